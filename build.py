@@ -1,7 +1,8 @@
 #!/usr/bin/env python3
 """
 Build script for talkie tools using CMake.
-Builds the project in the build/ directory and copies level9 binary to talkie/data/l9.
+Builds the project in the build/ directory and copies level9 binary to talkie/data/l9,
+the magnetic binary and the interpreters' shared libraries to talkie/data.
 """
 
 import shutil
@@ -75,6 +76,14 @@ def main():
     shutil.copy2(magnetic_binary, target_path)
     target_path.chmod(0o755)
 
+    # The shared libraries, for talkie.explore
+    for library in (build_dir / "level9").glob("liblevel9.*"):
+        print(f"Copying {library} to {target_dir}")
+        shutil.copy2(library, target_dir)
+    for library in (build_dir / "Magnetic" / "lib").glob("libmagnetic.*"):
+        print(f"Copying {library} to {target_dir}")
+        shutil.copy2(library, target_dir)
+
 
 if __name__ == "__main__":
     main()
@@ -89,6 +89,12 @@ class AIPlayer:
                 self.image_file = result.image
                 self.output.append(ImageOutput(self.image_file))
 
+            # A known location is a better image key than any paragraph
+            if self.image_gen and result.room is not None:
+                first_image_file = self.image_gen.get_image(self._room_key(result.room))
+                if first_image_file:
+                    self.output.append(ImageOutput(first_image_file))
+
             # Process paragraphs for TTS or image lookup
             sections = self.desc.split("\n\n")
             for text in sections:
@@ -140,15 +146,22 @@ class AIPlayer:
                 self.output.append(PromptOutput(text))
                 self.write_command(text + "\n")
 
+    @staticmethod
+    def _room_key(room: int) -> str:
+        return f"room {room}"
+
     def handle_slash_command(self, cmd: str) -> bool:
         """Handle slash commands and return image path if applicable"""
         para: str | None = None
-        paragraphs = self.desc.split("\n\n")
-        while len(paragraphs) > 0 and len(paragraphs[0]) < 60:
-            logging.debug("Removing short paragraph from image description")
-            _ = paragraphs.pop(0)
-        if len(paragraphs) > 0:
-            para = paragraphs[0]
+        if self.player.room is not None:
+            para = self._room_key(self.player.room)
+        else:
+            paragraphs = self.desc.split("\n\n")
+            while len(paragraphs) > 0 and len(paragraphs[0]) < 60:
+                logging.debug("Removing short paragraph from image description")
+                _ = paragraphs.pop(0)
+            if len(paragraphs) > 0:
+                para = paragraphs[0]
         if cmd == "image":
             if para and self.image_gen:
                 logging.info(f"Generate image with key '{para}'")
@@ -173,6 +186,16 @@ class AIPlayer:
     def key_mode(self) -> bool:
         return self.player.key_mode
 
+    def speculate_command(self, text: str) -> bool:
+        """
+        Run a partial voice transcript ahead of the final one, which then
+        shows its output at once if it says the same, see IFPlayer.speculate().
+        Commands that AdventureGuy rewrites are not guessed at.
+        """
+        if self.smart_parse and self.adventure_guy:
+            return False
+        return self.player.speculate(text)
+
     def write_command(self, text: str):
         """Write command to game"""
         self.image_file = None
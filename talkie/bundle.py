@@ -0,0 +1,122 @@
+"""
+Game bundles: a game's story, graphics and other files in one uncompressed
+file, so the interpreters start it with one open and one map. The layout is
+described in tools/bundle/bundle.h, which is what the interpreters read.
+
+    python -m talkie.bundle out.tkb games/the_pawn.mag [graphics]
+"""
+
+import argparse
+import json
+import re
+import struct
+from pathlib import Path
+from typing import Final
+
+MAGIC: Final = b"TKB1"
+ALIGN: Final = 4096
+HEADER: Final = struct.Struct("<4sIII")
+ENTRY: Final = struct.Struct("<II56s")
+
+
+def _align(n: int) -> int:
+    return (n + ALIGN - 1) // ALIGN * ALIGN
+
+
+def write_bundle(path: Path, entries: dict[str, bytes]) -> None:
+    """Write `entries` (name -> data) as a bundle, each entry page aligned."""
+    offset = _align(HEADER.size + ENTRY.size * len(entries))
+    toc = bytearray(HEADER.pack(MAGIC, len(entries), ALIGN, 0))
+    for name, data in entries.items():
+        encoded = name.encode()
+        if len(encoded) >= 56:
+            raise ValueError(f"Bundle entry name too long: {name}")
+        toc += ENTRY.pack(offset, len(data), encoded)
+        offset = _align(offset + len(data))
+    with path.open("wb") as f:
+        f.write(toc)
+        for data in entries.values():
+            f.seek(_align(f.tell()))
+            f.write(data)
+        f.truncate(offset)
+
+
+def read_toc(path: Path) -> dict[str, tuple[int, int]]:
+    """The entries of a bundle as name -> (offset, length)."""
+    with path.open("rb") as f:
+        magic, count, _, _ = HEADER.unpack(f.read(HEADER.size))
+        if magic != MAGIC:
+            raise ValueError(f"{path} is not a bundle")
+        toc: dict[str, tuple[int, int]] = {}
+        for _ in range(count):
+            offset, length, name = ENTRY.unpack(f.read(ENTRY.size))
+            toc[name.rstrip(b"\0").decode()] = (offset, length)
+    return toc
+
+
+def read_entry(path: Path, name: str) -> bytes | None:
+    """The data of one bundle entry, or None if there is no such entry."""
+    entry = read_toc(path).get(name)
+    if entry is None:
+        return None
+    with path.open("rb") as f:
+        f.seek(entry[0])
+        return f.read(entry[1])
+
+
+def is_bundle(path: Path) -> bool:
+    with path.open("rb") as f:
+        return f.read(len(MAGIC)) == MAGIC
+
+
+def read_meta(path: Path) -> dict[str, str]:
+    meta = read_entry(path, "meta")
+    return json.loads(meta) if meta else {}
+
+
+def game_entries(story: Path, gfx: Path | None = None) -> dict[str, bytes]:
+    """
+    The bundle entries for a game: "story", and depending on the format
+    "graphics", "hints", "sound" and "pics/<name>" for a Level 9 bitmap
+    directory.
+    """
+    entries: dict[str, bytes] = {}
+    if re.search(r"\.(mag|MAG)$", story.name):
+        fmt = "magnetic"
+        gfx = gfx or story.with_suffix(".gfx")
+        hints = story.with_suffix(".hnt")
+        if hints.is_file():
+            entries["hints"] = hints.read_bytes()
+        sound = story.with_suffix(".snd")
+        if sound.is_file():
+            entries["sound"] = sound.read_bytes()
+    elif re.search(r"\.(l9|v\d)$", story.name):
+        fmt = "level9"
+        if gfx and gfx.is_dir():
+            for pic in sorted(gfx.iterdir()):
+                if pic.is_file():
+                    entries["pics/" + pic.name] = pic.read_bytes()
+            gfx = None
+    elif re.search(r"\.z(ode|[123456789])$", story.name):
+        fmt = "zcode"
+    else:
+        raise ValueError(f"Unknown game format: {story}")
+    entries["story"] = story.read_bytes()
+    if gfx and gfx.is_file():
+        entries["graphics"] = gfx.read_bytes()
+    meta = {"format": fmt, "name": story.name}
+    entries["meta"] = json.dumps(meta).encode()
+    return entries
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Pack a game into a bundle")
+    parser.add_argument("bundle", type=Path)
+    parser.add_argument("story", type=Path)
+    parser.add_argument("graphics", type=Path, nargs="?")
+    args = parser.parse_args()
+    write_bundle(args.bundle, game_entries(args.story, args.graphics))
+
+
+if __name__ == "__main__":
+    main()
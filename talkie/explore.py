@@ -0,0 +1,336 @@
+"""
+Explore a game offline: try candidate commands in every state the game can
+reach, breadth first, so that pictures and speech can be made for each room
+ahead of time. The Level 9 and Magnetic interpreters run in-process through
+their shared libraries (tools/level9/l9lib.h, tools/Magnetic/Talkie/maglib.h),
+in one worker process per core. States are told apart by a hash of the game's
+RAM, without the bytes that change every turn.
+
+    python -m talkie.explore games/the_pawn.mag --commands words.txt -o pawn.json
+"""
+
+import argparse
+import ctypes
+import hashlib
+import json
+import os
+import re
+from concurrent.futures import ProcessPoolExecutor
+from dataclasses import asdict, dataclass
+from importlib import resources
+from pathlib import Path
+from typing import Final
+
+from .bundle import read_meta
+
+DIRECTIONS: Final = ("n", "ne", "e", "se", "s", "sw", "w", "nw", "u", "d", "in", "out")
+# Commands that should change nothing but counters, see find_noise()
+NOISE_COMMANDS: Final = ("look", "score", "inventory", "l")
+# MS_SLICE_* and L9_SLICE_* agree on these
+SLICE_INPUT: Final = 3
+SLICE_STOPPED: Final = 4
+SLICE_BUDGET: Final = 100000
+# Slices a command may take before the game is taken to hang
+MAX_SLICES: Final = 2000
+L9STATESIZE: Final = 64 + 2 * (512 + 0x800 + 2 * 1024) + 16
+
+
+def _load(name: str) -> ctypes.CDLL:
+    data = resources.files("talkie.data")
+    for suffix in (".so", ".dylib", ".dll"):
+        path = Path(str(data / (name + suffix)))
+        if path.is_file():
+            return ctypes.CDLL(str(path))
+    raise FileNotFoundError(f"{name} not found in talkie/data, run build.py")
+
+
+class Engine:
+    """A Level 9 or Magnetic game running in its interpreter's shared library."""
+
+    def __init__(self, story: Path, seed: int = 1):
+        fmt = read_meta(story).get("format") if story.suffix == ".tkb" else None
+        if fmt == "magnetic" or re.search(r"\.(mag|MAG)$", story.name):
+            self.magnetic = True
+        elif fmt == "level9" or re.search(r"\.(l9|v\d)$", story.name):
+            self.magnetic = False
+        else:
+            raise ValueError(f"Not a Level 9 or Magnetic game: {story}")
+        self.story: Final = story
+        self.seed: Final = seed
+        self.lib: Final = _load("libmagnetic" if self.magnetic else "liblevel9")
+        lib = self.lib
+        if self.magnetic:
+            for f in (lib.mag_open, lib.mag_run, lib.ms_state_restore):
+                f.restype = ctypes.c_uint8
+            lib.mag_output.restype = ctypes.c_uint32
+            lib.mag_output.argtypes = [ctypes.c_char_p, ctypes.c_uint32]
+            lib.ms_state_size.restype = ctypes.c_uint32
+            lib.ms_state_save.restype = ctypes.c_uint32
+            lib.ms_state_save.argtypes = [ctypes.c_char_p, ctypes.c_uint32]
+            lib.ms_state_restore.argtypes = [ctypes.c_char_p, ctypes.c_uint32]
+            lib.ms_ram.restype = ctypes.c_void_p
+            lib.ms_room.restype = ctypes.c_int32
+        else:
+            lib.L9SaveState.argtypes = [ctypes.c_char_p, ctypes.c_int]
+            lib.L9RestoreState.argtypes = [ctypes.c_char_p, ctypes.c_int]
+            lib.GetWorkspace.restype = ctypes.c_void_p
+        self.buffer: Final = ctypes.create_string_buffer(65536)
+        self.stopped = False
+        self.intro: Final = self._open()
+
+    def _open(self) -> str:
+        name = str(self.story).encode()
+        if self.magnetic:
+            ok = self.lib.mag_open(name, None, None)
+            self.lib.ms_seed(self.seed)
+        else:
+            ok = self.lib.l9_open(name, None)
+            self.lib.SetRandomSeed(self.seed)
+        if not ok:
+            raise RuntimeError(f"Could not load {self.story}")
+        self.stopped = False
+        return self._run()
+
+    def _run(self) -> str:
+        """Run until the game waits for input, returns what it printed."""
+        run = self.lib.mag_run if self.magnetic else self.lib.l9_run
+        output = self.lib.mag_output if self.magnetic else self.lib.l9_output
+        text = b""
+        for _ in range(MAX_SLICES):
+            status = run(SLICE_BUDGET)
+            while n := output(self.buffer, len(self.buffer)):
+                text += self.buffer.raw[:n]
+            if status == SLICE_STOPPED:
+                self.stopped = True
+            if status in (SLICE_INPUT, SLICE_STOPPED):
+                break
+        else:
+            self.stopped = True
+        return text.decode("latin-1")
+
+    def command(self, text: str) -> str:
+        if self.stopped:
+            return ""
+        (self.lib.mag_input if self.magnetic else self.lib.l9_input)(text.encode())
+        return self._run()
+
+    def save(self) -> bytes:
+        if self.magnetic:
+            size = self.lib.ms_state_size()
+            buf = ctypes.create_string_buffer(size)
+            n = self.lib.ms_state_save(buf, size)
+        else:
+            buf = ctypes.create_string_buffer(L9STATESIZE)
+            n = self.lib.L9SaveState(buf, L9STATESIZE)
+        return buf.raw[:n]
+
+    def restore(self, state: bytes) -> None:
+        # A stopped Level 9 game does not run again after a restore
+        if self.stopped:
+            _ = self._open()
+        if self.magnetic:
+            ok = self.lib.ms_state_restore(state, len(state))
+        else:
+            ok = self.lib.L9RestoreState(state, len(state))
+        if not ok:
+            raise RuntimeError("Could not restore a state")
+
+    def ram(self) -> bytes:
+        if self.magnetic:
+            size = ctypes.c_uint32()
+            p = self.lib.ms_ram(ctypes.byref(size))
+        else:
+            size = ctypes.c_int()
+            p = self.lib.GetWorkspace(ctypes.byref(size))
+        return ctypes.string_at(p, size.value) if p else b""
+
+    def room(self) -> int | None:
+        room = self.lib.ms_room() if self.magnetic else self.lib.GetRoom()
+        return room if room >= 0 else None
+
+
+def ram_key(ram: bytes, noise: frozenset[int]) -> bytes:
+    """A hash of the game's RAM, leaving out the `noise` bytes."""
+    if noise:
+        masked = bytearray(ram)
+        for i in noise:
+            masked[i] = 0
+        ram = bytes(masked)
+    return hashlib.blake2b(ram, digest_size=16).digest()
+
+
+def find_noise(
+    engine: Engine, commands: tuple[str, ...] = NOISE_COMMANDS
+) -> frozenset[int]:
+    """
+    The bytes of RAM that change when nothing happens, such as the move
+    counter and the input buffer: what differs after each of `commands`.
+    The game is left as it was.
+    """
+    start = engine.save()
+    first = engine.ram()
+    rams: list[bytes] = []
+    for cmd in commands:
+        _ = engine.command(cmd)
+        rams.append(engine.ram())
+    engine.restore(start)
+    return frozenset(
+        i for i in range(len(first)) if any(r[i] != first[i] for r in rams)
+    )
+
+
+@dataclass
+class State:
+    id: int
+    parent: int | None
+    command: str | None
+    depth: int
+    room: int | None
+    text: str
+    ended: bool = False
+
+
+def transcript(states: list[State], state: State) -> list[str]:
+    """The commands that lead from the start to `state`."""
+    commands: list[str] = []
+    while state.parent is not None:
+        commands.append(state.command or "")
+        state = states[state.parent]
+    return commands[::-1]
+
+
+_engine: Engine | None = None
+_noise: frozenset[int] = frozenset()
+
+
+def _start_worker(story: Path, seed: int, noise: frozenset[int]) -> None:
+    global _engine, _noise
+    _engine = Engine(story, seed)
+    _noise = noise
+
+
+def _step(job: tuple[bytes, str]) -> tuple[bytes, str, int | None, bytes, bool]:
+    """Run one command from a state, in a worker."""
+    assert _engine
+    state, cmd = job
+    _engine.restore(state)
+    text = _engine.command(cmd)
+    key = ram_key(_engine.ram(), _noise)
+    return _engine.save(), text, _engine.room(), key, _engine.stopped
+
+
+def explore(
+    story: Path,
+    commands: list[str],
+    depth: int,
+    max_states: int = 10000,
+    jobs: int | None = None,
+    seed: int = 1,
+    per_room: int | None = None,
+) -> dict[str, object]:
+    """
+    Try `commands` in every new state up to `depth` commands from the start,
+    or in the first `per_room` states found in each room. Returns the graph,
+    each state with its parent, the command that led to it and what the game
+    said, and for each room the first state found in it.
+    """
+    engine = Engine(story, seed)
+    noise = find_noise(engine)
+    states = [State(0, None, None, 0, engine.room(), engine.intro)]
+    saved = {0: engine.save()}
+    seen = {ram_key(engine.ram(), noise)}
+    frontier = [0]
+    expanded: dict[int, int] = {}
+    with ProcessPoolExecutor(
+        jobs or os.cpu_count(), initializer=_start_worker, initargs=(story, seed, noise)
+    ) as pool:
+        for level in range(1, depth + 1):
+            work = [(s, cmd) for s in frontier for cmd in commands]
+            steps = [(saved[s], cmd) for s, cmd in work]
+            results = pool.map(_step, steps, chunksize=16)
+            frontier = []
+            for (parent, cmd), (state, text, room, key, ended) in zip(work, results):
+                if key in seen or len(states) >= max_states:
+                    continue
+                seen.add(key)
+                node = State(len(states), parent, cmd, level, room, text, ended)
+                states.append(node)
+                if ended:
+                    continue
+                if per_room and room is not None:
+                    if expanded.get(room, 0) >= per_room:
+                        continue
+                    expanded[room] = expanded.get(room, 0) + 1
+                saved[node.id] = state
+                frontier.append(node.id)
+            saved = {s: saved[s] for s in frontier}
+            if not frontier or len(states) >= max_states:
+                break
+
+    rooms: dict[str, dict[str, object]] = {}
+    for state in states:
+        if state.room is not None and str(state.room) not in rooms:
+            rooms[str(state.room)] = {
+                "state": state.id,
+                "transcript": transcript(states, state),
+                "text": state.text,
+            }
+    return {
+        "game": story.name,
+        "noise": len(noise),
+        "states": [asdict(s) for s in states],
+        "rooms": rooms,
+    }
+
+
+def read_commands(path: Path) -> list[str]:
+    """One command per line, e.g. from --vocab. Only the text up to a tab counts."""
+    commands: list[str] = []
+    for line in path.read_text().splitlines():
+        cmd = line.split("\t")[0].strip()
+        if cmd and cmd not in commands:
+            commands.append(cmd)
+    return commands
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Explore a game's reachable states")
+    parser.add_argument("story", type=Path)
+    parser.add_argument(
+        "--commands", type=Path, help="candidate commands, one per line"
+    )
+    parser.add_argument(
+        "--depth", type=int, default=6, help="most commands from the start"
+    )
+    parser.add_argument("--max-states", type=int, default=10000)
+    parser.add_argument(
+        "--jobs", type=int, help="worker processes (default: one per core)"
+    )
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument(
+        "--per-room", type=int, help="go on from only the first n states of each room"
+    )
+    parser.add_argument(
+        "-o", "--output", type=Path, help="graph file (default: stdout)"
+    )
+    args = parser.parse_args()
+
+    commands = read_commands(args.commands) if args.commands else list(DIRECTIONS)
+    graph = explore(
+        args.story,
+        commands,
+        args.depth,
+        args.max_states,
+        args.jobs,
+        args.seed,
+        args.per_room,
+    )
+    text = json.dumps(graph, indent=1)
+    if args.output:
+        _ = args.output.write_text(text)
+    else:
+        print(text)
+
+
+if __name__ == "__main__":
+    main()
@@ -2,58 +2,324 @@ import contextlib
 import queue
 import re
 import subprocess
+import tempfile
 import threading
 import time
-from dataclasses import dataclass
+from dataclasses import dataclass, field
 from importlib import resources
 from io import BufferedReader
 from logging import getLogger
 from pathlib import Path
 from typing import Final
 
+from talkie.bundle import read_entry, read_meta
 from talkie.image_drawer import ImageDrawer
 
-from .text_utils import parse_adventure_description, trim_lines, unwrap_text
+from .text_utils import (
+    parse_adventure_description,
+    parse_status,
+    status_from_title,
+    trim_lines,
+    unwrap_text,
+)
+from .tts_chunk import strip_message_tags, tagged_messages
 
 logger = getLogger(__name__)
 
+# Sent by the l9 and magnetic front ends when they wait for a line / a key
+TURN_MARKERS: Final = ("#[prompt]", "#[ready]")
+BINARY_CHUNK: Final = re.compile(rb"#\[(imgbin|gfxbin|frame|state|midibin|animbin|rgba|rgbaframe)((?: \d+)*) (\d+)\]\n")
+# Replies of the l9 and magnetic front ends to ##save#, ##restore#,
+# ##speculate#, ##commit# and ##discard#
+STATE_REPLIES: Final = (
+    "saved",
+    "restored",
+    "savefailed",
+    "restorefailed",
+    "speculate",
+    "speculatefailed",
+    "committed",
+    "commitfailed",
+    "discarded",
+    "discardfailed",
+)
+
+
+# Interpreters preload() started, by their arguments, waiting for a player
+_warm: dict[tuple[str, ...], list[subprocess.Popen[bytes]]] = {}
+_warm_lock: Final = threading.Lock()
+
+
+def interpreter_args(
+    file_name: Path,
+    gfx_path: Path | None = None,
+    message_ids: bool = False,
+    stats: bool = False,
+    rgba: bool = False,
+    paragraphs: bool = False,
+    turn_budget: int = 0,
+    rooms: bool = False,
+) -> list[str]:
+    """The command line that plays `file_name`, see IFPlayer."""
+    data = resources.files("talkie.data")
+    bundle_format = None
+    if file_name.suffix == ".tkb":
+        bundle_format = read_meta(file_name).get("format")
+    if bundle_format == "zcode":
+        # dfrotz only reads plain story files, IFPlayer unpacks the story
+        args = ["dfrotz", "-m", "-w", "1000", file_name.as_posix()]
+    elif bundle_format == "level9":
+        # The bundle holds the bitmaps, the interpreter finds them itself
+        args = [str(data / "l9"), file_name.as_posix(), "-r"]
+    elif bundle_format == "magnetic":
+        args = [str(data / "magnetic"), file_name.as_posix()]
+    elif re.search(r"\.z(ode|[123456789])$", file_name.name):
+        args = ["dfrotz", "-m", "-w", "1000", file_name.as_posix()]
+    elif re.search(r"\.l9$", file_name.name):
+        if gfx_path:
+            gfx_str = gfx_path.as_posix()
+            if gfx_path.is_dir():
+                gfx_str += "/"
+            args = [str(data / "l9"), file_name.as_posix(), gfx_str, "-r"]
+        else:
+            args = [str(data / "l9"), file_name.as_posix(), "-r"]
+    elif re.search(r"\.(mag|MAG)", file_name.name):
+        args = [str(data / "magnetic"), file_name.as_posix()]
+        # Pictures come as #[imgbin] chunks if the .gfx file is given
+        gfx = gfx_path or file_name.with_suffix(".gfx")
+        if gfx.is_file():
+            args.append(gfx.as_posix())
+    else:
+        raise RuntimeError("Unknown format")
+    if args[0] != "dfrotz":
+        if message_ids:
+            args[1:1] = ["--msg-ids"]
+        if stats:
+            args[1:1] = ["--stats"]
+        if rgba:
+            args[1:1] = ["--rgba"]
+        if paragraphs:
+            args[1:1] = ["--paragraphs"]
+        if turn_budget:
+            args[1:1] = ["--turn-budget", str(turn_budget)]
+        if rooms:
+            args[1:1] = ["--rooms"]
+    return args
+
+
+def preload(
+    file_name: Path,
+    gfx_path: Path | None = None,
+    count: int = 1,
+    message_ids: bool = False,
+    stats: bool = False,
+    rgba: bool = False,
+    paragraphs: bool = False,
+    turn_budget: int = 0,
+    rooms: bool = False,
+) -> int:
+    """
+    Start `count` l9 or magnetic interpreters with --preload: they load the
+    game and wait, and an IFPlayer made for it with the same arguments and
+    no replay takes one instead of starting its own, so the game starts at
+    once. Returns how many were started, 0 for games dfrotz plays.
+    """
+    args = interpreter_args(
+        file_name, gfx_path, message_ids, stats, rgba, paragraphs, turn_budget, rooms
+    )
+    if args[0] == "dfrotz":
+        return 0
+    procs = [
+        subprocess.Popen(
+            [args[0], "--preload", *args[1:]],
+            stdin=subprocess.PIPE,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+        )
+        for _ in range(count)
+    ]
+    with _warm_lock:
+        _warm.setdefault(tuple(args), []).extend(procs)
+    return count
+
+
+def _take_warm(args: list[str]) -> subprocess.Popen[bytes] | None:
+    """A preloaded interpreter for `args` that is still waiting, if any."""
+    with _warm_lock:
+        procs = _warm.get(tuple(args), [])
+        while procs:
+            proc = procs.pop(0)
+            if proc.poll() is None:
+                return proc
+    return None
+
+
+def turn_end(text: str) -> int:
+    """Where the first turn in `text` ends, after its marker line, or -1."""
+    found = [i for i in (text.find(m) for m in TURN_MARKERS) if i >= 0]
+    if not found:
+        return -1
+    end = text.find("\n", min(found))
+    return len(text) if end < 0 else end + 1
+
+
+def split_binary_chunks(
+    data: bytes,
+) -> tuple[bytes, list[tuple[str, list[int], bytes]], bytes]:
+    """
+    Cut binary chunks (`#[imgbin <no> <length>]`, `#[gfxbin <length>]`,
+    `#[frame <length>]`, `#[state <length>]`,
+    `#[midibin <no> <tempo> <length>]`, `#[animbin <no> <length>]`,
+    `#[rgba <no> <width> <height> <length>]`,
+    `#[rgbaframe <width> <height> <length>]`) out of interpreter output.
+    Returns the remaining text, the (tag, arguments, payload) triplets found
+    and any incomplete tail that has to wait for more data.
+    """
+    text = b""
+    chunks: list[tuple[str, list[int], bytes]] = []
+    while True:
+        m = BINARY_CHUNK.search(data)
+        if not m:
+            # Hold back what could be the start of a chunk header
+            start = data.rfind(b"#[")
+            if start >= 0 and b"\n" not in data[start:] and len(data) - start < 32:
+                return text + data[:start], chunks, data[start:]
+            return text + data, chunks, b""
+        length = int(m.group(3))
+        payload = data[m.end() : m.end() + length]
+        if len(payload) < length:
+            return text + data[: m.start()], chunks, data[m.start() :]
+        text += data[: m.start()]
+        args = [int(x) for x in m.group(2).split()]
+        chunks.append((m.group(1).decode(), args, payload))
+        data = data[m.end() + length :]
+
 
 @dataclass
 class IFOutput:
     text: str
     all_text: str
     image: Path | None
+    # The player's location as the interpreter numbers it, if rooms was
+    # asked for and it knows
+    room: int | None = None
+    # The status bar as room, score and moves, the ones the game has
+    status: dict[str, str | int] = field(default_factory=dict)
+    # (message id, text) of the game messages, if message_ids was asked for
+    messages: list[tuple[int, str]] = field(default_factory=list)
+    # What the turn took in the interpreter, if stats was asked for:
+    # instructions, vm_us, text, pictures and picture_us
+    stats: dict[str, str | int] = field(default_factory=dict)
+    # (MIDI file, tempo) of the tune the turn started on magnetic, (b"", 0)
+    # if it stopped the music
+    music: tuple[bytes, int] | None = None
+    # "budget" if the turn ran past turn_budget and was undone
+    error: str | None = None
 
 
 class IFPlayer:
     def __init__(
-        self, image_drawer: ImageDrawer, file_name: Path, gfx_path: Path | None = None
+        self,
+        image_drawer: ImageDrawer,
+        file_name: Path,
+        gfx_path: Path | None = None,
+        replay: list[str] | None = None,
+        seed: int | None = None,
+        message_ids: bool = False,
+        stats: bool = False,
+        rgba: bool = False,
+        paragraphs: bool = False,
+        turn_budget: int = 0,
+        rooms: bool = False,
     ):
         """
-        Start an interactive fiction game in a subprocess
+        Start an interactive fiction game in a subprocess. `replay` commands
+        are played first, as fast as the interpreter runs and without output
+        on l9 and magnetic; with the same `seed` they play out as they did.
+        With `message_ids` l9 and magnetic tag the game's messages, see
+        IFOutput.messages, with `stats` they tell what each turn took, see
+        IFOutput.stats. With `rgba` they send pictures with the colours
+        looked up, for ImageDrawer to save as they are. With `paragraphs`
+        they mark the end of each paragraph with #[p] and the text is split
+        there, instead of unwrapped and split on empty lines. With a
+        `turn_budget` they undo a turn that runs more instructions than that,
+        e.g. stuck in a loop, and ask for the input again, see IFOutput.error.
+        With `rooms` they tell where the player is, see IFOutput.room.
         """
 
-        data = resources.files("talkie.data")
         self.image_drawer = image_drawer
         self.key_mode: bool = False
-
-        if re.search(r"\.z(ode|[123456789])$", file_name.name):
-            args = ["dfrotz", "-m", "-w", "1000", file_name.as_posix()]
-        elif re.search(r"\.l9$", file_name.name):
-            if gfx_path:
-                gfx_str = gfx_path.as_posix()
-                if gfx_path.is_dir():
-                    gfx_str += "/"
-                args = [str(data / "l9"), file_name.as_posix(), gfx_str]
-            else:
-                args = [str(data / "l9"), file_name.as_posix()]
-        elif re.search(r"\.(mag|MAG)", file_name.name):
-            args = [str(data / "magnetic"), file_name.as_posix()]
+        self.temp_story: Path | None = None
+        self.temp_replay: Path | None = None
+        # The last checkpoint sent by save_state() and the last reply to it
+        # or restore_state()
+        self.last_state: bytes | None = None
+        self.state_reply: str | None = None
+        # From the last #[room <n>] line of l9 and magnetic, for games whose
+        # location variable they know
+        self.room: int | None = None
+        # From the last #[status] line, or dfrotz's status bar
+        self.status: dict[str, str | int] = {}
+        # From the #[stats] line of the turn
+        self.stats: dict[str, str | int] = {}
+        # From the #[error <what>] line of the turn
+        self.error: str | None = None
+        # The tunes magnetic sent as #[midibin] chunks, by number, and the
+        # one the turn started or stopped
+        self.tunes: dict[int, tuple[bytes, int]] = {}
+        self.music: tuple[bytes, int] | None = None
+        # The command speculate() runs ahead, and its output so far, held
+        # until write() settles it. "hold" or "drop" while that output is
+        # still coming.
+        self.speculation: str | None = None
+        self.speculated: list[tuple[str, list[tuple[str, list[int], bytes]]]] = []
+        self.spec_mode: str | None = None
+
+        if file_name.suffix == ".tkb" and read_meta(file_name).get("format") == "zcode":
+            # dfrotz only reads plain story files
+            story = read_entry(file_name, "story") or b""
+            with tempfile.NamedTemporaryFile(suffix=".z5", delete=False) as f:
+                f.write(story)
+            self.temp_story = file_name = Path(f.name)
+
+        args = interpreter_args(
+            file_name,
+            gfx_path,
+            message_ids,
+            stats,
+            rgba,
+            paragraphs,
+            turn_budget,
+            rooms,
+        )
+        # dfrotz has no ##speculate# and no #[p]
+        self.can_speculate: bool = args[0] != "dfrotz"
+        self.paragraphs: bool = paragraphs and args[0] != "dfrotz"
+
+        proc = None
+        if args[0] == "dfrotz":
+            if seed is not None:
+                args[1:1] = ["-s", str(seed)]
         else:
-            raise RuntimeError("Unknown format")
+            # A preloaded interpreter has the game loaded already, a replay
+            # needs one of its own
+            if not replay:
+                proc = _take_warm(args)
+            if seed is not None:
+                args[1:1] = ["--seed", str(seed)]
+            if replay:
+                with tempfile.NamedTemporaryFile("w", suffix=".rec", delete=False) as f:
+                    f.write("".join(cmd + "\n" for cmd in replay))
+                self.temp_replay = Path(f.name)
+                args[1:1] = ["--fast-forward", f.name]
+                replay = None
         print(args)
 
-        self.proc: Final = subprocess.Popen(
+        if proc and proc.stdin:
+            start = b"#[start]\n" if seed is None else b"#[start seed=%d]\n" % seed
+            _ = proc.stdin.write(start)
+            proc.stdin.flush()
+        self.proc: Final = proc or subprocess.Popen(
             args,
             stdin=subprocess.PIPE,
             stdout=subprocess.PIPE,
@@ -64,7 +330,10 @@ class IFPlayer:
         self.last_write = time.time()
         self.transcript: list[tuple[str, str]] = []
         self.text_output: str = ""
+        self.pending: bytes = b""
+        self.found_gfx: bool = False
         self.last_result: float = 0
+        self.ready: bool = False
 
         # TODO: Handle stderr, and handle split command in stdout
         def _read_output(fout: BufferedReader):
@@ -82,6 +351,10 @@ class IFPlayer:
 
         self._closed: bool = False
 
+        # dfrotz has no fast forward, its commands go in like the player's
+        for cmd in replay or []:
+            self.input_queue.put((cmd + "\n").encode())
+
     def read(self) -> IFOutput | None:
         """
         Read stdout from running interpreter. Returns a dict containing
@@ -89,32 +362,84 @@ class IFPlayer:
             status bar from frotz etc).
         """
         try:
-            raw_text = self.output_queue.get_nowait()
+            raw_text = self.pending + self.output_queue.get_nowait()
+            raw_text, chunks, self.pending = split_binary_chunks(raw_text)
             result = raw_text.decode()
-            self.text_output += result
+            if self.spec_mode:
+                # The turn of a speculation is held back, or dropped if it
+                # has been discarded already
+                end = turn_end(result)
+                spec, result = (result, "") if end < 0 else (result[:end], result[end:])
+                if "#[speculatefailed]" in spec:
+                    self.speculation = None
+                    self.spec_mode = "drop"
+                if self.spec_mode == "hold":
+                    self.speculated.append((spec, chunks))
+                if end >= 0:
+                    self.spec_mode = None
+                    self.ready = True
+                chunks = []
+            self._take(result, chunks)
             self.last_result = time.time()
         except queue.Empty:
             pass
         return self._handle_output()
 
+    def _take(self, text: str, chunks: list[tuple[str, list[int], bytes]]) -> None:
+        for tag, args, payload in chunks:
+            if tag == "imgbin":
+                self.image_drawer.add_binary_bitmap(args[0], payload)
+            elif tag == "rgba":
+                self.image_drawer.add_rgba_bitmap(*args, payload)
+            elif tag == "rgbaframe":
+                if self.image_drawer.add_rgba_frame(*args, payload):
+                    self.found_gfx = True
+            elif tag == "state":
+                self.last_state = payload
+            elif tag == "midibin":
+                self.tunes[args[0]] = (payload, args[1])
+            elif tag == "animbin":
+                if self.image_drawer.add_binary_regions(args[0], payload):
+                    self.found_gfx = True
+            elif tag == "frame":
+                if self.image_drawer.add_binary_frame(payload):
+                    self.found_gfx = True
+            elif self.image_drawer.add_binary_commands(payload):
+                self.found_gfx = True
+        if any(m in text for m in TURN_MARKERS):
+            self.ready = True
+        self.text_output += text
+
     def _handle_output(self) -> IFOutput | None:
 
-        # We add delays between input so we have time to get ouput first.
-        # TODO: Investigate better way to accomplish that is using time
-        if not self.input_queue.empty() and time.time() - self.last_write > 0.4:
+        # Input waits until the interpreter says it is ready for it, or for
+        # 0.4s so the output from the last input has time to arrive first.
+        if not self.input_queue.empty() and (
+            self.ready or time.time() - self.last_write > 0.4
+        ):
                 data = self.input_queue.get_nowait()
                 self.last_write = time.time()
+                self.ready = False
                 if self.proc.stdin:
                     _ = self.proc.stdin.write(data)
                     self.proc.stdin.flush()
 
-        if not self.text_output or time.time() - self.last_result < 0.2:
+        # Front ends that mark the end of a turn don't need to wait for the
+        # output to go quiet
+        if not self.text_output or (
+            not any(m in self.text_output for m in TURN_MARKERS)
+            and time.time() - self.last_result < 0.2
+        ):
             return None
 
         # We have a full set of text
         meta = re.compile(r"#\[(.*?)\]\n?")
-        text = trim_lines(self.text_output)
-        found_gfx = False
+        messages = tagged_messages(self.text_output)
+        text = strip_message_tags(self.text_output)
+        if not self.paragraphs:
+            text = trim_lines(text)
+        found_gfx = self.found_gfx
+        self.found_gfx = False
         for line in text.splitlines():
             for m in re.finditer(meta, line):
                 match = m.group(1)
@@ -122,13 +447,40 @@ class IFPlayer:
                     self.key_mode = True
                 elif match == "linemode":
                     self.key_mode = False
+                elif match in ("prompt", "ready", "loaded", "p"):
+                    continue
+                elif match.split()[0] in STATE_REPLIES:
+                    self.state_reply = match
+                    continue
+                elif match.startswith("room "):
+                    self.room = int(match.split()[1])
+                    continue
+                elif match.startswith("status"):
+                    self.status = parse_status(match)
+                    continue
+                elif match.startswith("music "):
+                    no = match.split()[1]
+                    self.music = self.tunes.get(int(no)) if no.isdigit() else (b"", 0)
+                    continue
+                elif match.startswith("stats "):
+                    self.stats = parse_status(match)
+                    logger.debug(f"Turn stats: {self.stats}")
+                    continue
+                elif match.startswith("error "):
+                    self.error = match.split()[1]
+                    logger.warning(f"Turn undone: {self.error}")
+                    continue
                 if self.image_drawer.add_text_command(match):
                     found_gfx = True
 
-        text = meta.sub("", text)
-
-        text = unwrap_text(text)
-        ps = text.split("\n\n")
+        if self.paragraphs:
+            # The interpreter has trimmed and joined the lines already
+            ps = [meta.sub("", p).strip() for p in text.split("#[p]\n")]
+            ps = [p for p in ps if p]
+        else:
+            text = meta.sub("", text)
+            text = unwrap_text(text)
+            ps = text.split("\n\n")
         if len(ps) > 2:
             first = ps[0].strip()
             for px in ps[1:]:
@@ -136,13 +488,28 @@ class IFPlayer:
                     logger.debug(f"Dropping first line '{first}'")
                     _ = ps.pop(0)
                     break
-            text = "\n\n".join(ps)
+        text = "\n\n".join(ps)
         fields = parse_adventure_description(text)
         logger.debug(f"Parsed: '{text}' into:\n{fields}")
         self.transcript.append((":", str(fields["text"])))
         fields["full_text"] = self.text_output
+        if fields["title"] and (status := status_from_title(fields["title"])):
+            self.status = status
         image = self.image_drawer.get_image() if found_gfx else None
-        output = IFOutput(fields["text"], self.text_output, image)
+        output = IFOutput(
+            fields["text"],
+            self.text_output,
+            image,
+            self.room,
+            dict(self.status),
+            messages,
+            self.stats,
+            self.music,
+            self.error,
+        )
+        self.stats = {}
+        self.music = None
+        self.error = None
         self.text_output = ""
         return output
 
@@ -150,11 +517,71 @@ class IFPlayer:
         return self.image_drawer.get_image()
 
     def write(self, text: str):
-        """Write text line to stdin of running interpreter."""
-        self.input_queue.put(text.encode())
+        """
+        Write text line to stdin of running interpreter. If it is the command
+        speculate() ran, its output is handed over without running it again.
+        """
         print(f"IN:'{text}'")
         logger.info(f"IN: '{text}'")
         self.transcript.append((">", text))
+        if self.speculation is not None:
+            if self._settle(text.strip() == self.speculation):
+                return
+        self.input_queue.put(text.encode())
+
+    def speculate(self, command: str) -> bool:
+        """
+        Run `command` ahead on l9 and magnetic, e.g. from a partial voice
+        transcript, while the game is waiting for input. Its output is held
+        until write() gets the same command and dropped, with the game going
+        back to where it was, if it gets another. A new guess replaces the
+        last one. Returns False if the command could not be started.
+        """
+        command = command.strip()
+        if not self.can_speculate or not command:
+            return False
+        if command == self.speculation:
+            return True
+        if self.speculation is not None:
+            self._settle(False)
+        if not self.ready or not self.input_queue.empty() or not self.proc.stdin:
+            return False
+        self.last_write = time.time()
+        self.ready = False
+        _ = self.proc.stdin.write(b"##speculate#" + command.encode() + b"\n")
+        self.proc.stdin.flush()
+        self.speculation = command
+        self.spec_mode = "hold"
+        return True
+
+    def _settle(self, keep: bool) -> bool:
+        """Commit or discard the speculation, True if it was committed."""
+        self.input_queue.put(b"##commit#\n" if keep else b"##discard#\n")
+        held, self.speculated = self.speculated, []
+        self.speculation = None
+        if keep:
+            for text, chunks in held:
+                self._take(text, chunks)
+            if self.spec_mode == "hold":
+                self.spec_mode = None
+        elif self.spec_mode == "hold":
+            self.spec_mode = "drop"
+        return keep
+
+    def save_state(self, path: Path | None = None) -> None:
+        """
+        Checkpoint the game (l9 and magnetic only) to `path`, or into
+        `last_state` once the reply has been read. Cheap enough for every turn.
+        """
+        name = path.as_posix().encode() if path else b""
+        self.input_queue.put(b"##save#" + name + b"\n")
+
+    def restore_state(self, state: bytes | Path) -> None:
+        """Continue from a checkpoint made by save_state()."""
+        if isinstance(state, Path):
+            self.input_queue.put(b"##restore#" + state.as_posix().encode() + b"\n")
+        else:
+            self.input_queue.put(b"##restore#\n#[state %d]\n" % len(state) + state)
 
     def get_transcript(self) -> str:
         """Get the transcript of the game so far."""
@@ -199,6 +626,10 @@ class IFPlayer:
                 )
             except Exception as e:
                 logger.error(f"Error terminating subprocess: {e}")
+        if self.temp_story:
+            self.temp_story.unlink(missing_ok=True)
+        if self.temp_replay:
+            self.temp_replay.unlink(missing_ok=True)
 
     def close(self):
         """Explicitly close the IFPlayer and cleanup resources."""
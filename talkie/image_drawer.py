@@ -1,3 +1,5 @@
+import array
+import struct
 from dataclasses import dataclass, field
 from logging import getLogger
 from pathlib import Path
@@ -10,7 +12,16 @@ from .draw import PixelCanvas
 logger = getLogger(__name__)
 
 Command = Literal[
-    "line", "fill", "clear", "setcolor", "img", "pal", "pixels", "imgsize", "bitmap"
+    "line",
+    "fill",
+    "clear",
+    "setcolor",
+    "img",
+    "pal",
+    "pixels",
+    "imgsize",
+    "bitmap",
+    "bin",
 ]
 
 
@@ -20,6 +31,8 @@ class Bitmap:
     height: int = 0
     palette: list[int] = field(default_factory=list[int])
     pixels: bytes = field(default_factory=bytes)
+    # Sent as an `#[rgba]` chunk, the pixels with their colours looked up
+    rgba: bytes = field(default_factory=bytes)
 
 
 class ImageDrawer:
@@ -39,6 +52,129 @@ class ImageDrawer:
         ]
         self.palette: list[int] = [0] * 64
         self.bitmaps: list[Bitmap] = []
+        # The bitmap the last #[bitmap] command showed
+        self.shown: int | None = None
+        # What get_image() shows if the picture came as RGBA pixels: width,
+        # height and the pixels
+        self.rgba: tuple[int, int, bytes] | None = None
+
+    def add_binary_bitmap(self, no: int, data: bytes):
+        """
+        Add a bitmap sent as an `#[imgbin]` chunk: 16 bit LE width and height,
+        palette size, RGB palette, packing (0 raw, 1 run length) and pixels.
+        """
+        width = data[0] | data[1] << 8
+        height = data[2] | data[3] << 8
+        npal = data[4]
+        palette = [
+            data[i] << 16 | data[i + 1] << 8 | data[i + 2]
+            for i in range(5, 5 + npal * 3, 3)
+        ]
+        pos = 5 + npal * 3
+        packing, pixels = data[pos], data[pos + 1 :]
+        if packing == 1:
+            pixels = b"".join(
+                bytes((pixels[i + 1],)) * pixels[i] for i in range(0, len(pixels), 2)
+            )
+        print(f"IMGBIN {no}")
+        while len(self.bitmaps) <= no:
+            self.bitmaps.append(Bitmap())
+        self.bitmaps[no] = Bitmap(width, height, palette, bytes(pixels))
+
+    def add_rgba_bitmap(self, no: int, width: int, height: int, data: bytes):
+        """
+        Add a bitmap sent as an `#[rgba <no> <width> <height> <length>]`
+        chunk, red, green, blue and alpha bytes for each pixel.
+        """
+        print(f"RGBA {no}")
+        while len(self.bitmaps) <= no:
+            self.bitmaps.append(Bitmap())
+        self.bitmaps[no] = Bitmap(width, height, rgba=data)
+
+    def add_rgba_frame(self, width: int, height: int, data: bytes) -> bool:
+        """
+        Show an `#[rgbaframe <width> <height> <length>]` chunk, a whole
+        picture as red, green, blue and alpha bytes for each pixel.
+        """
+        self.rgba = (width, height, data)
+        return True
+
+    def add_binary_regions(self, no: int, data: bytes) -> bool:
+        """
+        Draw an `#[animbin]` chunk, the regions of bitmap `no` that changed in
+        a step of its animation: a 16 bit LE count, then for each region 16
+        bit LE x, y, width and height and (count, index) run length pairs.
+        Returns True if it changed the picture that is showing.
+        """
+        if no != self.shown:
+            return False
+        self.rgba = None
+        count = data[0] | data[1] << 8
+        pos = 2
+        for _ in range(count):
+            x, y, w, h = struct.unpack_from("<4H", data, pos)
+            pos += 8
+            pixels = bytearray()
+            while len(pixels) < w * h:
+                pixels += bytes((data[pos + 1],)) * data[pos]
+                pos += 2
+            for row in range(h):
+                start = (y + row) * self.pcanvas.width + x
+                self.pcanvas.array[start : start + w] = array.array(
+                    "B", pixels[row * w : (row + 1) * w]
+                )
+        return count > 0
+
+    def add_binary_commands(self, data: bytes) -> bool:
+        """
+        Replay a `#[gfxbin]` chunk, the drawing commands of one picture. Each
+        is an opcode byte followed by signed 16 bit LE arguments.
+        Returns True if anything was drawn.
+        """
+        nargs = {"X": 0, "C": 2, "L": 6, "F": 4}
+        self.rgba = None
+        drawn = False
+        pos = 0
+        while pos < len(data):
+            op = chr(data[pos])
+            n = nargs.get(op)
+            if n is None:
+                logger.warning(f"Bad gfx opcode {data[pos]}")
+                return drawn
+            args = list(struct.unpack_from(f"<{n}h", data, pos + 1))
+            pos += 1 + 2 * n
+            match op:
+                case "X":
+                    self.pcanvas.clear(0)
+                case "C":
+                    self.palette[args[0]] = (self.colors[args[1]] << 8) | 0xFF
+                    continue
+                case "L":
+                    self.pcanvas.draw_line(*args)
+                case _:
+                    self.pcanvas.flood_fill(*args)
+            drawn = True
+        return drawn
+
+    def add_binary_frame(self, data: bytes) -> bool:
+        """
+        Show a `#[frame]` chunk, a line drawn picture already rendered by the
+        interpreter: 16 bit LE width and height, the 8 colour index of each of
+        the 4 logical colours, packing (0 raw, 1 run length) and pixels.
+        """
+        width = data[0] | data[1] << 8
+        height = data[2] | data[3] << 8
+        self.rgba = None
+        for i in range(4):
+            self.palette[i] = (self.colors[data[4 + i]] << 8) | 0xFF
+        packing, pixels = data[8], data[9:]
+        if packing == 1:
+            pixels = b"".join(
+                bytes((pixels[i + 1],)) * pixels[i] for i in range(0, len(pixels), 2)
+            )
+        self.pcanvas = PixelCanvas(width, height)
+        self.pcanvas.set_pixels(pixels)
+        return True
 
     def add_text_command(self, s: str) -> bool:
         parts = s.split()
@@ -61,6 +197,8 @@ class ImageDrawer:
                 print(f"PIXELS {no}")
                 self.bitmaps[no].pixels = bytes(args[1:])
                 return False
+            case "bin":
+                return False
             case "imgsize":
                 self.pcanvas = PixelCanvas(*args)
                 return False
@@ -78,17 +216,29 @@ class ImageDrawer:
                 if no >= len(self.bitmaps):
                     return False
                 print(f"BITMAP {no}")
+                self.shown = no
                 # x, y = args[1], args[2]
                 bmp = self.bitmaps[no]
                 self.pcanvas = PixelCanvas(bmp.width, bmp.height)
+                if bmp.rgba:
+                    self.rgba = (bmp.width, bmp.height, bmp.rgba)
+                    return True
                 self.pcanvas.set_pixels(bmp.pixels)
                 self.palette = [(c << 8) | 0xFF for c in self.bitmaps[no].palette]
             case _:
                 logger.warning(f"Unhandled cmd '{s}'")
                 return False
+        self.rgba = None
         return True
 
     def get_image(self) -> Path:
+        png_path = Path("game.png")
+        if self.rgba:
+            # The interpreter has looked the colours up already
+            w, h, data = self.rgba
+            Image.frombytes("RGBA", (w, h), data).save(png_path)
+            return png_path
+
         # Create image directly from canvas array and palette
         w, h = self.pcanvas.width, self.pcanvas.height
         game_image = Image.new("RGBA", (w, h))
@@ -100,6 +250,5 @@ class ImageDrawer:
             rgba_data.append((p >> 24 & 0xFF, p >> 16 & 0xFF, p >> 8 & 0xFF, p & 0xFF))
 
         game_image.putdata(rgba_data)  # pyright: ignore[reportUnknownMemberType]
-        png_path = Path("game.png")
         game_image.save(png_path)
         return png_path
@@ -96,8 +96,9 @@ def main():
         )
     else:
         container[AdventureGuy] = lambda _: None  # type: ignore[assignment]
+    # AIPlayer keys its pictures by room
     container[IFPlayer] = lambda c: IFPlayer(
-        c[ImageDrawer], c[TalkieConfig].game_file, c[TalkieConfig].gfx_path
+        c[ImageDrawer], c[TalkieConfig].game_file, c[TalkieConfig].gfx_path, rooms=True
     )
     bind(container, FileCache, img_cache).setup(ImageGen)
     voice = args.voice
@@ -55,6 +55,29 @@ def parse_adventure_description(text: str) -> dict[str, str]:
     )
 
 
+STATUS_FIELD = re.compile(r'(\w+)=(?:"([^"]*)"|(-?\d+))')
+FROTZ_STATUS = re.compile(r"^\s*(.*?)\s{5,}Score:\s*(-?\d+)\s+Moves:\s*(\d+)\s*$")
+
+
+def parse_status(meta: str) -> dict[str, str | int]:
+    """
+    The fields of a `status room="..." score=N moves=N` meta line, numbers as
+    ints. Fields the game doesn't have are left out.
+    """
+    return {
+        m.group(1): m.group(2) if m.group(3) is None else int(m.group(3))
+        for m in STATUS_FIELD.finditer(meta)
+    }
+
+
+def status_from_title(title: str) -> dict[str, str | int]:
+    """The same fields from a frotz status bar, {} if it isn't one."""
+    m = FROTZ_STATUS.match(title)
+    if not m:
+        return {}
+    return {"room": m.group(1), "score": int(m.group(2)), "moves": int(m.group(3))}
+
+
 def unwrap_text(text: str, colum: int = 200) -> str:
     """
     Try to unwrap wrapped text. Assumes any line that is longer than 'column' and does not end in punctuation should be joined with the next line.
@@ -137,4 +137,39 @@ def split_for_tts(text: str, *, max_chars: int = 3000) -> list[str]:
     return out
 
 
-__all__ = ["split_for_tts"]
+# The l9 and magnetic front ends can tag each game message they print
+_MESSAGE: Final[re.Pattern[str]] = re.compile(
+    r"#\[msg (\d+)\](.*?)#\[/msg\]", re.DOTALL
+)
+_MESSAGE_TAG: Final[re.Pattern[str]] = re.compile(r"#\[/?msg(?: \d+)?\]")
+
+
+def tagged_messages(text: str) -> list[tuple[int, str]]:
+    """The (message id, text) of each `#[msg id]...#[/msg]` in `text`.
+
+    The same id always has the same text, so its audio can be cached by id.
+    Messages with nothing to say are left out.
+    """
+    return [
+        (int(m.group(1)), m.group(2).strip())
+        for m in _MESSAGE.finditer(text)
+        if m.group(2).strip()
+    ]
+
+
+def strip_message_tags(text: str) -> str:
+    """`text` without the message tags, as the game printed it."""
+    return _MESSAGE_TAG.sub("", text)
+
+
+def message_cache_key(game: str, msg_id: int) -> str:
+    """The audio cache key of a tagged message."""
+    return f"{game}#msg{msg_id}"
+
+
+__all__ = [
+    "message_cache_key",
+    "split_for_tts",
+    "strip_message_tags",
+    "tagged_messages",
+]
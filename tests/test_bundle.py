@@ -0,0 +1,60 @@
+import json
+from pathlib import Path
+
+from talkie.bundle import (
+    ALIGN,
+    game_entries,
+    is_bundle,
+    read_entry,
+    read_meta,
+    read_toc,
+    write_bundle,
+)
+
+
+def test_bundle_round_trip(tmp_path: Path):
+    path = tmp_path / "game.tkb"
+    entries = {"story": b"s" * 5000, "meta": b"{}", "empty": b"", "pics/2": b"\x01\x02"}
+    write_bundle(path, entries)
+
+    assert is_bundle(path)
+    toc = read_toc(path)
+    assert list(toc) == list(entries)
+    for name, data in entries.items():
+        offset, length = toc[name]
+        assert offset % ALIGN == 0
+        assert length == len(data)
+        assert read_entry(path, name) == data
+    assert read_entry(path, "missing") is None
+    assert path.stat().st_size % ALIGN == 0
+
+
+def test_game_entries_level9_pictures(tmp_path: Path):
+    story = tmp_path / "game.l9"
+    story.write_bytes(b"L9" * 200)
+    pics = tmp_path / "pics"
+    pics.mkdir()
+    (pics / "1").write_bytes(b"one")
+    (pics / "title").write_bytes(b"title")
+
+    entries = game_entries(story, pics)
+
+    assert entries["story"] == story.read_bytes()
+    assert entries["pics/1"] == b"one"
+    assert entries["pics/title"] == b"title"
+    assert "graphics" not in entries
+    assert json.loads(entries["meta"])["format"] == "level9"
+
+
+def test_game_entries_magnetic(tmp_path: Path):
+    story = tmp_path / "game.mag"
+    story.write_bytes(b"MaSc")
+    story.with_suffix(".gfx").write_bytes(b"MaPi")
+    story.with_suffix(".snd").write_bytes(b"MaSd")
+
+    path = tmp_path / "game.tkb"
+    write_bundle(path, game_entries(story))
+
+    assert read_entry(path, "graphics") == b"MaPi"
+    assert read_entry(path, "sound") == b"MaSd"
+    assert read_meta(path) == {"format": "magnetic", "name": "game.mag"}
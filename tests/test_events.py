@@ -0,0 +1,75 @@
+import ctypes
+
+import pytest
+
+from talkie.explore import _load
+
+EV_TEXT = 1
+EV_PROMPT = 4
+
+
+class Event(ctypes.Structure):
+    _fields_ = [
+        ("type", ctypes.c_int),
+        ("arg", ctypes.c_long),
+        ("data", ctypes.c_void_p),
+        ("len", ctypes.c_ulong),
+    ]
+
+
+@pytest.fixture
+def lib():
+    """The event ring as linked into liblevel9 (tools/events/events.h)."""
+    try:
+        lib = _load("liblevel9")
+    except FileNotFoundError as e:
+        pytest.skip(str(e))
+    lib.ev_ring_new.restype = ctypes.c_void_p
+    lib.ev_ring_new.argtypes = [ctypes.c_ulong]
+    lib.ev_ring_free.argtypes = [ctypes.c_void_p]
+    lib.ev_put.argtypes = [
+        ctypes.c_void_p,
+        ctypes.c_int,
+        ctypes.c_long,
+        ctypes.c_char_p,
+        ctypes.c_ulong,
+    ]
+    lib.ev_peek.argtypes = [ctypes.c_void_p, ctypes.POINTER(Event)]
+    lib.ev_pop.argtypes = [ctypes.c_void_p]
+    return lib
+
+
+def take(lib, ring) -> tuple[int, int, bytes] | None:
+    ev = Event()
+    if not lib.ev_peek(ring, ctypes.byref(ev)):
+        return None
+    event = (ev.type, ev.arg, ctypes.string_at(ev.data, ev.len))
+    lib.ev_pop(ring)
+    return event
+
+
+def test_events_in_order(lib):
+    ring = lib.ev_ring_new(0)
+    assert lib.ev_put(ring, EV_TEXT, 0, b"hello", 5) == 0
+    assert lib.ev_put(ring, EV_PROMPT, 0, None, 0) == 0
+    assert take(lib, ring) == (EV_TEXT, 0, b"hello")
+    assert take(lib, ring) == (EV_PROMPT, 0, b"")
+    assert take(lib, ring) is None
+    lib.ev_ring_free(ring)
+
+
+def test_event_wraps_the_end(lib):
+    ring = lib.ev_ring_new(4096)
+    first = b"a" * 4000
+    assert lib.ev_put(ring, EV_TEXT, 1, first, len(first)) == 0
+    # Only the rest of the buffer is free, too little for the record and its pad
+    second = b"b" * 200
+    assert lib.ev_put(ring, EV_TEXT, 2, second, len(second)) == -1
+    assert take(lib, ring) == (EV_TEXT, 1, first)
+    # Now it goes in at the start, after a pad to the end
+    assert lib.ev_put(ring, EV_TEXT, 2, second, len(second)) == 0
+    assert lib.ev_put(ring, EV_TEXT, 3, b"c", 1) == 0
+    assert take(lib, ring) == (EV_TEXT, 2, second)
+    assert take(lib, ring) == (EV_TEXT, 3, b"c")
+    assert take(lib, ring) is None
+    lib.ev_ring_free(ring)
@@ -0,0 +1,56 @@
+from pathlib import Path
+
+from talkie.explore import State, find_noise, ram_key, read_commands, transcript
+
+
+class FakeEngine:
+    """RAM of a counter at 0 and a room at 1, "n" moves north."""
+
+    def __init__(self):
+        self.memory = bytearray(4)
+
+    def save(self) -> bytes:
+        return bytes(self.memory)
+
+    def restore(self, state: bytes) -> None:
+        self.memory = bytearray(state)
+
+    def ram(self) -> bytes:
+        return bytes(self.memory)
+
+    def command(self, text: str) -> str:
+        self.memory[0] += 1
+        if text == "n":
+            self.memory[1] += 1
+        return text
+
+
+def test_find_noise_is_the_counter():
+    engine = FakeEngine()
+    engine.memory[2] = 7
+    noise = find_noise(engine)  # pyright: ignore[reportArgumentType]
+    assert noise == frozenset({0})
+    assert engine.ram() == bytes([0, 0, 7, 0])
+
+
+def test_ram_key_leaves_out_noise():
+    noise = frozenset({0})
+    assert ram_key(bytes([1, 2]), noise) == ram_key(bytes([9, 2]), noise)
+    assert ram_key(bytes([1, 2]), noise) != ram_key(bytes([1, 3]), noise)
+    assert ram_key(bytes([1, 2]), frozenset()) != ram_key(bytes([9, 2]), frozenset())
+
+
+def test_transcript():
+    states = [
+        State(0, None, None, 0, 1, "intro"),
+        State(1, 0, "n", 1, 2, "north"),
+        State(2, 1, "take lamp", 2, 2, "taken"),
+    ]
+    assert transcript(states, states[2]) == ["n", "take lamp"]
+    assert transcript(states, states[0]) == []
+
+
+def test_read_commands(tmp_path: Path):
+    path = tmp_path / "words.txt"
+    _ = path.write_text("n\nlamp\tnoun\n\nn\ntake lamp\t\n")
+    assert read_commands(path) == ["n", "lamp", "take lamp"]
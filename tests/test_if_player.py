@@ -1,9 +1,14 @@
+import queue
+import struct
 import time
 from pathlib import Path
 from unittest.mock import Mock
 
 import pytest
-from talkie.if_player import IFPlayer
+from PIL import Image
+from talkie.bundle import game_entries, write_bundle
+from talkie.draw import PixelCanvas
+from talkie.if_player import IFPlayer, preload, split_binary_chunks
 from talkie.image_drawer import ImageDrawer
 
 
@@ -62,3 +67,452 @@ def test_zork_basic_gameplay():
         assert "mailbox" in transcript.lower(), (
             f"'mailbox' not found in transcript: {transcript}"
         )
+
+
+def test_binary_picture_chunks():
+    """Binary #[imgbin] chunks are cut out of the text and decoded."""
+    raw = bytes([2, 0, 2, 0, 1, 0x10, 0x20, 0x30, 0]) + bytes([0, 0, 0, 0])
+    rle = bytes([2, 0, 2, 0, 1, 0xFF, 0xFF, 0xFF, 1, 3, 0, 1, 1])
+    data = (
+        b"Hello\n#[imgbin 1 "
+        + str(len(raw)).encode()
+        + b"]\n"
+        + raw
+        + b"#[imgbin 2 "
+        + str(len(rle)).encode()
+        + b"]\n"
+        + rle
+        + b"World #[img"
+    )
+    text, chunks, rest = split_binary_chunks(data)
+    assert text == b"Hello\nWorld "
+    assert rest == b"#[img"
+    assert [(tag, args) for tag, args, _ in chunks] == [("imgbin", [1]), ("imgbin", [2])]
+
+    # An incomplete chunk is held back until the rest arrives
+    text, partial, rest = split_binary_chunks(data[:20])
+    assert text == b"Hello\n" and not partial and rest == data[6:20]
+
+    drawer = ImageDrawer()
+    for _, args, payload in chunks:
+        drawer.add_binary_bitmap(args[0], payload)
+    assert drawer.bitmaps[1].palette == [0x102030]
+    assert drawer.bitmaps[1].pixels == bytes(4)
+    assert (drawer.bitmaps[2].width, drawer.bitmaps[2].height) == (2, 2)
+    assert drawer.bitmaps[2].pixels == bytes([0, 0, 0, 1])
+
+
+def test_binary_animation_regions():
+    """#[animbin] regions are drawn over the bitmap that is showing."""
+    drawer = ImageDrawer()
+    drawer.add_binary_bitmap(0, bytes([3, 0, 2, 0, 1, 0, 0, 0, 0]) + bytes(6))
+    regions = bytes([1, 0]) + struct.pack("<4H", 1, 0, 2, 2) + bytes([3, 5, 1, 6])
+    data = b"#[animbin 0 " + str(len(regions)).encode() + b"]\n" + regions
+    _, chunks, _ = split_binary_chunks(data)
+    assert chunks == [("animbin", [0], regions)]
+
+    assert not drawer.add_binary_regions(0, regions)
+    assert drawer.add_text_command("bitmap 0 0 0")
+    assert drawer.add_binary_regions(0, regions)
+    assert list(drawer.pcanvas.array) == [0, 5, 5, 0, 5, 6]
+    assert not drawer.add_binary_regions(1, regions)
+    assert not drawer.add_binary_regions(0, bytes([0, 0]))
+
+
+def test_rgba_chunks(tmp_path: Path, monkeypatch: pytest.MonkeyPatch):
+    """#[rgba] bitmaps and #[rgbaframe] pictures are saved as they came."""
+    pixels = bytes([255, 0, 0, 255, 0, 0, 255, 255])
+    data = b"#[rgba 0 2 1 8]\n" + pixels + b"#[rgbaframe 1 2 8]\n" + pixels[::-1]
+    text, chunks, rest = split_binary_chunks(data)
+    assert text == b"" and rest == b""
+    assert chunks == [("rgba", [0, 2, 1], pixels), ("rgbaframe", [1, 2], pixels[::-1])]
+
+    monkeypatch.chdir(tmp_path)
+    drawer = ImageDrawer()
+    drawer.add_rgba_bitmap(0, 2, 1, pixels)
+    assert drawer.add_text_command("bitmap 0 0 0")
+    with Image.open(drawer.get_image()) as image:
+        assert image.size == (2, 1)
+        assert image.tobytes() == pixels
+    assert drawer.add_rgba_frame(1, 2, pixels[::-1])
+    with Image.open(drawer.get_image()) as image:
+        assert image.size == (1, 2)
+    assert drawer.add_text_command("clear")
+    assert drawer.rgba is None
+
+
+def test_binary_music_chunks():
+    """A #[midibin] chunk carries a tune's number, tempo and MIDI file."""
+    midi = b"MThd\x00\x00\x00\x06#[music 0]\n"
+    data = b"#[midibin 3 120 " + str(len(midi)).encode() + b"]\n" + midi + b"#[music 3]\n"
+    text, chunks, rest = split_binary_chunks(data)
+    assert text == b"#[music 3]\n" and rest == b""
+    assert chunks == [("midibin", [3, 120], midi)]
+
+
+def test_binary_drawing_commands():
+    """A #[gfxbin] chunk replays the vector commands of one picture."""
+    cmds = (
+        b"X"
+        + b"C"
+        + struct.pack("<2h", 1, 2)
+        + b"L"
+        + struct.pack("<6h", 0, 0, 3, 0, 1, 0)
+    )
+    data = b"#[gfxbin " + str(len(cmds)).encode() + b"]\n" + cmds + b"#[bitmap 1]\n"
+    text, chunks, rest = split_binary_chunks(data)
+    assert text == b"#[bitmap 1]\n" and not rest
+    assert chunks == [("gfxbin", [], cmds)]
+
+    drawer = ImageDrawer()
+    drawer.pcanvas = PixelCanvas(4, 2)
+    assert drawer.add_binary_commands(cmds)
+    assert list(drawer.pcanvas.array) == [1, 1, 1, 1, 0, 0, 0, 0]
+    assert drawer.palette[1] == (0x30E830 << 8) | 0xFF
+
+
+def test_binary_frame():
+    """A #[frame] chunk replaces the canvas with the rendered picture."""
+    frame = bytes([3, 0, 1, 0, 0, 7, 2, 3, 1, 2, 1, 1, 0])
+    drawer = ImageDrawer()
+    assert drawer.add_binary_frame(frame)
+    assert (drawer.pcanvas.width, drawer.pcanvas.height) == (3, 1)
+    assert list(drawer.pcanvas.array) == [1, 1, 0]
+    assert drawer.palette[1] == (0xFFFFFF << 8) | 0xFF
+
+
+def test_magnetic_gets_graphics_file(tmp_path: Path, monkeypatch: pytest.MonkeyPatch):
+    """A .gfx file next to a .mag game is passed to the interpreter."""
+    game = tmp_path / "pawn.mag"
+    game.write_bytes(b"")
+    started: list[list[str]] = []
+    proc = Mock()
+    proc.stdout.read1.return_value = b""  # the reader thread stops at once
+    popen = Mock(side_effect=lambda args, **_: started.append(args) or proc)
+    monkeypatch.setattr("talkie.if_player.subprocess.Popen", popen)
+
+    _ = IFPlayer(Mock(spec_set=ImageDrawer), game)
+    (tmp_path / "pawn.gfx").write_bytes(b"")
+    _ = IFPlayer(Mock(spec_set=ImageDrawer), game)
+    assert started[0][1:] == [game.as_posix()]
+    assert started[1][1:] == [game.as_posix(), (tmp_path / "pawn.gfx").as_posix()]
+
+
+def test_bundle_picks_interpreter(tmp_path: Path, monkeypatch: pytest.MonkeyPatch):
+    """A bundle is passed as it is to its interpreter, z-code is unpacked."""
+    started: list[list[str]] = []
+    proc = Mock()
+    proc.stdout.read1.return_value = b""  # the reader thread stops at once
+    popen = Mock(side_effect=lambda args, **_: started.append(args) or proc)
+    monkeypatch.setattr("talkie.if_player.subprocess.Popen", popen)
+
+    for name in ("pawn.mag", "snowball.l9", "zork.z3"):
+        story = tmp_path / name
+        story.write_bytes(name.encode())
+        write_bundle(story.with_suffix(".tkb"), game_entries(story))
+
+    _ = IFPlayer(Mock(spec_set=ImageDrawer), tmp_path / "pawn.tkb")
+    _ = IFPlayer(Mock(spec_set=ImageDrawer), tmp_path / "snowball.tkb")
+    player = IFPlayer(Mock(spec_set=ImageDrawer), tmp_path / "zork.tkb")
+    assert started[0][0].endswith("magnetic")
+    assert started[0][1:] == [(tmp_path / "pawn.tkb").as_posix()]
+    assert started[1][0].endswith("l9")
+    assert started[1][1:] == [(tmp_path / "snowball.tkb").as_posix(), "-r"]
+    assert started[2][0] == "dfrotz"
+    assert Path(started[2][-1]).read_bytes() == b"zork.z3"
+    player.close()
+    assert not Path(started[2][-1]).exists()
+
+
+def _bare_player(text: str) -> IFPlayer:
+    """An IFPlayer that has received `text` just now, without a subprocess."""
+    player = IFPlayer.__new__(IFPlayer)
+    player.image_drawer = Mock(spec_set=ImageDrawer)
+    player.key_mode = False
+    player.input_queue = queue.Queue()
+    player.output_queue = queue.Queue()
+    player.pending = b""
+    player.last_write = time.time()
+    player.transcript = []
+    player.text_output = text
+    player.found_gfx = False
+    player.last_result = time.time()
+    player.ready = False
+    player.last_state = None
+    player.state_reply = None
+    player.room = None
+    player.status = {}
+    player.stats = {}
+    player.error = None
+    player.tunes = {}
+    player.music = None
+    player.can_speculate = True
+    player.speculation = None
+    player.speculated = []
+    player.spec_mode = None
+    player.paragraphs = False
+    return player
+
+
+def test_prompt_marker_ends_turn():
+    """Output ending in #[prompt] is handed over without waiting for quiet."""
+    assert _bare_player("You are in a dark room.\n").read() is None
+    output = _bare_player("You are in a dark room.\n>#[prompt]\n").read()
+    assert output is not None
+    assert "dark room" in output.text
+    assert "#[prompt]" not in output.text
+
+
+def test_ready_marker_releases_input():
+    """Input is written as soon as the interpreter reports it is waiting."""
+    player = _bare_player("")
+    player.proc = Mock()
+    player.output_queue.put(b"Press a key#[ready]\n")
+    player.input_queue.put(b"y")
+    output = player.read()
+    assert output is not None
+    assert "Press a key" in output.text
+    player.proc.stdin.write.assert_called_once_with(b"y")
+
+
+def test_state_chunk_and_replies():
+    """A #[state] chunk is kept for restore_state(), the reply is noted."""
+    player = _bare_player("")
+    player.proc = Mock()
+    player.output_queue.put(b"#[state 3]\n\x00\n#" + b"#[saved 3]\n#[prompt]\n")
+    output = player.read()
+    assert output is not None
+    assert player.last_state == b"\x00\n#"
+    assert player.state_reply == "saved 3"
+    assert "saved" not in output.text
+
+    player.restore_state(player.last_state)
+    player.restore_state(Path("/tmp/game.sav"))
+    assert player.input_queue.get_nowait() == b"##restore#\n#[state 3]\n\x00\n#"
+    assert player.input_queue.get_nowait() == b"##restore#/tmp/game.sav\n"
+
+
+def test_paragraph_markers_split_text():
+    """With paragraphs the text is split on #[p] and not unwrapped."""
+    player = _bare_player(
+        "On The Path\n#[p]\n#[room 1]\nYou are on a gravel path.\n#[p]\n"
+        "A dying forest.\n#[p]\n>#[prompt]\n"
+    )
+    player.paragraphs = True
+    output = player.read()
+    assert output is not None
+    assert "#[" not in output.text
+    assert "On The Path\n\nYou are on a gravel path.\n\nA dying forest." in output.text
+    assert player.room == 1
+
+
+def test_budget_error_goes_with_output():
+    """#[error budget] tells that the turn was undone, for that turn only."""
+    player = _bare_player("You are carrying nothing\n#[error budget]\n#[prompt]\n")
+    output = player.read()
+    assert output is not None
+    assert output.error == "budget"
+    assert "#[" not in output.text
+    player.image_drawer.add_text_command.assert_not_called()
+
+    player.text_output = "On The Path\n>#[prompt]\n"
+    output = player.read()
+    assert output is not None
+    assert output.error is None
+
+
+def test_room_line_sets_room():
+    """#[room] lines are kept, the last one goes with the output."""
+    player = _bare_player("On The Path\n>#[room 1]\n#[prompt]\n")
+    output = player.read()
+    assert output is not None
+    assert output.room == 1
+    assert "#[room" not in output.text
+    player.image_drawer.add_text_command.assert_not_called()
+
+    player.text_output = "Grassy Plain\n>#[room 14]\n#[prompt]\n"
+    output = player.read()
+    assert output is not None
+    assert output.room == player.room == 14
+
+
+def test_rooms_asks_for_room_lines(tmp_path: Path, monkeypatch: pytest.MonkeyPatch):
+    """l9 and magnetic only send #[room] lines with rooms."""
+    game = tmp_path / "pawn.mag"
+    game.write_bytes(b"")
+    started: list[list[str]] = []
+    proc = Mock()
+    proc.stdout.read1.return_value = b""  # the reader thread stops at once
+    popen = Mock(side_effect=lambda args, **_: started.append(args) or proc)
+    monkeypatch.setattr("talkie.if_player.subprocess.Popen", popen)
+
+    _ = IFPlayer(Mock(spec_set=ImageDrawer), game)
+    _ = IFPlayer(Mock(spec_set=ImageDrawer), game, rooms=True)
+    assert started[0][1:] == [game.as_posix()]
+    assert started[1][1:] == ["--rooms", game.as_posix()]
+
+
+def test_status_line():
+    """#[status] lines and frotz status bars give the same fields."""
+    player = _bare_player(
+        '#[status room="ON THE PATH" score=0 moves=3]\nOn The Path\n>#[prompt]\n'
+    )
+    output = player.read()
+    assert output is not None
+    assert output.status == {"room": "ON THE PATH", "score": 0, "moves": 3}
+    assert "status" not in output.text
+    player.image_drawer.add_text_command.assert_not_called()
+
+    player.text_output = " West of House      Score: 5     Moves: 12\n\nOpen field.\n>"
+    player.last_result = 0
+    output = player.read()
+    assert output is not None
+    assert output.status == {"room": "West of House", "score": 5, "moves": 12}
+
+
+def test_stats_line():
+    """A #[stats] line goes to IFOutput.stats of its turn only."""
+    player = _bare_player(
+        "Hi\n>#[stats instructions=2625 vm_us=6009 text=3 pictures=1 picture_us=5592]"
+        "\n#[prompt]\n"
+    )
+    output = player.read()
+    assert output is not None
+    assert output.stats == {
+        "instructions": 2625,
+        "vm_us": 6009,
+        "text": 3,
+        "pictures": 1,
+        "picture_us": 5592,
+    }
+    assert "stats" not in output.text
+    player.image_drawer.add_text_command.assert_not_called()
+
+    player.text_output = "Hi\n>#[prompt]\n"
+    output = player.read()
+    assert output is not None
+    assert output.stats == {}
+
+
+def test_music_lines():
+    """A tune sent once is started again by number, and stopped."""
+    midi = b"MThd\x00\x00\x00\x06"
+    player = _bare_player("")
+    player.output_queue.put(
+        b"#[midibin 0 90 " + str(len(midi)).encode() + b"]\n" + midi
+        + b"#[music 0]\nHi\n#[prompt]\n"
+    )
+    output = player.read()
+    assert output is not None
+    assert output.music == (midi, 90)
+    assert "music" not in output.text
+    player.image_drawer.add_text_command.assert_not_called()
+
+    player.text_output = "Hi\n#[music 0]\n#[prompt]\n"
+    assert (output := player.read()) is not None and output.music == (midi, 90)
+    player.text_output = "Hi\n#[music off]\n#[prompt]\n"
+    assert (output := player.read()) is not None and output.music == (b"", 0)
+    player.text_output = "Hi\n#[prompt]\n"
+    assert (output := player.read()) is not None and output.music is None
+
+
+def test_message_tags():
+    """Tagged messages are listed, the tags don't reach the text."""
+    player = _bare_player(
+        "#[msg 0]You are on a gravel path#[/msg]. #[msg 9]\n\n#[/msg]Hi\n>#[prompt]\n"
+    )
+    output = player.read()
+    assert output is not None
+    assert output.messages == [(0, "You are on a gravel path")]
+    assert "msg" not in output.text
+    assert "gravel path." in output.text
+
+
+def test_speculation_is_held_until_settled():
+    """A speculated turn waits for the same command, another one drops it."""
+    player = _bare_player("")
+    player.proc = Mock()
+    player.ready = True
+    assert player.speculate("north")
+    player.output_queue.put(b"#[speculate]\nRock Slide\n>#[prompt]\n")
+    assert player.read() is None
+
+    player.write("north\n")
+    output = player.read()
+    assert output is not None
+    assert "Rock Slide" in output.text
+    assert "speculate" not in output.text
+
+    player.ready = True
+    assert player.speculate("south")
+    player.output_queue.put(b"#[speculate]\nGrassy Mound\n>#[prompt]\n")
+    assert player.read() is None
+    player.write("look\n")
+    player.output_queue.put(b"#[discarded]\n#[prompt]\nPlain\n>#[prompt]\n")
+    output = player.read()
+    assert output is not None
+    assert "Mound" not in output.text
+    assert "Plain" in output.text
+    assert player.input_queue.get_nowait() == b"look\n"
+
+    writes = [c.args[0] for c in player.proc.stdin.write.call_args_list]
+    assert writes == [
+        b"##speculate#north\n",
+        b"##commit#\n",
+        b"##speculate#south\n",
+        b"##discard#\n",
+    ]
+
+
+def test_replay_fast_forwards(tmp_path: Path, monkeypatch: pytest.MonkeyPatch):
+    """Replayed commands go to l9 and magnetic as a file, to dfrotz as input."""
+    started: list[list[str]] = []
+    replays: list[str] = []
+    proc = Mock()
+    proc.stdout.read1.return_value = b""  # the reader thread stops at once
+
+    def popen(args: list[str], **_: object) -> Mock:
+        started.append(args)
+        if "--fast-forward" in args:
+            replays.append(Path(args[args.index("--fast-forward") + 1]).read_text())
+        return proc
+
+    monkeypatch.setattr("talkie.if_player.subprocess.Popen", popen)
+    for name in ("snowball.l9", "zork.z3"):
+        (tmp_path / name).write_bytes(b"")
+
+    player = IFPlayer(
+        Mock(spec_set=ImageDrawer), tmp_path / "snowball.l9", replay=["n", "look"], seed=9
+    )
+    assert started[0][1:5] == ["--fast-forward", started[0][2], "--seed", "9"]
+    assert replays == ["n\nlook\n"]
+    assert player.input_queue.empty()
+    player.close()
+    assert not Path(started[0][2]).exists()
+
+    player = IFPlayer(Mock(spec_set=ImageDrawer), tmp_path / "zork.z3", replay=["n"], seed=9)
+    assert started[1][:3] == ["dfrotz", "-s", "9"]
+    assert player.input_queue.get_nowait() == b"n\n"
+
+
+def test_preloaded_interpreter_is_taken(tmp_path: Path, monkeypatch: pytest.MonkeyPatch):
+    """An IFPlayer starts a preloaded interpreter, with its seed, if one waits."""
+    started: list[list[str]] = []
+    proc = Mock()
+    proc.poll.return_value = None  # still waiting
+    proc.stdout.read1.return_value = b""  # the reader thread stops at once
+    popen = Mock(side_effect=lambda args, **_: started.append(args) or proc)
+    monkeypatch.setattr("talkie.if_player.subprocess.Popen", popen)
+    for name in ("snowball.l9", "zork.z3"):
+        (tmp_path / name).write_bytes(b"")
+
+    assert preload(tmp_path / "zork.z3") == 0
+    assert preload(tmp_path / "snowball.l9") == 1
+    assert started[0][1:] == ["--preload", (tmp_path / "snowball.l9").as_posix(), "-r"]
+    player = IFPlayer(Mock(spec_set=ImageDrawer), tmp_path / "snowball.l9", seed=3)
+    assert player.proc is proc
+    proc.stdin.write.assert_called_once_with(b"#[start seed=3]\n")
+
+    # The pool is empty now, the next player starts an interpreter of its own
+    _ = IFPlayer(Mock(spec_set=ImageDrawer), tmp_path / "snowball.l9")
+    assert len(started) == 2 and "--preload" not in started[1]
@@ -1,6 +1,13 @@
 import unittest
 
-from talkie.text_utils import parse_adventure_description, parse_text, unwrap_text, partition_text
+from talkie.text_utils import (
+    parse_adventure_description,
+    parse_status,
+    parse_text,
+    partition_text,
+    status_from_title,
+    unwrap_text,
+)
 
 
 class TestTextUtils(unittest.TestCase):
@@ -144,6 +151,22 @@ Mrs. Robner leads you into the house and closes the door behind you.""",
         for chunk in result:
             self.assertLessEqual(len(chunk), 50)
 
+    def test_parse_status(self):
+        self.assertEqual(
+            parse_status('status room="GRASSY PLAIN" score=-5 moves=4'),
+            {"room": "GRASSY PLAIN", "score": -5, "moves": 4},
+        )
+        self.assertEqual(parse_status('status room="DARK"'), {"room": "DARK"})
+
+    def test_status_from_title(self):
+        self.assertEqual(
+            status_from_title("West of House      Score: 0        Moves: 1"),
+            {"room": "West of House", "score": 0, "moves": 1},
+        )
+        self.assertEqual(
+            status_from_title("DEADLINE     An Interactive Fiction by Marc Blank"), {}
+        )
+
 
 if __name__ == "__main__":
     unittest.main()
@@ -1,6 +1,11 @@
 import pytest
 
-from talkie.tts_chunk import split_for_tts
+from talkie.tts_chunk import (
+    message_cache_key,
+    split_for_tts,
+    strip_message_tags,
+    tagged_messages,
+)
 
 
 def assert_all_leq(chunks: list[str], max_chars: int) -> None:
@@ -67,3 +72,11 @@ def test_greedy_packing_under_limit() -> None:
     # Greedy packing: first chunk should contain more than one sentence if possible
     assert any(c.count(".") >= 2 for c in chunks)
 
+
+def test_tagged_messages() -> None:
+    text = (
+        "#[msg 24]You are #[/msg]on a #[msg 411]grassy\nplain#[/msg]#[msg 5]\n#[/msg]"
+    )
+    assert tagged_messages(text) == [(24, "You are"), (411, "grassy\nplain")]
+    assert strip_message_tags(text) == "You are on a grassy\nplain\n"
+    assert message_cache_key("red_moon.v9", 411) == "red_moon.v9#msg411"
@@ -4,6 +4,12 @@
     Extracter for Magnetic Scrolls pictures (Wonderland
     and the MS Collection Volume 1), Amiga versions.
     Written by David Kinder.
+
+    With -i the files are written indexed: "MaP3" instead of "MaP2", the
+    directory sorted by name (pictures of the same name in their old
+    order), so that it can be binary searched, and every picture starting
+    on a GFX_PAGE boundary, so that it can be mapped on its own. The
+    entries are laid out as in MaP2.
 */
 
 #include <ctype.h>
@@ -20,6 +26,8 @@ extern unsigned _stklen = 0x1000;
 
 #define BUFFER_SIZE 32UL*1024UL
 
+#define GFX_PAGE 4096UL
+
 #define MS_WONDERLAND 1
 #define MS_COLLECTION 2
 
@@ -38,6 +46,7 @@ struct GfxFile
 };
 
 int Game = 0;
+int Indexed = 0;
 struct GfxFile* GfxFiles = NULL;
 int GfxFileCount = 0;
 int GfxSubCount[3] = { 0, 0, 0 };
@@ -122,6 +131,28 @@ unsigned long ReadFile(unsigned char* buf, unsigned long* offset, unsigned long
 #endif
 }
 
+/* Sort by name, keeping pictures of the same name in their order */
+void SortResourceNames(void)
+{
+	struct GfxFile f;
+	int i, j;
+
+	for (i = 1; i < GfxFileCount; i++)
+	{
+		f = GfxFiles[i];
+		for (j = i; j > 0 && strncmp(GfxFiles[j-1].Name,f.Name,6) > 0; j--)
+			GfxFiles[j] = GfxFiles[j-1];
+		GfxFiles[j] = f;
+	}
+}
+
+unsigned long AlignOffset(unsigned long offset)
+{
+	if (!Indexed)
+		return offset;
+	return (offset + GFX_PAGE - 1) & ~(GFX_PAGE - 1);
+}
+
 unsigned long WriteFile(unsigned char* buf, unsigned long sz, int file)
 {
 #if defined(__MSDOS__) && defined(__BORLANDC__)
@@ -238,7 +269,7 @@ void WriteGfxHeader1(void)
 		if ((OutputFile[0] = fopen("wonder.gfx","wb")) == NULL)
 			Error("Cannot open output file");
 
-		WriteFile("MaP2",4,0);
+		WriteFile(Indexed ? "MaP3" : "MaP2",4,0);
 		OutOffset[0] += 4;
 
 		WriteFile(zeros,2,0);
@@ -259,7 +290,7 @@ void WriteGfxHeader1(void)
 
 		for (i = 0; i < 3; i++)
 		{
-			WriteFile("MaP2",4,i);
+			WriteFile(Indexed ? "MaP3" : "MaP2",4,i);
 			OutOffset[i] += 4;
 
 			WriteFile(zeros,2,i);
@@ -327,6 +358,11 @@ void WriteGfxFile(int Index)
 
 	if (game >= 0)
 	{
+		/* pad up to the page the picture starts on */
+		memset(Buffer1,0,GFX_PAGE);
+		offset = (unsigned long)ftell(OutputFile[game]);
+		WriteFile(Buffer1,AlignOffset(offset) - offset,game);
+
 		while (position < GfxFiles[Index].Length)
 		{
 			offset = GfxFiles[Index].Offset + position;
@@ -404,6 +440,7 @@ void WriteGfxHeader2(void)
 		{
 			memset(&out,0,sizeof(struct OutputGfxFile));
 			strcpy(out.Name,GfxFiles[i].Name);
+			OutOffset[game] = AlignOffset(OutOffset[game]);
 			WriteLong(out.Offset,OutOffset[game]);
 			WriteLong(out.Length,GfxFiles[i].Length);
 
@@ -419,10 +456,18 @@ void WriteGfxHeader2(void)
 
 int main(int argc, char** argv)
 {
+	if (argc == 3 && strcmp(argv[1],"-i") == 0)
+	{
+		Indexed = 1;
+		argv++;
+		argc--;
+	}
 	if (argc == 2)
 	{
 		OpenFile(argv[1]);
 		FindResourceNames();
+		if (Indexed)
+			SortResourceNames();
 		WriteGfxHeader1();
 		WriteGfxFiles();
 		WriteGfxHeader2();
@@ -435,12 +480,15 @@ int main(int argc, char** argv)
 		       "Extractor for the pictures in the Magnetic Windows versions of\n"
 		       "Magnetic Scrolls games (Wonderland and the MS Collection Volume 1),\n"
 		       "Amiga versions.\n\n"
-		       "Usage: GfxLink2 user.rsc\n\n"
+		       "Usage: GfxLink2 [-i] user.rsc\n\n"
 		       "\"user.rsc\" is taken from an Amiga Magnetic Scrolls installation\n"
 		       "in which the option to expand all the graphics files has been\n"
 		       "selected. For Wonderland there is only one output file\n"
 		       "(\"wonder.gfx\"), for the Collection there are three (\"corrupt.gfx\",\n"
-		       "\"fish.gfx\" and \"guild.gfx\").\n");
+		       "\"fish.gfx\" and \"guild.gfx\").\n\n"
+		       "With -i the files get a sorted directory and page aligned pictures,\n"
+		       "for interpreters that look pictures up by binary search and map\n"
+		       "them (\"MaP3\", which older interpreters do not read).\n");
 	}
 	return 0;
 }
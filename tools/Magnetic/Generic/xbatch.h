@@ -0,0 +1,317 @@
+/*
+    XBatch.h
+    Batch mode shared by the Xtract tools. Each extraction of a batch runs
+    in a worker process of its own, so that the tools' globals and their
+    exit-on-error handling work as they always have, and a table of the
+    results is printed once they have all finished. Input files are mapped
+    rather than read a few bytes at a time.
+
+    A tool fills in XBatch as it extracts, and calls XBatchFail() from its
+    error handler so that a worker reports why it gave up. Where fork() is
+    not available the extractions run one after the other, and the first
+    error ends the batch.
+*/
+
+#ifndef XBATCH_H
+#define XBATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define XBATCH_FORK
+#define XBATCH_MMAP
+#endif
+
+struct XBatchResult
+{
+  char Game[64];
+  unsigned long Size;   /* bytes written */
+  int Checksum;         /* 1 good, 0 bad, -1 not checked */
+  char Message[128];    /* why the extraction failed, empty if it did not */
+};
+
+/* The extraction running in this process */
+static struct XBatchResult XBatch;
+
+/* In a worker, the pipe its result goes back through */
+static int XBatchPipe = -1;
+
+static void XBatchGame(const char* name)
+{
+  strncpy(XBatch.Game,name,sizeof(XBatch.Game) - 1);
+  XBatch.Game[sizeof(XBatch.Game) - 1] = 0;
+}
+
+/* Called from a tool's error handler, only returns outside a worker */
+static void XBatchFail(const char* message)
+{
+#ifdef XBATCH_FORK
+  size_t n;
+  ssize_t w;
+
+  if (XBatchPipe < 0)
+    return;
+  strncpy(XBatch.Message,message,sizeof(XBatch.Message) - 1);
+  XBatch.Message[sizeof(XBatch.Message) - 1] = 0;
+  n = strlen(XBatch.Message);
+  while (n > 0 && XBatch.Message[n - 1] == '\n')
+    XBatch.Message[--n] = 0;
+  if (n == 0)
+    strcpy(XBatch.Message,"failed");
+  w = write(XBatchPipe,&XBatch,sizeof(XBatch));
+  (void)w;
+  _exit(1);
+#else
+  (void)message;
+#endif
+}
+
+/* The whole of a file, or 0 if it cannot be read. Empty files are fine. */
+static unsigned char* XBatchMap(const char* name, unsigned long* size)
+{
+  static unsigned char empty[1];
+#ifdef XBATCH_MMAP
+  struct stat st;
+  void* p;
+  int fd;
+
+  if ((fd = open(name,O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd,&st) < 0)
+  {
+    close(fd);
+    return 0;
+  }
+  *size = (unsigned long)st.st_size;
+  if (*size == 0)
+  {
+    close(fd);
+    return empty;
+  }
+  p = mmap(0,(size_t)st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+  return (p == MAP_FAILED) ? 0 : (unsigned char*)p;
+#else
+  FILE* fp;
+  unsigned char* p;
+  long n;
+
+  if ((fp = fopen(name,"rb")) == 0)
+    return 0;
+  if (fseek(fp,0,SEEK_END) < 0 || (n = ftell(fp)) < 0)
+  {
+    fclose(fp);
+    return 0;
+  }
+  rewind(fp);
+  *size = (unsigned long)n;
+  if (n == 0)
+  {
+    fclose(fp);
+    return empty;
+  }
+  if ((p = (unsigned char*)malloc((size_t)n)) != 0 &&
+      fread(p,1,(size_t)n,fp) != (size_t)n)
+  {
+    free(p);
+    p = 0;
+  }
+  fclose(fp);
+  return p;
+#endif
+}
+
+static void XBatchUnmap(unsigned char* data, unsigned long size)
+{
+  if (data == 0 || size == 0)
+    return;
+#ifdef XBATCH_MMAP
+  munmap(data,(size_t)size);
+#else
+  free(data);
+#endif
+}
+
+static double XBatchNow(void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/*
+    Reads the options after -b: "-j n" for the number of workers (0, the
+    default, for one per CPU) and "-p" to remove password protection
+    instead of asking. Returns the index of the first file argument, or 0
+    if an option is not understood.
+*/
+static int XBatchOptions(int argc, char** argv, int* jobs, int* unprotect)
+{
+  int i;
+
+  *jobs = 0;
+  *unprotect = 0;
+  for (i = 2; i < argc && argv[i][0] == '-'; i++)
+  {
+    if (strcmp(argv[i],"-j") == 0 && i + 1 < argc)
+      *jobs = atoi(argv[++i]);
+    else if (strcmp(argv[i],"-p") == 0)
+      *unprotect = 1;
+    else
+      return 0;
+  }
+  return i;
+}
+
+/*
+    Runs extract once for every per_job arguments of args, with up to jobs
+    workers at once, then prints a table of the results. extract returns
+    normally only if it worked. Returns the number of extractions that
+    failed.
+*/
+static int XBatchRun(char** args, int count, int per_job, int jobs,
+                     void (*extract)(char** args))
+{
+  struct XBatchResult* results;
+  double* times;
+  double start = XBatchNow();
+  unsigned long total = 0;
+  int n = count / per_job, failed = 0, i;
+#ifdef XBATCH_FORK
+  pid_t* pids;
+  int* fds;
+  int fd[2], started, done, status, null;
+  pid_t pid;
+
+  if (jobs <= 0)
+    jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs <= 0)
+    jobs = 1;
+#endif
+
+  results = (struct XBatchResult*)calloc((size_t)n + 1,
+    sizeof(struct XBatchResult));
+  times = (double*)calloc((size_t)n + 1,sizeof(double));
+#ifdef XBATCH_FORK
+  pids = (pid_t*)calloc((size_t)n + 1,sizeof(pid_t));
+  fds = (int*)calloc((size_t)n + 1,sizeof(int));
+  if (results == 0 || times == 0 || pids == 0 || fds == 0)
+#else
+  if (results == 0 || times == 0)
+#endif
+  {
+    fprintf(stderr,"Fatal Error: Not enough memory\n");
+    exit(1);
+  }
+
+#ifdef XBATCH_FORK
+  fflush(stdout);
+  for (started = 0, done = 0; done < n; done++)
+  {
+    for (; started < n && started - done < jobs; started++)
+    {
+      times[started] = XBatchNow();
+      if (pipe(fd) != 0 || (pids[started] = fork()) < 0)
+      {
+        perror("fork");
+        exit(1);
+      }
+      if (pids[started] == 0)
+      {
+        /* the extraction's running commentary is not wanted here */
+        close(fd[0]);
+        if ((null = open("/dev/null",O_WRONLY)) >= 0)
+        {
+          dup2(null,STDOUT_FILENO);
+          close(null);
+        }
+        XBatchPipe = fd[1];
+        memset(&XBatch,0,sizeof(XBatch));
+        XBatch.Checksum = -1;
+        extract(args + started * per_job);
+        if (write(XBatchPipe,&XBatch,sizeof(XBatch)) != sizeof(XBatch))
+          _exit(1);
+        _exit(0);
+      }
+      close(fd[1]);
+      fds[started] = fd[0];
+    }
+
+    /* Collect whichever worker finishes first */
+    do
+      pid = waitpid(-1,&status,0);
+    while (pid < 0 && errno == EINTR);
+    for (i = 0; i < started && pids[i] != pid; i++);
+    if (i == started)
+      break;
+    times[i] = XBatchNow() - times[i];
+    if (read(fds[i],&results[i],sizeof(results[i])) != sizeof(results[i]))
+    {
+      memset(&results[i],0,sizeof(results[i]));
+      results[i].Checksum = -1;
+      strcpy(results[i].Message,"worker died");
+    }
+    else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+      if (results[i].Message[0] == 0)
+        strcpy(results[i].Message,"failed");
+    }
+    close(fds[i]);
+    pids[i] = 0;
+  }
+  free(pids);
+  free(fds);
+#else
+  for (i = 0; i < n; i++)
+  {
+    times[i] = XBatchNow();
+    memset(&XBatch,0,sizeof(XBatch));
+    XBatch.Checksum = -1;
+    extract(args + i * per_job);
+    results[i] = XBatch;
+    times[i] = XBatchNow() - times[i];
+  }
+#endif
+
+  printf("\n%-28s %-20s %-28s %8s %5s %7s  %s\n",
+    "Input","Output","Game","Size","Sum","Time","Result");
+  for (i = 0; i < n; i++)
+  {
+    const char* sum = (results[i].Checksum < 0) ? "-" :
+      (results[i].Checksum ? "ok" : "bad");
+
+    printf("%-28s %-20s %-28s %8lu %5s %6.2fs  %s\n",args[i * per_job],
+      args[i * per_job + per_job - 1],
+      results[i].Game[0] ? results[i].Game : "-",results[i].Size,sum,
+      times[i],results[i].Message[0] ? results[i].Message : "ok");
+    if (results[i].Message[0])
+      failed++;
+    else
+      total += results[i].Size;
+  }
+  start = XBatchNow() - start;
+  printf("\n%d of %d extracted, %lu bytes in %.2fs",n - failed,n,total,start);
+  if (start > 0)
+    printf(" (%.1f MB/s)",(double)total / start / 1e6);
+  printf("\n");
+
+  free(results);
+  free(times);
+  return failed;
+}
+
+#endif
@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "xbatch.h"
+
 #define size_d64 ((type32)(174848))
 #define NL ((type32) -1)
 
@@ -18,17 +20,26 @@ typedef unsigned char huge * type8ptr;
 typedef unsigned char * type8ptr;
 #endif
 
-FILE *fpout=0, *fp[3];			/* Globals for easy cleanup */
+FILE *fpout=0;					/* Globals for easy cleanup */
+type8ptr disk[3];				/* The disk images, mapped whole */
+type32 disksize[3];
 type8 dir[256], block[256], game1, game2;
 type8ptr out, tmpbuf;
+int unprotect=-1;				/* -1 to ask */
 
-void cleanup(char *errormsg, type32 status) {
-	fprintf(stderr,errormsg);
+void release(void) {
 	if (fpout) fclose(fpout);
-	if (fp[1]) fclose(fp[1]);
-	if (fp[2]) fclose(fp[2]);
+	if (disk[1]) XBatchUnmap(disk[1],disksize[1]);
+	if (disk[2]) XBatchUnmap(disk[2],disksize[2]);
 	if (out) free(out);
 	if (tmpbuf) free(tmpbuf);
+	fpout=0; disk[0]=disk[1]=disk[2]=0; out=tmpbuf=0;
+}
+
+void cleanup(char *errormsg, type32 status) {
+	if (status) XBatchFail(errormsg);
+	fprintf(stderr,"%s",errormsg);
+	release();
 	exit(status);
 }
 
@@ -44,13 +55,13 @@ void write_w(type8ptr ptr, type32 val) {
 	ptr[0]=val;
 }
 
-FILE *get_file(char *name, type8ptr game) {
-	FILE *fp;
-	type8 buf[512];
+void get_file(char *name, type8ptr game, type32 n) {
+	type8ptr buf;
 	type32 id;
 
-	if (!(fp=fopen(name,"rb"))) cleanup("Couldn't open input file\n",1);
-	if (fread(buf,1,512,fp)!=512) cleanup("Wrong size or read error\n",1);
+	if (!(disk[n]=XBatchMap(name,&disksize[n]))) cleanup("Couldn't open input file\n",1);
+	buf=disk[n];
+	if (disksize[n]<512) cleanup("Wrong size or read error\n",1);
 
 	if	(buf[0]!='M' || buf[1]!='S')
 		cleanup("This isn't a disk image of a Magnetic Scrolls game.\n",1);
@@ -59,23 +70,28 @@ FILE *get_file(char *name, type8ptr game) {
 	if (id==0x5041574e) {						/* PAWN */
 		printf("'The Pawn' detected\n");
 		*game=0;
+		XBatchGame("The Pawn");
 	} else if (id==0x53574147) {				/* SWAG */
 		printf("'Guild of Thieves' detected\n");
 		*game=1;
+		XBatchGame("Guild of Thieves");
 	} else if (id==0x41525345) {				/* ARSE */
 		printf("'Jinxter' detected\n");
 		*game=2;
+		XBatchGame("Jinxter");
 	} else if (id==0x474c5547) {				/* GLUG */
 		printf("'Fish' detected\n");
 		*game=3;
+		XBatchGame("Fish");
 	} else if (id==0x434f4b45) {				/* COKE */
 		printf("'Corruption' detected\n");
 		*game=4;
+		XBatchGame("Corruption");
 	} else if (id==0x474f4453) {				/* GODS */
 		printf("'Myth' detected\n");
 		*game=5;
+		XBatchGame("Myth");
 	} else cleanup("Nothing I can identify, yet.\n",1);
-	return fp;
 }
 
 void ungarble(type8ptr block, type32 init) {
@@ -123,8 +139,8 @@ type8ptr getblock(type32 file, type32 sector, type32 garble) {
 		if (track==18) sector+=19;
 		else sector+=pertrack[track];
 	}
-	fseek(fp[side],sector*256,SEEK_SET);
-	if (fread(block,1,256,fp[side])!=256) cleanup("Wrong file size or read error",1);
+	if (!disk[side] || sector*256+256>disksize[side]) cleanup("Wrong file size or read error",1);
+	memcpy(block,disk[side]+sector*256,256);
 	if (garble) ungarble(block,0);
 	return block;
 }
@@ -182,7 +198,8 @@ type32 write_file(type8ptr buffer, type32 sz, FILE *fp) {
 #endif
 }
 
-main(int argc, char **argv) {
+/* args are the two disk images and the story file */
+void extract(char **args) {
 	type32 m1,m2,s1,s2,dc,sz,i,sum;
 	type32 info[6][9]={
 		{ 0, 35, 1, 2, 3, NL, 0x0b400, 0x3fb0, 0x09528f1 }, /* The Pawn */
@@ -194,30 +211,19 @@ main(int argc, char **argv) {
 	};
 	/* version, mem1, mem2, str1, str2, dict, decode_offset, undo_pc, checksum */
 
-	assert(sizeof(type8)==1);
-	assert(sizeof(type32)==4);
-
-	if (argc!=4) cleanup(
-		"Xtract64 v1.0 by Niclas Karlsson\n"
-		"\n"
-		"This is an utility to extract story files from C64 disk images of Magnetic\n"
-		"Scrolls games. The resulting story files can be run with with the Magnetic\n"
-		"interpreter by Niclas Karlsson.\n"
-		"\n"
-		"Usage: Xtract64 disk1.d64 disk2.d64 story.mag\n"
-		"\n"
-		"(disk2 can be anything when extracting Myth)\n",1);
-
 	if (!(out=(type8ptr)malloc(0x29800))) cleanup("Not enough memory\n",1);
 	if (!(tmpbuf=(type8ptr)malloc(0x8000))) cleanup("Not enough memory\n",1);
 
-	fp[1]=get_file(argv[1],&game1);
+	get_file(args[0],&game1,1);
 	if (game1!=5)
-		fp[2]=get_file(argv[2],&game2);
-	fp[0]=fp[1];
+		get_file(args[1],&game2,2);
+	disk[0]=disk[1];
+	disksize[0]=disksize[1];
 	printf ("\n");
 
-	if (fread(dir,1,256,fp[1])!=256) cleanup("Wrong file size or read error\n",1);
+	/* the directory follows the 512 bytes get_file() looked at */
+	if (disksize[1]<768) cleanup("Wrong file size or read error\n",1);
+	memcpy(dir,disk[1]+512,256);
 
 	sz=42;
 	sz+=(m1=dump_file(info[game1][1],sz,1,info[game1][0]!=0));	/* main memory 1 */
@@ -287,6 +293,7 @@ main(int argc, char **argv) {
 	}
 
 	for (i=0,sum=0;i<sz;i++) sum+=out[i];
+	XBatch.Checksum=(sum==info[game1][8]);
 	printf(
 		"Checksum is %s (actual %lx, should be %lx)\n\n",
 		(sum==info[game1][8])?"OK":"bad",
@@ -295,9 +302,12 @@ main(int argc, char **argv) {
 
 	if (game1!=4) {
 		char c;
-		printf("Shall I remove the password protection (y/n)? ");
-		c = getchar();
-		if (c=='y' || c=='Y') {
+		if (unprotect<0) {
+			printf("Shall I remove the password protection (y/n)? ");
+			c = getchar();
+			unprotect=(c=='y' || c=='Y');
+		}
+		if (unprotect) {
 			if (game1==0) {
 				out[0x3de6]=0x4e; out[0x3de7]=0x71; }
 			if (game1==1) {
@@ -312,9 +322,43 @@ main(int argc, char **argv) {
 	} else printf("This game has no password protection.\n");
 	printf("\n");
 
-	if (!(fpout=fopen(argv[3],"wb"))) cleanup("Couldn't open output file\n",1);
+	if (!(fpout=fopen(args[2],"wb"))) cleanup("Couldn't open output file\n",1);
 	if (write_file(out,sz,fpout)!=sz) cleanup("Write error\n",1);
+	XBatch.Size=sz;
+	release();
+}
+
+int main(int argc, char **argv) {
+	int first, jobs;
+
+	assert(sizeof(type8)==1);
+	assert(sizeof(type32)==4);
+
+	if (argc>2 && strcmp(argv[1],"-b")==0 &&
+		(first=XBatchOptions(argc,argv,&jobs,&unprotect))>0 &&
+		first<argc && (argc-first)%3==0)
+		return XBatchRun(argv+first,argc-first,3,jobs,extract) ? 1 : 0;
+
+	if (argc!=4) cleanup(
+		"Xtract64 v1.0 by Niclas Karlsson\n"
+		"\n"
+		"This is an utility to extract story files from C64 disk images of Magnetic\n"
+		"Scrolls games. The resulting story files can be run with with the Magnetic\n"
+		"interpreter by Niclas Karlsson.\n"
+		"\n"
+		"Usage: Xtract64 disk1.d64 disk2.d64 story.mag\n"
+		"\n"
+		"(disk2 can be anything when extracting Myth)\n"
+		"\n"
+		"To extract many games at once:\n"
+		"\n"
+		"       Xtract64 -b [-j jobs] [-p] disk1.d64 disk2.d64 story.mag ...\n"
+		"\n"
+		"runs up to \"jobs\" extractions at a time (default one per CPU) and\n"
+		"prints a table of the results. -p removes the password protection\n"
+		"instead of asking.\n",1);
 
+	extract(argv+1);
 	cleanup("Operation successful\n",0);
 
 	return 0;
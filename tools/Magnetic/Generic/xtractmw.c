@@ -12,20 +12,27 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "xbatch.h"
+
 #define HEADER_SIZE 42
 #define MAX_FILES 10
 #define BUF_SIZE 1024
 #define NUMBER_GAMES 4
 
-FILE* FileHandles[MAX_FILES];
-FILE* OutputFile = NULL;
-long FileLengths[MAX_FILES];
+unsigned char* FileData[MAX_FILES];  /* the resource files, mapped whole */
+unsigned long FileSizes[MAX_FILES];
+long FileLengths[MAX_FILES];         /* their lengths as the RDF file gives them */
 int FileCount = 0;
 unsigned char Buffer[BUF_SIZE];
 int Game = -1;
 int NextExtract = 0;
 int RemoveProtection = 0;
 
+/* The .mag file, put together in memory and written in one go */
+unsigned char* Output = NULL;
+long OutputSize = 0;
+long OutputRoom = 0;
+
 struct GameInfo
 {
   int TotalFiles;
@@ -80,26 +87,52 @@ void writeWord(unsigned char* p, unsigned long v)
   p[0] = (unsigned char)v;
 }
 
-void Error(const unsigned char *pError)
+void Error(const char *pError)
 {
+   XBatchFail(pError);
    fprintf(stderr,"Fatal Error: %s\n",pError);
    exit(1);
 }
 
-void OpenFiles(const unsigned char* pRdfName)
+/* Room for size more bytes at the end of the output */
+unsigned char* OutputSpace(long size)
+{
+  unsigned char* p;
+
+  if (OutputSize + size > OutputRoom)
+  {
+    long room = (OutputRoom > 0) ? OutputRoom : 0x40000;
+
+    while (OutputSize + size > room)
+      room *= 2;
+    if ((p = (unsigned char*)realloc(Output,(size_t)room)) == NULL)
+      Error("Not enough memory");
+    Output = p;
+    OutputRoom = room;
+  }
+  p = Output + OutputSize;
+  OutputSize += size;
+  return p;
+}
+
+void OpenFiles(const char* pRdfName)
 {
   FILE *fp;
   int result;
+  long length;
 
   if ((fp = fopen(pRdfName,"rt")) == NULL)
     Error("Cannot open RDF file");
 
-  while ((result = fscanf(fp," %256s %ld\n",Buffer,FileLengths+FileCount)) == 2)
+  while ((result = fscanf(fp," %256s %ld\n",Buffer,&length)) == 2)
   {
     if (FileCount < MAX_FILES)
     {
-      if ((FileHandles[FileCount++] = fopen(Buffer,"rb")) == NULL)
+      FileLengths[FileCount] = length;
+      if ((FileData[FileCount] = XBatchMap((const char*)Buffer,
+        FileSizes+FileCount)) == NULL)
         Error("Cannot open resource file");
+      FileCount++;
     }
   }
 
@@ -108,15 +141,12 @@ void OpenFiles(const unsigned char* pRdfName)
     Error("Bad format RDF file");
 }
 
-void OpenOutputFile(const unsigned char* pMagName)
+void OpenOutputFile(void)
 {
-  unsigned char header[HEADER_SIZE];
+  unsigned char* header;
   long code, text1, text2, index, dict, decode, total;
   long undo_size, undo_pc;
 
-  if ((OutputFile = fopen(pMagName,"wb")) == NULL)
-    Error("Cannot open output file");
-
   /* Get all the buffer sizes. */
 
   code = MSGames[Game].CodeSize;
@@ -130,7 +160,10 @@ void OpenOutputFile(const unsigned char* pMagName)
   text2 = decode + index - text1;
   total = HEADER_SIZE + code + decode + index + dict;
 
-  /* Set up the header. */
+  /* Set up the header, at the start of the output. */
+
+  OutputSize = 0;
+  header = OutputSpace(HEADER_SIZE);
 
   writeLong(header+ 0,0x4D615363);   /* Magic word */
   writeLong(header+ 4,total);        /* Size of this file */
@@ -143,12 +176,10 @@ void OpenOutputFile(const unsigned char* pMagName)
   writeLong(header+30,decode);       /* Offset to string decoding table */
   writeLong(header+34,undo_size);    /* Undo size */
   writeLong(header+38,undo_pc);      /* Undo offset */
-
-  /* Write out the header. */
-  fwrite(header,1,HEADER_SIZE,OutputFile);
 }
 
-void ReadFile(long *offset, unsigned int size)
+/* Read size bytes at offset in the resource files to pDest */
+void ReadFile(long *offset, unsigned int size, unsigned char* pDest)
 {
   long l = 0;
   unsigned int read = 0;
@@ -159,11 +190,14 @@ void ReadFile(long *offset, unsigned int size)
     if (l + FileLengths[i] > (long)(*offset + read))
     {
       unsigned int s = size - read;
+      unsigned long pos = *offset + read - l;
 
-      fseek(FileHandles[i],*offset + read - l,SEEK_SET);
       if ((long)(*offset + size) > l + FileLengths[i])
-        s = FileLengths[i] - ftell(FileHandles[i]);
-      fread(Buffer + read,s,1,FileHandles[i]);
+        s = FileLengths[i] - pos;
+      /* a resource file shorter than the RDF says leaves the rest unread */
+      if (pos < FileSizes[i])
+        memcpy(pDest + read,FileData[i] + pos,
+          (pos + s <= FileSizes[i]) ? s : (size_t)(FileSizes[i] - pos));
       read += s;
     }
     l += FileLengths[i];
@@ -182,10 +216,13 @@ void ExtractFile(long offset, long size, int unprotect)
   while (read < size)
   {
     long s = size - read;
+    unsigned char* dest;
 
     if (s > BUF_SIZE)
       s = BUF_SIZE;
-    ReadFile(&offset,(unsigned int)s);
+    dest = OutputSpace(s);
+    memcpy(dest,Buffer,(size_t)s);
+    ReadFile(&offset,(unsigned int)s,dest);
 
     /* Remove copy protection */
     
@@ -193,19 +230,19 @@ void ExtractFile(long offset, long size, int unprotect)
     {
       if ((prot >= read) && (prot < read + s))
       {
-        Buffer[prot - read] = 0x4E;
+        dest[prot - read] = 0x4E;
         printf("Removing copy protection...\n");
       }
       if ((prot + 1 >= read) && (prot + 1 < read + s))
-        Buffer[prot + 1- read] = 0x75;
+        dest[prot + 1- read] = 0x75;
     }
 
-    fwrite(Buffer,s,1,OutputFile);
+    memcpy(Buffer,dest,(size_t)s);
     read += s;
   }
 }
 
-void ExtractFiles(const char* pMagName)
+void ExtractFiles(void)
 {
   long offset = 0;
   int count, i = 0;
@@ -213,13 +250,13 @@ void ExtractFiles(const char* pMagName)
 
   /* Work out how many files are present. */
 
-  ReadFile(&offset,4);
+  ReadFile(&offset,4,Buffer);
   offset = ((long)Buffer[0] <<  0) |
            ((long)Buffer[1] <<  8) |
            ((long)Buffer[2] << 16) |
            ((long)Buffer[3] << 24);
 
-  ReadFile(&offset,2);
+  ReadFile(&offset,2,Buffer);
   count = ((int)Buffer[0] << 0) |
           ((int)Buffer[1] << 8);
 
@@ -238,6 +275,7 @@ void ExtractFiles(const char* pMagName)
   if (Game >= 0)
   {
     printf("Found %s\n",MSGames[Game].pDisplayName);
+    XBatchGame(MSGames[Game].pDisplayName);
     if (MSGames[Game].Protection != 0xFFFF)
     {
       RemoveProtection = 1;
@@ -249,7 +287,7 @@ void ExtractFiles(const char* pMagName)
         RemoveProtection = 1;
 */
     }
-    OpenOutputFile(pMagName);
+    OpenOutputFile();
   }
   else
     Error("Game not recognised");
@@ -263,7 +301,7 @@ void ExtractFiles(const char* pMagName)
     unsigned int n;
     int j;
 
-    ReadFile(&offset,18);
+    ReadFile(&offset,18,Buffer);
     o = ((long)Buffer[2] <<  0) |
         ((long)Buffer[3] <<  8) |
         ((long)Buffer[4] << 16) |
@@ -336,34 +374,67 @@ void ExtractFiles(const char* pMagName)
   }
 }
 
-void CloseFiles(void)
+void CloseFiles(const char* pMagName)
 {
+  FILE* fp;
   int i;
+
   for (i = 0; i < FileCount; i++)
-    fclose(FileHandles[i]);
-  fclose(OutputFile);
+    XBatchUnmap(FileData[i],FileSizes[i]);
+  FileCount = 0;
+
+  if ((fp = fopen(pMagName,"wb")) == NULL)
+    Error("Cannot open output file");
+  if (fwrite(Output,1,(size_t)OutputSize,fp) != (size_t)OutputSize)
+    Error("Cannot write output file");
+  fclose(fp);
+  XBatch.Size = (unsigned long)OutputSize;
+  free(Output);
+  Output = NULL;
+  OutputSize = OutputRoom = 0;
+}
+
+/* args are the RDF file and the .mag file */
+void Extract(char** args)
+{
+  Game = -1;
+  NextExtract = 0;
+  RemoveProtection = 0;
+
+  OpenFiles(args[0]);
+  ExtractFiles();
+  CloseFiles(args[1]);
+
+  /* Was all the data extracted? */
+  if (NextExtract != 4)
+    Error("Not enough game data found");
 }
 
 int main(int argc, char** argv)
 {
-  if (argc == 3)
+  int first, jobs, unprotect;
+
+  if ((argc > 2) && (strcmp(argv[1],"-b") == 0) &&
+      ((first = XBatchOptions(argc,argv,&jobs,&unprotect)) > 0) &&
+      (first < argc) && ((argc - first) % 2 == 0))
+  {
+    return XBatchRun(argv + first,argc - first,2,jobs,Extract) ? 1 : 0;
+  }
+  else if (argc == 3)
   {
-    OpenFiles(argv[1]);
-    ExtractFiles(argv[2]);
-    CloseFiles();
-
-    /* Was all the data extracted? */
-    if (NextExtract != 4)
-      Error("Not enough game data found");
-    else
-      printf("Game extracted successfully");
+    Extract(argv + 1);
+    printf("Game extracted successfully");
   }
   else
   {
     printf("XtractMW v1.0 by David Kinder, Stefan Jokisch and Niclas Karlsson.\n\n"
            "Extractor for the Magnetic Windows versions of Magnetic Scrolls\n"
            "games (Wonderland and the MS Collection Volume 1), MS-DOS versions.\n\n"
-           "Usage: XtractMW game.rdf game.mag\n");
+           "Usage: XtractMW game.rdf game.mag\n\n"
+           "To extract many games at once:\n\n"
+           "       XtractMW -b [-j jobs] game.rdf game.mag [game.rdf game.mag ...]\n\n"
+           "runs up to \"jobs\" extractions at a time (default one per CPU) and\n"
+           "prints a table of the results.\n");
   }
   return 0;
 }
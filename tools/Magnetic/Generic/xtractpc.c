@@ -12,6 +12,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "xbatch.h"
+
 #if defined(__MSDOS__) || defined (_WIN32)
 #define SEP "\\"
 #else
@@ -98,6 +100,11 @@ char* NameNumber = 0;
 FILE* InputFile = 0;
 FILE* OutputFile = 0;
 int GameIndex = -1;
+int Unprotect = -1; /* -1 to ask */
+
+/* The data file being unpacked, mapped whole */
+unsigned char* InputData = 0;
+unsigned long InputSize = 0, InputPos = 0;
 
 HugePtr Dictionary, Code, String1, String2;
 unsigned long DictionarySize = 0, CodeSize = 0;
@@ -106,8 +113,11 @@ unsigned char DecodeTable[256];
 
 void Error(const char* error)
 {
+  XBatchFail(error);
   if (InputFile)
     fclose(InputFile);
+  if (InputData)
+    XBatchUnmap(InputData,InputSize);
   if (OutputFile)
     fclose(OutputFile);
   if (Dictionary)
@@ -140,6 +150,18 @@ unsigned long ReadFile(HugePtr buf, unsigned long sz, FILE *fp)
 #endif
 }
 
+void CopyData(HugePtr dst, const unsigned char* src, unsigned long sz)
+{
+#ifdef __MSDOS__
+  unsigned long i;
+
+  for (i = 0; i < sz; i++)
+    dst[i] = src[i];
+#else
+  memcpy(dst,src,sz);
+#endif
+}
+
 unsigned long WriteFile(HugePtr buf, unsigned long sz, FILE *fp)
 {
 #ifdef __MSDOS__
@@ -183,6 +205,7 @@ void RecogniseGame(void)
       {
         GameIndex = i;
         printf("Found %s\n",Games[GameIndex].Name);
+        XBatchGame(Games[GameIndex].Name);
       }
 
       fclose(InputFile);
@@ -195,6 +218,12 @@ void RecogniseGame(void)
     Error("Game not recognised");
 }
 
+/* The next byte of the input file, or EOF past its end */
+int GetByte(void)
+{
+  return (InputPos < InputSize) ? InputData[InputPos++] : EOF;
+}
+
 unsigned char GetBits(int init)
 {
   static unsigned char mask, c;
@@ -212,7 +241,7 @@ unsigned char GetBits(int init)
     if (!mask)
     {
       mask = 0x80;
-      c = fgetc(InputFile);
+      c = GetByte();
     }
     if (!(c & mask))
       b++;
@@ -228,17 +257,19 @@ unsigned long ReadAndUnpack(HugePtr* ptr, int unpack)
   unsigned long size, loop = 0;
   int table_size, i;
 
-  if ((InputFile = fopen(Name,"rb")) == 0)
+  if ((InputData = XBatchMap(Name,&InputSize)) == 0)
     Error("Couldn't open input file");
+  InputPos = 0;
 
   if (unpack)
   {
     GetBits(1);
-    table_size = fgetc(InputFile);
+    table_size = GetByte();
     for (i = 0; i < table_size; i++)
-      DecodeTable[i] = fgetc(InputFile);
+      DecodeTable[i] = GetByte();
 
-    loop = (fgetc(InputFile) << 8) | fgetc(InputFile);
+    loop = GetByte() << 8;
+    loop |= GetByte();
     if ((ptr2 = (HugePtr)malloc(loop*3)) == 0)
       Error("Not enough memory");
 
@@ -254,19 +285,15 @@ unsigned long ReadAndUnpack(HugePtr* ptr, int unpack)
   }
   else
   {
-    if (fseek(InputFile,0,SEEK_END) < 0)
-      Error("File error");
-    if ((size = ftell(InputFile)) < 0)
-      Error("File error");
-    rewind(InputFile);
-    ptr2 = malloc(size);
+    size = InputSize;
+    if ((ptr2 = (HugePtr)malloc(size ? size : 1)) == 0)
+      Error("Not enough memory");
     *ptr = ptr2;
-    if (ReadFile(ptr2,size,InputFile) != size)
-      Error("File error");
+    CopyData(ptr2,InputData,size);
   }
 
-  fclose(InputFile);
-  InputFile = 0;
+  XBatchUnmap(InputData,InputSize);
+  InputData = 0;
   return size;
 }
 
@@ -291,9 +318,13 @@ void DoPatches(void)
   {
     char c;
 
-    printf("Should the password protection be removed (y/n)? ");
-    c = getchar();
-    if (tolower(c) == 'y')
+    if (Unprotect < 0)
+    {
+      printf("Should the password protection be removed (y/n)? ");
+      c = getchar();
+      Unprotect = (tolower(c) == 'y');
+    }
+    if (Unprotect)
     {
       Code[Games[GameIndex].CopyAddr1 - 0x2A] = Games[GameIndex].CopyByte1;
       if (Games[GameIndex].CopyAddr2 != 0x0000)
@@ -323,6 +354,8 @@ void WriteLong(HugePtr ptr, unsigned long value)
 void WriteOutputFile(const char* output)
 {
   unsigned char header[42];
+  unsigned long size, pos;
+  HugePtr out;
 
   WriteLong(header,0x4D615363);
   WriteLong(header+4,
@@ -339,37 +372,83 @@ void WriteOutputFile(const char* output)
   WriteLong(header+34,Games[GameIndex].UndoSize);
   WriteLong(header+38,Games[GameIndex].UndoPC);
 
-  if ((OutputFile = fopen(output,"wb")) == 0)
-    Error("Couldn't open output file");
+  /* Put the whole file together, so that it goes out in one write */
 
-  if (WriteFile(header,42,OutputFile) != 42)
-    Error("File error");
-  if (WriteFile(Code,CodeSize,OutputFile) != CodeSize)
-    Error("File error");
-  if (WriteFile(String1,String1Size,OutputFile) != String1Size)
-    Error("File error");
-  if (WriteFile(String2,String2Size,OutputFile) != String2Size)
-    Error("File error");
+  size = 42 + CodeSize + String1Size + String2Size;
   if (Games[GameIndex].Version > 1)
+    size += DictionarySize;
+  if ((out = (HugePtr)malloc(size)) == 0)
+    Error("Not enough memory");
+  CopyData(out,header,42);
+  pos = 42;
+  CopyData(out+pos,Code,CodeSize);
+  pos += CodeSize;
+  CopyData(out+pos,String1,String1Size);
+  pos += String1Size;
+  CopyData(out+pos,String2,String2Size);
+  pos += String2Size;
+  if (Games[GameIndex].Version > 1)
+    CopyData(out+pos,Dictionary,DictionarySize);
+
+  if ((OutputFile = fopen(output,"wb")) == 0)
+  {
+    free(out);
+    Error("Couldn't open output file");
+  }
+  if (WriteFile(out,size,OutputFile) != size)
   {
-    if (WriteFile(Dictionary,DictionarySize,OutputFile) != DictionarySize)
-      Error("File error");
+    free(out);
+    Error("File error");
   }
+  free(out);
   fclose(OutputFile);
   OutputFile = 0;
+  XBatch.Size = size;
+}
+
+void FreeData(void)
+{
+  if (Dictionary)
+    free(Dictionary);
+  if (Code)
+    free(Code);
+  if (String1)
+    free(String1);
+  if (String2)
+    free(String2);
+  Dictionary = Code = String1 = String2 = 0;
+  DictionarySize = CodeSize = String1Size = String2Size = 0;
+}
+
+/* args are the game's path, minus the trailing numbers, and the .mag file */
+void Extract(char** args)
+{
+  if (strlen(args[0]) + 2 > sizeof(Name))
+    Error("Game path too long");
+  strcpy(Name,args[0]);
+  NameNumber = Name + strlen(Name);
+  GameIndex = -1;
+
+  RecogniseGame();
+  ExtractData();
+  DoPatches();
+  WriteOutputFile(args[1]);
+  FreeData();
 }
 
 int main(int argc, char** argv)
 {
-  if (argc == 3)
-  {
-    strcpy(Name,argv[1]);
-    NameNumber = Name + strlen(Name);
+  int first, jobs;
 
-    RecogniseGame();
-    ExtractData();
-    DoPatches();
-    WriteOutputFile(argv[2]);
+  if ((argc > 2) && (strcmp(argv[1],"-b") == 0) &&
+      ((first = XBatchOptions(argc,argv,&jobs,&Unprotect)) > 0) &&
+      (first < argc) && ((argc - first) % 2 == 0))
+  {
+    return XBatchRun(argv + first,argc - first,2,jobs,Extract) ? 1 : 0;
+  }
+  else if (argc == 3)
+  {
+    Extract(argv + 1);
     printf("Game extracted successfully");
   }
   else
@@ -381,7 +460,12 @@ int main(int argc, char** argv)
            "numbers. For example, the data files for \"The Pawn\" are called \"pawn1\"\n"
            "to \"pawn6\". If these files are in a directory \"Magnetic"SEP"ThePawn\", the\n"
            "following use would be valid:\n\n"
-           "       XtractPC Magnetic"SEP"ThePawn"SEP"pawn Pawn.mag\n");
+           "       XtractPC Magnetic"SEP"ThePawn"SEP"pawn Pawn.mag\n\n"
+           "To extract many games at once:\n\n"
+           "       XtractPC -b [-j jobs] [-p] game game.mag [game game.mag ...]\n\n"
+           "runs up to \"jobs\" extractions at a time (default one per CPU) and\n"
+           "prints a table of the results. -p removes any password protection\n"
+           "instead of asking.\n");
   }
   return 0;
 }
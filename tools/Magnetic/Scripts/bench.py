@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+"""
+Replay the walkthrough recordings in this directory against their games
+with `magnetic --bench` and print one line of timings per recording.
+
+    bench.py MAGNETIC [--games DIR] [--hle off|on|check] [RECORDING ...]
+
+Games are looked up in DIR as <name>.mag or the_<name>.mag (and the .gfx
+file next to it), where <name> is the recording name without suffixes like
+"103", "Coll" or "Bug". Recordings without a game are skipped. With --hle check the loops
+that magnetic runs as C are emulated as well, a replay where they differ
+counts as failed.
+"""
+
+import argparse
+import re
+import subprocess
+import sys
+from pathlib import Path
+
+SCRIPTS = Path(__file__).parent
+COLUMNS = [
+    ("instructions", "instructions", 12),
+    ("instructions_per_second", "instr/s", 11),
+    ("turns", "turns", 6),
+    ("turn_ms_p50", "p50 ms", 8),
+    ("turn_ms_p90", "p90 ms", 8),
+    ("turn_ms_p99", "p99 ms", 8),
+    ("turn_ms_max", "max ms", 8),
+    ("peak_rss_kb", "rss kB", 8),
+    ("hle_calls", "hle", 7),
+    ("hle_mismatches", "differ", 7),
+]
+
+
+def find_game(games: Path, recording: Path):
+    name = re.sub(r"(\d+|Coll|Bug)$", "", recording.stem).lower()
+    for stem in (name, "the_" + name):
+        game = games / (stem + ".mag")
+        if game.exists():
+            gfx = game.with_suffix(".gfx")
+            return game, gfx if gfx.exists() else None
+    return None, None
+
+
+def bench(magnetic: str, recording: Path, game: Path, gfx, hle=None):
+    args = [magnetic, "--bench", "-r" + str(recording), str(game)]
+    if hle:
+        args[1:1] = ["--hle", hle]
+    if gfx:
+        args.append(str(gfx))
+    out = subprocess.run(
+        args, stdin=subprocess.DEVNULL, capture_output=True, text=True
+    ).stdout
+    result = {}
+    for line in out.splitlines():
+        key, _, value = line.partition(" ")
+        result[key] = value
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark Magnetic replays")
+    parser.add_argument("magnetic", help="path to the magnetic binary")
+    parser.add_argument("--games", default=str(SCRIPTS.parents[2] / "games"))
+    parser.add_argument("--hle", choices=["off", "on", "check"])
+    parser.add_argument("recordings", nargs="*", type=Path)
+    args = parser.parse_args()
+
+    recordings = args.recordings or sorted(SCRIPTS.glob("*.rec"))
+    print(f"{'recording':14}" + "".join(f"{t:>{w}}" for _, t, w in COLUMNS))
+    failed = False
+    for recording in recordings:
+        game, gfx = find_game(Path(args.games), recording)
+        if not game:
+            print(f"{recording.name:14}  (no game found, skipped)")
+            continue
+        result = bench(args.magnetic, recording, game, gfx, args.hle)
+        if "instructions" not in result:
+            print(f"{recording.name:14}  (replay failed)")
+            failed = True
+            continue
+        if result.get("hle_mismatches", "0") != "0":
+            failed = True
+        print(
+            f"{recording.name:14}"
+            + "".join(f"{result.get(k, '-'):>{w}}" for k, _, w in COLUMNS)
+        )
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,174 @@
+/****************************************************************************\
+*
+* Magnetic - Magnetic Scrolls Interpreter.
+*
+* Written by Niclas Karlsson <nkarlsso@abo.fi>,
+*            David Kinder <davidk@davidkinder.co.uk>,
+*            Stefan Meier <Stefan.Meier@if-legends.org> and
+*            Paul David Doherty <pdd@if-legends.org>
+*
+* Copyright (C) 1997-2023  Niclas Karlsson
+*
+*     This program is free software; you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation; either version 2 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program; if not, write to the Free Software
+*     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA.
+*
+*     Animation frames and changed regions anim.c
+*
+\****************************************************************************/
+
+/* The frame drawing of gms_graphics_apply_animation_frame() and
+   gms_graphics_animate() in Glk/glk.c, and the changed pixel search that
+   its on_screen/off_screen buffers are for, as regions instead of Glk
+   rectangle fills. */
+
+#include <string.h>
+#include "anim.h"
+
+/* changes are looked for in tiles of this size, which are then joined
+   into runs along a band of rows and into taller regions down the bands */
+#define ANIM_TILE_W 16
+#define ANIM_TILE_H 8
+
+void anim_apply_frame(uint8_t* screen, uint16_t width, uint16_t height,
+                      uint8_t* bitmap, uint16_t fw, uint16_t fh,
+                      uint8_t* mask, int16_t x, int16_t y)
+{
+    /* the mask is made up of rows of 16 bit words, see the Glk port */
+    long mask_width = (((fw - 1) / 8) + 2) & ~1;
+    int32_t fx, fy, sx, sy;
+
+    for (fy = 0; fy < fh; fy++) {
+        sy = y + fy;
+        if (sy < 0 || sy >= height) continue;
+        for (fx = 0; fx < fw; fx++) {
+            sx = x + fx;
+            if (sx < 0 || sx >= width) continue;
+            if (mask && (mask[fy * mask_width + fx / 8] & (0x80 >> (fx % 8))))
+                continue;
+            screen[(long)sy * width + sx] = bitmap[(long)fy * fw + fx];
+        }
+    }
+}
+
+uint8_t anim_step(uint8_t* off_screen, uint16_t width, uint16_t height)
+{
+    struct ms_position* positions;
+    uint16_t count, i, fw, fh;
+    uint8_t *bitmap, *mask;
+
+    if (!ms_animate(&positions, &count)) return 0;
+    for (i = 0; i < count; i++) {
+        /* a frame that can't be had is left out, as in the Glk port */
+        bitmap = ms_get_anim_frame(positions[i].number, &fw, &fh, &mask);
+        if (bitmap)
+            anim_apply_frame(off_screen, width, height, bitmap, fw, fh, mask,
+                             positions[i].x, positions[i].y);
+    }
+    return 1;
+}
+
+/* Whether any pixel of the columns x0..x1-1 of rows y0..y1-1 changed */
+static uint8_t anim_changed(uint8_t* off_screen, uint8_t* on_screen,
+                            uint16_t width, uint16_t x0, uint16_t x1,
+                            uint16_t y0, uint16_t y1)
+{
+    long row;
+
+    for (row = (long)y0 * width; y0 < y1; y0++, row += width) {
+        if (memcmp(off_screen + row + x0, on_screen + row + x0, x1 - x0))
+            return 1;
+    }
+    return 0;
+}
+
+/* Shrink a region to the changed pixels in it, 0 if there are none */
+static uint8_t anim_shrink(uint8_t* off_screen, uint8_t* on_screen,
+                           uint16_t width, struct anim_rect* r)
+{
+    uint16_t x0 = r->x, x1 = r->x + r->w, y0 = r->y, y1 = r->y + r->h;
+
+    while (y0 < y1 && !anim_changed(off_screen, on_screen, width, x0, x1,
+                                    y0, y0 + 1))
+        y0++;
+    while (y1 > y0 && !anim_changed(off_screen, on_screen, width, x0, x1,
+                                    y1 - 1, y1))
+        y1--;
+    if (y0 == y1) return 0;
+    while (!anim_changed(off_screen, on_screen, width, x0, x0 + 1, y0, y1))
+        x0++;
+    while (!anim_changed(off_screen, on_screen, width, x1 - 1, x1, y0, y1))
+        x1--;
+    r->x = x0;
+    r->y = y0;
+    r->w = x1 - x0;
+    r->h = y1 - y0;
+    return 1;
+}
+
+uint16_t anim_diff(uint8_t* off_screen, uint8_t* on_screen, uint16_t width,
+                   uint16_t height, struct anim_rect* rects, uint16_t max)
+{
+    uint16_t n = 0, i, j, tx, ty, th, start, end;
+    uint8_t overflow = 0;
+    long row;
+
+    for (ty = 0; ty < height && !overflow; ty += th) {
+        th = height - ty < ANIM_TILE_H ? height - ty : ANIM_TILE_H;
+        for (tx = 0; tx < width && !overflow;) {
+            end = width - tx < ANIM_TILE_W ? width : tx + ANIM_TILE_W;
+            if (!anim_changed(off_screen, on_screen, width, tx, end, ty,
+                              ty + th)) {
+                tx = end;
+                continue;
+            }
+            for (start = tx; tx < width; tx = end) {
+                end = width - tx < ANIM_TILE_W ? width : tx + ANIM_TILE_W;
+                if (!anim_changed(off_screen, on_screen, width, tx, end, ty,
+                                  ty + th))
+                    break;
+            }
+            end = tx;
+            /* the same run in the band above makes that region taller */
+            for (i = 0; i < n; i++) {
+                if (rects[i].x == start && rects[i].w == end - start &&
+                    rects[i].y + rects[i].h == ty)
+                    break;
+            }
+            if (i < n)
+                rects[i].h += th;
+            else if (n < max) {
+                rects[n].x = start;
+                rects[n].y = ty;
+                rects[n].w = end - start;
+                rects[n++].h = th;
+            } else
+                overflow = 1;
+        }
+    }
+    if (overflow) {
+        rects[0].x = rects[0].y = 0;
+        rects[0].w = width;
+        rects[0].h = height;
+        n = 1;
+    }
+    for (i = j = 0; i < n; i++) {
+        if (!anim_shrink(off_screen, on_screen, width, rects + i)) continue;
+        rects[j] = rects[i];
+        for (row = (long)rects[j].y * width + rects[j].x;
+             row < (long)(rects[j].y + rects[j].h) * width; row += width)
+            memcpy(on_screen + row, off_screen + row, rects[j].w);
+        j++;
+    }
+    return j;
+}
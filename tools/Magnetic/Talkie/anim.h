@@ -0,0 +1,105 @@
+/****************************************************************************\
+*
+* Magnetic - Magnetic Scrolls Interpreter.
+*
+* Written by Niclas Karlsson <nkarlsso@abo.fi>,
+*            David Kinder <davidk@davidkinder.co.uk>,
+*            Stefan Meier <Stefan.Meier@if-legends.org> and
+*            Paul David Doherty <pdd@if-legends.org>
+*
+* Copyright (C) 1997-2023  Niclas Karlsson
+*
+*     This program is free software; you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation; either version 2 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program; if not, write to the Free Software
+*     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA.
+*
+*     Animation frames and changed regions anim.h
+*
+\****************************************************************************/
+
+#ifndef MAGNETIC_ANIM_H
+#define MAGNETIC_ANIM_H
+
+#include "defs.h"
+
+/****************************************************************************\
+* The animations of Magnetic Windows pictures, composed the way the Glk port
+* does it: the frames of each ms_animate() step are drawn over an off-screen
+* copy of the picture, and only the pixels that differ from what was last
+* shown (the on-screen copy) have to be sent or painted again.
+*
+* Both buffers are width * height colour indexes, as ms_extract() returns
+* them. Start both as copies of the picture, then call anim_step() and
+* anim_diff() in turn until anim_step() returns 0.
+\****************************************************************************/
+
+struct anim_rect
+{
+  uint16_t x, y, w, h;
+};
+
+/****************************************************************************\
+* Function: anim_apply_frame
+*
+* Purpose: Draws one animation frame into a picture buffer
+*
+* Parameters:   uint8_t*    screen      picture buffer, width * height
+*               uint16_t    width       width of the picture
+*               uint16_t    height      height of the picture
+*               uint8_t*    bitmap      the frame from ms_get_anim_frame()
+*               uint16_t    fw, fh      width and height of the frame
+*               uint8_t*    mask        its mask, null if it has none
+*               int16_t     x, y        where the frame goes
+*
+* Note: The frame is clipped to the picture. Pixels whose mask bit is set
+*       are transparent. A mask row is a whole number of 16 bit words.
+\****************************************************************************/
+
+void anim_apply_frame(uint8_t * screen, uint16_t width, uint16_t height,
+                      uint8_t * bitmap, uint16_t fw, uint16_t fh,
+                      uint8_t * mask, int16_t x, int16_t y);
+
+/****************************************************************************\
+* Function: anim_step
+*
+* Purpose: Draws the frames of the next ms_animate() step into off_screen
+*
+* Return: 1 if frames were drawn, 0 if the animation has finished
+\****************************************************************************/
+
+uint8_t anim_step(uint8_t * off_screen, uint16_t width, uint16_t height);
+
+/****************************************************************************\
+* Function: anim_diff
+*
+* Purpose: Finds the regions where off_screen differs from on_screen
+*
+* Parameters:   uint8_t*      off_screen  the picture with the new frames
+*               uint8_t*      on_screen   the picture as last shown
+*               uint16_t      width       width of the pictures
+*               uint16_t      height      height of the pictures
+*               anim_rect*    rects       receives up to max regions
+*               uint16_t      max         room in rects, at least 1
+*
+* Return: the number of regions, 0 if nothing changed
+*
+* Note: The regions don't overlap and cover every changed pixel. Their
+*       pixels are copied to on_screen, so the next call only finds what
+*       changed after this one. Changes too scattered for max regions give
+*       a single region around all of them.
+\****************************************************************************/
+
+uint16_t anim_diff(uint8_t * off_screen, uint8_t * on_screen, uint16_t width,
+                   uint16_t height, struct anim_rect * rects, uint16_t max);
+
+#endif
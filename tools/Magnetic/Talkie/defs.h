@@ -45,12 +45,23 @@
 * Compile time switches 
 \****************************************************************************/
 
-/* Switch:  SAVEMEM
-   Purpose: Magnetic loads a complete graphics file into memory by default.
-            Setting this switch you tell Magnetic to load images on request
-            (saving memory, wasting load time)
+/* Switch:  GFX_CACHE
+   Purpose: Magnetic loads (or maps) a complete graphics file by default.
+            Setting this to a number of bytes makes it read the pictures
+            as they are shown instead, keeping at most that much of them
+            in memory, see ms_gfx_cache. SAVEMEM, the old switch to load
+            each picture on request, is the same as GFX_CACHE 1.
+
+#define GFX_CACHE 262144
+*/
+
+/* Switch:  MMAP_FILES
+   Purpose: Map the story and graphics files (POSIX mmap) and use the
+            text, dictionary and picture data in place, so pictures are
+            decoded without a read or an allocation each. Only the code
+            area is copied. Falls back to loading if mapping fails.
 
-#define SAVEMEM
+#define MMAP_FILES
 */
 
 /* Switch:  NO_ANIMATION
@@ -61,6 +72,48 @@
 #define NO_ANIMATION
 */
 
+/* Switch:  PICTURE_CACHE
+   Purpose: Number of decoded pictures kept in memory (default 8), so
+            showing a picture again skips the decompression. Set to 0 to
+            decode every time. See also ms_picture_cache_dir.
+
+#define PICTURE_CACHE 8
+*/
+
+/* Switch:  PROFILE
+   Purpose: Count executions and timer ticks (the TSC where available) per
+            opcode group, per line A trap and for dict_lookup, write_string
+            and char_out. ms_status() and ms_profile() print the summary.
+
+#define PROFILE
+*/
+
+/* Switch:  FAST_REGS
+   Purpose: Access the emulated registers through inlined, sized accessors
+            instead of the range checked read_reg/write_reg functions.
+            Register contents and flags are the same either way.
+
+#define FAST_REGS
+*/
+
+/* Switch:  NO_HLE
+   Purpose: Emulate every instruction. By default the string copy, byte
+            search, block copy and clear loops of the games are found
+            when they are loaded and run as C, see ms_hle.
+
+#define NO_HLE
+*/
+
+/* Switch:  MS_VERSION
+   Purpose: Build a core for the games of one version (0-4) only. The
+            version tests of the core become constants, so the compiler
+            drops the branches for the other versions; ms_init refuses
+            games of another version. Set with MAGNETIC_GAME_VERSION in
+            CMakeLists.txt.
+
+#define MS_VERSION 0
+*/
+
 /****************************************************************************\
 * Abstract functions
 *
@@ -216,6 +269,77 @@ void ms_fatal(const char * txt);
 
 uint8_t *ms_extract(uint32_t c, uint16_t * w, uint16_t * h, uint16_t * pal, uint8_t * is_anim);
 
+/****************************************************************************\
+* Function: ms_picture_count
+*
+* Purpose: Number of pictures in the graphics file
+*
+* Return: Number of picture slots, 0 if gfx are disabled
+\****************************************************************************/
+
+uint16_t ms_picture_count(void);
+
+/****************************************************************************\
+* Function: ms_extract_index
+*
+* Purpose: Like ms_extract, but the picture is given by its slot in the
+*          graphics file (0 .. ms_picture_count() - 1) rather than the
+*          number or name the game uses
+*
+* Return: Pointer to bitmap data if successful, otherwise null (empty slot)
+\****************************************************************************/
+
+uint8_t *ms_extract_index(uint16_t n, uint16_t * w, uint16_t * h, uint16_t * pal, uint8_t * is_anim);
+
+/****************************************************************************\
+* Function: ms_picture_cache_dir
+*
+* Purpose: Keep decoded pictures in files below dir as well, so they are
+*          not decoded again in later sessions. Use one directory per
+*          graphics file. Null stops using the directory.
+*
+* Parameters:   const char*   dir       existing directory or null
+*
+* Note: Has no effect if the core is built with PICTURE_CACHE 0
+\****************************************************************************/
+
+void ms_picture_cache_dir(const char * dir);
+
+/****************************************************************************\
+* Function: ms_gfx_cache
+*
+* Purpose: Read the pictures of the graphics file as they are shown, and
+*          keep at most bytes of the compressed pictures in memory, the
+*          least recently shown going first. The picture after the one
+*          shown is read ahead if there is room. 0 loads (or maps) the
+*          whole file, the default unless built with GFX_CACHE.
+*
+* Parameters:   uint32_t   bytes     the cap, or 0
+*
+* Note: Takes effect with the next ms_init. The picture shown last is
+*       always kept, however large.
+\****************************************************************************/
+
+void ms_gfx_cache(uint32_t bytes);
+
+/****************************************************************************\
+* Function: ms_picture_contrast
+*
+* Purpose: The gamma_contrast() level (see gamma.h) of the picture that
+*          ms_extract() or ms_extract_index() returned last
+*
+* Parameters:   uint8_t*    bitmap      the picture as it was returned
+*               uint16_t    w, h        its width and height
+*               uint16_t*   pal         its palette
+*
+* Note: The level is found when the picture is decoded and kept in the
+*       picture cache, on disk as well, so this is a lookup unless the core
+*       is built with PICTURE_CACHE 0
+\****************************************************************************/
+
+uint8_t ms_picture_contrast(uint8_t * bitmap, uint16_t w, uint16_t h,
+                            uint16_t * pal);
+
 /****************************************************************************\
 * Magnetic animated pictures support
 *
@@ -307,6 +431,54 @@ uint8_t * ms_get_anim_frame(int16_t number, uint16_t * width, uint16_t * height,
 
 uint8_t ms_anim_is_repeating(void);
 
+/****************************************************************************\
+* Function: ms_anim_timeline
+*
+* Purpose: Play the current animation in one go, for ports that want to
+*          prepare it once (say as a sprite sheet) instead of calling
+*          ms_animate() at intervals
+*
+* Parameters:   uint16_t  max_steps     stop after this many ms_animate()
+*                                     steps, 0 for no limit
+*
+* Return: The timeline, to be freed with ms_free_timeline, or null if there
+*         is no animation or memory ran out
+*
+* Note: Step i shows positions[steps[i].first] to
+*       positions[steps[i].first + steps[i].count - 1], like one call to
+*       ms_animate(). The animation stops at its end or, if it repeats, just
+*       before it starts again (repeats is then 1). frames holds every
+*       frame used, ordered by number, with its pixels and mask as
+*       ms_get_anim_frame() returns them. The animation state is left as it
+*       was, but the picture buffer is overwritten as by ms_get_anim_frame.
+\****************************************************************************/
+
+struct ms_anim_step
+{
+  uint16_t first, count;
+};
+
+struct ms_anim_frame
+{
+  int16_t number;
+  uint16_t width, height;
+  uint8_t *pixels;
+  uint8_t *mask;
+};
+
+struct ms_timeline
+{
+  uint16_t nsteps, nframes;
+  uint32_t npositions;
+  uint8_t repeats;
+  struct ms_anim_step *steps;
+  struct ms_position *positions;
+  struct ms_anim_frame *frames;
+};
+
+struct ms_timeline *ms_anim_timeline(uint16_t max_steps);
+void ms_free_timeline(struct ms_timeline * timeline);
+
 /****************************************************************************\
 * Magnetic Windows hint support
 * 
@@ -406,6 +578,41 @@ uint8_t ms_init(const char * name, const char * gfxname, const char * hntname, c
 
 uint8_t ms_rungame(void);
 
+/****************************************************************************\
+* Function: ms_run_slice
+*
+* Purpose: Executes up to budget instructions, so that a front end can take
+*          turns between many games on one thread
+*
+* Parameter:    uint32_t  budget  most instructions to execute
+*
+* Return: MS_SLICE_BUDGET if all of them ran, otherwise why it stopped
+*         early: MS_SLICE_STOPPED once the game is over, or what the front
+*         end last reported with ms_yield during the slice
+\****************************************************************************/
+
+#define MS_SLICE_BUDGET 0  /* budget used up, the game can go on */
+#define MS_SLICE_OUTPUT 1  /* text is ready to be sent */
+#define MS_SLICE_PICTURE 2 /* a picture is ready to be shown */
+#define MS_SLICE_INPUT 3   /* the game waits for input, see ms_suspend */
+#define MS_SLICE_STOPPED 4 /* the game is over */
+
+uint8_t ms_run_slice(uint32_t budget);
+
+/****************************************************************************\
+* Function: ms_yield
+*
+* Purpose: Ends the running ms_run_slice after the current instruction
+*
+* Parameter:    uint8_t   status  MS_SLICE_OUTPUT, _PICTURE or _INPUT, the
+*                                 highest one of a slice is returned
+*
+* Note: Call it from the front end functions (ms_flush, ms_showpic,
+*       ms_getchar), it does nothing outside ms_run_slice
+\****************************************************************************/
+
+void ms_yield(uint8_t status);
+
 /****************************************************************************\
 * Function: ms_freemen
 *
@@ -425,6 +632,31 @@ void ms_freemem(void);
 
 void ms_seed(uint32_t seed);
 
+/****************************************************************************\
+* Function: ms_message_ids
+*
+* Purpose: Puts "#[msg <n>]" before and "#[/msg]" after the text of each
+*          of the game's strings, n being the string number, so that text
+*          that is printed again can be recognised
+*
+* Parameter:    on      1 to tag the strings, 0 not to
+\****************************************************************************/
+
+void ms_message_ids(uint8_t on);
+
+/****************************************************************************\
+* Function: ms_set_undo_levels
+*
+* Purpose: Sets how many turns the next undo request (ms_getchar returning
+*          0) takes back
+*
+* Parameter:    uint16_t  levels  number of turns, reset to 1 after each undo
+*
+* Note: The core keeps up to UNDO_LEVELS turns, see emu.c
+\****************************************************************************/
+
+void ms_set_undo_levels(uint16_t levels);
+
 /****************************************************************************\
 * Function: ms_is_running
 *
@@ -471,5 +703,267 @@ void ms_status(void);
 
 uint32_t ms_count(void);
 
+/****************************************************************************\
+* Function: ms_suspend
+*
+* Purpose: Makes the input opcode that called ms_getchar run again with the
+*          next ms_rungame, instead of being skipped
+*
+* Note: Call it from ms_getchar and return 1. A front end can then leave
+*       ms_rungame while the game waits for input, e.g. to switch sessions,
+*       and the game asks for the input again once it continues.
+\****************************************************************************/
+
+void ms_suspend(void);
+
+#ifndef NO_HLE
+/****************************************************************************\
+* Function: ms_hle
+*
+* Purpose: Chooses how the loops found in the game's code run
+*
+* Parameters:   uint8_t mode    0 emulated, 1 as C (the default), 2 as C
+*                               and then emulated, comparing the registers,
+*                               flags and instruction counts after them
+\****************************************************************************/
+
+void ms_hle(uint8_t mode);
+
+/****************************************************************************\
+* Function: ms_hle_count
+*
+* Parameters:   uint32_t* mismatches    set to the loops where the C and
+*                                       the emulated results differed
+*                                       (mode 2), may be 0
+*
+* Return: Number of loops run as C since the program started
+\****************************************************************************/
+
+uint32_t ms_hle_count(uint32_t* mismatches);
+#endif
+
+#ifdef PROFILE
+/****************************************************************************\
+* Function: ms_profile
+*
+* Purpose: Dumps the profiling counters to stderr, busiest entries first
+\****************************************************************************/
+
+void ms_profile(void);
+#endif
+
+/****************************************************************************\
+* Magnetic session support
+*
+* A server can run many games from a single ms_init(). The loaded image
+* (code, strings, dictionary, graphics) is shared, a session only holds
+* what a game can change: the undo area, the live part of the stack, the
+* registers and the interpreter state. Switching sessions copies that and
+* nothing else. A session's undo history travels with it, ms_session_store
+* hands it to the session and ms_session_restore takes it back.
+* Sessions become invalid once ms_freemem or ms_init(name,...) is called.
+\****************************************************************************/
+
+struct ms_session;
+
+/****************************************************************************\
+* Function: ms_session_new
+*
+* Purpose: Forks the running game into a new session
+*
+* Return: Pointer to the session, null on failure
+*
+* Note: Call it right after ms_init to get a fresh game for each player.
+*       The new session starts with an empty undo history.
+\****************************************************************************/
+
+struct ms_session * ms_session_new(void);
+
+/****************************************************************************\
+* Function: ms_session_store
+*
+* Purpose: Saves the running game into a session
+*
+* Parameter:    ms_session* s   session to overwrite
+*
+* Return: 1 on success, 0 on failure
+\****************************************************************************/
+
+uint8_t ms_session_store(struct ms_session * s);
+
+/****************************************************************************\
+* Function: ms_session_restore
+*
+* Purpose: Continues the game of a session
+*
+* Parameter:    ms_session* s   session to switch to
+*
+* Return: 1 on success, 0 on failure
+*
+* Note: Store the running session first, its state is overwritten.
+\****************************************************************************/
+
+uint8_t ms_session_restore(struct ms_session * s);
+
+/****************************************************************************\
+* Function: ms_session_free
+*
+* Purpose: Frees a session
+*
+* Parameter:    ms_session* s   session to free, might be null
+\****************************************************************************/
+
+void ms_session_free(struct ms_session * s);
+
+/****************************************************************************\
+* Function: ms_session_keep
+*
+* Purpose: Keeps the running game in a session as it was before the opcode
+*          now asking for input, which the game reruns once the session is
+*          rolled back, e.g. to undo a turn that ran away
+*
+* Parameter:    ms_session* s   session to overwrite, from ms_session_new
+*
+* Return: 1 on success, 0 on failure
+*
+* Note: Call it from ms_getchar. Unlike ms_session_store the undo history
+*       stays with the running game.
+\****************************************************************************/
+
+uint8_t ms_session_keep(struct ms_session * s);
+
+/****************************************************************************\
+* Function: ms_session_rollback
+*
+* Purpose: Goes back to the game ms_session_keep kept in a session
+*
+* Parameter:    ms_session* s   session to copy from, it is not changed
+*
+* Return: 1 on success, 0 on failure
+*
+* Note: The undo history is cleared, as by ms_state_restore.
+\****************************************************************************/
+
+uint8_t ms_session_rollback(struct ms_session * s);
+
+/****************************************************************************\
+* Magnetic saved states
+*
+* The running game as a block of bytes, for checkpoints a front end keeps
+* itself instead of the game's own save files. Only what changed since the
+* game was loaded is stored, and a state only restores into the game it was
+* saved from. The undo history is not part of it.
+\****************************************************************************/
+
+/****************************************************************************\
+* Function: ms_state_size
+*
+* Purpose: Returns the most bytes a saved state of the loaded game takes
+\****************************************************************************/
+
+uint32_t ms_state_size(void);
+
+/****************************************************************************\
+* Function: ms_state_save
+*
+* Purpose: Saves the running game into buf
+*
+* Parameter:    uint8_t*  buf     buffer for the state
+*               uint32_t  size    size of buf
+*
+* Return: Length of the state, 0 if buf is too small or on failure
+*
+* Note: Call it from ms_getchar after ms_suspend, so that the restored game
+*       asks for the same input again.
+\****************************************************************************/
+
+uint32_t ms_state_save(uint8_t * buf, uint32_t size);
+
+/****************************************************************************\
+* Function: ms_state_restore
+*
+* Purpose: Continues the game saved in a state
+*
+* Parameter:    uint8_t*  buf     state from ms_state_save
+*               uint32_t  size    length of the state
+*
+* Return: 1 on success, 0 if the state is damaged or from another game
+*
+* Note: Call it from ms_getchar and return 1, like ms_suspend. The undo
+*       history is cleared.
+\****************************************************************************/
+
+uint8_t ms_state_restore(const uint8_t * buf, uint32_t size);
+
+/****************************************************************************\
+* Function: ms_ram
+*
+* Purpose: The part of the game's memory it writes to, what saved states
+*          and undo cover, e.g. to tell game states apart by hashing it
+*
+* Parameter:    uint32_t* size  set to its length
+*
+* Return: Pointer to the memory, 0 without a game
+\****************************************************************************/
+
+const uint8_t * ms_ram(uint32_t * size);
+
+/****************************************************************************\
+* Function: ms_vocab
+*
+* Purpose: Lists the words of the game's dictionary
+*
+* Parameter:    word    called with each word, lower case, and the number
+*                       of its bank (the word class, the game decides
+*                       which bank is which)
+*
+* Return: Number of words, 0 if the game has not looked up a word yet
+*
+* Note: The dictionary is only known once the game parsed a command, e.g.
+*       call it from ms_getchar when the second line is asked for.
+\****************************************************************************/
+
+uint32_t ms_vocab(void (*word)(const char * text, uint8_t bank));
+
+/****************************************************************************\
+* Function: ms_messages
+*
+* Purpose: Lists the text of all of the game's strings in one pass, without
+*          running the game
+*
+* Parameter:    message called with the number of each string that has any
+*                       text and its text, as ms_message_ids tags it
+*
+* Return: Number of strings listed
+\****************************************************************************/
+
+uint32_t ms_messages(void (*message)(uint16_t id, const char * text));
+
+/****************************************************************************\
+* Function: ms_room
+*
+* Purpose: Reads the player's location from the game's memory
+*
+* Return: The location, a number the game chooses, or -1 if it is not
+*         known where this game keeps it
+*
+* Note: The place is known for some games, ms_room_var names it for
+*       others.
+\****************************************************************************/
+
+int32_t ms_room(void);
+
+/****************************************************************************\
+* Function: ms_room_var
+*
+* Purpose: Tells ms_room where the game keeps the player's location
+*
+* Parameter:    addr    address in the game's memory, -1 to use the one
+*                       known for the game
+*               size    1 for a byte, 2 for a word
+\****************************************************************************/
+
+void ms_room_var(int32_t addr, uint8_t size);
+
 #endif /* MAGNETIC_DEFS_H */
 
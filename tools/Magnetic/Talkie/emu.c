@@ -261,12 +261,18 @@
 \****************************************************************************/
 
 #include <ctype.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <time.h>
 #include "defs.h"
+#include "gamma.h"
+#ifdef MMAP_FILES
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #if defined(__MSDOS__) && defined(__BORLANDC__)
 
@@ -282,29 +288,134 @@ extern FILE far* lfopen(const char far*, const char far*);
 
 #endif
 
+/* the game files may come from a bundle, see tools/bundle/bundle.h */
+#ifdef HAS_BUNDLE
+#include "bundle.h"
+#else
+#define bundle_fopen(f) fopen(f, "rb")
+#endif
+
+/* phase spans when TALKIE_TRACE is set, see tools/trace/trace.h */
+#include "trace.h"
+
+/* the run encoding of saved states, see tools/state/state.h */
+#include "state.h"
+
 uint32_t dreg[8], areg[8], i_count, string_size, rseed = 0, pc, arg1i, mem_size;
 uint16_t properties, fl_sub, fl_tab, fl_size, fp_tab, fp_size;
 uint8_t zflag, nflag, cflag, vflag, byte1, byte2, regnr, admode, opsize;
 uint8_t *arg1, *arg2, is_reversible, running = 0, tmparg[4] = {0, 0, 0, 0};
-uint8_t lastchar = 0, version = 0, sd = 0;
+uint8_t lastchar = 0, sd = 0;
+#ifdef MS_VERSION
+#define version MS_VERSION
+#else
+uint8_t version = 0;
+#endif
+/* the game's addresses wrap at 64K, as on v0-v3 games with less code */
+#if defined(MS_VERSION) && MS_VERSION >= 4
+#define mem_wrap 0
+#else
+uint8_t mem_wrap = 0;
+#endif
+uint8_t out_big = 0, out_period = 0, out_pipe = 0, string_mask_bak = 0;
+uint32_t string_offset_bak = 0;
+/* ms_message_ids(): each string is put between "#[msg <n>]" and "#[/msg]";
+   the tag ends where the game stops the string to print something else or
+   at an '@', a plural 's' or nothing, so the tagged text of a string number
+   is always the same */
+uint8_t msg_ids = 0;
+/* ms_messages() has char_out() collect the text here instead of printing */
+#define MSG_CAPTURE_SIZE 4096
+char* msg_capture = 0;
+uint32_t msg_capture_len = 0;
+/* string holds both text sections, string2 points at the second one */
 uint8_t *decode_table, *restart = 0, *code = 0, *string = 0, *string2 = 0;
-uint8_t *string3 = 0, *dict = 0;
+uint8_t* dict = 0;
+uint32_t text_size = 0;
+/* write_string() takes 8 bits per step: huff_table[node * 256 + bits] is the
+   node or character (bit 7 set) that the decode tree reaches from node with
+   the next 8 bits, least significant first, with the number of bits used
+   in the high byte */
+uint16_t* huff_table = 0;
+uint32_t dict_len = 0;
+/* The start of the dictionary is where the first lookup begins, later ones
+   may start part way into it. -1 until the game has looked up a word. */
+int32_t dict_start = -1;
+/* Where the game keeps the player's location, see ms_room(). The address
+   given with ms_room_var() wins over the one known for the game. */
+int32_t room_addr = -1, room_user_addr = -1;
+uint8_t room_size = 2, room_user_size = 2;
+void room_find(uint32_t code_size);
+void dindex_free(void);
+void pcache_free(void);
+void gfx_chunks_free(void);
+void names_free(void);
+void huff_build(void);
+uint16_t output_text(const char* text);
 uint8_t quick_flag = 0, gfx_ver = 0, *gfx_buf = 0, *gfx_data = 0;
 uint8_t *gfx2_hdr = 0, *gfx2_buf = 0;
 int8_t* gfx2_name = 0;
 uint16_t gfx2_hsize = 0;
-FILE* gfx_fp = 0;
-uint8_t *snd_buf = 0, *snd_hdr = 0;
+uint8_t gfx2_sorted = 0; /* MaP3, the header is sorted by name */
+FILE* gfx_fp = 0; /* open while the pictures are paged, see gfx_picture() */
+uint32_t gfx_file_size = 0;
+uint8_t *snd_hdr = 0, **snd_tunes = 0; /* tunes read so far, by entry */
 uint16_t snd_hsize = 0;
 FILE* snd_fp = 0;
+/* hash of the names in gfx2_hdr and snd_hdr, see names_build() */
+typedef struct {
+    uint16_t* slots; /* entry number + 1, 0 for an empty slot */
+    uint16_t mask;
+} name_index;
+name_index gfx2_names = {0, 0}, snd_names = {0, 0};
+#ifdef MMAP_FILES
+/* whole file mappings: the story sections behind the code and the
+   graphics file are used in place instead of being read into buffers */
+uint8_t *story_map = 0, *gfx_map = 0;
+size_t story_map_size = 0, gfx_map_size = 0;
+#endif
 
 const int8_t undo_ok[] = "\n[Previous turn undone.]";
 const int8_t undo_fail[] = "\n[You can't \"undo\" what hasn't been done!]";
-uint32_t undo_regs[2][18], undo_pc, undo_size;
-uint8_t *undo[2] = {0, 0}, undo_stat[2] = {0, 0};
+uint32_t undo_pc, undo_size;
+/* start of the running instruction and whether it is an input opcode run
+   again after ms_suspend() */
+uint32_t op_pc;
+uint8_t op_retry = 0;
 uint16_t gfxtable = 0, table_dist = 0;
 uint16_t v4_id = 0, next_table = 1;
 
+/* Undo history: a ring of snapshots taken whenever pc == undo_pc, i.e.
+   once per turn. undo_shadow holds the undo area as it was at the newest
+   snapshot. Each step only keeps the previous contents of the 256 byte
+   pages that changed since the step before, so taking one back means
+   copying those pages back. */
+
+#ifndef UNDO_LEVELS
+#    define UNDO_LEVELS 100
+#endif
+#define UNDO_PAGE_SHIFT 8
+#define UNDO_PAGE (1 << UNDO_PAGE_SHIFT)
+
+struct undo_step
+{
+    uint32_t regs[18];
+    uint32_t npages;
+    uint32_t* page;
+    uint8_t* data;
+};
+
+struct undo_step undo_ring[UNDO_LEVELS];
+uint8_t *undo_shadow = 0, undo_restored = 0;
+uint32_t undo_pages = 0;
+uint16_t undo_first = 0, undo_count = 0, undo_levels = 1;
+
+#ifndef NO_HLE
+/* the loops run as C, per word of code, see hle_find() */
+uint8_t *hle_map = 0, hle_mode = 1, hle_pending = 0;
+void hle_find(uint32_t code_size);
+#endif
+
 struct picture
 {
     uint8_t* data;
@@ -339,6 +450,7 @@ int16_t pos_table_index = -1;
 int16_t pos_table_max = -1;
 struct ms_position pos_array[MAX_FRAMES];
 uint8_t anim_repeat = 0;
+uint16_t anim_frames = 0; /* entries of anim_frame_table in use */
 
 #endif
 
@@ -358,12 +470,57 @@ FILE* dbg_log;
 #endif
 
 /* prototypes */
+void undo_reset(void);
+#ifdef FAST_REGS
+
+/* Registers keep their big-endian layout, as arg1/arg2 alias them byte
+   wise, but are accessed inline. All register numbers come from 3 or 4
+   bit opcode fields, so there is no range check. */
+
+#    define REG_PTR(i) ((i) < 8 ? (uint8_t*)&dreg[i] : (uint8_t*)&areg[(i)-8])
+
+static inline uint32_t read_reg(int i, int s)
+{
+    uint8_t* ptr = REG_PTR(i);
+
+    switch (s) {
+    case 0:
+        return ptr[3];
+    case 1:
+        return (uint32_t)(ptr[2] << 8 | ptr[3]);
+    default:
+        return (uint32_t)ptr[0] << 24 | (uint32_t)ptr[1] << 16 |
+               (uint32_t)ptr[2] << 8 | (uint32_t)ptr[3];
+    }
+}
+
+static inline void write_reg(int i, int s, uint32_t val)
+{
+    uint8_t* ptr = REG_PTR(i);
+
+    switch (s) {
+    case 0:
+        ptr[3] = (uint8_t)val;
+        break;
+    case 1:
+        ptr[2] = (uint8_t)(val >> 8);
+        ptr[3] = (uint8_t)val;
+        break;
+    default:
+        ptr[0] = (uint8_t)(val >> 24);
+        ptr[1] = (uint8_t)(val >> 16);
+        ptr[2] = (uint8_t)(val >> 8);
+        ptr[3] = (uint8_t)val;
+        break;
+    }
+}
+
+#else
 uint32_t read_reg(int, int);
 void write_reg(int, int, uint32_t);
+#endif
 
-#define MAX_STRING_SIZE 0xFF00
 #define MAX_PICTURE_SIZE 0xC800
-#define MAX_MUSIC_SIZE 0x4E20
 
 #ifdef LOGEMU
 void out(char* format, ...)
@@ -390,7 +547,7 @@ void out2(char* format, ...)
 /* Convert virtual pointer to effective pointer */
 uint8_t* effective(uint32_t ptr)
 {
-    if ((version < 4) && (mem_size == 0x10000)) return &(code[ptr & 0xffff]);
+    if (mem_wrap) return &(code[ptr & 0xffff]);
     if (ptr >= mem_size) {
         ms_fatal("Outside memory experience");
         return code;
@@ -457,22 +614,41 @@ uint32_t rand_emu(void)
 
 void ms_freemem(void)
 {
+    uint16_t i;
+
+#ifdef MMAP_FILES
+    if (story_map) {
+        munmap(story_map, story_map_size);
+        string = string2 = dict = story_map = 0;
+    }
+    if (gfx_map) {
+        munmap(gfx_map, gfx_map_size);
+        gfx_data = gfx2_hdr = gfx2_buf = gfx_map = 0;
+    }
+#endif
+    gfx_chunks_free();
     if (code) free(code);
     if (string) free(string);
-    if (string2) free(string2);
-    if (string3) free(string3);
     if (dict) free(dict);
-    if (undo[0]) free(undo[0]);
-    if (undo[1]) free(undo[1]);
+    if (huff_table) free(huff_table);
+    huff_table = 0;
+    if (undo_shadow) free(undo_shadow);
     if (restart) free(restart);
-    code = string = string2 = string3 = dict = undo[0] = undo[1] = restart = 0;
+#ifndef NO_HLE
+    if (hle_map) free(hle_map);
+    hle_map = 0;
+    hle_pending = 0;
+#endif
+    code = string = string2 = dict = undo_shadow = restart = 0;
+    undo_reset(); /* frees the history steps */
     if (gfx_data) free(gfx_data);
     if (gfx_buf) free(gfx_buf);
     if (gfx2_hdr) free(gfx2_hdr);
-    if (gfx2_buf) free(gfx2_buf);
     if (gfx_fp) fclose(gfx_fp);
-    gfx_data = gfx_buf = gfx2_hdr = gfx2_buf = 0;
+    gfx_data = gfx_buf = gfx2_hdr = 0;
+    gfx_file_size = 0;
     gfx2_name = 0;
+    gfx2_sorted = 0;
     gfx_fp = 0;
     gfx_ver = 0;
     gfxtable = table_dist = 0;
@@ -483,16 +659,24 @@ void ms_freemem(void)
     pos_table_index = -1;
     pos_table_max = -1;
 #endif
+    dindex_free();
+    dict_start = -1;
+    pcache_free();
     lastchar = 0;
     if (hints) free(hints);
     if (hint_contents) free(hint_contents);
     hints = 0;
     hint_contents = 0;
+    if (snd_tunes) {
+        for (i = 0; i < snd_hsize / 18; i++)
+            if (snd_tunes[i]) free(snd_tunes[i]);
+        free(snd_tunes);
+    }
     if (snd_hdr) free(snd_hdr);
-    if (snd_buf) free(snd_buf);
     snd_hdr = 0;
+    snd_tunes = 0;
     snd_hsize = 0;
-    snd_buf = 0;
+    names_free();
 }
 
 uint8_t ms_is_running(void)
@@ -510,33 +694,179 @@ void ms_stop(void)
     running = 0;
 }
 
-uint8_t init_gfx1(uint8_t* header)
+#ifdef MMAP_FILES
+/* Map a whole file copy-on-write, the dictionary is patched at runtime. */
+uint8_t* map_file(FILE* fp, size_t* size)
 {
-#ifdef SAVEMEM
-    uint32_t i;
+    struct stat st;
+    void* p;
+
+    if (fstat(fileno(fp), &st) < 0 || st.st_size <= 0) return 0;
+    p = mmap(0, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+             fileno(fp), 0);
+    if (p == MAP_FAILED) return 0;
+    *size = (size_t)st.st_size;
+    return p;
+}
+#endif
+
+/* Paging of the graphics file: with a cap set by ms_gfx_cache() the file
+   stays open and the compressed pictures are read into chunks as they are
+   shown, the least recently used going first once the chunks would take
+   more than gfx_cap bytes. The chunk of the picture shown last is never
+   dropped, the animations of version 2 take their frames from it, so a
+   picture larger than the cap is still shown. After a picture the next
+   one in the file is read ahead, if it fits without dropping any.
+   Version 2 files that are not mapped are always paged, with no cap only
+   the picture shown last is kept. SAVEMEM, which used to load each picture
+   on request, is a cap of one byte. */
+
+#ifndef GFX_CACHE
+#    ifdef SAVEMEM
+#        define GFX_CACHE 1
+#    else
+#        define GFX_CACHE 0
+#    endif
 #endif
+#define GFX_CHUNKS 64
 
+struct gfx_chunk
+{
+    uint32_t offset, length, used;
+    uint8_t* data;
+};
+
+struct gfx_chunk gfx_chunks[GFX_CHUNKS];
+struct gfx_chunk* gfx_pinned = 0; /* of the picture shown last */
+uint32_t gfx_cap = GFX_CACHE, gfx_cached = 0, gfx_clock = 0;
+
+void ms_gfx_cache(uint32_t bytes)
+{
+    gfx_cap = bytes;
+}
+
+void gfx_drop(struct gfx_chunk* c)
+{
+    free(c->data);
+    c->data = 0;
+    gfx_cached -= c->length;
+}
+
+/* Make room for need more bytes under the cap, dropping chunks only with
+   drop. Returns a free slot, or 0 if there is none. */
+struct gfx_chunk* gfx_room(uint32_t need, uint8_t drop)
+{
+    struct gfx_chunk *c, *lru;
+
+    for (;;) {
+        lru = 0;
+        for (c = gfx_chunks; c < gfx_chunks + GFX_CHUNKS; c++) {
+            if (c->data && c != gfx_pinned && (!lru || c->used < lru->used))
+                lru = c;
+        }
+        if (gfx_cached + need <= gfx_cap || !drop || !lru) break;
+        gfx_drop(lru);
+    }
+    for (c = gfx_chunks; c < gfx_chunks + GFX_CHUNKS; c++)
+        if (!c->data) break;
+    if (c == gfx_chunks + GFX_CHUNKS) {
+        if (!drop || !lru) return 0;
+        gfx_drop(c = lru);
+    }
+    if (!drop && gfx_cached + need > gfx_cap) return 0;
+    return c;
+}
+
+/* The chunk of length bytes at offset in the graphics file, read unless it
+   is kept. Read ahead only fills free room. */
+struct gfx_chunk* gfx_read(uint32_t offset, uint32_t length, uint8_t ahead)
+{
+    struct gfx_chunk* c;
+
+    for (c = gfx_chunks; c < gfx_chunks + GFX_CHUNKS; c++) {
+        if (c->data && c->offset == offset && c->length == length) {
+            if (!ahead) c->used = ++gfx_clock;
+            return c;
+        }
+    }
+    if (!length || !(c = gfx_room(length, (uint8_t)!ahead))) return 0;
+    if (!(c->data = malloc(length))) return 0;
+    if (fseek(gfx_fp, offset, SEEK_SET) < 0 ||
+        fread(c->data, 1, length, gfx_fp) != length) {
+        free(c->data);
+        c->data = 0;
+        return 0;
+    }
+    c->offset = offset;
+    c->length = length;
+    c->used = ahead ? 0 : ++gfx_clock; /* never shown, dropped first */
+    gfx_cached += length;
+    return c;
+}
+
+/* The compressed picture at offset, kept until the next one is shown */
+uint8_t* gfx_picture(uint32_t offset, uint32_t length)
+{
+    gfx_pinned = 0;
+    if (!(gfx_pinned = gfx_read(offset, length, 0))) return 0;
+    return gfx_pinned->data;
+}
+
+void gfx_chunks_free(void)
+{
+    struct gfx_chunk* c;
+
+    for (c = gfx_chunks; c < gfx_chunks + GFX_CHUNKS; c++) {
+        if (c->data) free(c->data);
+        c->data = 0;
+    }
+    gfx_pinned = 0;
+    gfx_cached = gfx_clock = 0;
+    gfx2_buf = 0;
+}
+
+/* The length of a version 1 picture, up to the next one in the file */
+uint32_t gfx1_length(uint8_t pic)
+{
+    uint32_t offset = read_l(gfx_data + 4 * pic), end = gfx_file_size, i, o;
+
+    for (i = 0; i < 32; i++) {
+        o = read_l(gfx_data + 4 * i);
+        if (o > offset && o < end) end = o;
+    }
+    return end > offset ? end - offset : 0;
+}
+
+uint8_t init_gfx1(uint8_t* header)
+{
     if (!(gfx_buf = malloc(MAX_PICTURE_SIZE))) {
         fclose(gfx_fp);
         gfx_fp = 0;
         return 1;
     }
-#ifdef SAVEMEM
-    if (!(gfx_data = malloc(128))) {
-#else
-    if (!(gfx_data = malloc(read_l(header + 4) - 8))) {
+    gfx_file_size = read_l(header + 4);
+#ifdef MMAP_FILES
+    if (!gfx_cap && (gfx_map = map_file(gfx_fp, &gfx_map_size))) {
+        if (gfx_map_size >= read_l(header + 4)) {
+            gfx_data = gfx_map + 8;
+            fclose(gfx_fp);
+            gfx_fp = 0;
+            gfx_ver = 1;
+            return 2;
+        }
+        munmap(gfx_map, gfx_map_size);
+        gfx_map = 0;
+    }
 #endif
+    /* only the offset table when paged */
+    if (!(gfx_data = malloc(gfx_cap ? 128 : read_l(header + 4) - 8))) {
         free(gfx_buf);
         fclose(gfx_fp);
         gfx_buf = 0;
         gfx_fp = 0;
         return 1;
     }
-#ifdef SAVEMEM
-    if (!fread(gfx_data, 128, 1, gfx_fp)) {
-#else
-    if (!fread(gfx_data, read_l(header + 4) - 8, 1, gfx_fp)) {
-#endif
+    if (!fread(gfx_data, gfx_cap ? 128 : read_l(header + 4) - 8, 1, gfx_fp)) {
         free(gfx_data);
         free(gfx_buf);
         fclose(gfx_fp);
@@ -545,18 +875,59 @@ uint8_t init_gfx1(uint8_t* header)
         return 1;
     }
 
-#ifdef SAVEMEM
-    for (i = 0; i < 128; i += 4)
-        if (!read_l(gfx_data + i)) write_l(gfx_data + i, read_l(header + 4));
-#else
-    fclose(gfx_fp);
-    gfx_fp = 0;
-#endif
+    if (!gfx_cap) {
+        fclose(gfx_fp);
+        gfx_fp = 0;
+    }
 
     gfx_ver = 1;
     return 2;
 }
 
+/* Name indexes: find_name_in_header() and find_name_in_sndheader() used to
+   compare the name with every header entry. The entries are hashed by the
+   first 6 characters of their name when the header is loaded, with linear
+   probing, so entries of the same name are probed in header order. The
+   entries probed are still compared as before and the first match wins.
+   The header of a MaP3 file (gfxlink2 -i) is sorted by name instead, with
+   entries of the same name in their old order, and is binary searched
+   without an index. Its pictures start on page boundaries. */
+
+uint32_t names_hash(const int8_t* name)
+{
+    uint32_t h = 2166136261UL;
+    uint8_t i;
+
+    for (i = 0; i < 6 && name[i]; i++)
+        h = (h ^ (uint8_t)name[i]) * 16777619UL;
+    return h ^ (h >> 16);
+}
+
+void names_build(name_index* x, uint8_t* hdr, uint16_t hsize, uint8_t step)
+{
+    uint32_t n = (hsize + step - 1) / step, size = 16, i, j;
+
+    if (x->slots) free(x->slots);
+    x->slots = 0;
+    while (size < 2 * n)
+        size *= 2;
+    if (!(x->slots = calloc(size, sizeof(uint16_t)))) return;
+    x->mask = (uint16_t)(size - 1);
+    for (i = 0; i < n; i++) {
+        j = names_hash((int8_t*)(hdr + i * step)) & x->mask;
+        while (x->slots[j])
+            j = (j + 1) & x->mask;
+        x->slots[j] = (uint16_t)(i + 1);
+    }
+}
+
+void names_free(void)
+{
+    if (gfx2_names.slots) free(gfx2_names.slots);
+    if (snd_names.slots) free(snd_names.slots);
+    gfx2_names.slots = snd_names.slots = 0;
+}
+
 uint8_t init_gfx2(uint8_t* header)
 {
     if (!(gfx_buf = malloc(MAX_PICTURE_SIZE))) {
@@ -566,6 +937,20 @@ uint8_t init_gfx2(uint8_t* header)
     }
 
     gfx2_hsize = read_w(header + 4);
+#ifdef MMAP_FILES
+    if (!gfx_cap && (gfx_map = map_file(gfx_fp, &gfx_map_size))) {
+        if (gfx_map_size >= 6 + (size_t)gfx2_hsize) {
+            gfx2_hdr = gfx_map + 6;
+            fclose(gfx_fp);
+            gfx_fp = 0;
+            gfx_ver = 2;
+            if (!gfx2_sorted) names_build(&gfx2_names, gfx2_hdr, gfx2_hsize, 16);
+            return 2;
+        }
+        munmap(gfx_map, gfx_map_size);
+        gfx_map = 0;
+    }
+#endif
     if (!(gfx2_hdr = malloc(gfx2_hsize))) {
         free(gfx_buf);
         fclose(gfx_fp);
@@ -586,48 +971,48 @@ uint8_t init_gfx2(uint8_t* header)
     }
 
     gfx_ver = 2;
+    if (!gfx2_sorted) names_build(&gfx2_names, gfx2_hdr, gfx2_hsize, 16);
     return 2;
 }
 
 uint8_t init_snd(uint8_t* header)
 {
-    if (!(snd_buf = malloc(MAX_MUSIC_SIZE))) {
-        fclose(snd_fp);
-        snd_fp = 0;
-        return 1;
-    }
-
     snd_hsize = read_w(header + 4);
-    if (!(snd_hdr = malloc(snd_hsize))) {
-        free(snd_buf);
+    if (!(snd_hdr = malloc(snd_hsize)) ||
+        !(snd_tunes = calloc(snd_hsize / 18 + 1, sizeof(*snd_tunes)))) {
+        if (snd_hdr) free(snd_hdr);
         fclose(snd_fp);
-        snd_buf = 0;
+        snd_hdr = 0;
+        snd_hsize = 0;
         snd_fp = 0;
         return 1;
     }
 
     fseek(snd_fp, 6, SEEK_SET);
     if (!fread(snd_hdr, snd_hsize, 1, snd_fp)) {
-        free(snd_buf);
         free(snd_hdr);
+        free(snd_tunes);
         fclose(snd_fp);
-        snd_buf = 0;
         snd_hdr = 0;
+        snd_tunes = 0;
+        snd_hsize = 0;
         snd_fp = 0;
         return 1;
     }
 
+    names_build(&snd_names, snd_hdr, snd_hsize, 18);
     return 2;
 }
 
 /* zero all registers and flags and load the game */
 
-uint8_t ms_init(const char* name, const char* gfxname, const char* hntname,
-                const char* sndname)
+uint8_t load_game(const char* name, const char* gfxname, const char* hntname,
+                  const char* sndname)
 {
     FILE* fp;
     uint8_t header[42], header2[8], header3[4];
     uint32_t i, dict_size, string2_size, code_size, dec;
+    uint8_t mapped = 0;
 
 #if defined(LOGEMU) || defined(LOGGFX) || defined(LOGHNT)
     dbg_log = fopen(LOG_FILE, "wt");
@@ -638,13 +1023,12 @@ uint8_t ms_init(const char* name, const char* gfxname, const char* hntname,
             return 0;
         else {
             memcpy(code, restart, undo_size);
-            undo_stat[0] = undo_stat[1] = 0;
+            undo_reset();
             ms_showpic(0, 0);
         }
     } else {
-        undo_stat[0] = undo_stat[1] = 0;
         ms_seed((uint32_t)time(0));
-        if (!(fp = fopen(name, "rb"))) return 0;
+        if (!(fp = bundle_fopen(name))) return 0;
         if ((fread(header, 1, 42, fp) != 42) ||
             (read_l(header) != 0x4d615363)) {
             fclose(fp);
@@ -654,19 +1038,31 @@ uint8_t ms_init(const char* name, const char* gfxname, const char* hntname,
             fclose(fp);
             return 0;
         }
+#ifdef MS_VERSION
+        if (header[13] != MS_VERSION) {
+            fclose(fp);
+            return 0;
+        }
+#endif
         ms_freemem();
+#ifndef MS_VERSION
         version = header[13];
+#endif
         code_size = read_l(header + 14);
         string_size = read_l(header + 18);
         string2_size = read_l(header + 22);
         dict_size = read_l(header + 26);
         undo_size = read_l(header + 34);
         undo_pc = read_l(header + 38);
+        room_find(code_size);
 
         if ((version < 4) && (code_size < 65536))
             mem_size = 65536;
         else
             mem_size = code_size;
+#if !defined(MS_VERSION) || MS_VERSION < 4
+        mem_wrap = (version < 4) && (mem_size == 0x10000);
+#endif
 
         /* Some C libraries don't like malloc(0), so make
            sure that undo_size is always positive. */
@@ -674,29 +1070,35 @@ uint8_t ms_init(const char* name, const char* gfxname, const char* hntname,
 
         sd =
             (uint8_t)((dict_size != 0L) ? 1 : 0); /* if (sd) => separate dict */
-
-        if (!(code = malloc(mem_size)) || !(string2 = malloc(string2_size)) ||
-            !(restart = malloc(undo_size)) ||
-            (sd && !(dict = malloc(dict_size)))) {
+        dict_len = dict_size;
+
+#ifdef MMAP_FILES
+        /* the code is modified by the game and gets its own copy below,
+           everything behind it is used straight from the mapping */
+        if ((story_map = map_file(fp, &story_map_size))) {
+            if (story_map_size >= (size_t)42 + code_size + string_size +
+                                      string2_size + dict_size) {
+                string = story_map + 42 + code_size;
+                if (sd) dict = string2 + string2_size;
+                mapped = 1;
+            } else {
+                munmap(story_map, story_map_size);
+                story_map = 0;
+            }
+        }
+#endif
+        text_size = string_size + string2_size;
+        if (!(code = malloc(mem_size)) || !(restart = malloc(undo_size)) ||
+            !(huff_table = malloc(0x80 * 256 * sizeof(*huff_table))) ||
+            (!mapped && !(string = malloc(text_size ? text_size : 1))) ||
+            (!mapped && sd && !(dict = malloc(dict_size)))) {
             ms_freemem();
             fclose(fp);
             return 0;
         }
-        if (string_size > MAX_STRING_SIZE) {
-            if (!(string = malloc(MAX_STRING_SIZE)) ||
-                !(string3 = malloc(string_size - MAX_STRING_SIZE))) {
-                ms_freemem();
-                fclose(fp);
-                return 0;
-            }
-        } else {
-            if (!(string = malloc(string_size))) {
-                ms_freemem();
-                fclose(fp);
-                return 0;
-            }
-        }
-        if (!(undo[0] = malloc(undo_size)) || !(undo[1] = malloc(undo_size))) {
+        string2 = string + string_size;
+        undo_pages = (undo_size + UNDO_PAGE - 1) >> UNDO_PAGE_SHIFT;
+        if (!(undo_shadow = malloc(undo_size))) {
             ms_freemem();
             fclose(fp);
             return 0;
@@ -707,44 +1109,25 @@ uint8_t ms_init(const char* name, const char* gfxname, const char* hntname,
             return 0;
         }
         memcpy(restart, code, undo_size); /* fast restarts */
-        if (string_size > MAX_STRING_SIZE) {
-            if (fread(string, 1, MAX_STRING_SIZE, fp) != MAX_STRING_SIZE) {
-                ms_freemem();
-                fclose(fp);
-                return 0;
-            }
-            if (fread(string3, 1, string_size - MAX_STRING_SIZE, fp) !=
-                string_size - MAX_STRING_SIZE) {
-                ms_freemem();
-                fclose(fp);
-                return 0;
-            }
-        } else {
-            if (fread(string, 1, string_size, fp) != string_size) {
-                ms_freemem();
-                fclose(fp);
-                return 0;
-            }
-        }
-        if (fread(string2, 1, string2_size, fp) != string2_size) {
+        undo_reset();
+#ifndef NO_HLE
+        hle_find(code_size);
+#endif
+        if (!mapped && fread(string, 1, text_size, fp) != text_size) {
             ms_freemem();
             fclose(fp);
             return 0;
         }
-        if (sd && fread(dict, 1, dict_size, fp) != dict_size) {
+        if (!mapped && sd && fread(dict, 1, dict_size, fp) != dict_size) {
             ms_freemem();
             fclose(fp);
             return 0;
         }
         dec = read_l(header + 30);
-        if (dec >= string_size)
-            decode_table = string2 + dec - string_size;
-        else {
-            if (dec >= MAX_STRING_SIZE)
-                decode_table = string3 + dec - MAX_STRING_SIZE;
-            else
-                decode_table = string + dec;
-        }
+        decode_table = string + dec;
+        trace_begin("huff_build");
+        huff_build();
+        trace_end();
         fclose(fp);
     }
 
@@ -761,7 +1144,7 @@ uint8_t ms_init(const char* name, const char* gfxname, const char* hntname,
     if (version == 4) {
         /* Try loading a hint file */
         FILE* hnt_fp;
-        if (hntname && (hnt_fp = fopen(hntname, "rb"))) {
+        if (hntname && (hnt_fp = bundle_fopen(hntname))) {
             if ((fread(&header3, 1, 4, hnt_fp) == 4) &&
                 (read_l(header3) == 0x4D614874)) {
                 uint8_t buf[8];
@@ -847,14 +1230,16 @@ uint8_t ms_init(const char* name, const char* gfxname, const char* hntname,
         }
 
         /* Try loading a music file */
-        if (sndname && (snd_fp = fopen(sndname, "rb"))) {
+        if (sndname && (snd_fp = bundle_fopen(sndname))) {
             if (fread(&header2, 1, 8, snd_fp) != 8) {
                 fclose(snd_fp);
                 snd_fp = 0;
             } else {
                 if (read_l(header2) == 0x4D615364) /* MaSd */
                 {
+                    trace_begin("init_snd");
                     init_snd(header2);
+                    trace_end();
 #ifdef LOGSND
                     out2("Sound file loaded.\n");
 #endif
@@ -863,46 +1248,228 @@ uint8_t ms_init(const char* name, const char* gfxname, const char* hntname,
         }
     }
 
-    if (!gfxname || !(gfx_fp = fopen(gfxname, "rb"))) return 1;
+    if (!gfxname || !(gfx_fp = bundle_fopen(gfxname))) return 1;
     if (fread(&header2, 1, 8, gfx_fp) != 8) {
         fclose(gfx_fp);
         gfx_fp = 0;
         return 1;
     }
 
-    if (version < 4 && read_l(header2) == 0x4D615069) /* MaPi */
-        return init_gfx1(header2);
-    else if (version == 4 && read_l(header2) == 0x4D615032) /* MaP2 */
-        return init_gfx2(header2);
+    if (version < 4 && read_l(header2) == 0x4D615069) { /* MaPi */
+        trace_begin("init_gfx1");
+        i = init_gfx1(header2);
+        trace_end();
+        return (uint8_t)i;
+    } else if (version == 4 && (read_l(header2) == 0x4D615032 || /* MaP2 */
+                                read_l(header2) == 0x4D615033)) { /* MaP3 */
+        gfx2_sorted = (uint8_t)(header2[3] == '3');
+        trace_begin("init_gfx2");
+        i = init_gfx2(header2);
+        trace_end();
+        return (uint8_t)i;
+    }
     fclose(gfx_fp);
     gfx_fp = 0;
     return 1;
 }
 
-uint8_t is_blank(uint16_t line, uint16_t width)
+uint8_t ms_init(const char* name, const char* gfxname, const char* hntname,
+                const char* sndname)
 {
-    int32_t i;
+    uint8_t loaded;
 
-    for (i = line * width; i < (line + 1) * width; i++)
-        if (gfx_buf[i]) return 0;
-    return 1;
+    trace_begin("ms_init");
+    loaded = load_game(name, gfxname, hntname, sndname);
+    trace_end();
+    return loaded;
 }
 
+/* Decoded pictures: the PICTURE_CACHE most recently used ones are kept, so
+   showing a picture again is a copy into gfx_buf instead of a decode. With
+   a directory set by ms_picture_cache_dir() they are also written there,
+   one file per picture, and read back in later sessions. Pictures are
+   identified by their slot in the graphics file, the position of the
+   compressed data guards against files of another game. The
+   gamma_contrast() level of a picture is found when it is decoded and kept
+   with it, see ms_picture_contrast(). */
+
+#ifndef PICTURE_CACHE
+#    define PICTURE_CACHE 8
+#endif
+
+#if PICTURE_CACHE > 0
+struct pcache_entry
+{
+    uint32_t slot, offset, length, used;
+    uint16_t w, h, pal[16];
+    uint8_t is_anim, contrast, *pixels;
+};
+
+struct pcache_entry pcache[PICTURE_CACHE];
+struct pcache_entry* pcache_last = 0; /* of the last ms_extract() */
+uint32_t pcache_clock = 0;
+char* pcache_dir = 0;
+
+#    define PCACHE_HEADER 52
+
+/* keep is set for a picture that has just been decoded, which is written
+   to the cache directory, otherwise contrast is the one read from there */
+struct pcache_entry* pcache_store(uint32_t slot, uint32_t offset,
+                                  uint32_t length, uint16_t w, uint16_t h,
+                                  uint16_t* pal, uint8_t is_anim,
+                                  uint8_t* pixels, uint8_t keep,
+                                  uint8_t contrast)
+{
+    struct pcache_entry* e = pcache;
+    uint8_t head[PCACHE_HEADER];
+    char path[1024];
+    FILE* fh;
+    int i;
+
+    for (i = 1; i < PICTURE_CACHE; i++) {
+        if (pcache[i].used < e->used) e = pcache + i;
+    }
+    if (e->pixels) free(e->pixels);
+    if (!(e->pixels = malloc((size_t)w * h + 1))) {
+        e->used = 0;
+        return 0;
+    }
+    memcpy(e->pixels, pixels, (size_t)w * h);
+    memcpy(e->pal, pal, sizeof(e->pal));
+    e->slot = slot;
+    e->offset = offset;
+    e->length = length;
+    e->w = w;
+    e->h = h;
+    e->is_anim = is_anim;
+    e->contrast = keep ? gamma_contrast(pixels, w, h, pal) : contrast;
+    e->used = ++pcache_clock;
+    pcache_last = e;
+
+    if (keep && pcache_dir) {
+        snprintf(path, sizeof(path), "%s/%u.pic", pcache_dir, slot);
+        if ((fh = fopen(path, "wb"))) {
+            memcpy(head, "MSP2", 4);
+            write_l(head + 4, offset);
+            write_l(head + 8, length);
+            write_w(head + 12, w);
+            write_w(head + 14, h);
+            write_w(head + 16, is_anim);
+            for (i = 0; i < 16; i++)
+                write_w(head + 18 + 2 * i, pal[i]);
+            write_w(head + 50, e->contrast);
+            if (fwrite(head, PCACHE_HEADER, 1, fh) != 1 ||
+                (w && h && fwrite(pixels, (size_t)w * h, 1, fh) != 1)) {
+                fclose(fh);
+                remove(path);
+            } else if (fclose(fh))
+                remove(path);
+        }
+    }
+    return e;
+}
+
+struct pcache_entry* pcache_find(uint32_t slot, uint32_t offset,
+                                 uint32_t length)
+{
+    struct pcache_entry* e = 0;
+    uint8_t head[PCACHE_HEADER], *pixels;
+    uint16_t w, h, pal[16];
+    char path[1024];
+    FILE* fh;
+    int i;
+
+    for (i = 0; i < PICTURE_CACHE; i++) {
+        if (pcache[i].pixels && pcache[i].slot == slot &&
+            pcache[i].offset == offset && pcache[i].length == length) {
+            pcache[i].used = ++pcache_clock;
+            pcache_last = pcache + i;
+            return pcache + i;
+        }
+    }
+    if (!pcache_dir) return 0;
+    snprintf(path, sizeof(path), "%s/%u.pic", pcache_dir, slot);
+    if (!(fh = fopen(path, "rb"))) return 0;
+    if (fread(head, PCACHE_HEADER, 1, fh) == 1 && !memcmp(head, "MSP2", 4) &&
+        read_l(head + 4) == offset && read_l(head + 8) == length) {
+        w = read_w(head + 12);
+        h = read_w(head + 14);
+        for (i = 0; i < 16; i++)
+            pal[i] = read_w(head + 18 + 2 * i);
+        if ((uint32_t)w * h <= MAX_PICTURE_SIZE &&
+            (pixels = malloc((size_t)w * h + 1))) {
+            if (!w || !h || fread(pixels, (size_t)w * h, 1, fh) == 1)
+                e = pcache_store(slot, offset, length, w, h, pal,
+                                 (uint8_t)read_w(head + 16), pixels, 0,
+                                 (uint8_t)read_w(head + 50));
+            free(pixels);
+        }
+    }
+    fclose(fh);
+    return e;
+}
+
+uint8_t* pcache_copy(struct pcache_entry* e, uint16_t* w, uint16_t* h,
+                     uint16_t* pal)
+{
+    memcpy(gfx_buf, e->pixels, (size_t)e->w * e->h);
+    memcpy(pal, e->pal, sizeof(e->pal));
+    *w = e->w;
+    *h = e->h;
+    return gfx_buf;
+}
+#endif
+
+void pcache_free(void)
+{
+#if PICTURE_CACHE > 0
+    int i;
+
+    for (i = 0; i < PICTURE_CACHE; i++) {
+        if (pcache[i].pixels) free(pcache[i].pixels);
+        pcache[i].pixels = 0;
+        pcache[i].used = 0;
+    }
+    pcache_last = 0;
+    pcache_clock = 0;
+#endif
+}
+
+void ms_picture_cache_dir(const char* dir)
+{
+#if PICTURE_CACHE > 0
+    if (pcache_dir) free(pcache_dir);
+    pcache_dir = 0;
+    if (dir && (pcache_dir = malloc(strlen(dir) + 1))) strcpy(pcache_dir, dir);
+#else
+    (void)dir;
+#endif
+}
+
+/* Version 1 pictures are Huffman coded runs of colours, each line XORed
+   with the one above. The decode tree is walked 4 bits at a time,
+   table[node * 16 + bits] being the node or colour (bit 7 set) reached from
+   node with the next 4 bits, most significant first, and the number of bits
+   used in the high byte. Lines are XORed and checked for blanks as soon as
+   they are complete, so the picture is only touched once. */
 uint8_t* ms_extract1(uint8_t pic, uint16_t* w, uint16_t* h, uint16_t* pal)
 {
-    uint8_t *decode_table, *data, bit, val, *buffer;
-    uint16_t tablesize, count;
-    uint32_t i, j, datasize, upsize, offset;
+    uint16_t table[0x80 * 16], tablesize, node, len, e;
+    uint8_t *decode_table, *data, *buffer, *row, *prev, val, any;
+    uint32_t i, j, k, pos, bits, datasize, upsize, offset, run, rows, top, bottom;
+#if PICTURE_CACHE > 0
+    struct pcache_entry* ce;
+#endif
 
+    if (gfx_fp && pic >= 32) return 0; /* past the offset table */
     offset = read_l(gfx_data + 4 * pic);
-#ifdef SAVEMEM
-    if (fseek(gfx_fp, offset, SEEK_SET) < 0) return 0;
-    datasize = read_l(gfx_data + 4 * (pic + 1)) - offset;
-    if (!(buffer = malloc(datasize))) return 0;
-    if (fread(buffer, 1, datasize, gfx_fp) != datasize) return 0;
-#else
-    buffer = gfx_data + offset - 8;
+#if PICTURE_CACHE > 0
+    if ((ce = pcache_find(pic, offset, 0))) return pcache_copy(ce, w, h, pal);
 #endif
+    if (gfx_fp) { /* paged, only the offset table is loaded */
+        if (!(buffer = gfx_picture(offset, gfx1_length(pic)))) return 0;
+    } else
+        buffer = gfx_data + offset - 8;
 
     for (i = 0; i < 16; i++)
         pal[i] = read_w(buffer + 0x1c + 2 * i);
@@ -914,39 +1481,61 @@ uint8_t* ms_extract1(uint8_t pic, uint16_t* w, uint16_t* h, uint16_t* pal)
     decode_table = buffer + 0x42;
     data = decode_table + tablesize * 2 + 2;
     upsize = h[0] * w[0];
+    if (upsize > MAX_PICTURE_SIZE) return 0;
 
-    for (i = 0, j = 0, count = 0, val = 0, bit = 7; i < upsize; i++, count--) {
-        if (!count) {
-            count = tablesize;
-            while (count < 0x80) {
-                if (data[j] & (1 << bit))
-                    count = decode_table[2 * count];
-                else
-                    count = decode_table[2 * count + 1];
-                if (!bit) j++;
-                bit = (uint8_t)(bit ? bit - 1 : 7);
-            }
-            count &= 0x7f;
-            if (count >= 0x10)
-                count -= 0x10;
-            else {
-                val = (uint8_t)count;
-                count = 1;
+    for (k = 0; k <= tablesize && k < 0x80; k++) {
+        for (bits = 0; bits < 16; bits++) {
+            for (node = (uint16_t)k, len = 0; node < 0x80 && len < 4; len++)
+                node = decode_table[2 * node + !(bits & (8 >> len))];
+            table[k * 16 + bits] = (uint16_t)(node | len << 8);
+        }
+    }
+
+    top = h[0];
+    bottom = 0;
+    for (i = 0, pos = 0, rows = 0, val = 0; i < upsize;) {
+        for (node = tablesize; node < 0x80; pos += e >> 8) {
+            j = pos >> 3;
+            if (j + 1 < datasize)
+                bits = read_w(data + j);
+            else
+                bits = j < datasize ? (uint32_t)data[j] << 8 : 0;
+            e = table[node * 16 + (bits >> (12 - (pos & 7)) & 0xf)];
+            node = e & 0xff;
+        }
+        node &= 0x7f;
+        if (node >= 0x10) /* repeat the last colour, 0 meaning 65536 times */
+            run = node > 0x10 ? node - 0x10 : 0x10000;
+        else {
+            val = (uint8_t)node;
+            run = 1;
+        }
+        if (run > upsize - i) run = upsize - i;
+        memset(gfx_buf + i, val, run);
+        for (i += run; (rows + 1) * w[0] <= i; rows++) {
+            row = gfx_buf + rows * w[0];
+            if (rows)
+                for (prev = row - w[0], j = 0; j < w[0]; j++)
+                    row[j] ^= prev[j];
+            for (j = 0, any = 0; j < w[0]; j++)
+                any |= row[j];
+            if (any) {
+                if (top > rows) top = rows;
+                bottom = rows + 1;
             }
         }
-        gfx_buf[i] = val;
     }
-    for (j = w[0]; j < upsize; j++)
-        gfx_buf[j] ^= gfx_buf[j - w[0]];
 
-#ifdef SAVEMEM
-    free(buffer);
+    /* drop the blank lines at the top and bottom */
+    if (!bottom) top = 0;
+    h[0] = (uint16_t)(bottom - top);
+#if PICTURE_CACHE > 0
+    pcache_store(pic, offset, 0, w[0], h[0], pal, 0, gfx_buf + top * w[0], 1,
+                 0);
 #endif
-    for (; h[0] > 0 && is_blank((uint16_t)(h[0] - 1), w[0]); h[0]--)
-        ;
-    for (i = 0; h[0] > 0 && is_blank((uint16_t)i, w[0]); h[0]--, i++)
-        ;
-    return gfx_buf + i * w[0];
+    if (gfx_fp && pic < 31 && read_l(gfx_data + 4 * (pic + 1)) >= 8)
+        gfx_read(read_l(gfx_data + 4 * (pic + 1)), gfx1_length(pic + 1), 1);
+    return gfx_buf + top * w[0];
 }
 
 int16_t find_name_in_header(int8_t* name, uint8_t upper)
@@ -954,6 +1543,7 @@ int16_t find_name_in_header(int8_t* name, uint8_t upper)
     int16_t header_pos = 0;
     int8_t pic_name[8];
     uint8_t i;
+    uint32_t j, lo, hi;
 
     for (i = 0; i < 8; i++)
         pic_name[i] = 0;
@@ -963,6 +1553,31 @@ int16_t find_name_in_header(int8_t* name, uint8_t upper)
             pic_name[i] = (int8_t)toupper(pic_name[i]);
     }
 
+    if (gfx2_sorted) {
+        /* the first of the entries of that name, see gfxlink2 -i */
+        lo = 0;
+        hi = gfx2_hsize / 16;
+        while (lo < hi) {
+            j = (lo + hi) / 2;
+            if (strncmp((int8_t*)(gfx2_hdr + j * 16), pic_name, 6) < 0)
+                lo = j + 1;
+            else
+                hi = j;
+        }
+        if (lo < gfx2_hsize / 16 &&
+            strncmp((int8_t*)(gfx2_hdr + lo * 16), pic_name, 6) == 0)
+            return (int16_t)(lo * 16);
+        return -1;
+    }
+    if (gfx2_names.slots) {
+        for (j = names_hash(pic_name) & gfx2_names.mask; gfx2_names.slots[j];
+             j = (j + 1) & gfx2_names.mask) {
+            header_pos = (int16_t)((gfx2_names.slots[j] - 1) * 16);
+            if (strncmp((int8_t*)(gfx2_hdr + header_pos), pic_name, 6) == 0)
+                return header_pos;
+        }
+        return -1;
+    }
     while (header_pos < gfx2_hsize) {
         int8_t* hname = (int8_t*)(gfx2_hdr + header_pos);
         if (strncmp(hname, pic_name, 6) == 0) return header_pos;
@@ -1010,6 +1625,10 @@ uint8_t* ms_extract2(int8_t* name, uint16_t* w, uint16_t* h, uint16_t* pal,
     struct picture main_pic;
     uint32_t offset = 0, length = 0, i;
     int16_t header_pos = -1;
+#if PICTURE_CACHE > 0
+    struct pcache_entry* e;
+    uint8_t anim = 0;
+#endif
 #ifndef NO_ANIMATION
     uint8_t* anim_data;
     uint32_t j;
@@ -1033,25 +1652,22 @@ uint8_t* ms_extract2(int8_t* name, uint16_t* w, uint16_t* h, uint16_t* pal,
     length = read_l(gfx2_hdr + header_pos + 12);
 
     if (offset != 0) {
-        if (gfx2_buf) {
-            free(gfx2_buf);
-            gfx2_buf = 0;
-        }
-
-        gfx2_buf = malloc(length);
-        if (!gfx2_buf) return 0;
-
-        if (fseek(gfx_fp, offset, SEEK_SET) < 0) {
-            free(gfx2_buf);
-            gfx2_buf = 0;
-            return 0;
-        }
-
-        if (!fread(gfx2_buf, length, 1, gfx_fp)) {
-            free(gfx2_buf);
-            gfx2_buf = 0;
-            return 0;
+#if PICTURE_CACHE > 0
+        /* animations need their frames from gfx2_buf, still loaded below */
+        e = pcache_find((uint32_t)header_pos / 16, offset, length);
+        if (e && !e->is_anim) return pcache_copy(e, w, h, pal);
+#endif
+#ifdef MMAP_FILES
+        if (gfx_map) {
+            if (offset > gfx_map_size || length > gfx_map_size - offset)
+                return 0;
+            gfx2_buf = gfx_map + offset;
+        } else {
+#endif
+        if (!(gfx2_buf = gfx_picture(offset, length))) return 0;
+#ifdef MMAP_FILES
         }
+#endif
 
         for (i = 0; i < 16; i++)
             pal[i] = read_w2(gfx2_buf + 4 + (2 * i));
@@ -1063,7 +1679,12 @@ uint8_t* ms_extract2(int8_t* name, uint16_t* w, uint16_t* h, uint16_t* pal,
         main_pic.wbytes = (uint16_t)(main_pic.data_size / main_pic.height);
         main_pic.plane_step = (uint16_t)(main_pic.wbytes / 4);
         main_pic.mask = (uint8_t*)0;
-        extract_frame(&main_pic);
+#if PICTURE_CACHE > 0
+        if (e)
+            pcache_copy(e, w, h, pal);
+        else
+#endif
+            extract_frame(&main_pic);
 
         *w = main_pic.width;
         *h = main_pic.height;
@@ -1077,6 +1698,9 @@ uint8_t* ms_extract2(int8_t* name, uint16_t* w, uint16_t* h, uint16_t* pal,
             uint16_t value1, value2;
 
             if (is_anim != 0) *is_anim = 1;
+#if PICTURE_CACHE > 0
+            anim = 1;
+#endif
 
             current = anim_data + 6;
             frame_count = read_w2(anim_data + 2);
@@ -1086,6 +1710,7 @@ uint8_t* ms_extract2(int8_t* name, uint16_t* w, uint16_t* h, uint16_t* pal,
             }
 
             /* Loop through each animation frame */
+            anim_frames = frame_count;
             for (i = 0; i < frame_count; i++) {
                 anim_frame_table[i].data = current + 10;
                 anim_frame_table[i].data_size = read_l2(current);
@@ -1160,6 +1785,15 @@ uint8_t* ms_extract2(int8_t* name, uint16_t* w, uint16_t* h, uint16_t* pal,
             pos_table_max = -1;
         }
 #endif
+#if PICTURE_CACHE > 0
+        if (!e)
+            pcache_store((uint32_t)header_pos / 16, offset, length, *w, *h,
+                         pal, anim, gfx_buf, 1, 0);
+#endif
+        if (gfx_fp && header_pos + 32 <= gfx2_hsize &&
+            read_l(gfx2_hdr + header_pos + 24))
+            gfx_read(read_l(gfx2_hdr + header_pos + 24),
+                     read_l(gfx2_hdr + header_pos + 28), 1);
         return gfx_buf;
     }
     return 0;
@@ -1169,18 +1803,68 @@ uint8_t* ms_extract(uint32_t pic, uint16_t* w, uint16_t* h, uint16_t* pal,
                     uint8_t* is_anim)
 {
     if (is_anim) *is_anim = 0;
+#if PICTURE_CACHE > 0
+    pcache_last = 0;
+#endif
 
     if (gfx_buf) {
+        uint8_t* pixels = 0;
+
+        trace_begin("picture");
         switch (gfx_ver) {
         case 1:
-            return ms_extract1((uint8_t)pic, w, h, pal);
+            pixels = ms_extract1((uint8_t)pic, w, h, pal);
+            break;
         case 2:
-            return ms_extract2((int8_t*)(code + pic), w, h, pal, is_anim);
+            pixels = ms_extract2((int8_t*)(code + pic), w, h, pal, is_anim);
+            break;
         }
+        trace_end();
+        return pixels;
     }
     return 0;
 }
 
+uint8_t ms_picture_contrast(uint8_t* bitmap, uint16_t w, uint16_t h,
+                            uint16_t* pal)
+{
+#if PICTURE_CACHE > 0
+    if (pcache_last && pcache_last->w == w && pcache_last->h == h)
+        return pcache_last->contrast;
+#endif
+    return gamma_contrast(bitmap, w, h, pal);
+}
+
+uint16_t ms_picture_count(void)
+{
+    uint32_t i, first;
+
+    if (!gfx_buf) return 0;
+    if (gfx_ver == 2) return (uint16_t)(gfx2_hsize / 16);
+
+    /* the offset table runs up to the first picture */
+    for (i = 0, first = 0; i < 128; i += 4) {
+        uint32_t offset = read_l(gfx_data + i);
+        if (offset >= 8 && (!first || offset < first)) first = offset;
+    }
+    i = first ? (first - 8) / 4 : 0;
+    return (uint16_t)(i > 32 ? 32 : i);
+}
+
+uint8_t* ms_extract_index(uint16_t n, uint16_t* w, uint16_t* h, uint16_t* pal,
+                          uint8_t* is_anim)
+{
+    if (is_anim) *is_anim = 0;
+#if PICTURE_CACHE > 0
+    pcache_last = 0;
+#endif
+    if (n >= ms_picture_count()) return 0;
+    if (gfx_ver == 2)
+        return ms_extract2((int8_t*)(gfx2_hdr + 16 * n), w, h, pal, is_anim);
+    if (read_l(gfx_data + 4 * n) < 8) return 0;
+    return ms_extract1((uint8_t)n, w, h, pal);
+}
+
 uint8_t ms_animate(struct ms_position** positions, uint16_t* count)
 {
 #ifndef NO_ANIMATION
@@ -1362,10 +2046,134 @@ uint8_t ms_anim_is_repeating(void)
 #endif
 }
 
+void ms_free_timeline(struct ms_timeline* t)
+{
+    uint16_t i;
+
+    if (!t) return;
+    for (i = 0; i < t->nframes; i++) {
+        if (t->frames[i].pixels) free(t->frames[i].pixels);
+        if (t->frames[i].mask) free(t->frames[i].mask);
+    }
+    if (t->steps) free(t->steps);
+    if (t->positions) free(t->positions);
+    if (t->frames) free(t->frames);
+    free(t);
+}
+
+/* Run ms_animate() to the end of the animation or its repeat point and
+   collect what it returns, then put the animation state back */
+
+struct ms_timeline* ms_anim_timeline(uint16_t max_steps)
+{
+#ifndef NO_ANIMATION
+    struct ms_timeline* t;
+    struct ms_position* positions;
+    struct lookup saved_table[MAX_POSITIONS];
+    int16_t saved_index = command_index, saved_pos_index = pos_table_index;
+    int16_t saved_pos_max = pos_table_max;
+    uint8_t saved_repeat = anim_repeat, used[MAX_ANIMS], ok = 1;
+    uint16_t saved_next = next_table, count, i, n;
+    uint32_t size;
+    void* grown;
+
+    if (!(t = calloc(1, sizeof(*t)))) return 0;
+    memcpy(saved_table, anim_table, sizeof(saved_table));
+    memset(used, 0, sizeof(used));
+    if (!max_steps) max_steps = 0xffff;
+
+    anim_repeat = 0;
+    while (t->nsteps < max_steps && ms_animate(&positions, &count)) {
+        if (anim_repeat) {
+            /* the command stream started over, this step comes again */
+            t->repeats = 1;
+            break;
+        }
+        if (!(t->nsteps & 63)) {
+            grown = realloc(t->steps, (t->nsteps + 64) * sizeof(*t->steps));
+            if (!grown) {
+                ok = 0;
+                break;
+            }
+            t->steps = grown;
+        }
+        grown = realloc(t->positions,
+                        (t->npositions + count) * sizeof(*t->positions));
+        if (count && !grown) {
+            ok = 0;
+            break;
+        }
+        if (count) t->positions = grown;
+        memcpy(t->positions + t->npositions, positions,
+               count * sizeof(*positions));
+        t->steps[t->nsteps].first = (uint16_t)t->npositions;
+        t->steps[t->nsteps++].count = count;
+        t->npositions += count;
+        for (i = 0; i < count; i++) {
+            n = (uint16_t)positions[i].number;
+            if (positions[i].number >= 0 && n < anim_frames && !used[n]) {
+                used[n] = 1;
+                t->nframes++;
+            }
+        }
+    }
+    if (ok && t->nframes &&
+        !(t->frames = calloc(t->nframes, sizeof(*t->frames))))
+        ok = 0;
+    for (i = 0, n = 0; ok && i < anim_frames; i++) {
+        struct ms_anim_frame* frame = t->frames + n;
+        struct picture* pic = anim_frame_table + i;
+
+        if (!used[i]) continue;
+        n++;
+        frame->number = (int16_t)i;
+        frame->width = pic->width;
+        frame->height = pic->height;
+        size = (uint32_t)pic->width * pic->height;
+        extract_frame(pic);
+        if (!(frame->pixels = malloc(size + 1))) ok = 0;
+        else
+            memcpy(frame->pixels, gfx_buf, size);
+        if (pic->mask && pic->width) {
+            /* mask rows are whole 16 bit words */
+            size = ((((uint32_t)pic->width - 1) / 8 + 2) & ~1) * pic->height;
+            if (!(frame->mask = malloc(size + 1))) ok = 0;
+            else
+                memcpy(frame->mask, pic->mask, size);
+        }
+    }
+
+    memcpy(anim_table, saved_table, sizeof(saved_table));
+    command_index = saved_index;
+    pos_table_index = saved_pos_index;
+    pos_table_max = saved_pos_max;
+    anim_repeat = saved_repeat;
+    next_table = saved_next;
+    if (!ok) {
+        ms_free_timeline(t);
+        return 0;
+    }
+    return t;
+#else
+    (void)max_steps;
+    return 0;
+#endif
+}
+
 int16_t find_name_in_sndheader(int8_t* name)
 {
     int16_t header_pos = 0;
+    uint32_t j;
 
+    if (snd_names.slots) {
+        for (j = names_hash(name) & snd_names.mask; snd_names.slots[j];
+             j = (j + 1) & snd_names.mask) {
+            header_pos = (int16_t)((snd_names.slots[j] - 1) * 18);
+            if (strcmp((int8_t*)(snd_hdr + header_pos), name) == 0)
+                return header_pos;
+        }
+        return -1;
+    }
     while (header_pos < snd_hsize) {
         int8_t* hname = (int8_t*)(snd_hdr + header_pos);
         if (strcmp(hname, name) == 0) return header_pos;
@@ -1374,70 +2182,460 @@ int16_t find_name_in_sndheader(int8_t* name)
     return -1;
 }
 
-uint8_t* sound_extract(int8_t* name, uint32_t* length, uint16_t* tempo)
+/* Each tune is read from the sound file the first time it plays and kept
+   until ms_freemem(), so a tune always comes back at the same address */
+uint8_t* sound_extract(int8_t* name, uint32_t* length, uint16_t* tempo)
+{
+    uint32_t offset = 0;
+    int16_t header_pos = -1;
+    uint8_t** tune;
+
+    if (header_pos < 0) header_pos = find_name_in_sndheader(name);
+    if (header_pos < 0) return 0;
+
+    *tempo = read_w(snd_hdr + header_pos + 8);
+    offset = read_l(snd_hdr + header_pos + 10);
+    *length = read_l(snd_hdr + header_pos + 14);
+
+    if (offset != 0 && *length) {
+        tune = snd_tunes + header_pos / 18;
+        if (*tune) return *tune;
+        if (!(*tune = malloc(*length))) return 0;
+        if (fseek(snd_fp, offset, SEEK_SET) < 0 ||
+            !fread(*tune, *length, 1, snd_fp)) {
+            free(*tune);
+            *tune = 0;
+            return 0;
+        }
+        return *tune;
+    }
+    return 0;
+}
+
+void undo_free_step(struct undo_step* step)
+{
+    if (step->page) free(step->page);
+    if (step->data) free(step->data);
+    step->page = 0;
+    step->data = 0;
+    step->npages = 0;
+}
+
+/* forget the whole history, the current memory becomes the reference */
+
+void undo_reset(void)
+{
+    uint16_t i;
+
+    for (i = 0; i < UNDO_LEVELS; i++)
+        undo_free_step(&undo_ring[i]);
+    undo_first = undo_count = 0;
+    undo_restored = 0;
+    if (undo_shadow) memcpy(undo_shadow, code, undo_size);
+}
+
+uint32_t undo_page_size(uint32_t page)
+{
+    uint32_t offset = page << UNDO_PAGE_SHIFT;
+
+    return (undo_size - offset < UNDO_PAGE) ? undo_size - offset : UNDO_PAGE;
+}
+
+/* has a page been written to since the newest snapshot? */
+
+int undo_page_dirty(uint32_t page)
+{
+    uint32_t offset = page << UNDO_PAGE_SHIFT;
+
+    return memcmp(code + offset, undo_shadow + offset, undo_page_size(page));
+}
+
+void save_undo(void)
+{
+    struct undo_step* step;
+    uint32_t i, n, offset, len;
+
+    if (undo_restored) {
+        /* memory is exactly the newest snapshot again */
+        undo_restored = 0;
+        return;
+    }
+    if (!undo_shadow) return;
+
+    for (i = n = 0; i < undo_pages; i++)
+        if (undo_page_dirty(i)) n++;
+
+    if (undo_count == UNDO_LEVELS) {
+        undo_free_step(&undo_ring[undo_first]);
+        undo_first = (undo_first + 1) % UNDO_LEVELS;
+        undo_count--;
+    }
+    step = &undo_ring[(undo_first + undo_count) % UNDO_LEVELS];
+    if (n && (!(step->page = malloc(n * sizeof(uint32_t))) ||
+              !(step->data = malloc(n * UNDO_PAGE)))) {
+        /* out of memory - start a fresh history at this turn */
+        undo_free_step(step);
+        undo_reset();
+        step = &undo_ring[0];
+        n = 0;
+    }
+
+    for (i = 0; n && i < undo_pages; i++) {
+        if (!undo_page_dirty(i)) continue;
+        offset = i << UNDO_PAGE_SHIFT;
+        len = undo_page_size(i);
+        memcpy(step->data + step->npages * UNDO_PAGE, undo_shadow + offset,
+               len);
+        memcpy(undo_shadow + offset, code + offset, len);
+        step->page[step->npages++] = i;
+    }
+
+    for (i = 0; i < 8; i++) {
+        step->regs[i] = dreg[i];
+        step->regs[8 + i] = areg[i];
+    }
+    step->regs[16] = i_count;
+    step->regs[17] = pc; /* status flags intentionally omitted */
+    undo_count++;
+}
+
+void ms_set_undo_levels(uint16_t levels)
+{
+    undo_levels = levels;
+}
+
+uint8_t ms_undo(void)
+{
+    struct undo_step* step;
+    uint32_t i, offset, len;
+    uint16_t levels = undo_levels;
+
+    ms_flush();
+    undo_levels = 1;
+    if (!levels || levels >= undo_count) return 0;
+
+    /* first back to the newest snapshot ... */
+    memcpy(code, undo_shadow, undo_size);
+
+    /* ... then step by step to the requested one */
+    while (levels--) {
+        step = &undo_ring[(undo_first + undo_count - 1) % UNDO_LEVELS];
+        for (i = 0; i < step->npages; i++) {
+            offset = step->page[i] << UNDO_PAGE_SHIFT;
+            len = undo_page_size(step->page[i]);
+            memcpy(undo_shadow + offset, step->data + i * UNDO_PAGE, len);
+            memcpy(code + offset, undo_shadow + offset, len);
+        }
+        undo_free_step(step);
+        undo_count--;
+    }
+
+    step = &undo_ring[(undo_first + undo_count - 1) % UNDO_LEVELS];
+    for (i = 0; i < 8; i++) {
+        dreg[i] = step->regs[i];
+        areg[i] = step->regs[8 + i];
+    }
+    i_count = step->regs[16];
+    pc = step->regs[17]; /* status flags intentionally omitted */
+    undo_restored = 1;
+    return 1;
+}
+
+/* Sessions: the loaded image (code, strings, dictionary, graphics) is
+   shared, a session only owns what a game can change - the undo area, the
+   live part of the stack, the registers and some bits of emulator state. */
+
+struct ms_session
+{
+    uint32_t regs[16], pc, i_count, rseed, string_offset_bak;
+    uint32_t stack_lo, stack_size;
+    uint16_t properties, fl_sub, fl_tab, fl_size, fp_tab, fp_size;
+    uint8_t zflag, nflag, cflag, vflag, running, lastchar, op_retry;
+    uint8_t out_big, out_period, out_pipe, string_mask_bak;
+    uint8_t *ram, *stack;
+    struct undo_step undo_ring[UNDO_LEVELS];
+    uint8_t *undo_shadow, undo_restored;
+    uint16_t undo_first, undo_count;
+};
+
+/* top of the stack area, sp starts at 0xfffe */
+
+uint32_t session_stack_top(void)
+{
+    return (mem_size < 0x10000) ? mem_size : 0x10000;
+}
+
+uint8_t session_copy_out(struct ms_session* s)
+{
+    uint32_t i, sp, top;
+    uint8_t* tmp;
+
+    sp = read_reg(15, 2) & ~1;
+    top = session_stack_top();
+    if (sp > top) sp = top;
+    if (top - sp > s->stack_size || !s->stack) {
+        if (!(tmp = realloc(s->stack, top - sp ? top - sp : 1))) return 0;
+        s->stack = tmp;
+    }
+    s->stack_lo = sp;
+    s->stack_size = top - sp;
+    memcpy(s->stack, code + sp, s->stack_size);
+    if (s->ram) memcpy(s->ram, code, undo_size);
+
+    for (i = 0; i < 8; i++) {
+        s->regs[i] = dreg[i];
+        s->regs[8 + i] = areg[i];
+    }
+    s->pc = pc;
+    s->i_count = i_count;
+    s->rseed = rseed;
+    s->zflag = zflag;
+    s->nflag = nflag;
+    s->cflag = cflag;
+    s->vflag = vflag;
+    s->running = running;
+    s->lastchar = lastchar;
+    s->op_retry = op_retry;
+    s->out_big = out_big;
+    s->out_period = out_period;
+    s->out_pipe = out_pipe;
+    s->string_offset_bak = string_offset_bak;
+    s->string_mask_bak = string_mask_bak;
+    s->properties = properties;
+    s->fl_sub = fl_sub;
+    s->fl_tab = fl_tab;
+    s->fl_size = fl_size;
+    s->fp_tab = fp_tab;
+    s->fp_size = fp_size;
+    return 1;
+}
+
+void session_copy_in(struct ms_session* s)
+{
+    uint32_t i;
+
+    memcpy(code, s->ram, undo_size);
+    memcpy(code + s->stack_lo, s->stack, s->stack_size);
+
+    for (i = 0; i < 8; i++) {
+        dreg[i] = s->regs[i];
+        areg[i] = s->regs[8 + i];
+    }
+    pc = s->pc;
+    i_count = s->i_count;
+    rseed = s->rseed;
+    zflag = s->zflag;
+    nflag = s->nflag;
+    cflag = s->cflag;
+    vflag = s->vflag;
+    running = s->running;
+    lastchar = s->lastchar;
+    op_retry = s->op_retry;
+    out_big = s->out_big;
+    out_period = s->out_period;
+    out_pipe = s->out_pipe;
+    string_offset_bak = s->string_offset_bak;
+    string_mask_bak = s->string_mask_bak;
+    properties = s->properties;
+    fl_sub = s->fl_sub;
+    fl_tab = s->fl_tab;
+    fl_size = s->fl_size;
+    fp_tab = s->fp_tab;
+    fp_size = s->fp_size;
+}
+
+/* hand the undo history from one owner to the other, leaving from empty */
+
+void session_move_history(struct undo_step* to_ring, uint8_t** to_shadow,
+                          struct undo_step* from_ring, uint8_t** from_shadow)
+{
+    uint8_t* tmp;
+    uint16_t i;
+
+    for (i = 0; i < UNDO_LEVELS; i++) {
+        undo_free_step(&to_ring[i]);
+        to_ring[i] = from_ring[i];
+        from_ring[i].page = 0;
+        from_ring[i].data = 0;
+        from_ring[i].npages = 0;
+    }
+    tmp = *to_shadow;
+    *to_shadow = *from_shadow;
+    *from_shadow = tmp;
+}
+
+struct ms_session* ms_session_new(void)
+{
+    struct ms_session* s;
+
+    if (!code || !(s = calloc(1, sizeof(struct ms_session)))) return 0;
+    if (!(s->ram = malloc(undo_size)) ||
+        !(s->undo_shadow = malloc(undo_size)) || !session_copy_out(s)) {
+        ms_session_free(s);
+        return 0;
+    }
+    memcpy(s->undo_shadow, code, undo_size);
+    return s;
+}
+
+uint8_t ms_session_store(struct ms_session* s)
+{
+    if (!code || !session_copy_out(s)) return 0;
+    session_move_history(s->undo_ring, &s->undo_shadow, undo_ring,
+                         &undo_shadow);
+    s->undo_first = undo_first;
+    s->undo_count = undo_count;
+    s->undo_restored = undo_restored;
+    undo_reset(); /* the core keeps running with a fresh history */
+    return 1;
+}
+
+uint8_t ms_session_restore(struct ms_session* s)
+{
+    if (!code) return 0;
+    session_copy_in(s);
+    session_move_history(undo_ring, &undo_shadow, s->undo_ring,
+                         &s->undo_shadow);
+    undo_first = s->undo_first;
+    undo_count = s->undo_count;
+    undo_restored = s->undo_restored;
+    undo_levels = 1;
+    if (!undo_count) undo_reset();
+    s->undo_first = s->undo_count = 0;
+    return 1;
+}
+
+void ms_session_free(struct ms_session* s)
+{
+    uint16_t i;
+
+    if (!s) return;
+    for (i = 0; i < UNDO_LEVELS; i++)
+        undo_free_step(&s->undo_ring[i]);
+    if (s->ram) free(s->ram);
+    if (s->stack) free(s->stack);
+    if (s->undo_shadow) free(s->undo_shadow);
+    free(s);
+}
+
+uint8_t ms_session_keep(struct ms_session* s)
+{
+    uint32_t now_pc = pc, now_count = i_count;
+    uint8_t now_retry = op_retry, ok;
+
+    if (!code) return 0;
+    /* as the game is once the opcode has been suspended */
+    ms_suspend();
+    ok = session_copy_out(s);
+    pc = now_pc;
+    i_count = now_count;
+    op_retry = now_retry;
+    return ok;
+}
+
+uint8_t ms_session_rollback(struct ms_session* s)
 {
-    uint32_t offset = 0;
-    int16_t header_pos = -1;
-
-    if (header_pos < 0) header_pos = find_name_in_sndheader(name);
-    if (header_pos < 0) return 0;
+    if (!code) return 0;
+    session_copy_in(s);
+    undo_reset(); /* its snapshots may be from the turn left behind */
+    undo_levels = 1;
+    return 1;
+}
 
-    *tempo = read_w(snd_hdr + header_pos + 8);
-    offset = read_l(snd_hdr + header_pos + 10);
-    *length = read_l(snd_hdr + header_pos + 14);
+/* Saved states: a session without its undo history, flattened. The undo
+   area is kept as runs against the image the game started from, the stack
+   as runs against zeros (tools/state). The scalar part of struct
+   ms_session and the header go in as they are, in the machine's byte
+   order. */
 
-    if (offset != 0) {
-        if (!snd_buf) return 0;
-        if (fseek(snd_fp, offset, SEEK_SET) < 0) return 0;
-        if (!fread(snd_buf, (int)(*length), 1, snd_fp)) return 0;
-        return snd_buf;
-    }
-    return 0;
-}
+#define STATE_ID 0x4d535331 /* "MSS1" */
 
-void save_undo(void)
+struct state_header
 {
-    uint8_t *tmp, i;
-    uint32_t tmp32;
+    uint32_t id, undo_size, base_sum, checksum, length;
+};
 
-    tmp = undo[0]; /* swap buffers */
-    undo[0] = undo[1];
-    undo[1] = tmp;
+const uint8_t* ms_ram(uint32_t* size)
+{
+    *size = code ? undo_size : 0;
+    return code;
+}
 
-    for (i = 0; i < 18; i++) {
-        tmp32 = undo_regs[0][i];
-        undo_regs[0][i] = undo_regs[1][i];
-        undo_regs[1][i] = tmp32;
-    }
+uint32_t ms_state_size(void)
+{
+    if (!code) return 0;
+    return sizeof(struct state_header) + offsetof(struct ms_session, ram) +
+           2 * (undo_size + session_stack_top()) + 20;
+}
 
-    memcpy(undo[1], code, undo_size);
-    for (i = 0; i < 8; i++) {
-        undo_regs[1][i] = dreg[i];
-        undo_regs[1][8 + i] = areg[i];
+uint32_t ms_state_save(uint8_t* buf, uint32_t size)
+{
+    struct ms_session s;
+    struct state_header h;
+    uint8_t *tmp, *out;
+    uint32_t len;
+
+    if (!code) return 0;
+    memset(&s, 0, sizeof(s));
+    if (!session_copy_out(&s)) return 0;
+    if (!(tmp = malloc(ms_state_size()))) {
+        free(s.stack);
+        return 0;
     }
-    undo_regs[1][16] = i_count;
-    undo_regs[1][17] = pc; /* status flags intentionally omitted */
-
-    undo_stat[0] = undo_stat[1];
-    undo_stat[1] = 1;
+    out = tmp + sizeof(h);
+    memcpy(out, &s, offsetof(struct ms_session, ram));
+    out += offsetof(struct ms_session, ram);
+    out = state_encode(out, code, restart, undo_size);
+    out = state_encode(out, s.stack, 0, s.stack_size);
+    free(s.stack);
+
+    len = (uint32_t)(out - tmp);
+    h.id = STATE_ID;
+    h.undo_size = undo_size;
+    h.base_sum = state_adler32(restart, undo_size);
+    h.length = len - sizeof(h);
+    h.checksum = state_adler32(tmp + sizeof(h), h.length);
+    memcpy(tmp, &h, sizeof(h));
+    if (len > size) len = 0;
+    else memcpy(buf, tmp, len);
+    free(tmp);
+    return len;
 }
 
-uint8_t ms_undo(void)
+uint8_t ms_state_restore(const uint8_t* buf, uint32_t size)
 {
-    uint8_t i;
-
-    ms_flush();
-    if (!undo_stat[0]) return 0;
+    struct ms_session s;
+    struct state_header h;
+    const uint8_t *in = buf + sizeof(h), *end = buf + size;
+    uint8_t ok = 0;
+
+    if (!code || size < sizeof(h) + offsetof(struct ms_session, ram)) return 0;
+    memcpy(&h, buf, sizeof(h));
+    if (h.id != STATE_ID || h.undo_size != undo_size ||
+        h.length != size - sizeof(h) ||
+        h.base_sum != state_adler32(restart, undo_size) ||
+        h.checksum != state_adler32(in, h.length))
+        return 0;
+    memset(&s, 0, sizeof(s));
+    memcpy(&s, in, offsetof(struct ms_session, ram));
+    in += offsetof(struct ms_session, ram);
+    if (s.stack_size > session_stack_top() ||
+        s.stack_lo != session_stack_top() - s.stack_size || s.pc >= mem_size)
+        return 0;
 
-    undo_stat[0] = undo_stat[1] = 0;
-    memcpy(code, undo[0], undo_size);
-    for (i = 0; i < 8; i++) {
-        dreg[i] = undo_regs[0][i];
-        areg[i] = undo_regs[0][8 + i];
+    /* nothing changes unless the whole state decodes */
+    s.ram = malloc(undo_size);
+    s.stack = malloc(s.stack_size ? s.stack_size : 1);
+    if (s.ram && s.stack && (in = state_decode(s.ram, restart, undo_size, in, end)) &&
+        state_decode(s.stack, 0, s.stack_size, in, end) == end) {
+        session_copy_in(&s);
+        undo_reset(); /* the history belongs to the game left behind */
+        undo_levels = 1;
+        ok = 1;
     }
-    i_count = undo_regs[0][16];
-    pc = undo_regs[0][17]; /* status flags intentionally omitted */
-    return 1;
+    if (s.ram) free(s.ram);
+    if (s.stack) free(s.stack);
+    return ok;
 }
 
 #ifdef LOGEMU
@@ -1468,6 +2666,9 @@ void ms_status(void)
         fprintf(stderr, " %8.8lx", (long)read_reg(8 + j, 3));
     fprintf(stderr, "\nPC=%5.5lx ZCNV=%d%d%d%d - %ld instructions\n", (long)pc,
             zflag & 1, cflag & 1, nflag & 1, vflag & 1, (long)i_count);
+#ifdef PROFILE
+    ms_profile();
+#endif
 }
 
 uint32_t ms_count(void)
@@ -1475,6 +2676,107 @@ uint32_t ms_count(void)
     return i_count;
 }
 
+void ms_suspend(void)
+{
+    pc = op_pc;
+    i_count--;
+    op_retry = 1;
+}
+
+/* what ends the running ms_run_slice, the front end reports it */
+uint8_t slice_status = MS_SLICE_BUDGET;
+
+void ms_yield(uint8_t status)
+{
+    if (status > slice_status) slice_status = status;
+}
+
+uint8_t ms_run_slice(uint32_t budget)
+{
+    slice_status = MS_SLICE_BUDGET;
+    while (budget--) {
+        if (!ms_rungame()) return MS_SLICE_STOPPED;
+        if (slice_status != MS_SLICE_BUDGET) return slice_status;
+    }
+    return MS_SLICE_BUDGET;
+}
+
+#ifdef PROFILE
+/* Ticks are inclusive: an opcode group contains its line A trap, which
+   contains the routines it calls. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PROF_TICKS() ((uint64_t)__builtin_ia32_rdtsc())
+#else
+#define PROF_TICKS() ((uint64_t)clock())
+#endif
+
+#define PROF_CALL(slot, call)                                                 \
+    do {                                                                      \
+        prof_slot* prof_s = &(slot);                                          \
+        uint64_t prof_t = PROF_TICKS();                                       \
+        call;                                                                 \
+        prof_s->count++;                                                      \
+        prof_s->ticks += PROF_TICKS() - prof_t;                               \
+    } while (0)
+
+typedef struct {
+    uint64_t count, ticks;
+} prof_slot;
+
+prof_slot prof_group[128], prof_line_a[256];
+prof_slot prof_dict_lookup, prof_write_string, prof_char_out;
+
+void prof_print(const char* name, prof_slot* s, uint64_t total)
+{
+    fprintf(stderr, "  %-14s %12llu %16llu %6.2f%%\n", name,
+            (unsigned long long)s->count, (unsigned long long)s->ticks,
+            total ? 100.0 * s->ticks / total : 0.0);
+}
+
+void prof_print_table(const char* title, const char* fmt, prof_slot* s,
+                      int n, uint64_t total)
+{
+    char name[16];
+    int i, j, best;
+    uint8_t* shown = calloc(n, 1);
+
+    fprintf(stderr, "%s\n", title);
+    for (i = 0; shown && i < n; i++) {
+        best = -1;
+        for (j = 0; j < n; j++)
+            if (!shown[j] && s[j].count &&
+                (best < 0 || s[j].ticks > s[best].ticks))
+                best = j;
+        if (best < 0) break;
+        shown[best] = 1;
+        sprintf(name, fmt, best);
+        prof_print(name, &s[best], total);
+    }
+    free(shown);
+}
+
+void ms_profile(void)
+{
+    uint64_t total = 0;
+    int i;
+
+    for (i = 0; i < 128; i++)
+        total += prof_group[i].ticks;
+    fprintf(stderr, "Profile:\n  %-14s %12s %16s %7s\n", "name", "count",
+            "ticks", "share");
+    prof_print_table("Opcode groups (byte1 >> 1):", "%.2X", prof_group, 128,
+                     total);
+    prof_print_table("Line A traps:", "A0%.2X", prof_line_a, 256, total);
+    fprintf(stderr, "Routines:\n");
+    prof_print("dict_lookup", &prof_dict_lookup, total);
+    prof_print("write_string", &prof_write_string, total);
+    prof_print("char_out", &prof_char_out, total);
+}
+#else
+#define PROF_CALL(slot, call) call
+#endif
+
 /* align register pointer for word/byte accesses */
 
 uint8_t* reg_align(uint8_t* ptr, uint8_t size)
@@ -1484,6 +2786,8 @@ uint8_t* reg_align(uint8_t* ptr, uint8_t size)
     return ptr;
 }
 
+#ifndef FAST_REGS
+
 uint32_t read_reg(int i, int s)
 {
     uint8_t* ptr;
@@ -1533,14 +2837,14 @@ void write_reg(int i, int s, uint32_t val)
     }
 }
 
+#endif
+
 /* [35c4] */
 
 void char_out(uint8_t c)
 {
-    static uint8_t big = 0, period = 0, pipe = 0;
-
     if (c == 0xff) {
-        big = 1;
+        out_big = 1;
         return;
     }
     c &= 0x7f;
@@ -1562,33 +2866,33 @@ void char_out(uint8_t c)
         c = 0x0a;
     }
     if (((c > 0x40) && (c < 0x5b)) || ((c > 0x60) && (c < 0x7b))) {
-        if (big) {
+        if (out_big) {
             c &= 0xdf;
-            big = 0;
+            out_big = 0;
         }
-        if (period) char_out(0x20);
+        if (out_period) char_out(0x20);
     }
-    period = 0;
+    out_period = 0;
     if (version < 4) {
         if ((c == 0x2e) || (c == 0x3f) || (c == 0x21) || (c == 0x0a))
-            big = 1;
+            out_big = 1;
         else if (c == 0x22)
-            big = 0;
+            out_big = 0;
     } else {
         if ((c == 0x20) && (lastchar == 0x0a)) return;
         if ((c == 0x2e) || (c == 0x3f) || (c == 0x21) || (c == 0x0a))
-            big = 1;
+            out_big = 1;
         else if (c == 0x22)
-            big = 0;
+            out_big = 0;
     }
     if (((c == 0x20) || (c == 0x0a)) && (c == lastchar)) return;
     if (version < 3) {
-        if (pipe) {
-            pipe = 0;
+        if (out_pipe) {
+            out_pipe = 0;
             return;
         }
         if (c == 0x7c) {
-            pipe = 1;
+            out_pipe = 1;
             return;
         }
     } else {
@@ -1601,8 +2905,11 @@ void char_out(uint8_t c)
     if (c == 0x5f) c = 0x20;
     if ((c == 0x2e) || (c == 0x2c) || (c == 0x3b) || (c == 0x3a) ||
         (c == 0x21) || (c == 0x3f))
-        period = 1;
-    ms_putchar(c);
+        out_period = 1;
+    if (msg_capture) {
+        if (msg_capture_len < MSG_CAPTURE_SIZE - 1) msg_capture[msg_capture_len++] = c;
+    } else
+        ms_putchar(c);
 }
 
 /* extract addressing mode information [1c6f] */
@@ -2097,6 +3404,45 @@ void check_lea(void)
 
 /* [33cc] */
 
+/* MOVEM to -(Ax) or from (Ax)+ in one go, the registers are laid out
+   big-endian like the memory. 0 if the loops of check_movem() and
+   check_movem2() are to do it: Ax is in the list, or the block doesn't
+   fit in memory in one piece. */
+
+uint8_t movem_block(uint8_t to_mem)
+{
+    uint16_t mask = (uint16_t)(byte1 << 8 | byte2);
+    uint8_t i, size = (opsize == 2) ? 4 : 2, *ptr, *reg;
+    uint32_t n = 0, addr = read_reg(8 + regnr, 2);
+
+    /* to memory bit 15 - i is register i, from memory bit i */
+    if (to_mem) {
+        if (mask & 1 << (7 - regnr)) return 0;
+    } else if (mask & 1 << (8 + regnr))
+        return 0;
+    for (i = 0; i < 16; i++)
+        if (mask & 1 << i) n++;
+    if (to_mem) addr -= n * size;
+    if (mem_wrap) {
+        if ((addr & 0xffff) + n * size > 0x10000) return 0;
+        ptr = code + (addr & 0xffff);
+    } else {
+        if (addr >= mem_size || n * size > mem_size - addr) return 0;
+        ptr = code + addr;
+    }
+    for (i = 0; i < 16; i++) {
+        if (!(mask & 1 << (to_mem ? 15 - i : i))) continue;
+        reg = (i < 8) ? (uint8_t*)&dreg[i] : (uint8_t*)&areg[i - 8];
+        if (to_mem)
+            memcpy(ptr, reg + 4 - size, size);
+        else
+            memcpy(reg + 4 - size, ptr, size);
+        ptr += size;
+    }
+    write_reg(8 + regnr, 2, to_mem ? addr : addr + n * size);
+    return 1;
+}
+
 void check_movem(void)
 {
     uint8_t l1c;
@@ -2106,6 +3452,7 @@ void check_movem(void)
 #endif
     set_info((uint8_t)(byte2 - 0x40));
     read_word();
+    if (admode == 4 && movem_block(1)) return;
     for (l1c = 0; l1c < 8; l1c++) {
         if (byte2 & 1 << l1c) {
             set_arg1();
@@ -2133,6 +3480,7 @@ void check_movem2(void)
 #endif
     set_info((uint8_t)(byte2 - 0x40));
     read_word();
+    if (admode == 3 && movem_block(0)) return;
     for (l1c = 0; l1c < 8; l1c++) {
         if (byte2 & 1 << l1c) {
             set_arg1();
@@ -2149,6 +3497,195 @@ void check_movem2(void)
     }
 }
 
+/* Dictionary index: dict_lookup() compares the input word against every
+   entry of the dictionary. The entries are listed once per dictionary start
+   offset, grouped by their first character, so only those that can match are
+   compared. The result is the same as the full scan, the skipped entries only
+   advance the bank and word counters. */
+
+#define DINDEX_SLOTS 4
+
+typedef struct {
+    uint16_t doff, word;
+    uint8_t bank; /* relative to D6 */
+} dict_entry;
+
+typedef struct {
+    dict_entry* entries; /* 0 if the dictionary can't be indexed */
+    uint32_t start[0x61];
+    uint16_t doff, end;
+} dict_index;
+
+dict_index dindex[DINDEX_SLOTS];
+uint8_t dindex_count = 0, dindex_next = 0;
+
+void dindex_free(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < dindex_count; i++)
+        if (dindex[i].entries) free(dindex[i].entries);
+    dindex_count = dindex_next = 0;
+}
+
+/* dictionary byte, 0 when outside the dictionary */
+int dindex_byte(uint32_t off, uint8_t* c)
+{
+    if (off > 0xffff) return 0;
+    if (sd) {
+        if (off >= dict_len) return 0;
+        *c = dict[off];
+    } else {
+        if (!mem_wrap && off >= mem_size)
+            return 0;
+        *c = effective(off)[0];
+    }
+    return 1;
+}
+
+dict_entry* dindex_scan(dict_index* x)
+{
+    dict_entry *list, *sorted;
+    uint32_t off = x->doff, n = 0, start, i, fill[0x60];
+    uint16_t word = 0;
+    uint8_t bank = 0, c, k;
+
+    if (!(list = malloc(sizeof(dict_entry) * 0x8000))) return 0;
+    memset(x->start, 0, sizeof(x->start));
+    while (dindex_byte(off, &c) && c != 0x81) {
+        if (c == 0x82) {
+            bank++;
+            word = 0;
+            off++;
+            continue;
+        }
+        start = off;
+        while (dindex_byte(off, &c) && c < 0x80)
+            off++;
+        /* a marker reached while comparing would end the scan early */
+        if (!dindex_byte(off, &c) || c == 0x81 || c == 0x82 || n >= 0x8000)
+            break;
+        off++;
+        dindex_byte(start, &c);
+        list[n].doff = (uint16_t)start;
+        list[n].word = word++;
+        list[n].bank = bank;
+        x->start[(c & 0x5f) + 1]++;
+        n++;
+    }
+    if (!dindex_byte(off, &c) || c != 0x81 ||
+        !(sorted = malloc(sizeof(dict_entry) * (n + 1)))) {
+        free(list);
+        return 0;
+    }
+    x->end = (uint16_t)off;
+
+    /* sort by first character, keeping dictionary order in each group */
+    for (k = 0; k < 0x60; k++) {
+        x->start[k + 1] += x->start[k];
+        fill[k] = x->start[k];
+    }
+    for (i = 0; i < n; i++) {
+        dindex_byte(list[i].doff, &c);
+        sorted[fill[c & 0x5f]++] = list[i];
+    }
+    free(list);
+    return sorted;
+}
+
+dict_index* dindex_get(uint16_t doff)
+{
+    dict_index* x;
+    uint8_t i;
+
+    for (i = 0; i < dindex_count; i++)
+        if (dindex[i].doff == doff) return &dindex[i];
+    if (dindex_count < DINDEX_SLOTS)
+        x = &dindex[dindex_count++];
+    else {
+        x = &dindex[dindex_next];
+        dindex_next = (dindex_next + 1) % DINDEX_SLOTS;
+        if (x->entries) free(x->entries);
+    }
+    x->doff = doff;
+    x->entries = dindex_scan(x);
+    return x;
+}
+
+uint32_t ms_vocab(void (*word)(const char* text, uint8_t bank))
+{
+    char text[64];
+    uint32_t off, count = 0;
+    uint8_t bank = 0, c, n = 0;
+
+    if (dict_start < 0) return 0;
+    for (off = (uint32_t)dict_start; dindex_byte(off, &c) && c != 0x81; off++) {
+        if (c == 0x82 && !n) {
+            bank++;
+            continue;
+        }
+        if (n < sizeof(text) - 1) text[n++] = (char)tolower(c & 0x7f);
+        if (c & 0x80) {
+            /* '_' ends a word early, words may end with a space */
+            while (n && (text[n - 1] == ' ' || text[n - 1] == '_'))
+                n--;
+            text[n] = 0;
+            if (n) {
+                word(text, bank);
+                count++;
+            }
+            n = 0;
+        }
+    }
+    return count;
+}
+
+/* The games whose location variable is known, by their version, code size
+   and undo pc, which tell the releases apart. */
+struct room_var {
+    uint8_t game_version;
+    uint32_t code_size, undo_pc, addr;
+    uint8_t size;
+};
+
+const struct room_var room_vars[] = {
+    {0, 0xd500, 0x3fb0, 0x1940, 2}, /* The Pawn */
+};
+
+void room_find(uint32_t code_size)
+{
+    uint32_t i;
+
+    room_addr = -1;
+    for (i = 0; i < sizeof(room_vars) / sizeof(room_vars[0]); i++) {
+        if (room_vars[i].game_version == version &&
+            room_vars[i].code_size == code_size &&
+            room_vars[i].undo_pc == undo_pc) {
+            room_addr = (int32_t)room_vars[i].addr;
+            room_size = room_vars[i].size;
+        }
+    }
+}
+
+void ms_room_var(int32_t addr, uint8_t size)
+{
+    room_user_addr = addr;
+    room_user_size = (size == 1) ? 1 : 2;
+}
+
+int32_t ms_room(void)
+{
+    int32_t addr = room_addr;
+    uint8_t size = room_size;
+
+    if (room_user_addr >= 0) {
+        addr = room_user_addr;
+        size = room_user_size;
+    }
+    if (!code || addr < 0 || (uint32_t)addr + size > mem_size) return -1;
+    return (size == 1) ? code[addr] : read_w(code + addr);
+}
+
 /* [30e4] in Jinxter, ~540 lines of 6510 spaghetti-code */
 /* The mother of all bugs, but hey - no gotos used :-) */
 
@@ -2157,7 +3694,10 @@ void dict_lookup(void)
     uint16_t dtab, doff, output, output_bak, bank, word, output2;
     uint16_t tmp16, i, obj_adj, adjlist, adjlist_bak;
     uint8_t c, c2, c3, flag, matchlen, longest, flag2;
-    uint8_t restart = 0, accept = 0;
+    uint8_t restart = 0, accept = 0, at_start = 1, base_bank;
+    uint32_t ia = 0, ea = 0, ib = 0, eb = 0;
+    dict_index* x;
+    dict_entry* e;
 
     /*
        dtab=A5.W                    ;dict_table offset <L22>
@@ -2172,6 +3712,7 @@ void dict_lookup(void)
     write_reg(8 + 5, 1, read_reg(8 + 6, 1));
     doff = (uint16_t)read_reg(8 + 3, 1);
     adjlist = (uint16_t)read_reg(8 + 0, 1);
+    if (dict_start < 0) dict_start = doff;
 
     bank = (uint16_t)read_reg(6, 0); /* l2d */
     flag = 0;                        /* l2c */
@@ -2180,7 +3721,37 @@ void dict_lookup(void)
     longest = 0;                     /* 30e2 */
     write_reg(0, 1, 0);              /* apostroph */
 
-    while ((c = sd ? dict[doff] : effective(doff)[0]) != 0x81) {
+    x = dindex_get(doff);
+    if (x->entries) {
+        /* entries starting with the first input character, and with '_'
+           which also matches the end of the input */
+        c = effective(read_reg(8 + 6, 1))[0] & 0x5f;
+        ia = x->start[c];
+        ea = x->start[c + 1];
+        if (!c) {
+            ib = x->start[0x5f];
+            eb = x->start[0x60];
+        }
+    }
+    base_bank = (uint8_t)bank;
+
+    for (;;) {
+        if (x->entries && at_start) {
+            e = 0;
+            if (ia < ea &&
+                (ib >= eb || x->entries[ia].doff < x->entries[ib].doff))
+                e = &x->entries[ia++];
+            else if (ib < eb)
+                e = &x->entries[ib++];
+            if (e) {
+                doff = e->doff;
+                bank = (uint16_t)(base_bank + e->bank);
+                word = e->word;
+            } else
+                doff = x->end;
+            at_start = 0;
+        }
+        if ((c = sd ? dict[doff] : effective(doff)[0]) == 0x81) break;
         if (c >= 0x80) {
             if (c == 0x82) {
                 flag = matchlen = 0;
@@ -2188,6 +3759,7 @@ void dict_lookup(void)
                 write_reg(8 + 6, 1, read_reg(8 + 5, 1));
                 bank++;
                 doff++;
+                at_start = 1;
                 continue;
             }
             c3 = c;
@@ -2243,6 +3815,7 @@ void dict_lookup(void)
                 while (effective(doff++)[0] < 0x80)
                     ;
             restart = 0;
+            at_start = 1;
         }
     }
     write_w(effective(read_reg(8 + 2, 1)), 0xffff);
@@ -2352,59 +3925,136 @@ void do_findprop(void)
     write_reg(8 + 0, 2, tmp * 14 + properties);
 }
 
+void huff_build(void)
+{
+    uint32_t node, bits;
+    uint8_t c, len;
+
+    for (node = 0; node < 0x80; node++) {
+        for (bits = 0; bits < 256; bits++) {
+            for (c = (uint8_t)node, len = 0; c < 0x80 && len < 8; len++)
+                c = decode_table[((bits >> len) & 1 ? 0x80 : 0) + c];
+            huff_table[node * 256 + bits] = (uint16_t)(c | len << 8);
+        }
+    }
+}
+
+void ms_message_ids(uint8_t on)
+{
+    msg_ids = on;
+}
+
+/* the next character of the string at bit position pos */
+uint8_t huff_char(uint32_t* pos)
+{
+    uint32_t i, window;
+    uint16_t e;
+    uint8_t c = 0;
+
+    do {
+        i = *pos >> 3;
+        window = i < text_size ? string[i] : 0;
+        if (i + 1 < text_size) window |= (uint32_t)string[i + 1] << 8;
+        e = huff_table[c * 256 + ((window >> (*pos & 7)) & 0xff)];
+        c = (uint8_t)e;
+        *pos += e >> 8;
+    } while (c < 0x80);
+    return c & 0x7f;
+}
+
+/* the byte offset of string number ptr, as write_string() finds it */
+uint32_t string_offset(uint16_t ptr)
+{
+    uint32_t offset;
+
+    if (!ptr) return 0;
+    offset = read_w(&decode_table[0x100 + 2 * ptr]);
+    if (read_w(&decode_table[0x100])) {
+        if (ptr >= read_w(&decode_table[0x100])) offset += string_size;
+    }
+    return offset;
+}
+
+/* The string offsets follow the decode tree up to the end of the text. The
+   text of each string is what ms_message_ids() would tag, up to the first
+   '@', and goes through char_out() as if it started a sentence. */
+uint32_t ms_messages(void (*message)(uint16_t id, const char* text))
+{
+    char text[MSG_CAPTURE_SIZE];
+    uint8_t c, save_last = lastchar, save_big = out_big, save_period = out_period,
+               save_pipe = out_pipe;
+    uint32_t table, n, id, pos, count = 0;
+
+    if (!string || !decode_table || !huff_table) return 0;
+    table = (uint32_t)(decode_table - string) + 0x100;
+    n = (table < text_size) ? (text_size - table) / 2 : 0;
+    if (n > 0x10000) n = 0x10000;
+    msg_capture = text;
+    for (id = 0; id < n; id++) {
+        pos = string_offset((uint16_t)id);
+        if (pos >= text_size) continue;
+        lastchar = 0x0a;
+        out_big = 1;
+        out_period = out_pipe = 0;
+        msg_capture_len = 0;
+        for (pos *= 8; (c = huff_char(&pos)) && c != 0x40;)
+            char_out(c);
+        text[msg_capture_len] = 0;
+        if (msg_capture_len) {
+            message((uint16_t)id, text);
+            count++;
+        }
+    }
+    msg_capture = 0;
+    lastchar = save_last;
+    out_big = save_big;
+    out_period = save_period;
+    out_pipe = save_pipe;
+    return count;
+}
+
 void write_string(void)
 {
-    static uint32_t offset_bak;
-    static uint8_t mask_bak;
-    uint8_t c, b, mask;
+    char tag[16];
+    uint8_t c, mask, tagged = 0;
     uint16_t ptr;
-    uint32_t offset;
+    uint32_t offset, pos;
 
+    trace_begin("text");
     if (!cflag) {
         /* new string */
         ptr = (uint16_t)read_reg(0, 1);
-        if (!ptr)
-            offset = 0;
-        else {
-            offset = read_w(&decode_table[0x100 + 2 * ptr]);
-            if (read_w(&decode_table[0x100])) {
-                if (ptr >= read_w(&decode_table[0x100])) offset += string_size;
-            }
+        /* not in the status bar */
+        if (msg_ids && !read_reg(3, 0)) {
+            sprintf(tag, "#[msg %u]", (unsigned)ptr);
+            output_text(tag);
+            tagged = 1;
         }
+        offset = string_offset(ptr);
         mask = 1;
     } else {
-        offset = offset_bak;
-        mask = mask_bak;
+        offset = string_offset_bak;
+        mask = string_mask_bak;
     }
+    /* the bit position, mask selects the bit of string[offset] */
+    for (pos = offset * 8; mask > 1; mask >>= 1)
+        pos++;
     do {
-        c = 0;
-        while (c < 0x80) {
-            if (offset >= string_size)
-                b = string2[offset - string_size];
-            else {
-                if (offset >= MAX_STRING_SIZE)
-                    b = string3[offset - MAX_STRING_SIZE];
-                else
-                    b = string[offset];
-            }
-            if (b & mask)
-                c = decode_table[0x80 + c];
-            else
-                c = decode_table[c];
-            mask <<= 1;
-            if (!mask) {
-                mask = 1;
-                offset++;
-            }
+        c = huff_char(&pos);
+        if (tagged && c == 0x40) {
+            output_text("#[/msg]");
+            tagged = 0;
         }
-        c &= 0x7f;
-        if (c && ((c != 0x40) || (lastchar != 0x20))) char_out(c);
+        if (c && ((c != 0x40) || (lastchar != 0x20)))
+            PROF_CALL(prof_char_out, char_out(c));
     } while (c && ((c != 0x40) || (lastchar != 0x20)));
     cflag = c ? 0xff : 0;
     if (c) {
-        offset_bak = offset;
-        mask_bak = mask;
+        string_offset_bak = pos >> 3;
+        string_mask_bak = (uint8_t)(1 << (pos & 7));
     }
+    if (tagged) output_text("#[/msg]");
+    trace_end();
 }
 
 void output_number(uint16_t number)
@@ -2724,7 +4374,7 @@ void do_line_a(void)
             write_reg(3, 0, read_reg(1, 0));
             do {
                 l1c = dict[ptr++];
-                char_out(l1c);
+                PROF_CALL(prof_char_out, char_out(l1c));
             } while (l1c < 0x80);
             write_reg(8 + 1, 1, ptr);
             write_reg(3, 0, tmp32);
@@ -2781,7 +4431,8 @@ void do_line_a(void)
             break;
 
         case 22:
-            char_out((uint8_t)read_reg(1, 0)); /* A0F3 */
+            PROF_CALL(prof_char_out,
+                      char_out((uint8_t)read_reg(1, 0))); /* A0F3 */
             break;
 
         case 23: /* D7=Save_(filename A0) D1 bytes starting from A1  A0F4 */
@@ -2809,7 +4460,7 @@ void do_line_a(void)
             break;
 
         case 27: /* write string [D0] [2999] A0F8 */
-            write_string();
+            PROF_CALL(prof_write_string, write_string());
             break;
 
         case 28: /* Z,D0=Get_inventory_item(D0) [2a9e] A0F9 */
@@ -2918,11 +4569,276 @@ void do_line_a(void)
             break;
 
         case 34: /* Dictionary_lookup A0FF */
-            dict_lookup();
+            PROF_CALL(prof_dict_lookup, dict_lookup());
             break;
         }
 }
 
+#ifndef NO_HLE
+
+/* High-level emulation: loops of the game library that the games spend
+   much of their time in are found when the code is loaded and run as C,
+   leaving the registers, flags and instruction count as emulating them
+   would. With ms_hle(2) the loop is emulated afterwards as well and the
+   results are compared where it ends. */
+
+#define HLE_STRCPY 1 /* loop: move.b (As)+,(Ad)+ ; bne.s loop */
+#define HLE_SCAN 2   /* loop: cmp.b (As)+,Dn ; dbeq Dm,loop */
+#define HLE_COPY 3   /* loop: move.s (As)+,(Ad)+ ; dbra Dm,loop */
+#define HLE_FILL 4   /* loop: clr.s (Ad)+ ; dbra Dm,loop */
+/* what the loop routines return */
+#define HLE_DONE 0   /* the core emulates the loop */
+#define HLE_END 1    /* the loop has run to its end */
+#define HLE_MORE 2   /* part of the loop has run, it goes on from the start */
+/* most bytes copied at once, the rest is copied from the loop start */
+#define HLE_MAX_COPY 0x10000
+
+struct hle_regs {
+    uint32_t dreg[8], areg[8], pc, i_count;
+    uint8_t zflag, nflag, cflag, vflag;
+};
+
+uint32_t hle_lo = 0, hle_hi = 0, hle_calls = 0, hle_mismatches = 0;
+uint32_t hle_start;
+struct hle_regs hle_expect;
+
+void hle_find(uint32_t code_size)
+{
+    uint32_t a;
+    uint16_t w1, w2, w3;
+
+    if (hle_map) free(hle_map);
+    hle_map = 0;
+    /* below undo_size is data, as for the decode cache */
+    hle_lo = undo_size & ~1;
+    hle_hi = (code_size < mem_size) ? code_size : mem_size;
+    if (hle_hi < hle_lo + 6 || !(hle_map = calloc((hle_hi - hle_lo) >> 1, 1)))
+        return;
+    for (a = hle_lo; a + 6 <= hle_hi; a += 2) {
+        w1 = read_w(code + a);
+        w2 = read_w(code + a + 2);
+        w3 = read_w(code + a + 4);
+        if ((w1 & 0xf1f8) == 0x10d8 && w2 == 0x66fc &&
+            (w1 & 7) != (w1 >> 9 & 7))
+            hle_map[(a - hle_lo) >> 1] = HLE_STRCPY;
+        else if ((w1 & 0xf1f8) == 0xb018 && (w2 & 0xfff8) == 0x57c8 &&
+                 w3 == 0xfffc && (w1 >> 9 & 7) != (w2 & 7))
+            hle_map[(a - hle_lo) >> 1] = HLE_SCAN;
+        else if (((w1 & 0xf1f8) == 0x10d8 || (w1 & 0xf1f8) == 0x20d8 ||
+                  (w1 & 0xf1f8) == 0x30d8) &&
+                 (w2 & 0xfff8) == 0x51c8 && w3 == 0xfffc &&
+                 (w1 & 7) != (w1 >> 9 & 7))
+            hle_map[(a - hle_lo) >> 1] = HLE_COPY;
+        else if ((w1 & 0xff38) == 0x4218 && (w1 & 0xc0) != 0xc0 &&
+                 (w2 & 0xfff8) == 0x51c8 && w3 == 0xfffc)
+            hle_map[(a - hle_lo) >> 1] = HLE_FILL;
+    }
+}
+
+/* the loop starting at ptr, 0 if there is none to run as C */
+uint8_t hle_at(uint32_t ptr)
+{
+    if (!hle_map || !hle_mode || hle_pending) return 0;
+    if (mem_wrap) ptr &= 0xffff;
+    if (ptr < hle_lo || ptr >= hle_hi) return 0;
+    return hle_map[(ptr - hle_lo) >> 1];
+}
+
+void hle_save(struct hle_regs* r)
+{
+    memcpy(r->dreg, dreg, sizeof(dreg));
+    memcpy(r->areg, areg, sizeof(areg));
+    r->pc = pc;
+    r->i_count = i_count;
+    r->zflag = zflag;
+    r->nflag = nflag;
+    r->cflag = cflag;
+    r->vflag = vflag;
+}
+
+void hle_load(const struct hle_regs* r)
+{
+    memcpy(dreg, r->dreg, sizeof(dreg));
+    memcpy(areg, r->areg, sizeof(areg));
+    pc = r->pc;
+    i_count = r->i_count;
+    zflag = r->zflag;
+    nflag = r->nflag;
+    cflag = r->cflag;
+    vflag = r->vflag;
+}
+
+/* a block of bytes at the virtual address ptr, 0 if it does not fit
+   in memory in one piece */
+uint8_t* hle_block(uint32_t ptr, uint32_t size)
+{
+    if (mem_wrap)
+        return ((ptr & 0xffff) + size <= 0x10000) ? code + (ptr & 0xffff) : 0;
+    return (ptr < mem_size && size <= mem_size - ptr) ? code + ptr : 0;
+}
+
+uint8_t hle_strcpy(void)
+{
+    uint8_t s = byte2 & 7, d = byte1 >> 1 & 7, c, *ptr;
+    uint32_t src = read_reg(8 + s, 2), dst = read_reg(8 + d, 2), n = 0;
+
+    do {
+        c = effective(src++)[0];
+        ptr = effective(dst++);
+        ptr[0] = c;
+        n++;
+    } while (c && n < HLE_MAX_COPY);
+    write_reg(8 + s, 2, src);
+    write_reg(8 + d, 2, dst);
+    cflag = vflag = 0;
+    zflag = c ? 0 : 0xff;
+    nflag = (c & 0x80) ? 0xff : 0;
+    /* a move and a bne per byte, ms_rungame counted the first */
+    i_count += 2 * n - 1;
+    pc = c ? op_pc : op_pc + 4;
+    return c ? HLE_MORE : HLE_END;
+}
+
+uint8_t hle_scan(void)
+{
+    uint8_t s = byte2 & 7, m = read_w(effective(op_pc + 2)) & 7, c, d, r;
+    uint16_t left = (uint16_t)read_reg(m, 1);
+    uint32_t src = read_reg(8 + s, 2), n = 0;
+
+    d = (uint8_t)read_reg(byte1 >> 1 & 7, 0);
+    do {
+        c = effective(src++)[0];
+        n++;
+    } while (c != d && --left != 0xffff);
+    write_reg(8 + s, 2, src);
+    write_reg(m, 1, left);
+    r = d - c;
+    cflag = (c > d) ? 0xff : 0;
+    vflag = 0;
+    zflag = r ? 0 : 0xff;
+    nflag = (r & 0x80) ? 0xff : 0;
+    i_count += 2 * n - 1;
+    pc = op_pc + 6;
+    return HLE_END;
+}
+
+/* Copies as the emulated moves would, element by element front to back.
+   That is memmove() unless the destination overlaps the source ahead. */
+uint8_t hle_copy(void)
+{
+    uint8_t s = byte2 & 7, d = byte1 >> 1 & 7, m, *from, *to, *last;
+    uint8_t size = (byte1 >> 4 == 1) ? 1 : (byte1 >> 4 == 3) ? 2 : 4;
+    uint32_t n, bytes, i, src = read_reg(8 + s, 2), dst = read_reg(8 + d, 2);
+
+    m = read_w(effective(op_pc + 2)) & 7;
+    n = read_reg(m, 1) + 1;
+    bytes = n * size;
+    if (!(from = hle_block(src, bytes)) || !(to = hle_block(dst, bytes)))
+        return HLE_DONE;
+    if (to <= from || to >= from + bytes)
+        memmove(to, from, bytes);
+    else
+        for (i = 0; i < bytes; i += size)
+            memmove(to + i, from + i, size);
+    write_reg(8 + s, 2, src + bytes);
+    write_reg(8 + d, 2, dst + bytes);
+    write_reg(m, 1, 0xffff);
+    last = to + bytes - size;
+    cflag = vflag = 0;
+    zflag = nflag = 0;
+    for (i = 0; i < size && !last[i]; i++)
+        ;
+    if (i == size) zflag = 0xff;
+    if (last[0] & 0x80) nflag = 0xff;
+    i_count += 2 * n - 1;
+    pc = op_pc + 6;
+    return HLE_END;
+}
+
+uint8_t hle_fill(void)
+{
+    uint8_t d = byte2 & 7, size = 1 << (byte2 >> 6), m, *to;
+    uint32_t n, bytes, dst = read_reg(8 + d, 2);
+
+    m = read_w(effective(op_pc + 2)) & 7;
+    n = read_reg(m, 1) + 1;
+    bytes = n * size;
+    if (!(to = hle_block(dst, bytes))) return HLE_DONE;
+    memset(to, 0, bytes);
+    write_reg(8 + d, 2, dst + bytes);
+    write_reg(m, 1, 0xffff);
+    nflag = cflag = 0; /* clr keeps V */
+    zflag = 0xff;
+    i_count += 2 * n - 1;
+    pc = op_pc + 6;
+    return HLE_END;
+}
+
+/* Run the loop at op_pc as C, 0 if the core is to emulate it instead */
+uint8_t hle_run(uint8_t kind)
+{
+    struct hle_regs before;
+    uint8_t done;
+
+    if (hle_mode == 2) hle_save(&before);
+    switch (kind) {
+    case HLE_STRCPY:
+        done = hle_strcpy();
+        break;
+    case HLE_SCAN:
+        done = hle_scan();
+        break;
+    case HLE_COPY:
+        done = hle_copy();
+        break;
+    default:
+        done = hle_fill();
+        break;
+    }
+    if (done == HLE_DONE) return 0;
+    hle_calls++;
+    if (hle_mode != 2) return 1;
+    if (done == HLE_END) {
+        hle_save(&hle_expect);
+        hle_start = op_pc;
+        hle_pending = 1;
+    }
+    hle_load(&before);
+    return 0;
+}
+
+/* the emulated loop of mode 2 has ended, it should agree with the C one */
+void hle_compare(void)
+{
+    struct hle_regs now;
+
+    hle_pending = 0;
+    hle_save(&now);
+    if (!memcmp(now.dreg, hle_expect.dreg, sizeof(dreg)) &&
+        !memcmp(now.areg, hle_expect.areg, sizeof(areg)) &&
+        now.i_count == hle_expect.i_count && now.zflag == hle_expect.zflag &&
+        now.nflag == hle_expect.nflag && now.cflag == hle_expect.cflag &&
+        now.vflag == hle_expect.vflag)
+        return;
+    hle_mismatches++;
+    fprintf(stderr, "hle: loop at %.4lx differs after %lu instructions\n",
+            (unsigned long)hle_start, (unsigned long)i_count);
+}
+
+void ms_hle(uint8_t mode)
+{
+    hle_mode = mode;
+    hle_pending = 0;
+}
+
+uint32_t ms_hle_count(uint32_t* mismatches)
+{
+    if (mismatches) *mismatches = hle_mismatches;
+    return hle_calls;
+}
+
+#endif
+
 /* emulate an instruction [1b7e] */
 
 uint8_t ms_rungame(void)
@@ -2933,9 +4849,19 @@ uint8_t ms_rungame(void)
 #ifdef LOGEMU
     static int stat = 0;
 #endif
+#ifdef PROFILE
+    prof_slot* prof_s;
+    uint64_t prof_t = PROF_TICKS();
+#endif
 
     if (!running) return running;
-    if (pc == undo_pc) save_undo();
+    /* a retried input opcode already took its undo snapshot */
+    if (pc == undo_pc && !op_retry) save_undo();
+    op_retry = 0;
+#ifndef NO_HLE
+    if (hle_pending && pc == hle_expect.pc) hle_compare();
+#endif
+    op_pc = pc;
 
 #ifdef LOGEMU
     if (pc == 0x0000) stat = 0;
@@ -2948,6 +4874,9 @@ uint8_t ms_rungame(void)
 #endif
     i_count++;
     read_word();
+#ifdef PROFILE
+    prof_s = &prof_group[byte1 >> 1];
+#endif
     switch (byte1 >> 1) {
 
         /* 00-0F */
@@ -3087,6 +5016,12 @@ uint8_t ms_rungame(void)
 
 #ifdef LOGEMU
         out("move.b");
+#endif
+#ifndef NO_HLE
+        if ((byte2 & 0xf8) == 0xd8 &&
+            ((l1c = hle_at(op_pc)) == HLE_STRCPY || l1c == HLE_COPY) &&
+            hle_run(l1c))
+            break;
 #endif
         set_info((uint8_t)(byte2 & 0x3f));
         set_arg1();
@@ -3109,6 +5044,11 @@ uint8_t ms_rungame(void)
 
 #ifdef LOGEMU
         out("move.l");
+#endif
+#ifndef NO_HLE
+        if ((byte2 & 0xf8) == 0xd8 && hle_at(op_pc) == HLE_COPY &&
+            hle_run(HLE_COPY))
+            break;
 #endif
         set_info((uint8_t)((byte2 & 0x3f) | 0x80));
         set_arg1();
@@ -3131,6 +5071,11 @@ uint8_t ms_rungame(void)
 
 #ifdef LOGEMU
         out("move.w");
+#endif
+#ifndef NO_HLE
+        if ((byte2 & 0xf8) == 0xd8 && hle_at(op_pc) == HLE_COPY &&
+            hle_run(HLE_COPY))
+            break;
 #endif
         set_info((uint8_t)((byte2 & 0x3f) | 0x40));
         set_arg1();
@@ -3160,6 +5105,11 @@ uint8_t ms_rungame(void)
                 /* CLR */
 #ifdef LOGEMU
                 out("clr");
+#endif
+#ifndef NO_HLE
+                if ((byte2 & 0x38) == 0x18 && hle_at(op_pc) == HLE_FILL &&
+                    hle_run(HLE_FILL))
+                    break;
 #endif
                 set_info(byte2);
                 set_arg1();
@@ -3560,7 +5510,7 @@ uint8_t ms_rungame(void)
     case 0x50:
     case 0x56:
     case 0x57: /* [2521] */
-        do_line_a();
+        PROF_CALL(prof_line_a[byte2], do_line_a());
 #ifdef LOGEMU
         out("LINE_A A0%.2X", byte2);
 #endif
@@ -3617,6 +5567,11 @@ uint8_t ms_rungame(void)
     case 0x5e:
     case 0x5f:
 
+#ifndef NO_HLE
+        if ((byte2 & 0xf8) == 0x18 && !(byte1 & 0x01) &&
+            hle_at(op_pc) == HLE_SCAN && hle_run(HLE_SCAN))
+            break;
+#endif
         if ((byte2 & 0xc0) == 0xc0) {
 #ifdef LOGEMU
             out("cmp");
@@ -3844,7 +5799,7 @@ uint8_t ms_rungame(void)
 
         if (version == 0) {
             /* hardcoded jump */
-            char_out(l1c = (uint8_t)read_reg(1, 0));
+            PROF_CALL(prof_char_out, char_out(l1c = (uint8_t)read_reg(1, 0)));
         } else if (version == 1) {
             /* single programmable shortcut */
             push(pc);
@@ -3873,6 +5828,10 @@ uint8_t ms_rungame(void)
     }
 #ifdef LOGEMU
     fprintf(dbg_log, "\n");
+#endif
+#ifdef PROFILE
+    prof_s->count++;
+    prof_s->ticks += PROF_TICKS() - prof_t;
 #endif
     return running;
 }
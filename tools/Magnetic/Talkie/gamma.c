@@ -0,0 +1,160 @@
+/****************************************************************************\
+*
+* Magnetic - Magnetic Scrolls Interpreter.
+*
+* Written by Niclas Karlsson <nkarlsso@abo.fi>,
+*            David Kinder <davidk@davidkinder.co.uk>,
+*            Stefan Meier <Stefan.Meier@if-legends.org> and
+*            Paul David Doherty <pdd@if-legends.org>
+*
+* Copyright (C) 1997-2023  Niclas Karlsson
+*
+*     This program is free software; you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation; either version 2 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program; if not, write to the Free Software
+*     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA.
+*
+*     Automatic gamma correction of pictures gamma.c
+*
+\****************************************************************************/
+
+/* gms_graphics_select_gamma() and its helpers from Glk/glk.c. The search
+   is the same, with integer arithmetic that gives the same levels, but the
+   picture is only scanned for the colours it uses, and the 17 luminances
+   are sorted by insertion instead of qsort(). */
+
+#include <stddef.h>
+#include "gamma.h"
+
+/* BEGIN { max=255.0; step=max/7.0
+           for (gamma=0.9; gamma<=2.7; gamma+=0.05) {
+               printf "    {0, "
+               for (i=1; i<8; i++) {
+                   printf "%3.0f", (((step*i / max) ^ (1.0/gamma)) * max)
+                   printf "%s", (i<7) ? ", " : ""
+               }
+               printf "},\n"
+           } } */
+static const uint8_t gamma_table[GAMMA_LEVELS][8] = {
+    {0,  29,  63,  99, 137, 175, 215, 255},
+    {0,  33,  68, 105, 141, 179, 217, 255},
+    {0,  36,  73, 109, 146, 182, 219, 255},
+    {0,  40,  77, 114, 150, 185, 220, 255},
+    {0,  43,  82, 118, 153, 188, 222, 255},
+    {0,  47,  86, 122, 157, 190, 223, 255},
+    {0,  50,  90, 126, 160, 193, 224, 255},
+    {0,  54,  94, 129, 163, 195, 225, 255},
+    {0,  57,  97, 133, 166, 197, 226, 255},
+    {0,  60, 101, 136, 168, 199, 227, 255},
+    {0,  64, 104, 139, 171, 201, 228, 255},
+    {0,  67, 107, 142, 173, 202, 229, 255},
+    {0,  70, 111, 145, 176, 204, 230, 255},
+    {0,  73, 114, 148, 178, 205, 231, 255},
+    {0,  76, 117, 150, 180, 207, 232, 255},
+    {0,  78, 119, 153, 182, 208, 232, 255},
+    {0,  81, 122, 155, 183, 209, 233, 255},
+    {0,  84, 125, 157, 185, 210, 233, 255},
+    {0,  87, 127, 159, 187, 212, 234, 255},
+    {0,  89, 130, 161, 188, 213, 235, 255},
+    {0,  92, 132, 163, 190, 214, 235, 255},
+    {0,  94, 134, 165, 191, 215, 236, 255},
+    {0,  96, 136, 167, 193, 216, 236, 255},
+    {0,  99, 138, 169, 194, 216, 237, 255},
+    {0, 101, 140, 170, 195, 217, 237, 255},
+    {0, 103, 142, 172, 197, 218, 237, 255},
+    {0, 105, 144, 173, 198, 219, 238, 255},
+    {0, 107, 146, 175, 199, 220, 238, 255},
+    {0, 109, 148, 176, 200, 220, 238, 255},
+    {0, 111, 150, 178, 201, 221, 239, 255},
+    {0, 113, 151, 179, 202, 222, 239, 255},
+    {0, 115, 153, 180, 203, 222, 239, 255},
+    {0, 117, 154, 182, 204, 223, 240, 255},
+    {0, 119, 156, 183, 205, 223, 240, 255},
+    {0, 121, 158, 184, 206, 224, 240, 255},
+    {0, 122, 159, 185, 206, 225, 241, 255},
+    {0, 124, 160, 186, 207, 225, 241, 255},
+};
+
+/* The variance of the differences in luminance between the used colours
+   at a level, black included, as gms_graphics_contrast_variance() */
+static long gamma_variance(uint16_t* pal, uint16_t used, uint8_t level)
+{
+    const uint8_t* t = gamma_table[level];
+    int luminance[17], count = 0, i, j, l, has_black = 0, mean;
+    long sum;
+
+    for (i = 0; i < 16; i++) {
+        if (!(used & (1 << i))) continue;
+        l = (t[(pal[i] >> 8) & 7] * 299 + t[(pal[i] >> 4) & 7] * 587 +
+             t[pal[i] & 7] * 114) / 1000;
+        has_black |= l == 0;
+        for (j = count++; j > 0 && luminance[j - 1] > l; j--)
+            luminance[j] = luminance[j - 1];
+        luminance[j] = l;
+    }
+    if (!has_black) {
+        for (j = count++; j > 0; j--)
+            luminance[j] = luminance[j - 1];
+        luminance[0] = 0;
+    }
+
+    for (i = 0, sum = 0; i < count - 1; i++)
+        sum += luminance[i + 1] - luminance[i];
+    mean = sum / (count - 1);
+    for (i = 0, sum = 0; i < count - 1; i++) {
+        l = luminance[i + 1] - luminance[i] - mean;
+        sum += (long)l * l;
+    }
+    return sum / (count - 1);
+}
+
+uint8_t gamma_contrast(uint8_t* bitmap, uint16_t w, uint16_t h,
+                       uint16_t* pal)
+{
+    size_t i, n = (size_t)w * h;
+    uint16_t used = 0;
+    uint8_t level, best = GAMMA_LINEAR;
+    long variance, lowest = 0;
+
+    for (i = 0; i < n && used != 0xffff; i++)
+        used |= 1 << (bitmap[i] & 15);
+    if (!used || !(used & (used - 1))) return GAMMA_LINEAR;
+
+    for (level = 0; level < GAMMA_LEVELS; level++) {
+        variance = gamma_variance(pal, used, level);
+        if (!level || variance < lowest) {
+            best = level;
+            lowest = variance;
+        }
+    }
+    return best;
+}
+
+uint8_t gamma_select(uint8_t contrast, uint8_t mode)
+{
+    if (mode == GAMMA_OFF || contrast >= GAMMA_LEVELS) return GAMMA_LINEAR;
+    if (mode == GAMMA_NORMAL)
+        return (uint8_t)(GAMMA_LINEAR + (contrast - GAMMA_LINEAR) / 2);
+    return contrast;
+}
+
+void gamma_palette(uint16_t* pal, uint8_t level, uint8_t* rgb)
+{
+    const uint8_t* t = gamma_table[level < GAMMA_LEVELS ? level : GAMMA_LINEAR];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        rgb[3 * i] = t[(pal[i] >> 8) & 7];
+        rgb[3 * i + 1] = t[(pal[i] >> 4) & 7];
+        rgb[3 * i + 2] = t[pal[i] & 7];
+    }
+}
@@ -0,0 +1,85 @@
+/****************************************************************************\
+*
+* Magnetic - Magnetic Scrolls Interpreter.
+*
+* Written by Niclas Karlsson <nkarlsso@abo.fi>,
+*            David Kinder <davidk@davidkinder.co.uk>,
+*            Stefan Meier <Stefan.Meier@if-legends.org> and
+*            Paul David Doherty <pdd@if-legends.org>
+*
+* Copyright (C) 1997-2023  Niclas Karlsson
+*
+*     This program is free software; you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation; either version 2 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program; if not, write to the Free Software
+*     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA.
+*
+*     Automatic gamma correction of pictures gamma.h
+*
+\****************************************************************************/
+
+#ifndef MAGNETIC_GAMMA_H
+#define MAGNETIC_GAMMA_H
+
+#include "defs.h"
+
+/****************************************************************************\
+* The automatic gamma correction of the Glk port. The 3 bit colour
+* components of a picture's palette are scaled to 0-255 through one of
+* GAMMA_LEVELS tables, gamma 0.90 to 2.70 in steps of 0.05. The level that
+* gives the most even contrast between the colours the picture uses only
+* depends on the picture, so it is found once with gamma_contrast() (see
+* ms_picture_contrast(), which keeps it with the picture cache), and
+* gamma_select() then applies the correction mode to it.
+\****************************************************************************/
+
+#define GAMMA_LEVELS 37
+#define GAMMA_LINEAR 2 /* 1.00 */
+
+#define GAMMA_OFF 0    /* always GAMMA_LINEAR */
+#define GAMMA_NORMAL 1 /* half way from linear to the most even contrast */
+#define GAMMA_HIGH 2   /* the most even contrast */
+
+/****************************************************************************\
+* Function: gamma_contrast
+*
+* Purpose: Finds the level that gives the colours of a picture the most
+*          even contrast
+*
+* Parameters:   uint8_t*    bitmap      the picture, as ms_extract returns it
+*               uint16_t    w, h        its width and height
+*               uint16_t*   pal         its palette
+*
+* Return: the level, GAMMA_LINEAR if the picture has one colour or none
+\****************************************************************************/
+
+uint8_t gamma_contrast(uint8_t * bitmap, uint16_t w, uint16_t h,
+                       uint16_t * pal);
+
+/****************************************************************************\
+* Function: gamma_select
+*
+* Purpose: The level to show a picture at, from its gamma_contrast() level
+*          and a GAMMA_ mode
+\****************************************************************************/
+
+uint8_t gamma_select(uint8_t contrast, uint8_t mode);
+
+/****************************************************************************\
+* Function: gamma_palette
+*
+* Purpose: Converts a palette to 16 RGB triples at the given level
+\****************************************************************************/
+
+void gamma_palette(uint16_t * pal, uint8_t level, uint8_t * rgb);
+
+#endif
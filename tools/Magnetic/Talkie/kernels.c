@@ -0,0 +1,272 @@
+/****************************************************************************\
+*
+* Magnetic - Magnetic Scrolls Interpreter.
+*
+* Written by Niclas Karlsson <nkarlsso@abo.fi>,
+*            David Kinder <davidk@davidkinder.co.uk>,
+*            Stefan Meier <Stefan.Meier@if-legends.org> and
+*            Paul David Doherty <pdd@if-legends.org>
+*
+* Copyright (C) 1997-2023  Niclas Karlsson
+*
+*     This program is free software; you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation; either version 2 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program; if not, write to the Free Software
+*     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA.
+*
+*     Microbenchmarks of the decoding kernels kernels.c
+*
+\****************************************************************************/
+
+/* magnetic-kernels: times the decoders of emu.c on their own, rather than
+   as part of a replay:
+
+       magnetic-kernels game.mag [game.gfx [walkthrough.rec]]
+
+   "extract" decodes every picture of the graphics file (ms_extract1() or
+   ms_extract2(), through ms_extract_index()), "messages" the text of every
+   string (the Huffman decoding of write_string(), through ms_messages()).
+   dict_lookup() works on the registers the game sets up while it parses, so
+   the walkthrough is replayed and the calls are timed where they happen,
+   with the PROFILE counters of emu.c. The tool is built with PICTURE_CACHE
+   0, or all but the first pass would be copies from the cache. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "defs.h"
+
+/* the passes of a kernel are repeated until they took this long */
+#define KERNEL_TIME 0.25
+
+#ifdef PROFILE
+/* as in emu.c */
+#    if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#        define KERNEL_TICKS() ((uint64_t)__builtin_ia32_rdtsc())
+#    else
+#        define KERNEL_TICKS() ((uint64_t)clock())
+#    endif
+
+typedef struct {
+    uint64_t count, ticks;
+} prof_slot;
+
+extern prof_slot prof_dict_lookup;
+#endif
+
+FILE* script = 0;
+uint32_t message_bytes = 0;
+
+uint8_t ms_load_file(const char* name, uint8_t* ptr, uint16_t size)
+{
+    (void)name;
+    (void)ptr;
+    (void)size;
+    return 1;
+}
+
+uint8_t ms_save_file(const char* name, uint8_t* ptr, uint16_t size)
+{
+    (void)name;
+    (void)ptr;
+    (void)size;
+    return 1;
+}
+
+void ms_statuschar(uint8_t c)
+{
+    (void)c;
+}
+
+void ms_putchar(uint8_t c)
+{
+    (void)c;
+}
+
+void ms_flush(void) {}
+
+/* the walkthrough without its "#" lines, the game stops at its end */
+uint8_t ms_getchar(uint8_t trans)
+{
+    static uint8_t start = 1;
+    int c;
+
+    (void)trans;
+    while (script && (c = fgetc(script)) != EOF) {
+        if (start && c == '#') {
+            while ((c = fgetc(script)) != EOF && c != '\n')
+                ;
+            continue;
+        }
+        if (c == '\r') continue;
+        start = (c == '\n');
+        return (uint8_t)c;
+    }
+    ms_stop();
+    return '\n';
+}
+
+void ms_showpic(uint32_t c, uint8_t mode)
+{
+    (void)c;
+    (void)mode;
+}
+
+void ms_fatal(const char* txt)
+{
+    fprintf(stderr, "Fatal error: %s\n", txt);
+    exit(1);
+}
+
+uint8_t ms_showhints(struct ms_hint* hints)
+{
+    (void)hints;
+    return 0;
+}
+
+void ms_playmusic(uint8_t* midi_data, uint32_t length, uint16_t tempo)
+{
+    (void)midi_data;
+    (void)length;
+    (void)tempo;
+}
+
+double kernel_now(void)
+{
+#ifdef __unix__
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+const char* base_name(const char* path)
+{
+    const char* p = strrchr(path, '/');
+    return p ? p + 1 : path;
+}
+
+/* mbs < 0 if the kernel has no byte count */
+void report(const char* kernel, const char* game, uint32_t ops, double ns,
+            double mbs)
+{
+    char rate[16];
+
+    if (mbs < 0)
+        strcpy(rate, "-");
+    else
+        sprintf(rate, "%.2f", mbs);
+    printf("%-20s %-18s %8lu %10.1f %9s\n", kernel, game, (unsigned long)ops,
+           ns, rate);
+}
+
+void bench_extract(const char* game)
+{
+    uint16_t count = ms_picture_count(), n, w, h, pal[16];
+    uint32_t pictures, passes = 0;
+    double start, elapsed, bytes = 0;
+
+    if (!count) return;
+    start = kernel_now();
+    do {
+        for (n = 0, pictures = 0; n < count; n++) {
+            if (ms_extract_index(n, &w, &h, pal, 0)) {
+                bytes += (double)w * h;
+                pictures++;
+            }
+        }
+        passes++;
+    } while ((elapsed = kernel_now() - start) < KERNEL_TIME);
+    report("extract", game, pictures,
+           pictures ? elapsed * 1e9 / ((double)pictures * passes) : 0,
+           bytes / elapsed / 1e6);
+}
+
+void count_message(uint16_t id, const char* text)
+{
+    (void)id;
+    message_bytes += (uint32_t)strlen(text);
+}
+
+void bench_messages(const char* game)
+{
+    uint32_t messages, passes = 0;
+    double start, elapsed, bytes = 0;
+
+    start = kernel_now();
+    do {
+        message_bytes = 0;
+        messages = ms_messages(count_message);
+        bytes += message_bytes;
+        passes++;
+    } while ((elapsed = kernel_now() - start) < KERNEL_TIME && messages);
+    report("messages", game, messages,
+           messages ? elapsed * 1e9 / ((double)messages * passes) : 0,
+           bytes / elapsed / 1e6);
+}
+
+#ifdef PROFILE
+void bench_dict_lookup(const char* game, const char* rec)
+{
+    uint64_t ticks;
+    double start;
+
+    if (!(script = fopen(rec, "rb"))) {
+        fprintf(stderr, "%s: cannot open walkthrough\n", rec);
+        return;
+    }
+    ms_seed(7);
+    prof_dict_lookup.count = prof_dict_lookup.ticks = 0;
+    start = kernel_now();
+    ticks = KERNEL_TICKS();
+    while (ms_rungame())
+        ;
+    /* the ticks in nanoseconds, from the length of the replay */
+    ticks = KERNEL_TICKS() - ticks;
+    report("dict_lookup", game, (uint32_t)prof_dict_lookup.count,
+           prof_dict_lookup.count && ticks
+               ? (kernel_now() - start) * 1e9 * prof_dict_lookup.ticks / ticks /
+                     prof_dict_lookup.count
+               : 0,
+           -1);
+    fclose(script);
+    script = 0;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+    const char* game;
+
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage: %s game.mag [game.gfx [walkthrough.rec]]\n",
+                argv[0]);
+        return 1;
+    }
+    if (!ms_init(argv[1], argc > 2 ? argv[2] : 0, 0, 0)) {
+        fprintf(stderr, "%s: cannot load the game\n", argv[1]);
+        return 1;
+    }
+    game = base_name(argv[1]);
+    printf("%-20s %-18s %8s %10s %9s\n", "kernel", "game", "ops", "ns/op",
+           "MB/s");
+    bench_extract(game);
+    bench_messages(game);
+#ifdef PROFILE
+    if (argc > 3) bench_dict_lookup(game, argv[3]);
+#endif
+    ms_freemem();
+    return 0;
+}
@@ -0,0 +1,313 @@
+/****************************************************************************\
+*
+* Magnetic - Magnetic Scrolls Interpreter.
+*
+* Written by Niclas Karlsson <nkarlsso@abo.fi>,
+*            David Kinder <davidk@davidkinder.co.uk>,
+*            Stefan Meier <Stefan.Meier@if-legends.org> and
+*            Paul David Doherty <pdd@if-legends.org>
+*
+* Copyright (C) 1997-2023  Niclas Karlsson
+*
+*     This program is free software; you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation; either version 2 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program; if not, write to the Free Software
+*     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA.
+*
+*     Library interface maglib.c, see maglib.h
+*
+\****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "maglib.h"
+#include "events.h"
+#ifdef HAS_BUNDLE
+#include "bundle.h"
+#endif
+
+/* the text printed and not yet taken by mag_output() */
+static char* text_buf = 0;
+static uint32_t text_len = 0, text_size = 0;
+
+static char input_line[256];
+static uint16_t input_pos = 0;
+static uint8_t input_ready = 0;
+
+static char status_line[80], status_shown[80];
+static uint8_t status_len = 0;
+
+static uint32_t pic_shown = 0;
+static uint8_t pic_new = 0;
+
+static const char* fatal_error = 0;
+
+/* with mag_events(), what has yet to go into the ring besides the text */
+static struct ev_ring* events = 0;
+static uint8_t status_new = 0, prompt_new = 0, prompt_sent = 0;
+static uint8_t* pic_data = 0;
+static unsigned long pic_len = 0;
+
+/* the data of an EV_PICTURE event, see mag_events() */
+static uint8_t* picture_data(unsigned long* len)
+{
+    uint16_t w, h, pal[16];
+    uint8_t *pixels = ms_extract(pic_shown, &w, &h, pal, 0), *data;
+
+    *len = pixels ? 36 + (unsigned long)w * h : 0;
+    if (*len > ev_max(events)) *len = 0;
+    if (!(data = malloc(*len ? *len : 1))) {
+        *len = 0;
+        return 0;
+    }
+    if (*len) {
+        memcpy(data, &w, 2);
+        memcpy(data + 2, &h, 2);
+        memcpy(data + 4, pal, 32);
+        memcpy(data + 36, pixels, *len - 36);
+    }
+    return data;
+}
+
+/* 0 and the slice ends if some of it has to wait for room */
+static uint8_t events_send(void)
+{
+    unsigned long n;
+
+    while (text_len) {
+        if ((n = ev_room(events)) > text_len) n = text_len;
+        if (!n || ev_put(events, EV_TEXT, 0, text_buf, n)) goto full;
+        memmove(text_buf, text_buf + n, text_len - n);
+        text_len -= (uint32_t)n;
+    }
+    if (status_new) {
+        if (ev_put(events, EV_META, 0, status_shown, strlen(status_shown))) goto full;
+        status_new = 0;
+    }
+    if (pic_new) {
+        /* decoded once, however long it waits */
+        if (!pic_data) pic_data = picture_data(&pic_len);
+        if (ev_put(events, EV_PICTURE, (long)pic_shown, pic_data, pic_len)) goto full;
+        free(pic_data);
+        pic_data = 0;
+        pic_new = 0;
+    }
+    if (prompt_new) {
+        if (ev_put(events, EV_PROMPT, 0, 0, 0)) goto full;
+        prompt_new = 0;
+    }
+    return 1;
+full:
+    ms_yield(MS_SLICE_OUTPUT);
+    return 0;
+}
+
+uint8_t ms_load_file(const char* name, uint8_t* ptr, uint16_t size)
+{
+    FILE* fh;
+
+    /* without a name the game asks the player, the host has ms_state_save */
+    if (!name || !(fh = fopen(name, "rb"))) return 1;
+    if (fread(ptr, 1, size, fh) != size) {
+        fclose(fh);
+        return 1;
+    }
+    fclose(fh);
+    return 0;
+}
+
+uint8_t ms_save_file(const char* name, uint8_t* ptr, uint16_t size)
+{
+    FILE* fh;
+
+    if (!name || !(fh = fopen(name, "wb"))) return 1;
+    if (fwrite(ptr, 1, size, fh) != size) {
+        fclose(fh);
+        return 1;
+    }
+    fclose(fh);
+    return 0;
+}
+
+void ms_statuschar(uint8_t c)
+{
+    if (c != 0x0a) {
+        if (status_len < sizeof(status_line) - 1) status_line[status_len++] = (char)c;
+        return;
+    }
+    status_line[status_len] = 0;
+    status_len = 0;
+    strcpy(status_shown, status_line);
+    if (events) status_new = 1;
+}
+
+void ms_putchar(uint8_t c)
+{
+    if (c == 0x08) {
+        if (text_len > 0) text_len--;
+        return;
+    }
+    if (text_len == text_size) {
+        uint32_t size = text_size ? text_size * 2 : 4096;
+        char* grown = realloc(text_buf, size);
+        if (!grown) return;
+        text_buf = grown;
+        text_size = size;
+    }
+    text_buf[text_len++] = (char)c;
+    if (events && c == 0x0a) events_send();
+}
+
+void ms_flush(void)
+{
+    if (events)
+        events_send();
+    else if (text_len)
+        ms_yield(MS_SLICE_OUTPUT);
+}
+
+uint8_t ms_getchar(uint8_t trans)
+{
+    (void)trans;
+    if (!input_ready) {
+        /* run the opcode again once there is input */
+        if (events && !prompt_sent) prompt_new = prompt_sent = 1;
+        ms_suspend();
+        ms_yield(MS_SLICE_INPUT);
+        return 1;
+    }
+    prompt_sent = 0;
+    if (!input_line[input_pos]) {
+        input_ready = 0;
+        input_pos = 0;
+        return '\n';
+    }
+    return (uint8_t)input_line[input_pos++];
+}
+
+void ms_showpic(uint32_t c, uint8_t mode)
+{
+    /* mode: 0 gfx off, 1 gfx on (thumbnails), 2 gfx on (normal) */
+    if (!mode) return;
+    pic_shown = c;
+    pic_new = 1;
+    free(pic_data);
+    pic_data = 0;
+    ms_yield(MS_SLICE_PICTURE);
+}
+
+void ms_fatal(const char* txt)
+{
+    fatal_error = txt;
+    ms_stop();
+}
+
+uint8_t ms_showhints(struct ms_hint* hints)
+{
+    (void)hints;
+    return 0;
+}
+
+void ms_playmusic(uint8_t* midi_data, uint32_t length, uint16_t tempo)
+{
+    (void)midi_data;
+    (void)length;
+    (void)tempo;
+}
+
+uint8_t mag_open(const char* name, const char* gfxname, const char* hntname)
+{
+    mag_close();
+#ifdef HAS_BUNDLE
+    /* a bundle holds the game and the files that go with it */
+    if (bundle_open(name)) {
+        name = "story";
+        if (!gfxname && bundle_find("graphics", 0)) gfxname = "graphics";
+        if (!hntname && bundle_find("hints", 0)) hntname = "hints";
+    }
+#endif
+    return ms_init(name, gfxname, hntname, 0);
+}
+
+void mag_close(void)
+{
+    ms_freemem();
+#ifdef HAS_BUNDLE
+    bundle_close();
+#endif
+    free(text_buf);
+    text_buf = 0;
+    text_len = text_size = 0;
+    input_ready = 0;
+    input_pos = 0;
+    status_len = 0;
+    status_shown[0] = 0;
+    pic_new = 0;
+    fatal_error = 0;
+    events = 0;
+    status_new = prompt_new = prompt_sent = 0;
+    free(pic_data);
+    pic_data = 0;
+}
+
+void mag_input(const char* line)
+{
+    strncpy(input_line, line, sizeof(input_line) - 1);
+    input_line[sizeof(input_line) - 1] = 0;
+    input_pos = 0;
+    input_ready = 1;
+}
+
+uint8_t mag_run(uint32_t budget)
+{
+    uint8_t status;
+
+    /* the host has yet to make room for the last slice's events */
+    if (events && !events_send()) return MS_SLICE_OUTPUT;
+    status = ms_run_slice(budget);
+    if (events && !events_send() && status < MS_SLICE_OUTPUT) status = MS_SLICE_OUTPUT;
+    return status;
+}
+
+uint32_t mag_output(char* buf, uint32_t size)
+{
+    uint32_t n = text_len < size ? text_len : size;
+
+    if (!n) return 0;
+    memcpy(buf, text_buf, n);
+    memmove(text_buf, text_buf + n, text_len - n);
+    text_len -= n;
+    return n;
+}
+
+const char* mag_status(void)
+{
+    return status_shown;
+}
+
+uint8_t* mag_picture(uint16_t* w, uint16_t* h, uint16_t* pal)
+{
+    if (!pic_new) return 0;
+    pic_new = 0;
+    return ms_extract(pic_shown, w, h, pal, 0);
+}
+
+const char* mag_error(void)
+{
+    return fatal_error;
+}
+
+void mag_events(struct ev_ring* ring)
+{
+    events = ring;
+}
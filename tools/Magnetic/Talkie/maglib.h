@@ -0,0 +1,171 @@
+/****************************************************************************\
+*
+* Magnetic - Magnetic Scrolls Interpreter.
+*
+* Written by Niclas Karlsson <nkarlsso@abo.fi>,
+*            David Kinder <davidk@davidkinder.co.uk>,
+*            Stefan Meier <Stefan.Meier@if-legends.org> and
+*            Paul David Doherty <pdd@if-legends.org>
+*
+* Copyright (C) 1997-2023  Niclas Karlsson
+*
+*     This program is free software; you can redistribute it and/or modify
+*     it under the terms of the GNU General Public License as published by
+*     the Free Software Foundation; either version 2 of the License, or
+*     (at your option) any later version.
+*
+*     This program is distributed in the hope that it will be useful,
+*     but WITHOUT ANY WARRANTY; without even the implied warranty of
+*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*     GNU General Public License for more details.
+*
+*     You should have received a copy of the GNU General Public License
+*     along with this program; if not, write to the Free Software
+*     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA.
+*
+*     C API of libmagnetic maglib.h
+*
+\****************************************************************************/
+
+#ifndef MAGNETIC_MAGLIB_H
+#define MAGNETIC_MAGLIB_H
+
+/****************************************************************************\
+* libmagnetic is the interpreter built as a shared library, so that a host
+* can run a game in its own process (with ctypes or cffi) instead of talking
+* to the magnetic executable over pipes. The library implements the abstract
+* functions of defs.h itself and keeps what the game produces in buffers
+* that the host empties between slices:
+*
+*     mag_open("the_pawn.mag", "the_pawn.gfx", 0);
+*     mag_input("look");
+*     while ((status = mag_run(100000)) != MS_SLICE_INPUT && ...)
+*         n = mag_output(text, sizeof(text));
+*
+* Text and pictures are plain, no "#[...]" lines. The ms_ functions of
+* defs.h, e.g. ms_state_save or ms_room, work on the opened game.
+*
+* A host that runs the game on a thread of its own has it put everything
+* into an event ring instead, see mag_events.
+\****************************************************************************/
+
+#include "defs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/****************************************************************************\
+* Function: mag_open
+*
+* Purpose: Loads a game, closing the one open before
+*
+* Parameters:   char* name      story file or bundle (see tools/bundle)
+*               char* gfxname   graphics file (optional)
+*               char* hntname   hints file (optional)
+*
+* Return: as ms_init, 0 on failure, 2 if the pictures can be shown
+\****************************************************************************/
+
+uint8_t mag_open(const char * name, const char * gfxname, const char * hntname);
+
+/****************************************************************************\
+* Function: mag_close
+*
+* Purpose: Stops the game and frees everything the library holds
+\****************************************************************************/
+
+void mag_close(void);
+
+/****************************************************************************\
+* Function: mag_input
+*
+* Purpose: Gives the game its next line of input, without a newline
+\****************************************************************************/
+
+void mag_input(const char * line);
+
+/****************************************************************************\
+* Function: mag_run
+*
+* Purpose: Runs up to budget instructions, see ms_run_slice
+*
+* Return: MS_SLICE_INPUT once the game waits for a line given with
+*         mag_input, MS_SLICE_PICTURE after the game showed a picture,
+*         see mag_picture, MS_SLICE_STOPPED once the game is over or
+*         failed, see mag_error
+\****************************************************************************/
+
+uint8_t mag_run(uint32_t budget);
+
+/****************************************************************************\
+* Function: mag_output
+*
+* Purpose: Copies up to size bytes of the text printed so far to buf and
+*          removes them from the library's buffer
+*
+* Return: Number of bytes copied, buf is not terminated
+\****************************************************************************/
+
+uint32_t mag_output(char * buf, uint32_t size);
+
+/****************************************************************************\
+* Function: mag_status
+*
+* Return: The status bar last printed, "<ROOM>\t<score>/<moves>" in the
+*         games that have one, otherwise ""
+\****************************************************************************/
+
+const char * mag_status(void);
+
+/****************************************************************************\
+* Function: mag_picture
+*
+* Purpose: Decodes the picture the game showed last, once per showing
+*
+* Parameters:   uint16_t* w     width of picture
+*               uint16_t* h     height of picture
+*               uint16_t* pal   array of 16 Atari ST colours, as ms_extract
+*
+* Return: One colour index per pixel, valid until the next mag_run, or 0
+*         if no picture was shown since the last call
+\****************************************************************************/
+
+uint8_t * mag_picture(uint16_t * w, uint16_t * h, uint16_t * pal);
+
+/****************************************************************************\
+* Function: mag_error
+*
+* Return: Why the game failed (what ms_fatal was given), or 0
+\****************************************************************************/
+
+const char * mag_error(void);
+
+/****************************************************************************\
+* Function: mag_events
+*
+* Purpose: Sends what the game produces to an event ring (see
+*          tools/events/events.h) instead of the buffers of mag_output,
+*          mag_status and mag_picture, until mag_close
+*
+* Parameter:    ev_ring* ring   ring the host takes the events from on its
+*                               own thread, null for the buffers again
+*
+* Note: The events are EV_TEXT spans of text, EV_META with the status bar
+*       (arg 0), EV_PICTURE once per showing with arg the picture number
+*       and as data the width and height, the 16 colours of mag_picture
+*       (all uint16_t) and one colour index per pixel, or no data if that
+*       does not fit the ring, and EV_PROMPT (arg 0) once the game waits
+*       for a line. While events wait for room in the ring, mag_run
+*       returns MS_SLICE_OUTPUT and does not run the game. Everything but taking the events stays on the game's thread.
+\****************************************************************************/
+
+struct ev_ring;
+
+void mag_events(struct ev_ring * ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAGNETIC_MAGLIB_H */
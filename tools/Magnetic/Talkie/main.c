@@ -32,11 +32,44 @@
 #include <string.h>
 #include <ctype.h>
 #include "defs.h"
-
-#define WIDTH 78
+#include "anim.h"
+#include "gamma.h"
+#include "scale.h"
+#include "trace.h"
+#include <time.h>
+#ifdef HAS_BUNDLE
+#include "bundle.h"
+#endif
+#ifdef __unix__
+#include <errno.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 uint8_t ms_gfx_enabled = 0;
 
+/* --server: many players share one loaded game, see server_run() */
+uint8_t server = 0;
+const char* server_line = 0;
+char* server_out = 0;
+size_t server_len = 0, server_size = 0;
+
+void server_append(const char* s, size_t len)
+{
+    if (server_len + len > server_size) {
+        while (server_len + len > server_size)
+            server_size = server_size ? server_size * 2 : 4096;
+        if (!(server_out = realloc(server_out, server_size))) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(server_out + server_len, s, len);
+    server_len += len;
+}
+
 //uint8_t buffer[80], xpos = 0, bufpos = 0, log_on = 0, ms_gfx_enabled,
    //               filename[256];
 //FILE *logfile1 = 0, *logfile2 = 0;
@@ -48,10 +81,13 @@ uint8_t ms_load_file(const char* name, uint8_t* ptr, uint16_t size)
 
     if (name)
         realname = name;
+    else if (server)
+        return 1; /* stdin carries the requests */
     else {
         char filename[256];
         do {
             printf("Filename: ");
+            fflush(stdout);
         } while (!fgets(filename, 256, stdin));
         filename[strlen(filename) - 1] = 0;
         realname = filename;
@@ -69,10 +105,13 @@ uint8_t ms_save_file(const char* name, uint8_t* ptr, uint16_t size)
 
     if (name)
         realname = name;
+    else if (server)
+        return 1; /* stdin carries the requests */
     else {
         char filename[256];
         do {
             printf("Filename: ");
+            fflush(stdout);
         } while (!fgets(filename, 256, stdin));
         filename[strlen(filename) - 1] = 0;
         realname = filename;
@@ -86,65 +125,532 @@ uint8_t ms_save_file(const char* name, uint8_t* ptr, uint16_t size)
 int log_on = 0;
 FILE *logfile1 = 0, *logfile2 = 0;
 
-void script_write(uint8_t c)
+/* --fast-forward: replay the script without output or pictures, then hand
+   over to the player. The last picture asked for is shown at the end. */
+uint8_t fastforward = 0, ff_mode = 0;
+uint32_t ff_pic = 0;
+
+/* --vocab: type a command without output until the game has looked it up,
+   then list the dictionary instead of playing, see vocab_word() */
+uint8_t vocab = 0;
+uint32_t vocab_words = 0;
+
+/* The words go out in the format of infodump -V: the word, a tab and its
+   word class, here the dictionary bank */
+void vocab_word(const char* text, uint8_t bank)
 {
-    if (log_on == 2 && fputc(c, logfile1) == EOF) {
-        printf("[Problem with script file - closing]\n");
-        fclose(logfile1);
-        log_on = 0;
+    printf("%s\tbank%u\n", text, (unsigned)bank);
+}
+
+/* --dump-messages: the text of every game string for speech synthesis in
+   advance, one "<id>\t<text>" line each with newlines, tabs and
+   backslashes written as \n, \t and \\ */
+uint8_t dump_messages = 0;
+
+void dump_message(uint16_t id, const char* text)
+{
+    printf("%u\t", (unsigned)id);
+    for (; *text; text++) {
+        if (*text == 0x0a)
+            fputs("\\n", stdout);
+        else if (*text == 0x09)
+            fputs("\\t", stdout);
+        else if (*text == '\\')
+            fputs("\\\\", stdout);
+        else
+            putchar(*text);
     }
+    putchar(0x0a);
 }
 
-void transcript_write(uint8_t c)
+/* --bench: replay the script without output and report timings */
+uint8_t bench = 0, bench_done = 0;
+double *bench_turns = 0, bench_turn_start = -1;
+uint32_t bench_nturns = 0, bench_maxturns = 0;
+
+double bench_now(void)
+{
+#ifdef __unix__
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+void bench_turn_end(void)
+{
+    double now = bench_now();
+
+    if (bench_turn_start >= 0) {
+        if (bench_nturns == bench_maxturns) {
+            bench_maxturns = bench_maxturns ? bench_maxturns * 2 : 256;
+            if (!(bench_turns = realloc(bench_turns,
+                                        bench_maxturns * sizeof(double)))) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        bench_turns[bench_nturns++] = now - bench_turn_start;
+    }
+}
+
+int bench_compare(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+double bench_percentile(double p)
+{
+    uint32_t i;
+
+    if (!bench_nturns) return 0;
+    i = (uint32_t)(p * (bench_nturns - 1) + 0.5);
+    return bench_turns[i] * 1000;
+}
+
+void bench_report(double seconds)
 {
-    if (logfile2 && c == 0x08 && ftell(logfile2) > 0)
-        fseek(logfile2, -1, SEEK_CUR);
-    else if (logfile2 && fputc(c, logfile2) == EOF) {
+    long rss = 0;
+#ifdef __unix__
+    struct rusage ru;
+    if (!getrusage(RUSAGE_SELF, &ru)) rss = ru.ru_maxrss;
+#endif
+
+    qsort(bench_turns, bench_nturns, sizeof(double), bench_compare);
+    printf("instructions %lu\n", (unsigned long)ms_count());
+    printf("seconds %.3f\n", seconds);
+    printf("instructions_per_second %.0f\n",
+           seconds > 0 ? ms_count() / seconds : 0);
+    printf("turns %lu\n", (unsigned long)bench_nturns);
+    printf("turn_ms_p50 %.3f\n", bench_percentile(0.5));
+    printf("turn_ms_p90 %.3f\n", bench_percentile(0.9));
+    printf("turn_ms_p99 %.3f\n", bench_percentile(0.99));
+    printf("turn_ms_max %.3f\n", bench_percentile(1));
+    printf("peak_rss_kb %ld\n", rss);
+#ifndef NO_HLE
+    {
+        uint32_t mismatches, calls = ms_hle_count(&mismatches);
+        printf("hle_calls %lu\n", (unsigned long)calls);
+        printf("hle_mismatches %lu\n", (unsigned long)mismatches);
+    }
+#endif
+}
+
+/* --stats: a "#[stats instructions=<n> vm_us=<n> text=<n> pictures=<n>
+   picture_us=<n>]" line goes before each "#[prompt]", for the turn since
+   the input before it: the instructions run, the time from the input to
+   the prompt, the bytes of text printed, the pictures decoded and the
+   time that took */
+uint8_t stats = 0;
+uint32_t stats_count = 0, stats_text = 0, stats_pictures = 0;
+double stats_start = 0, stats_picture_time = 0;
+
+void stats_write(void)
+{
+    char line[160];
+    double now = bench_now();
+
+    snprintf(line, sizeof(line),
+             "#[stats instructions=%lu vm_us=%ld text=%lu pictures=%lu "
+             "picture_us=%ld]\n",
+             (unsigned long)(ms_count() - stats_count),
+             (long)((now - stats_start) * 1e6), (unsigned long)stats_text,
+             (unsigned long)stats_pictures, (long)(stats_picture_time * 1e6));
+    if (server)
+        server_append(line, strlen(line));
+    else
+        fputs(line, stdout);
+    stats_count = ms_count();
+    stats_text = stats_pictures = 0;
+    stats_picture_time = 0;
+}
+
+/* The script and the transcript are collected a line at a time, where a
+   backspace takes back the last character, and written by log_flush() once
+   the line is complete, instead of a stdio call per character. */
+char script_buf[260], transcript_buf[260];
+int script_len = 0, transcript_len = 0;
+
+void log_flush(void)
+{
+    if (script_len && log_on == 2 &&
+        (fwrite(script_buf, 1, script_len, logfile1) != (size_t)script_len ||
+         fflush(logfile1))) {
+        printf("[Problem with script file - closing]\n");
+        fclose(logfile1);
+        log_on = 0;
+    }
+    script_len = 0;
+    if (transcript_len && logfile2 &&
+        (fwrite(transcript_buf, 1, transcript_len, logfile2) !=
+             (size_t)transcript_len ||
+         fflush(logfile2))) {
         printf("[Problem with transcript file - closing]\n");
         fclose(logfile2);
         logfile2 = 0;
     }
+    transcript_len = 0;
 }
 
-void ms_statuschar(uint8_t c)
+void log_close(void)
+{
+    log_flush();
+    if (log_on) fclose(logfile1);
+    if (logfile2) fclose(logfile2);
+}
+
+void script_write(uint8_t c)
 {
-    return;
-    static uint8_t x = 0;
+    if (log_on != 2) return;
+    if (script_len == sizeof(script_buf)) log_flush();
+    script_buf[script_len++] = c;
+}
 
-    if (c == 0x09) {
-        while (x + 11 < WIDTH) {
-            putchar(0x20);
-            x++;
-        }
-        return;
-    }
-    if (c == 0x0a) {
-        x = 0;
-        putchar(0x0a);
+void transcript_write(uint8_t c)
+{
+    if (!logfile2) return;
+    if (c == 0x08) {
+        /* the line so far, or what an earlier one left in the file */
+        if (transcript_len)
+            transcript_len--;
+        else if (ftell(logfile2) > 0)
+            fseek(logfile2, -1, SEEK_CUR);
         return;
     }
-    printf("\x1b[32m%c\x1b[31m", c);
-    x++;
+    if (transcript_len == sizeof(transcript_buf)) log_flush();
+    transcript_buf[transcript_len++] = c;
 }
 
 char buffer[256];
 int bufpos = 0;
 
+/* --paragraphs: each paragraph goes out on a line of its own, with runs of
+   spaces as one and none at either end, followed by a "#[p]" line. Empty
+   lines are left out. The line the game is still writing when it wants
+   input, its prompt, goes out as it is, see turn_flush(). */
+uint8_t paragraphs = 0, para_space = 0;
+uint32_t para_chars = 0;
+
+/* Output is collected in the stdout buffer for the whole turn and written
+   once, followed by a "#[prompt]" line, when ms_getchar() needs a new line
+   of input. With --rooms a "#[room <n>]" line comes before it when the
+   player has moved (see ms_room()), and with every reply of the server,
+   whose sessions are in different rooms. */
+
 void ms_flush(void)
 {
     if (bufpos == 0) return;
+    ms_yield(MS_SLICE_OUTPUT);
+    trace_begin("flush");
     buffer[bufpos] = 0;
-    fputs(buffer, stdout);
+    if (server)
+        server_append(buffer, bufpos);
+    else
+        fputs(buffer, stdout);
     bufpos = 0;
+    trace_end();
+}
+
+uint8_t rooms = 0;
+int32_t last_room = -1;
+
+void turn_flush(void)
+{
+    char room[32];
+    int32_t r = ms_room();
+
+    ms_flush();
+    /* the prompt is not a paragraph, nor is the end of its line */
+    para_chars = para_space = 0;
+    if (server) {
+        if (rooms && r >= 0)
+            server_append(room, sprintf(room, "#[room %ld]\n", (long)r));
+        if (stats) stats_write();
+        server_append("#[prompt]\n", 10);
+    } else {
+        if (!bench && !fastforward && !vocab) {
+            if (rooms && r >= 0 && r != last_room) {
+                printf("#[room %ld]\n", (long)r);
+                last_room = r;
+            }
+            if (stats) stats_write();
+            fputs("#[prompt]\n", stdout);
+        }
+        fflush(stdout);
+    }
+}
+
+/* The status bar, "<ROOM>\t<score>/<moves>\n" in the games that have one,
+   goes out as one '#[status room="<room>" score=<n> moves=<n>]' line when
+   it changes, or with every reply of the server. */
+char status_line[80], status_sent[128];
+uint8_t status_len = 0;
+
+void ms_statuschar(uint8_t c)
+{
+    char meta[128], *tab, *room;
+    long score, moves;
+    int n;
+    uint8_t i;
+
+    if (c != 0x0a) {
+        if (status_len < sizeof(status_line) - 1) status_line[status_len++] = (char)c;
+        return;
+    }
+    status_line[status_len] = 0;
+    status_len = 0;
+    if ((tab = strchr(status_line, 0x09))) *tab++ = 0;
+    for (room = status_line; *room == ' '; room++)
+        ;
+    for (i = (uint8_t)strlen(room); i && room[i - 1] == ' '; i--)
+        room[i - 1] = 0;
+    /* the room goes in quotes and the line ends at ']' */
+    for (i = 0; room[i]; i++)
+        if (room[i] == '"' || room[i] == ']') room[i] = '\'';
+    n = sprintf(meta, "#[status room=\"%s\"", room);
+    if (tab && sscanf(tab, "%ld/%ld", &score, &moves) == 2)
+        n += sprintf(meta + n, " score=%ld moves=%ld", score, moves);
+    strcpy(meta + n, "]\n");
+
+    if (bench || fastforward || vocab || (!server && !strcmp(meta, status_sent))) return;
+    ms_flush();
+    if (server)
+        server_append(meta, strlen(meta));
+    else {
+        fputs(meta, stdout);
+        strcpy(status_sent, meta);
+    }
+}
+
+/* interpreter messages go with the game text */
+void front_text(const char* s)
+{
+    while (*s)
+        ms_putchar((uint8_t)*s++);
+}
+
+/* next input character, the server takes it from the request line */
+int input_getc(void)
+{
+    int c;
+
+    if (!server) {
+        trace_begin("input");
+        c = getchar();
+        trace_end();
+        return c;
+    }
+    if (!server_line) return EOF;
+    if (*server_line) return (uint8_t)*server_line++;
+    server_line = 0;
+    return '\n';
+}
+
+/* --preload: the game is loaded, "#[loaded]" goes out and nothing runs
+   until a "#[start]" or "#[start seed=<n>]" line comes in, so a host can
+   keep interpreters waiting for players. 0 if the input ends first. */
+uint8_t preload = 0;
+
+uint8_t wait_for_start(void)
+{
+    char line[128];
+    const char* seed;
+
+    fputs("#[loaded]\n", stdout);
     fflush(stdout);
+    while (fgets(line, sizeof(line), stdin)) {
+        if (strncmp(line, "#[start", 7)) continue;
+        if ((seed = strstr(line, "seed=")))
+            ms_seed((uint32_t)strtoul(seed + 5, 0, 0));
+        return 1;
+    }
+    return 0;
+}
+
+/* replies that may be binary go out unbuffered by ms_putchar */
+void front_out(const void* p, size_t len)
+{
+    if (server)
+        server_append((const char*)p, len);
+    else
+        fwrite(p, 1, len, stdout);
+}
+
+/* Reads a "#[state <length>]" chunk from the input into data, returns its
+   length or 0. The server's request lines cannot carry one. */
+uint32_t read_state_chunk(uint8_t* data, uint32_t size)
+{
+    char line[64];
+    unsigned long n, i;
+    int c;
+
+    for (i = 0; (c = input_getc()) != '\n' && c != EOF;)
+        if (i < sizeof(line) - 1) line[i++] = (char)c;
+    line[i] = 0;
+    if (sscanf(line, "#[state %lu]", &n) != 1) return 0;
+    /* read all of it even if it is too big, to stay in step with the host */
+    for (i = 0; i < n; i++) {
+        if ((c = input_getc()) == EOF) return 0;
+        if (i < size) data[i] = (uint8_t)c;
+    }
+    return (n <= size) ? (uint32_t)n : 0;
+}
+
+/* ##save#[path] and ##restore#[path] checkpoint the game without the
+   game's own save dialogue. Without a path the state goes out as a
+   "#[state <length>]" chunk, and comes back the same way: the host sends
+   the chunk right after the ##restore# line. The reply is "#[saved
+   <length>]", "#[restored]", "#[savefailed]" or "#[restorefailed]". */
+void state_command(const char* cmd)
+{
+    const char* path = strchr(cmd, '#') + 1;
+    uint32_t size = ms_state_size(), len = 0;
+    uint8_t* data = malloc(size ? size : 1);
+    char line[64];
+    FILE* fh;
+
+    ms_flush();
+    if (cmd[0] == 's') {
+        if (data) len = ms_state_save(data, size);
+        if (len && !*path) {
+            snprintf(line, sizeof(line), "#[state %lu]\n", (unsigned long)len);
+            front_out(line, strlen(line));
+            front_out(data, len);
+        } else if (len) {
+            if (!(fh = fopen(path, "wb")))
+                len = 0;
+            else {
+                if (fwrite(data, 1, len, fh) != len) len = 0;
+                if (fclose(fh)) len = 0;
+            }
+        }
+        if (len)
+            snprintf(line, sizeof(line), "#[saved %lu]\n", (unsigned long)len);
+        else
+            strcpy(line, "#[savefailed]\n");
+    } else {
+        if (data && !*path)
+            len = read_state_chunk(data, size);
+        else if (data && (fh = fopen(path, "rb"))) {
+            len = (uint32_t)fread(data, 1, size, fh);
+            fclose(fh);
+        }
+        strcpy(line, (len && ms_state_restore(data, len)) ? "#[restored]\n"
+                                                            : "#[restorefailed]\n");
+    }
+    front_out(line, strlen(line));
+    free(data);
+}
+
+/* ##speculate#<command> runs a command the host is only guessing at, e.g.
+   while the player is still speaking: the state before it is kept, then
+   "#[speculate]" goes out and the command runs as any other. The next line
+   settles it, ##commit# keeps what the command did ("#[committed]"),
+   ##discard# goes back to the kept state ("#[discarded]"). The server's
+   sessions share the one kept state, so it does not speculate. cmd is the
+   line after the first '#', returns 1 if it now holds the command to run. */
+uint8_t* fork_state = 0;
+uint32_t fork_len = 0;
+
+uint8_t fork_command(char* cmd)
+{
+    const char* reply;
+
+    ms_flush();
+    if (!strncmp(cmd, "#speculate#", 11)) {
+        uint32_t size = ms_state_size();
+        uint8_t* grown = server ? 0 : realloc(fork_state, size ? size : 1);
+
+        fork_len = 0;
+        if (grown) {
+            fork_state = grown;
+            fork_len = ms_state_save(fork_state, size);
+        }
+        reply = fork_len ? "#[speculate]\n" : "#[speculatefailed]\n";
+        front_out(reply, strlen(reply));
+        if (!fork_len) return 0;
+        memmove(cmd, cmd + 11, strlen(cmd + 11) + 1);
+        return 1;
+    }
+    /* the host's status bar may be the discarded one */
+    status_sent[0] = 0;
+    if (!strcmp(cmd, "#commit#"))
+        reply = fork_len ? "#[committed]\n" : "#[commitfailed]\n";
+    else if (fork_len && ms_state_restore(fork_state, fork_len))
+        reply = "#[discarded]\n";
+    else
+        reply = "#[discardfailed]\n";
+    front_out(reply, strlen(reply));
+    fork_len = 0;
+    return 0;
+}
+
+/* --turn-budget: a turn may run this many instructions, counted from the
+   input request, 0 for any number. ms_getchar() keeps the game before each
+   line in turn_game; a turn that runs longer, e.g. stuck in a loop,
+   is rolled back to it and "#[error budget]" goes out, then the game asks
+   for the line again. Only the text still buffered is dropped. */
+uint32_t turn_budget = 0, turn_start = 0;
+struct ms_session* turn_game = 0;
+uint8_t turn_kept = 0, turn_dropped = 0;
+size_t turn_reply = 0;
+
+/* the turn ran past its budget: returns MS_SLICE_INPUT, or MS_SLICE_STOPPED
+   if there was nothing to go back to and the game is stopped */
+uint8_t turn_rollback(void)
+{
+    uint8_t kept = turn_kept && ms_session_rollback(turn_game);
+
+    bufpos = status_len = 0;
+    para_chars = para_space = 0;
+    turn_dropped = 1;
+    if (server) {
+        /* the reply so far is the turn's, the prompt is sent again here */
+        server_len = turn_reply;
+        server_append("#[error budget]\n", 16);
+        if (kept) turn_flush();
+    } else {
+        fputs("#[error budget]\n", stdout);
+        fflush(stdout);
+    }
+    turn_start = ms_count();
+    if (kept) return MS_SLICE_INPUT;
+    ms_stop();
+    return MS_SLICE_STOPPED;
 }
 
 void ms_putchar(uint8_t c)
 {
+    if (bench || fastforward || vocab) return;
+    if (c != 0x08) stats_text++;
     if (c == 0x08) {
-        if (bufpos > 0) bufpos--;
+        if (para_space)
+            para_space = 0;
+        else if (bufpos > 0)
+            bufpos--;
         return;
     }
+    if (paragraphs) {
+        if (c == 0x0a) {
+            if (para_chars) {
+                memcpy(buffer + bufpos, "\n#[p]\n", 6);
+                bufpos += 6;
+                ms_flush();
+            }
+            para_chars = para_space = 0;
+            return;
+        }
+        if (c == 0x20) {
+            para_space = para_chars > 0;
+            return;
+        }
+        if (para_space) buffer[bufpos++] = 0x20;
+        para_space = 0;
+        para_chars++;
+    }
     buffer[bufpos++] = c;
     if ((c == 0x0a) || (bufpos >= 200)) ms_flush();
 }
@@ -156,8 +662,37 @@ uint8_t ms_getchar(uint8_t trans)
     int c;
     uint8_t i;
 
+    if (turn_dropped) pos = turn_dropped = 0;
+    if (vocab) {
+        static const char* look = "look\n";
+        static uint8_t tries = 0;
+        if (*look) return (uint8_t)*look++;
+        /* some games want a key or an answer before the first command */
+        if (!(vocab_words = ms_vocab(vocab_word)) && ++tries < 10) {
+            look = "look\n";
+            return (uint8_t)*look++;
+        }
+        ms_stop();
+        return '\n';
+    }
     if (!pos) {
         /* Read new line? */
+        if (server && !server_line) {
+            /* turn done, run the opcode again once there is input */
+            turn_flush();
+            ms_suspend();
+            ms_yield(MS_SLICE_INPUT);
+            return 1;
+        }
+        if (bench) bench_turn_end();
+        if (!server) turn_flush();
+        if (turn_budget) {
+            turn_kept = ms_session_keep(turn_game);
+            turn_start = ms_count();
+        }
+        /* one vm span per turn, see main() */
+        trace_end();
+        trace_begin("vm");
         i = 0;
         while (1) {
             if (log_on == 1) {
@@ -166,26 +701,59 @@ uint8_t ms_getchar(uint8_t trans)
                     /* End of log? - turn off */
                     log_on = 0;
                     fclose(logfile1);
-                    c = getchar();
-                } else
+                    if (bench) {
+                        /* stop after the last recorded turn */
+                        bench_done = 1;
+                        bench_turn_start = -1;
+                        c = '\n';
+                    } else {
+                        if (fastforward) {
+                            fastforward = 0;
+                            if (ff_mode) ms_showpic(ff_pic, ff_mode);
+                            turn_flush();
+                        }
+                        c = input_getc();
+                    }
+                } else if (!bench && !fastforward)
                     printf("%c", c); /* print the char as well */
             } else {
-                c = getchar();
+                c = input_getc();
                 if (c == '#' && !i && trans) {
                     /* Interpreter command? */
-                    while ((c = getchar()) != '\n' && c != EOF && i < 255)
+                    while ((c = input_getc()) != '\n' && c != EOF && i < 255)
                         buf[i++] = c;
                     buf[i] = 0;
                     c = '\n'; /* => Prints new prompt */
                     i = 0;
                     if (!strcmp(buf, "logoff") && log_on == 2) {
-                        printf("[Closing script file]\n");
+                        front_text("[Closing script file]\n");
+                        log_flush();
                         log_on = 0;
                         fclose(logfile1);
-                    } else if (!strcmp(buf, "undo"))
+                    } else if (!strncmp((char*)buf, "undo", 4) &&
+                               (!buf[4] || buf[4] == ' ')) {
+                        /* #undo [turns] */
+                        ms_set_undo_levels(buf[4] ? atoi((char*)buf + 5) : 1);
                         c = 0;
+                    } else if (!strncmp((char*)buf, "#save#", 6) ||
+                               !strncmp((char*)buf, "#restore#", 9)) {
+                        /* the input is asked for again, in the restored
+                           game if there is one */
+                        ms_suspend();
+                        state_command((char*)buf + 1);
+                        return 1;
+                    } else if (!strncmp((char*)buf, "#speculate#", 11) ||
+                               !strcmp((char*)buf, "#commit#") ||
+                               !strcmp((char*)buf, "#discard#")) {
+                        if (!fork_command((char*)buf)) {
+                            ms_suspend();
+                            return 1;
+                        }
+                        /* the command goes in as if it had been typed */
+                        i = (uint8_t)strlen((char*)buf);
+                    }
                     else
-                        printf("[Nothing done]\n");
+                        front_text("[Nothing done]\n");
                 }
             }
             script_write((uint8_t)c);
@@ -195,35 +763,262 @@ uint8_t ms_getchar(uint8_t trans)
             if (!c) break;
         }
         buf[i] = '\n';
+        log_flush();
+        if (bench && !bench_done) bench_turn_start = bench_now();
+        if (stats) stats_start = bench_now();
     }
     if ((c = buf[pos++]) == '\n' || !c) pos = 0;
     return (uint8_t)c;
 }
 
-void ms_showpic(uint32_t c, uint8_t mode)
+/* Pictures are sent like the level9 front end's binary ones: the first time
+   a picture is shown it goes out as a "#[imgbin <no> <length>]" chunk
+   (16 bit LE width and height, colour count, RGB palette, packing 1 and
+   (count, index) run length pairs), then "#[bitmap <no> 0 0]" shows it.
+   Pictures are numbered in the order the game first shows them, which
+   keeps the numbers small for v4 games, where the game gives them by name.
+
+   An animated picture is sent without its frames. Each ms_animate() step
+   after it, one per 100 ms of the animation, follows as an
+   "#[animbin <no> <length>]" chunk with the regions that changed since the
+   last step (16 bit LE count, then for each region 16 bit LE x, y, width
+   and height and (count, index) run length pairs of its pixels), see
+   anim.h. A step that changes nothing has no regions.
+
+   With --rgba the colours are looked up here instead: a picture goes out
+   as "#[rgba <no> <width> <height> <length>]" with width * height red,
+   green, blue and alpha bytes, and each animation step as the whole
+   picture in a "#[rgbaframe <width> <height> <length>]" chunk. */
+
+#define ANIM_MAX_STEPS 100 /* for the animations that repeat */
+#define ANIM_MAX_RECTS 64
+
+uint32_t* pic_sent = 0;
+uint8_t* pic_anim = 0; /* the animated ones are extracted every time */
+uint16_t pic_nsent = 0;
+
+void gfx_write(const char* s, size_t len)
+{
+    ms_flush();
+    if (server)
+        server_append(s, len);
+    else
+        fwrite(s, 1, len, stdout);
+}
+
+uint8_t gamma_mode = GAMMA_NORMAL;
+uint8_t rgba_gfx = 0;
+
+/* The palette of a picture as it goes out, 16 RGB triples */
+void picture_palette(uint8_t* raw, uint16_t w, uint16_t h, uint16_t* pal,
+                     uint8_t* rgb)
+{
+    gamma_palette(pal,
+                  gamma_select(ms_picture_contrast(raw, w, h, pal), gamma_mode),
+                  rgb);
+}
+
+/* Expand n colour indexes to RGBA through the 16 colours of rgb, 0 if out
+   of memory */
+uint8_t* encode_rgba(uint8_t* raw, size_t n, uint8_t* rgb)
+{
+    uint32_t lut[256], q[4];
+    uint8_t *buf, *p, c[4];
+    size_t i = 0;
+
+    if (!(buf = p = malloc(4 * n))) return 0;
+    for (i = 0; i < 256; i++) {
+        c[0] = rgb[3 * (i & 15)];
+        c[1] = rgb[3 * (i & 15) + 1];
+        c[2] = rgb[3 * (i & 15) + 2];
+        c[3] = 0xff;
+        memcpy(lut + i, c, 4);
+    }
+    /* four at a time, the lookups are independent so the compiler can
+       vectorise them */
+    for (i = 0; i + 4 <= n; i += 4, p += 16) {
+        q[0] = lut[raw[i]];
+        q[1] = lut[raw[i + 1]];
+        q[2] = lut[raw[i + 2]];
+        q[3] = lut[raw[i + 3]];
+        memcpy(p, q, 16);
+    }
+    for (; i < n; i++, p += 4)
+        memcpy(p, lut + raw[i], 4);
+    return buf;
+}
+
+/* Encode a picture as an #[imgbin] payload, 0 if out of memory. The palette
+   goes out gamma corrected, see gamma.h. */
+uint8_t* encode_picture(uint8_t* raw, uint16_t w, uint16_t h, uint16_t* pal,
+                        size_t* len)
 {
-    /* Insert your favourite picture viewing code here
-       mode: 0 gfx off, 1 gfx on (thumbnails), 2 gfx on (normal) */
+    size_t n = (size_t)w * h, i = 0, run, out = 54;
+    uint8_t* buf;
+
+    if (!(buf = malloc(out + 2 * n))) return 0;
+    buf[0] = w & 0xff;
+    buf[1] = w >> 8;
+    buf[2] = h & 0xff;
+    buf[3] = h >> 8;
+    buf[4] = 16;
+    picture_palette(raw, w, h, pal, buf + 5);
+    buf[53] = 1;
+    for (i = 0; i < n; i += run) {
+        for (run = 1; i + run < n && run < 255 && raw[i + run] == raw[i]; run++)
+            ;
+        buf[out++] = (uint8_t)run;
+        buf[out++] = raw[i];
+    }
+    *len = out;
+    return buf;
+}
 
-    /*
-        printf("Display picture [%d]\n",c);
-    */
+/* Pixel i of region r, counting along its rows */
+#define REGION_PIXEL(i)                                             \
+    screen[(size_t)(rects[r].y + (i) / rects[r].w) * w + rects[r].x + \
+           (i) % rects[r].w]
 
-    /* Small bitmap retrieving example */
+/* Encode the regions of an animation step as an #[animbin] payload, 0 if
+   out of memory */
+uint8_t* encode_regions(uint8_t* screen, uint16_t w, struct anim_rect* rects,
+                        uint16_t n, size_t* len)
+{
+    size_t out = 2, size = 2, i, end, run;
+    uint8_t* buf;
+    uint16_t r;
+
+    for (r = 0; r < n; r++)
+        size += 8 + 2 * (size_t)rects[r].w * rects[r].h;
+    if (!(buf = malloc(size))) return 0;
+    buf[0] = n & 0xff;
+    buf[1] = n >> 8;
+    for (r = 0; r < n; r++) {
+        uint16_t v[4] = {rects[r].x, rects[r].y, rects[r].w, rects[r].h};
+
+        for (i = 0; i < 4; i++) {
+            buf[out++] = v[i] & 0xff;
+            buf[out++] = v[i] >> 8;
+        }
+        /* runs may go on from one row of the region to the next */
+        for (i = 0, end = (size_t)v[2] * v[3]; i < end; i += run) {
+            for (run = 1; i + run < end && run < 255 &&
+                          REGION_PIXEL(i + run) == REGION_PIXEL(i);
+                 run++)
+                ;
+            buf[out++] = (uint8_t)run;
+            buf[out++] = REGION_PIXEL(i);
+        }
+    }
+    *len = out;
+    return buf;
+}
 
-    /*
-        {
-            uint16_t w, h, pal[16];
-            uint8_t *raw = 0, i;
+/* Send the steps of the animation of picture no, raw and pal as
+   ms_extract() gave them, until it finishes or has run ANIM_MAX_STEPS */
+void send_animation(uint16_t no, uint8_t* raw, uint16_t w, uint16_t h,
+                    uint16_t* pal)
+{
+    struct anim_rect rects[ANIM_MAX_RECTS];
+    size_t size = (size_t)w * h, len;
+    uint8_t *off_screen, *on_screen, *buf, rgb[48];
+    uint16_t n, step;
+    char line[64];
 
-            raw = ms_extract(c,&w,&h,pal,0);
-            printf("\n\nExtract: [%d] %dx%d",c,w,h);
-            for (i = 0; i < 16; i++)
-                printf(", %3.3x",pal[i]);
-            printf("\n");
-            printf("Bitmap at: %8.8x\n",raw);
+    off_screen = malloc(size);
+    on_screen = malloc(size);
+    if (rgba_gfx) picture_palette(raw, w, h, pal, rgb);
+    if (off_screen && on_screen) {
+        memcpy(off_screen, raw, size);
+        memcpy(on_screen, raw, size);
+        for (step = 0; step < ANIM_MAX_STEPS && anim_step(off_screen, w, h);
+             step++) {
+            if (rgba_gfx) {
+                if (!(buf = encode_rgba(off_screen, size, rgb))) break;
+                snprintf(line, sizeof(line), "#[rgbaframe %u %u %lu]\n", w, h,
+                         (unsigned long)(4 * size));
+                gfx_write(line, strlen(line));
+                gfx_write((const char*)buf, 4 * size);
+                free(buf);
+                continue;
+            }
+            n = anim_diff(off_screen, on_screen, w, h, rects, ANIM_MAX_RECTS);
+            if (!(buf = encode_regions(on_screen, w, rects, n, &len))) break;
+            snprintf(line, sizeof(line), "#[animbin %u %lu]\n", no,
+                     (unsigned long)len);
+            gfx_write(line, strlen(line));
+            gfx_write((const char*)buf, len);
+            free(buf);
         }
-    */
+    }
+    free(off_screen);
+    free(on_screen);
+}
+
+void ms_showpic(uint32_t c, uint8_t mode)
+{
+    /* mode: 0 gfx off, 1 gfx on (thumbnails), 2 gfx on (normal) */
+    char line[64];
+    uint16_t w, h, pal[16], no;
+    uint8_t *raw = 0, *buf, is_anim = 0;
+    size_t len;
+
+    if (fastforward) {
+        ff_pic = c;
+        ff_mode = mode;
+        return;
+    }
+    if (!mode || bench || vocab) return;
+    for (no = 0; no < pic_nsent && pic_sent[no] != c; no++)
+        ;
+    if (no < pic_nsent && pic_anim[no]) {
+        raw = ms_extract(c, &w, &h, pal, &is_anim);
+        if (!raw || !w || !h) return;
+    } else if (no == pic_nsent) {
+        uint32_t* grown;
+        uint8_t* anim;
+        double start = stats ? bench_now() : 0;
+
+        raw = ms_extract(c, &w, &h, pal, &is_anim);
+        if (raw && w && h && rgba_gfx) {
+            uint8_t rgb[48];
+
+            picture_palette(raw, w, h, pal, rgb);
+            buf = encode_rgba(raw, (size_t)w * h, rgb);
+            len = 4 * (size_t)w * h;
+        } else
+            buf = (raw && w && h) ? encode_picture(raw, w, h, pal, &len) : 0;
+        if (stats) {
+            stats_pictures++;
+            stats_picture_time += bench_now() - start;
+        }
+        if (!buf) return;
+        if (!(grown = realloc(pic_sent, (pic_nsent + 1) * sizeof(*pic_sent)))) {
+            free(buf);
+            return;
+        }
+        pic_sent = grown;
+        if (!(anim = realloc(pic_anim, (pic_nsent + 1) * sizeof(*pic_anim)))) {
+            free(buf);
+            return;
+        }
+        pic_anim = anim;
+        pic_anim[pic_nsent] = is_anim;
+        pic_sent[pic_nsent++] = c;
+        if (rgba_gfx)
+            snprintf(line, sizeof(line), "#[rgba %u %u %u %lu]\n", no, w, h,
+                     (unsigned long)len);
+        else
+            snprintf(line, sizeof(line), "#[imgbin %u %lu]\n", no,
+                     (unsigned long)len);
+        gfx_write(line, strlen(line));
+        gfx_write((const char*)buf, len);
+        free(buf);
+    }
+    snprintf(line, sizeof(line), "#[bitmap %u 0 0]\n", no);
+    gfx_write(line, strlen(line));
+    if (is_anim) send_animation(no, raw, w, h, pal);
+    ms_yield(MS_SLICE_PICTURE);
 }
 
 void ms_fatal(const char* txt)
@@ -240,20 +1035,412 @@ uint8_t ms_showhints(struct ms_hint* hints)
     return 0;
 }
 
-void ms_playmusic(uint8_t* midi_data, uint32_t length, uint16_t tempo) {}
+/* Tunes go out the same way: the first time a tune plays it is sent as a
+   "#[midibin <no> <tempo> <length>]" chunk holding the MIDI file, then
+   "#[music <no>]" plays it and "#[music off]" stops it. sound_extract()
+   keeps each tune at one address, which is what tells them apart here. */
+
+uint8_t** music_sent = 0;
+uint16_t music_nsent = 0;
+
+void ms_playmusic(uint8_t* midi_data, uint32_t length, uint16_t tempo)
+{
+    char line[64];
+    uint16_t no;
+
+    if (fastforward || bench || vocab) return;
+    if (!midi_data) {
+        gfx_write("#[music off]\n", 13);
+        return;
+    }
+    for (no = 0; no < music_nsent && music_sent[no] != midi_data; no++)
+        ;
+    if (no == music_nsent) {
+        uint8_t** grown;
+
+        grown = realloc(music_sent, (music_nsent + 1) * sizeof(*music_sent));
+        if (!grown) return;
+        music_sent = grown;
+        music_sent[music_nsent++] = midi_data;
+        snprintf(line, sizeof(line), "#[midibin %u %u %lu]\n", no, tempo,
+                 (unsigned long)length);
+        gfx_write(line, strlen(line));
+        gfx_write((const char*)midi_data, length);
+    }
+    snprintf(line, sizeof(line), "#[music %u]\n", no);
+    gfx_write(line, strlen(line));
+}
+
+/* --export-all: every picture is written as <n>.raw (width and height as
+   16 bit LE, colour count, RGB palette corrected as by --gamma, packing
+   byte 0, one byte per pixel)
+   and listed in manifest.json. The decoder keeps its state in globals, so
+   the pictures are split across one forked process per CPU. With --scale
+   2, 3 or 4 the pixels are upscaled first, see scale.h, on threads of their
+   own if there are no other processes. */
+
+uint8_t export_scale = 1;
+
+int export_picture(const char* dir, uint16_t n, int threads)
+{
+    char path[1024];
+    uint8_t head[54], *raw, *scaled = 0;
+    uint16_t w, h, pal[16];
+    FILE* fh;
+
+    if (!(raw = ms_extract_index(n, &w, &h, pal, 0)) || !w || !h) return 0;
+    /* the gamma is picked for the picture as it was drawn */
+    picture_palette(raw, w, h, pal, head + 5);
+    if (export_scale > 1) {
+        if (!(scaled = scale_alloc(raw, w, h, export_scale, threads))) return 0;
+        raw = scaled;
+        w *= export_scale;
+        h *= export_scale;
+    }
+    head[0] = w & 0xff;
+    head[1] = w >> 8;
+    head[2] = h & 0xff;
+    head[3] = h >> 8;
+    head[4] = 16;
+    head[53] = 0;
+    snprintf(path, sizeof(path), "%s/%u.raw", dir, n);
+    if ((fh = fopen(path, "wb"))) {
+        fwrite(head, 1, sizeof(head), fh);
+        fwrite(raw, 1, (size_t)w * h, fh);
+        fclose(fh);
+    }
+    free(scaled);
+    return fh != 0;
+}
+
+void export_slice(const char* dir, uint16_t first, uint16_t step)
+{
+    uint32_t n;
+    for (n = first; n < ms_picture_count(); n += step)
+        export_picture(dir, (uint16_t)n, step > 1 ? 1 : 0);
+}
+
+int export_all(const char* dir)
+{
+    char path[1024];
+    uint8_t head[5];
+    uint16_t count = ms_picture_count(), n, workers = 1;
+    int exported = 0;
+    FILE *fh, *manifest;
+
+#ifdef __unix__
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) return -1;
+#endif
+    for (n = 0; n < count; n++) {
+        snprintf(path, sizeof(path), "%s/%u.raw", dir, n);
+        remove(path);
+    }
+#ifdef __unix__
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        uint16_t k;
+        if (cpus > 1) workers = (uint16_t)(cpus < count ? cpus : count);
+        for (k = 1; k < workers; k++) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                export_slice(dir, k, workers);
+                _exit(0);
+            }
+            if (pid < 0) export_slice(dir, k, workers);
+        }
+    }
+#endif
+    if (workers) export_slice(dir, 0, workers);
+#ifdef __unix__
+    while (wait(0) > 0)
+        ;
+#endif
+
+    snprintf(path, sizeof(path), "%s/manifest.json", dir);
+    if (!(manifest = fopen(path, "w"))) return -1;
+    fprintf(manifest, "{\n  \"format\": \"raw\",\n  \"pictures\": [");
+    for (n = 0; n < count; n++) {
+        snprintf(path, sizeof(path), "%s/%u.raw", dir, n);
+        if (!(fh = fopen(path, "rb"))) continue;
+        if (fread(head, 1, 5, fh) == 5) {
+            fprintf(manifest,
+                    "%s\n    {\"index\": %u, \"file\": \"%u.raw\", "
+                    "\"width\": %u, \"height\": %u, \"colours\": %u}",
+                    exported ? "," : "", n, n, head[0] | head[1] << 8,
+                    head[2] | head[3] << 8, head[4]);
+            exported++;
+        }
+        fclose(fh);
+    }
+    fprintf(manifest, "\n  ]\n}\n");
+    fclose(manifest);
+    return exported;
+}
+
+/* --server: requests are lines of "<id> <input>" on stdin. A new id starts a
+   player of its own, forked from the game as it was after ms_init(), and
+   gets the opening text first (an empty input only does that). "<id> #close"
+   ends a session. Every reply is a "#[session <id> <length>]" line followed
+   by that many bytes of output, ending in "#[prompt]" while the game waits
+   for more, "#[end]" once it stopped or "#[closed]". Each session is sent
+   its own pictures and tunes, so it keeps the ones it was sent aside while
+   another session plays. */
+
+typedef struct {
+    char id[64];
+    struct ms_session* game;
+    uint32_t* pic_sent;
+    uint8_t* pic_anim;
+    uint16_t pic_nsent;
+    uint8_t** music_sent;
+    uint16_t music_nsent;
+} server_session;
+
+void server_store(server_session* s)
+{
+    ms_session_store(s->game);
+    s->pic_sent = pic_sent;
+    s->pic_anim = pic_anim;
+    s->pic_nsent = pic_nsent;
+    s->music_sent = music_sent;
+    s->music_nsent = music_nsent;
+}
+
+void server_restore(server_session* s)
+{
+    ms_session_restore(s->game);
+    pic_sent = s->pic_sent;
+    pic_anim = s->pic_anim;
+    pic_nsent = s->pic_nsent;
+    music_sent = s->music_sent;
+    music_nsent = s->music_nsent;
+}
+
+/* drop what was sent to the session playing, or to none */
+void server_forget(void)
+{
+    free(pic_sent);
+    free(pic_anim);
+    free(music_sent);
+    pic_sent = 0;
+    pic_anim = 0;
+    pic_nsent = 0;
+    music_sent = 0;
+    music_nsent = 0;
+}
+
+void server_free(server_session* s, uint8_t playing)
+{
+    ms_session_free(s->game);
+    if (playing)
+        server_forget();
+    else {
+        free(s->pic_sent);
+        free(s->pic_anim);
+        free(s->music_sent);
+    }
+}
+
+/* instructions between looks at the slice status */
+#define SERVER_SLICE 100000
+
+/* the next slice, so that it ends as the turn runs out of --turn-budget */
+uint32_t turn_slice(void)
+{
+    uint32_t used = ms_count() - turn_start;
+
+    if (!turn_budget) return SERVER_SLICE;
+    if (used >= turn_budget) return 1;
+    return (turn_budget - used < SERVER_SLICE) ? turn_budget - used + 1 : SERVER_SLICE;
+}
+
+void server_send(const char* id)
+{
+    printf("#[session %s %lu]\n", id, (unsigned long)server_len);
+    fwrite(server_out, 1, server_len, stdout);
+    fflush(stdout);
+    server_len = 0;
+}
+
+/* run the game until it wants the next line, 0 if it stopped instead */
+uint8_t server_turn(const char* line)
+{
+    uint8_t status;
+
+    server_line = line;
+    turn_kept = 0;
+    turn_start = ms_count();
+    turn_reply = server_len;
+    trace_begin("vm");
+    do {
+        status = ms_run_slice(turn_slice());
+        if (turn_budget && ms_count() - turn_start > turn_budget)
+            status = turn_rollback();
+    } while (status != MS_SLICE_INPUT && status != MS_SLICE_STOPPED);
+    trace_end();
+    ms_flush();
+    return status == MS_SLICE_INPUT;
+}
+
+int server_run(void)
+{
+    char line[512], *input;
+    server_session* list = 0;
+    struct ms_session* start;
+    int count = 0, cur = -1, i;
+
+    if (!(start = ms_session_new())) return 1;
+    while (fgets(line, sizeof(line), stdin)) {
+        line[strcspn(line, "\r\n")] = 0;
+        input = line + strcspn(line, " ");
+        if (*input) *input++ = 0;
+        if (!*line) continue;
+        if (strlen(line) >= sizeof(list->id)) {
+            server_append("#[error]\n", 9);
+            server_send("-");
+            continue;
+        }
+        for (i = 0; i < count && strcmp(list[i].id, line); i++)
+            ;
+
+        if (!strcmp(input, "#close")) {
+            if (i < count) {
+                server_free(&list[i], cur == i);
+                list[i] = list[--count];
+                if (cur == i)
+                    cur = -1;
+                else if (cur == count)
+                    cur = i;
+            }
+            server_append("#[closed]\n", 10);
+            server_send(line);
+            continue;
+        }
+
+        if (i == count) {
+            server_session* grown = realloc(list, (count + 1) * sizeof(*list));
+            if (!grown) return 1;
+            list = grown;
+            if (cur >= 0)
+                server_store(&list[cur]);
+            else
+                server_forget();
+            ms_session_restore(start);
+            pic_sent = 0;
+            pic_anim = 0;
+            pic_nsent = 0;
+            music_sent = 0;
+            music_nsent = 0;
+            memset(&list[count], 0, sizeof(*list));
+            if (!(list[count].game = ms_session_new())) return 1;
+            strcpy(list[count].id, line);
+            cur = count++;
+            if (!server_turn(0)) {
+                server_append("#[end]\n", 7);
+                input = "";
+            }
+            server_send(line);
+            if (!*input) continue;
+        } else if (i != cur) {
+            if (cur >= 0)
+                server_store(&list[cur]);
+            else
+                server_forget();
+            server_restore(&list[i]);
+            cur = i;
+        }
+
+        if (!server_turn(input)) {
+            server_append("#[end]\n", 7);
+            server_send(line);
+            /* the game is over, stop the session as with #close */
+            server_free(&list[i], 1);
+            list[i] = list[--count];
+            cur = -1;
+            continue;
+        }
+        server_send(line);
+    }
+    for (i = 0; i < count; i++)
+        server_free(&list[i], cur == i);
+    ms_session_free(start);
+    free(list);
+    free(server_out);
+    return 0;
+}
 
 int main(int argc, char** argv)
 {
     uint8_t running, i, *gamename = 0, *gfxname = 0, *hintname = 0;
-    uint32_t dlimit, slimit;
+    uint8_t* sndname = 0;
+    const char* exportdir = 0;
+    uint32_t dlimit, slimit, seed = 0;
+    uint8_t seeded = 0;
+    double bench_start = 0;
 
+    /* big enough for a turn, see ms_flush() */
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
     if (sizeof(uint8_t) != 1 || sizeof(uint16_t) != 2 || sizeof(uint32_t) != 4) {
         fprintf(stderr, "Unsupported platform: stdint types have unexpected sizes\n");
         exit(1);
     }
     dlimit = slimit = 0xffffffff;
     for (i = 1; i < argc; i++) {
-        if (argv[i][0] == '-') {
+        if (!strcmp(argv[i], "--export-all") && i + 1 < argc)
+            exportdir = argv[++i];
+        else if (!strcmp(argv[i], "--scale") && i + 1 < argc)
+            export_scale = (uint8_t)atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--bench"))
+            bench = 1;
+        else if (!strcmp(argv[i], "--vocab"))
+            vocab = 1;
+        else if (!strcmp(argv[i], "--dump-messages"))
+            dump_messages = 1;
+        else if (!strcmp(argv[i], "--fast-forward") && i + 1 < argc) {
+            if ((logfile1 = fopen(argv[++i], "r"))) {
+                log_on = 1;
+                fastforward = 1;
+            } else
+                printf("Failed to open \"%s\" for reading.\n", argv[i]);
+        } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+            seed = (uint32_t)strtoul(argv[++i], 0, 0);
+            seeded = 1;
+        } else if (!strcmp(argv[i], "--msg-ids"))
+            ms_message_ids(1);
+        else if (!strcmp(argv[i], "--room-var") && i + 1 < argc) {
+            char* end;
+            int32_t addr = (int32_t)strtol(argv[++i], &end, 0);
+            ms_room_var(addr, (uint8_t)(*end == ':' ? atoi(end + 1) : 2));
+        }
+        else if (!strcmp(argv[i], "--server"))
+            server = 1;
+        else if (!strcmp(argv[i], "--stats"))
+            stats = 1;
+        else if (!strcmp(argv[i], "--preload"))
+            preload = 1;
+        else if (!strcmp(argv[i], "--paragraphs"))
+            paragraphs = 1;
+        else if (!strcmp(argv[i], "--rooms"))
+            rooms = 1;
+        else if (!strcmp(argv[i], "--turn-budget") && i + 1 < argc)
+            turn_budget = (uint32_t)strtoul(argv[++i], 0, 0);
+#ifndef NO_HLE
+        else if (!strcmp(argv[i], "--hle") && i + 1 < argc) {
+            i++;
+            ms_hle(!strcmp(argv[i], "off") ? 0 : !strcmp(argv[i], "check") ? 2 : 1);
+        }
+#endif
+        else if (!strcmp(argv[i], "--picture-cache") && i + 1 < argc)
+            ms_picture_cache_dir(argv[++i]);
+        else if (!strcmp(argv[i], "--gfx-cache") && i + 1 < argc)
+            ms_gfx_cache((uint32_t)strtoul(argv[++i], 0, 0));
+        else if (!strcmp(argv[i], "--gamma") && i + 1 < argc) {
+            i++;
+            gamma_mode = !strcmp(argv[i], "off") ? GAMMA_OFF : !strcmp(argv[i], "high") ? GAMMA_HIGH : GAMMA_NORMAL;
+        }
+        else if (!strcmp(argv[i], "--rgba"))
+            rgba_gfx = 1;
+        else if (argv[i][0] == '-') {
             switch (tolower(argv[i][1])) {
             case 'd':
                 if (strlen(argv[i]) > 2)
@@ -293,41 +1480,190 @@ int main(int argc, char** argv)
             gfxname = argv[i];
         else if (!hintname)
             hintname = argv[i];
+        else if (!sndname)
+            sndname = argv[i];
     }
     if (!gamename) {
         printf("Magnetic 2.3.1 - a Magnetic Scrolls interpreter\n\n");
         printf(
-            "Usage: %s [options] game [gfxfile] [hintfile]\n\n"
+            "Usage: %s [options] game [gfxfile] [hintfile] [soundfile]\n\n"
+            "The game may be a bundle (see tools/bundle/bundle.h) holding\n"
+            "the game, graphics, hint and sound files.\n\n"
             "Where the options are:\n"
             " -dn    activate register dump (after n instructions)\n"
             " -rname read script file\n"
             " -sn    safety mode, exits automatically (after n instructions)\n"
             " -tname write transcript file\n"
-            " -wname write script file\n\n"
+            " -wname write script file\n"
+            " --export-all dir  write all pictures and a manifest to dir\n"
+            "                   instead of playing\n"
+            " --scale n         upscale the exported pictures n times (2-4)\n"
+            "                   with Scale2x/Scale3x\n"
+            " --fast-forward name  replay a script without output or\n"
+            "                   pictures, then continue from the keyboard\n"
+            " --seed n          start the random numbers from n, so a\n"
+            "                   replayed script plays out the same\n"
+            " --room-var addr[:size]  where the game keeps the player's\n"
+            "                   location, a byte or word (the default),\n"
+            "                   for the #[room] lines\n"
+            " --rooms           send a #[room n] line when the player\n"
+            "                   has moved\n"
+            " --msg-ids         tag the text of each game string with\n"
+            "                   #[msg <n>] ... #[/msg]\n"
+            " --bench           replay the -r script without output and\n"
+            "                   report instructions, turn times and memory\n"
+            " --vocab           list the dictionary words, one per line\n"
+            "                   with a tab and their bank, instead of\n"
+            "                   playing\n"
+            " --dump-messages   list the text of every game string, one\n"
+            "                   per line after its id and a tab, instead\n"
+            "                   of playing\n"
+            " --server          serve many players, see server_run() in\n"
+            "                   main.c for the protocol\n"
+            " --stats           send a #[stats] line with the instructions,\n"
+            "                   time, text and pictures of each turn\n"
+            " --paragraphs      send each paragraph on one line with a\n"
+            "                   #[p] line after it\n"
+            " --preload         load the game, send #[loaded] and wait\n"
+            "                   for a #[start] or #[start seed=n] line\n"
+            "                   before running it\n"
+            " --turn-budget n   undo a turn that runs more than n\n"
+            "                   instructions, send #[error budget] and\n"
+            "                   ask for the line again\n"
+            " --hle off|on|check  run the copy, search and clear loops\n"
+            "                   of the game as C (on, the default), and\n"
+            "                   with check emulate them too and report\n"
+            "                   where the results differ\n"
+            " --picture-cache dir  keep decoded pictures in dir across\n"
+            "                   sessions (one dir per game)\n"
+            " --gfx-cache n     read the pictures as they are shown and\n"
+            "                   keep at most n bytes of them, instead of\n"
+            "                   loading the whole graphics file\n"
+            " --gamma off|normal|high  how far the picture colours are\n"
+            "                   corrected towards even contrast (normal\n"
+            "                   is half way, the default)\n"
+            " --rgba            send pictures as RGBA pixels, #[rgba] and\n"
+            "                   #[rgbaframe] chunks\n\n"
             "The interpreter commands are:\n"
-            " #undo   undo - don't use it near are_you_sure prompts\n"
-            " #logoff turn off script writing\n\n",
+            " #undo [n] undo n turns (default 1) - don't use it near\n"
+            "           are_you_sure prompts\n"
+            " #logoff turn off script writing\n"
+            " ##save#[file] save the game to file, or to stdout as a\n"
+            "           #[state <length>] chunk\n"
+            " ##restore#[file] restore it, or from a #[state] chunk\n"
+            "           sent on the next line\n"
+            " ##speculate#command run command, keeping the game as it\n"
+            "           was until ##commit# or ##discard#\n\n",
             argv[0]);
         exit(1);
     }
 
-    if (!(ms_gfx_enabled = ms_init(gamename, gfxname, hintname, 0))) {
+#ifdef HAS_BUNDLE
+    /* a bundle holds the game and the files that go with it */
+    if (bundle_open((char*)gamename)) {
+        gamename = (uint8_t*)"story";
+        if (!gfxname && bundle_find("graphics", 0)) gfxname = (uint8_t*)"graphics";
+        if (!hintname && bundle_find("hints", 0)) hintname = (uint8_t*)"hints";
+        if (!sndname && bundle_find("sound", 0)) sndname = (uint8_t*)"sound";
+    }
+#endif
+    if (!(ms_gfx_enabled = ms_init(gamename, gfxname, hintname, sndname))) {
         printf("Couldn't start up game \"%s\".\n", gamename);
         exit(1);
     }
+    if (seeded) ms_seed(seed);
+    if (exportdir) {
+        int exported;
+
+        if (export_scale != 1 &&
+            (export_scale < SCALE_MIN || export_scale > SCALE_MAX)) {
+            printf("--scale takes %d to %d.\n", SCALE_MIN, SCALE_MAX);
+            exit(1);
+        }
+        exported = (ms_gfx_enabled == 2) ? export_all(exportdir) : -1;
+        ms_freemem();
+        if (exported < 0) {
+            printf("Couldn't export pictures to \"%s\".\n", exportdir);
+            exit(1);
+        }
+        printf("Exported %d pictures to \"%s\".\n", exported, exportdir);
+        return 0;
+    }
+    if (dump_messages) {
+        uint32_t n = ms_messages(dump_message);
+        ms_freemem();
+        return n ? 0 : 1;
+    }
+    if (bench && log_on != 1) {
+        printf("--bench needs a script to replay (-rname).\n");
+        exit(1);
+    }
     ms_gfx_enabled--;
+    if (vocab) {
+        running = 1;
+        while ((ms_count() < slimit) && running)
+            running = ms_rungame();
+        ms_freemem();
+        if (!vocab_words) {
+            printf("Couldn't find the dictionary of \"%s\".\n", gamename);
+            exit(1);
+        }
+        return 0;
+    }
+    if (preload && !wait_for_start()) {
+        ms_freemem();
+        return 0;
+    }
+    stats_start = bench_now();
+    if (turn_budget && !(turn_game = ms_session_new())) {
+        printf("Not enough memory for --turn-budget.\n");
+        exit(1);
+    }
+    if (server) {
+        int rc = server_run();
+        ms_session_free(turn_game);
+        ms_freemem();
+        return rc;
+    }
     running = 1;
-    while ((ms_count() < slimit) && running) {
+    bench_start = bench_now();
+    /* the game's input, text, pictures and output are spans within this,
+       and ms_getchar() starts another one for each turn */
+    trace_begin("vm");
+    while ((ms_count() < slimit) && running && !bench_done) {
         if (ms_count() >= dlimit) ms_status();
         running = ms_rungame();
+        if (turn_budget && ms_count() - turn_start > turn_budget) turn_rollback();
+    }
+    trace_end();
+    ms_session_free(turn_game);
+    if (bench) {
+        bench_report(bench_now() - bench_start);
+#ifdef PROFILE
+        ms_profile();
+#endif
+        ms_freemem();
+        log_close();
+        free(bench_turns);
+        return 0;
     }
     if (ms_count() == slimit) {
         printf("\n\nSafety limit (%d) reached.\n", slimit);
         ms_status();
     }
+#ifdef PROFILE
+    else
+        ms_profile();
+#endif
     ms_freemem();
-    if (log_on) fclose(logfile1);
-    if (logfile2) fclose(logfile2);
+#ifdef HAS_BUNDLE
+    bundle_close();
+#endif
+    free(pic_sent);
+    free(pic_anim);
+    free(music_sent);
+    free(fork_state);
+    log_close();
     printf("\nExiting.\n");
     return 0;
 }
@@ -0,0 +1,186 @@
+/*
+ * bundle.c
+ *
+ * Reader for talkie game bundles, see bundle.h for the layout. The whole
+ * bundle is mapped once; entries are handed out as pointers into the map or
+ * as streams over them, so the interpreters' fopen/fread code reads them
+ * unchanged.
+ */
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L /* fmemopen() */
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bundle.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define BUNDLE_MMAP
+#endif
+
+static unsigned char* bundle_data = NULL;
+static unsigned long bundle_size = 0;
+static unsigned long bundle_count = 0;
+
+static unsigned long bundle_read_l(const unsigned char* p)
+{
+    return (unsigned long)p[0] | (unsigned long)p[1] << 8 |
+           (unsigned long)p[2] << 16 | (unsigned long)p[3] << 24;
+}
+
+static void bundle_unmap(void)
+{
+#ifdef BUNDLE_MMAP
+    if (bundle_data != NULL)
+        munmap(bundle_data, bundle_size);
+#else
+    free(bundle_data);
+#endif
+    bundle_data = NULL;
+    bundle_size = 0;
+    bundle_count = 0;
+}
+
+static int bundle_map(const char* path)
+{
+#ifdef BUNDLE_MMAP
+    struct stat st;
+    void* p;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return 0;
+    if (fstat(fd, &st) < 0 || st.st_size < BUNDLE_HEADER_SIZE) {
+        close(fd);
+        return 0;
+    }
+    p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return 0;
+    bundle_data = p;
+    bundle_size = (unsigned long)st.st_size;
+#else
+    FILE* f;
+    long size;
+
+    if ((f = fopen(path, "rb")) == NULL)
+        return 0;
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < BUNDLE_HEADER_SIZE ||
+        fseek(f, 0, SEEK_SET) != 0 ||
+        (bundle_data = malloc((size_t)size)) == NULL) {
+        fclose(f);
+        return 0;
+    }
+    if (fread(bundle_data, 1, (size_t)size, f) != (size_t)size) {
+        fclose(f);
+        free(bundle_data);
+        bundle_data = NULL;
+        return 0;
+    }
+    fclose(f);
+    bundle_size = (unsigned long)size;
+#endif
+    return 1;
+}
+
+int bundle_open(const char* path)
+{
+    FILE* f;
+    unsigned char magic[4];
+    unsigned long i;
+    const unsigned char* e;
+
+    bundle_close();
+
+    /* most files given to us are not bundles, check before mapping */
+    if ((f = fopen(path, "rb")) == NULL)
+        return 0;
+    i = (unsigned long)fread(magic, 1, sizeof(magic), f);
+    fclose(f);
+    if (i != sizeof(magic) || memcmp(magic, BUNDLE_MAGIC, sizeof(magic)) != 0)
+        return 0;
+
+    if (!bundle_map(path))
+        return 0;
+    bundle_count = bundle_read_l(bundle_data + 4);
+    if (bundle_count > (bundle_size - BUNDLE_HEADER_SIZE) / BUNDLE_ENTRY_SIZE) {
+        bundle_unmap();
+        return 0;
+    }
+    for (i = 0; i < bundle_count; i++) {
+        e = bundle_data + BUNDLE_HEADER_SIZE + i * BUNDLE_ENTRY_SIZE;
+        if (bundle_read_l(e) > bundle_size ||
+            bundle_read_l(e + 4) > bundle_size - bundle_read_l(e) ||
+            memchr(e + 8, 0, BUNDLE_NAME_SIZE) == NULL) {
+            bundle_unmap();
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void bundle_close(void)
+{
+    bundle_unmap();
+}
+
+int bundle_active(void)
+{
+    return bundle_data != NULL;
+}
+
+const unsigned char* bundle_find(const char* name, unsigned long* size)
+{
+    unsigned long i;
+    const unsigned char* e;
+
+    for (i = 0; i < bundle_count; i++) {
+        e = bundle_data + BUNDLE_HEADER_SIZE + i * BUNDLE_ENTRY_SIZE;
+        if (strcmp((const char*)e + 8, name) == 0) {
+            if (size != NULL)
+                *size = bundle_read_l(e + 4);
+            return bundle_data + bundle_read_l(e);
+        }
+    }
+    return NULL;
+}
+
+const char* bundle_name(unsigned long i)
+{
+    if (i >= bundle_count)
+        return NULL;
+    return (const char*)bundle_data + BUNDLE_HEADER_SIZE +
+           i * BUNDLE_ENTRY_SIZE + 8;
+}
+
+FILE* bundle_fopen(const char* name)
+{
+    const unsigned char* data;
+    unsigned long size;
+    FILE* f;
+
+    if ((data = bundle_find(name, &size)) == NULL)
+        return fopen(name, "rb");
+#ifdef BUNDLE_MMAP
+    /* fmemopen() cannot open an empty buffer */
+    if (size == 0)
+        return fopen("/dev/null", "rb");
+    f = fmemopen((void*)data, size, "rb");
+#else
+    if ((f = tmpfile()) != NULL) {
+        if (fwrite(data, 1, size, f) != size) {
+            fclose(f);
+            return NULL;
+        }
+        rewind(f);
+    }
+#endif
+    return f;
+}
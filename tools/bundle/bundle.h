@@ -0,0 +1,51 @@
+/*
+ * bundle.h
+ *
+ * Reader for talkie game bundles: one file holding the story, its graphics
+ * and anything else an interpreter needs, so a game is started with one open
+ * and one map instead of a search for each of its files.
+ *
+ * The layout is little-endian and uncompressed:
+ *
+ *   0   "TKB1"
+ *   4   number of entries
+ *   8   alignment of the entry data (4096)
+ *   12  0
+ *   16  the entries, 64 bytes each:
+ *         0   offset of the data from the start of the file
+ *         4   length of the data
+ *         8   name, NUL padded to 56 bytes
+ *
+ * Entry data starts on an alignment boundary so that it can be mapped on
+ * its own. The names the interpreters look for are "story", "graphics"
+ * (Magnetic .gfx or Level 9 picture file), "hints", "sound", "pics/<name>"
+ * (the files of a Level 9 bitmap directory) and "meta" (JSON, see
+ * talkie/bundle.py which writes the bundles).
+ */
+
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stdio.h>
+
+#define BUNDLE_MAGIC "TKB1"
+#define BUNDLE_HEADER_SIZE 16
+#define BUNDLE_ENTRY_SIZE 64
+#define BUNDLE_NAME_SIZE 56
+
+/* Returns 1 if path is a bundle, which then becomes the current one */
+int bundle_open(const char* path);
+void bundle_close(void);
+int bundle_active(void);
+
+/* The data of the named entry in the current bundle, or NULL */
+const unsigned char* bundle_find(const char* name, unsigned long* size);
+
+/* The name of entry i of the current bundle, NULL past the last */
+const char* bundle_name(unsigned long i);
+
+/* A read-only stream over the named entry if the current bundle has one,
+   otherwise fopen(name, "rb") */
+FILE* bundle_fopen(const char* name);
+
+#endif /* BUNDLE_H */
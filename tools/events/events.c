@@ -0,0 +1,167 @@
+/*
+ * events.c
+ *
+ * The event ring, see events.h. Events are records of a header and their
+ * data, kept whole so that ev_peek() can hand the data out where it is:
+ * one that would run past the end of the buffer goes in at the start, and
+ * a pad record takes up the rest. Records are EV_ALIGN aligned, so there
+ * is always room for a header at the end.
+ *
+ * head and tail count the bytes put and taken since the start, the
+ * producer only writes head and the consumer only tail. Each also keeps
+ * the other's as it last saw it, and only looks again when that is not
+ * enough, so the two sides share a cache line no more than they must.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "events.h"
+
+#if defined(__GNUC__)
+#define ev_load(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define ev_store(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else
+#define ev_load(p) (*(p))
+#define ev_store(p, v) (*(p) = (v))
+#endif
+
+#define EV_ALIGN 16
+#define EV_LINE 64
+#define EV_PAD 0
+
+struct ev_head
+{
+    unsigned int type, len;
+    long arg;
+};
+
+#define EV_HEAD ((sizeof(struct ev_head) + EV_ALIGN - 1) & ~(unsigned long)(EV_ALIGN - 1))
+
+struct ev_ring
+{
+    unsigned char* buf;
+    unsigned long mask;
+    char pad0[EV_LINE - sizeof(unsigned char*) - sizeof(unsigned long)];
+    /* the producer's */
+    unsigned long head, tail_seen;
+    char pad1[EV_LINE - 2 * sizeof(unsigned long)];
+    /* the consumer's */
+    unsigned long tail, head_seen;
+    char pad2[EV_LINE - 2 * sizeof(unsigned long)];
+};
+
+static unsigned long ev_align(unsigned long n)
+{
+    return (n + EV_ALIGN - 1) & ~(unsigned long)(EV_ALIGN - 1);
+}
+
+struct ev_ring* ev_ring_new(unsigned long size)
+{
+    struct ev_ring* ring;
+    unsigned long n = EV_MIN_SIZE;
+
+    while (n < size)
+        n *= 2;
+    if ((ring = calloc(1, sizeof(*ring))) == NULL) return NULL;
+    if ((ring->buf = malloc(n)) == NULL) {
+        free(ring);
+        return NULL;
+    }
+    ring->mask = n - 1;
+    return ring;
+}
+
+void ev_ring_free(struct ev_ring* ring)
+{
+    if (ring == NULL) return;
+    free(ring->buf);
+    free(ring);
+}
+
+/* the bytes free from head on, looking at tail again only if need are not */
+static unsigned long ev_free(struct ev_ring* ring, unsigned long need)
+{
+    unsigned long size = ring->mask + 1;
+
+    if (size - (ring->head - ring->tail_seen) < need)
+        ring->tail_seen = ev_load(&ring->tail);
+    return size - (ring->head - ring->tail_seen);
+}
+
+unsigned long ev_max(const struct ev_ring* ring)
+{
+    return ring->mask + 1 - EV_HEAD;
+}
+
+unsigned long ev_room(struct ev_ring* ring)
+{
+    unsigned long size = ring->mask + 1;
+    unsigned long left = ev_free(ring, size);
+    unsigned long end = size - (ring->head & ring->mask);
+    unsigned long fit = left < end ? left : end;
+
+    /* past the end the record starts again at the beginning */
+    if (left > end && left - end > fit) fit = left - end;
+    return fit > EV_HEAD ? (fit - EV_HEAD) & ~(unsigned long)(EV_ALIGN - 1) : 0;
+}
+
+int ev_put(struct ev_ring* ring, int type, long arg, const void* data,
+           unsigned long len)
+{
+    unsigned long head = ring->head;
+    unsigned long need = EV_HEAD + ev_align(len);
+    unsigned long end = (ring->mask + 1) - (head & ring->mask);
+    /* a record that wraps needs the pad's room as well */
+    unsigned long left = ev_free(ring, need > end ? need + end : need);
+    struct ev_head h;
+
+    if (need > end) {
+        /* pad to the end, the record goes at the start */
+        if (need + end > left) return -1;
+        h.type = EV_PAD;
+        h.len = (unsigned int)(end - EV_HEAD);
+        h.arg = 0;
+        memcpy(ring->buf + (head & ring->mask), &h, sizeof(h));
+        head += end;
+    } else if (need > left)
+        return -1;
+
+    h.type = (unsigned int)type;
+    h.len = (unsigned int)len;
+    h.arg = arg;
+    memcpy(ring->buf + (head & ring->mask), &h, sizeof(h));
+    if (len) memcpy(ring->buf + (head & ring->mask) + EV_HEAD, data, len);
+    /* the pad and the record are written before the consumer can see
+       either */
+    ev_store(&ring->head, head + need);
+    return 0;
+}
+
+int ev_peek(struct ev_ring* ring, struct ev_event* ev)
+{
+    struct ev_head h;
+
+    for (;;) {
+        if (ring->tail == ring->head_seen) {
+            ring->head_seen = ev_load(&ring->head);
+            if (ring->tail == ring->head_seen) return 0;
+        }
+        memcpy(&h, ring->buf + (ring->tail & ring->mask), sizeof(h));
+        if (h.type != EV_PAD) break;
+        ev_store(&ring->tail, ring->tail + EV_HEAD + h.len);
+    }
+    ev->type = (int)h.type;
+    ev->arg = h.arg;
+    ev->data = ring->buf + (ring->tail & ring->mask) + EV_HEAD;
+    ev->len = h.len;
+    return 1;
+}
+
+void ev_pop(struct ev_ring* ring)
+{
+    struct ev_event ev;
+
+    if (ev_peek(ring, &ev))
+        ev_store(&ring->tail, ring->tail + EV_HEAD + ev_align(ev.len));
+}
@@ -0,0 +1,76 @@
+/*
+ * events.h
+ *
+ * A ring of typed events from one thread to one other, without locks or
+ * system calls, for an interpreter library running its game on a worker
+ * thread: the engine puts the game's text, pictures, status lines and
+ * prompts in, the host takes them out as it renders them.
+ *
+ * The ring has a fixed size and never waits. ev_put() fails when the
+ * event does not fit, the engine keeps it and ends its slice, and runs on
+ * once the host has taken enough out. So neither side blocks the other,
+ * and a host that falls behind holds the game up instead of filling the
+ * memory. An event's data stays in the ring until the host is done with
+ * it, there is no copy on the way out.
+ *
+ * Only one thread may put and only one take. Where the compiler has no
+ * atomics (GCC and Clang do) both must be the same thread.
+ */
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The event types. What arg and the data hold is up to the library that
+   puts them, see maglib.h and l9lib.h. */
+#define EV_TEXT 1    /* a span of the game's text */
+#define EV_PICTURE 2 /* a picture to show */
+#define EV_META 3    /* something about the game, e.g. its status line */
+#define EV_PROMPT 4  /* the game waits for input */
+
+/* The smallest ring ev_ring_new() makes */
+#define EV_MIN_SIZE 4096
+
+struct ev_ring;
+
+struct ev_event
+{
+    int type;
+    long arg;
+    const void* data; /* in the ring, until ev_pop() */
+    unsigned long len;
+};
+
+/* A ring of size bytes, rounded up to a power of two of at least
+   EV_MIN_SIZE. NULL if there is not enough memory. */
+struct ev_ring* ev_ring_new(unsigned long size);
+
+void ev_ring_free(struct ev_ring* ring);
+
+/* The most data an event can have, in an empty ring */
+unsigned long ev_max(const struct ev_ring* ring);
+
+/* For the producer: the most data an event put now can have, 0 if the
+   ring is full. A longer text span goes in as several. */
+unsigned long ev_room(struct ev_ring* ring);
+
+/* For the producer: puts an event with len bytes of data. Returns 0, or
+   -1 if it does not fit now; nothing is put then. */
+int ev_put(struct ev_ring* ring, int type, long arg, const void* data,
+           unsigned long len);
+
+/* For the consumer: the oldest event, 1 if there is one. It stays the
+   oldest until ev_pop(). */
+int ev_peek(struct ev_ring* ring, struct ev_event* ev);
+
+/* For the consumer: removes the oldest event, making room for more */
+void ev_pop(struct ev_ring* ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EVENTS_H */
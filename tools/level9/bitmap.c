@@ -22,12 +22,27 @@
 *
 \***********************************************************************/
 
+#include <ctype.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <strings.h>
+#define BITMAP_DIR_INDEX
+#endif
 
 #include "level9.h"
 
+/* the picture files may come from a bundle, see tools/bundle/bundle.h */
+#ifdef HAS_BUNDLE
+#include "bundle.h"
+#else
+#define bundle_fopen(f) fopen(f,"rb")
+#endif
+
 extern Bitmap* bitmap;
 
 L9UINT32 filelength(FILE *f);
@@ -36,7 +51,7 @@ void L9Allocate(L9BYTE **ptr,L9UINT32 Size);
 L9BYTE* bitmap_load(char* file, L9UINT32* size)
 {
 	L9BYTE* data = NULL;
-	FILE* f = fopen(file,"rb");
+	FILE* f = bundle_fopen(file);
 	if (f)
 	{
 		*size = filelength(f);
@@ -51,10 +66,41 @@ L9BYTE* bitmap_load(char* file, L9UINT32* size)
 	return data;
 }
 
+/*
+	Bitmaps that are no longer needed go back to a small pool rather than
+	to free(), and bitmap_alloc() hands them out again when they are big
+	enough. The pictures of a game are mostly of one size, so decoding one
+	after another reuses the same few buffers.
+*/
+#define BITMAP_POOL_SIZE 4
+
+typedef struct
+{
+	Bitmap* bitmap;
+	L9UINT32 pixels; /* room for this many */
+} BitmapPoolEntry;
+
+static BitmapPoolEntry bitmap_pool[BITMAP_POOL_SIZE];
+static int bitmap_pool_count = 0;
+
 Bitmap* bitmap_alloc(int x, int y)
 {
 	Bitmap* bitmap = NULL;
-	L9Allocate((L9BYTE**)&bitmap,sizeof(Bitmap)+(x*y));
+	L9UINT32 pixels = (L9UINT32)x*y;
+	int i;
+
+	for (i = 0; i < bitmap_pool_count; i++)
+	{
+		if (bitmap_pool[i].pixels >= pixels)
+		{
+			bitmap = bitmap_pool[i].bitmap;
+			pixels = bitmap_pool[i].pixels;
+			bitmap_pool[i] = bitmap_pool[--bitmap_pool_count];
+			break;
+		}
+	}
+	if (bitmap == NULL)
+		L9Allocate((L9BYTE**)&bitmap,sizeof(Bitmap)+pixels);
 
 	bitmap->width = x;
 	bitmap->height = y;
@@ -63,6 +109,153 @@ Bitmap* bitmap_alloc(int x, int y)
 	return bitmap;
 }
 
+/* Give a bitmap from bitmap_alloc() back, NULL is ignored */
+void bitmap_release(Bitmap* b)
+{
+	int i, smallest = 0;
+
+	if (b == NULL)
+		return;
+	if (bitmap_pool_count < BITMAP_POOL_SIZE)
+	{
+		bitmap_pool[bitmap_pool_count].bitmap = b;
+		bitmap_pool[bitmap_pool_count++].pixels = (L9UINT32)b->width*b->height;
+		return;
+	}
+	/* a full pool keeps the biggest buffers */
+	for (i = 1; i < BITMAP_POOL_SIZE; i++)
+	{
+		if (bitmap_pool[i].pixels < bitmap_pool[smallest].pixels)
+			smallest = i;
+	}
+	if (bitmap_pool[smallest].pixels < (L9UINT32)b->width*b->height)
+	{
+		free(bitmap_pool[smallest].bitmap);
+		bitmap_pool[smallest].bitmap = b;
+		bitmap_pool[smallest].pixels = (L9UINT32)b->width*b->height;
+	}
+	else
+		free(b);
+}
+
+static void bitmap_pool_free(void)
+{
+	while (bitmap_pool_count > 0)
+		free(bitmap_pool[--bitmap_pool_count].bitmap);
+}
+
+/*
+	Which picture files exist is answered from a sorted list of the names in
+	the picture directory, read once with a single directory scan, rather
+	than by opening each candidate name in turn. This matters when the
+	pictures are on a network filesystem. A name that only matches with a
+	different case is checked with os_find_file(), in case the filesystem
+	ignores case. Where the directory cannot be read, or there is no
+	directory scan, every lookup goes to os_find_file(). When the game came
+	in a bundle the pictures are its "pics/" entries and nothing else is
+	looked at.
+*/
+#ifdef BITMAP_DIR_INDEX
+static char bitmap_index_dir[MAX_PATH];
+static char** bitmap_index = NULL;
+static int bitmap_index_count = 0;
+static L9BOOL bitmap_index_read = FALSE; /* bitmap_index_dir has been scanned */
+static L9BOOL bitmap_index_ok = FALSE;
+
+static int bitmap_index_compare(const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a,*(char* const*)b);
+}
+
+static void bitmap_index_free(void)
+{
+	int i;
+
+	for (i = 0; i < bitmap_index_count; i++)
+		free(bitmap_index[i]);
+	free(bitmap_index);
+	bitmap_index = NULL;
+	bitmap_index_count = 0;
+	bitmap_index_read = FALSE;
+	bitmap_index_ok = FALSE;
+}
+
+static void bitmap_index_scan(const char* dir)
+{
+	DIR* d;
+	struct dirent* de;
+	char** grown;
+	int size = 0;
+
+	bitmap_index_free();
+	strcpy(bitmap_index_dir,dir);
+	bitmap_index_read = TRUE;
+
+	d = opendir(*dir ? dir : ".");
+	if (d == NULL)
+		return;
+	while ((de = readdir(d)) != NULL)
+	{
+		if (bitmap_index_count == size)
+		{
+			size = size ? size*2 : 64;
+			grown = realloc(bitmap_index,size*sizeof(char*));
+			if (grown == NULL)
+			{
+				closedir(d);
+				bitmap_index_free();
+				bitmap_index_read = TRUE;
+				return;
+			}
+			bitmap_index = grown;
+		}
+		bitmap_index[bitmap_index_count] = malloc(strlen(de->d_name)+1);
+		if (bitmap_index[bitmap_index_count] == NULL)
+			break;
+		strcpy(bitmap_index[bitmap_index_count++],de->d_name);
+	}
+	closedir(d);
+	qsort(bitmap_index,bitmap_index_count,sizeof(char*),bitmap_index_compare);
+	bitmap_index_ok = (de == NULL);
+}
+#endif
+
+L9BOOL bitmap_find_file(char* file)
+{
+#ifdef HAS_BUNDLE
+	if (bundle_active())
+		return bundle_find(file,NULL) != NULL;
+#endif
+#ifdef BITMAP_DIR_INDEX
+	char dir[MAX_PATH];
+	char* name = strrchr(file,'/');
+	int i, len;
+
+	name = (name != NULL) ? name+1 : file;
+	len = (int)(name-file);
+	if (len >= MAX_PATH)
+		return os_find_file(file);
+	memcpy(dir,file,len);
+	dir[len] = '\0';
+
+	if (!bitmap_index_read || strcmp(dir,bitmap_index_dir) != 0)
+		bitmap_index_scan(dir);
+	if (!bitmap_index_ok)
+		return os_find_file(file);
+
+	if (bsearch(&name,bitmap_index,bitmap_index_count,sizeof(char*),bitmap_index_compare))
+		return TRUE;
+	for (i = 0; i < bitmap_index_count; i++)
+	{
+		if (strcasecmp(name,bitmap_index[i]) == 0)
+			return os_find_file(file);
+	}
+	return FALSE;
+#else
+	return os_find_file(file);
+#endif
+}
+
 /*
 	A PC or ST palette colour is a sixteen bit value in which the low three nybbles
 	hold the rgb colour values. The lowest nybble holds the blue value, the 
@@ -97,98 +290,67 @@ Colour bitmap_pcst_colour(int big, int small)
 */
 
 /*
-	Extracts the number of pixels requested from an eight-byte data block (4 bit-
-	planes) passed to it.
-
-	Note:	On entry each one of four pointers is set to point to the start of each
-			bit-plane in the block. The function then indexes through each byte in
-			each bit plane. and uses shift and mask operations to extract each four
-			bit pixel into an L9PIXEL.
-
-			The bit belonging to the pixel in the current byte of the current bit-
-			plane is moved to its position in an eight-bit pixel. The byte is then
-			masked by a value to select only that bit and added to the final pixel
-			value.
+	Planar to chunky conversion, shared by the ST, Amiga and Mac decoders.
+
+	bitmap_planar_spread[b] holds the eight pixels of the bitplane byte b,
+	one to a byte in screen order (the MSBit being the leftmost pixel), so
+	eight pixels are built by or-ing together the entries for the byte from
+	each bitplane, shifted up to the bit that plane stands for. Each entry
+	is two words, so this is four pixels to an operation rather than one,
+	or all eight in the first word, the second left at zero, where an
+	L9UINT32 has eight bytes. An L9UINT32 has at least four, so the two
+	words always hold the eight pixels, and a pixel never carries into the
+	next byte.
 */
-L9UINT32 bitmap_st1_decode_pixels(L9BYTE* bitmap, L9BYTE* data, L9UINT32 count, L9UINT32 pixels)
-{
-	L9UINT32 bitplane_length = count / 4; /* length of each bitplane */
-	L9BYTE *bitplane0 = data; /* address of bit0 bitplane */
-	L9BYTE *bitplane1 = data + (bitplane_length); /* address of bit1 bitplane */
-	L9BYTE *bitplane2 = data + (bitplane_length * 2); /* address of bit2 bitplane */
-	L9BYTE *bitplane3 = data + (bitplane_length * 3); /* address of bit3 bitplane */
-	L9UINT32 bitplane_index, pixel_index = 0; /* index variables */
-
-	for (bitplane_index = 0; bitplane_index < bitplane_length; bitplane_index++)
-	{
-		/* build the eight pixels from the current bitplane bytes, high bit to low */
-
-		/* bit7 byte */
-		bitmap[pixel_index] = ((bitplane3[bitplane_index] >> 4) & 0x08) 
-			+ ((bitplane2[bitplane_index] >> 5) & 0x04)
-			+ ((bitplane1[bitplane_index] >> 6) & 0x02) 
-			+ ((bitplane0[bitplane_index] >> 7) & 0x01);
-		if (pixels == ++pixel_index)
-			break;
-
-		/* bit6 byte */
-		bitmap[pixel_index] = ((bitplane3[bitplane_index] >> 3) & 0x08) 
-			+ ((bitplane2[bitplane_index] >> 4) & 0x04)
-			+ ((bitplane1[bitplane_index] >> 5) & 0x02) 
-			+ ((bitplane0[bitplane_index] >> 6) & 0x01);
-		if (pixels == ++pixel_index)
-			break;
-
-		/* bit5 byte */
-		bitmap[pixel_index] = ((bitplane3[bitplane_index] >> 2) & 0x08) 
-			+ ((bitplane2[bitplane_index] >> 3) & 0x04)
-			+ ((bitplane1[bitplane_index] >> 4) & 0x02) 
-			+ ((bitplane0[bitplane_index] >> 5) & 0x01);
-		if (pixels == ++pixel_index)
-			break;
+static L9UINT32 bitmap_planar_spread[256][2];
+static L9BOOL bitmap_planar_ready = FALSE;
 
-		/* bit4 byte */
-		bitmap[pixel_index] = ((bitplane3[bitplane_index] >> 1) & 0x08) 
-			+ ((bitplane2[bitplane_index] >> 2) & 0x04)
-			+ ((bitplane1[bitplane_index] >> 3) & 0x02) 
-			+ ((bitplane0[bitplane_index] >> 4) & 0x01);
-		if (pixels == ++pixel_index)
-			break;
+void bitmap_planar_init(void)
+{
+	L9BYTE pixels[8];
+	int b, i;
 
-		/* bit3 byte */
-		bitmap[pixel_index] = ((bitplane3[bitplane_index]) & 0x08) 
-			+ ((bitplane2[bitplane_index] >> 1) & 0x04)
-			+ ((bitplane1[bitplane_index] >> 2) & 0x02) 
-			+ ((bitplane0[bitplane_index] >> 3) & 0x01);
-		if (pixels == ++pixel_index)
-			break;
+	for (b = 0; b < 256; b++)
+	{
+		for (i = 0; i < 8; i++)
+			pixels[i] = (L9BYTE)((b>>(7-i))&1);
+		bitmap_planar_spread[b][0] = bitmap_planar_spread[b][1] = 0;
+		memcpy(bitmap_planar_spread[b],pixels,sizeof pixels);
+	}
+	bitmap_planar_ready = TRUE;
+}
 
-		/* bit2 byte */
-		bitmap[pixel_index] = ((bitplane3[bitplane_index] << 1) & 0x08) 
-			+ ((bitplane2[bitplane_index]) & 0x04)
-			+ ((bitplane1[bitplane_index] >> 1) & 0x02) 
-			+ ((bitplane0[bitplane_index] >> 2) & 0x01);
-		if (pixels == ++pixel_index)
-			break;
+/*
+	Converts one row of pixels. Byte k of the row in bitplane p is at
+	planes[p][(k/group)*stride+(k%group)], which covers the ST's interleaved
+	sixteen pixel blocks (group 2, stride 8) as well as plain bitplanes
+	(group 1, stride 1).
+*/
+void bitmap_planar_row(L9BYTE* out, L9BYTE** planes, int nplanes, int group, int stride, int pixels)
+{
+	L9UINT32 chunk[2];
+	const L9UINT32* spread;
+	int k, p, offset;
 
-		/* bit1 byte */
-		bitmap[pixel_index] = ((bitplane3[bitplane_index] << 2) & 0x08) 
-			+ ((bitplane2[bitplane_index] << 1) & 0x04)
-			+ ((bitplane1[bitplane_index]) & 0x02) 
-			+ ((bitplane0[bitplane_index] >> 1) & 0x01);
-		if (pixels == ++pixel_index)
-			break;
+	if (!bitmap_planar_ready)
+		bitmap_planar_init();
 
-		/* bit0 byte */
-		bitmap[pixel_index] = ((bitplane3[bitplane_index] << 3) & 0x08) 
-			+ ((bitplane2[bitplane_index] << 2) & 0x04)
-			+ ((bitplane1[bitplane_index] << 1) & 0x02) 
-			+ ((bitplane0[bitplane_index]) & 0x01);
-		if (pixels == ++pixel_index)
-			break;
+	for (k = 0; pixels > 0; k++, pixels -= 8, out += 8)
+	{
+		offset = (k/group)*stride+(k%group);
+		chunk[0] = chunk[1] = 0;
+		for (p = 0; p < nplanes; p++)
+		{
+			spread = bitmap_planar_spread[planes[p][offset]];
+			chunk[0] |= spread[0]<<p;
+			if (sizeof(L9UINT32) < 8)
+				chunk[1] |= spread[1]<<p;
+		}
+		if (pixels >= 8)
+			memcpy(out,chunk,8);
+		else
+			memcpy(out,chunk,pixels);
 	}
-
-	return pixel_index;
 }
 
 /*
@@ -255,16 +417,17 @@ L9UINT32 bitmap_st1_decode_pixels(L9BYTE* bitmap, L9BYTE* data, L9UINT32 count,
 
 	Having obtained the pixel dimensions of the image the function uses
 	them to allocate memory for the bitmap and then extracts the pixel
-	information from the bitmap row by row. For each row eight byte blocks
-	are read from the image data and passed to UnpackSTv1Pixels along with
-	the number of pixels to extract (usually 16, possibly less for the last
-	block in a row.)
+	information from the bitmap row by row, each row being passed to
+	bitmap_planar_row() as four bitplanes interleaved in eight byte blocks.
+	Only max_x pixels are kept, so the noise at the end of the last block is
+	dropped.
 */
 L9BOOL bitmap_st1_decode(char* file, int x, int y)
 {
 	L9BYTE* data = NULL;
-	int i, xi, yi, max_x, max_y, last_block;
-	int bitplanes_row, bitmaps_row, pixel_count, get_pixels;
+	L9BYTE* planes[4];
+	int i, yi, max_x, max_y, last_block;
+	int bitplanes_row;
 
 	L9UINT32 size;
 	data = bitmap_load(file,&size);
@@ -272,7 +435,6 @@ L9BOOL bitmap_st1_decode(char* file, int x, int y)
 		return FALSE;
 
 	bitplanes_row = data[35]+data[34]*256;
-	bitmaps_row = bitplanes_row/4;
 	max_x = bitplanes_row*4;
 	max_y = data[39]+data[38]*256;
 	last_block = data[43]+data[42]*256;
@@ -298,8 +460,7 @@ L9BOOL bitmap_st1_decode(char* file, int x, int y)
 
 	if ((x == 0) && (y == 0))
 	{
-		if (bitmap)
-			free(bitmap);
+		bitmap_release(bitmap);
 		bitmap = bitmap_alloc(max_x,max_y);
 	}
 	if (bitmap == NULL)
@@ -315,18 +476,9 @@ L9BOOL bitmap_st1_decode(char* file, int x, int y)
 
 	for (yi = 0; yi < max_y; yi++)
 	{
-		pixel_count = 0;
-		for (xi = 0; xi < bitmaps_row; xi++)
-		{
-			if ((max_x - pixel_count) < 16)
-				get_pixels = max_x - pixel_count;
-			else
-				get_pixels = 16;
-
-			pixel_count += bitmap_st1_decode_pixels(
-				bitmap->bitmap+((y+yi)*bitmap->width)+x+(xi*16),
-				data+44+(yi*bitplanes_row*2)+(xi*8),8,get_pixels);
-		}
+		for (i = 0; i < 4; i++)
+			planes[i] = data+44+(yi*bitplanes_row*2)+(i*2);
+		bitmap_planar_row(bitmap->bitmap+((y+yi)*bitmap->width)+x,planes,4,2,8,max_x);
 	}
 
 	bitmap->npalette = 16;
@@ -403,55 +555,37 @@ Colour bitmap_pc1_colour(int i)
 	image colour table. The pixels are organised with the top left first and 
 	bottom left last, each row in turn.
 */
-L9BOOL bitmap_pc1_decode(char* file, int x, int y)
+static L9BOOL bitmap_pc1_pixels(const L9BYTE* data, L9UINT32 size, Bitmap* out, int x, int y)
 {
-	L9BYTE* data = NULL;
 	int i, xi, yi, max_x, max_y;
+	L9UINT32 at;
 
-	L9UINT32 size;
-	data = bitmap_load(file,&size);
-	if (data == NULL)
+	if (size < 22)
 		return FALSE;
-
 	max_x = data[2]+data[3]*256;
 	max_y = data[4]+data[5]*256;
 	if (max_x > MAX_BITMAP_WIDTH || max_y > MAX_BITMAP_HEIGHT)
-	{
-		free(data);
-		return FALSE;
-	}
-
-	if ((x == 0) && (y == 0))
-	{
-		if (bitmap)
-			free(bitmap);
-		bitmap = bitmap_alloc(max_x,max_y);
-	}
-	if (bitmap == NULL)
-	{
-		free(data);
 		return FALSE;
-	}
 
-	if (x+max_x > bitmap->width)
-		max_x = bitmap->width-x;
-	if (y+max_y > bitmap->height)
-		max_y = bitmap->height-y;
+	if (x+max_x > out->width)
+		max_x = out->width-x;
+	if (y+max_y > out->height)
+		max_y = out->height-y;
 
 	for (yi = 0; yi < max_y; yi++)
 	{
+		L9BYTE* row = out->bitmap+(out->width*(y+yi))+x;
 		for (xi = 0; xi < max_x; xi++)
 		{
-			bitmap->bitmap[(bitmap->width*(y+yi))+(x+xi)] =
-				(data[23+((yi*max_x)/2)+(xi/2)]>>((1-(xi&1))*4)) & 0x0f;
+			/* pixels past the end of a short file are 0 */
+			at = 23+((yi*max_x)/2)+(xi/2);
+			row[xi] = (at < size) ? (data[at]>>((1-(xi&1))*4)) & 0x0f : 0;
 		}
 	}
 
-	bitmap->npalette = 16;
+	out->npalette = 16;
 	for (i = 0; i < 16; i++)
-		bitmap->palette[i] = bitmap_pc1_colour(data[6+i]);
-
-	free(data);
+		out->palette[i] = bitmap_pc1_colour(data[6+i]);
 	return TRUE;
 }
 
@@ -604,60 +738,65 @@ L9BOOL bitmap_pc1_decode(char* file, int x, int y)
 	code in a debugger - thanks to the now defunct HiSoft for their DevPac ST and
 	Gerin Philippe for NoSTalgia <http://users.skynet.be/sky39147/>.
 */
-L9BOOL bitmap_pc2_decode(char* file, int x, int y)
+static L9BOOL bitmap_pc2_pixels(const L9BYTE* data, L9UINT32 size, Bitmap* out, int x, int y)
 {
-	L9BYTE* data = NULL;
 	int i, xi, yi, max_x, max_y;
 
 	L9BYTE theNewPixel, theNewPixelIndex;
 	L9BYTE theBufferBitCounter, theNewPixelIndexSelector, theBufferBitStripCount;
 	L9UINT16 theBitStreamBuffer, theImageDataIndex;
-	L9BYTE* theImageFileData;
+	const L9BYTE* theImageFileData;
+	L9UINT32 theImageDataSize;
+	int k;
 
-	L9UINT32 size;
-	data = bitmap_load(file,&size);
-	if (data == NULL)
+	if (size < 570)
 		return FALSE;
-
 	max_x = data[37]+data[36]*256;
 	max_y = data[39]+data[38]*256;
 	if (max_x > MAX_BITMAP_WIDTH || max_y > MAX_BITMAP_HEIGHT)
-	{
-		free(data);
 		return FALSE;
-	}
 
-	if ((x == 0) && (y == 0))
-	{
-		if (bitmap)
-			free(bitmap);
-		bitmap = bitmap_alloc(max_x,max_y);
-	}
-	if (bitmap == NULL)
-	{
-		free(data);
-		return FALSE;
+	if (x+max_x > out->width)
+		max_x = out->width-x;
+	if (y+max_y > out->height)
+		max_y = out->height-y;
+
+/* the next byte of the image data, 0 past the end of a short file */
+#define PC2_NEXT_BYTE() ((theImageDataIndex < theImageDataSize) ? \
+	theImageFileData[theImageDataIndex++] : (theImageDataIndex++, 0))
+
+/* strip n bits from theBitStreamBuffer, as many at a time as are left in
+   its low byte, refilling the high byte each time the low one runs out */
+#define PC2_STRIP(n) \
+	for (theBufferBitStripCount = (n); theBufferBitStripCount > 0; ) \
+	{ \
+		k = (theBufferBitStripCount < theBufferBitCounter) ? \
+			theBufferBitStripCount : theBufferBitCounter; \
+		theBitStreamBuffer = theBitStreamBuffer >> k; \
+		theBufferBitStripCount -= k; \
+		theBufferBitCounter -= k; \
+		if (theBufferBitCounter == 0) \
+		{ \
+			theBitStreamBuffer = theBitStreamBuffer + (0x100 * PC2_NEXT_BYTE()); \
+			theBufferBitCounter = 8; \
+		} \
 	}
 
-	if (x+max_x > bitmap->width)
-		max_x = bitmap->width-x;
-	if (y+max_y > bitmap->height)
-		max_y = bitmap->height-y;
-
 	/* prime the new pixel variable with the seed byte */
 	theNewPixel = data[40];
 	/* initialise the index to the image data */
 	theImageDataIndex = 0;
 	/* prime the bit stream buffer */
 	theImageFileData = data+570;
-	theBitStreamBuffer = theImageFileData[theImageDataIndex++];
-	theBitStreamBuffer = theBitStreamBuffer + 
-		(0x100 * theImageFileData[theImageDataIndex++]);
+	theImageDataSize = size-570;
+	theBitStreamBuffer = PC2_NEXT_BYTE();
+	theBitStreamBuffer = theBitStreamBuffer + (0x100 * PC2_NEXT_BYTE());
 	/* initialise the bit stream buffer bit counter */
 	theBufferBitCounter = 8;
 
 	for (yi = 0; yi < max_y; yi++)
 	{
+		L9BYTE* row = out->bitmap+(out->width*(y+yi))+x;
 		for (xi = 0; xi < max_x; xi++)
 		{
 			theNewPixelIndexSelector = (theBitStreamBuffer & 0x00FF);
@@ -665,60 +804,17 @@ L9BOOL bitmap_pc2_decode(char* file, int x, int y)
 			{
 				/* get index for new pixel and bit strip count */
 				theNewPixelIndex = (data+314)[theNewPixelIndexSelector];
-				/* get the bit strip count */
-				theBufferBitStripCount = (data+298)[theNewPixelIndex];
-				/* strip theBufferBitStripCount bits from theBitStreamBuffer */
-				while (theBufferBitStripCount > 0)
-				{
-					theBitStreamBuffer = theBitStreamBuffer >> 1;
-					theBufferBitStripCount--;
-					theBufferBitCounter--;
-					if (theBufferBitCounter == 0)
-					{
-						/* need to refill the theBitStreamBuffer high byte */
-						theBitStreamBuffer = theBitStreamBuffer + 
-							(0x100 * theImageFileData[theImageDataIndex++]);
-						/* re-initialise the bit stream buffer bit counter */
-						theBufferBitCounter = 8;
-					}
-				}
+				/* strip the bit strip count bits from theBitStreamBuffer */
+				PC2_STRIP((data+298)[theNewPixelIndex]);
 			}
 			else
 			{
 				/* strip the 8 bits holding 0xFF from theBitStreamBuffer */
-				theBufferBitStripCount = 8;
-				while (theBufferBitStripCount > 0)
-				{
-					theBitStreamBuffer = theBitStreamBuffer >> 1;
-					theBufferBitStripCount--;
-					theBufferBitCounter--;
-					if (theBufferBitCounter == 0)
-					{
-						/* need to refill the theBitStreamBuffer high byte */
-						theBitStreamBuffer = theBitStreamBuffer + 
-							(0x100 * theImageFileData[theImageDataIndex++]);
-						/* re-initialise the bit stream buffer bit counter */
-						theBufferBitCounter = 8;
-					}
-				}
+				PC2_STRIP(8);
 				/* get the literal pixel index value from the bit stream */
 				theNewPixelIndex = (0x000F & theBitStreamBuffer);
-				theBufferBitStripCount = 4;
 				/* strip 4 bits from theBitStreamBuffer */
-				while (theBufferBitStripCount > 0)
-				{
-					theBitStreamBuffer = theBitStreamBuffer >> 1;
-					theBufferBitStripCount--;
-					theBufferBitCounter--;
-					if (theBufferBitCounter == 0)
-					{
-						/* need to refill the theBitStreamBuffer high byte */
-						theBitStreamBuffer = theBitStreamBuffer + 
-							(0x100 * theImageFileData[theImageDataIndex++]);
-						/* re-initialise the bit stream buffer bit counter */
-						theBufferBitCounter = 8;
-					}
-				}
+				PC2_STRIP(4);
 			}
 
 			/* shift the previous pixel into the high four bits of theNewPixel */
@@ -728,23 +824,123 @@ L9BOOL bitmap_pc2_decode(char* file, int x, int y)
 			/* extract the nex pixel from the table */
 			theNewPixel = (data+42)[theNewPixel];
 			/* store new pixel in the bitmap */
-			bitmap->bitmap[(bitmap->width*(y+yi))+(x+xi)] = theNewPixel;
+			row[xi] = theNewPixel;
 		}
 	}
+#undef PC2_STRIP
+#undef PC2_NEXT_BYTE
 
-	bitmap->npalette = 16;
+	out->npalette = 16;
 	for (i = 0; i < 16; i++)
-		bitmap->palette[i] = bitmap_pcst_colour(data[4+(i*2)],data[5+(i*2)]);
-
-	free(data);
+		out->palette[i] = bitmap_pcst_colour(data[4+(i*2)],data[5+(i*2)]);
 	return TRUE;
 }
 
+L9BOOL GetBitmapSize(BitmapType type, const L9BYTE* data, L9UINT32 size, int* width, int* height)
+{
+	if (type == PC1_BITMAPS && size >= 22)
+	{
+		*width = data[2]+data[3]*256;
+		*height = data[4]+data[5]*256;
+	}
+	else if ((type == PC2_BITMAPS || type == ST2_BITMAPS) && size >= 570)
+	{
+		*width = data[37]+data[36]*256;
+		*height = data[39]+data[38]*256;
+	}
+	else
+		return FALSE;
+	return (*width <= MAX_BITMAP_WIDTH && *height <= MAX_BITMAP_HEIGHT);
+}
+
+L9BOOL DecodeBitmapData(BitmapType type, const L9BYTE* data, L9UINT32 size, Bitmap* out, int x, int y)
+{
+	if (type == PC1_BITMAPS)
+		return bitmap_pc1_pixels(data,size,out,x,y);
+	if (type == PC2_BITMAPS || type == ST2_BITMAPS)
+		return bitmap_pc2_pixels(data,size,out,x,y);
+	return FALSE;
+}
+
+/*
+	The picture files are read from the bundle's map where there is one,
+	and otherwise into a buffer that is kept from one picture to the next.
+*/
+static L9BYTE* bitmap_file_buffer = NULL;
+static L9UINT32 bitmap_file_room = 0;
+
+static const L9BYTE* bitmap_source(char* file, L9UINT32* size)
+{
+	FILE* f;
+	L9UINT32 length;
+
+#ifdef HAS_BUNDLE
+	unsigned long entry;
+	const L9BYTE* data = bundle_find(file,&entry);
+	if (data != NULL)
+	{
+		*size = (L9UINT32)entry;
+		return data;
+	}
+#endif
+	if ((f = fopen(file,"rb")) == NULL)
+		return NULL;
+	length = filelength(f);
+	if (length > bitmap_file_room)
+	{
+		L9BYTE* grown = realloc(bitmap_file_buffer,length);
+		if (grown == NULL)
+		{
+			fclose(f);
+			return NULL;
+		}
+		bitmap_file_buffer = grown;
+		bitmap_file_room = length;
+	}
+	if (fread(bitmap_file_buffer,1,length,f) != length)
+	{
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	*size = length;
+	return bitmap_file_buffer;
+}
+
+/* Decode a PC1 or PC2 file into the current bitmap, a new one if x == y == 0 */
+static L9BOOL bitmap_pc_decode(char* file, BitmapType type, int x, int y)
+{
+	L9UINT32 size;
+	const L9BYTE* data = bitmap_source(file,&size);
+	int max_x, max_y;
+
+	if (data == NULL || !GetBitmapSize(type,data,size,&max_x,&max_y))
+		return FALSE;
+	if ((x == 0) && (y == 0))
+	{
+		bitmap_release(bitmap);
+		bitmap = bitmap_alloc(max_x,max_y);
+	}
+	if (bitmap == NULL)
+		return FALSE;
+	return DecodeBitmapData(type,data,size,bitmap,x,y);
+}
+
+L9BOOL bitmap_pc1_decode(char* file, int x, int y)
+{
+	return bitmap_pc_decode(file,PC1_BITMAPS,x,y);
+}
+
+L9BOOL bitmap_pc2_decode(char* file, int x, int y)
+{
+	return bitmap_pc_decode(file,PC2_BITMAPS,x,y);
+}
+
 BitmapType bitmap_pc_type(char* file)
 {
 	BitmapType type = PC2_BITMAPS;
 
-	FILE* f = fopen(file,"rb");
+	FILE* f = bundle_fopen(file);
 	if (f != NULL)
 	{
 		L9BYTE data[6];
@@ -777,17 +973,10 @@ void bitmap_noext_name(int num, const char* dir, char* out)
 {
 	if (num == 0)
 	{
-		FILE* f;
-
 		sprintf(out,"%stitle",dir);
-		f = fopen(out,"rb");
-		if (f != NULL)
-		{
-			fclose(f);
+		if (bitmap_find_file(out))
 			return;
-		}
-		else
-			num = 30;
+		num = 30;
 	}
 
 	sprintf(out,"%s%d",dir,num);
@@ -841,7 +1030,8 @@ Colour bitmap_amiga_colour(int i1, int i2)
 L9BOOL bitmap_amiga_decode(char* file, int x, int y)
 {
 	L9BYTE* data = NULL;
-	int i, xi, yi, max_x, max_y, p, b;
+	L9BYTE* planes[5];
+	int i, yi, max_x, max_y, b;
 
 	L9UINT32 size;
 	data = bitmap_load(file,&size);
@@ -858,8 +1048,7 @@ L9BOOL bitmap_amiga_decode(char* file, int x, int y)
 
 	if ((x == 0) && (y == 0))
 	{
-		if (bitmap)
-			free(bitmap);
+		bitmap_release(bitmap);
 		bitmap = bitmap_alloc(max_x,max_y);
 	}
 	if (bitmap == NULL)
@@ -875,13 +1064,9 @@ L9BOOL bitmap_amiga_decode(char* file, int x, int y)
 
 	for (yi = 0; yi < max_y; yi++)
 	{
-		for (xi = 0; xi < max_x; xi++)
-		{
-			p = 0;
-			for (b = 0; b < 5; b++)
-				p |= ((data[72+(max_x/8)*(max_y*b+yi)+xi/8]>>(7-(xi%8)))&1)<<b;
-			bitmap->bitmap[(bitmap->width*(y+yi))+(x+xi)] = p;
-		}
+		for (b = 0; b < 5; b++)
+			planes[b] = data+72+(max_x/8)*(max_y*b+yi);
+		bitmap_planar_row(bitmap->bitmap+(bitmap->width*(y+yi))+x,planes,5,1,1,max_x);
 	}
 
 	bitmap->npalette = 32;
@@ -894,7 +1079,7 @@ L9BOOL bitmap_amiga_decode(char* file, int x, int y)
 
 BitmapType bitmap_noext_type(char* file)
 {
-	FILE* f = fopen(file,"rb");
+	FILE* f = bundle_fopen(file);
 	if (f != NULL)
 	{
 		L9BYTE data[72];
@@ -970,7 +1155,8 @@ BitmapType bitmap_noext_type(char* file)
 L9BOOL bitmap_mac_decode(char* file, int x, int y)
 {
 	L9BYTE* data = NULL;
-	int xi, yi, max_x, max_y;
+	L9BYTE* plane;
+	int yi, max_x, max_y;
 
 	L9UINT32 size;
 	data = bitmap_load(file,&size);
@@ -990,8 +1176,7 @@ L9BOOL bitmap_mac_decode(char* file, int x, int y)
 
 	if ((x == 0) && (y == 0))
 	{
-		if (bitmap)
-			free(bitmap);
+		bitmap_release(bitmap);
 		bitmap = bitmap_alloc(max_x,max_y);
 	}
 	if (bitmap == NULL)
@@ -1007,11 +1192,8 @@ L9BOOL bitmap_mac_decode(char* file, int x, int y)
 
 	for (yi = 0; yi < max_y; yi++)
 	{
-		for (xi = 0; xi < max_x; xi++)
-		{
-			bitmap->bitmap[(bitmap->width*(y+yi))+(x+xi)] = 
-				(data[10+(max_x/8)*yi+xi/8]>>(7-(xi%8)))&1;
-		}
+		plane = data+10+(max_x/8)*yi;
+		bitmap_planar_row(bitmap->bitmap+(bitmap->width*(y+yi))+x,&plane,1,1,1,max_x);
 	}
 
 	bitmap->npalette = 2;
@@ -1069,29 +1251,19 @@ void bitmap_c64_name(int num, const char* dir, char* out)
 
 void bitmap_bbc_name(int num, const char* dir, char* out)
 {
-	FILE* f;
-
 	if (num == 0)
 	{
 		sprintf(out,"%sP.Title",dir);
-		f = fopen(out,"rb");
-		if (f != NULL)
-		{
-			fclose(f);
+		if (bitmap_find_file(out))
 			return;
-		}
 
 		sprintf(out,"%stitle",dir);
 	}
 	else
 	{
 		sprintf(out,"%sP.Pic%d",dir,num);
-		f = fopen(out,"rb");
-		if (f != NULL)
-		{
-			fclose(f);
+		if (bitmap_find_file(out))
 			return;
-		}
 
 		sprintf(out,"%spic%d",dir,num);
 	}
@@ -1111,7 +1283,7 @@ BitmapType bitmap_c64_type(char* file)
 {
 	BitmapType type = C64_BITMAPS;
 
-	FILE* f = fopen(file,"rb");
+	FILE* f = bundle_fopen(file);
 	if (f != NULL)
 	{
 		L9UINT32 size = filelength(f);
@@ -1164,14 +1336,123 @@ BitmapType bitmap_c64_type(char* file)
 	each forming a picture, in the C64 game file format (minus the two
 	byte header).
 */
+/* The 4 double width pixels of a multicolour byte, 2 bits each from the top */
+static L9BYTE bitmap_c64_quads[256][4];
+static L9BOOL bitmap_c64_quads_ready = FALSE;
+
+static void bitmap_bbc_patterns(const L9BYTE* data, L9BYTE pat[16][2][2]);
+
+/* Load length bytes from offset of file, for the pictures that share one */
+L9BYTE* bitmap_load_part(char* file, L9UINT32 offset, L9UINT32 length)
+{
+	L9BYTE* data = NULL;
+	FILE* f = bundle_fopen(file);
+	if (f)
+	{
+		L9Allocate(&data,length);
+		if (fseek(f,offset,SEEK_SET) != 0 || fread(data,1,length,f) != length)
+		{
+			free(data);
+			data = NULL;
+		}
+		fclose(f);
+	}
+	return data;
+}
+
+/*
+	Decode the picture a 4*8 pixel character cell at a time: the 4 colours
+	of the cell are looked up once, and each of its 8 bytes is a row of 4
+	double width pixels through bitmap_c64_quads. With pat, the BBC
+	pix-patterns, the colours go through those as well, see
+	bitmap_bbc_decode().
+*/
+static L9BOOL bitmap_c64_cells(const L9BYTE* data, L9UINT32 size, int max_x,
+	int max_y, int off, int off_scr, int off_col, int off_bg, int col_comp,
+	L9BYTE pat[16][2][2])
+{
+	int cells = (max_x/8)*(max_y/8), cx, cy, cell, px, py, i, k;
+	L9BYTE colours[4], tab[2][2][4];
+
+	/* the parts of the picture must all be in the file */
+	if ((L9UINT32)(off+cells*8) > size || (L9UINT32)(off_scr+cells) > size ||
+		(L9UINT32)off_bg >= size ||
+		(L9UINT32)(off_col+(col_comp ? cells/2 : cells)) > size)
+		return FALSE;
+
+	if (!bitmap_c64_quads_ready)
+	{
+		for (i = 0; i < 256; i++)
+		{
+			for (k = 0; k < 4; k++)
+				bitmap_c64_quads[i][k] = (i>>((3-k)*2))&3;
+		}
+		bitmap_c64_quads_ready = TRUE;
+	}
+
+	bitmap_release(bitmap);
+	bitmap = bitmap_alloc(max_x,max_y);
+	if (bitmap == NULL)
+		return FALSE;
+
+	colours[0] = data[off_bg] & 0x0f;
+	for (cy = 0, cell = 0; cy < max_y/8; cy++)
+	{
+		for (cx = 0; cx < max_x/8; cx++, cell++)
+		{
+			const L9BYTE* rows = data+off+cell*8;
+			L9BYTE* out = bitmap->bitmap+(cy*8*max_x)+(cx*8);
+
+			colours[1] = data[off_scr+cell] >> 4;
+			colours[2] = data[off_scr+cell] & 0x0f;
+			if (col_comp)
+				colours[3] = (data[off_col+cell/2]>>((1-(cell%2))*4)) & 0x0f;
+			else
+				colours[3] = data[off_col+cell] & 0x0f;
+
+			/* tab[odd row][odd column], the BBC patterns depend on both */
+			for (py = 0; py < 2; py++)
+			{
+				for (px = 0; px < 2; px++)
+				{
+					for (k = 0; k < 4; k++)
+						tab[py][px][k] = pat ? pat[colours[k]][px][py] : colours[k];
+				}
+			}
+
+			for (py = 0; py < 8; py++, out += max_x)
+			{
+				const L9BYTE* q = bitmap_c64_quads[rows[py]];
+				const L9BYTE* even = tab[py%2][0];
+				const L9BYTE* odd = tab[py%2][1];
+
+				out[0] = out[1] = even[q[0]];
+				out[2] = out[3] = odd[q[1]];
+				out[4] = out[5] = even[q[2]];
+				out[6] = out[7] = odd[q[3]];
+			}
+		}
+	}
+	return TRUE;
+}
+
 L9BOOL bitmap_c64_decode(char* file, BitmapType type, int num)
 {
 	L9BYTE* data = NULL;
-	int i, xi, yi, max_x, max_y, cx, cy, px, py, p;
+	L9BYTE pat[16][2][2];
+	L9BOOL ok;
+	int i, max_x, max_y;
 	int off, off_scr, off_col, off_bg, col_comp;
 
 	L9UINT32 size;
-	data = bitmap_load(file,&size);
+	if (type == CPC_BITMAPS && num >= 2 && num <= 29)
+	{
+		/* only the picture's own block of allpics.pic */
+		size = 6462;
+		data = bitmap_load_part(file,(num-2)*size,size);
+	}
+	else
+		data = bitmap_load(file,&size);
 	if (data == NULL)
 		return FALSE;
 
@@ -1198,7 +1479,10 @@ L9BOOL bitmap_c64_decode(char* file, BitmapType type, int num)
 			col_comp = 1;
 		}
 		else
+		{
+			free(data);
 			return FALSE;
+		}
 	}
 	else if (type == BBC_BITMAPS)
 	{
@@ -1243,7 +1527,12 @@ L9BOOL bitmap_c64_decode(char* file, BitmapType type, int num)
 			col_comp = 1;
 		}
 		else
+		{
+			free(data);
 			return FALSE;
+		}
+		/* the pix-patterns are the last 32 bytes */
+		bitmap_bbc_patterns(data+size-32,pat);
 	}
 	else if (type == CPC_BITMAPS)
 	{
@@ -1271,66 +1560,42 @@ L9BOOL bitmap_c64_decode(char* file, BitmapType type, int num)
 		{
 			max_x = 320;
 			max_y = 136;
-			off = ((num-2)*6462);
-			off_scr = 5440+((num-2)*6462);
-			off_col = 6120+((num-2)*6462);
-			off_bg = 6460+((num-2)*6462);
+			off = 0;
+			off_scr = 5440;
+			off_col = 6120;
+			off_bg = 6460;
 			col_comp = 1;
 		}
 		else
+		{
+			free(data);
 			return FALSE;
+		}
 	}
-
-	if (bitmap)
-		free(bitmap);
-	bitmap = bitmap_alloc(max_x,max_y);
-	if (bitmap == NULL)
+	else
 	{
 		free(data);
 		return FALSE;
 	}
 
-	for (yi = 0; yi < max_y; yi++)
-	{
-		for (xi = 0; xi < max_x/2; xi++)
-		{
-			cx = xi/4;
-			px = xi%4;
-			cy = yi/8;
-			py = yi%8;
-
-			p = data[off+(cy*40+cx)*8+py];
-			p = (p>>((3-px)*2))&3;
-
-			switch (p)
-			{
-			case 0:
-				i = data[off_bg] & 0x0f;
-				break;
-			case 1:
-				i = data[off_scr+cy*40+cx] >> 4;
-				break;
-			case 2:
-				i = data[off_scr+cy*40+cx] & 0x0f;
-				break;
-			case 3:
-				if (col_comp)
-					i = (data[off_col+(cy*40+cx)/2]>>((1-(cx%2))*4)) & 0x0f;
-				else
-					i = data[off_col+(cy*40+cx)] & 0x0f;
-				break;
-			}
+	ok = bitmap_c64_cells(data,size,max_x,max_y,off,off_scr,off_col,off_bg,
+		col_comp,type == BBC_BITMAPS ? pat : NULL);
+	free(data);
+	if (!ok)
+		return FALSE;
 
-			bitmap->bitmap[(bitmap->width*yi)+(xi*2)] = i;
-			bitmap->bitmap[(bitmap->width*yi)+(xi*2)+1] = i;
-		}
+	if (type == BBC_BITMAPS)
+	{
+		bitmap->npalette = 8;
+		for (i = 0; i < 8; i++)
+			bitmap->palette[i] = bitmap_bbc_colours[i];
+	}
+	else
+	{
+		bitmap->npalette = 16;
+		for (i = 0; i < 16; i++)
+			bitmap->palette[i] = bitmap_c64_colours[i];
 	}
-
-	bitmap->npalette = 16;
-	for (i = 0; i < 16; i++)
-		bitmap->palette[i] = bitmap_c64_colours[i];
-
-	free(data);
 	return TRUE;
 }
 
@@ -1404,70 +1669,34 @@ L9BOOL bitmap_c64_decode(char* file, BitmapType type, int num)
 				|		|		|		|
 				+-------+-------+-------+----- Odd Pixel 0011 (3)
 
-	This function calls the C64 decoding routines to do the actual
-	loading. See the comments to that function for details of how the
-	image is encoded and stored.
+	bitmap_c64_decode() does the actual loading, and converts the pixels
+	through the patterns as it goes. See the comments to that function for
+	details of how the image is encoded and stored.
 */
-L9BOOL bitmap_bbc_decode(char* file, BitmapType type, int num)
+static void bitmap_bbc_patterns(const L9BYTE* data, L9BYTE pat[16][2][2])
 {
-	unsigned char	patRowData[32];
-	unsigned char patArray[16][2][2];
-	FILE* f;
-	int i,j,k,isOddColumn,isOddRow;
-	L9BYTE pixel;
-
-	if (bitmap_c64_decode(file,type,num) == FALSE)
-		return FALSE;
+	int i = 0, j, k;
 
-	f = fopen(file,"rb");
-	if (f == NULL)
-		return FALSE;
-
-	/* Seek to the offset of the pixPat data and read in the data */
-	fseek(f,filelength(f)-32,SEEK_SET);
-	fread(patRowData,sizeof (L9BYTE),32,f);
-	fclose(f);
-
-	/* Extract the patterns */
-	i = 0;
 	for (k = 0; k < 2; k++)
 	{
 		for (j = 0; j < 16; j++)
 		{
 			/* Extract the even col pixel for this pattern row */
-			patArray[j][k][0] =
-				((patRowData[i] >> 4) & 0x8) + ((patRowData[i] >> 3) & 0x4) +
-				((patRowData[i] >> 2) & 0x2) + ((patRowData[i] >> 1) & 0x1);
+			pat[j][k][0] =
+				((data[i] >> 4) & 0x8) + ((data[i] >> 3) & 0x4) +
+				((data[i] >> 2) & 0x2) + ((data[i] >> 1) & 0x1);
 			/* Extract the odd col pixel for this pattern row */
-			patArray[j][k][1] =
-				((patRowData[i] >> 3) & 0x8) + ((patRowData[i] >> 2) & 0x4) +
-				((patRowData[i] >> 1) & 0x2) + (patRowData[i] & 0x1);
+			pat[j][k][1] =
+				((data[i] >> 3) & 0x8) + ((data[i] >> 2) & 0x4) +
+				((data[i] >> 1) & 0x2) + (data[i] & 0x1);
 			i++;
 		}
 	}
+}
 
-	/* Convert the image. Each BBC pixel is represented by two pixels here */
-	i = 0;
-	isOddRow = 0;
-	for (j = 0; j < bitmap->height; j++)
-	{
-		isOddColumn = 0;
-		for (k = 0; k < bitmap->width/2; k++)
-		{
-			pixel = bitmap->bitmap[i];
-			bitmap->bitmap[i] = patArray[pixel][isOddColumn][isOddRow];
-			bitmap->bitmap[i+1] = patArray[pixel][isOddColumn][isOddRow];
-			isOddColumn ^= 1;
-			i += 2;
-		}
-		isOddRow ^= 1;
-	}
-
-	bitmap->npalette = 8;
-	for (i = 0; i < 8; i++)
-		bitmap->palette[i] = bitmap_bbc_colours[i];
-
-	return TRUE;
+L9BOOL bitmap_bbc_decode(char* file, BitmapType type, int num)
+{
+	return bitmap_c64_decode(file,type,num);
 }
 
 BitmapType DetectBitmaps(const char* dir)
@@ -1475,33 +1704,160 @@ BitmapType DetectBitmaps(const char* dir)
 	char file[MAX_PATH];
 
 	bitmap_noext_name(2,dir,file);
-	if (os_find_file(file))
+	if (bitmap_find_file(file))
 		return bitmap_noext_type(file);
 
 	bitmap_pc_name(2,dir,file);
-	if (os_find_file(file))
+	if (bitmap_find_file(file))
 		return bitmap_pc_type(file);
 
 	bitmap_c64_name(2,dir,file);
-	if (os_find_file(file))
+	if (bitmap_find_file(file))
 		return bitmap_c64_type(file);
 
 	bitmap_bbc_name(2,dir,file);
-	if (os_find_file(file))
+	if (bitmap_find_file(file))
 		return BBC_BITMAPS;
 
 	bitmap_cpc_name(2,dir,file);
-	if (os_find_file(file))
+	if (bitmap_find_file(file))
 		return CPC_BITMAPS;
 
 	bitmap_st2_name(2,dir,file);
-	if (os_find_file(file))
+	if (bitmap_find_file(file))
 		return ST2_BITMAPS;
 
 	return NO_BITMAPS;
 }
 
-Bitmap* DecodeBitmap(const char* dir, BitmapType type, int num, int x, int y)
+/*
+	Pictures are numbered by their file names, a prefix, the number and a
+	suffix for each type, so the highest number is found from the names in
+	the bundle or the directory index. The CPC pictures after the first are
+	all in one file, numbered up to 29 by its layout. Where the names cannot
+	be listed, numbers are tried in turn until BITMAP_COUNT_GAP of them in a
+	row have no file.
+*/
+#define BITMAP_COUNT_GAP 64
+
+static const struct
+{
+	BitmapType type;
+	const char* prefix;
+	const char* suffix;
+} bitmap_numbered[] =
+{
+	{PC1_BITMAPS,"",".pic"},
+	{PC2_BITMAPS,"",".pic"},
+	{AMIGA_BITMAPS,"",""},
+	{MAC_BITMAPS,"",""},
+	{ST1_BITMAPS,"",""},
+	{ST2_BITMAPS,"",".squ"},
+	{C64_BITMAPS,"pic",""},
+	{BBC_BITMAPS,"P.Pic",""},
+	{BBC_BITMAPS,"pic",""}
+};
+
+#define BITMAP_NUMBERED ((int)(sizeof(bitmap_numbered)/sizeof(bitmap_numbered[0])))
+
+/* as bitmap_find_file(), a name may differ in case */
+static L9BOOL bitmap_name_equal(const char* a, const char* b, size_t len)
+{
+	for (; len > 0; a++, b++, len--)
+	{
+		if (tolower((unsigned char)*a) != tolower((unsigned char)*b))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* The number of the picture of type in the file name, -1 if there is none */
+static int bitmap_name_number(BitmapType type, const char* name)
+{
+	const char* p;
+	size_t len;
+	int i, n;
+
+	for (i = 0; i < BITMAP_NUMBERED; i++)
+	{
+		if (bitmap_numbered[i].type != type)
+			continue;
+		len = strlen(bitmap_numbered[i].prefix);
+		if (!bitmap_name_equal(name,bitmap_numbered[i].prefix,len))
+			continue;
+		p = name+len;
+		if (*p < '0' || *p > '9')
+			continue;
+		for (n = 0; *p >= '0' && *p <= '9' && n < 10000; p++)
+			n = n*10+(*p-'0');
+		len = strlen(bitmap_numbered[i].suffix);
+		if (strlen(p) == len && bitmap_name_equal(p,bitmap_numbered[i].suffix,len))
+			return n;
+	}
+	return -1;
+}
+
+int CountBitmaps(const char* dir, BitmapType type)
+{
+	char file[MAX_PATH];
+	int count = 1; /* the title picture is always looked for */
+	int i, n, gap;
+
+	if (type == NO_BITMAPS)
+		return 0;
+	if (type == CPC_BITMAPS)
+		return 30;
+
+#ifdef HAS_BUNDLE
+	if (bundle_active())
+	{
+		const char* name;
+		size_t len = strlen(dir);
+		unsigned long e;
+
+		for (e = 0; (name = bundle_name(e)) != NULL; e++)
+		{
+			if (strncmp(name,dir,len) == 0 && (n = bitmap_name_number(type,name+len)) >= count)
+				count = n+1;
+		}
+		return count;
+	}
+#endif
+#ifdef BITMAP_DIR_INDEX
+	if (!bitmap_index_read || strcmp(dir,bitmap_index_dir) != 0)
+		bitmap_index_scan(dir);
+	if (bitmap_index_ok)
+	{
+		for (i = 0; i < bitmap_index_count; i++)
+		{
+			if ((n = bitmap_name_number(type,bitmap_index[i])) >= count)
+				count = n+1;
+		}
+		return count;
+	}
+#endif
+
+	for (i = 0; i < BITMAP_NUMBERED; i++)
+	{
+		if (bitmap_numbered[i].type != type)
+			continue;
+		for (n = 1, gap = 0; gap < BITMAP_COUNT_GAP; n++)
+		{
+			sprintf(file,"%s%s%d%s",dir,bitmap_numbered[i].prefix,n,bitmap_numbered[i].suffix);
+			if (!bitmap_find_file(file))
+				gap++;
+			else
+			{
+				gap = 0;
+				if (n >= count)
+					count = n+1;
+			}
+		}
+	}
+	return count;
+}
+
+static Bitmap* bitmap_decode(const char* dir, BitmapType type, int num, int x, int y)
 {
 	char file[MAX_PATH];
 
@@ -1509,7 +1865,7 @@ Bitmap* DecodeBitmap(const char* dir, BitmapType type, int num, int x, int y)
 	{
 	case PC1_BITMAPS:
 		bitmap_pc_name(num,dir,file);
-		if (os_find_file(file))
+		if (bitmap_find_file(file))
 		{
 			if (bitmap_pc1_decode(file,x,y))
 				return bitmap;
@@ -1518,7 +1874,7 @@ Bitmap* DecodeBitmap(const char* dir, BitmapType type, int num, int x, int y)
 
 	case PC2_BITMAPS:
 		bitmap_pc_name(num,dir,file);
-		if (os_find_file(file))
+		if (bitmap_find_file(file))
 		{
 			if (bitmap_pc2_decode(file,x,y))
 				return bitmap;
@@ -1527,7 +1883,7 @@ Bitmap* DecodeBitmap(const char* dir, BitmapType type, int num, int x, int y)
 
 	case AMIGA_BITMAPS:
 		bitmap_noext_name(num,dir,file);
-		if (os_find_file(file))
+		if (bitmap_find_file(file))
 		{
 			if (bitmap_amiga_decode(file,x,y))
 				return bitmap;
@@ -1536,7 +1892,7 @@ Bitmap* DecodeBitmap(const char* dir, BitmapType type, int num, int x, int y)
 
 	case C64_BITMAPS:
 		bitmap_c64_name(num,dir,file);
-		if (os_find_file(file))
+		if (bitmap_find_file(file))
 		{
 			if (bitmap_c64_decode(file,type,num))
 				return bitmap;
@@ -1545,7 +1901,7 @@ Bitmap* DecodeBitmap(const char* dir, BitmapType type, int num, int x, int y)
 
 	case BBC_BITMAPS:
 		bitmap_bbc_name(num,dir,file);
-		if (os_find_file(file))
+		if (bitmap_find_file(file))
 		{
 			if (bitmap_bbc_decode(file,type,num))
 				return bitmap;
@@ -1554,7 +1910,7 @@ Bitmap* DecodeBitmap(const char* dir, BitmapType type, int num, int x, int y)
 
 	case CPC_BITMAPS:
 		bitmap_cpc_name(num,dir,file);
-		if (os_find_file(file))
+		if (bitmap_find_file(file))
 		{
 			if (bitmap_c64_decode(file,type,num)) /* Nearly identical to C64 */
 				return bitmap;
@@ -1563,7 +1919,7 @@ Bitmap* DecodeBitmap(const char* dir, BitmapType type, int num, int x, int y)
 
 	case MAC_BITMAPS:
 		bitmap_noext_name(num,dir,file);
-		if (os_find_file(file))
+		if (bitmap_find_file(file))
 		{
 			if (bitmap_mac_decode(file,x,y))
 				return bitmap;
@@ -1572,7 +1928,7 @@ Bitmap* DecodeBitmap(const char* dir, BitmapType type, int num, int x, int y)
 
 	case ST1_BITMAPS:
 		bitmap_noext_name(num,dir,file);
-		if (os_find_file(file))
+		if (bitmap_find_file(file))
 		{
 			if (bitmap_st1_decode(file,x,y))
 				return bitmap;
@@ -1581,7 +1937,7 @@ Bitmap* DecodeBitmap(const char* dir, BitmapType type, int num, int x, int y)
 
 	case ST2_BITMAPS:
 		bitmap_st2_name(num,dir,file);
-		if (os_find_file(file))
+		if (bitmap_find_file(file))
 		{
 			if (bitmap_pc2_decode(file,x,y))
 				return bitmap;
@@ -1592,3 +1948,171 @@ Bitmap* DecodeBitmap(const char* dir, BitmapType type, int num, int x, int y)
 	return NULL;
 }
 
+/*
+	Decoded pictures are kept in a small LRU cache keyed by (type, num), so
+	showing a picture again neither looks for the file nor decodes it. Pictures
+	that could not be found are remembered as well. Only whole pictures
+	(x == 0 and y == 0) are cached; drawing a picture at an offset composes it
+	onto the current bitmap as before.
+*/
+
+#define BITMAP_CACHE_SIZE 16
+
+typedef struct
+{
+	BitmapType type;
+	int num;
+	Bitmap* bitmap;
+	L9UINT32 used;
+} BitmapCacheEntry;
+
+static BitmapCacheEntry bitmap_cache[BITMAP_CACHE_SIZE];
+static int bitmap_cache_count = 0;
+static L9UINT32 bitmap_cache_clock = 0;
+static int bitmap_prefetch = 0;
+
+static BitmapCacheEntry* bitmap_cache_find(BitmapType type, int num)
+{
+	int i;
+	for (i = 0; i < bitmap_cache_count; i++)
+	{
+		if (bitmap_cache[i].type == type && bitmap_cache[i].num == num)
+			return &bitmap_cache[i];
+	}
+	return NULL;
+}
+
+static L9BOOL bitmap_cached(Bitmap* b)
+{
+	int i;
+	if (b == NULL)
+		return FALSE;
+	for (i = 0; i < bitmap_cache_count; i++)
+	{
+		if (bitmap_cache[i].bitmap == b)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Store a decode result, evicting the least recently used entry other than
+   the one holding keep */
+static void bitmap_cache_add(BitmapType type, int num, Bitmap* b, Bitmap* keep)
+{
+	BitmapCacheEntry* e = NULL;
+	int i;
+
+	if (bitmap_cache_count < BITMAP_CACHE_SIZE)
+		e = &bitmap_cache[bitmap_cache_count++];
+	else
+	{
+		for (i = 0; i < BITMAP_CACHE_SIZE; i++)
+		{
+			if (keep != NULL && bitmap_cache[i].bitmap == keep)
+				continue;
+			if (e == NULL || bitmap_cache[i].used < e->used)
+				e = &bitmap_cache[i];
+		}
+		bitmap_release(e->bitmap);
+	}
+	e->type = type;
+	e->num = num;
+	e->bitmap = b;
+	e->used = ++bitmap_cache_clock;
+}
+
+static Bitmap* bitmap_cache_decode(const char* dir, BitmapType type, int num, Bitmap* keep)
+{
+	Bitmap* b;
+
+	/* the decoders free the current bitmap, which must not be a cached one */
+	if (bitmap_cached(bitmap))
+		bitmap = NULL;
+	b = bitmap_decode(dir,type,num,0,0);
+	if (b == NULL && bitmap != NULL)
+	{
+		/* a decoder failed after allocating */
+		bitmap_release(bitmap);
+	}
+	bitmap = NULL;
+	bitmap_cache_add(type,num,b,keep);
+	return b;
+}
+
+Bitmap* DecodeBitmap(const char* dir, BitmapType type, int num, int x, int y)
+{
+	BitmapCacheEntry* e;
+	Bitmap* current;
+	int i;
+
+	if ((x != 0) || (y != 0))
+	{
+		/* compose onto a private copy, cached pictures stay untouched */
+		if (bitmap_cached(bitmap))
+		{
+			Bitmap* copy = bitmap_alloc(bitmap->width,bitmap->height);
+			memcpy(copy->bitmap,bitmap->bitmap,bitmap->width*bitmap->height);
+			memcpy(copy->palette,bitmap->palette,sizeof(copy->palette));
+			copy->npalette = bitmap->npalette;
+			bitmap = copy;
+		}
+		return bitmap_decode(dir,type,num,x,y);
+	}
+
+	e = bitmap_cache_find(type,num);
+	if (e != NULL)
+	{
+		e->used = ++bitmap_cache_clock;
+		current = e->bitmap;
+	}
+	else
+	{
+		if (bitmap != NULL && !bitmap_cached(bitmap))
+			bitmap_release(bitmap);
+		bitmap = NULL;
+		current = bitmap_cache_decode(dir,type,num,NULL);
+		for (i = 1; current != NULL && i <= bitmap_prefetch; i++)
+		{
+			if (bitmap_cache_find(type,num+i) == NULL)
+				bitmap_cache_decode(dir,type,num+i,current);
+		}
+	}
+	if (current != NULL)
+	{
+		if (bitmap != NULL && bitmap != current && !bitmap_cached(bitmap))
+			bitmap_release(bitmap);
+		bitmap = current;
+	}
+	return current;
+}
+
+void SetBitmapPrefetch(int count)
+{
+	if (count < 0)
+		count = 0;
+	if (count > BITMAP_CACHE_SIZE/2)
+		count = BITMAP_CACHE_SIZE/2;
+	bitmap_prefetch = count;
+}
+
+void FreeBitmaps(void)
+{
+	int i;
+
+	if (bitmap != NULL && !bitmap_cached(bitmap))
+		free(bitmap);
+	bitmap = NULL;
+	for (i = 0; i < bitmap_cache_count; i++)
+	{
+		if (bitmap_cache[i].bitmap)
+			free(bitmap_cache[i].bitmap);
+	}
+	bitmap_cache_count = 0;
+	bitmap_pool_free();
+	free(bitmap_file_buffer);
+	bitmap_file_buffer = NULL;
+	bitmap_file_room = 0;
+#ifdef BITMAP_DIR_INDEX
+	bitmap_index_free();
+#endif
+}
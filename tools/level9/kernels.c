@@ -0,0 +1,292 @@
+/***********************************************************************\
+*
+* Level 9 interpreter
+* Version 5.2
+* Copyright (c) 1996-2025 Glen Summers and contributors.
+* Contributions from David Kinder, Alan Staniforth, Simon Baldwin,
+* Dieter Baron and Andreas Scherrer.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA.
+*
+\***********************************************************************/
+
+/* level9-kernels: microbenchmarks of the picture decoders, each run on
+   its own rather than as part of a game:
+
+       level9-kernels [-b bitmapdir] game.l9 ...
+
+   "vector" runs the drawing program of every line drawn picture of a game
+   (show_picture() and RunGraphics(), which find the picture's subroutine
+   with findsub()) into os_ routines that only count the calls. "bitmap"
+   decodes every picture of bitmapdir with DecodeBitmap(), in the format
+   DetectBitmaps() finds there. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "level9.h"
+
+/* the tests of a kernel are repeated until they took this long */
+#define KERNEL_TIME 0.25
+#define MAX_PICTURES 1024
+
+void show_picture(int pic);
+
+static long draw_calls = 0;
+
+void os_printchar(char c)
+{
+    (void)c;
+}
+
+/* the game is only run up to its first input */
+L9BOOL os_input(char* ibuff, int size)
+{
+    (void)ibuff;
+    (void)size;
+    return FALSE;
+}
+
+char os_readchar(int millis)
+{
+    (void)millis;
+    L9Yield(L9_SLICE_INPUT);
+    return 0;
+}
+
+L9BOOL os_stoplist(void)
+{
+    return FALSE;
+}
+
+void os_flush(void)
+{
+}
+
+L9BOOL os_save_file(L9BYTE* Ptr, int Bytes)
+{
+    (void)Ptr;
+    (void)Bytes;
+    return FALSE;
+}
+
+L9BOOL os_load_file(L9BYTE* Ptr, int* Bytes, int Max)
+{
+    (void)Ptr;
+    (void)Bytes;
+    (void)Max;
+    return FALSE;
+}
+
+L9BOOL os_get_game_file(char* NewName, int Size)
+{
+    (void)NewName;
+    (void)Size;
+    return FALSE;
+}
+
+void os_set_filenumber(char* NewName, int Size, int n)
+{
+    (void)NewName;
+    (void)Size;
+    (void)n;
+}
+
+void os_graphics(int mode)
+{
+    (void)mode;
+}
+
+void os_cleargraphics(void)
+{
+}
+
+void os_setcolour(int colour, int index)
+{
+    (void)colour;
+    (void)index;
+}
+
+void os_drawline(int x1, int y1, int x2, int y2, int colour1, int colour2)
+{
+    (void)x1;
+    (void)y1;
+    (void)x2;
+    (void)y2;
+    (void)colour1;
+    (void)colour2;
+    draw_calls++;
+}
+
+void os_fill(int x, int y, int colour1, int colour2)
+{
+    (void)x;
+    (void)y;
+    (void)colour1;
+    (void)colour2;
+    draw_calls++;
+}
+
+void os_show_bitmap(int pic, int x, int y)
+{
+    (void)pic;
+    (void)x;
+    (void)y;
+}
+
+FILE* os_open_script_file(void)
+{
+    return NULL;
+}
+
+L9BOOL os_find_file(char* NewName)
+{
+    FILE* f = fopen(NewName, "rb");
+    if (f != NULL) {
+        fclose(f);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static double now(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static const char* base_name(const char* path)
+{
+    const char* p = strrchr(path, '/');
+    return p ? p + 1 : path;
+}
+
+/* mbs < 0 if the kernel has no byte count */
+static void report(const char* kernel, const char* game, int ops, double ns,
+                   double mbs)
+{
+    char rate[16];
+
+    if (mbs < 0)
+        strcpy(rate, "-");
+    else
+        sprintf(rate, "%.2f", mbs);
+    printf("%-20s %-18s %8d %10.1f %9s\n", kernel, game, ops, ns, rate);
+}
+
+static long draw_picture(int pic)
+{
+    long calls = draw_calls;
+
+    show_picture(pic);
+    while (RunGraphics())
+        ;
+    return draw_calls - calls;
+}
+
+static void bench_vector(const char* game)
+{
+    static int pics[MAX_PICTURES];
+    int i, count = 0, passes = 0;
+    double start, elapsed;
+
+    if (!LoadGame((char*)game, NULL)) {
+        fprintf(stderr, "%s: not a Level 9 game\n", game);
+        return;
+    }
+    /* up to the first input, so that the game has set up its graphics */
+    while (L9RunSlice(100000) < L9_SLICE_INPUT)
+        ;
+    for (i = 0; i < MAX_PICTURES; i++) {
+        if (draw_picture(i) > 0) pics[count++] = i;
+    }
+    if (count) {
+        start = now();
+        do {
+            for (i = 0; i < count; i++)
+                draw_picture(pics[i]);
+            passes++;
+        } while ((elapsed = now() - start) < KERNEL_TIME);
+        report("vector", base_name(game), count,
+               elapsed * 1e9 / ((double)count * passes), -1);
+    } else
+        report("vector", base_name(game), 0, 0, -1);
+    StopGame();
+    FreeMemory();
+}
+
+static void bench_bitmaps(const char* dir)
+{
+    static const char* names[] = {"none", "amiga", "pc1", "pc2", "c64",
+                                  "bbc",  "cpc",   "mac", "st1", "st2"};
+    static int pics[MAX_PICTURES];
+    BitmapType type = DetectBitmaps(dir);
+    Bitmap* b;
+    int i, count = 0, passes = 0;
+    double start, elapsed, bytes = 0;
+    char kernel[32];
+
+    if (type == NO_BITMAPS) {
+        fprintf(stderr, "%s: no bitmaps found\n", dir);
+        return;
+    }
+    SetBitmapPrefetch(0);
+    for (i = 0; i < MAX_PICTURES; i++) {
+        if (DecodeBitmap(dir, type, i, 0, 0)) pics[count++] = i;
+        FreeBitmaps();
+    }
+    sprintf(kernel, "bitmap %s",
+            (unsigned)type < sizeof(names) / sizeof(names[0]) ? names[type] : "?");
+    if (count) {
+        start = now();
+        do {
+            for (i = 0; i < count; i++) {
+                if ((b = DecodeBitmap(dir, type, pics[i], 0, 0)))
+                    bytes += (double)b->width * b->height;
+                /* the cache would make the next pass a lookup */
+                FreeBitmaps();
+            }
+            passes++;
+        } while ((elapsed = now() - start) < KERNEL_TIME);
+        report(kernel, base_name(dir), count,
+               elapsed * 1e9 / ((double)count * passes), bytes / elapsed / 1e6);
+    } else
+        report(kernel, base_name(dir), 0, 0, -1);
+}
+
+int main(int argc, char** argv)
+{
+    int i;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s [-b bitmapdir] game.l9 ...\n", argv[0]);
+        return 1;
+    }
+    printf("%-20s %-18s %8s %10s %9s\n", "kernel", "game", "ops", "ns/op",
+           "MB/s");
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-b") && i + 1 < argc)
+            bench_bitmaps(argv[++i]);
+        else
+            bench_vector(argv[i]);
+    }
+    return 0;
+}
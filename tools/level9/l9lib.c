@@ -0,0 +1,440 @@
+/***********************************************************************\
+*
+* Level 9 interpreter
+* Version 5.2
+* Copyright (c) 1996-2025 Glen Summers and contributors.
+* Contributions from David Kinder, Alan Staniforth, Simon Baldwin,
+* Dieter Baron and Andreas Scherrer.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA.
+*
+\***********************************************************************/
+
+/* The os_ routines of liblevel9, see l9lib.h. Where talkie.c writes to
+   stdout and reads stdin, these fill and empty buffers. */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "l9lib.h"
+#include "events.h"
+#ifdef HAS_BUNDLE
+#include "bundle.h"
+#endif
+
+/* a growing byte buffer, for the text and the drawing calls */
+typedef struct
+{
+    L9BYTE* data;
+    int len, size;
+} Buffer;
+
+static Buffer text = {NULL, 0, 0};
+static Buffer drawing = {NULL, 0, 0};
+static int drawing_sent = 0;
+
+static char input[256];
+static int input_ready = 0;
+
+static BitmapType bitmap_type = NO_BITMAPS;
+static char* bitmap_dir = NULL;
+static int gfx_mode = -1, bitmap_pic = -1, bitmap_x, bitmap_y;
+
+static void buffer_add(Buffer* b, const void* p, int len)
+{
+    if (b->len + len > b->size) {
+        int size = b->size ? b->size : 4096;
+        L9BYTE* grown;
+        while (b->len + len > size)
+            size *= 2;
+        if (!(grown = realloc(b->data, size))) return;
+        b->data = grown;
+        b->size = size;
+    }
+    memcpy(b->data + b->len, p, len);
+    b->len += len;
+}
+
+static void buffer_free(Buffer* b)
+{
+    free(b->data);
+    b->data = NULL;
+    b->len = b->size = 0;
+}
+
+/* with l9_events(), what has yet to go into the ring besides the text and
+   the drawing calls: the bitmap shown, and the prompt, 0 for a line and 1
+   for a key */
+static struct ev_ring* events = NULL;
+static L9BYTE* bitmap_data = NULL;
+static int bitmap_len = 0, prompt_new = -1, prompt_sent = 0;
+
+/* the drawing calls at the start of p, len bytes, that fit in room */
+static int drawing_fit(const L9BYTE* p, int len, unsigned long room)
+{
+    int n = 0, step;
+
+    while (n < len) {
+        step = p[n] == 'X' ? 1 : p[n] == 'C' ? 5 : p[n] == 'F' ? 9 : 13;
+        if ((unsigned long)(n + step) > room) break;
+        n += step;
+    }
+    return n;
+}
+
+/* the data of a bitmap's EV_PICTURE event, see l9_events() */
+static L9BYTE* bitmap_event(int* len)
+{
+    Bitmap* b = NULL;
+    L9UINT16 head[5];
+    L9BYTE* data;
+    int n = 4, i;
+
+    if (bitmap_type != NO_BITMAPS)
+        b = DecodeBitmap(bitmap_dir, bitmap_type, bitmap_pic, 0, 0);
+    head[0] = (L9UINT16)bitmap_x;
+    head[1] = (L9UINT16)bitmap_y;
+    if (b) {
+        head[2] = b->width;
+        head[3] = b->height;
+        head[4] = b->npalette;
+        n = 10 + 3 * b->npalette + b->width * b->height;
+        if ((unsigned long)n > ev_max(events)) n = 4;
+    }
+    *len = 0;
+    if (!(data = malloc(n))) return NULL;
+    memcpy(data, head, n > 4 ? 10 : 4);
+    if (n > 4) {
+        for (i = 0; i < b->npalette; i++) {
+            data[10 + 3 * i] = b->palette[i].red;
+            data[11 + 3 * i] = b->palette[i].green;
+            data[12 + 3 * i] = b->palette[i].blue;
+        }
+        memcpy(data + 10 + 3 * b->npalette, b->bitmap, b->width * b->height);
+    }
+    *len = n;
+    return data;
+}
+
+/* FALSE and the slice ends if some of it has to wait for room */
+static L9BOOL events_send(void)
+{
+    unsigned long room;
+    int n;
+
+    while (text.len) {
+        room = ev_room(events);
+        n = room < (unsigned long)text.len ? (int)room : text.len;
+        if (!n || ev_put(events, EV_TEXT, 0, text.data, n)) goto full;
+        memmove(text.data, text.data + n, text.len - n);
+        text.len -= n;
+    }
+    while (drawing.len) {
+        n = drawing_fit(drawing.data, drawing.len, ev_room(events));
+        if (!n || ev_put(events, EV_PICTURE, -1, drawing.data, n)) goto full;
+        memmove(drawing.data, drawing.data + n, drawing.len - n);
+        drawing.len -= n;
+    }
+    if (bitmap_pic >= 0) {
+        /* decoded once, however long it waits */
+        if (!bitmap_data) bitmap_data = bitmap_event(&bitmap_len);
+        if (ev_put(events, EV_PICTURE, bitmap_pic, bitmap_data, bitmap_len)) goto full;
+        free(bitmap_data);
+        bitmap_data = NULL;
+        bitmap_pic = -1;
+    }
+    if (prompt_new >= 0) {
+        if (ev_put(events, EV_PROMPT, prompt_new, NULL, 0)) goto full;
+        prompt_new = -1;
+    }
+    return TRUE;
+full:
+    L9Yield(L9_SLICE_OUTPUT);
+    return FALSE;
+}
+
+static void add_gfx_cmd(char op, int nargs, const int* args)
+{
+    L9BYTE cmd[1 + 2 * 6];
+    int i;
+
+    cmd[0] = (L9BYTE)op;
+    for (i = 0; i < nargs; i++) {
+        cmd[1 + 2 * i] = args[i] & 0xff;
+        cmd[2 + 2 * i] = (args[i] >> 8) & 0xff;
+    }
+    buffer_add(&drawing, cmd, 1 + 2 * nargs);
+}
+
+void os_printchar(char c)
+{
+    if (c == 13) c = 10;
+    buffer_add(&text, &c, 1);
+    if (events && c == 10) events_send();
+}
+
+L9BOOL os_input(char* ibuff, int size)
+{
+    if (!input_ready) {
+        if (events && !prompt_sent) {
+            prompt_new = 0;
+            prompt_sent = 1;
+        }
+        return FALSE; /* L9RunSlice() yields L9_SLICE_INPUT */
+    }
+    strncpy(ibuff, input, size - 1);
+    ibuff[size - 1] = 0;
+    input_ready = prompt_sent = 0;
+    return TRUE;
+}
+
+char os_readchar(int millis)
+{
+    (void)millis;
+    if (!input_ready) {
+        if (events && !prompt_sent) {
+            prompt_new = 1;
+            prompt_sent = 1;
+        }
+        L9Yield(L9_SLICE_INPUT);
+        return 0;
+    }
+    input_ready = prompt_sent = 0;
+    return input[0] ? input[0] : '\r';
+}
+
+L9BOOL os_stoplist(void)
+{
+    return FALSE;
+}
+
+void os_flush(void)
+{
+    if (events)
+        events_send();
+    else if (text.len)
+        L9Yield(L9_SLICE_OUTPUT);
+}
+
+/* the host saves and restores with L9SaveState() and L9RestoreState() */
+L9BOOL os_save_file(L9BYTE* Ptr, int Bytes)
+{
+    (void)Ptr;
+    (void)Bytes;
+    return FALSE;
+}
+
+L9BOOL os_load_file(L9BYTE* Ptr, int* Bytes, int Max)
+{
+    (void)Ptr;
+    (void)Bytes;
+    (void)Max;
+    return FALSE;
+}
+
+L9BOOL os_get_game_file(char* NewName, int Size)
+{
+    (void)NewName;
+    (void)Size;
+    return FALSE;
+}
+
+void os_set_filenumber(char* NewName, int Size, int n)
+{
+    char* p;
+    int i;
+
+    (void)Size;
+#if defined(_Windows) || defined(__MSDOS__) || defined(_WIN32) ||              \
+    defined(__WIN32__)
+    p = strrchr(NewName, '\\');
+#else
+    p = strrchr(NewName, '/');
+#endif
+    if (p == NULL) p = NewName;
+    for (i = strlen(p) - 1; i >= 0; i--) {
+        if (isdigit(p[i])) {
+            p[i] = '0' + n;
+            return;
+        }
+    }
+}
+
+void os_graphics(int mode)
+{
+    gfx_mode = mode;
+}
+
+void os_cleargraphics(void)
+{
+    add_gfx_cmd('X', 0, NULL);
+}
+
+void os_setcolour(int colour, int index)
+{
+    int args[] = {colour, index};
+    add_gfx_cmd('C', 2, args);
+}
+
+void os_drawline(int x1, int y1, int x2, int y2, int colour1, int colour2)
+{
+    int args[] = {x1, y1, x2, y2, colour1, colour2};
+    add_gfx_cmd('L', 6, args);
+}
+
+void os_fill(int x, int y, int colour1, int colour2)
+{
+    int args[] = {x, y, colour1, colour2};
+    add_gfx_cmd('F', 4, args);
+}
+
+void os_show_bitmap(int pic, int x, int y)
+{
+    bitmap_pic = pic;
+    bitmap_x = x;
+    bitmap_y = y;
+    free(bitmap_data);
+    bitmap_data = NULL;
+    L9Yield(L9_SLICE_PICTURE);
+}
+
+FILE* os_open_script_file(void)
+{
+    return NULL;
+}
+
+L9BOOL os_find_file(char* NewName)
+{
+    FILE* f = fopen(NewName, "rb");
+    if (f != NULL) {
+        fclose(f);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+L9BOOL l9_open(const char* game, const char* gfx)
+{
+    char* picname = NULL;
+
+    l9_close();
+#ifdef HAS_BUNDLE
+    /* a bundle holds the game, its picture file and "pics/", the bitmaps */
+    if (bundle_open(game)) {
+        game = "story";
+        if (bundle_find("graphics", NULL)) picname = "graphics";
+        if (!gfx) gfx = "pics/";
+    }
+#endif
+    if (!LoadGame((char*)game, picname)) return FALSE;
+    if (gfx && (bitmap_dir = malloc(strlen(gfx) + 1)) != NULL) {
+        strcpy(bitmap_dir, gfx);
+        bitmap_type = DetectBitmaps(bitmap_dir);
+    }
+    return TRUE;
+}
+
+void l9_close(void)
+{
+    StopGame();
+    FreeMemory();
+#ifdef HAS_BUNDLE
+    bundle_close();
+#endif
+    buffer_free(&text);
+    buffer_free(&drawing);
+    drawing_sent = 0;
+    free(bitmap_dir);
+    bitmap_dir = NULL;
+    bitmap_type = NO_BITMAPS;
+    gfx_mode = bitmap_pic = -1;
+    input_ready = 0;
+    events = NULL;
+    free(bitmap_data);
+    bitmap_data = NULL;
+    prompt_new = -1;
+    prompt_sent = 0;
+}
+
+void l9_input(const char* line)
+{
+    strncpy(input, line, sizeof(input) - 1);
+    input[sizeof(input) - 1] = 0;
+    input_ready = 1;
+}
+
+L9SliceStatus l9_run(int budget)
+{
+    L9SliceStatus status;
+    int drawn;
+
+    /* the host has yet to make room for the last slice's events */
+    if (events && !events_send()) return L9_SLICE_OUTPUT;
+    if (drawing_sent) {
+        drawing.len = 0;
+        drawing_sent = 0;
+    }
+    drawn = drawing.len;
+    status = L9RunSlice(budget);
+    /* line drawn pictures are drawn between slices, as by talkie.c */
+    while (RunGraphics())
+        ;
+    if (drawing.len > drawn && status < L9_SLICE_PICTURE) status = L9_SLICE_PICTURE;
+    if (events && !events_send() && status < L9_SLICE_OUTPUT) status = L9_SLICE_OUTPUT;
+    return status;
+}
+
+int l9_output(char* buff, int size)
+{
+    int n = text.len < size ? text.len : size;
+
+    if (n <= 0) return 0;
+    memcpy(buff, text.data, n);
+    memmove(text.data, text.data + n, text.len - n);
+    text.len -= n;
+    return n;
+}
+
+int l9_graphics(int* width, int* height)
+{
+    GetPictureSize(width, height);
+    return gfx_mode;
+}
+
+const L9BYTE* l9_drawing(int* length)
+{
+    if (!drawing.len || drawing_sent) return NULL;
+    drawing_sent = 1;
+    *length = drawing.len;
+    return drawing.data;
+}
+
+Bitmap* l9_bitmap(int* pic, int* x, int* y)
+{
+    Bitmap* bitmap;
+
+    if (bitmap_pic < 0 || bitmap_type == NO_BITMAPS) return NULL;
+    bitmap = DecodeBitmap(bitmap_dir, bitmap_type, bitmap_pic, 0, 0);
+    *pic = bitmap_pic;
+    *x = bitmap_x;
+    *y = bitmap_y;
+    bitmap_pic = -1;
+    return bitmap;
+}
+
+void l9_events(struct ev_ring* ring)
+{
+    events = ring;
+}
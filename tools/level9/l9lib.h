@@ -0,0 +1,105 @@
+/***********************************************************************\
+*
+* Level 9 interpreter
+* Version 5.2
+* Copyright (c) 1996-2025 Glen Summers and contributors.
+* Contributions from David Kinder, Alan Staniforth, Simon Baldwin,
+* Dieter Baron and Andreas Scherrer.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111, USA.
+*
+\***********************************************************************/
+
+/* The C API of liblevel9, the interpreter built as a shared library so
+   that a host can run games in its own process (with ctypes or cffi)
+   instead of talking to the level9 executable over pipes. The library
+   provides the os_ routines itself and keeps what the game produces in
+   buffers that the host empties between slices:
+
+       l9_open("game.l9", "pics/");
+       l9_input("look");
+       while ((status = l9_run(10000)) != L9_SLICE_INPUT && ...)
+           ;
+       n = l9_output(text, sizeof(text));
+
+   Text and pictures are plain, no "#[...]" lines. The routines of
+   level9.h, e.g. L9SaveState() or GetRoom(), work on the opened game.
+
+   A host that runs the game on a thread of its own has it put everything
+   into an event ring instead, see l9_events(). */
+
+#include <stdio.h>
+#include "level9.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Load a game, and with gfx the bitmap directory that goes with it. The
+   game may be a bundle (see tools/bundle/bundle.h). FALSE if the game
+   could not be loaded. An open game is closed first. */
+L9BOOL l9_open(const char* game, const char* gfx);
+
+/* Stop the game and free everything the library holds */
+void l9_close(void);
+
+/* The next line of input, without a newline. Games that wait for a key
+   take the first character, or return ('\r') for an empty line. */
+void l9_input(const char* line);
+
+/* Run up to budget instructions, see L9RunSlice(). L9_SLICE_INPUT means
+   the game waits for a line (or polls for a key, running on without input
+   gets past that), L9_SLICE_PICTURE that l9_drawing() or l9_bitmap() has
+   something new. */
+L9SliceStatus l9_run(int budget);
+
+/* Copy up to size bytes of the text printed so far to buff and remove
+   them from the library's buffer. Lines end in '\n'. Returns the number of
+   bytes copied, buff is not terminated. */
+int l9_output(char* buff, int size);
+
+/* The graphics mode the game last asked for (0 off, 1 line drawings,
+   2 bitmaps) and the picture size, -1 before the game asked */
+int l9_graphics(int* width, int* height);
+
+/* The drawing calls of the line drawn picture since the last call, in the
+   layout of the level9 executable's "#[gfxbin]" chunks: an opcode byte
+   followed by 16 bit LE signed arguments, 'X' clear, 'C' colour index,
+   'L' x1 y1 x2 y2 colour1 colour2, 'F' x y colour1 colour2. NULL if there
+   are none; the data stays valid until the next l9_run(). */
+const L9BYTE* l9_drawing(int* length);
+
+/* The bitmap the game showed last, since the last call, and where; NULL
+   if there is none. The bitmap stays valid until the next l9_bitmap(). */
+Bitmap* l9_bitmap(int* pic, int* x, int* y);
+
+/* Send what the game produces to an event ring (see tools/events/events.h)
+   instead of the buffers of l9_output() and l9_drawing(), until l9_close(),
+   or to the buffers again with NULL. The events are EV_TEXT spans of text;
+   EV_PICTURE with arg -1 and the drawing calls of l9_drawing() as data, a
+   picture's calls in as many events as the ring needs, each ending after a
+   whole call; EV_PICTURE with arg the bitmap shown and as data x, y, the
+   width, the height and the number of colours (L9UINT16 each), the colours
+   as red, green and blue bytes and one colour index per pixel, or only x
+   and y if that does not fit the ring; and EV_PROMPT with arg 0 when the
+   game waits for a line, 1 for a key. While events wait for room in the
+   ring, l9_run() returns L9_SLICE_OUTPUT and does not run the game.
+   Everything but taking the events stays on the game's thread. */
+struct ev_ring;
+void l9_events(struct ev_ring* ring);
+
+#ifdef __cplusplus
+}
+#endif
@@ -31,6 +31,7 @@
 *  #dictionary   lists game dictionary (press a key to interrupt)
 *  #picture <n>  show picture <n>
 *  #seed <n>     set the random number seed to the value <n>
+*  #undo [<n>]   goes back <n> turns, 1 if it is left out
 *  #play         plays back a file as the input to the game
 *
 \***********************************************************************/
@@ -44,17 +45,52 @@
 
 #include "level9.h"
 
+/* the game and picture files may come from a bundle, see tools/bundle/bundle.h */
+#ifdef HAS_BUNDLE
+#include "bundle.h"
+#else
+#define bundle_fopen(f) fopen(f, "rb")
+#endif
+
+/* phase spans when TALKIE_TRACE is set, see tools/trace/trace.h */
+#include "trace.h"
+
+/* the run encoding of saved states, see tools/state/state.h */
+#include "state.h"
+
 /* #define L9DEBUG */
 /* #define CODEFOLLOW */
 /* #define FULLSCAN */
+/* #define NO_PREFETCH */
+/* #define NO_SCAN_THREADS */
+
+/* the other parts of a multi-part game are read and scanned by a thread,
+   see startprefetch(); the thread needs its own context pointer */
+#if !defined(NO_PREFETCH) && defined(__GNUC__) && (defined(__unix__) || defined(__APPLE__))
+#define L9PREFETCH
+#include <pthread.h>
+#endif
+
+/* on a scan cache miss the game's header is looked for by as many threads
+   as there are cores, see scanslices() */
+#if !defined(NO_SCAN_THREADS) && defined(__GNUC__) && (defined(__unix__) || defined(__APPLE__))
+#define L9SCANTHREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 /* "L901" */
 #define L9_ID 0x4c393031
+/* "L9Z1", see L9SaveState() */
+#define L9_STATEID 0x4c395a31
 
 #define IBUFFSIZE 500
 #define RAMSAVESLOTS 10
+#define UNDOSTEPS 32
 #define GFXSTACKSIZE 100
+#define GFXSUBCOUNT 0x800
 #define FIRSTLINESIZE 96
+#define CAPTURESIZE 4096
 
 /* Typedefs */
 typedef struct
@@ -63,6 +99,98 @@ typedef struct
     L9BYTE listarea[LISTAREASIZE];
 } SaveStruct;
 
+/* The game at a prompt, as #undo goes back to it, see recordturn(). The
+   stack past stackptr is kept zeroed so the turns' runs leave it out. */
+typedef struct
+{
+    SaveStruct ws;
+    L9UINT16 stack[STACKSIZE];
+    L9UINT16 codeptr, stackptr, randomseed, pad;
+} TurnState;
+
+/* Leads a compressed state, the runs follow it */
+typedef struct
+{
+    L9UINT32 Id, gamesize, basesum, checksum, length;
+    L9UINT16 codeptr, stackptr, randomseed, pad;
+} StateHeader;
+
+/* One drawing call of a picture, scaled: 'L' line x1,y1 to x2,y2 in colours
+   c1,c2, 'F' fill at x1,y1 with c1,c2, 'C' colour c1 set to index c2 */
+typedef struct
+{
+    int op, x1, y1, x2, y2, c1, c2;
+} GfxPrim;
+
+/* Where GetWordV2()/GetWordV3() left off: the dictionary position and
+   unpack state after word next - 1, next is 0 if there is none */
+typedef struct
+{
+    int next, subdict, unpackcount, unpackd3;
+    L9BYTE* dictptr;
+    char unpackbuf[8];
+    char threechars[34];
+} WordCursor;
+
+/* A word code's text as displaywordref() prints it, see buildwordcache():
+   len characters at start in wordchars, with wordcase set from character
+   caseat on */
+#define WORDCACHECODES 0xf80 /* the codes below the single characters */
+#define WORDCACHEMAX 64      /* longer words are decoded as they print */
+#define WORDUNCACHED 0xff    /* len of a word left to the decoder */
+#define WORDNOCASE 0xff      /* caseat of a word that keeps its case */
+
+typedef struct
+{
+    L9UINT32 start;
+    L9BYTE len, caseat;
+} CachedWord;
+
+/* The dictionary words by how they start, so that corruptinginput() and
+   inputV2() look a typed word up instead of unpacking or walking the
+   dictionary for it, see builddictindex(). The words are kept in the order
+   the walk meets them, in scans: one for the default dictionary and each
+   sub-dictionary of a V3/V4 game, one for the whole V1/V2 dictionary. */
+#define DICTWORDMAX 64 /* V1/V2 words past this are left to the walk */
+
+typedef struct
+{
+    L9UINT32 key; /* offset of the word in keys, lowercased as compared */
+    L9BYTE len;
+    L9BYTE code; /* V1/V2: what inputV2() returns for the word */
+    L9BYTE cut;  /* V1/V2: the word goes on past a character the walk
+                    treats as the end of the dictionary, len stops there */
+} DictWord;
+
+typedef struct
+{
+    int scan, len, word;   /* the first len characters of word, in scan */
+    L9UINT32 first, count; /* the words starting so, in order, in postings */
+} DictPrefix;
+
+typedef struct
+{
+    DictWord* words;
+    int wordcount, wordsize;
+    char* keys;
+    L9UINT32 keylen, keysize;
+    int *scanfirst, *scanbase; /* scanfirst[scans] ends the last scan */
+    int scans, scansize;
+    int* subscan; /* V3/V4: the scan of the default dictionary and then of
+                     each sub-dictionary, -1 where the walk is kept */
+    DictPrefix* prefixes;
+    L9UINT32 mask;
+    L9UINT32* postings;
+} DictIndex;
+
+/* The drawing calls of one picture, see SetDisplayLists() */
+typedef struct
+{
+    GfxPrim* prims;
+    int count, size, gfxmode;
+    L9BOOL recorded;
+} DisplayList;
+
 /* Enumerations */
 enum L9GameTypes
 {
@@ -92,80 +220,150 @@ enum L9GfxTypes
     GFX_V3C
 };
 
-/* Global Variables */
-L9BYTE *startfile = NULL, *pictureaddress = NULL, *picturedata = NULL;
-L9BYTE* startdata;
-L9UINT32 FileSize, picturesize;
-
-L9BYTE* L9Pointers[12];
-L9BYTE *absdatablock, *list2ptr, *list3ptr, *list9startptr, *acodeptr;
-L9BYTE *startmd, *endmd, *endwdp5, *wordtable, *dictdata, *defdict;
-L9UINT16 dictdatalen;
-L9BYTE* startmdV2;
-
-int wordcase;
-int unpackcount;
-char unpackbuf[8];
-L9BYTE* dictptr;
-char threechars[34];
-int L9GameType;
-int L9MsgType;
-char LastGame[MAX_PATH];
-char FirstLine[FIRSTLINESIZE];
-int FirstLinePos = 0;
-int FirstPicture = -1;
-
-#if defined(AMIGA) && defined(_DCC)
-__far SaveStruct ramsavearea[RAMSAVESLOTS];
+/* Everything a running game can change lives in an L9Context, so one
+   process can run several games, one per thread or switching between them.
+   The interpreter works on the calling thread's current context, set with
+   L9SetContext(). */
+
+#define MSGEQUIVCODES 0x1000
+
+#if defined(_MSC_VER)
+#    define L9THREAD __declspec(thread)
+#elif defined(__GNUC__)
+#    define L9THREAD __thread
 #else
-SaveStruct ramsavearea[RAMSAVESLOTS];
+#    define L9THREAD
 #endif
 
-GameState workspace;
-
-L9UINT16 randomseed;
-L9UINT16 constseed = 0;
-L9BOOL Running;
+struct L9Context
+{
+    L9BYTE *startfile, *pictureaddress, *picturedata;
+    L9BYTE* startdata;
+    L9UINT32 FileSize, picturesize;
+
+    L9BYTE* L9Pointers[12];
+    L9BYTE *absdatablock, *list2ptr, *list3ptr, *list9startptr, *acodeptr;
+    L9BYTE *startmd, *endmd, *endwdp5, *wordtable, *dictdata, *defdict;
+    L9UINT16 dictdatalen;
+    L9BYTE* startmdV2;
+
+    int wordcase;
+    int unpackcount;
+    char unpackbuf[8];
+    L9BYTE* dictptr;
+    char threechars[34];
+    WordCursor wordcursor;
+    int L9GameType;
+    int L9MsgType;
+    int L9V1Game;
+    char LastGame[MAX_PATH];
+    struct L9Prefetch* prefetch; /* the other parts, see startprefetch() */
+    char FirstLine[FIRSTLINESIZE];
+    int FirstLinePos;
+
+    /* ListMessages() has printchar() collect the text here */
+    char* capture;
+    int capturepos;
+    int FirstPicture;
+
+    /* RAM save slots as runs against basestate, see ramsave() */
+    L9BYTE* ramsaves[RAMSAVESLOTS];
+    L9UINT32 ramsavesize[RAMSAVESLOTS];
+    SaveStruct* basestate;
+    L9UINT32 basesum;
+
+    /* the last undocount prompts for #undo, newest first: lastturn in full
+       and undo[i] the runs that turn prompt i into the one before it */
+    TurnState* lastturn;
+    L9BYTE* undo[UNDOSTEPS - 1];
+    L9UINT32 undosize[UNDOSTEPS - 1];
+    int undocount;
+
+    /* what ends the running L9RunSlice(), see L9Yield() */
+    L9SliceStatus slicestatus;
+
+    GameState workspace;
+
+    L9UINT16 randomseed;
+    L9UINT16 constseed;
+    int roomvar; /* vartable index of the player's location, see GetRoom() */
+    L9BOOL Running;
+
+    char ibuff[IBUFFSIZE];
+    L9BYTE* ibuffptr;
+    char obuff[34];
+    FILE* scriptfile;
+
+    L9BOOL Cheating;
+    int CheatWord;
+    GameState CheatWorkspace;
+
+    int reflectflag, scale, gintcolour, option;
+    int l9textmode, drawx, drawy, screencalled, showtitle;
+    L9BYTE* gfxa5;
+    int gfx_mode;
+
+    /* offset + 1 into picturedata of each graphics subroutine's code,
+       0 if there is none, see indexgfxsubs() */
+    L9UINT32 gfxsubs[GFXSUBCOUNT];
+
+    /* GFXSUBCOUNT display lists by picture number once one is recorded,
+       the picture being recorded and the one RunGraphics() replays next */
+    DisplayList* displaylists;
+    DisplayList recording;
+    int recordpic, replaypic;
+    L9BOOL displaylistfileok;
+
+    L9BYTE* GfxA5Stack[GFXSTACKSIZE];
+    int GfxA5StackPos;
+    int GfxScaleStack[GFXSTACKSIZE];
+    int GfxScaleStackPos;
+
+    char lastchar;
+    char lastactualchar;
+    int d5, mdtmode, msgdepthV1, msgdepthV2;
+
+    L9BYTE* codeptr; /* instruction codes */
+    L9BYTE code;
+    L9UINT32 icount; /* instructions run, see GetInstructionCount() */
+
+    L9BYTE* list9ptr;
+
+    int unpackd3;
+
+    L9UINT16 gnostack[128];
+    L9BYTE gnoscratch[32];
+    int object, gnosp, numobjectfound, searchdepth, inithisearchpos;
+
+    /* message equivalents by dictionary word code, see buildmsgequiv() */
+    L9UINT32 msgequivstart[MSGEQUIVCODES + 1];
+    L9UINT16* msgequiv;
+
+    /* the decoded V3/V4 dictionary by word code, see buildwordcache() */
+    CachedWord* words;
+    L9BYTE* wordchars;
+
+    /* the dictionary for input, see builddictindex() */
+    DictIndex* dictindex;
+};
 
-char ibuff[IBUFFSIZE];
-L9BYTE* ibuffptr;
-char obuff[34];
-FILE* scriptfile = NULL;
+#define L9CONTEXTINIT                                                         \
+    {                                                                         \
+        .L9V1Game = -1, .FirstPicture = -1, .showtitle = 1,                   \
+        .gfx_mode = GFX_V2, .lastchar = '.', .recordpic = -1,                 \
+        .replaypic = -1, .roomvar = -1                                        \
+    }
 
-L9BOOL Cheating = FALSE;
-int CheatWord;
-GameState CheatWorkspace;
+/* used until the first L9SetContext(), so single game ports don't change */
+static L9Context l9default = L9CONTEXTINIT;
+static L9THREAD L9Context* vm = &l9default;
 
-int reflectflag, scale, gintcolour, option;
-int l9textmode = 0, drawx = 0, drawy = 0, screencalled = 0, showtitle = 1;
-L9BYTE* gfxa5 = NULL;
 Bitmap* bitmap = NULL;
-int gfx_mode = GFX_V2;
-
-L9BYTE* GfxA5Stack[GFXSTACKSIZE];
-int GfxA5StackPos = 0;
-int GfxScaleStack[GFXSTACKSIZE];
-int GfxScaleStackPos = 0;
-
-char lastchar = '.';
-char lastactualchar = 0;
-int d5;
-
-L9BYTE* codeptr; /* instruction codes */
-L9BYTE code;
-
-L9BYTE* list9ptr;
-
-int unpackd3;
 
 L9BYTE exitreversaltable[20] = {0x00, 0x04, 0x06, 0x07, 0x01, 0x08, 0x02,
                                 0x03, 0x05, 0x0a, 0x09, 0x0c, 0x0b, 0xff,
                                 0xff, 0x0f, 0xff, 0xff, 0xff, 0xff};
 
-L9UINT16 gnostack[128];
-L9BYTE gnoscratch[32];
-int object, gnosp, numobjectfound, searchdepth, inithisearchpos;
-
 struct L9V1GameInfo
 {
     L9BYTE dictVal1, dictVal2;
@@ -183,14 +381,28 @@ struct L9V1GameInfo L9V1Games[] = {
     0x15,    0x6c,    284,    -0x00f0, 0x0000,  -0x0050,
     -0x0050, -0x0050, 0x0300, 0x1930,  0x3c17, /* Snowball */
 };
-int L9V1Game = -1;
-
 /* Prototypes */
 L9BOOL LoadGame2(char* filename, char* picname);
 int getlongcode(void);
 L9BOOL GetWordV2(char* buff, int Word);
 L9BOOL GetWordV3(char* buff, int Word);
 void show_picture(int pic);
+void indexgfxsubs(void);
+void freedisplaylists(void);
+void loaddisplaylists(void);
+#ifdef L9PREFETCH
+void freeprefetch(void);
+#else
+#define freeprefetch()
+#endif
+void buildmsgequiv(void);
+void freemsgequiv(void);
+void buildwordcache(void);
+void freewordcache(void);
+void builddictindex(void);
+void freedictindex(void);
+L9BOOL matchdictindex(int scan);
+static void freestates(void);
 
 #ifdef CODEFOLLOW
 #    define CODEFOLLOWFILE "c:\\temp\\level9.txt"
@@ -246,31 +458,32 @@ char* drivercalls[] = {"init",
 
 void initdict(L9BYTE* ptr)
 {
-    dictptr = ptr;
-    unpackcount = 8;
+    vm->dictptr = ptr;
+    vm->unpackcount = 8;
+}
+
+/* the eight 5 bit codes packed into the five bytes at p */
+void unpackbytes(L9BYTE* p, char* codes)
+{
+    codes[0] = p[0] >> 3;
+    codes[1] = ((p[1] >> 6) + (p[0] << 2)) & 0x1f;
+    codes[2] = (p[1] >> 1) & 0x1f;
+    codes[3] = ((p[2] >> 4) + (p[1] << 4)) & 0x1f;
+    codes[4] = ((p[2] << 1) + (p[3] >> 7)) & 0x1f;
+    codes[5] = (p[3] >> 2) & 0x1f;
+    codes[6] = ((p[3] << 3) + (p[4] >> 5)) & 0x1f;
+    codes[7] = p[4] & 0x1f;
 }
 
 char getdictionarycode(void)
 {
-    if (unpackcount != 8)
-        return unpackbuf[unpackcount++];
+    if (vm->unpackcount != 8)
+        return vm->unpackbuf[vm->unpackcount++];
     else {
-        /* unpackbytes */
-        L9BYTE d1 = *dictptr++, d2;
-        unpackbuf[0] = d1 >> 3;
-        d2 = *dictptr++;
-        unpackbuf[1] = ((d2 >> 6) + (d1 << 2)) & 0x1f;
-        d1 = *dictptr++;
-        unpackbuf[2] = (d2 >> 1) & 0x1f;
-        unpackbuf[3] = ((d1 >> 4) + (d2 << 4)) & 0x1f;
-        d2 = *dictptr++;
-        unpackbuf[4] = ((d1 << 1) + (d2 >> 7)) & 0x1f;
-        d1 = *dictptr++;
-        unpackbuf[5] = (d2 >> 2) & 0x1f;
-        unpackbuf[6] = ((d2 << 3) + (d1 >> 5)) & 0x1f;
-        unpackbuf[7] = d1 & 0x1f;
-        unpackcount = 1;
-        return unpackbuf[0];
+        unpackbytes(vm->dictptr, vm->unpackbuf);
+        vm->dictptr += 5;
+        vm->unpackcount = 1;
+        return vm->unpackbuf[0];
     }
 }
 
@@ -287,7 +500,7 @@ int getlongcode(void)
     int d0, d1;
     d0 = getdictionarycode();
     if (d0 == 0x10) {
-        wordcase = 1;
+        vm->wordcase = 1;
         d0 = getdictionarycode();
         return getdictionary(d0); /* reentrant? */
     }
@@ -297,22 +510,26 @@ int getlongcode(void)
 
 void printchar(char c)
 {
-    if (Cheating) return;
+    if (vm->Cheating) return;
 
     if (c & 128)
-        lastchar = (c &= 0x7f);
+        vm->lastchar = (c &= 0x7f);
     else if (c != 0x20 && c != 0x0d && (c < '\"' || c >= '.')) {
-        if (lastchar == '!' || lastchar == '?' || lastchar == '.')
+        if (vm->lastchar == '!' || vm->lastchar == '?' || vm->lastchar == '.')
             c = toupper(c);
-        lastchar = c;
+        vm->lastchar = c;
     }
     /* eat multiple CRs */
-    if (c != 0x0d || lastactualchar != 0x0d) {
-        os_printchar(c);
-        if (FirstLinePos < FIRSTLINESIZE - 1)
-            FirstLine[FirstLinePos++] = tolower(c);
+    if (c != 0x0d || vm->lastactualchar != 0x0d) {
+        if (vm->capture) {
+            if (vm->capturepos < CAPTURESIZE - 1) vm->capture[vm->capturepos++] = c;
+        } else {
+            os_printchar(c);
+            if (vm->FirstLinePos < FIRSTLINESIZE - 1)
+                vm->FirstLine[vm->FirstLinePos++] = tolower(c);
+        }
     }
-    lastactualchar = c;
+    vm->lastactualchar = c;
 }
 
 void printstring(char* buf)
@@ -346,12 +563,12 @@ void printautocase(int d0)
     if (d0 & 128)
         printchar((char)d0);
     else {
-        if (wordcase)
+        if (vm->wordcase)
             printchar((char)toupper(d0));
-        else if (d5 < 6)
+        else if (vm->d5 < 6)
             printchar((char)d0);
         else {
-            wordcase = 0;
+            vm->wordcase = 0;
             printchar((char)toupper(d0));
         }
     }
@@ -359,22 +576,31 @@ void printautocase(int d0)
 
 void displaywordref(L9UINT16 Off)
 {
-    static int mdtmode = 0;
-
-    wordcase = 0;
-    d5 = (Off >> 12) & 7;
+    vm->wordcase = 0;
+    vm->d5 = (Off >> 12) & 7;
     Off &= 0xfff;
     if (Off < 0xf80) {
         /* dwr01 */
         L9BYTE *a0, *oPtr, *a3;
         int d0, d2, i;
 
-        if (mdtmode == 1) printchar(0x20);
-        mdtmode = 1;
+        if (vm->mdtmode == 1) printchar(0x20);
+        vm->mdtmode = 1;
+
+        if (vm->words && vm->words[Off].len != WORDUNCACHED) {
+            CachedWord* w = &vm->words[Off];
+            L9BYTE* p = vm->wordchars + w->start;
+
+            for (i = 0; i < w->len; i++) {
+                if (i == w->caseat) vm->wordcase = 1;
+                printautocase(p[i]);
+            }
+            return;
+        }
 
         /* setindex */
-        a0 = dictdata;
-        d2 = dictdatalen;
+        a0 = vm->dictdata;
+        d2 = vm->dictdatalen;
 
         /* dwr02 */
         oPtr = a0;
@@ -384,17 +610,17 @@ void displaywordref(L9UINT16 Off)
         }
         /* dwr04 */
         if (a0 == oPtr) {
-            a0 = defdict;
+            a0 = vm->defdict;
         } else {
             a0 -= 4;
             Off -= L9WORD(a0 + 2);
-            a0 = startdata + L9WORD(a0);
+            a0 = vm->startdata + L9WORD(a0);
         }
         /* dwr04b */
         Off++;
         initdict(a0);
         a3 = (L9BYTE*)
-            threechars; /* a3 not set in original, prevent possible spam */
+            vm->threechars; /* a3 not set in original, prevent possible spam */
 
         /* dwr05 */
         while (TRUE) {
@@ -408,12 +634,12 @@ void displaywordref(L9UINT16 Off)
                 *a3++ = d0;
             } else {
                 d0 &= 3;
-                a3 = (L9BYTE*)threechars + d0;
+                a3 = (L9BYTE*)vm->threechars + d0;
                 if (--Off == 0) break;
             }
         }
         for (i = 0; i < d0; i++)
-            printautocase(threechars[i]);
+            printautocase(vm->threechars[i]);
 
         /* dwr10 */
         while (TRUE) {
@@ -424,14 +650,161 @@ void displaywordref(L9UINT16 Off)
     }
 
     else {
-        if (d5 & 2) printchar(0x20); /* prespace */
-        mdtmode = 2;
+        if (vm->d5 & 2) printchar(0x20); /* prespace */
+        vm->mdtmode = 2;
         Off &= 0x7f;
         if (Off != 0x7e) printchar((char)Off);
-        if (d5 & 1) printchar(0x20); /* postspace */
+        if (vm->d5 & 1) printchar(0x20); /* postspace */
     }
 }
 
+/*
+    The dictionary walk of displaywordref() for every word code at once.
+    Each sub-dictionary is unpacked from its start only once, instead of
+    once for every word printed from it, on a cursor that stops at the end
+    of the game data. A word the cursor can't finish, that would overrun
+    threechars or that starts with what an earlier call left there, is
+    left for displaywordref() to decode as it always has.
+*/
+
+typedef struct
+{
+    L9BYTE *ptr, *end;
+    int count, wordcase;
+    char codes[8];
+} DictCursor;
+
+/* getdictionarycode() on a cursor, -1 at the end of the data */
+int cursorcode(DictCursor* c)
+{
+    if (c->count == 8) {
+        if (c->end - c->ptr < 5) return -1;
+        unpackbytes(c->ptr, c->codes);
+        c->ptr += 5;
+        c->count = 0;
+    }
+    return c->codes[c->count++];
+}
+
+/* getlongcode() on a cursor */
+int cursorlongcode(DictCursor* c)
+{
+    int d0 = cursorcode(c), d1;
+    if (d0 == 0x10) {
+        c->wordcase = 1;
+        d0 = cursorcode(c);
+        if (d0 < 0) return -1;
+        return d0 >= 0x1a ? cursorlongcode(c) : d0 + 0x61;
+    }
+    if (d0 < 0 || (d1 = cursorcode(c)) < 0) return -1;
+    return 0x80 | ((d0 << 5) & 0xe0) | (d1 & 0x1f);
+}
+
+void freewordcache(void)
+{
+    free(vm->words);
+    free(vm->wordchars);
+    vm->words = NULL;
+    vm->wordchars = NULL;
+}
+
+void buildwordcache(void)
+{
+    DictCursor c;
+    L9BYTE *base = NULL, *a3 = NULL, *chars;
+    L9BYTE three[sizeof(vm->threechars)];
+    L9UINT32 used = 0;
+    int code, count = 0, known = 0, ok = FALSE;
+
+    freewordcache();
+    vm->words = malloc(sizeof(CachedWord) * WORDCACHECODES);
+    vm->wordchars = malloc(WORDCACHECODES * WORDCACHEMAX);
+    if (vm->words == NULL || vm->wordchars == NULL) {
+        fprintf(stderr, "Unable to allocate memory for the game! Exiting...\n");
+        exit(0);
+    }
+
+    for (code = 0; code < WORDCACHECODES; code++) {
+        CachedWord* w = &vm->words[code];
+        L9BYTE *a0 = vm->dictdata, *word = vm->defdict;
+        DictCursor rest;
+        int Off = code, d2 = vm->dictdatalen, d0 = 0, len, done = FALSE;
+
+        w->len = WORDUNCACHED;
+
+        /* setindex, as displaywordref() does it */
+        while (d2 && Off >= L9WORD(a0 + 2)) {
+            a0 += 4;
+            d2--;
+        }
+        if (a0 != vm->dictdata) {
+            a0 -= 4;
+            Off -= L9WORD(a0 + 2);
+            word = vm->startdata + L9WORD(a0);
+        }
+
+        /* carry on from the last word, unless it was further on or in a
+           different sub-dictionary */
+        if (word != base || Off < count) {
+            base = word;
+            c.ptr = word;
+            c.end = vm->startdata + vm->FileSize;
+            c.count = 8;
+            c.wordcase = 0;
+            count = -1;
+            known = 0; /* the bytes of three written since */
+            a3 = three;
+            ok = word >= vm->startdata && word < c.end;
+        }
+
+        /* dwr05, until the separator before word Off */
+        while (ok && count < Off) {
+            d0 = cursorcode(&c);
+            if (d0 < 0)
+                ok = FALSE;
+            else if (d0 < 0x1c) {
+                d0 = d0 >= 0x1a ? cursorlongcode(&c) : d0 + 0x61;
+                if (d0 < 0 || a3 >= three + sizeof(three))
+                    ok = FALSE;
+                else {
+                    if (a3 - three == known) known++;
+                    *a3++ = d0;
+                }
+            } else {
+                a3 = three + (d0 & 3);
+                count++;
+            }
+        }
+        len = a3 - three;
+        if (!ok || len > known) continue;
+
+        /* the shared start of the word, then dwr10 for the rest of it */
+        chars = vm->wordchars + used;
+        memcpy(chars, three, len);
+        w->caseat = c.wordcase ? 0 : WORDNOCASE;
+        rest = c;
+        while (len < WORDCACHEMAX) {
+            d0 = cursorcode(&rest);
+            if (d0 < 0) break;
+            if (d0 >= 0x1b) {
+                done = TRUE;
+                break;
+            }
+            d0 = d0 >= 0x1a ? cursorlongcode(&rest) : d0 + 0x61;
+            if (d0 < 0) break;
+            if (rest.wordcase && w->caseat == WORDNOCASE) w->caseat = len;
+            chars[len++] = d0;
+        }
+        if (done) {
+            w->start = used;
+            w->len = len;
+            used += len;
+        }
+    }
+    if ((chars = realloc(vm->wordchars, used ? used : 1)) != NULL)
+        vm->wordchars = chars;
+}
+
 int getmdlength(L9BYTE** Ptr)
 {
     int tot = 0, len;
@@ -442,15 +815,35 @@ int getmdlength(L9BYTE** Ptr)
     return tot;
 }
 
+/* the len bytes of a message after its length */
+void printmessagetext(L9BYTE* Msgptr, int len)
+{
+    L9BYTE Data;
+    L9UINT16 Off;
+
+    while (len) {
+        Data = *Msgptr++;
+        len--;
+        if (Data & 128) {
+            /* long form (reverse word) */
+            Off = (Data << 8) + *Msgptr++;
+            len--;
+        } else {
+            Off = (vm->wordtable[Data * 2] << 8) + vm->wordtable[Data * 2 + 1];
+        }
+        if (Off == 0x8f80) break;
+        displaywordref(Off);
+    }
+}
+
 void printmessage(int Msg)
 {
-    L9BYTE* Msgptr = startmd;
+    L9BYTE* Msgptr = vm->startmd;
     L9BYTE Data;
 
     int len;
-    L9UINT16 Off;
 
-    while (Msg > 0 && Msgptr - endmd <= 0) {
+    while (Msg > 0 && Msgptr - vm->endmd <= 0) {
         Data = *Msgptr;
         if (Data & 128) {
             Msgptr++;
@@ -465,20 +858,7 @@ void printmessage(int Msg)
 
     len = getmdlength(&Msgptr);
     if (len == 0) return;
-
-    while (len) {
-        Data = *Msgptr++;
-        len--;
-        if (Data & 128) {
-            /* long form (reverse word) */
-            Off = (Data << 8) + *Msgptr++;
-            len--;
-        } else {
-            Off = (wordtable[Data * 2] << 8) + wordtable[Data * 2 + 1];
-        }
-        if (Off == 0x8f80) break;
-        displaywordref(Off);
-    }
+    printmessagetext(Msgptr, len);
 }
 
 /* v2 message stuff */
@@ -489,12 +869,12 @@ int msglenV2(L9BYTE** ptr)
     L9BYTE a;
 
     /* catch berzerking code */
-    if (*ptr >= startdata + FileSize) return 0;
+    if (*ptr >= vm->startdata + vm->FileSize) return 0;
 
     while ((a = **ptr) == 0) {
         (*ptr)++;
 
-        if (*ptr >= startdata + FileSize) return 0;
+        if (*ptr >= vm->startdata + vm->FileSize) return 0;
 
         i += 255;
     }
@@ -526,7 +906,7 @@ void displaywordV2(L9BYTE* ptr, int msg)
         if (a < 3) return;
 
         if (a >= 0x5e)
-            displaywordV2(startmdV2 - 1, a - 0x5d);
+            displaywordV2(vm->startmdV2 - 1, a - 0x5d);
         else
             printcharV2((char)(a + 0x1d));
     }
@@ -535,7 +915,7 @@ void displaywordV2(L9BYTE* ptr, int msg)
 int msglenV1(L9BYTE** ptr)
 {
     L9BYTE* ptr2 = *ptr;
-    while (ptr2 < startdata + FileSize && *ptr2++ != 1)
+    while (ptr2 < vm->startdata + vm->FileSize && *ptr2++ != 1)
         ;
     return ptr2 - *ptr;
 }
@@ -554,7 +934,7 @@ void displaywordV1(L9BYTE* ptr, int msg)
         if (a < 3) return;
 
         if (a >= 0x5e)
-            displaywordV1(startmdV2, a - 0x5e);
+            displaywordV1(vm->startmdV2, a - 0x5e);
         else
             printcharV2((char)(a + 0x1d));
     }
@@ -564,12 +944,11 @@ L9BOOL amessageV2(L9BYTE* ptr, int msg, long* w, long* c)
 {
     int n;
     L9BYTE a;
-    static int depth = 0;
     if (msg == 0) return FALSE;
     while (--msg) {
         ptr += msglenV2(&ptr);
     }
-    if (ptr >= startdata + FileSize) return FALSE;
+    if (ptr >= vm->startdata + vm->FileSize) return FALSE;
     n = msglenV2(&ptr);
 
     while (--n > 0) {
@@ -577,11 +956,11 @@ L9BOOL amessageV2(L9BYTE* ptr, int msg, long* w, long* c)
         if (a < 3) return TRUE;
 
         if (a >= 0x5e) {
-            if (++depth > 10 || !amessageV2(startmdV2 - 1, a - 0x5d, w, c)) {
-                depth--;
+            if (++vm->msgdepthV2 > 10 || !amessageV2(vm->startmdV2 - 1, a - 0x5d, w, c)) {
+                vm->msgdepthV2--;
                 return FALSE;
             }
-            depth--;
+            vm->msgdepthV2--;
         } else {
             char ch = a + 0x1d;
             if (ch == 0x5f || ch == ' ')
@@ -597,12 +976,11 @@ L9BOOL amessageV1(L9BYTE* ptr, int msg, long* w, long* c)
 {
     int n;
     L9BYTE a;
-    static int depth = 0;
 
     while (msg--) {
         ptr += msglenV1(&ptr);
     }
-    if (ptr >= startdata + FileSize) return FALSE;
+    if (ptr >= vm->startdata + vm->FileSize) return FALSE;
     n = msglenV1(&ptr);
 
     while (--n > 0) {
@@ -610,11 +988,11 @@ L9BOOL amessageV1(L9BYTE* ptr, int msg, long* w, long* c)
         if (a < 3) return TRUE;
 
         if (a >= 0x5e) {
-            if (++depth > 10 || !amessageV1(startmdV2, a - 0x5e, w, c)) {
-                depth--;
+            if (++vm->msgdepthV1 > 10 || !amessageV1(vm->startmdV2, a - 0x5e, w, c)) {
+                vm->msgdepthV1--;
                 return FALSE;
             }
-            depth--;
+            vm->msgdepthV1--;
         } else {
             char ch = a + 0x1d;
             if (ch == 0x5f || ch == ' ')
@@ -632,7 +1010,7 @@ L9BOOL analyseV2(double* wl)
     int i;
     for (i = 1; i < 256; i++) {
         long w = 0, c = 0;
-        if (amessageV2(startmd, i, &w, &c)) {
+        if (amessageV2(vm->startmd, i, &w, &c)) {
             words += w;
             chars += c;
         } else
@@ -648,7 +1026,7 @@ L9BOOL analyseV1(double* wl)
     int i;
     for (i = 0; i < 256; i++) {
         long w = 0, c = 0;
-        if (amessageV1(startmd, i, &w, &c)) {
+        if (amessageV1(vm->startmd, i, &w, &c)) {
             words += w;
             chars += c;
         } else
@@ -661,10 +1039,69 @@ L9BOOL analyseV1(double* wl)
 
 void printmessageV2(int Msg)
 {
-    if (L9MsgType == MSGT_V2)
-        displaywordV2(startmd, Msg);
+    if (vm->L9MsgType == MSGT_V2)
+        displaywordV2(vm->startmd, Msg);
     else
-        displaywordV1(startmd, Msg);
+        displaywordV1(vm->startmd, Msg);
+}
+
+/* Each message is printed into a buffer as it reads within a line. V3
+   and V4 messages run from startmd to endmd, V1 and V2 ones up to the
+   word table after them or the first that amessageV2() rejects. */
+int ListMessages(void (*message)(int Msg, const char* text))
+{
+    char text[CAPTURESIZE], lastchar = vm->lastchar, lastactualchar = vm->lastactualchar;
+    L9BYTE *ptr = vm->startmd, *end, *next, Data;
+    int Msg = 0, len, count = 0;
+    long w, c;
+
+    if (!ptr) return 0;
+    end = (vm->L9GameType >= L9_V3) ? vm->endmd
+          : (vm->startmdV2 > vm->startmd) ? vm->startmdV2
+                                          : vm->startdata + vm->FileSize;
+    if (vm->L9GameType <= L9_V2 && vm->L9MsgType == MSGT_V2) Msg = 1;
+    vm->capture = text;
+    while (ptr < end) {
+        vm->capturepos = 0;
+        vm->lastchar = 'a';
+        vm->lastactualchar = 0x0d;
+        if (vm->L9GameType >= L9_V3) {
+            Data = *ptr;
+            if (Data & 128) {
+                /* a run of empty messages */
+                ptr++;
+                Msg += (Data & 0x7f) + 1;
+                continue;
+            }
+            len = getmdlength(&ptr);
+            printmessagetext(ptr, len);
+            ptr += len;
+        } else if (vm->L9MsgType == MSGT_V2) {
+            w = c = 0;
+            if (!amessageV2(ptr, 1, &w, &c)) break;
+            displaywordV2(ptr, 1);
+            /* step on the way displaywordV2() does */
+            next = ptr;
+            if (msglenV2(&next) == 0) break;
+            ptr += msglenV2(&ptr);
+        } else {
+            w = c = 0;
+            if (!amessageV1(ptr, 0, &w, &c)) break;
+            displaywordV1(ptr, 0);
+            if ((len = msglenV1(&ptr)) == 0) break;
+            ptr += len;
+        }
+        text[vm->capturepos] = 0;
+        if (vm->capturepos) {
+            message(Msg, text);
+            count++;
+        }
+        Msg++;
+    }
+    vm->capture = NULL;
+    vm->lastchar = lastchar;
+    vm->lastactualchar = lastactualchar;
+    return count;
 }
 
 L9UINT32 filelength(FILE* f)
@@ -690,40 +1127,87 @@ void L9Allocate(L9BYTE** ptr, L9UINT32 Size)
 
 void FreeMemory(void)
 {
-    if (startfile) {
-        free(startfile);
-        startfile = NULL;
+    if (vm->startfile) {
+        free(vm->startfile);
+        vm->startfile = NULL;
     }
-    if (pictureaddress) {
-        free(pictureaddress);
-        pictureaddress = NULL;
+    if (vm->pictureaddress) {
+        free(vm->pictureaddress);
+        vm->pictureaddress = NULL;
     }
-    if (bitmap) {
-        free(bitmap);
-        bitmap = NULL;
+    FreeBitmaps();
+    freemsgequiv();
+    freewordcache();
+    freedictindex();
+    freestates();
+    freedisplaylists();
+    freeprefetch();
+    if (vm->scriptfile) {
+        fclose(vm->scriptfile);
+        vm->scriptfile = NULL;
     }
-    if (scriptfile) {
-        fclose(scriptfile);
-        scriptfile = NULL;
+    vm->picturedata = NULL;
+    vm->picturesize = 0;
+    memset(vm->gfxsubs, 0, sizeof(vm->gfxsubs));
+    vm->gfxa5 = NULL;
+}
+
+L9Context* L9NewContext(void)
+{
+    static const L9Context initial = L9CONTEXTINIT;
+    L9Context* context = malloc(sizeof(L9Context));
+    if (context == NULL) {
+        fprintf(stderr, "Unable to allocate memory for the game! Exiting...\n");
+        exit(0);
     }
-    picturedata = NULL;
-    picturesize = 0;
-    gfxa5 = NULL;
+    *context = initial;
+    return context;
+}
+
+/* The decoded bitmaps are shared by all contexts and are left alone here,
+   FreeBitmaps() releases them. */
+void L9FreeContext(L9Context* context)
+{
+    L9Context* current = vm;
+
+    if (context == NULL) return;
+    vm = context;
+    if (vm->startfile) free(vm->startfile);
+    if (vm->pictureaddress) free(vm->pictureaddress);
+    if (vm->scriptfile) fclose(vm->scriptfile);
+    freemsgequiv();
+    freewordcache();
+    freedictindex();
+    freestates();
+    freedisplaylists();
+    freeprefetch();
+    vm = current == context ? &l9default : current;
+    if (context != &l9default) free(context);
+}
+
+void L9SetContext(L9Context* context)
+{
+    vm = context ? context : &l9default;
+}
+
+L9Context* L9GetContext(void)
+{
+    return vm;
 }
 
 L9BOOL load(char* filename)
 {
-    FILE* f = fopen(filename, "rb");
+    FILE* f = bundle_fopen(filename);
     if (!f) return FALSE;
 
-    if ((FileSize = filelength(f)) < 256) {
+    if ((vm->FileSize = filelength(f)) < 256) {
         fclose(f);
         error("\rFile is too small to contain a Level 9 game\r");
         return FALSE;
     }
 
-    L9Allocate(&startfile, FileSize);
-    if (fread(startfile, 1, FileSize, f) != FileSize) {
+    L9Allocate(&vm->startfile, vm->FileSize);
+    if (fread(vm->startfile, 1, vm->FileSize, f) != vm->FileSize) {
         fclose(f);
         return FALSE;
     }
@@ -1004,117 +1488,287 @@ L9BOOL Check(L9BYTE* StartFile,L9UINT32 FileSize,L9UINT32 Offset)
 }
 */
 
-long Scan(L9BYTE* StartFile, L9UINT32 FileSize)
+/*
+    Scan slices: on a scan cache miss Scan(), ScanV2() and ScanV1() each
+    look at every offset of the file, and a file that is not a V2 or V3
+    game goes through all three. So the file is cut into slices, one per
+    thread. For Scan() and ScanV2() the threads only collect the offsets
+    that pass the header checks, the cheap tests before ValidateSequence():
+    the code an offset leads to is marked in one Image, and a later header
+    stops where it meets code already found, so those are validated in
+    file order as before. ScanV1() unmarks what each candidate marked, so
+    its threads validate their slices as well, each with an Image of its
+    own, and the longest code of the first slice to have it wins.
+*/
+#define SCAN_V3 0
+#define SCAN_V2 1
+#define SCAN_V1 2
+
+/* at most SCANTHREADS threads, each with a slice of at least SCANSLICE */
+#define SCANTHREADS 8
+#define SCANSLICE 0x8000
+
+typedef struct
 {
-    L9BYTE* Chk = malloc(FileSize + 1);
-    L9BYTE* Image = calloc(FileSize, 1);
-    L9UINT32 i, num, Size, MaxSize = 0;
-    int j;
-    L9UINT16 d0 = 0, l9, md, ml, dd, dl;
-    L9UINT32 Min, Max;
-    long Offset = -1;
-    L9BOOL JumpKill, DriverV4;
+    int kind;
+    L9BYTE* StartFile;
+    L9BYTE* Chk;
+    L9BYTE* Image;
+    L9UINT32 FileSize, from, to;
+#ifdef L9SCANTHREADS
+    pthread_t thread;
+    L9BOOL threaded;
+#endif
+    /* SCAN_V3, SCAN_V2: the offsets that pass the header checks */
+    L9UINT32* found;
+    L9UINT32 count, alloc;
+    /* SCAN_V1: the longest code in the slice */
+    long MaxPos;
+    L9UINT32 MaxCount;
+} ScanSlice;
 
-    if ((Chk == NULL) || (Image == NULL)) {
-        fprintf(stderr,
-                "Unable to allocate memory for game scan! Exiting...\n");
-        exit(0);
-    }
+/* The 0 +...+ i-1 of each i, for the header checksums */
+L9BYTE* scanchecksums(L9BYTE* StartFile, L9UINT32 FileSize)
+{
+    L9BYTE* Chk = malloc(FileSize + 1);
+    L9UINT32 i;
 
+    if (Chk == NULL) return NULL;
     Chk[0] = 0;
     for (i = 1; i <= FileSize; i++)
         Chk[i] = Chk[i - 1] + StartFile[i - 1];
+    return Chk;
+}
 
-    for (i = 0; i < FileSize - 33; i++) {
-        num = L9WORD(StartFile + i) + 1;
-        /*
-                Chk[i] = 0 +...+ i-1
-                Chk[i+n] = 0 +...+ i+n-1
-                Chk[i+n] - Chk[i] = i + ... + i+n
-        */
-        if (num > 0x2000 && i + num <= FileSize && Chk[i + num] == Chk[i]) {
-            md = L9WORD(StartFile + i + 0x2);
-            ml = L9WORD(StartFile + i + 0x4);
-            dd = L9WORD(StartFile + i + 0xa);
-            dl = L9WORD(StartFile + i + 0xc);
-
-            if (ml > 0 && md > 0 && i + md + ml <= FileSize && dd > 0 &&
-                dl > 0 && i + dd + dl * 4 <= FileSize) {
-                /* v4 files may have acodeptr in 8000-9000, need to fix */
-                for (j = 0; j < 12; j++) {
-                    d0 = L9WORD(StartFile + i + 0x12 + j * 2);
-                    if (j != 11 && d0 >= 0x8000 && d0 < 0x9000) {
-                        if (d0 >= 0x8000 + LISTAREASIZE) break;
-                    } else if (i + d0 > FileSize)
-                        break;
-                }
-                /* list9 ptr must be in listarea, acode ptr in data */
-                if (j < 12 /*|| (d0>=0x8000 && d0<0x9000)*/) continue;
+/* A V3 or V4 header at i, as far as it can be told without its code */
+L9BOOL scanheader(L9BYTE* StartFile, L9UINT32 FileSize, L9BYTE* Chk,
+                  L9UINT32 i)
+{
+    L9UINT32 num = L9WORD(StartFile + i) + 1;
+    L9UINT16 d0, l9, md, ml, dd, dl;
+    int j;
+
+    /*
+            Chk[i] = 0 +...+ i-1
+            Chk[i+n] = 0 +...+ i+n-1
+            Chk[i+n] - Chk[i] = i + ... + i+n
+    */
+    if (num <= 0x2000 || i + num > FileSize || Chk[i + num] != Chk[i])
+        return FALSE;
+    md = L9WORD(StartFile + i + 0x2);
+    ml = L9WORD(StartFile + i + 0x4);
+    dd = L9WORD(StartFile + i + 0xa);
+    dl = L9WORD(StartFile + i + 0xc);
+    if (!(ml > 0 && md > 0 && i + md + ml <= FileSize && dd > 0 && dl > 0 &&
+          i + dd + dl * 4 <= FileSize))
+        return FALSE;
 
-                l9 = L9WORD(StartFile + i + 0x12 + 10 * 2);
-                if (l9 < 0x8000 || l9 >= 0x8000 + LISTAREASIZE) continue;
+    /* v4 files may have acodeptr in 8000-9000, need to fix */
+    for (j = 0; j < 12; j++) {
+        d0 = L9WORD(StartFile + i + 0x12 + j * 2);
+        if (j != 11 && d0 >= 0x8000 && d0 < 0x9000) {
+            if (d0 >= 0x8000 + LISTAREASIZE) break;
+        } else if (i + d0 > FileSize)
+            break;
+    }
+    /* list9 ptr must be in listarea, acode ptr in data */
+    if (j < 12 /*|| (d0>=0x8000 && d0<0x9000)*/) return FALSE;
 
+    l9 = L9WORD(StartFile + i + 0x12 + 10 * 2);
+    return l9 >= 0x8000 && l9 < 0x8000 + LISTAREASIZE;
+}
+
+/* The same for a V2 header */
+L9BOOL scanheaderv2(L9BYTE* StartFile, L9UINT32 FileSize, L9BYTE* Chk,
+                    L9UINT32 i)
+{
+    L9UINT32 num = L9WORD(StartFile + i + 28) + 1;
+    L9UINT16 d0, l9;
+    int j;
+
+    if (i + num > FileSize ||
+        ((Chk[i + num] - Chk[i + 32]) & 0xff) != StartFile[i + 0x1e])
+        return FALSE;
+    for (j = 0; j < 14; j++) {
+        d0 = L9WORD(StartFile + i + j * 2);
+        if (j != 13 && d0 >= 0x8000 && d0 < 0x9000) {
+            if (d0 >= 0x8000 + LISTAREASIZE) break;
+        } else if (i + d0 > FileSize)
+            break;
+    }
+    /* list9 ptr must be in listarea, acode ptr in data */
+    if (j < 14 /*|| (d0>=0x8000 && d0<0x9000)*/) return FALSE;
+
+    l9 = L9WORD(StartFile + i + 6 + 9 * 2);
+    return l9 >= 0x8000 && l9 < 0x8000 + LISTAREASIZE;
+}
+
+void scanfound(ScanSlice* s, L9UINT32 i)
+{
+    if (s->count == s->alloc) {
+        s->alloc = s->alloc ? s->alloc * 2 : 16;
+        if ((s->found = realloc(s->found, s->alloc * sizeof(L9UINT32))) ==
+            NULL) {
+            fprintf(stderr,
+                    "Unable to allocate memory for game scan! Exiting...\n");
+            exit(0);
+        }
+    }
+    s->found[s->count++] = i;
+}
+
+void scanslice(ScanSlice* s)
+{
+    L9BYTE* StartFile = s->StartFile;
+    L9UINT32 i, Size, Min, Max;
+    L9BYTE* ImagePtr;
+    L9BOOL JumpKill;
+
+    for (i = s->from; i < s->to; i++) {
+        switch (s->kind) {
+        case SCAN_V3:
+            if (scanheader(StartFile, s->FileSize, s->Chk, i))
+                scanfound(s, i);
+            break;
+        case SCAN_V2:
+            if (scanheaderv2(StartFile, s->FileSize, s->Chk, i))
+                scanfound(s, i);
+            break;
+        case SCAN_V1:
+            if ((StartFile[i] == 0 && StartFile[i + 1] == 6) ||
+                (StartFile[i] == 32 && StartFile[i + 1] == 4)) {
                 Size = 0;
-                Min = Max = i + d0;
-                DriverV4 = 0;
-                if (ValidateSequence(StartFile, Image, i + d0, i + d0, &Size,
-                                     FileSize, &Min, &Max, FALSE, &JumpKill,
-                                     &DriverV4)) {
-#ifdef L9DEBUG
-                    printf("Found valid header at %ld, code size %ld", i, Size);
-#endif
-                    if (Size > MaxSize && Size > 100) {
-                        Offset = i;
-                        MaxSize = Size;
-                        L9GameType = DriverV4 ? L9_V4 : L9_V3;
-                    }
+                Min = Max = i;
+                if (ValidateSequence(StartFile, s->Image, i, i, &Size,
+                                     s->FileSize, &Min, &Max, FALSE,
+                                     &JumpKill, NULL) &&
+                    Size > s->MaxCount && Size > 100 && Size < 10000) {
+                    s->MaxCount = Size;
+                    s->MaxPos = i;
+                }
+                for (ImagePtr = s->Image + Min; ImagePtr <= s->Image + Max;
+                     ImagePtr++) {
+                    if (*ImagePtr == 2) *ImagePtr = 0;
                 }
             }
+            break;
         }
     }
-    free(Chk);
-    free(Image);
-    return Offset;
 }
 
-long ScanV2(L9BYTE* StartFile, L9UINT32 FileSize)
+#ifdef L9SCANTHREADS
+void* scanthread(void* arg)
 {
-    L9BYTE* Chk = malloc(FileSize + 1);
-    L9BYTE* Image = calloc(FileSize, 1);
-    L9UINT32 i, Size, MaxSize = 0, num;
-    int j;
-    L9UINT16 d0 = 0, l9;
-    L9UINT32 Min, Max;
-    long Offset = -1;
-    L9BOOL JumpKill;
+    scanslice(arg);
+    return NULL;
+}
+#endif
 
-    if ((Chk == NULL) || (Image == NULL)) {
-        fprintf(stderr,
-                "Unable to allocate memory for game scan! Exiting...\n");
-        exit(0);
+/* Runs scanslice() over the offsets up to end, in slices of its own
+   thread but the first; the slices are in s, and there are as many as
+   it returns. Image is the first slice's, the others of a SCAN_V1 get
+   one of their own. */
+int scanslices(ScanSlice* s, int kind, L9BYTE* StartFile, L9UINT32 FileSize,
+               L9UINT32 end, L9BYTE* Chk, L9BYTE* Image)
+{
+    int n = 1, k;
+
+#ifdef L9SCANTHREADS
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n = cpus < SCANTHREADS ? (int)cpus : SCANTHREADS;
+    if (n > (int)(end / SCANSLICE)) n = end / SCANSLICE;
+    if (n < 1) n = 1;
+#endif
+    memset(s, 0, n * sizeof(*s));
+    for (k = 0; k < n; k++) {
+        s[k].kind = kind;
+        s[k].StartFile = StartFile;
+        s[k].Chk = Chk;
+        s[k].Image = Image;
+        s[k].FileSize = FileSize;
+        s[k].from = end / n * k;
+        s[k].to = k == n - 1 ? end : end / n * (k + 1);
+        s[k].MaxPos = -1;
+    }
+#ifdef L9SCANTHREADS
+    /* a slice without an Image of its own waits for the first */
+    for (k = 1; k < n; k++)
+        if (kind != SCAN_V1 || (s[k].Image = calloc(FileSize, 1)) != NULL)
+            s[k].threaded =
+                pthread_create(&s[k].thread, NULL, scanthread, &s[k]) == 0;
+        else
+            s[k].Image = Image;
+#endif
+    scanslice(&s[0]);
+    for (k = 1; k < n; k++) {
+#ifdef L9SCANTHREADS
+        if (s[k].threaded) {
+            pthread_join(s[k].thread, NULL);
+            continue;
+        }
+#endif
+        scanslice(&s[k]);
     }
+    for (k = 1; k < n; k++)
+        if (s[k].Image != Image) free(s[k].Image);
+    return n;
+}
 
-    Chk[0] = 0;
-    for (i = 1; i <= FileSize; i++)
-        Chk[i] = Chk[i - 1] + StartFile[i - 1];
+long Scan(L9BYTE* StartFile, L9UINT32 FileSize, L9BYTE* Chk, L9BYTE* Image)
+{
+    ScanSlice s[SCANTHREADS];
+    L9UINT32 i, Size, MaxSize = 0;
+    int n, k;
+    L9UINT32 c;
+    L9UINT16 d0;
+    L9UINT32 Min, Max;
+    long Offset = -1;
+    L9BOOL JumpKill, DriverV4;
 
-    for (i = 0; i < FileSize - 28; i++) {
-        num = L9WORD(StartFile + i + 28) + 1;
-        if (i + num <= FileSize &&
-            ((Chk[i + num] - Chk[i + 32]) & 0xff) == StartFile[i + 0x1e]) {
-            for (j = 0; j < 14; j++) {
-                d0 = L9WORD(StartFile + i + j * 2);
-                if (j != 13 && d0 >= 0x8000 && d0 < 0x9000) {
-                    if (d0 >= 0x8000 + LISTAREASIZE) break;
-                } else if (i + d0 > FileSize)
-                    break;
+    n = scanslices(s, SCAN_V3, StartFile, FileSize, FileSize - 33, Chk, Image);
+    for (k = 0; k < n; k++) {
+        for (c = 0; c < s[k].count; c++) {
+            i = s[k].found[c];
+            /* the acode ptr, the last the header checks read */
+            d0 = L9WORD(StartFile + i + 0x12 + 11 * 2);
+            Size = 0;
+            Min = Max = i + d0;
+            DriverV4 = 0;
+            if (ValidateSequence(StartFile, Image, i + d0, i + d0, &Size,
+                                 FileSize, &Min, &Max, FALSE, &JumpKill,
+                                 &DriverV4)) {
+#ifdef L9DEBUG
+                printf("Found valid header at %ld, code size %ld", i, Size);
+#endif
+                if (Size > MaxSize && Size > 100) {
+                    Offset = i;
+                    MaxSize = Size;
+                    vm->L9GameType = DriverV4 ? L9_V4 : L9_V3;
+                }
             }
-            /* list9 ptr must be in listarea, acode ptr in data */
-            if (j < 14 /*|| (d0>=0x8000 && d0<0x9000)*/) continue;
+        }
+        free(s[k].found);
+    }
+    return Offset;
+}
 
-            l9 = L9WORD(StartFile + i + 6 + 9 * 2);
-            if (l9 < 0x8000 || l9 >= 0x8000 + LISTAREASIZE) continue;
+long ScanV2(L9BYTE* StartFile, L9UINT32 FileSize, L9BYTE* Chk, L9BYTE* Image)
+{
+    ScanSlice s[SCANTHREADS];
+    L9UINT32 i, Size, MaxSize = 0;
+    int n, k;
+    L9UINT32 c;
+    L9UINT16 d0;
+    L9UINT32 Min, Max;
+    long Offset = -1;
+    L9BOOL JumpKill;
 
+    n = scanslices(s, SCAN_V2, StartFile, FileSize, FileSize - 28, Chk, Image);
+    for (k = 0; k < n; k++) {
+        for (c = 0; c < s[k].count; c++) {
+            i = s[k].found[c];
+            /* the acode ptr, the last the header checks read */
+            d0 = L9WORD(StartFile + i + 13 * 2);
             Size = 0;
             Min = Max = i + d0;
             if (ValidateSequence(StartFile, Image, i + d0, i + d0, &Size,
@@ -1129,53 +1783,27 @@ long ScanV2(L9BYTE* StartFile, L9UINT32 FileSize)
                 }
             }
         }
+        free(s[k].found);
     }
-    free(Chk);
-    free(Image);
     return Offset;
 }
 
-long ScanV1(L9BYTE* StartFile, L9UINT32 FileSize)
+long ScanV1(L9BYTE* StartFile, L9UINT32 FileSize, L9BYTE* Image)
 {
-    L9BYTE* Image = calloc(FileSize, 1);
-    L9UINT32 i, Size;
-    int Replace;
-    L9BYTE* ImagePtr;
+    ScanSlice s[SCANTHREADS];
+    L9UINT32 i;
+    int n, k;
     long MaxPos = -1;
     L9UINT32 MaxCount = 0;
-    L9UINT32 Min, Max, MaxMin, MaxMax;
-    L9BOOL JumpKill, MaxJK;
 
     int dictOff1, dictOff2;
     L9BYTE dictVal1 = 0xff, dictVal2 = 0xff;
 
-    if (Image == NULL) {
-        fprintf(stderr,
-                "Unable to allocate memory for game scan! Exiting...\n");
-        exit(0);
-    }
-
-    for (i = 0; i < FileSize; i++) {
-        if ((StartFile[i] == 0 && StartFile[i + 1] == 6) ||
-            (StartFile[i] == 32 && StartFile[i + 1] == 4)) {
-            Size = 0;
-            Min = Max = i;
-            Replace = 0;
-            if (ValidateSequence(StartFile, Image, i, i, &Size, FileSize, &Min,
-                                 &Max, FALSE, &JumpKill, NULL)) {
-                if (Size > MaxCount && Size > 100 && Size < 10000) {
-                    MaxCount = Size;
-                    MaxMin = Min;
-                    MaxMax = Max;
-
-                    MaxPos = i;
-                    MaxJK = JumpKill;
-                }
-                Replace = 0;
-            }
-            for (ImagePtr = Image + Min; ImagePtr <= Image + Max; ImagePtr++) {
-                if (*ImagePtr == 2) *ImagePtr = Replace;
-            }
+    n = scanslices(s, SCAN_V1, StartFile, FileSize, FileSize, NULL, Image);
+    for (k = 0; k < n; k++) {
+        if (s[k].MaxCount > MaxCount) {
+            MaxCount = s[k].MaxCount;
+            MaxPos = s[k].MaxPos;
         }
     }
 #ifdef L9DEBUG
@@ -1204,25 +1832,23 @@ long ScanV1(L9BYTE* StartFile, L9UINT32 FileSize)
             }
         }
     }
-    L9V1Game = -1;
+    vm->L9V1Game = -1;
     if (dictVal1 != 0xff || dictVal2 != 0xff) {
         for (i = 0; i < sizeof L9V1Games / sizeof L9V1Games[0]; i++) {
             if ((L9V1Games[i].dictVal1 == dictVal1) &&
                 (L9V1Games[i].dictVal2 == dictVal2)) {
-                L9V1Game = i;
-                dictdata = StartFile + dictOff1 - L9V1Games[i].dictStart;
+                vm->L9V1Game = i;
+                vm->dictdata = StartFile + dictOff1 - L9V1Games[i].dictStart;
             }
         }
     }
 
 #ifdef L9DEBUG
-    if (L9V1Game >= 0) printf("V1scan found known dictionary: %d", L9V1Game);
+    if (vm->L9V1Game >= 0) printf("V1scan found known dictionary: %d", vm->L9V1Game);
 #endif
 
-    free(Image);
-
     if (MaxPos > 0) {
-        acodeptr = StartFile + MaxPos;
+        vm->acodeptr = StartFile + MaxPos;
         return 0;
     }
     return -1;
@@ -1334,22 +1960,292 @@ L9BOOL findsubs(L9BYTE* testptr, L9UINT32 testsize, L9BYTE** picdata,
                 tmpptr = startptr - j;
                 if (*tmpptr == 0xff || tmpptr < testptr) break;
 
-                length = ((*(tmpptr + 1) & 0x0f) << 8) + *(tmpptr + 2);
-                if (tmpptr + length == startptr) {
-                    startptr = tmpptr;
-                    break;
-                }
-            }
+                length = ((*(tmpptr + 1) & 0x0f) << 8) + *(tmpptr + 2);
+                if (tmpptr + length == startptr) {
+                    startptr = tmpptr;
+                    break;
+                }
+            }
+
+            if (*tmpptr != 0xff) {
+                *picdata = startptr;
+                *picsize = picptr - startptr;
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+/*
+    Scan cache: what Scan()/ScanV2()/ScanV1() and findsubs() found in a game
+    is written to a small text file, keyed by the size and an FNV-1a hash of
+    the game and picture data. A later start with the same files reads the
+    result back and skips the scan. A V1 game's A-code is not at a header
+    but where ScanV1() found it, so its offset in the file is kept too.
+*/
+char* scancachefile = NULL;
+
+typedef struct
+{
+    L9UINT32 size, hash, picsize, pichash; /* key */
+    long offset, dictoff, acodeoff, picoff;
+    int type, v1game, picsrc;
+    L9UINT32 piclen;
+} ScanResult;
+
+enum { PICSRC_NONE, PICSRC_PICFILE, PICSRC_DATA, PICSRC_FILE };
+
+void SetScanCache(char* filename)
+{
+    scancachefile = filename;
+}
+
+L9UINT32 scanhash(L9BYTE* data, L9UINT32 size)
+{
+    L9UINT32 h = 2166136261UL;
+    while (size--) h = ((h ^ *data++) * 16777619UL) & 0xffffffffUL;
+    return h;
+}
+
+L9BOOL readscancache(ScanResult* key, ScanResult* r)
+{
+    unsigned long v[13];
+    FILE* f = fopen(scancachefile, "rt");
+    int n;
+
+    if (f == NULL) return FALSE;
+    n = fscanf(f, "L9SCAN 2 %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
+               &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8],
+               &v[9], &v[10], &v[11], &v[12]);
+    fclose(f);
+    if (n != 13 || v[0] != key->size || v[1] != key->hash ||
+        v[2] != key->picsize || v[3] != key->pichash)
+        return FALSE;
+    *r = *key;
+    r->offset = (long)v[4];
+    r->type = (int)v[5];
+    r->v1game = (int)v[6] - 1;
+    r->dictoff = (long)v[7] - 1;
+    r->acodeoff = (long)v[8] - 1;
+    r->picsrc = (int)v[9];
+    r->picoff = (long)v[10];
+    r->piclen = v[11];
+    /* v[12] is the file size behind the header, a last sanity check */
+    return r->offset >= 0 && (L9UINT32)r->offset < key->size &&
+           v[12] == key->size - r->offset && r->type >= L9_V1 &&
+           r->type <= L9_V4 &&
+           (r->type != L9_V1 ||
+            (r->acodeoff >= 0 && (L9UINT32)r->acodeoff < key->size));
+}
+
+void writescancache(ScanResult* r)
+{
+    FILE* f = fopen(scancachefile, "wt");
+    if (f == NULL) return;
+    fprintf(f, "L9SCAN 2 %lu %lu %lu %lu %ld %d %d %ld %ld %d %ld %lu %lu\n",
+            (unsigned long)r->size, (unsigned long)r->hash,
+            (unsigned long)r->picsize, (unsigned long)r->pichash, r->offset,
+            r->type, r->v1game + 1, r->dictoff + 1, r->acodeoff + 1,
+            r->picsrc, r->picoff, (unsigned long)r->piclen,
+            (unsigned long)(r->size - r->offset));
+    fclose(f);
+}
+
+/* Scan(), then ScanV2() and ScanV1(): the offset of the game in the file,
+   with its type in L9GameType, or -1 */
+long scangame(L9BYTE* StartFile, L9UINT32 FileSize)
+{
+    L9BYTE* Chk = scanchecksums(StartFile, FileSize);
+    L9BYTE* Image = calloc(FileSize, 1);
+    long Offset;
+
+    if ((Chk == NULL) || (Image == NULL)) {
+        fprintf(stderr,
+                "Unable to allocate memory for game scan! Exiting...\n");
+        exit(0);
+    }
+
+    Offset = Scan(StartFile, FileSize, Chk, Image);
+    if (Offset < 0) {
+        memset(Image, 0, FileSize);
+        Offset = ScanV2(StartFile, FileSize, Chk, Image);
+        vm->L9GameType = L9_V2;
+        if (Offset < 0) {
+            memset(Image, 0, FileSize);
+            Offset = ScanV1(StartFile, FileSize, Image);
+            vm->L9GameType = L9_V1;
+        }
+    }
+    free(Chk);
+    free(Image);
+    return Offset;
+}
+
+#ifdef L9PREFETCH
+/*
+    Part prefetch: multi-part games (Snowball, Time and Magik...) switch
+    parts with driver call 0x0b, which had to read and scan the next file
+    while the player waited. Once a game with a part number in its file
+    name is loaded, a thread reads the files of the other part numbers and
+    scans them like intinitialise() does, into ScanResults as the scan
+    cache has them, and the switch only copies the file.
+*/
+#define MAXPARTS 10
+
+typedef struct
+{
+    char name[MAX_PATH];
+    L9BYTE* file; /* NULL if it is not a game */
+    L9UINT32 size;
+    ScanResult scan;
+} L9Part;
+
+struct L9Prefetch
+{
+    pthread_t thread;
+    L9BOOL joined;
+    int count;
+    L9Part part[MAXPARTS];
+};
+
+void prefetchpart(L9Part* part)
+{
+    ScanResult* r = &part->scan;
+    FILE* f = fopen(part->name, "rb");
+
+    if (!f) return;
+    part->size = filelength(f);
+    if (part->size >= 256 && (part->file = malloc(part->size)) != NULL &&
+        fread(part->file, 1, part->size, f) != part->size) {
+        free(part->file);
+        part->file = NULL;
+    }
+    fclose(f);
+    if (!part->file) return;
+
+    memset(r, 0, sizeof(*r));
+    vm->L9V1Game = -1;
+    vm->dictdata = NULL;
+    vm->acodeptr = NULL;
+    if ((r->offset = scangame(part->file, part->size)) < 0) {
+        free(part->file);
+        part->file = NULL;
+        return;
+    }
+    r->size = part->size;
+    r->type = vm->L9GameType;
+    r->v1game = vm->L9V1Game;
+    r->dictoff = r->type == L9_V1 && vm->dictdata ? vm->dictdata - part->file : -1;
+    r->acodeoff = r->type == L9_V1 && vm->acodeptr ? vm->acodeptr - part->file : -1;
+    r->picsrc = PICSRC_NONE;
+#ifndef NO_SCAN_GRAPHICS
+    /* as intinitialise() without a picture file */
+    L9BYTE *startdata = part->file + r->offset, *picdata;
+    L9UINT32 picsize;
+    if (findsubs(startdata, part->size - r->offset, &picdata, &picsize)) {
+        r->picsrc = PICSRC_DATA;
+        r->picoff = picdata - startdata;
+        r->piclen = picsize;
+    } else if (findsubs(part->file, r->offset, &picdata, &picsize)) {
+        r->picsrc = PICSRC_FILE;
+        r->picoff = picdata - part->file;
+        r->piclen = picsize;
+    }
+#endif
+}
+
+/* the scans set fields of the game, so the thread has a context to itself */
+void* prefetchparts(void* arg)
+{
+    struct L9Prefetch* p = arg;
+    L9Context* context = L9NewContext();
+    int i;
+
+    L9SetContext(context);
+    trace_begin("prefetch");
+    for (i = 0; i < p->count; i++)
+        prefetchpart(&p->part[i]);
+    trace_end();
+    L9FreeContext(context);
+    return NULL;
+}
+
+void freeprefetch(void)
+{
+    struct L9Prefetch* p = vm->prefetch;
+    int i;
+
+    if (p == NULL) return;
+    if (!p->joined) pthread_join(p->thread, NULL);
+    for (i = 0; i < p->count; i++)
+        free(p->part[i].file);
+    free(p);
+    vm->prefetch = NULL;
+}
+
+/* Look for the other parts of the game in filename, numbered as driver call
+   0x0b numbers them with os_set_filenumber(). The part itself is scanned
+   again too, for games that go back to it. */
+void startprefetch(char* filename)
+{
+    struct L9Prefetch* p;
+    char name[MAX_PATH];
+    int n;
+
+    freeprefetch();
+#ifdef HAS_BUNDLE
+    /* a bundle holds a single part */
+    if (bundle_active()) return;
+#endif
+    if (strlen(filename) >= MAX_PATH) return;
+    if ((p = calloc(1, sizeof(*p))) == NULL) return;
+    for (n = 0; n < MAXPARTS; n++) {
+        strcpy(name, filename);
+        os_set_filenumber(name, MAX_PATH, n);
+        if (strcmp(name, filename) && os_find_file(name))
+            strcpy(p->part[p->count++].name, name);
+    }
+    if (p->count == 0 || p->count == MAXPARTS) {
+        free(p);
+        return;
+    }
+    strcpy(p->part[p->count++].name, filename);
+    if (pthread_create(&p->thread, NULL, prefetchparts, p)) {
+        free(p);
+        return;
+    }
+    vm->prefetch = p;
+}
+
+/* Load filename from the prefetched parts, FALSE if it is not one of them
+   or not a game; r is what the scans found */
+L9BOOL takepart(char* filename, ScanResult* r)
+{
+    struct L9Prefetch* p = vm->prefetch;
+    L9Part* part;
+    int i;
 
-            if (*tmpptr != 0xff) {
-                *picdata = startptr;
-                *picsize = picptr - startptr;
-                return TRUE;
-            }
-        }
+    if (p == NULL) return FALSE;
+    for (i = 0; i < p->count && strcmp(p->part[i].name, filename); i++)
+        ;
+    if (i == p->count) return FALSE;
+    if (!p->joined) {
+        pthread_join(p->thread, NULL);
+        p->joined = TRUE;
     }
-    return FALSE;
+    part = &p->part[i];
+    if (!part->file) return FALSE;
+    L9Allocate(&vm->startfile, part->size);
+    memcpy(vm->startfile, part->file, part->size);
+    vm->FileSize = part->size;
+    *r = part->scan;
+    return TRUE;
 }
+#else
+#define startprefetch(filename) ((void)(filename))
+#define takepart(filename, r) FALSE
+#endif
 
 L9BOOL intinitialise(char* filename, char* picname)
 {
@@ -1360,243 +2256,302 @@ L9BOOL intinitialise(char* filename, char* picname)
     int hdoffset;
     long Offset;
     FILE* f;
+    ScanResult key, cache;
+    L9BOOL cached = FALSE;
 
-    if (pictureaddress) {
-        free(pictureaddress);
-        pictureaddress = NULL;
+    if (vm->pictureaddress) {
+        free(vm->pictureaddress);
+        vm->pictureaddress = NULL;
     }
-    picturedata = NULL;
-    picturesize = 0;
-    gfxa5 = NULL;
-
-    if (!load(filename)) {
+    vm->picturedata = NULL;
+    vm->picturesize = 0;
+    memset(vm->gfxsubs, 0, sizeof(vm->gfxsubs));
+    freedisplaylists();
+    vm->gfxa5 = NULL;
+    vm->wordcursor.next = 0;
+
+    /* a part switch takes the part prefetched, see startprefetch() */
+    if (!picname && takepart(filename, &cache)) {
+        cached = TRUE;
+    } else if (!load(filename)) {
         error("\rUnable to load: %s\r", filename);
         return FALSE;
     }
 
     /* try to load graphics */
     if (picname) {
-        f = fopen(picname, "rb");
+        f = bundle_fopen(picname);
         if (f) {
-            picturesize = filelength(f);
-            L9Allocate(&pictureaddress, picturesize);
-            if (fread(pictureaddress, 1, picturesize, f) != picturesize) {
-                free(pictureaddress);
-                pictureaddress = NULL;
-                picturesize = 0;
+            vm->picturesize = filelength(f);
+            L9Allocate(&vm->pictureaddress, vm->picturesize);
+            if (fread(vm->pictureaddress, 1, vm->picturesize, f) != vm->picturesize) {
+                free(vm->pictureaddress);
+                vm->pictureaddress = NULL;
+                vm->picturesize = 0;
             }
             fclose(f);
         }
     }
-    screencalled = 0;
-    l9textmode = 0;
+    vm->screencalled = 0;
+    vm->l9textmode = 0;
 
 #ifdef FULLSCAN
-    FullScan(startfile, FileSize);
+    FullScan(vm->startfile, vm->FileSize);
 #endif
 
-    Offset = Scan(startfile, FileSize);
-    if (Offset < 0) {
-        Offset = ScanV2(startfile, FileSize);
-        L9GameType = L9_V2;
+    if (scancachefile && !cached) {
+        memset(&key, 0, sizeof(key));
+        key.size = vm->FileSize;
+        key.hash = scanhash(vm->startfile, vm->FileSize);
+        key.picsize = vm->picturesize;
+        key.pichash = vm->pictureaddress ? scanhash(vm->pictureaddress, vm->picturesize) : 0;
+        cached = readscancache(&key, &cache);
+    }
+    if (cached) {
+        Offset = cache.offset;
+        vm->L9GameType = cache.type;
+        vm->L9V1Game = cache.v1game;
+        if (cache.dictoff >= 0) vm->dictdata = vm->startfile + cache.dictoff;
+        if (cache.acodeoff >= 0) vm->acodeptr = vm->startfile + cache.acodeoff;
+    } else {
+        trace_begin("scan");
+        Offset = scangame(vm->startfile, vm->FileSize);
+        trace_end();
         if (Offset < 0) {
-            Offset = ScanV1(startfile, FileSize);
-            L9GameType = L9_V1;
-            if (Offset < 0) {
-                error("\rUnable to locate valid Level 9 game in file: %s\r",
-                      filename);
-                return FALSE;
-            }
+            error("\rUnable to locate valid Level 9 game in file: %s\r",
+                  filename);
+            return FALSE;
         }
     }
 
-    startdata = startfile + Offset;
-    FileSize -= Offset;
+    vm->startdata = vm->startfile + Offset;
+    vm->FileSize -= Offset;
 
     /* setup pointers */
-    if (L9GameType == L9_V1) {
-        if (L9V1Game < 0) {
+    if (vm->L9GameType == L9_V1) {
+        if (vm->L9V1Game < 0) {
             error("\rWhat appears to be V1 game data was found, but the game "
                   "was not recognised.\rEither this is an unknown V1 game file "
                   "or, more likely, it is corrupted.\r");
             return FALSE;
         }
         for (i = 0; i < 5; i++) {
-            int off = L9V1Games[L9V1Game].L9Ptrs[i];
+            int off = L9V1Games[vm->L9V1Game].L9Ptrs[i];
             if (off < 0)
-                L9Pointers[i + 2] = acodeptr + off;
+                vm->L9Pointers[i + 2] = vm->acodeptr + off;
             else
-                L9Pointers[i + 2] = workspace.listarea + off;
+                vm->L9Pointers[i + 2] = vm->workspace.listarea + off;
         }
-        absdatablock = acodeptr - L9V1Games[L9V1Game].absData;
+        vm->absdatablock = vm->acodeptr - L9V1Games[vm->L9V1Game].absData;
     } else {
         /* V2,V3,V4 */
-        hdoffset = L9GameType == L9_V2 ? 4 : 0x12;
+        hdoffset = vm->L9GameType == L9_V2 ? 4 : 0x12;
         for (i = 0; i < 12; i++) {
-            L9UINT16 d0 = L9WORD(startdata + hdoffset + i * 2);
-            L9Pointers[i] = (i != 11 && d0 >= 0x8000 && d0 <= 0x9000)
-                                ? workspace.listarea + d0 - 0x8000
-                                : startdata + d0;
-        }
-        absdatablock = L9Pointers[0];
-        dictdata = L9Pointers[1];
-        list2ptr = L9Pointers[3];
-        list3ptr = L9Pointers[4];
+            L9UINT16 d0 = L9WORD(vm->startdata + hdoffset + i * 2);
+            vm->L9Pointers[i] = (i != 11 && d0 >= 0x8000 && d0 <= 0x9000)
+                                ? vm->workspace.listarea + d0 - 0x8000
+                                : vm->startdata + d0;
+        }
+        vm->absdatablock = vm->L9Pointers[0];
+        vm->dictdata = vm->L9Pointers[1];
+        vm->list2ptr = vm->L9Pointers[3];
+        vm->list3ptr = vm->L9Pointers[4];
         /*list9startptr */
-        list9startptr = L9Pointers[10];
-        acodeptr = L9Pointers[11];
+        vm->list9startptr = vm->L9Pointers[10];
+        vm->acodeptr = vm->L9Pointers[11];
     }
 
-    switch (L9GameType) {
+    trace_begin("analyse");
+    switch (vm->L9GameType) {
     case L9_V1: {
         double a1;
-        startmd = acodeptr + L9V1Games[L9V1Game].msgStart;
-        startmdV2 = startmd + L9V1Games[L9V1Game].msgLen;
+        vm->startmd = vm->acodeptr + L9V1Games[vm->L9V1Game].msgStart;
+        vm->startmdV2 = vm->startmd + L9V1Games[vm->L9V1Game].msgLen;
 
         if (analyseV1(&a1) && a1 > 2 && a1 < 10) {
-            L9MsgType = MSGT_V1;
+            vm->L9MsgType = MSGT_V1;
 #ifdef L9DEBUG
             printf("V1 msg table: wordlen=%.2lf", a1);
 #endif
         } else {
             error("\rUnable to identify V1 message table in file: %s\r",
                   filename);
+            trace_end();
             return FALSE;
         }
         break;
     }
     case L9_V2: {
         double a2, a1;
-        startmd = startdata + L9WORD(startdata + 0x0);
-        startmdV2 = startdata + L9WORD(startdata + 0x2);
+        vm->startmd = vm->startdata + L9WORD(vm->startdata + 0x0);
+        vm->startmdV2 = vm->startdata + L9WORD(vm->startdata + 0x2);
 
         /* determine message type */
         if (analyseV2(&a2) && a2 > 2 && a2 < 10) {
-            L9MsgType = MSGT_V2;
+            vm->L9MsgType = MSGT_V2;
 #ifdef L9DEBUG
             printf("V2 msg table: wordlen=%.2lf", a2);
 #endif
         } else if (analyseV1(&a1) && a1 > 2 && a1 < 10) {
-            L9MsgType = MSGT_V1;
+            vm->L9MsgType = MSGT_V1;
 #ifdef L9DEBUG
             printf("V1 msg table: wordlen=%.2lf", a1);
 #endif
         } else {
             error("\rUnable to identify V2 message table in file: %s\r",
                   filename);
+            trace_end();
             return FALSE;
         }
         break;
     }
     case L9_V3:
     case L9_V4:
-        startmd = startdata + L9WORD(startdata + 0x2);
-        endmd = startmd + L9WORD(startdata + 0x4);
-        defdict = startdata + L9WORD(startdata + 6);
-        endwdp5 = defdict + 5 + L9WORD(startdata + 0x8);
-        dictdata = startdata + L9WORD(startdata + 0x0a);
-        dictdatalen = L9WORD(startdata + 0x0c);
-        wordtable = startdata + L9WORD(startdata + 0xe);
+        vm->startmd = vm->startdata + L9WORD(vm->startdata + 0x2);
+        vm->endmd = vm->startmd + L9WORD(vm->startdata + 0x4);
+        vm->defdict = vm->startdata + L9WORD(vm->startdata + 6);
+        vm->endwdp5 = vm->defdict + 5 + L9WORD(vm->startdata + 0x8);
+        vm->dictdata = vm->startdata + L9WORD(vm->startdata + 0x0a);
+        vm->dictdatalen = L9WORD(vm->startdata + 0x0c);
+        vm->wordtable = vm->startdata + L9WORD(vm->startdata + 0xe);
+        buildmsgequiv();
+        buildwordcache();
         break;
     }
+    builddictindex();
+    trace_end();
 
 #ifndef NO_SCAN_GRAPHICS
     /* If there was no graphics file, look in the game data */
     //printf("PA %p\n", pictureaddress);
-    if (pictureaddress) {
-        if (!findsubs(pictureaddress, picturesize, &picturedata,
-                      &picturesize)) {
-            picturedata = NULL;
-            picturesize = 0;
+    trace_begin("findsubs");
+    if (cached) {
+        L9BYTE* base[] = {NULL, vm->pictureaddress, vm->startdata, vm->startfile};
+        vm->picturedata = cache.picsrc > PICSRC_NONE && cache.picsrc <= PICSRC_FILE
+                          ? base[cache.picsrc] + cache.picoff
+                          : NULL;
+        vm->picturesize = vm->picturedata ? cache.piclen : 0;
+    } else if (vm->pictureaddress) {
+        if (!findsubs(vm->pictureaddress, vm->picturesize, &vm->picturedata,
+                      &vm->picturesize)) {
+            vm->picturedata = NULL;
+            vm->picturesize = 0;
         }
     } else {
-        if (!findsubs(startdata, FileSize, &picturedata, &picturesize) &&
-            !findsubs(startfile, startdata - startfile, &picturedata,
-                      &picturesize)) {
-            picturedata = NULL;
-            picturesize = 0;
+        if (!findsubs(vm->startdata, vm->FileSize, &vm->picturedata, &vm->picturesize) &&
+            !findsubs(vm->startfile, vm->startdata - vm->startfile, &vm->picturedata,
+                      &vm->picturesize)) {
+            vm->picturedata = NULL;
+            vm->picturesize = 0;
         }
     }
+    trace_end();
     //printf("PD %p\n", picturedata);
 #endif
+    indexgfxsubs();
+    loaddisplaylists();
+
+    if (scancachefile && !cached) {
+        cache = key;
+        cache.offset = Offset;
+        cache.type = vm->L9GameType;
+        cache.v1game = vm->L9V1Game;
+        cache.dictoff = vm->L9GameType == L9_V1 ? vm->dictdata - vm->startfile : -1;
+        cache.acodeoff = vm->L9GameType == L9_V1 ? vm->acodeptr - vm->startfile : -1;
+        cache.picsrc = PICSRC_NONE;
+        cache.picoff = 0;
+        cache.piclen = vm->picturesize;
+        if (vm->picturedata && vm->pictureaddress && vm->picturedata >= vm->pictureaddress &&
+            vm->picturedata < vm->pictureaddress + key.picsize) {
+            cache.picsrc = PICSRC_PICFILE;
+            cache.picoff = vm->picturedata - vm->pictureaddress;
+        } else if (vm->picturedata && vm->picturedata >= vm->startdata) {
+            cache.picsrc = PICSRC_DATA;
+            cache.picoff = vm->picturedata - vm->startdata;
+        } else if (vm->picturedata) {
+            cache.picsrc = PICSRC_FILE;
+            cache.picoff = vm->picturedata - vm->startfile;
+        }
+        writescancache(&cache);
+    }
 
-    memset(FirstLine, 0, FIRSTLINESIZE);
-    FirstLinePos = 0;
+    memset(vm->FirstLine, 0, FIRSTLINESIZE);
+    vm->FirstLinePos = 0;
 
     return TRUE;
 }
 
 L9BOOL checksumgamedata(void)
 {
-    return calcchecksum(startdata, L9WORD(startdata) + 1) == 0;
+    return calcchecksum(vm->startdata, L9WORD(vm->startdata) + 1) == 0;
 }
 
 L9UINT16 movewa5d0(void)
 {
-    L9UINT16 ret = L9WORD(codeptr);
-    codeptr += 2;
+    L9UINT16 ret = L9WORD(vm->codeptr);
+    vm->codeptr += 2;
     return ret;
 }
 
 L9UINT16 getcon(void)
 {
-    if (code & 64) {
+    if (vm->code & 64) {
         /* getconsmall */
-        return *codeptr++;
+        return *vm->codeptr++;
     } else
         return movewa5d0();
 }
 
 L9BYTE* getaddr(void)
 {
-    if (code & 0x20) {
+    if (vm->code & 0x20) {
         /* getaddrshort */
-        signed char diff = *codeptr++;
-        return codeptr + diff - 1;
+        signed char diff = *vm->codeptr++;
+        return vm->codeptr + diff - 1;
     } else {
-        return acodeptr + movewa5d0();
+        return vm->acodeptr + movewa5d0();
     }
 }
 
 L9UINT16* getvar(void)
 {
 #ifndef CODEFOLLOW
-    return workspace.vartable + *codeptr++;
+    return vm->workspace.vartable + *vm->codeptr++;
 #else
     cfvar2 = cfvar;
-    return cfvar = workspace.vartable + *codeptr++;
+    return cfvar = vm->workspace.vartable + *vm->codeptr++;
 #endif
 }
 
 void Goto(void)
 {
     L9BYTE* target = getaddr();
-    if (target == codeptr - 2)
-        Running = FALSE; /* Endless loop! */
+    if (target == vm->codeptr - 2)
+        vm->Running = FALSE; /* Endless loop! */
     else
-        codeptr = target;
+        vm->codeptr = target;
 }
 
 void intgosub(void)
 {
     L9BYTE* newcodeptr = getaddr();
-    if (workspace.stackptr == STACKSIZE) {
+    if (vm->workspace.stackptr == STACKSIZE) {
         error("\rStack overflow error\r");
-        Running = FALSE;
+        vm->Running = FALSE;
         return;
     }
-    workspace.stack[workspace.stackptr++] = (L9UINT16)(codeptr - acodeptr);
-    codeptr = newcodeptr;
+    vm->workspace.stack[vm->workspace.stackptr++] = (L9UINT16)(vm->codeptr - vm->acodeptr);
+    vm->codeptr = newcodeptr;
 }
 
 void intreturn(void)
 {
-    if (workspace.stackptr == 0) {
+    if (vm->workspace.stackptr == 0) {
         error("\rStack underflow error\r");
-        Running = FALSE;
+        vm->Running = FALSE;
         return;
     }
-    codeptr = acodeptr + workspace.stack[--workspace.stackptr];
+    vm->codeptr = vm->acodeptr + vm->workspace.stack[--vm->workspace.stackptr];
 }
 
 void printnumber(void)
@@ -1604,20 +2559,48 @@ void printnumber(void)
     printdecimald0(*getvar());
 }
 
-void messagec(void)
+/* SetMessageIds(): "#[msg <n>]" and "#[/msg]" around each message the
+   game prints, straight to os_printchar() so they don't change the case of
+   the text or the first line */
+L9BOOL tagmessages = FALSE;
+
+void SetMessageIds(L9BOOL on)
 {
-    if (L9GameType <= L9_V2)
-        printmessageV2(getcon());
+    tagmessages = on;
+}
+
+void printmeta(char* s)
+{
+    while (*s)
+        os_printchar(*s++);
+}
+
+void printtaggedmessage(int Msg)
+{
+    char tag[24];
+    L9BOOL tagged = tagmessages && !vm->Cheating;
+
+    if (tagged) {
+        sprintf(tag, "#[msg %d]", Msg);
+        printmeta(tag);
+    }
+    trace_begin("text");
+    if (vm->L9GameType <= L9_V2)
+        printmessageV2(Msg);
     else
-        printmessage(getcon());
+        printmessage(Msg);
+    trace_end();
+    if (tagged) printmeta("#[/msg]");
+}
+
+void messagec(void)
+{
+    printtaggedmessage(getcon());
 }
 
 void messagev(void)
 {
-    if (L9GameType <= L9_V2)
-        printmessageV2(*getvar());
-    else
-        printmessage(*getvar());
+    printtaggedmessage(*getvar());
 }
 
 void init(L9BYTE* a6)
@@ -1684,7 +2667,7 @@ void driverosrdch(L9BYTE* a6)
 #endif
 
     os_flush();
-    if (Cheating) {
+    if (vm->Cheating) {
         *a6 = '\r';
     } else {
         /* max delay of 1/50 sec */
@@ -1778,7 +2761,7 @@ void checkfordisc(L9BYTE* a6)
 #endif
 
     *a6 = 0;
-    list9startptr[2] = 0;
+    vm->list9startptr[2] = 0;
 }
 
 void driver(int d0, L9BYTE* a6)
@@ -1852,13 +2835,148 @@ void driver(int d0, L9BYTE* a6)
     }
 }
 
+/* Compressed save states
+
+   States are kept as runs (tools/state) against the workspace the game had
+   when it first asked for input, the stack as runs against zeros. The
+   header is in the machine's byte order, as in the .sav files. */
+
+/* The workspace states are compressed against, taken the first time it is
+   needed, normally when the game first asks for input */
+static SaveStruct* getbasestate(void)
+{
+    if (vm->basestate == NULL) {
+        vm->basestate = malloc(sizeof(SaveStruct));
+        if (vm->basestate == NULL) {
+            fprintf(stderr, "Unable to allocate memory for the game! Exiting...\n");
+            exit(0);
+        }
+        memmove(vm->basestate, vm->workspace.vartable, sizeof(SaveStruct));
+        vm->basesum = state_adler32((L9BYTE*)vm->basestate, sizeof(SaveStruct));
+    }
+    return vm->basestate;
+}
+
+static void freestates(void)
+{
+    int i;
+
+    for (i = 0; i < RAMSAVESLOTS; i++) {
+        free(vm->ramsaves[i]);
+        vm->ramsaves[i] = NULL;
+        vm->ramsavesize[i] = 0;
+    }
+    free(vm->basestate);
+    vm->basestate = NULL;
+    for (i = 0; i < vm->undocount - 1; i++)
+        free(vm->undo[i]);
+    free(vm->lastturn);
+    vm->lastturn = NULL;
+    vm->undocount = 0;
+}
+
+/* out must hold L9STATESIZE bytes */
+static L9UINT32 encodestate(L9BYTE* out)
+{
+    StateHeader h;
+    L9BYTE* end;
+
+    end = state_encode(out + sizeof(h), (L9BYTE*)vm->workspace.vartable,
+                       (L9BYTE*)getbasestate(), sizeof(SaveStruct));
+    end = state_encode(end, (L9BYTE*)vm->workspace.stack, NULL,
+                       vm->workspace.stackptr * sizeof(L9UINT16));
+
+    h.Id = L9_STATEID;
+    h.gamesize = vm->FileSize;
+    h.basesum = vm->basesum;
+    h.length = end - out - sizeof(h);
+    h.checksum = state_adler32(out + sizeof(h), h.length);
+    h.codeptr = vm->codeptr - vm->acodeptr;
+    h.stackptr = vm->workspace.stackptr;
+    h.randomseed = vm->randomseed;
+    h.pad = 0;
+    memcpy(out, &h, sizeof(h));
+    return end - out;
+}
+
+/* Restores a state from L9SaveState(), only the workspace unless full */
+static L9BOOL loadstate(const L9BYTE* buffer, int size, L9BOOL full)
+{
+    StateHeader h;
+    SaveStruct temp;
+    L9UINT16 stack[STACKSIZE];
+    const L9BYTE* in = buffer + sizeof(h);
+
+    if (size < (int)sizeof(h)) return FALSE;
+    memcpy(&h, buffer, sizeof(h));
+    if (h.Id != L9_STATEID || h.gamesize != vm->FileSize || h.length != size - sizeof(h) ||
+        h.stackptr > STACKSIZE)
+        return FALSE;
+    getbasestate();
+    if (h.basesum != vm->basesum || h.checksum != state_adler32(in, h.length)) return FALSE;
+    if (!(in = state_decode((L9BYTE*)&temp, (L9BYTE*)vm->basestate, sizeof(SaveStruct), in,
+                            buffer + size)) ||
+        !state_decode((L9BYTE*)stack, NULL, h.stackptr * sizeof(L9UINT16), in, buffer + size))
+        return FALSE;
+
+    memmove(vm->workspace.vartable, &temp, sizeof(SaveStruct));
+    if (full) {
+        memmove(vm->workspace.stack, stack, h.stackptr * sizeof(L9UINT16));
+        vm->workspace.stackptr = h.stackptr;
+        vm->workspace.codeptr = h.codeptr;
+        vm->codeptr = vm->acodeptr + h.codeptr;
+        vm->randomseed = h.randomseed;
+    }
+    return TRUE;
+}
+
+int L9SaveState(L9BYTE* buffer, int size)
+{
+    L9BYTE temp[L9STATESIZE];
+    L9UINT32 n;
+
+    if (vm->acodeptr == NULL) return 0;
+    if (size >= L9STATESIZE) return encodestate(buffer);
+    n = encodestate(temp);
+    if (n > (L9UINT32)size) return 0;
+    memcpy(buffer, temp, n);
+    return n;
+}
+
+L9BOOL L9RestoreState(L9BYTE* buffer, int size)
+{
+    if (vm->acodeptr == NULL || !loadstate(buffer, size, TRUE)) return FALSE;
+    /* the rest of a line of commands belongs to the game left behind */
+    vm->ibuffptr = NULL;
+    return TRUE;
+}
+
+L9BYTE* GetWorkspace(int* size)
+{
+    /* the list area follows the variables, see GameState */
+    *size = sizeof(vm->workspace.vartable) + LISTAREASIZE;
+    return vm->acodeptr ? (L9BYTE*)vm->workspace.vartable : NULL;
+}
+
 void ramsave(int i)
 {
+    L9BYTE buffer[STATE_ENCODE_MAX(sizeof(SaveStruct))];
+    L9UINT32 n;
+    L9BYTE* p;
 #ifdef L9DEBUG
     printf("driver - ramsave %d", i);
 #endif
 
-    memmove(ramsavearea + i, workspace.vartable, sizeof(SaveStruct));
+    n = state_encode(buffer, (L9BYTE*)vm->workspace.vartable, (L9BYTE*)getbasestate(),
+                     sizeof(SaveStruct)) - buffer;
+    p = realloc(vm->ramsaves[i], n);
+    if (p == NULL) {
+        fprintf(stderr, "Unable to allocate memory for the game! Exiting...\n");
+        exit(0);
+    }
+    memcpy(p, buffer, n);
+    vm->ramsaves[i] = p;
+    vm->ramsavesize[i] = n;
 }
 
 void ramload(int i)
@@ -1867,12 +2985,100 @@ void ramload(int i)
     printf("driver - ramload %d", i);
 #endif
 
-    memmove(workspace.vartable, ramsavearea + i, sizeof(SaveStruct));
+    /* an unused slot holds zeros, as the old full copies started out */
+    if (vm->ramsaves[i] == NULL)
+        memset(vm->workspace.vartable, 0, sizeof(SaveStruct));
+    else
+        state_decode((L9BYTE*)vm->workspace.vartable, (L9BYTE*)vm->basestate, sizeof(SaveStruct),
+                     vm->ramsaves[i], vm->ramsaves[i] + vm->ramsavesize[i]);
+}
+
+static void getturn(TurnState* t)
+{
+    memset(t, 0, sizeof(*t));
+    memmove(&t->ws, vm->workspace.vartable, sizeof(SaveStruct));
+    memmove(t->stack, vm->workspace.stack, vm->workspace.stackptr * sizeof(L9UINT16));
+    t->codeptr = (L9UINT16)(vm->codeptr - vm->acodeptr);
+    t->stackptr = vm->workspace.stackptr;
+    t->randomseed = vm->randomseed;
+}
+
+/* Called as each line of input is taken, with codeptr on the input
+   instruction, so that #undo can come back to it. Only the bytes that
+   changed since the last prompt are kept for it. */
+static void recordturn(void)
+{
+    TurnState now;
+    L9BYTE buffer[STATE_ENCODE_MAX(sizeof(TurnState))];
+    L9UINT32 n;
+    L9BYTE* p;
+
+    getturn(&now);
+    if (vm->lastturn == NULL) {
+        vm->lastturn = malloc(sizeof(TurnState));
+        if (vm->lastturn == NULL) {
+            fprintf(stderr, "Unable to allocate memory for the game! Exiting...\n");
+            exit(0);
+        }
+    } else if (vm->undocount > 0) {
+        n = state_encode(buffer, (L9BYTE*)vm->lastturn, (L9BYTE*)&now, sizeof(TurnState)) - buffer;
+        if ((p = malloc(n)) == NULL) {
+            fprintf(stderr, "Unable to allocate memory for the game! Exiting...\n");
+            exit(0);
+        }
+        memcpy(p, buffer, n);
+        /* the oldest prompt goes to make room */
+        if (vm->undocount == UNDOSTEPS) free(vm->undo[--vm->undocount - 1]);
+        memmove(vm->undo + 1, vm->undo, (vm->undocount - 1) * sizeof(vm->undo[0]));
+        memmove(vm->undosize + 1, vm->undosize, (vm->undocount - 1) * sizeof(vm->undosize[0]));
+        vm->undo[0] = p;
+        vm->undosize[0] = n;
+    }
+    *vm->lastturn = now;
+    vm->undocount++;
+}
+
+/* Goes back to the prompt n turns before this one, FALSE if there is none */
+static L9BOOL undoturns(int n)
+{
+    TurnState t, older;
+    int i, deltas = vm->undocount - 1;
+
+    if (n < 1 || n > vm->undocount) return FALSE;
+    t = *vm->lastturn;
+    for (i = 0; i < n; i++) {
+        if (i == deltas) break;
+        if (!state_decode((L9BYTE*)&older, (L9BYTE*)&t, sizeof(TurnState), vm->undo[i],
+                          vm->undo[i] + vm->undosize[i]))
+            return FALSE;
+        if (i == n - 1)
+            *vm->lastturn = older; /* the newest prompt still kept */
+        else
+            t = older;
+    }
+
+    memmove(vm->workspace.vartable, &t.ws, sizeof(SaveStruct));
+    memmove(vm->workspace.stack, t.stack, sizeof(t.stack));
+    vm->workspace.stackptr = t.stackptr;
+    vm->workspace.codeptr = t.codeptr;
+    vm->codeptr = vm->acodeptr + t.codeptr;
+    vm->randomseed = t.randomseed;
+
+    /* the prompts gone back past are dropped, the one returned to is taken
+       again with its next line */
+    for (i = 0; i < n && i < deltas; i++)
+        free(vm->undo[i]);
+    if (deltas > n) {
+        memmove(vm->undo, vm->undo + n, (deltas - n) * sizeof(vm->undo[0]));
+        memmove(vm->undosize, vm->undosize + n, (deltas - n) * sizeof(vm->undosize[0]));
+    }
+    vm->undocount -= n;
+    return TRUE;
 }
 
 void calldriver(void)
 {
-    L9BYTE* a6 = list9startptr;
+    L9BYTE* a6 = vm->list9startptr;
     int d0 = *a6++;
 #ifdef CODEFOLLOW
     fprintf(f, " %s", drivercalls[d0]);
@@ -1891,10 +3097,10 @@ void calldriver(void)
             else
                 ramload(d1 + 1);
         }
-        *list9startptr = *a6;
+        *vm->list9startptr = *a6;
     } else if (d0 == 0x0b) {
         char NewName[MAX_PATH];
-        strcpy(NewName, LastGame);
+        strcpy(NewName, vm->LastGame);
         if (*a6 == 0) {
             printstring("\rSearching for next sub-game file.\r");
             if (!os_get_game_file(NewName, MAX_PATH)) {
@@ -1912,13 +3118,13 @@ void calldriver(void)
 void L9Random(void)
 {
 #ifdef CODEFOLLOW
-    fprintf(f, " %d", randomseed);
+    fprintf(f, " %d", vm->randomseed);
 #endif
-    randomseed =
-        (((randomseed << 8) + 0x0a - randomseed) << 2) + randomseed + 1;
-    *getvar() = randomseed & 0xff;
+    vm->randomseed =
+        (((vm->randomseed << 8) + 0x0a - vm->randomseed) << 2) + vm->randomseed + 1;
+    *getvar() = vm->randomseed & 0xff;
 #ifdef CODEFOLLOW
-    fprintf(f, " %d", randomseed);
+    fprintf(f, " %d", vm->randomseed);
 #endif
 }
 
@@ -1932,20 +3138,20 @@ void save(void)
     /* does a full save, workpace, stack, codeptr, stackptr, game name, checksum
      */
 
-    workspace.Id = L9_ID;
-    workspace.codeptr = codeptr - acodeptr;
-    workspace.listsize = LISTAREASIZE;
-    workspace.stacksize = STACKSIZE;
-    workspace.filenamesize = MAX_PATH;
-    workspace.checksum = 0;
-    strcpy(workspace.filename, LastGame);
+    vm->workspace.Id = L9_ID;
+    vm->workspace.codeptr = vm->codeptr - vm->acodeptr;
+    vm->workspace.listsize = LISTAREASIZE;
+    vm->workspace.stacksize = STACKSIZE;
+    vm->workspace.filenamesize = MAX_PATH;
+    vm->workspace.checksum = 0;
+    strcpy(vm->workspace.filename, vm->LastGame);
 
     checksum = 0;
     for (i = 0; i < sizeof(GameState); i++)
-        checksum += ((L9BYTE*)&workspace)[i];
-    workspace.checksum = checksum;
+        checksum += ((L9BYTE*)&vm->workspace)[i];
+    vm->workspace.checksum = checksum;
 
-    if (os_save_file((L9BYTE*)&workspace, sizeof(workspace)))
+    if (os_save_file((L9BYTE*)&vm->workspace, sizeof(vm->workspace)))
         printstring("\rGame saved.\r");
     else
         printstring("\rUnable to save game.\r");
@@ -1989,7 +3195,7 @@ L9BOOL CheckFile(GameState* gs)
     for (i = 0; i < sizeof(GameState); i++)
         checksum -= *((L9BYTE*)gs + i);
     if (checksum) return FALSE;
-    if (StrCompare(gs->filename, LastGame)) {
+    if (StrCompare(gs->filename, vm->LastGame)) {
         printstring(
             "\rWarning: game path name does not match, you may be about to "
             "load this position file into the wrong story file.\r");
@@ -2011,21 +3217,23 @@ void NormalRestore(void)
 #ifdef L9DEBUG
     printf("function - restore");
 #endif
-    if (Cheating) {
+    if (vm->Cheating) {
         /* not really an error */
-        Cheating = FALSE;
-        error("\rWord is: %s\r", ibuff);
+        vm->Cheating = FALSE;
+        error("\rWord is: %s\r", vm->ibuff);
     }
 
     if (os_load_file((L9BYTE*)&temp, &Bytes, sizeof(GameState))) {
-        if (Bytes == V1FILESIZE) {
+        if (loadstate((L9BYTE*)&temp, Bytes, FALSE)) {
             printstring("\rGame restored.\r");
-            memset(workspace.listarea, 0, LISTAREASIZE);
-            memmove(workspace.vartable, &temp, V1FILESIZE);
+        } else if (Bytes == V1FILESIZE) {
+            printstring("\rGame restored.\r");
+            memset(vm->workspace.listarea, 0, LISTAREASIZE);
+            memmove(vm->workspace.vartable, &temp, V1FILESIZE);
         } else if (CheckFile(&temp)) {
             printstring("\rGame restored.\r");
             /* only copy in workspace */
-            memmove(workspace.vartable, temp.vartable, sizeof(SaveStruct));
+            memmove(vm->workspace.vartable, temp.vartable, sizeof(SaveStruct));
         } else {
             printstring("\rSorry, unrecognised format. Unable to restore\r");
         }
@@ -2038,16 +3246,18 @@ void restore(void)
     int Bytes;
     GameState temp;
     if (os_load_file((L9BYTE*)&temp, &Bytes, sizeof(GameState))) {
-        if (Bytes == V1FILESIZE) {
+        if (loadstate((L9BYTE*)&temp, Bytes, TRUE)) {
+            printstring("\rGame restored.\r");
+        } else if (Bytes == V1FILESIZE) {
             printstring("\rGame restored.\r");
             /* only copy in workspace */
-            memset(workspace.listarea, 0, LISTAREASIZE);
-            memmove(workspace.vartable, &temp, V1FILESIZE);
+            memset(vm->workspace.listarea, 0, LISTAREASIZE);
+            memmove(vm->workspace.vartable, &temp, V1FILESIZE);
         } else if (CheckFile(&temp)) {
             printstring("\rGame restored.\r");
             /* full restore */
-            memmove(&workspace, &temp, sizeof(GameState));
-            codeptr = acodeptr + workspace.codeptr;
+            memmove(&vm->workspace, &temp, sizeof(GameState));
+            vm->codeptr = vm->acodeptr + vm->workspace.codeptr;
         } else {
             printstring("\rSorry, unrecognised format. Unable to restore\r");
         }
@@ -2057,9 +3267,9 @@ void restore(void)
 
 void playback(void)
 {
-    if (scriptfile) fclose(scriptfile);
-    scriptfile = os_open_script_file();
-    if (scriptfile)
+    if (vm->scriptfile) fclose(vm->scriptfile);
+    vm->scriptfile = os_open_script_file();
+    if (vm->scriptfile)
         printstring("\rPlaying back input from script file.\r");
     else
         printstring("\rUnable to play back script file.\r");
@@ -2091,14 +3301,14 @@ void l9_fgets(char* s, int n, FILE* f)
 
 L9BOOL scriptinput(char* ibuff, int size)
 {
-    while (scriptfile != NULL) {
-        if (feof(scriptfile)) {
-            fclose(scriptfile);
-            scriptfile = NULL;
+    while (vm->scriptfile != NULL) {
+        if (feof(vm->scriptfile)) {
+            fclose(vm->scriptfile);
+            vm->scriptfile = NULL;
         } else {
             char* p = ibuff;
             *p = '\0';
-            l9_fgets(ibuff, size, scriptfile);
+            l9_fgets(ibuff, size, vm->scriptfile);
             while (*p != '\0') {
                 switch (*p) {
                 case '\n':
@@ -2120,7 +3330,7 @@ L9BOOL scriptinput(char* ibuff, int size)
             }
             if (*ibuff != '\0') {
                 printstring(ibuff);
-                lastchar = lastactualchar = '.';
+                vm->lastchar = vm->lastactualchar = '.';
                 return TRUE;
             }
         }
@@ -2130,25 +3340,25 @@ L9BOOL scriptinput(char* ibuff, int size)
 
 void clearworkspace(void)
 {
-    memset(workspace.vartable, 0, sizeof(workspace.vartable));
+    memset(vm->workspace.vartable, 0, sizeof(vm->workspace.vartable));
 }
 
 void ilins(int d0)
 {
     error("\rIllegal instruction: %d\r", d0);
-    Running = FALSE;
+    vm->Running = FALSE;
 }
 
 void function(void)
 {
-    int d0 = *codeptr++;
+    int d0 = *vm->codeptr++;
 #ifdef CODEFOLLOW
     fprintf(f, " %s", d0 == 250 ? "printstr" : functions[d0 - 1]);
 #endif
 
     switch (d0) {
     case 1:
-        if (L9GameType == L9_V1)
+        if (vm->L9GameType == L9_V1)
             StopGame();
         else
             calldriver();
@@ -2166,11 +3376,11 @@ void function(void)
         clearworkspace();
         break;
     case 6:
-        workspace.stackptr = 0;
+        vm->workspace.stackptr = 0;
         break;
     case 250:
-        printstring((char*)codeptr);
-        while (*codeptr++)
+        printstring((char*)vm->codeptr);
+        while (*vm->codeptr++)
             ;
         break;
 
@@ -2179,14 +3389,33 @@ void function(void)
     }
 }
 
-void findmsgequiv(int d7)
+/*
+    Message equivalents are looked up for every word typed, so the message
+    data is walked once at load time and each dictionary word code is mapped
+    to the list of list9 entries it produces, in message order.
+*/
+
+#define MSGEQUIVMAX 16
+
+void freemsgequiv(void)
+{
+    if (vm->msgequiv) {
+        free(vm->msgequiv);
+        vm->msgequiv = NULL;
+    }
+    memset(vm->msgequivstart, 0, sizeof(vm->msgequivstart));
+}
+
+/* walk the message data as findmsgequiv used to, counting the entries for
+   each word code when out is NULL and storing them otherwise */
+void scanmsgequiv(L9UINT32* count, L9UINT16* out)
 {
     int d4 = -1, d0;
-    L9BYTE* a2 = startmd;
+    L9BYTE* a2 = vm->startmd;
 
     do {
         d4++;
-        if (a2 > endmd) return;
+        if (a2 > vm->endmd) return;
         d0 = *a2;
         if (d0 & 0x80) {
             a2++;
@@ -2204,14 +3433,15 @@ void findmsgequiv(int d7)
                         a2++;
                         d6--;
                     } else {
+                        int d7;
                         d0 = (d1 << 8) + *a2++;
                         d6--;
-                        if (d7 == (d0 & 0xfff)) {
-                            d0 = ((d0 << 1) & 0xe000) | d4;
-                            list9ptr[1] = d0;
-                            list9ptr[0] = d0 >> 8;
-                            list9ptr += 2;
-                            if (list9ptr >= list9startptr + 0x20) return;
+                        d7 = d0 & 0xfff;
+                        if (count[d7] < MSGEQUIVMAX) {
+                            if (out)
+                                out[vm->msgequivstart[d7] + count[d7]] =
+                                    ((d0 << 1) & 0xe000) | d4;
+                            count[d7]++;
                         }
                     }
                 }
@@ -2223,21 +3453,53 @@ void findmsgequiv(int d7)
     } while (TRUE);
 }
 
+void buildmsgequiv(void)
+{
+    L9UINT32 count[MSGEQUIVCODES];
+    int i;
+
+    freemsgequiv();
+    memset(count, 0, sizeof(count));
+    scanmsgequiv(count, NULL);
+    for (i = 0; i < MSGEQUIVCODES; i++)
+        vm->msgequivstart[i + 1] = vm->msgequivstart[i] + count[i];
+    vm->msgequiv = malloc(sizeof(L9UINT16) * (vm->msgequivstart[MSGEQUIVCODES] + 1));
+    if (vm->msgequiv == NULL) {
+        fprintf(stderr, "Unable to allocate memory for the game! Exiting...\n");
+        exit(0);
+    }
+    memset(count, 0, sizeof(count));
+    scanmsgequiv(count, vm->msgequiv);
+}
+
+void findmsgequiv(int d7)
+{
+    L9UINT32 i;
+
+    if (vm->msgequiv == NULL || d7 < 0 || d7 >= MSGEQUIVCODES) return;
+    for (i = vm->msgequivstart[d7]; i < vm->msgequivstart[d7 + 1]; i++) {
+        vm->list9ptr[1] = (L9BYTE)vm->msgequiv[i];
+        vm->list9ptr[0] = vm->msgequiv[i] >> 8;
+        vm->list9ptr += 2;
+        if (vm->list9ptr >= vm->list9startptr + 0x20) return;
+    }
+}
+
 L9BOOL unpackword(void)
 {
     L9BYTE* a3;
 
-    if (unpackd3 == 0x1b) return TRUE;
+    if (vm->unpackd3 == 0x1b) return TRUE;
 
-    a3 = (L9BYTE*)threechars + (unpackd3 & 3);
+    a3 = (L9BYTE*)vm->threechars + (vm->unpackd3 & 3);
 
     /*uw01 */
     while (TRUE) {
         L9BYTE d0 = getdictionarycode();
-        if (dictptr >= endwdp5) return TRUE;
+        if (vm->dictptr >= vm->endwdp5) return TRUE;
         if (d0 >= 0x1b) {
             *a3 = 0;
-            unpackd3 = d0;
+            vm->unpackd3 = d0;
             return FALSE;
         }
         *a3++ = getdictionary(d0);
@@ -2247,7 +3509,7 @@ L9BOOL unpackword(void)
 L9BOOL initunpack(L9BYTE* ptr)
 {
     initdict(ptr);
-    unpackd3 = 0x1c;
+    vm->unpackd3 = 0x1c;
     return unpackword();
 }
 
@@ -2270,117 +3532,164 @@ L9UINT32 readdecimal(char* buff)
 
 void checknumber(void)
 {
-    if (*obuff >= 0x30 && *obuff < 0x3a) {
-        if (L9GameType == L9_V4) {
-            *list9ptr = 1;
-            L9SETWORD(list9ptr + 1, readdecimal(obuff));
-            L9SETWORD(list9ptr + 3, 0);
+    if (*vm->obuff >= 0x30 && *vm->obuff < 0x3a) {
+        if (vm->L9GameType == L9_V4) {
+            *vm->list9ptr = 1;
+            L9SETWORD(vm->list9ptr + 1, readdecimal(vm->obuff));
+            L9SETWORD(vm->list9ptr + 3, 0);
         } else {
-            L9SETDWORD(list9ptr, readdecimal(obuff));
-            L9SETWORD(list9ptr + 4, 0);
+            L9SETDWORD(vm->list9ptr, readdecimal(vm->obuff));
+            L9SETWORD(vm->list9ptr + 4, 0);
         }
     } else {
-        L9SETWORD(list9ptr, 0x8000);
-        L9SETWORD(list9ptr + 2, 0);
+        L9SETWORD(vm->list9ptr, 0x8000);
+        L9SETWORD(vm->list9ptr + 2, 0);
     }
 }
 
 void NextCheat(void)
 {
     /* restore game status */
-    memmove(&workspace, &CheatWorkspace, sizeof(GameState));
-    codeptr = acodeptr + workspace.codeptr;
+    memmove(&vm->workspace, &vm->CheatWorkspace, sizeof(GameState));
+    vm->codeptr = vm->acodeptr + vm->workspace.codeptr;
 
-    if (!((L9GameType <= L9_V2) ? GetWordV2(ibuff, CheatWord++)
-                                : GetWordV3(ibuff, CheatWord++))) {
-        Cheating = FALSE;
+    if (!((vm->L9GameType <= L9_V2) ? GetWordV2(vm->ibuff, vm->CheatWord++)
+                                : GetWordV3(vm->ibuff, vm->CheatWord++))) {
+        vm->Cheating = FALSE;
         printstring("\rCheat failed.\r");
-        *ibuff = 0;
+        *vm->ibuff = 0;
     }
 }
 
 void StartCheat(void)
 {
-    Cheating = TRUE;
-    CheatWord = 0;
+    vm->Cheating = TRUE;
+    vm->CheatWord = 0;
 
     /* save current game status */
-    memmove(&CheatWorkspace, &workspace, sizeof(GameState));
-    CheatWorkspace.codeptr = codeptr - acodeptr;
+    memmove(&vm->CheatWorkspace, &vm->workspace, sizeof(GameState));
+    vm->CheatWorkspace.codeptr = vm->codeptr - vm->acodeptr;
 
     NextCheat();
 }
 
 /* v3,4 input routine */
 
+/* Listing the words in order, as #dictionary and #cheat do, carries on
+   from the word before instead of unpacking from the start every time */
 L9BOOL GetWordV3(char* buff, int Word)
 {
+    WordCursor* c = &vm->wordcursor;
     int i;
     int subdict = 0;
+    int next = Word + 1;
     /* 26*4-1=103 */
 
-    initunpack(startdata + L9WORD(dictdata));
-    unpackword();
+    if (Word > 0 && c->next == Word) {
+        vm->dictptr = c->dictptr;
+        vm->unpackcount = c->unpackcount;
+        vm->unpackd3 = c->unpackd3;
+        memcpy(vm->unpackbuf, c->unpackbuf, sizeof(vm->unpackbuf));
+        memcpy(vm->threechars, c->threechars, sizeof(vm->threechars));
+        subdict = c->subdict;
+        Word = 1;
+    } else {
+        initunpack(vm->startdata + L9WORD(vm->dictdata));
+        unpackword();
+    }
+    c->next = 0;
 
     while (Word--) {
         if (unpackword()) {
-            if (++subdict == dictdatalen) return FALSE;
-            initunpack(startdata + L9WORD(dictdata + (subdict << 2)));
+            if (++subdict == vm->dictdatalen) return FALSE;
+            initunpack(vm->startdata + L9WORD(vm->dictdata + (subdict << 2)));
             Word++; /* force unpack again */
         }
     }
-    strcpy(buff, threechars);
+    c->next = next;
+    c->subdict = subdict;
+    c->dictptr = vm->dictptr;
+    c->unpackcount = vm->unpackcount;
+    c->unpackd3 = vm->unpackd3;
+    memcpy(c->unpackbuf, vm->unpackbuf, sizeof(c->unpackbuf));
+    memcpy(c->threechars, vm->threechars, sizeof(c->threechars));
+    strcpy(buff, vm->threechars);
     for (i = 0; i < (int)strlen(buff); i++)
         buff[i] &= 0x7f;
     return TRUE;
 }
 
+L9BOOL GetDictionaryWord(int Word, char* buff, int size)
+{
+    char word[IBUFFSIZE];
+
+    if (size <= 0 || !((vm->L9GameType <= L9_V2) ? GetWordV2(word, Word)
+                                                 : GetWordV3(word, Word)))
+        return FALSE;
+    strncpy(buff, word, size - 1);
+    buff[size - 1] = 0;
+    return TRUE;
+}
+
 L9BOOL CheckHash(void)
 {
-    if (StrCompare(ibuff, "#cheat") == 0)
+    if (StrCompare(vm->ibuff, "#cheat") == 0)
         StartCheat();
-    else if (StrCompare(ibuff, "#save") == 0) {
+    else if (StrCompare(vm->ibuff, "#save") == 0) {
         save();
         return TRUE;
-    } else if (StrCompare(ibuff, "#restore") == 0) {
+    } else if (StrCompare(vm->ibuff, "#restore") == 0) {
         restore();
         return TRUE;
-    } else if (StrCompare(ibuff, "#quit") == 0) {
+    } else if (StrCompare(vm->ibuff, "#quit") == 0) {
         StopGame();
         printstring("\rGame Terminated\r");
         return TRUE;
-    } else if (StrCompare(ibuff, "#dictionary") == 0) {
-        CheatWord = 0;
+    } else if (StrCompare(vm->ibuff, "#dictionary") == 0) {
+        vm->CheatWord = 0;
         printstring("\r");
-        while ((L9GameType <= L9_V2) ? GetWordV2(ibuff, CheatWord++)
-                                     : GetWordV3(ibuff, CheatWord++)) {
-            error("%s ", ibuff);
-            if (os_stoplist() || !Running) break;
+        while ((vm->L9GameType <= L9_V2) ? GetWordV2(vm->ibuff, vm->CheatWord++)
+                                     : GetWordV3(vm->ibuff, vm->CheatWord++)) {
+            error("%s ", vm->ibuff);
+            if (os_stoplist() || !vm->Running) break;
         }
         printstring("\r");
         return TRUE;
-    } else if (StrCompareN(ibuff, "#picture ", 9) == 0) {
+    } else if (StrCompareN(vm->ibuff, "#picture ", 9) == 0) {
         int pic = 0;
-        if (sscanf(ibuff + 9, "%d", &pic) == 1) {
-            if (L9GameType == L9_V4)
+        if (sscanf(vm->ibuff + 9, "%d", &pic) == 1) {
+            if (vm->L9GameType == L9_V4)
                 os_show_bitmap(pic, 0, 0);
             else
                 show_picture(pic);
         }
 
-        lastactualchar = 0;
+        vm->lastactualchar = 0;
         printchar('\r');
         return TRUE;
-    } else if (StrCompareN(ibuff, "#seed ", 6) == 0) {
+    } else if (StrCompareN(vm->ibuff, "#seed ", 6) == 0) {
         int seed = 0;
-        if (sscanf(ibuff + 6, "%d", &seed) == 1) randomseed = constseed = seed;
-        lastactualchar = 0;
+        if (sscanf(vm->ibuff + 6, "%d", &seed) == 1) vm->randomseed = vm->constseed = seed;
+        vm->lastactualchar = 0;
         printchar('\r');
         return TRUE;
-    } else if (StrCompare(ibuff, "#play") == 0) {
+    } else if (StrCompare(vm->ibuff, "#undo") == 0 || StrCompareN(vm->ibuff, "#undo ", 6) == 0) {
+        int n = 1;
+        char msg[64];
+        if (vm->ibuff[5] && sscanf(vm->ibuff + 6, "%d", &n) != 1) n = 0;
+        if (!undoturns(n))
+            printstring("\r[You can't \"undo\" what hasn't been done!]\r");
+        else if (n == 1)
+            printstring("\r[Previous turn undone.]\r");
+        else {
+            sprintf(msg, "\r[%d turns undone.]\r", n);
+            printstring(msg);
+        }
+        return TRUE;
+    } else if (StrCompare(vm->ibuff, "#play") == 0) {
         playback();
         return TRUE;
-    } else if (StrCompare(ibuff, "#bitmap")) {
+    } else if (StrCompare(vm->ibuff, "#bitmap")) {
 
     }
     return FALSE;
@@ -2389,60 +3698,61 @@ L9BOOL CheckHash(void)
 L9BOOL IsInputChar(char c)
 {
     if (c == '-' || c == '\'') return TRUE;
-    if ((L9GameType >= L9_V3) && (c == '.' || c == ',')) return TRUE;
+    if ((vm->L9GameType >= L9_V3) && (c == '.' || c == ',')) return TRUE;
     return isalnum(c);
 }
 
 L9BOOL corruptinginput(void)
 {
     L9BYTE *a0, *a2, *a6;
-    int d0, d1, d2, keywordnumber, abrevword;
+    int d0, d1, d2, keywordnumber, abrevword, scan;
     char* iptr;
 
-    list9ptr = list9startptr;
+    vm->list9ptr = vm->list9startptr;
 
-    if (ibuffptr == NULL) {
-        if (Cheating)
+    if (vm->ibuffptr == NULL) {
+        if (vm->Cheating)
             NextCheat();
         else {
             /* flush */
             os_flush();
-            lastchar = lastactualchar = '.';
+            vm->lastchar = vm->lastactualchar = '.';
             /* get input */
-            if (!scriptinput(ibuff, IBUFFSIZE)) {
-                if (!os_input(ibuff, IBUFFSIZE))
+            if (!scriptinput(vm->ibuff, IBUFFSIZE)) {
+                if (!os_input(vm->ibuff, IBUFFSIZE))
                     return FALSE; /* fall through */
             }
             if (CheckHash()) return FALSE;
+            recordturn();
 
             /* check for invalid chars */
-            for (iptr = ibuff; *iptr != 0; iptr++) {
+            for (iptr = vm->ibuff; *iptr != 0; iptr++) {
                 if (!IsInputChar(*iptr)) *iptr = ' ';
             }
 
             /* force CR but prevent others */
-            os_printchar(lastactualchar = '\r');
+            os_printchar(vm->lastactualchar = '\r');
         }
-        ibuffptr = (L9BYTE*)ibuff;
+        vm->ibuffptr = (L9BYTE*)vm->ibuff;
     }
 
-    a2 = (L9BYTE*)obuff;
-    a6 = ibuffptr;
+    a2 = (L9BYTE*)vm->obuff;
+    a6 = vm->ibuffptr;
 
     /*ip05 */
     while (TRUE) {
         d0 = *a6++;
         if (d0 == 0) {
-            ibuffptr = NULL;
-            L9SETWORD(list9ptr, 0);
+            vm->ibuffptr = NULL;
+            L9SETWORD(vm->list9ptr, 0);
             return TRUE;
         }
         if (partword((char)d0) == 0) break;
         if (d0 != 0x20) {
-            ibuffptr = a6;
-            L9SETWORD(list9ptr, 0);
-            L9SETWORD(list9ptr + 2, 0);
-            list9ptr[1] = d0;
+            vm->ibuffptr = a6;
+            L9SETWORD(vm->list9ptr, 0);
+            L9SETWORD(vm->list9ptr + 2, 0);
+            vm->list9ptr[1] = d0;
             *a2 = 0x20;
             keywordnumber = -1;
             return TRUE;
@@ -2456,27 +3766,28 @@ L9BOOL corruptinginput(void)
         if (partword((char)d0) == 1) break;
         d0 = tolower(d0);
         *a2++ = d0;
-    } while (a2 < (L9BYTE*)obuff + 0x1f);
+    } while (a2 < (L9BYTE*)vm->obuff + 0x1f);
     /*ip06a */
     *a2 = 0x20;
     a6--;
-    ibuffptr = a6;
+    vm->ibuffptr = a6;
     abrevword = -1;
     keywordnumber = -1;
-    list9ptr = list9startptr;
+    vm->list9ptr = vm->list9startptr;
     /* setindex */
-    a0 = dictdata;
-    d2 = dictdatalen;
-    d0 = *obuff - 0x61;
+    a0 = vm->dictdata;
+    d2 = vm->dictdatalen;
+    d0 = *vm->obuff - 0x61;
     if (d0 < 0) {
-        a6 = defdict;
+        a6 = vm->defdict;
         d1 = 0;
+        scan = vm->dictindex ? vm->dictindex->subscan[0] : -1;
     } else {
         /*ip10 */
         d1 = 0x67;
         if (d0 < 0x1a) {
             d1 = d0 << 2;
-            d0 = obuff[1];
+            d0 = vm->obuff[1];
             if (d0 != 0x20) d1 += ((d0 - 0x61) >> 3) & 3;
         }
         /*ip13 */
@@ -2484,11 +3795,13 @@ L9BOOL corruptinginput(void)
             checknumber();
             return TRUE;
         }
+        scan = vm->dictindex ? vm->dictindex->subscan[d1 + 1] : -1;
         a0 += d1 << 2;
-        a6 = startdata + L9WORD(a0);
+        a6 = vm->startdata + L9WORD(a0);
         d1 = L9WORD(a0 + 2);
     }
     /*ip13gotwordnumber */
+    if (scan >= 0) return matchdictindex(scan);
 
     initunpack(a6);
     /*ip14 */
@@ -2501,10 +3814,10 @@ L9BOOL corruptinginput(void)
             else
                 d0 = abrevword; /* goto ip18b */
         } else {
-            L9BYTE* a1 = (L9BYTE*)threechars;
+            L9BYTE* a1 = (L9BYTE*)vm->threechars;
             int d6 = -1;
 
-            a0 = (L9BYTE*)obuff;
+            a0 = (L9BYTE*)vm->obuff;
             /*ip15 */
             do {
                 d6++;
@@ -2528,95 +3841,455 @@ L9BOOL corruptinginput(void)
                 continue;
             }
         }
-        /*ip18b */
-        findmsgequiv(d1);
+        /*ip18b */
+        findmsgequiv(d1);
+
+        abrevword = -1;
+        if (vm->list9ptr != vm->list9startptr) {
+            L9SETWORD(vm->list9ptr, 0);
+            return TRUE;
+        }
+    } while (TRUE);
+    /* ip22 */
+    checknumber();
+    return TRUE;
+}
+
+/* version 2 stuff hacked from bbc v2 files */
+
+L9BOOL IsDictionaryChar(char c)
+{
+    switch (c) {
+    case '?':
+    case '-':
+    case '\'':
+    case '/':
+        return TRUE;
+    case '!':
+    case '.':
+    case ',':
+        return TRUE;
+    }
+    return isupper(c) || isdigit(c);
+}
+
+L9BOOL GetWordV2(char* buff, int Word)
+{
+    WordCursor* c = &vm->wordcursor;
+    L9BYTE *ptr = vm->dictdata, x;
+    int next = Word + 1;
+
+    /* as in GetWordV3(), carry on after the word before */
+    if (Word > 0 && c->next == Word) {
+        ptr = c->dictptr;
+        Word = 0;
+    }
+    c->next = 0;
+    while (Word--) {
+        do {
+            x = *ptr++;
+        } while (x > 0 && x < 0x7f);
+        if (x == 0) return FALSE; /* no more words */
+        ptr++;
+    }
+    do {
+        x = *ptr++;
+        if (!IsDictionaryChar(x & 0x7f)) return FALSE;
+        *buff++ = x & 0x7f;
+    } while (x > 0 && x < 0x7f);
+    *buff = 0;
+    /* the next word starts after the two bytes of the last character */
+    if (x != 0) {
+        c->dictptr = ptr + 1;
+        c->next = next;
+    }
+    return TRUE;
+}
+
+/*
+    The dictionary index. corruptinginput() unpacks the sub-dictionary of a
+    typed word from its start, comparing each word in turn, and inputV2()
+    walks the whole V1/V2 dictionary the same way. Both only act on the
+    words that start with what was typed, and on the word after a short V3/V4
+    abbreviation, so builddictindex() unpacks every scan once at load and
+    lists its words by each of their prefixes.
+
+    A V3/V4 scan with a word the comparison could run on past the end of is
+    left to corruptinginput(). inputV2() still walks for a typed word that
+    goes on past a shorter dictionary word, where the walk picks up part way
+    into the next one, or that gets as far as a cut word.
+*/
+
+void freedictindex(void)
+{
+    DictIndex* x = vm->dictindex;
+
+    if (x == NULL) return;
+    free(x->words);
+    free(x->keys);
+    free(x->scanfirst);
+    free(x->scanbase);
+    free(x->subscan);
+    free(x->prefixes);
+    free(x->postings);
+    free(x);
+    vm->dictindex = NULL;
+}
+
+void* dictgrow(void* p, int* size, int need, size_t item)
+{
+    if (need > *size) {
+        int grown = *size ? *size : 256;
+        while (grown < need)
+            grown *= 2;
+        if ((p = realloc(p, grown * item)) == NULL) {
+            fprintf(stderr, "Unable to allocate memory for the game! Exiting...\n");
+            exit(0);
+        }
+        *size = grown;
+    }
+    return p;
+}
+
+void adddictword(DictIndex* x, const char* key, int len, int code, int cut)
+{
+    int size = (int)x->keysize;
+    DictWord* w;
+
+    x->words = dictgrow(x->words, &x->wordsize, x->wordcount + 1, sizeof(DictWord));
+    x->keys = dictgrow(x->keys, &size, (int)x->keylen + len, 1);
+    x->keysize = size;
+    w = &x->words[x->wordcount++];
+    w->key = x->keylen;
+    w->len = (L9BYTE)len;
+    w->code = (L9BYTE)code;
+    w->cut = (L9BYTE)cut;
+    memcpy(x->keys + x->keylen, key, len);
+    x->keylen += len;
+}
+
+/* start a scan, whose words follow with adddictword() */
+void adddictscan(DictIndex* x, int base)
+{
+    int size = x->scansize;
+
+    x->scanfirst = dictgrow(x->scanfirst, &size, x->scans + 2, sizeof(int));
+    x->scanbase = dictgrow(x->scanbase, &x->scansize, x->scans + 2, sizeof(int));
+    x->scanfirst[x->scans] = x->wordcount;
+    x->scanbase[x->scans++] = base;
+    x->scanfirst[x->scans] = x->wordcount;
+}
+
+/* the words corruptinginput() unpacks from ptr, base being the number of
+   the first, as a scan; -1 if it has to unpack them itself */
+int unpackdictscan(DictIndex* x, L9BYTE* ptr, int base)
+{
+    char key[sizeof(vm->threechars)];
+    L9UINT32 keylen = x->keylen;
+    int first = x->wordcount, len;
+
+    if (ptr < vm->startdata || ptr >= vm->endwdp5) return -1;
+    adddictscan(x, base);
+    initunpack(ptr);
+    while (!unpackword()) {
+        for (len = 0; len < (int)sizeof(key); len++) {
+            key[len] = tolower(((L9BYTE*)vm->threechars)[len] & 0x7f);
+            if (key[len] == 0) break;
+            /* would match the space after the typed word */
+            if (key[len] == 0x20) len = sizeof(key);
+        }
+        if (len == sizeof(key)) {
+            x->scans--;
+            x->wordcount = first;
+            x->keylen = keylen;
+            return -1;
+        }
+        adddictword(x, key, len, 0, FALSE);
+    }
+    x->scanfirst[x->scans] = x->wordcount;
+    return x->scans - 1;
+}
+
+/* the V1/V2 dictionary as inputV2() walks it, up to the first word that
+   doesn't start with a dictionary character, which stops the walk. FALSE
+   if skipping a word could stop the walk too, or run past the game data */
+L9BOOL walkdictV2(DictIndex* x)
+{
+    L9BYTE *p = vm->dictdata, *end = vm->startdata + vm->FileSize, c;
+    char key[DICTWORDMAX];
+    int len, cut;
+
+    if (p < vm->startfile || p >= end) return FALSE;
+    adddictscan(x, 0);
+    while (p < end && IsDictionaryChar(*p & 0x7f)) {
+        len = 0;
+        cut = -1;
+        do {
+            if (p == end || len == DICTWORDMAX || (c = *p++) == 0) return FALSE;
+            if (cut < 0 && !IsDictionaryChar(c & 0x7f)) cut = len;
+            key[len++] = tolower(c & 0x7f);
+        } while (c < 0x7f);
+        if (p == end) return FALSE;
+        adddictword(x, key, cut < 0 ? len : cut, *p++, cut >= 0);
+    }
+    x->scanfirst[x->scans] = x->wordcount;
+    return p < end;
+}
+
+L9UINT32 hashdictprefix(int scan, const char* p, int len)
+{
+    L9UINT32 h = 2166136261u ^ (L9UINT32)scan;
+    while (len--)
+        h = (h ^ (L9BYTE)*p++) * 16777619u;
+    return h;
+}
+
+/* the words in scan starting with the len characters at p, NULL if none */
+DictPrefix* finddictprefix(DictIndex* x, int scan, const char* p, int len)
+{
+    L9UINT32 i = hashdictprefix(scan, p, len) & x->mask;
+
+    for (; x->prefixes[i].len; i = (i + 1) & x->mask) {
+        DictPrefix* d = &x->prefixes[i];
+        if (d->scan == scan && d->len == len &&
+            memcmp(x->keys + x->words[d->word].key, p, len) == 0)
+            return d;
+    }
+    return NULL;
+}
+
+/* count the prefixes of the words when fill is FALSE, list the words by
+   them when it is TRUE */
+void indexdictprefixes(DictIndex* x, L9BOOL fill)
+{
+    int s, w, len;
+
+    for (s = 0; s < x->scans; s++) {
+        for (w = x->scanfirst[s]; w < x->scanfirst[s + 1]; w++) {
+            const char* key = x->keys + x->words[w].key;
+            for (len = 1; len <= x->words[w].len; len++) {
+                DictPrefix* d = finddictprefix(x, s, key, len);
+                if (d == NULL) {
+                    L9UINT32 i = hashdictprefix(s, key, len) & x->mask;
+                    while (x->prefixes[i].len)
+                        i = (i + 1) & x->mask;
+                    d = &x->prefixes[i];
+                    d->scan = s;
+                    d->len = len;
+                    d->word = w;
+                }
+                if (fill) x->postings[d->first + d->count] = w;
+                d->count++;
+            }
+        }
+    }
+}
+
+void builddictindex(void)
+{
+    DictIndex* x;
+    L9UINT32 total = 0, size = 1, i;
+    int s, t;
+
+    freedictindex();
+    if ((x = calloc(1, sizeof(DictIndex))) == NULL) {
+        fprintf(stderr, "Unable to allocate memory for the game! Exiting...\n");
+        exit(0);
+    }
+    vm->dictindex = x;
+
+    if (vm->L9GameType >= L9_V3) {
+        L9BYTE* end = vm->startdata + vm->FileSize;
+        if (vm->endwdp5 + 5 > end || vm->dictdata + 4 * vm->dictdatalen > end) {
+            freedictindex();
+            return;
+        }
+        x->subscan = malloc((vm->dictdatalen + 1) * sizeof(int));
+        if (x->subscan == NULL) {
+            fprintf(stderr, "Unable to allocate memory for the game! Exiting...\n");
+            exit(0);
+        }
+        x->subscan[0] = unpackdictscan(x, vm->defdict, 0);
+        for (s = 0; s < vm->dictdatalen; s++) {
+            L9BYTE* a0 = vm->dictdata + (s << 2);
+            L9BYTE* ptr = vm->startdata + L9WORD(a0);
+            int base = L9WORD(a0 + 2);
+
+            /* sub-dictionaries often share their words */
+            for (t = s - 1; t >= 0; t--) {
+                L9BYTE* b0 = vm->dictdata + (t << 2);
+                if (L9WORD(b0) == L9WORD(a0) && L9WORD(b0 + 2) == base) break;
+            }
+            x->subscan[s + 1] = t >= 0 ? x->subscan[t + 1] : unpackdictscan(x, ptr, base);
+        }
+    } else if (!walkdictV2(x)) {
+        freedictindex();
+        return;
+    }
+
+    for (i = 0; i < (L9UINT32)x->wordcount; i++)
+        total += x->words[i].len;
+    while (size < 2 * total + 2)
+        size *= 2;
+    x->mask = size - 1;
+    x->prefixes = calloc(size, sizeof(DictPrefix));
+    x->postings = malloc((total + 1) * sizeof(L9UINT32));
+    if (x->prefixes == NULL || x->postings == NULL) {
+        fprintf(stderr, "Unable to allocate memory for the game! Exiting...\n");
+        exit(0);
+    }
+    indexdictprefixes(x, FALSE);
+    for (i = 0, total = 0; i < size; i++) {
+        x->prefixes[i].first = total;
+        total += x->prefixes[i].count;
+        x->prefixes[i].count = 0;
+    }
+    indexdictprefixes(x, TRUE);
+}
+
+/* ip18b: the list9 entries of word d1, TRUE if it has any */
+L9BOOL dictindexfound(int d1)
+{
+    findmsgequiv(d1);
+    if (vm->list9ptr == vm->list9startptr) return FALSE;
+    L9SETWORD(vm->list9ptr, 0);
+    return TRUE;
+}
+
+/* corruptinginput() from ip13gotwordnumber on, for the word in obuff */
+L9BOOL matchdictindex(int scan)
+{
+    DictIndex* x = vm->dictindex;
+    int first = x->scanfirst[scan], count = x->scanfirst[scan + 1] - first;
+    int base = x->scanbase[scan], len = 0, at = 0, w;
+    L9UINT32 k;
+    DictPrefix* d;
+
+    while (vm->obuff[len] != 0x20)
+        len++;
+    d = finddictprefix(x, scan, vm->obuff, len);
+    for (k = 0; d && k < d->count; k++) {
+        DictWord* next;
+
+        w = x->postings[d->first + k] - first;
+        if (w < at) continue;
+        if (x->words[first + w].len == len || len >= 4) {
+            if (dictindexfound(base + w)) return TRUE;
+            at = w + 1;
+            continue;
+        }
 
-        abrevword = -1;
-        if (list9ptr != list9startptr) {
-            L9SETWORD(list9ptr, 0);
-            return TRUE;
+        /* an abbreviation, unless the next word is another one */
+        if (w + 1 == count) {
+            if (dictindexfound(base + count)) return TRUE;
+            break;
         }
-    } while (TRUE);
+        next = &x->words[first + w + 1];
+        if (next->len > len && memcmp(x->keys + next->key, vm->obuff, len) == 0)
+            break;
+        if (dictindexfound(base + w + 1)) return TRUE;
+        at = w + 2;
+    }
     /* ip22 */
     checknumber();
     return TRUE;
 }
 
-/* version 2 stuff hacked from bbc v2 files */
-
-L9BOOL IsDictionaryChar(char c)
+/* inputV2()'s dictionary walk for the word at ptr, which ends with a space:
+   its code, or -1 if it isn't in the dictionary */
+int walkwordV2(L9BYTE* ptr)
 {
-    switch (c) {
-    case '?':
-    case '-':
-    case '\'':
-    case '/':
-        return TRUE;
-    case '!':
-    case '.':
-    case ',':
-        return TRUE;
+    L9BYTE *ibuffptr = ptr, *list0ptr = vm->dictdata, a, x;
+
+    while (TRUE) {
+        a = *ibuffptr;
+        x = *list0ptr++;
+
+        if (a == 32) break;
+
+        ++ibuffptr;
+        if (!IsDictionaryChar(x & 0x7f)) x = 0;
+        if (tolower(x & 0x7f) != tolower(a)) {
+            while (x > 0 && x < 0x7f)
+                x = *list0ptr++;
+            if (x == 0) return -1;
+            list0ptr++;
+            ibuffptr = ptr;
+        } else if (x >= 0x7f) {
+            if (*ibuffptr == 32) break;
+            ibuffptr = ptr;
+            list0ptr += 2;
+        }
     }
-    return isupper(c) || isdigit(c);
+    --list0ptr;
+    while (*list0ptr++ < 0x7e)
+        ;
+    return *list0ptr;
 }
 
-L9BOOL GetWordV2(char* buff, int Word)
+/* walkwordV2() from the index: the first word the typed one starts. The
+   walk is left to a shorter word it starts with that comes first, and to a
+   cut word it gets as far as the end of. */
+int matchwordV2(L9BYTE* ptr)
 {
-    L9BYTE *ptr = dictdata, x;
+    DictIndex* x = vm->dictindex;
+    char key[DICTWORDMAX];
+    int len, prefix, hit;
+    DictPrefix* d;
+    L9UINT32 k;
 
-    while (Word--) {
-        do {
-            x = *ptr++;
-        } while (x > 0 && x < 0x7f);
-        if (x == 0) return FALSE; /* no more words */
-        ptr++;
+    for (len = 0; ptr[len] != 32; len++) {
+        if (len == DICTWORDMAX) return walkwordV2(ptr);
+        key[len] = tolower(ptr[len]);
     }
-    do {
-        x = *ptr++;
-        if (!IsDictionaryChar(x & 0x7f)) return FALSE;
-        *buff++ = x & 0x7f;
-    } while (x > 0 && x < 0x7f);
-    *buff = 0;
-    return TRUE;
+    d = finddictprefix(x, 0, key, len);
+    hit = d ? (int)x->postings[d->first] : x->wordcount;
+    if (hit < x->wordcount && x->words[hit].cut) return walkwordV2(ptr);
+    for (prefix = 1; prefix < len; prefix++) {
+        if ((d = finddictprefix(x, 0, key, prefix)) == NULL) break;
+        for (k = 0; k < d->count && (int)x->postings[d->first + k] < hit; k++)
+            if (x->words[x->postings[d->first + k]].len == prefix)
+                return walkwordV2(ptr);
+    }
+    return hit < x->wordcount ? x->words[hit].code : -1;
 }
 
 L9BOOL inputV2(int* wordcount)
 {
-    L9BYTE a, x;
-    L9BYTE *ibuffptr, *obuffptr, *ptr, *list0ptr;
+    L9BYTE a;
+    L9BYTE *ibuffptr, *obuffptr, *ptr;
     char* iptr;
 
-    if (Cheating)
+    if (vm->Cheating)
         NextCheat();
     else {
         os_flush();
-        lastchar = lastactualchar = '.';
+        vm->lastchar = vm->lastactualchar = '.';
         /* get input */
-        if (!scriptinput(ibuff, IBUFFSIZE)) {
-            if (!os_input(ibuff, IBUFFSIZE)) return FALSE; /* fall through */
+        if (!scriptinput(vm->ibuff, IBUFFSIZE)) {
+            if (!os_input(vm->ibuff, IBUFFSIZE)) return FALSE; /* fall through */
         }
         if (CheckHash()) return FALSE;
+        recordturn();
 
         /* check for invalid chars */
-        for (iptr = ibuff; *iptr != 0; iptr++) {
+        for (iptr = vm->ibuff; *iptr != 0; iptr++) {
             if (!IsInputChar(*iptr)) *iptr = ' ';
         }
 
         /* force CR but prevent others */
-        os_printchar(lastactualchar = '\r');
+        os_printchar(vm->lastactualchar = '\r');
     }
     /* add space onto end */
-    ibuffptr = (L9BYTE*)strchr(ibuff, 0);
+    ibuffptr = (L9BYTE*)strchr(vm->ibuff, 0);
     *ibuffptr++ = 32;
     *ibuffptr = 0;
 
     *wordcount = 0;
-    ibuffptr = (L9BYTE*)ibuff;
-    obuffptr = (L9BYTE*)obuff;
+    ibuffptr = (L9BYTE*)vm->ibuff;
+    obuffptr = (L9BYTE*)vm->obuff;
     /* ibuffptr=76,77 */
     /* obuffptr=84,85 */
-    /* list0ptr=7c,7d */
-    list0ptr = dictdata;
 
     while (*ibuffptr == 32)
         ++ibuffptr;
@@ -2633,85 +4306,51 @@ L9BOOL inputV2(int* wordcount)
     } while (*ptr > 0);
 
     while (TRUE) {
-        ptr = ibuffptr; /* 7a,7b */
-        while (*ibuffptr == 32)
-            ++ibuffptr;
-
-        while (TRUE) {
-            a = *ibuffptr;
-            x = *list0ptr++;
-
-            if (a == 32) break;
-            if (a == 0) {
-                *obuffptr++ = 0;
-                return TRUE;
-            }
+        int code;
 
+        while (*ibuffptr == 32)
             ++ibuffptr;
-            if (!IsDictionaryChar(x & 0x7f)) x = 0;
-            if (tolower(x & 0x7f) != tolower(a)) {
-                while (x > 0 && x < 0x7f)
-                    x = *list0ptr++;
-                if (x == 0) {
-                    do {
-                        a = *ibuffptr++;
-                        if (a == 0) {
-                            *obuffptr = 0;
-                            return TRUE;
-                        }
-                    } while (a != 32);
-                    while (*ibuffptr == 32)
-                        ++ibuffptr;
-                    list0ptr = dictdata;
-                    ptr = ibuffptr;
-                } else {
-                    list0ptr++;
-                    ibuffptr = ptr;
-                }
-            } else if (x >= 0x7f)
-                break;
-        }
-
-        a = *ibuffptr;
-        if (a != 32) {
-            ibuffptr = ptr;
-            list0ptr += 2;
-            continue;
+        if (*ibuffptr == 0) {
+            *obuffptr++ = 0;
+            return TRUE;
         }
-        --list0ptr;
-        while (*list0ptr++ < 0x7e)
-            ;
-        *obuffptr++ = *list0ptr;
-        while (*ibuffptr == 32)
+        code = vm->dictindex ? matchwordV2(ibuffptr) : walkwordV2(ibuffptr);
+        if (code >= 0) *obuffptr++ = code;
+        while (*ibuffptr != 32)
             ++ibuffptr;
-        list0ptr = dictdata;
     }
 }
 
 void input(void)
 {
-    if (L9GameType == L9_V3 && FirstPicture >= 0) {
-        show_picture(FirstPicture);
-        FirstPicture = -1;
+    if (vm->L9GameType == L9_V3 && vm->FirstPicture >= 0) {
+        show_picture(vm->FirstPicture);
+        vm->FirstPicture = -1;
     }
 
     /* if corruptinginput() returns false then, input will be called again
        next time around instructionloop, this is used when save() and restore()
        are called out of line */
 
-    codeptr--;
-    if (L9GameType <= L9_V2) {
+    /* what states are compressed against, see getbasestate() */
+    if (vm->basestate == NULL) getbasestate();
+
+    vm->codeptr--;
+    if (vm->L9GameType <= L9_V2) {
         int wordcount;
         if (inputV2(&wordcount)) {
-            L9BYTE* obuffptr = (L9BYTE*)obuff;
-            codeptr++;
+            L9BYTE* obuffptr = (L9BYTE*)vm->obuff;
+            vm->codeptr++;
             *getvar() = *obuffptr++;
             *getvar() = *obuffptr++;
             *getvar() = *obuffptr;
             *getvar() = wordcount;
-        }
+        } else
+            L9Yield(L9_SLICE_INPUT);
     } else if (corruptinginput())
-        codeptr += 5;
+        vm->codeptr += 5;
+    else
+        L9Yield(L9_SLICE_INPUT);
 }
 
 void varcon(void)
@@ -2720,7 +4359,7 @@ void varcon(void)
     *getvar() = d6;
 
 #ifdef CODEFOLLOW
-    fprintf(f, " Var[%d]=%d)", cfvar - workspace.vartable, *cfvar);
+    fprintf(f, " Var[%d]=%d)", cfvar - vm->workspace.vartable, *cfvar);
 #endif
 }
 
@@ -2730,8 +4369,8 @@ void varvar(void)
     *getvar() = d6;
 
 #ifdef CODEFOLLOW
-    fprintf(f, " Var[%d]=Var[%d] (=%d)", cfvar - workspace.vartable,
-            cfvar2 - workspace.vartable, d6);
+    fprintf(f, " Var[%d]=Var[%d] (=%d)", cfvar - vm->workspace.vartable,
+            cfvar2 - vm->workspace.vartable, d6);
 #endif
 }
 
@@ -2741,8 +4380,8 @@ void _add(void)
     *getvar() += d0;
 
 #ifdef CODEFOLLOW
-    fprintf(f, " Var[%d]+=Var[%d] (+=%d)", cfvar - workspace.vartable,
-            cfvar2 - workspace.vartable, d0);
+    fprintf(f, " Var[%d]+=Var[%d] (+=%d)", cfvar - vm->workspace.vartable,
+            cfvar2 - vm->workspace.vartable, d0);
 #endif
 }
 
@@ -2752,30 +4391,30 @@ void _sub(void)
     *getvar() -= d0;
 
 #ifdef CODEFOLLOW
-    fprintf(f, " Var[%d]-=Var[%d] (-=%d)", cfvar - workspace.vartable,
-            cfvar2 - workspace.vartable, d0);
+    fprintf(f, " Var[%d]-=Var[%d] (-=%d)", cfvar - vm->workspace.vartable,
+            cfvar2 - vm->workspace.vartable, d0);
 #endif
 }
 
 void jump(void)
 {
-    L9UINT16 d0 = L9WORD(codeptr);
+    L9UINT16 d0 = L9WORD(vm->codeptr);
     L9BYTE* a0;
-    codeptr += 2;
+    vm->codeptr += 2;
 
-    a0 = acodeptr + ((d0 + ((*getvar()) << 1)) & 0xffff);
-    codeptr = acodeptr + L9WORD(a0);
+    a0 = vm->acodeptr + ((d0 + ((*getvar()) << 1)) & 0xffff);
+    vm->codeptr = vm->acodeptr + L9WORD(a0);
 }
 
 /* bug */
 void exit1(L9BYTE* d4, L9BYTE* d5, L9BYTE d6, L9BYTE d7)
 {
-    L9BYTE* a0 = absdatablock;
+    L9BYTE* a0 = vm->absdatablock;
     L9BYTE d1 = d7, d0;
     if (--d1) {
         do {
             d0 = *a0;
-            if (L9GameType == L9_V4) {
+            if (vm->L9GameType == L9_V4) {
                 if ((d0 == 0) && (*(a0 + 1) == 0)) goto notfn4;
             }
             a0 += 2;
@@ -2794,7 +4433,7 @@ void exit1(L9BYTE* d4, L9BYTE* d5, L9BYTE d6, L9BYTE d7)
     /* notfn4 */
 notfn4:
     d6 = exitreversaltable[d6];
-    a0 = absdatablock;
+    a0 = vm->absdatablock;
     *d5 = 1;
 
     do {
@@ -2822,8 +4461,8 @@ void Exit(void)
     *getvar() = (d4 & 0x70) >> 4;
     *getvar() = d5;
 #ifdef CODEFOLLOW
-    fprintf(f, " Var[%d]=%d(d4=%d) Var[%d]=%d", cfvar2 - workspace.vartable,
-            (d4 & 0x70) >> 4, d4, cfvar - workspace.vartable, d5);
+    fprintf(f, " Var[%d]=%d(d4=%d) Var[%d]=%d", cfvar2 - vm->workspace.vartable,
+            (d4 & 0x70) >> 4, d4, cfvar - vm->workspace.vartable, d5);
 #endif
 }
 
@@ -2832,11 +4471,11 @@ void ifeqvt(void)
     L9UINT16 d0 = *getvar();
     L9UINT16 d1 = *getvar();
     L9BYTE* a0 = getaddr();
-    if (d0 == d1) codeptr = a0;
+    if (d0 == d1) vm->codeptr = a0;
 
 #ifdef CODEFOLLOW
-    fprintf(f, " if Var[%d]=Var[%d] goto %d (%s)", cfvar2 - workspace.vartable,
-            cfvar - workspace.vartable, (L9UINT32)(a0 - acodeptr),
+    fprintf(f, " if Var[%d]=Var[%d] goto %d (%s)", cfvar2 - vm->workspace.vartable,
+            cfvar - vm->workspace.vartable, (L9UINT32)(a0 - vm->acodeptr),
             d0 == d1 ? "Yes" : "No");
 #endif
 }
@@ -2846,11 +4485,11 @@ void ifnevt(void)
     L9UINT16 d0 = *getvar();
     L9UINT16 d1 = *getvar();
     L9BYTE* a0 = getaddr();
-    if (d0 != d1) codeptr = a0;
+    if (d0 != d1) vm->codeptr = a0;
 
 #ifdef CODEFOLLOW
-    fprintf(f, " if Var[%d]!=Var[%d] goto %d (%s)", cfvar2 - workspace.vartable,
-            cfvar - workspace.vartable, (L9UINT32)(a0 - acodeptr),
+    fprintf(f, " if Var[%d]!=Var[%d] goto %d (%s)", cfvar2 - vm->workspace.vartable,
+            cfvar - vm->workspace.vartable, (L9UINT32)(a0 - vm->acodeptr),
             d0 != d1 ? "Yes" : "No");
 #endif
 }
@@ -2860,11 +4499,11 @@ void ifltvt(void)
     L9UINT16 d0 = *getvar();
     L9UINT16 d1 = *getvar();
     L9BYTE* a0 = getaddr();
-    if (d0 < d1) codeptr = a0;
+    if (d0 < d1) vm->codeptr = a0;
 
 #ifdef CODEFOLLOW
-    fprintf(f, " if Var[%d]<Var[%d] goto %d (%s)", cfvar2 - workspace.vartable,
-            cfvar - workspace.vartable, (L9UINT32)(a0 - acodeptr),
+    fprintf(f, " if Var[%d]<Var[%d] goto %d (%s)", cfvar2 - vm->workspace.vartable,
+            cfvar - vm->workspace.vartable, (L9UINT32)(a0 - vm->acodeptr),
             d0 < d1 ? "Yes" : "No");
 #endif
 }
@@ -2874,93 +4513,93 @@ void ifgtvt(void)
     L9UINT16 d0 = *getvar();
     L9UINT16 d1 = *getvar();
     L9BYTE* a0 = getaddr();
-    if (d0 > d1) codeptr = a0;
+    if (d0 > d1) vm->codeptr = a0;
 
 #ifdef CODEFOLLOW
-    fprintf(f, " if Var[%d]>Var[%d] goto %d (%s)", cfvar2 - workspace.vartable,
-            cfvar - workspace.vartable, (L9UINT32)(a0 - acodeptr),
+    fprintf(f, " if Var[%d]>Var[%d] goto %d (%s)", cfvar2 - vm->workspace.vartable,
+            cfvar - vm->workspace.vartable, (L9UINT32)(a0 - vm->acodeptr),
             d0 > d1 ? "Yes" : "No");
 #endif
 }
 
 int scalex(int x)
 {
-    return (gfx_mode != GFX_V3C) ? (x >> 6) : (x >> 5);
+    return (vm->gfx_mode != GFX_V3C) ? (x >> 6) : (x >> 5);
 }
 
 int scaley(int y)
 {
-    return (gfx_mode == GFX_V2) ? 127 - (y >> 7)
+    return (vm->gfx_mode == GFX_V2) ? 127 - (y >> 7)
                                 : 95 - (((y >> 5) + (y >> 6)) >> 3);
 }
 
 void detect_gfx_mode(void)
 {
-    if (L9GameType == L9_V3) {
+    if (vm->L9GameType == L9_V3) {
         /* These V3 games use graphics logic similar to the V2 games */
-        if (strstr(FirstLine, "price of magik") != 0)
-            gfx_mode = GFX_V3A;
-        else if (strstr(FirstLine, "the archers") != 0)
-            gfx_mode = GFX_V3A;
-        else if (strstr(FirstLine, "secret diary of adrian mole") != 0)
-            gfx_mode = GFX_V3A;
-        else if ((strstr(FirstLine, "worm in paradise") != 0) &&
-                 (strstr(FirstLine, "silicon dreams") == 0))
-            gfx_mode = GFX_V3A;
-        else if (strstr(FirstLine, "growing pains of adrian mole") != 0)
-            gfx_mode = GFX_V3B;
-        else if (strstr(FirstLine, "jewels of darkness") != 0 &&
-                 picturesize < 11000)
-            gfx_mode = GFX_V3B;
-        else if (strstr(FirstLine, "silicon dreams") != 0) {
-            if (picturesize > 11000 ||
-                (startdata[0] == 0x14 &&
-                 startdata[1] == 0x7d) /* Return to Eden /SD (PC) */
-                || (startdata[0] == 0xd7 &&
-                    startdata[1] == 0x7c)) /* Worm in Paradise /SD (PC) */
-                gfx_mode = GFX_V3C;
+        if (strstr(vm->FirstLine, "price of magik") != 0)
+            vm->gfx_mode = GFX_V3A;
+        else if (strstr(vm->FirstLine, "the archers") != 0)
+            vm->gfx_mode = GFX_V3A;
+        else if (strstr(vm->FirstLine, "secret diary of adrian mole") != 0)
+            vm->gfx_mode = GFX_V3A;
+        else if ((strstr(vm->FirstLine, "worm in paradise") != 0) &&
+                 (strstr(vm->FirstLine, "silicon dreams") == 0))
+            vm->gfx_mode = GFX_V3A;
+        else if (strstr(vm->FirstLine, "growing pains of adrian mole") != 0)
+            vm->gfx_mode = GFX_V3B;
+        else if (strstr(vm->FirstLine, "jewels of darkness") != 0 &&
+                 vm->picturesize < 11000)
+            vm->gfx_mode = GFX_V3B;
+        else if (strstr(vm->FirstLine, "silicon dreams") != 0) {
+            if (vm->picturesize > 11000 ||
+                (vm->startdata[0] == 0x14 &&
+                 vm->startdata[1] == 0x7d) /* Return to Eden /SD (PC) */
+                || (vm->startdata[0] == 0xd7 &&
+                    vm->startdata[1] == 0x7c)) /* Worm in Paradise /SD (PC) */
+                vm->gfx_mode = GFX_V3C;
             else
-                gfx_mode = GFX_V3B;
+                vm->gfx_mode = GFX_V3B;
         } else
-            gfx_mode = GFX_V3C;
+            vm->gfx_mode = GFX_V3C;
     } else
-        gfx_mode = GFX_V2;
+        vm->gfx_mode = GFX_V2;
 }
 
 void _screen(void)
 {
     int mode = 0;
 
-    if (L9GameType == L9_V3 && strlen(FirstLine) == 0) {
-        if (*codeptr++) codeptr++;
+    if (vm->L9GameType == L9_V3 && strlen(vm->FirstLine) == 0) {
+        if (*vm->codeptr++) vm->codeptr++;
         return;
     }
 
     detect_gfx_mode();
-    l9textmode = *codeptr++;
-    if (l9textmode) {
-        if (L9GameType == L9_V4)
+    vm->l9textmode = *vm->codeptr++;
+    if (vm->l9textmode) {
+        if (vm->L9GameType == L9_V4)
             mode = 2;
-        else if (picturedata)
+        else if (vm->picturedata)
             mode = 1;
     }
     os_graphics(mode);
 
-    screencalled = 1;
+    vm->screencalled = 1;
 
 #ifdef L9DEBUG
-    printf("screen %s", l9textmode ? "graphics" : "text");
+    printf("screen %s", vm->l9textmode ? "graphics" : "text");
 #endif
 
-    if (l9textmode) {
-        codeptr++;
+    if (vm->l9textmode) {
+        vm->codeptr++;
         /* clearg */
         /* gintclearg */
         os_cleargraphics();
 
         /* title pic */
-        if (showtitle == 1 && mode == 2) {
-            showtitle = 0;
+        if (vm->showtitle == 1 && mode == 2) {
+            vm->showtitle = 0;
             os_show_bitmap(0, 0, 0);
         }
     }
@@ -2969,76 +4608,317 @@ void _screen(void)
 
 void cleartg(void)
 {
-    int d0 = *codeptr++;
+    int d0 = *vm->codeptr++;
 #ifdef L9DEBUG
     printf("cleartg %s", d0 ? "graphics" : "text");
 #endif
 
     if (d0) {
         /* clearg */
-        if (l9textmode) /* gintclearg */
+        if (vm->l9textmode) /* gintclearg */
             os_cleargraphics();
     }
     /* cleart */
     /* oswrch(0x0c) */
 }
 
+/*
+    Display lists, see SetDisplayLists(): the first time a picture is shown
+    its drawing calls are recorded, already scaled, while its program runs.
+    When it is shown again RunGraphics() replays them in one call instead of
+    interpreting the program again. A picture only depends on the picture
+    data and the graphics mode, so the lists can also be kept in a text file,
+    keyed by the size and hash of the picture data like the scan cache.
+*/
+L9BOOL usedisplaylists = FALSE;
+char* displaylistfile = NULL;
+
+void SetDisplayLists(L9BOOL on, char* filename)
+{
+    usedisplaylists = on || filename != NULL;
+    displaylistfile = filename;
+}
+
+void freedisplaylist(DisplayList* list)
+{
+    free(list->prims);
+    memset(list, 0, sizeof(DisplayList));
+}
+
+void freedisplaylists(void)
+{
+    int i;
+
+    if (vm->displaylists) {
+        for (i = 0; i < GFXSUBCOUNT; i++) freedisplaylist(&vm->displaylists[i]);
+        free(vm->displaylists);
+        vm->displaylists = NULL;
+    }
+    freedisplaylist(&vm->recording);
+    vm->recordpic = vm->replaypic = -1;
+    vm->displaylistfileok = FALSE;
+}
+
+/* the list of picture pic, NULL if pictures are not recorded */
+DisplayList* getdisplaylist(int pic)
+{
+    if (!usedisplaylists || !vm->picturedata || pic < 0 || pic >= GFXSUBCOUNT)
+        return NULL;
+    if (vm->displaylists == NULL) {
+        vm->displaylists = calloc(GFXSUBCOUNT, sizeof(DisplayList));
+        if (vm->displaylists == NULL) return NULL;
+    }
+    return &vm->displaylists[pic];
+}
+
+L9BOOL addprim(DisplayList* list, GfxPrim* prim)
+{
+    if (list->count == list->size) {
+        int size = list->size ? list->size * 2 : 64;
+        GfxPrim* p = realloc(list->prims, size * sizeof(GfxPrim));
+        if (p == NULL) return FALSE;
+        list->prims = p;
+        list->size = size;
+    }
+    list->prims[list->count++] = *prim;
+    return TRUE;
+}
+
+void writedisplaylist(FILE* f, int pic, DisplayList* list)
+{
+    GfxPrim* p;
+
+    fprintf(f, "P %d %d %d\n", pic, list->gfxmode, list->count);
+    for (p = list->prims; p < list->prims + list->count; p++) {
+        if (p->op == 'L')
+            fprintf(f, "L %d %d %d %d %d %d\n", p->x1, p->y1, p->x2, p->y2, p->c1, p->c2);
+        else if (p->op == 'F')
+            fprintf(f, "F %d %d %d %d\n", p->x1, p->y1, p->c1, p->c2);
+        else
+            fprintf(f, "C %d %d\n", p->c1, p->c2);
+    }
+}
+
+/* Append the new list of pic to the file, or start the file over with all
+   lists if it holds another game's */
+void savedisplaylist(int pic)
+{
+    FILE* f;
+    int i;
+
+    if (displaylistfile == NULL) return;
+    f = fopen(displaylistfile, vm->displaylistfileok ? "at" : "wt");
+    if (f == NULL) return;
+    if (vm->displaylistfileok)
+        writedisplaylist(f, pic, &vm->displaylists[pic]);
+    else {
+        fprintf(f, "L9DLIST 1 %lu %lu\n", (unsigned long)vm->picturesize,
+                (unsigned long)scanhash(vm->picturedata, vm->picturesize));
+        for (i = 0; i < GFXSUBCOUNT; i++)
+            if (vm->displaylists[i].recorded)
+                writedisplaylist(f, i, &vm->displaylists[i]);
+        vm->displaylistfileok = TRUE;
+    }
+    fclose(f);
+}
+
+/* Read the lists of this game's pictures, up to the first damaged one */
+void loaddisplaylists(void)
+{
+    unsigned long size, hash;
+    DisplayList list, *slot;
+    GfxPrim prim;
+    int pic, n;
+    FILE* f;
+    char op;
+
+    if (displaylistfile == NULL || getdisplaylist(0) == NULL) return;
+    if ((f = fopen(displaylistfile, "rt")) == NULL) return;
+    if (fscanf(f, "L9DLIST 1 %lu %lu", &size, &hash) != 2 ||
+        size != vm->picturesize ||
+        hash != scanhash(vm->picturedata, vm->picturesize)) {
+        fclose(f);
+        return;
+    }
+    vm->displaylistfileok = TRUE;
+    memset(&list, 0, sizeof(list));
+    while (fscanf(f, " P %d %d %d", &pic, &list.gfxmode, &n) == 3 &&
+           (slot = getdisplaylist(pic)) != NULL && n >= 0) {
+        list.count = 0;
+        while (list.count < n) {
+            memset(&prim, 0, sizeof(prim));
+            if (fscanf(f, " %c", &op) != 1) break;
+            prim.op = op;
+            if (op == 'L') {
+                if (fscanf(f, "%d %d %d %d %d %d", &prim.x1, &prim.y1, &prim.x2,
+                           &prim.y2, &prim.c1, &prim.c2) != 6)
+                    break;
+            } else if (op == 'F') {
+                if (fscanf(f, "%d %d %d %d", &prim.x1, &prim.y1, &prim.c1, &prim.c2) != 4)
+                    break;
+            } else if (op != 'C' || fscanf(f, "%d %d", &prim.c1, &prim.c2) != 2)
+                break;
+            if (!addprim(&list, &prim)) break;
+        }
+        if (list.count < n) break;
+        freedisplaylist(slot);
+        *slot = list;
+        slot->recorded = TRUE;
+        memset(&list, 0, sizeof(list));
+    }
+    freedisplaylist(&list);
+    fclose(f);
+}
+
+/* The graphics instructions draw through these, so a recorded picture has
+   every call its program made */
+void recordprim(int op, int x1, int y1, int x2, int y2, int c1, int c2)
+{
+    GfxPrim prim;
+
+    if (vm->recordpic < 0) return;
+    prim.op = op;
+    prim.x1 = x1;
+    prim.y1 = y1;
+    prim.x2 = x2;
+    prim.y2 = y2;
+    prim.c1 = c1;
+    prim.c2 = c2;
+    if (!addprim(&vm->recording, &prim)) vm->recordpic = -1;
+}
+
+void gfxdrawline(int x1, int y1, int x2, int y2, int colour1, int colour2)
+{
+    recordprim('L', x1, y1, x2, y2, colour1, colour2);
+    os_drawline(x1, y1, x2, y2, colour1, colour2);
+}
+
+void gfxfill(int x, int y, int colour1, int colour2)
+{
+    recordprim('F', x, y, 0, 0, colour1, colour2);
+    os_fill(x, y, colour1, colour2);
+}
+
+void gfxsetcolour(int colour, int index)
+{
+    recordprim('C', 0, 0, 0, 0, colour, index);
+    os_setcolour(colour, index);
+}
+
+/* Start recording pic, unless there is a list to replay */
+L9BOOL startdisplaylist(int pic)
+{
+    DisplayList* list = getdisplaylist(pic);
+
+    vm->recordpic = vm->replaypic = -1;
+    vm->recording.count = 0;
+    if (list == NULL) return FALSE;
+    if (list->recorded && list->gfxmode == vm->gfx_mode) {
+        vm->replaypic = pic;
+        return TRUE;
+    }
+    vm->recordpic = pic;
+    return FALSE;
+}
+
+/* The program of the picture being recorded has finished */
+void enddisplaylist(void)
+{
+    DisplayList* list;
+
+    if (vm->recordpic < 0) return;
+    list = &vm->displaylists[vm->recordpic];
+    freedisplaylist(list);
+    *list = vm->recording;
+    list->gfxmode = vm->gfx_mode;
+    list->recorded = TRUE;
+    memset(&vm->recording, 0, sizeof(DisplayList));
+    savedisplaylist(vm->recordpic);
+    vm->recordpic = -1;
+}
+
+void replaydisplaylist(void)
+{
+    DisplayList* list = &vm->displaylists[vm->replaypic];
+    GfxPrim* p;
+
+    vm->replaypic = -1;
+    for (p = list->prims; p < list->prims + list->count; p++) {
+        if (p->op == 'L')
+            os_drawline(p->x1, p->y1, p->x2, p->y2, p->c1, p->c2);
+        else if (p->op == 'F')
+            os_fill(p->x1, p->y1, p->c1, p->c2);
+        else
+            os_setcolour(p->c1, p->c2);
+    }
+}
+
 L9BOOL validgfxptr(L9BYTE* a5)
 {
-    return ((a5 >= picturedata) && (a5 < picturedata + picturesize));
+    return ((a5 >= vm->picturedata) && (a5 < vm->picturedata + vm->picturesize));
 }
 
-L9BOOL findsub(int d0, L9BYTE** a5)
+/*
+    Walk the subroutine headers once (nn | nl | ll, see findsubs()) and
+    remember where the code of each subroutine number starts, so findsub()
+    is a lookup instead of a walk from the start of the picture data. The
+    walk stops where the old findsub() loop gave up, and the first of two
+    subroutines with the same number wins as it did there.
+*/
+void indexgfxsubs(void)
 {
-    int d1, d2, d3, d4;
+    L9BYTE* a5 = vm->picturedata;
+    int d3, d4, n;
 
-    d1 = d0 << 4;
-    d2 = d1 >> 8;
-    *a5 = picturedata;
-    /* findsubloop */
+    memset(vm->gfxsubs, 0, sizeof(vm->gfxsubs));
+    if (a5 == NULL) return;
     while (TRUE) {
-        d3 = *(*a5)++;
-        if (!validgfxptr(*a5)) return FALSE;
-        if (d3 & 0x80) return FALSE;
-        if (d2 == d3) {
-            if ((d1 & 0xff) == (*(*a5) & 0xf0)) {
-                (*a5) += 2;
-                return TRUE;
-            }
-        }
+        d3 = *a5++;
+        if (!validgfxptr(a5)) return;
+        if (d3 & 0x80) return;
+        n = (d3 << 4) | (*a5 >> 4);
+        if (vm->gfxsubs[n] == 0)
+            vm->gfxsubs[n] = (L9UINT32)(a5 + 2 - vm->picturedata) + 1;
 
-        d3 = *(*a5)++ & 0x0f;
-        if (!validgfxptr(*a5)) return FALSE;
+        d3 = *a5++ & 0x0f;
+        if (!validgfxptr(a5)) return;
 
-        d4 = **a5;
-        if ((d3 | d4) == 0) return FALSE;
+        d4 = *a5;
+        if ((d3 | d4) == 0) return;
 
-        (*a5) += (d3 << 8) + d4 - 2;
-        if (!validgfxptr(*a5)) return FALSE;
+        a5 += (d3 << 8) + d4 - 2;
+        if (!validgfxptr(a5)) return;
     }
 }
 
+L9BOOL findsub(int d0, L9BYTE** a5)
+{
+    if (d0 < 0 || d0 >= GFXSUBCOUNT || vm->gfxsubs[d0] == 0) return FALSE;
+    *a5 = vm->picturedata + vm->gfxsubs[d0] - 1;
+    return TRUE;
+}
+
 void gosubd0(int d0, L9BYTE** a5)
 {
-    if (GfxA5StackPos < GFXSTACKSIZE) {
-        GfxA5Stack[GfxA5StackPos] = *a5;
-        GfxA5StackPos++;
-        GfxScaleStack[GfxScaleStackPos] = scale;
-        GfxScaleStackPos++;
+    if (vm->GfxA5StackPos < GFXSTACKSIZE) {
+        vm->GfxA5Stack[vm->GfxA5StackPos] = *a5;
+        vm->GfxA5StackPos++;
+        vm->GfxScaleStack[vm->GfxScaleStackPos] = vm->scale;
+        vm->GfxScaleStackPos++;
 
         if (findsub(d0, a5) == FALSE) {
-            GfxA5StackPos--;
-            *a5 = GfxA5Stack[GfxA5StackPos];
-            GfxScaleStackPos--;
-            scale = GfxScaleStack[GfxScaleStackPos];
+            vm->GfxA5StackPos--;
+            *a5 = vm->GfxA5Stack[vm->GfxA5StackPos];
+            vm->GfxScaleStackPos--;
+            vm->scale = vm->GfxScaleStack[vm->GfxScaleStackPos];
         }
     }
 }
 
 void newxy(int x, int y)
 {
-    drawx += (x * scale) & ~7;
-    drawy += (y * scale) & ~7;
+    vm->drawx += (x * vm->scale) & ~7;
+    vm->drawy += (y * vm->scale) & ~7;
 }
 
 /* sdraw instruction plus arguments are stored in an 8 bit word.
@@ -3058,21 +4938,21 @@ void sdraw(int d7)
     y = (d7 & 0x3) << 2;
     if (d7 & 0x4) y = (y | 0xf0) - 0x100;
 
-    if (reflectflag & 2) x = -x;
-    if (reflectflag & 1) y = -y;
+    if (vm->reflectflag & 2) x = -x;
+    if (vm->reflectflag & 1) y = -y;
 
     /* gintline */
-    x1 = drawx;
-    y1 = drawy;
+    x1 = vm->drawx;
+    y1 = vm->drawy;
     newxy(x, y);
 
 #ifdef L9DEBUG
-    printf("gfx - sdraw (%d,%d) (%d,%d) colours %d,%d", x1, y1, drawx, drawy,
-           gintcolour & 3, option & 3);
+    printf("gfx - sdraw (%d,%d) (%d,%d) colours %d,%d", x1, y1, vm->drawx, vm->drawy,
+           vm->gintcolour & 3, vm->option & 3);
 #endif
 
-    os_drawline(scalex(x1), scaley(y1), scalex(drawx), scaley(drawy),
-                gintcolour & 3, option & 3);
+    gfxdrawline(scalex(x1), scaley(y1), scalex(vm->drawx), scaley(vm->drawy),
+                vm->gintcolour & 3, vm->option & 3);
 }
 
 /* smove instruction plus arguments are stored in an 8 bit word.
@@ -3092,8 +4972,8 @@ void smove(int d7)
     y = (d7 & 0x3) << 2;
     if (d7 & 0x4) y = (y | 0xf0) - 0x100;
 
-    if (reflectflag & 2) x = -x;
-    if (reflectflag & 1) y = -y;
+    if (vm->reflectflag & 2) x = -x;
+    if (vm->reflectflag & 1) y = -y;
     newxy(x, y);
 }
 
@@ -3124,21 +5004,21 @@ void draw(int d7, L9BYTE** a5)
     y = (xy & 0xf) << 2;
     if (xy & 0x10) y = (y | 0xc0) - 0x100;
 
-    if (reflectflag & 2) x = -x;
-    if (reflectflag & 1) y = -y;
+    if (vm->reflectflag & 2) x = -x;
+    if (vm->reflectflag & 1) y = -y;
 
     /* gintline */
-    x1 = drawx;
-    y1 = drawy;
+    x1 = vm->drawx;
+    y1 = vm->drawy;
     newxy(x, y);
 
 #ifdef L9DEBUG
-    printf("gfx - draw (%d,%d) (%d,%d) colours %d,%d", x1, y1, drawx, drawy,
-           gintcolour & 3, option & 3);
+    printf("gfx - draw (%d,%d) (%d,%d) colours %d,%d", x1, y1, vm->drawx, vm->drawy,
+           vm->gintcolour & 3, vm->option & 3);
 #endif
 
-    os_drawline(scalex(x1), scaley(y1), scalex(drawx), scaley(drawy),
-                gintcolour & 3, option & 3);
+    gfxdrawline(scalex(x1), scaley(y1), scalex(vm->drawx), scaley(vm->drawy),
+                vm->gintcolour & 3, vm->option & 3);
 }
 
 /* move instruction plus arguments are stored in a 16 bit word.
@@ -3159,16 +5039,16 @@ void _move(int d7, L9BYTE** a5)
     y = (xy & 0xf) << 2;
     if (xy & 0x10) y = (y | 0xc0) - 0x100;
 
-    if (reflectflag & 2) x = -x;
-    if (reflectflag & 1) y = -y;
+    if (vm->reflectflag & 2) x = -x;
+    if (vm->reflectflag & 1) y = -y;
     newxy(x, y);
 }
 
 void icolour(int d7)
 {
-    gintcolour = d7 & 3;
+    vm->gintcolour = d7 & 3;
 #ifdef L9DEBUG
-    printf("gfx - icolour 0x%.2x", gintcolour);
+    printf("gfx - icolour 0x%.2x", vm->gintcolour);
 #endif
 }
 
@@ -3178,33 +5058,33 @@ void size(int d7)
 
     d7 &= 7;
     if (d7) {
-        int d0 = (scale * sizetable[d7 - 1]) >> 3;
-        scale = (d0 < 0x100) ? d0 : 0xff;
+        int d0 = (vm->scale * sizetable[d7 - 1]) >> 3;
+        vm->scale = (d0 < 0x100) ? d0 : 0xff;
     } else {
         /* sizereset */
-        scale = 0x80;
-        if (gfx_mode == GFX_V2 || gfx_mode == GFX_V3A) GfxScaleStackPos = 0;
+        vm->scale = 0x80;
+        if (vm->gfx_mode == GFX_V2 || vm->gfx_mode == GFX_V3A) vm->GfxScaleStackPos = 0;
     }
 
 #ifdef L9DEBUG
-    printf("gfx - size 0x%.2x", scale);
+    printf("gfx - size 0x%.2x", vm->scale);
 #endif
 }
 
 void gintfill(int d7)
 {
     if ((d7 & 7) == 0) /* filla */
-        d7 = gintcolour;
+        d7 = vm->gintcolour;
     else
         d7 &= 3;
     /* fillb */
 
 #ifdef L9DEBUG
-    printf("gfx - gintfill (%d,%d) colours %d,%d", drawx, drawy, d7 & 3,
-           option & 3);
+    printf("gfx - gintfill (%d,%d) colours %d,%d", vm->drawx, vm->drawy, d7 & 3,
+           vm->option & 3);
 #endif
 
-    os_fill(scalex(drawx), scaley(drawy), d7 & 3, option & 3);
+    gfxfill(scalex(vm->drawx), scaley(vm->drawy), d7 & 3, vm->option & 3);
 }
 
 void gosub(int d7, L9BYTE** a5)
@@ -3224,10 +5104,10 @@ void reflect(int d7)
 
     if (d7 & 4) {
         d7 &= 3;
-        d7 ^= reflectflag;
+        d7 ^= vm->reflectflag;
     }
     /* reflect1 */
-    reflectflag = d7;
+    vm->reflectflag = d7;
 }
 
 void notimp(void)
@@ -3245,15 +5125,15 @@ void gintchgcol(L9BYTE** a5)
     printf("gfx - gintchgcol %d %d", (d0 >> 3) & 3, d0 & 7);
 #endif
 
-    os_setcolour((d0 >> 3) & 3, d0 & 7);
+    gfxsetcolour((d0 >> 3) & 3, d0 & 7);
 }
 
 void amove(L9BYTE** a5)
 {
-    drawx = 0x40 * (*(*a5)++);
-    drawy = 0x40 * (*(*a5)++);
+    vm->drawx = 0x40 * (*(*a5)++);
+    vm->drawy = 0x40 * (*(*a5)++);
 #ifdef L9DEBUG
-    printf("gfx - amove (%d,%d)", drawx, drawy);
+    printf("gfx - amove (%d,%d)", vm->drawx, vm->drawy);
 #endif
 }
 
@@ -3266,7 +5146,7 @@ void opt(L9BYTE** a5)
 
     if (d0) d0 = (d0 & 3) | 0x80;
     /* optend */
-    option = d0;
+    vm->option = d0;
 }
 
 void restorescale(void)
@@ -3274,17 +5154,17 @@ void restorescale(void)
 #ifdef L9DEBUG
     printf("gfx - restorescale");
 #endif
-    if (GfxScaleStackPos > 0) scale = GfxScaleStack[GfxScaleStackPos - 1];
+    if (vm->GfxScaleStackPos > 0) vm->scale = vm->GfxScaleStack[vm->GfxScaleStackPos - 1];
 }
 
 L9BOOL rts(L9BYTE** a5)
 {
-    if (GfxA5StackPos > 0) {
-        GfxA5StackPos--;
-        *a5 = GfxA5Stack[GfxA5StackPos];
-        if (GfxScaleStackPos > 0) {
-            GfxScaleStackPos--;
-            scale = GfxScaleStack[GfxScaleStackPos];
+    if (vm->GfxA5StackPos > 0) {
+        vm->GfxA5StackPos--;
+        *a5 = vm->GfxA5Stack[vm->GfxA5StackPos];
+        if (vm->GfxScaleStackPos > 0) {
+            vm->GfxScaleStackPos--;
+            vm->scale = vm->GfxScaleStack[vm->GfxScaleStackPos];
         }
         return TRUE;
     }
@@ -3370,17 +5250,17 @@ void absrunsub(int d0)
 
 void show_picture(int pic)
 {
-    if (L9GameType == L9_V3 && strlen(FirstLine) == 0) {
-        FirstPicture = pic;
+    if (vm->L9GameType == L9_V3 && strlen(vm->FirstLine) == 0) {
+        vm->FirstPicture = pic;
         return;
     }
 
-    if (picturedata) {
+    if (vm->picturedata) {
         /* Some games don't call the screen() opcode before drawing
            graphics, so here graphics are enabled if necessary. */
-        if ((screencalled == 0) && (l9textmode == 0)) {
+        if ((vm->screencalled == 0) && (vm->l9textmode == 0)) {
             detect_gfx_mode();
-            l9textmode = 1;
+            vm->l9textmode = 1;
             os_graphics(1);
         }
 
@@ -3390,18 +5270,25 @@ void show_picture(int pic)
 
         os_cleargraphics();
         /* gintinit */
-        gintcolour = 3;
-        option = 0x80;
-        reflectflag = 0;
-        drawx = 0x1400;
-        drawy = 0x1400;
+        vm->gintcolour = 3;
+        vm->option = 0x80;
+        vm->reflectflag = 0;
+        vm->drawx = 0x1400;
+        vm->drawy = 0x1400;
         /* sizereset */
-        scale = 0x80;
+        vm->scale = 0x80;
 
-        GfxA5StackPos = 0;
-        GfxScaleStackPos = 0;
-        absrunsub(0);
-        if (!findsub(pic, &gfxa5)) gfxa5 = NULL;
+        vm->GfxA5StackPos = 0;
+        vm->GfxScaleStackPos = 0;
+        if (startdisplaylist(pic)) {
+            vm->gfxa5 = NULL;
+        } else {
+            absrunsub(0);
+            if (!findsub(pic, &vm->gfxa5)) vm->gfxa5 = NULL;
+            if (!vm->gfxa5) enddisplaylist();
+        }
+        /* the picture waits for RunGraphics() */
+        if (vm->gfxa5 || vm->replaypic >= 0) L9Yield(L9_SLICE_PICTURE);
     }
 }
 
@@ -3412,19 +5299,26 @@ void picture(void)
 
 void GetPictureSize(int* width, int* height)
 {
-    if (L9GameType == L9_V4) {
+    if (vm->L9GameType == L9_V4) {
         if (width != NULL) *width = 0;
         if (height != NULL) *height = 0;
     } else {
-        if (width != NULL) *width = (gfx_mode != GFX_V3C) ? 160 : 320;
-        if (height != NULL) *height = (gfx_mode == GFX_V2) ? 128 : 96;
+        if (width != NULL) *width = (vm->gfx_mode != GFX_V3C) ? 160 : 320;
+        if (height != NULL) *height = (vm->gfx_mode == GFX_V2) ? 128 : 96;
     }
 }
 
 L9BOOL RunGraphics(void)
 {
-    if (gfxa5) {
-        if (!getinstruction(&gfxa5)) gfxa5 = NULL;
+    if (vm->replaypic >= 0) {
+        replaydisplaylist();
+        return TRUE;
+    }
+    if (vm->gfxa5) {
+        if (!getinstruction(&vm->gfxa5)) {
+            vm->gfxa5 = NULL;
+            enddisplaylist();
+        }
         return TRUE;
     }
     return FALSE;
@@ -3433,10 +5327,10 @@ L9BOOL RunGraphics(void)
 void initgetobj(void)
 {
     int i;
-    numobjectfound = 0;
-    object = 0;
+    vm->numobjectfound = 0;
+    vm->object = 0;
     for (i = 0; i < 32; i++)
-        gnoscratch[i] = 0;
+        vm->gnoscratch[i] = 0;
 }
 
 void getnextobject(void)
@@ -3458,62 +5352,62 @@ void getnextobject(void)
     do {
         if ((d3 | d4) == 0) {
             /* initgetobjsp */
-            gnosp = 128;
-            searchdepth = 0;
+            vm->gnosp = 128;
+            vm->searchdepth = 0;
             initgetobj();
             break;
         }
 
-        if (numobjectfound == 0) inithisearchpos = d3;
+        if (vm->numobjectfound == 0) vm->inithisearchpos = d3;
 
         /* gnonext */
         do {
-            if (d4 == list2ptr[++object]) {
+            if (d4 == vm->list2ptr[++vm->object]) {
                 /* gnomaybefound */
-                int d6 = list3ptr[object] & 0x1f;
+                int d6 = vm->list3ptr[vm->object] & 0x1f;
                 if (d6 != d3) {
                     if (d6 == 0 || d3 == 0) continue;
                     if (d3 != 0x1f) {
-                        gnoscratch[d6] = d6;
+                        vm->gnoscratch[d6] = d6;
                         continue;
                     }
                     d3 = d6;
                 }
                 /* gnofound */
-                numobjectfound++;
-                gnostack[--gnosp] = object;
-                gnostack[--gnosp] = 0x1f;
+                vm->numobjectfound++;
+                vm->gnostack[--vm->gnosp] = vm->object;
+                vm->gnostack[--vm->gnosp] = 0x1f;
 
                 *hisearchposvar = d3;
                 *searchposvar = d4;
-                *getvar() = object;
-                *getvar() = numobjectfound;
-                *getvar() = searchdepth;
+                *getvar() = vm->object;
+                *getvar() = vm->numobjectfound;
+                *getvar() = vm->searchdepth;
                 return;
             }
-        } while (object <= d2);
+        } while (vm->object <= d2);
 
-        if (inithisearchpos == 0x1f) {
-            gnoscratch[d3] = 0;
+        if (vm->inithisearchpos == 0x1f) {
+            vm->gnoscratch[d3] = 0;
             d3 = 0;
 
             /* gnoloop */
             do {
-                if (gnoscratch[d3]) {
-                    gnostack[--gnosp] = d4;
-                    gnostack[--gnosp] = d3;
+                if (vm->gnoscratch[d3]) {
+                    vm->gnostack[--vm->gnosp] = d4;
+                    vm->gnostack[--vm->gnosp] = d3;
                 }
             } while (++d3 < 0x1f);
         }
         /* gnonewlevel */
-        if (gnosp != 128) {
-            d3 = gnostack[gnosp++];
-            d4 = gnostack[gnosp++];
+        if (vm->gnosp != 128) {
+            d3 = vm->gnostack[vm->gnosp++];
+            d4 = vm->gnostack[vm->gnosp++];
         } else
             d3 = d4 = 0;
 
-        numobjectfound = 0;
-        if (d3 == 0x1f) searchdepth++;
+        vm->numobjectfound = 0;
+        if (d3 == 0x1f) vm->searchdepth++;
 
         initgetobj();
     } while (d4);
@@ -3522,9 +5416,9 @@ void getnextobject(void)
     /* gnoreturnargs */
     *hisearchposvar = 0;
     *searchposvar = 0;
-    *getvar() = object = 0;
-    *getvar() = numobjectfound;
-    *getvar() = searchdepth;
+    *getvar() = vm->object = 0;
+    *getvar() = vm->numobjectfound;
+    *getvar() = vm->searchdepth;
 }
 
 void ifeqct(void)
@@ -3532,10 +5426,10 @@ void ifeqct(void)
     L9UINT16 d0 = *getvar();
     L9UINT16 d1 = getcon();
     L9BYTE* a0 = getaddr();
-    if (d0 == d1) codeptr = a0;
+    if (d0 == d1) vm->codeptr = a0;
 #ifdef CODEFOLLOW
-    fprintf(f, " if Var[%d]=%d goto %d (%s)", cfvar - workspace.vartable, d1,
-            (L9UINT32)(a0 - acodeptr), d0 == d1 ? "Yes" : "No");
+    fprintf(f, " if Var[%d]=%d goto %d (%s)", cfvar - vm->workspace.vartable, d1,
+            (L9UINT32)(a0 - vm->acodeptr), d0 == d1 ? "Yes" : "No");
 #endif
 }
 
@@ -3544,10 +5438,10 @@ void ifnect(void)
     L9UINT16 d0 = *getvar();
     L9UINT16 d1 = getcon();
     L9BYTE* a0 = getaddr();
-    if (d0 != d1) codeptr = a0;
+    if (d0 != d1) vm->codeptr = a0;
 #ifdef CODEFOLLOW
-    fprintf(f, " if Var[%d]!=%d goto %d (%s)", cfvar - workspace.vartable, d1,
-            (L9UINT32)(a0 - acodeptr), d0 != d1 ? "Yes" : "No");
+    fprintf(f, " if Var[%d]!=%d goto %d (%s)", cfvar - vm->workspace.vartable, d1,
+            (L9UINT32)(a0 - vm->acodeptr), d0 != d1 ? "Yes" : "No");
 #endif
 }
 
@@ -3556,10 +5450,10 @@ void ifltct(void)
     L9UINT16 d0 = *getvar();
     L9UINT16 d1 = getcon();
     L9BYTE* a0 = getaddr();
-    if (d0 < d1) codeptr = a0;
+    if (d0 < d1) vm->codeptr = a0;
 #ifdef CODEFOLLOW
-    fprintf(f, " if Var[%d]<%d goto %d (%s)", cfvar - workspace.vartable, d1,
-            (L9UINT32)(a0 - acodeptr), d0 < d1 ? "Yes" : "No");
+    fprintf(f, " if Var[%d]<%d goto %d (%s)", cfvar - vm->workspace.vartable, d1,
+            (L9UINT32)(a0 - vm->acodeptr), d0 < d1 ? "Yes" : "No");
 #endif
 }
 
@@ -3568,16 +5462,16 @@ void ifgtct(void)
     L9UINT16 d0 = *getvar();
     L9UINT16 d1 = getcon();
     L9BYTE* a0 = getaddr();
-    if (d0 > d1) codeptr = a0;
+    if (d0 > d1) vm->codeptr = a0;
 #ifdef CODEFOLLOW
-    fprintf(f, " if Var[%d]>%d goto %d (%s)", cfvar - workspace.vartable, d1,
-            (L9UINT32)(a0 - acodeptr), d0 > d1 ? "Yes" : "No");
+    fprintf(f, " if Var[%d]>%d goto %d (%s)", cfvar - vm->workspace.vartable, d1,
+            (L9UINT32)(a0 - vm->acodeptr), d0 > d1 ? "Yes" : "No");
 #endif
 }
 
 void printinput(void)
 {
-    L9BYTE* ptr = (L9BYTE*)obuff;
+    L9BYTE* ptr = (L9BYTE*)vm->obuff;
     char c;
     while ((c = *ptr++) != ' ')
         printchar(c);
@@ -3596,22 +5490,22 @@ void listhandler(void)
     int offset;
 #endif
 
-    if ((code & 0x1f) > 0xa) {
-        error("\rillegal list access %d\r", code & 0x1f);
-        Running = FALSE;
+    if ((vm->code & 0x1f) > 0xa) {
+        error("\rillegal list access %d\r", vm->code & 0x1f);
+        vm->Running = FALSE;
         return;
     }
-    a4 = L9Pointers[1 + code & 0x1f];
+    a4 = vm->L9Pointers[1 + vm->code & 0x1f];
 
-    if (a4 >= workspace.listarea && a4 < workspace.listarea + LISTAREASIZE) {
-        MinAccess = workspace.listarea;
-        MaxAccess = workspace.listarea + LISTAREASIZE;
+    if (a4 >= vm->workspace.listarea && a4 < vm->workspace.listarea + LISTAREASIZE) {
+        MinAccess = vm->workspace.listarea;
+        MaxAccess = vm->workspace.listarea + LISTAREASIZE;
     } else {
-        MinAccess = startdata;
-        MaxAccess = startdata + FileSize;
+        MinAccess = vm->startdata;
+        MaxAccess = vm->startdata + vm->FileSize;
     }
 
-    if (code >= 0xe0) {
+    if (vm->code >= 0xe0) {
         /* listvv */
 #ifndef CODEFOLLOW
         a4 += *getvar();
@@ -3621,8 +5515,8 @@ void listhandler(void)
         a4 += offset;
         var = getvar();
         val = *var;
-        fprintf(f, " list %d [%d]=Var[%d] (=%d)", code & 0x1f, offset,
-                var - workspace.vartable, val);
+        fprintf(f, " list %d [%d]=Var[%d] (=%d)", vm->code & 0x1f, offset,
+                var - vm->workspace.vartable, val);
 #endif
 
         if (a4 >= MinAccess && a4 < MaxAccess) *a4 = (L9BYTE)val;
@@ -3630,17 +5524,17 @@ void listhandler(void)
         else
             printf("Out of range list access");
 #endif
-    } else if (code >= 0xc0) {
+    } else if (vm->code >= 0xc0) {
         /* listv1c */
 #ifndef CODEFOLLOW
-        a4 += *codeptr++;
+        a4 += *vm->codeptr++;
         var = getvar();
 #else
-        offset = *codeptr++;
+        offset = *vm->codeptr++;
         a4 += offset;
         var = getvar();
-        fprintf(f, " Var[%d]= list %d [%d])", var - workspace.vartable,
-                code & 0x1f, offset);
+        fprintf(f, " Var[%d]= list %d [%d])", var - vm->workspace.vartable,
+                vm->code & 0x1f, offset);
         if (a4 >= MinAccess && a4 < MaxAccess) fprintf(f, " (=%d)", *a4);
 #endif
 
@@ -3652,7 +5546,7 @@ void listhandler(void)
             printf("Out of range list access");
 #endif
         }
-    } else if (code >= 0xa0) {
+    } else if (vm->code >= 0xa0) {
         /* listv1v */
 #ifndef CODEFOLLOW
         a4 += *getvar();
@@ -3662,8 +5556,8 @@ void listhandler(void)
         a4 += offset;
         var = getvar();
 
-        fprintf(f, " Var[%d] =list %d [%d]", var - workspace.vartable,
-                code & 0x1f, offset);
+        fprintf(f, " Var[%d] =list %d [%d]", var - vm->workspace.vartable,
+                vm->code & 0x1f, offset);
         if (a4 >= MinAccess && a4 < MaxAccess) fprintf(f, " (=%d)", *a4);
 #endif
 
@@ -3677,15 +5571,15 @@ void listhandler(void)
         }
     } else {
 #ifndef CODEFOLLOW
-        a4 += *codeptr++;
+        a4 += *vm->codeptr++;
         val = *getvar();
 #else
-        offset = *codeptr++;
+        offset = *vm->codeptr++;
         a4 += offset;
         var = getvar();
         val = *var;
-        fprintf(f, " list %d [%d]=Var[%d] (=%d)", code & 0x1f, offset,
-                var - workspace.vartable, val);
+        fprintf(f, " list %d [%d]=Var[%d] (=%d)", vm->code & 0x1f, offset,
+                var - vm->workspace.vartable, val);
 #endif
 
         if (a4 >= MinAccess && a4 < MaxAccess) *a4 = (L9BYTE)val;
@@ -3696,117 +5590,36 @@ void listhandler(void)
     }
 }
 
+void illegalins(void)
+{
+    ilins(vm->code & 0x1f);
+}
+
+/* opcode handlers, indexed by code & 0x1f */
+void (*const opcodetable[32])(void) = {
+    Goto, intgosub, intreturn, printnumber,
+    messagev, messagec, function, input,
+    varcon, varvar, _add, _sub,
+    illegalins, illegalins, jump, Exit,
+    ifeqvt, ifnevt, ifltvt, ifgtvt,
+    _screen, cleartg, picture, getnextobject,
+    ifeqct, ifnect, ifltct, ifgtct,
+    printinput, illegalins, illegalins, illegalins,
+};
+
 void executeinstruction(void)
 {
 #ifdef CODEFOLLOW
     f = fopen(CODEFOLLOWFILE, "a");
-    fprintf(f, "%ld (s:%d) %x", (L9UINT32)(codeptr - acodeptr) - 1,
-            workspace.stackptr, code);
-    if (!(code & 0x80)) fprintf(f, " = %s", codes[code & 0x1f]);
+    fprintf(f, "%ld (s:%d) %x", (L9UINT32)(vm->codeptr - vm->acodeptr) - 1,
+            vm->workspace.stackptr, vm->code);
+    if (!(vm->code & 0x80)) fprintf(f, " = %s", codes[vm->code & 0x1f]);
 #endif
 
-    if (code & 0x80)
+    if (vm->code & 0x80)
         listhandler();
-    else {
-        switch (code & 0x1f) {
-        case 0:
-            Goto();
-            break;
-        case 1:
-            intgosub();
-            break;
-        case 2:
-            intreturn();
-            break;
-        case 3:
-            printnumber();
-            break;
-        case 4:
-            messagev();
-            break;
-        case 5:
-            messagec();
-            break;
-        case 6:
-            function();
-            break;
-        case 7:
-            input();
-            break;
-        case 8:
-            varcon();
-            break;
-        case 9:
-            varvar();
-            break;
-        case 10:
-            _add();
-            break;
-        case 11:
-            _sub();
-            break;
-        case 12:
-            ilins(code & 0x1f);
-            break;
-        case 13:
-            ilins(code & 0x1f);
-            break;
-        case 14:
-            jump();
-            break;
-        case 15:
-            Exit();
-            break;
-        case 16:
-            ifeqvt();
-            break;
-        case 17:
-            ifnevt();
-            break;
-        case 18:
-            ifltvt();
-            break;
-        case 19:
-            ifgtvt();
-            break;
-        case 20:
-            _screen();
-            break;
-        case 21:
-            cleartg();
-            break;
-        case 22:
-            picture();
-            break;
-        case 23:
-            getnextobject();
-            break;
-        case 24:
-            ifeqct();
-            break;
-        case 25:
-            ifnect();
-            break;
-        case 26:
-            ifltct();
-            break;
-        case 27:
-            ifgtct();
-            break;
-        case 28:
-            printinput();
-            break;
-        case 29:
-            ilins(code & 0x1f);
-            break;
-        case 30:
-            ilins(code & 0x1f);
-            break;
-        case 31:
-            ilins(code & 0x1f);
-            break;
-        }
-    }
+    else
+        opcodetable[vm->code & 0x1f]();
 #ifdef CODEFOLLOW
     fprintf(f, "\n");
     fclose(f);
@@ -3822,45 +5635,126 @@ L9BOOL LoadGame2(char* filename, char* picname)
 #endif
 
     /* may be already running a game, maybe in input routine */
-    Running = FALSE;
-    ibuffptr = NULL;
+    vm->Running = FALSE;
+    vm->ibuffptr = NULL;
 
     /* intstart */
-    if (!intinitialise(filename, picname)) return FALSE;
+    trace_begin("intinitialise");
+    if (!intinitialise(filename, picname)) {
+        trace_end();
+        return FALSE;
+    }
+    trace_end();
     /*	if (!checksumgamedata()) return FALSE; */
 
-    codeptr = acodeptr;
-    if (constseed > 0)
-        randomseed = constseed;
+    vm->codeptr = vm->acodeptr;
+    if (vm->constseed > 0)
+        vm->randomseed = vm->constseed;
     else
-        randomseed = (L9UINT16)time(NULL);
-    strcpy(LastGame, filename);
-    return Running = TRUE;
+        vm->randomseed = (L9UINT16)time(NULL);
+    strcpy(vm->LastGame, filename);
+    return vm->Running = TRUE;
 }
 
 L9BOOL LoadGame(char* filename, char* picname)
 {
     L9BOOL ret = LoadGame2(filename, picname);
-    showtitle = 1;
+    if (ret) startprefetch(filename);
+    vm->showtitle = 1;
+    /* states of the last game do not apply to this one */
+    freestates();
     clearworkspace();
-    workspace.stackptr = 0;
+    vm->workspace.stackptr = 0;
     /* need to clear listarea as well */
-    memset((L9BYTE*)workspace.listarea, 0, LISTAREASIZE);
+    memset((L9BYTE*)vm->workspace.listarea, 0, LISTAREASIZE);
     return ret;
 }
 
+/* what #seed sets, before LoadGame() a game plays out the same each time;
+   0 seeds from the clock */
+void SetRandomSeed(L9UINT16 seed)
+{
+    vm->randomseed = vm->constseed = seed;
+}
+
+/* the variable holding the player's location in the games we know of,
+   found by their first line like detect_gfx_mode() */
+static const struct {
+    const char* firstline;
+    int var;
+} L9RoomVars[] = {
+    {"welcome to snowball", 124},
+    {"welcome to red moon", 13},
+};
+
+void SetRoomVariable(int var)
+{
+    vm->roomvar = (var >= 0 && var < 256) ? var : -1;
+}
+
+int GetRoom(void)
+{
+    int i, var = vm->roomvar;
+
+    for (i = 0; var < 0 && i < (int)(sizeof(L9RoomVars) / sizeof(L9RoomVars[0])); i++)
+        if (strstr(vm->FirstLine, L9RoomVars[i].firstline) != 0)
+            var = L9RoomVars[i].var;
+    return var < 0 ? -1 : vm->workspace.vartable[var];
+}
+
 /* can be called from input to cause fall through for exit */
 void StopGame(void)
 {
-    Running = FALSE;
+    vm->Running = FALSE;
 }
 
 L9BOOL RunGame(void)
 {
-    code = *codeptr++;
+    vm->icount++;
+    vm->code = *vm->codeptr++;
     /*	printf("%d",code); */
     executeinstruction();
-    return Running;
+    return vm->Running;
+}
+
+L9BOOL RunGameSteps(int steps)
+{
+    L9BYTE op;
+
+    while (vm->Running && steps-- > 0) {
+        vm->icount++;
+        op = vm->code = *vm->codeptr++;
+        executeinstruction();
+        /* hand back for picture drawing, input and driver calls */
+        if (vm->gfxa5 || vm->replaypic >= 0) break;
+        if (!(op & 0x80) &&
+            ((op & 0x1f) == 6 || (op & 0x1f) == 7 || (op & 0x1f) == 20))
+            break;
+    }
+    return vm->Running;
+}
+
+L9UINT32 GetInstructionCount(void)
+{
+    return vm->icount;
+}
+
+void L9Yield(L9SliceStatus status)
+{
+    if (status > vm->slicestatus) vm->slicestatus = status;
+}
+
+L9SliceStatus L9RunSlice(int budget)
+{
+    vm->slicestatus = L9_SLICE_BUDGET;
+    while (budget-- > 0) {
+        if (!vm->Running) return L9_SLICE_STOPPED;
+        vm->icount++;
+        vm->code = *vm->codeptr++;
+        executeinstruction();
+        if (vm->slicestatus != L9_SLICE_BUDGET) return vm->slicestatus;
+    }
+    return vm->Running ? L9_SLICE_BUDGET : L9_SLICE_STOPPED;
 }
 
 void RestoreGame(char* filename)
@@ -3871,16 +5765,19 @@ void RestoreGame(char* filename)
 
     if ((f = fopen(filename, "rb")) != NULL) {
         Bytes = fread(&temp, 1, sizeof(GameState), f);
-        if (Bytes == V1FILESIZE) {
+        fclose(f);
+        if (loadstate((L9BYTE*)&temp, Bytes, TRUE)) {
+            printstring("\rGame restored.\r");
+        } else if (Bytes == V1FILESIZE) {
             printstring("\rGame restored.\r");
             /* only copy in workspace */
-            memset(workspace.listarea, 0, LISTAREASIZE);
-            memmove(workspace.vartable, &temp, V1FILESIZE);
+            memset(vm->workspace.listarea, 0, LISTAREASIZE);
+            memmove(vm->workspace.vartable, &temp, V1FILESIZE);
         } else if (CheckFile(&temp)) {
             printstring("\rGame restored.\r");
             /* full restore */
-            memmove(&workspace, &temp, sizeof(GameState));
-            codeptr = acodeptr + workspace.codeptr;
+            memmove(&vm->workspace, &temp, sizeof(GameState));
+            vm->codeptr = vm->acodeptr + vm->workspace.codeptr;
         } else
             printstring("\rSorry, unrecognised format. Unable to restore\r");
     } else
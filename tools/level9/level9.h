@@ -77,6 +77,9 @@ typedef struct
 	L9UINT16 npalette;
 } Bitmap;
 
+/* the state of one running game, see L9NewContext() */
+typedef struct L9Context L9Context;
+
 #define MAX_BITMAP_WIDTH 512
 #define MAX_BITMAP_HEIGHT 218
 
@@ -120,18 +123,93 @@ void os_show_bitmap(int pic, int x, int y);
 FILE* os_open_script_file(void);
 L9BOOL os_find_file(char* NewName);
 
+/* why L9RunSlice() returned, a later one wins over an earlier one */
+typedef enum
+{
+	L9_SLICE_BUDGET,  /* budget used up, the game can go on */
+	L9_SLICE_OUTPUT,  /* text is ready to be sent */
+	L9_SLICE_PICTURE, /* a picture waits for RunGraphics() */
+	L9_SLICE_INPUT,   /* os_input() had no line, call again to retry */
+	L9_SLICE_STOPPED  /* the game is over */
+} L9SliceStatus;
+
 /* routines provided by level9 interpreter */
 L9BOOL LoadGame(char* filename, char* picname);
 L9BOOL RunGame(void);
+L9BOOL RunGameSteps(int steps);
+
+/* Runs up to budget instructions of the current game, so that one thread
+   can take turns between many games. Front ends call L9Yield() from their
+   os_ routines to end the slice early, e.g. with L9_SLICE_OUTPUT when a
+   line is flushed; a failing os_input() yields L9_SLICE_INPUT itself. */
+L9SliceStatus L9RunSlice(int budget);
+void L9Yield(L9SliceStatus status);
+/* The number of instructions run so far, e.g. to tell what a turn took */
+L9UINT32 GetInstructionCount(void);
 void StopGame(void);
 void RestoreGame(char* filename);
 void FreeMemory(void);
 void GetPictureSize(int* width, int* height);
 L9BOOL RunGraphics(void);
+void SetScanCache(char* filename);
+/* Record the drawing calls of each line drawn picture the first time it is
+   shown and replay them on later visits instead of running its program.
+   With a filename the recordings are also kept in that file for the next
+   start of the same game. */
+void SetDisplayLists(L9BOOL on, char* filename);
+void SetRandomSeed(L9UINT16 seed);
+/* Put "#[msg <n>]" before and "#[/msg]" after each message printed, so
+   that front ends can tell repeated text by its message number */
+void SetMessageIds(L9BOOL on);
+
+/* The player's location, read from a game variable after each move so
+   that front ends can tell rooms apart without parsing the text. The
+   variable is known for some games; SetRoomVariable() names it for others,
+   -1 goes back to the known ones. GetRoom() returns -1 if there is none. */
+void SetRoomVariable(int var);
+int GetRoom(void);
+
+/* Calls message() with the number and text of each of the game's
+   messages, in one pass and without running the game. Returns the number
+   of messages. */
+int ListMessages(void (*message)(int Msg, const char* text));
+
+/* Word number Word of the game's dictionary, FALSE after the last one.
+   Asking for the words in order takes one pass over the dictionary. */
+L9BOOL GetDictionaryWord(int Word, char* buff, int size);
+
+/* Compressed save states of the current game, without the file prompts of
+   #save and #restore. Call them while the game waits for input or between
+   RunGameSteps(). L9SaveState() returns the length of the state, or 0 if
+   size is too small; L9STATESIZE is always enough. L9RestoreState() returns
+   FALSE, changing nothing, if the state is damaged or from another game. */
+#define L9STATESIZE (64 + 2 * (512 + LISTAREASIZE + 2 * STACKSIZE) + 16)
+int L9SaveState(L9BYTE* buffer, int size);
+L9BOOL L9RestoreState(L9BYTE* buffer, int size);
+/* The variables and list area of the current game, size bytes in all, e.g.
+   to tell game states apart by hashing them. NULL without a game. */
+L9BYTE* GetWorkspace(int* size);
+
+/* game contexts, the routines above work on the current one of the calling thread */
+L9Context* L9NewContext(void);
+void L9FreeContext(L9Context* context);
+void L9SetContext(L9Context* context);
+L9Context* L9GetContext(void);
 
 /* bitmap routines provided by level9 interpreter */
 BitmapType DetectBitmaps(const char* dir);
 Bitmap* DecodeBitmap(const char* dir, BitmapType type, int num, int x, int y);
+/* One more than the highest picture number DecodeBitmap() can find in dir */
+int CountBitmaps(const char* dir, BitmapType type);
+/* A PC1, PC2 or ST2 picture file that is already in memory (a bundle entry,
+   a mapped file), decoded without the globals of DecodeBitmap() and without
+   allocating: GetBitmapSize() gives its size, DecodeBitmapData() draws it
+   at x, y of out, clipped, into the out->width * out->height pixels of
+   out->bitmap that the caller owns and may reuse, and sets its palette. */
+L9BOOL GetBitmapSize(BitmapType type, const L9BYTE* data, L9UINT32 size, int* width, int* height);
+L9BOOL DecodeBitmapData(BitmapType type, const L9BYTE* data, L9UINT32 size, Bitmap* out, int x, int y);
+void SetBitmapPrefetch(int count);
+void FreeBitmaps(void);
 
 #ifdef __cplusplus
 }
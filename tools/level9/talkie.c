@@ -23,10 +23,24 @@
 \***********************************************************************/
 
 #include <ctype.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include "level9.h"
+#include "scale.h"
+#include "trace.h"
+#ifdef HAS_BUNDLE
+#include "bundle.h"
+#endif
+#ifdef __unix__
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 #define TEXTBUFFER_SIZE 10240
 char TextBuffer[TEXTBUFFER_SIZE + 1];
@@ -35,26 +49,290 @@ char* ptr = TextBuffer;
 int Column = 0;
 #define SCREENWIDTH 76
 
+/* Instructions run between looks at the game, which otherwise only stops
+   for output, input and pictures, see main() */
+#define GAME_SLICE 100000
+
 BitmapType bitmap_type = NO_BITMAPS;
 const char* bitmap_dir = NULL;
 
+/* Set by -b: pictures are sent as binary chunks instead of hex text */
+static int binary_gfx = 0;
+/* Set by -r: line drawn pictures are rendered here, see draw_frame */
+static int raster_gfx = 0;
+/* Set by --rgba: pictures go out with their colours looked up, see
+   send_rgba, so the host shows them without touching the pixels */
+static int rgba_gfx = 0;
+/* Set by --fast-forward: input comes from this file and nothing is sent
+   until it runs out. Raster pictures are still drawn, the last graphics
+   mode and bitmap are remembered, so the host gets the current picture. */
+static FILE* fastforward = NULL;
+static int ff_gfx = -1, ff_bitmap = -1, ff_x, ff_y;
+/* os_readchar() told the host it waits for a key, and no output since */
+static int key_ready_sent = 0;
+/* Set by --server: the input of the request, NULL once it is used up, and
+   whether the game then asked for more, see server_run() */
+static int server = 0;
+static const char* server_line = NULL;
+static int server_waiting = 0;
+
+#ifdef __unix__
+/* forget the reply so far: stdout is a scratch file while a session runs */
+static void server_drop(void)
+{
+    fflush(stdout);
+    fseek(stdout, 0, SEEK_SET);
+    if (ftruncate(1, 0) != 0) perror("--server");
+}
+#else
+#define server_drop()
+#endif
+
+/* Set by --stats: a "#[stats instructions=<n> vm_us=<n> text=<n>
+   pictures=<n> picture_us=<n>]" line goes before each "#[prompt]" and
+   "#[ready]", for the time since the input before it: the instructions
+   run, the time taken, the bytes of text printed, the pictures decoded
+   or drawn and the time that took */
+static int stats = 0;
+static L9UINT32 stats_count = 0;
+static int stats_text = 0, stats_pictures = 0;
+static double stats_start = 0, stats_picture_time = 0;
+
+static double stats_now(void)
+{
+#ifdef __unix__
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static void stats_write(void)
+{
+    double now = stats_now();
+
+    printf("#[stats instructions=%lu vm_us=%ld text=%d pictures=%d picture_us=%ld]\n",
+           (unsigned long)(GetInstructionCount() - stats_count),
+           (long)((now - stats_start) * 1e6), stats_text, stats_pictures,
+           (long)(stats_picture_time * 1e6));
+    stats_count = GetInstructionCount();
+    stats_text = stats_pictures = 0;
+    stats_picture_time = 0;
+}
+
+/* In binary mode the vector drawing calls of one picture are collected
+   here and sent as a single "#[gfxbin <length>]" chunk when RunGraphics()
+   has nothing more to draw. Each command is an opcode byte followed by
+   16 bit LE signed arguments:
+     'X' clear, 'C' colour index, 'L' x1 y1 x2 y2 colour1 colour2,
+     'F' x y colour1 colour2 */
+static L9BYTE* gfx_cmds = NULL;
+static int gfx_cmds_len = 0, gfx_cmds_size = 0;
+
+static void add_gfx_cmd(char op, int nargs, const int* args)
+{
+    if (gfx_cmds_len + 1 + 2 * nargs > gfx_cmds_size) {
+        int size = gfx_cmds_size ? gfx_cmds_size * 2 : 4096;
+        L9BYTE* p = realloc(gfx_cmds, size);
+        if (!p) return;
+        gfx_cmds = p;
+        gfx_cmds_size = size;
+    }
+    gfx_cmds[gfx_cmds_len++] = (L9BYTE)op;
+    for (int i = 0; i < nargs; i++) {
+        gfx_cmds[gfx_cmds_len++] = args[i] & 0xff;
+        gfx_cmds[gfx_cmds_len++] = (args[i] >> 8) & 0xff;
+    }
+}
+
+static void flush_gfx_cmds(void)
+{
+    if (fastforward) gfx_cmds_len = 0;
+    if (gfx_cmds_len == 0) return;
+    stats_pictures++;
+    printf("#[gfxbin %d]\n", gfx_cmds_len);
+    fwrite(gfx_cmds, 1, gfx_cmds_len, stdout);
+    gfx_cmds_len = 0;
+}
+
+/* Set by --paragraphs: each paragraph goes out on a line of its own, with
+   runs of spaces as one and none at either end, followed by a "#[p]" line.
+   Empty lines are left out. The line the game is still writing when it
+   waits, its prompt, goes out as it is, see end_of_output(). */
+static int paragraphs = 0;
+static int para_chars = 0, para_space = 0;
+
+/* Set once the "#[prompt]" line has gone out: it ended the line the player
+   types on, so the new line the game prints after the input is left out. */
+static int prompted = 0;
+
 void os_printchar(char c)
 {
-    if (ptr - TextBuffer >= TEXTBUFFER_SIZE) {
+    if (fastforward) return;
+    if (prompted) {
+        prompted = 0;
+        if (c == 13 || c == 10) return;
+    }
+    stats_text++;
+    key_ready_sent = 0;
+    /* room for the end of a paragraph */
+    if (ptr - TextBuffer >= TEXTBUFFER_SIZE - 6) {
         os_flush();
     }
-    if (c == 13) {
+    if (paragraphs) {
+        if (c == 13 || c == 10) {
+            if (para_chars) {
+                memcpy(ptr, "\n#[p]\n", 6);
+                ptr += 6;
+                os_flush();
+            }
+            para_chars = para_space = 0;
+            Column = 0;
+            return;
+        }
+        if (c == ' ') {
+            para_space = para_chars > 0;
+            return;
+        }
+        if (para_space) *ptr++ = ' ';
+        para_space = 0;
+        para_chars++;
+        *ptr++ = c;
+        Column++;
+    } else if (c == 13) {
         *ptr++ = 10;
+        Column = 0;
         os_flush();
     } else {
         *ptr++ = c;
+        Column = c == 10 ? 0 : Column + 1;
+    }
+}
+
+
+/* Run length pack pixels as (count, index) pairs. Returns the packed size,
+   or -1 if it would not be smaller than max. */
+static int pack_pixels(const L9BYTE* src, int n, L9BYTE* dst, int max)
+{
+    int i = 0, len = 0;
+    while (i < n) {
+        int run = 1;
+        while (i + run < n && run < 255 && src[i + run] == src[i]) run++;
+        if (len + 2 >= max) return -1;
+        dst[len++] = (L9BYTE)run;
+        dst[len++] = src[i];
+        i += run;
+    }
+    return len;
+}
+
+/* Binary picture chunk: a "#[imgbin <no> <length>]" line followed by
+   length bytes of
+     width (16 bit LE), height (16 bit LE), npalette (8 bit),
+     npalette * (red, green, blue),
+     packing (0 = raw, 1 = run length pairs), pixel data */
+static L9BYTE* encode_bitmap(Bitmap* bitmap, int rle, int* len)
+{
+    int npixels = bitmap->width * bitmap->height;
+    int head = 5 + 3 * bitmap->npalette + 1;
+    int packed;
+    L9BYTE* buf = malloc(head + npixels);
+    L9BYTE* p = buf;
+
+    if (!buf) return NULL;
+    *p++ = bitmap->width & 0xff;
+    *p++ = bitmap->width >> 8;
+    *p++ = bitmap->height & 0xff;
+    *p++ = bitmap->height >> 8;
+    *p++ = (L9BYTE)bitmap->npalette;
+    for (int i = 0; i < bitmap->npalette; i++) {
+        *p++ = bitmap->palette[i].red;
+        *p++ = bitmap->palette[i].green;
+        *p++ = bitmap->palette[i].blue;
+    }
+    packed = rle ? pack_pixels(bitmap->bitmap, npixels, p + 1, npixels) : -1;
+    if (packed < 0) {
+        *p++ = 0;
+        memcpy(p, bitmap->bitmap, npixels);
+        *len = head + npixels;
+    } else {
+        *p++ = 1;
+        *len = head + packed;
+    }
+    return buf;
+}
+
+static L9BOOL dump_bitmap_binary(int no, Bitmap* bitmap)
+{
+    int len;
+    L9BYTE* buf = encode_bitmap(bitmap, 1, &len);
+
+    if (!buf) return FALSE;
+    printf("#[imgbin %d %d]\n", no, len);
+    fwrite(buf, 1, len, stdout);
+    free(buf);
+    return TRUE;
+}
+
+/* RGBA picture chunks: "#[rgba <no> <width> <height> <length>]" for a
+   bitmap, shown by "#[bitmap]" like an #[imgbin] one, and
+   "#[rgbaframe <width> <height> <length>]" for a finished -r picture,
+   followed by width * height red, green, blue and alpha bytes. lut holds
+   the 4 bytes of each colour index as they go out. */
+static L9BOOL send_rgba(const char* line, const L9BYTE* pixels, int npixels,
+                        const uint32_t* lut)
+{
+    L9BYTE* buf = malloc(4 * (size_t)npixels);
+    L9BYTE* p = buf;
+    int i = 0;
+
+    if (!buf) return FALSE;
+    /* four at a time, the lookups are independent so the compiler can
+       vectorise them */
+    for (; i + 4 <= npixels; i += 4, p += 16) {
+        uint32_t q[4] = {lut[pixels[i]], lut[pixels[i + 1]],
+                         lut[pixels[i + 2]], lut[pixels[i + 3]]};
+        memcpy(p, q, 16);
     }
+    for (; i < npixels; i++, p += 4)
+        memcpy(p, lut + pixels[i], 4);
+    fputs(line, stdout);
+    fwrite(buf, 4, npixels, stdout);
+    free(buf);
+    return TRUE;
+}
+
+static uint32_t rgba_colour(L9BYTE red, L9BYTE green, L9BYTE blue)
+{
+    L9BYTE c[4] = {red, green, blue, 0xff};
+    uint32_t v;
+
+    memcpy(&v, c, 4);
+    return v;
 }
 
+static L9BOOL dump_bitmap_rgba(int no, Bitmap* bitmap)
+{
+    uint32_t lut[256];
+    int npixels = bitmap->width * bitmap->height;
+    char line[80];
+
+    for (int i = 0; i < 256; i++) {
+        Colour* c = bitmap->palette + (i < bitmap->npalette ? i : 0);
+        lut[i] = rgba_colour(c->red, c->green, c->blue);
+    }
+    snprintf(line, sizeof(line), "#[rgba %d %d %d %d]\n", no, bitmap->width,
+             bitmap->height, 4 * npixels);
+    return send_rgba(line, bitmap->bitmap, npixels, lut);
+}
 
 void dump_bitmap(int no)
 {
     Bitmap* bitmap = DecodeBitmap(bitmap_dir, bitmap_type, no, 0, 0);
+    if (bitmap && rgba_gfx && dump_bitmap_rgba(no, bitmap)) return;
+    if (bitmap && binary_gfx && dump_bitmap_binary(no, bitmap)) return;
     if (bitmap) {
         printf("#[img %d %d %d %d]\n", no, bitmap->width, bitmap->height, bitmap->npalette);
         printf("#[pal %d", no);
@@ -71,16 +349,375 @@ void dump_bitmap(int no)
     }
 }
 
+/* Indexed framebuffer for -r, sized by GetPictureSize(). Pixels hold the
+   4 logical colours, fb_colours maps them to the 8 Level 9 colours. */
+static L9BYTE* fb = NULL;
+static int fb_width = 0, fb_height = 0, fb_dirty = 0;
+static L9BYTE fb_colours[4] = {0, 1, 2, 3};
+static int* fill_stack = NULL;
+static int fill_size = 0;
+
+static void fb_resize(int width, int height)
+{
+    if (width == fb_width && height == fb_height) return;
+    free(fb);
+    fb = calloc(width * height, 1);
+    fb_width = fb ? width : 0;
+    fb_height = fb ? height : 0;
+}
+
+/* Bresenham, clipped per point */
+static void fb_line(int x0, int y0, int x1, int y1, int colour1, int colour2)
+{
+    int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+    int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+    int err = dx + dy;
+
+    for (;;) {
+        if (x0 >= 0 && x0 < fb_width && y0 >= 0 && y0 < fb_height) {
+            L9BYTE* p = fb + y0 * fb_width + x0;
+            if (*p == colour2) *p = (L9BYTE)colour1;
+        }
+        if (x0 == x1 && y0 == y1) break;
+        int e2 = 2 * err;
+        if (e2 >= dy) {
+            err += dy;
+            x0 += sx;
+        }
+        if (e2 <= dx) {
+            err += dx;
+            y0 += sy;
+        }
+    }
+}
+
+/* Push one seed for every run of colour2 in row y between l and r */
+static int fb_seed_row(int sp, int l, int r, int y, int colour2)
+{
+    L9BYTE* row = fb + y * fb_width;
+    int x = l;
+    while (x <= r) {
+        while (x <= r && row[x] != colour2) x++;
+        if (x > r) break;
+        if (sp + 2 > fill_size) {
+            int size = fill_size ? fill_size * 2 : 1024;
+            int* p = realloc(fill_stack, size * sizeof(int));
+            if (!p) return sp;
+            fill_stack = p;
+            fill_size = size;
+        }
+        fill_stack[sp++] = x;
+        fill_stack[sp++] = y;
+        while (x <= r && row[x] == colour2) x++;
+    }
+    return sp;
+}
+
+/* Span based scanline flood fill of the 4-connected colour2 region */
+static void fb_fill(int x, int y, int colour1, int colour2)
+{
+    int sp;
+
+    if (colour1 == colour2 || x < 0 || x >= fb_width || y < 0 ||
+        y >= fb_height || fb[y * fb_width + x] != colour2)
+        return;
+    sp = fb_seed_row(0, x, x, y, colour2);
+    while (sp > 0) {
+        y = fill_stack[--sp];
+        x = fill_stack[--sp];
+        L9BYTE* row = fb + y * fb_width;
+        if (row[x] != colour2) continue;
+        int l = x, r = x;
+        while (l > 0 && row[l - 1] == colour2) l--;
+        while (r < fb_width - 1 && row[r + 1] == colour2) r++;
+        memset(row + l, colour1, r - l + 1);
+        if (y > 0) sp = fb_seed_row(sp, l, r, y - 1, colour2);
+        if (y < fb_height - 1) sp = fb_seed_row(sp, l, r, y + 1, colour2);
+    }
+}
+
+/* Send the finished picture as "#[frame <length>]" followed by
+     width (16 bit LE), height (16 bit LE), 4 colour indices,
+     packing (0 = raw, 1 = run length pairs), pixel data */
+static void draw_frame(void)
+{
+    int npixels = fb_width * fb_height;
+    int head = 9, len, packed;
+    L9BYTE* buf;
+
+    if (!fb_dirty || !fb || fastforward) return;
+    fb_dirty = 0;
+    stats_pictures++;
+    if (rgba_gfx) {
+        /* the 8 Level 9 colours, as the host's ImageDrawer has them */
+        static const L9BYTE colours[8][3] = {
+            {0x00, 0x00, 0x00}, {0xff, 0x00, 0x00}, {0x30, 0xe8, 0x30},
+            {0xff, 0xff, 0x00}, {0x00, 0x00, 0xff}, {0xa0, 0x68, 0x00},
+            {0x00, 0xff, 0xff}, {0xff, 0xff, 0xff}};
+        uint32_t lut[256];
+        char line[80];
+
+        for (int i = 0; i < 256; i++) {
+            const L9BYTE* c = colours[fb_colours[i & 3] & 7];
+            lut[i] = rgba_colour(c[0], c[1], c[2]);
+        }
+        snprintf(line, sizeof(line), "#[rgbaframe %d %d %d]\n", fb_width,
+                 fb_height, 4 * npixels);
+        if (send_rgba(line, fb, npixels, lut)) return;
+    }
+    if (!(buf = malloc(head + npixels))) return;
+    buf[0] = fb_width & 0xff;
+    buf[1] = fb_width >> 8;
+    buf[2] = fb_height & 0xff;
+    buf[3] = fb_height >> 8;
+    memcpy(buf + 4, fb_colours, 4);
+    packed = pack_pixels(fb, npixels, buf + head, npixels);
+    if (packed < 0) {
+        buf[8] = 0;
+        memcpy(buf + head, fb, npixels);
+        len = head + npixels;
+    } else {
+        buf[8] = 1;
+        len = head + packed;
+    }
+    printf("#[frame %d]\n", len);
+    fwrite(buf, 1, len, stdout);
+    free(buf);
+}
+
+/* Whatever the game has queued to draw goes out in one go: the pictures
+   RunGraphics() has to run and the finished frame or binary chunk. The
+   game only comes back here when something yielded L9_SLICE_PICTURE. */
+static void draw_pictures(void)
+{
+    double start = stats ? stats_now() : 0;
+
+    trace_begin("pictures");
+    while (RunGraphics())
+        ;
+    flush_gfx_cmds();
+    draw_frame();
+    trace_end();
+    if (stats) stats_picture_time += stats_now() - start;
+}
+
 static int key_mode = 0;
+/* Set by --rooms */
+static int rooms = 0, last_room = -1;
+
+/* Everything the turn produced goes out before we block on stdin, followed
+   by a marker so the host doesn't have to wait for the output to go quiet:
+   "#[prompt]" before a line of input, "#[ready]" before a key press. With
+   --rooms a "#[room <n>]" line goes first when the player has moved, see
+   GetRoom(). The meta lines start on a line of their own, after the game's
+   prompt. */
+static void end_of_output(const char* marker)
+{
+    int room;
+
+    draw_pictures();
+    os_flush();
+    /* the prompt is not a paragraph, nor is the end of its line */
+    para_chars = para_space = 0;
+    if (Column) {
+        putchar('\n');
+        Column = 0;
+    }
+    if (rooms) {
+        if ((room = GetRoom()) >= 0 && room != last_room) printf("#[room %d]\n", room);
+        last_room = room;
+    }
+    if (stats) stats_write();
+    puts(marker);
+    fflush(stdout);
+}
+
+/* ##save#[path] and ##restore#[path] checkpoint the game without the
+   #save dialogue. Without a path the state goes out as a "#[state <length>]"
+   chunk, and comes back the same way: the host sends the chunk right after
+   the ##restore# line. The reply is "#[saved <length>]", "#[restored]",
+   "#[savefailed]" or "#[restorefailed]". */
+static void state_command(const char* cmd)
+{
+    static L9BYTE state[L9STATESIZE];
+    const char* path = strchr(cmd, '#') + 1;
+    unsigned long n;
+    int len = 0;
+    FILE* f;
+
+    os_flush();
+    if (cmd[0] == 's') {
+        len = L9SaveState(state, sizeof(state));
+        if (len && !*path) {
+            printf("#[state %d]\n", len);
+            fwrite(state, 1, len, stdout);
+        } else if (len) {
+            if ((f = fopen(path, "wb")) == NULL)
+                len = 0;
+            else {
+                if (fwrite(state, 1, len, f) != (size_t)len) len = 0;
+                if (fclose(f)) len = 0;
+            }
+        }
+        if (len)
+            printf("#[saved %d]\n", len);
+        else
+            puts("#[savefailed]");
+    } else {
+        if (!*path && !server) {
+            char line[64];
+            if (fgets(line, sizeof(line), stdin) && sscanf(line, "#[state %lu]", &n) == 1) {
+                /* read all of it even if it is too big, to stay in step */
+                for (unsigned long i = 0; i < n; i++) {
+                    int c = getc(stdin);
+                    if (c == EOF) break;
+                    if (i < sizeof(state)) state[i] = (L9BYTE)c;
+                }
+                if (n <= sizeof(state)) len = (int)n;
+            }
+        } else if ((f = fopen(path, "rb")) != NULL) {
+            len = fread(state, 1, sizeof(state), f);
+            fclose(f);
+        }
+        puts(len && L9RestoreState(state, len) ? "#[restored]" : "#[restorefailed]");
+    }
+    fflush(stdout);
+}
+
+/* ##speculate#<command> runs a command the host is only guessing at, e.g.
+   while the player is still speaking: the state before it is kept, then
+   "#[speculate]" goes out and the command runs as any other. The next line
+   settles it, ##commit# keeps what the command did ("#[committed]"),
+   ##discard# goes back to the kept state ("#[discarded]"). The server's
+   sessions share the one kept state, so it does not speculate. Returns TRUE
+   if ibuff now holds the command to run. */
+static L9BYTE fork_state[L9STATESIZE];
+static int fork_len = 0;
+
+/* --preload: the game and its bitmaps are loaded, "#[loaded]" goes out and
+   nothing runs until a "#[start]" or "#[start seed=<n>]" line comes in, so
+   a host can keep interpreters waiting for players. FALSE if the input
+   ends first. */
+static L9BOOL wait_for_start(void)
+{
+    char line[128];
+    const char* seed;
+
+    puts("#[loaded]");
+    fflush(stdout);
+    while (fgets(line, sizeof(line), stdin)) {
+        if (strncmp(line, "#[start", 7) != 0) continue;
+        if ((seed = strstr(line, "seed=")) != NULL)
+            SetRandomSeed((L9UINT16)atoi(seed + 5));
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* --turn-budget: a turn may run this many instructions, counted from the
+   input request, 0 for any number. os_input() keeps the game before each
+   line in turn_state; a turn that runs longer, e.g. stuck in a loop, is
+   rolled back to it and "#[error budget]" goes out, then the game asks for
+   the line again. Only the text still buffered is dropped. A key wait
+   starts the count again but keeps nothing. */
+static L9UINT32 turn_budget = 0, turn_start = 0;
+static L9BYTE turn_state[L9STATESIZE];
+static int turn_len = 0;
+
+/* the next slice, so that it ends as the turn runs out of its budget */
+static int turn_slice(void)
+{
+    L9UINT32 used = GetInstructionCount() - turn_start;
+
+    if (!turn_budget) return GAME_SLICE;
+    if (used >= turn_budget) return 1;
+    return turn_budget - used < GAME_SLICE ? (int)(turn_budget - used + 1) : GAME_SLICE;
+}
+
+/* the game stops if it never asked for a line */
+static void roll_back_turn(void)
+{
+    L9BOOL kept = turn_len && L9RestoreState(turn_state, turn_len);
+
+    ptr = TextBuffer;
+    para_chars = para_space = 0;
+    /* the server drops the reply of the turn as well */
+    if (server) server_drop();
+    puts("#[error budget]");
+    fflush(stdout);
+    turn_start = GetInstructionCount();
+    if (!kept) StopGame();
+}
+
+static L9BOOL fork_command(char* ibuff)
+{
+    if (strncmp(ibuff, "##speculate#", 12) == 0) {
+        fork_len = server ? 0 : L9SaveState(fork_state, sizeof(fork_state));
+        puts(fork_len ? "#[speculate]" : "#[speculatefailed]");
+        if (!fork_len) return FALSE;
+        memmove(ibuff, ibuff + 12, strlen(ibuff + 12) + 1);
+        return TRUE;
+    }
+    if (strcmp(ibuff, "##commit#") == 0)
+        puts(fork_len ? "#[committed]" : "#[commitfailed]");
+    else
+        puts(fork_len && L9RestoreState(fork_state, fork_len) ? "#[discarded]"
+                                                              : "#[discardfailed]");
+    fork_len = 0;
+    return FALSE;
+}
+
+static void end_fast_forward(void)
+{
+    int width, height;
+
+    fclose(fastforward);
+    fastforward = NULL;
+    if (ff_gfx >= 0) {
+        printf("#[gfx %d]\n", ff_gfx);
+        GetPictureSize(&width, &height);
+        if (width != 0) printf("#[imgsize %d %d]\n", width, height);
+    }
+    if (ff_bitmap >= 0) os_show_bitmap(ff_bitmap, ff_x, ff_y);
+    fb_dirty = 1;
+}
 
 L9BOOL os_input(char* ibuff, int size)
 {
+    if (turn_budget) {
+        turn_len = L9SaveState(turn_state, sizeof(turn_state));
+        turn_start = GetInstructionCount();
+    }
     if (key_mode == 1) {
         key_mode = 0;
-        puts("#[linemode]");
+        if (!fastforward) puts("#[linemode]");
     }
-    os_flush();
-    fgets(ibuff, size, stdin);
+    if (fastforward) {
+        if (fgets(ibuff, size, fastforward)) {
+            char* nl = strchr(ibuff, '\n');
+            if (nl) *nl = 0;
+            return TRUE;
+        }
+        end_fast_forward();
+    }
+    if (server) {
+        /* the request's line, or the reply ends here */
+        if (!server_line) {
+            end_of_output("#[prompt]");
+            prompted = 1;
+            server_waiting = 1;
+            return FALSE;
+        }
+        snprintf(ibuff, size, "%s", server_line);
+        server_line = NULL;
+    } else {
+        end_of_output("#[prompt]");
+        prompted = 1;
+        trace_begin("input");
+        fgets(ibuff, size, stdin);
+        trace_end();
+    }
+    stats_start = stats_now();
     char* nl = strchr(ibuff, '\n');
     if (nl) *nl = 0;
     if (strncmp(ibuff, "##img#", 6) == 0) {
@@ -88,47 +725,101 @@ L9BOOL os_input(char* ibuff, int size)
         dump_bitmap(no);
         return FALSE;
     }
+    if (strncmp(ibuff, "##save#", 7) == 0 || strncmp(ibuff, "##restore#", 10) == 0) {
+        state_command(ibuff + 2);
+        return FALSE;
+    }
+    if (strncmp(ibuff, "##speculate#", 12) == 0 || strcmp(ibuff, "##commit#") == 0 ||
+        strcmp(ibuff, "##discard#") == 0)
+        return fork_command(ibuff);
     return TRUE;
 }
 
 char os_readchar(int millis)
 {
+    turn_start = GetInstructionCount();
     if (key_mode == 0) {
         key_mode = 1;
-        puts("#[keymode]");
+        if (!fastforward) puts("#[keymode]");
     }
-    static int count = 0;
-    char c;
 
     os_flush();
     if (millis == 0) return 0;
 
+    if (fastforward) {
+        int key = getc(fastforward);
+        if (key != EOF) return (char)key;
+        end_fast_forward();
+        puts("#[keymode]");
+    }
+
+    /* the server takes the keys from the request's input, and answers no
+       key once it is used up; the next wait ends the reply */
+    if (server) {
+        if (server_line && *server_line) {
+            key_ready_sent = 0;
+            stats_start = stats_now();
+            return *server_line++;
+        }
+        if (server_line) {
+            server_line = NULL;
+            return 0;
+        }
+        if (!key_ready_sent) {
+            end_of_output("#[ready]");
+            key_ready_sent = 1;
+        }
+        server_waiting = 1;
+        L9Yield(L9_SLICE_INPUT);
+        return 0;
+    }
+
     /* Some of the Level 9 games expect to be able to wait for
        a character for a short while as a way of pausing, and
        expect 0 to be returned, while the multiple-choice games
        (such as The Archers) expect 'proper' keys from this
-       routine.
+       routine. */
+#ifdef __unix__
+    /* So wait up to millis for a key. Keys queue up in the pipe, stdin is
+       unbuffered so that poll() sees all of them. The host is told once
+       per wait, "#[ready]" goes out again only after new output. */
+    struct pollfd pfd = {0, POLLIN, 0};
+    int c;
 
-       To get round this, we return 0 for the first 1024 calls,
+    if (!key_ready_sent) {
+        end_of_output("#[ready]");
+        key_ready_sent = 1;
+    }
+    trace_begin("input");
+    if (poll(&pfd, 1, millis) <= 0) {
+        trace_end();
+        return 0;
+    }
+    trace_end();
+    if ((c = getc(stdin)) == EOF) {
+        /* nothing more will come, but keep the pauses */
+        poll(NULL, 0, millis);
+        return 0;
+    }
+    key_ready_sent = 0;
+    stats_start = stats_now();
+    return (char)c;
+#else
+    /* Without a timed wait we return 0 for the first 1024 calls,
        and 'proper' keys thereafter. Since The Archers and
        similar games ignore the returned zeros, this works quite
-       well. A 'correct' port would solve this properly by
-       implementing a timed wait for a key, but this is not
-       possible using only C stdio-functions.
-    */
+       well. */
+    static int count = 0;
+    int c;
+
     if (++count < 1024) return 0;
     count = 0;
 
-    fprintf(stderr, "READCHAR\n");
+    end_of_output("#[ready]");
     c = getc(stdin); /* will require enter key as well */
-    fprintf(stderr, "GOT %02x\n", c);
-    //if (c != '\n') {
-    //    while (getc(stdin) != '\n') {
-    //        /* unbuffer input until enter key */
-    //    }
-    //}
-
-    return c;
+    stats_start = stats_now();
+    return (char)c;
+#endif
 }
 
 L9BOOL os_stoplist(void)
@@ -138,10 +829,13 @@ L9BOOL os_stoplist(void)
 
 void os_flush(void)
 {
+    if (ptr != TextBuffer) L9Yield(L9_SLICE_OUTPUT);
+    trace_begin("flush");
     *ptr = 0;
     fputs(TextBuffer, stdout);
     ptr = TextBuffer;
     fflush(stdout);
+    trace_end();
 }
 
 L9BOOL os_save_file(L9BYTE* Ptr, int Bytes)
@@ -151,6 +845,8 @@ L9BOOL os_save_file(L9BYTE* Ptr, int Bytes)
     FILE* f;
 
     os_flush();
+    /* stdin carries the server's requests */
+    if (server) return FALSE;
     printf("Save file: ");
     fgets(name, 256, stdin);
     nl = strchr(name, '\n');
@@ -169,6 +865,7 @@ L9BOOL os_load_file(L9BYTE* Ptr, int* Bytes, int Max)
     FILE* f;
 
     os_flush();
+    if (server) return FALSE;
     printf("Load file: ");
     fgets(name, 256, stdin);
     nl = strchr(name, '\n');
@@ -185,6 +882,7 @@ L9BOOL os_get_game_file(char* NewName, int Size)
     char* nl;
 
     os_flush();
+    if (server) return FALSE;
     printf("Load next game: ");
     fgets(NewName, Size, stdin);
     nl = strchr(NewName, '\n');
@@ -214,44 +912,114 @@ void os_set_filenumber(char* NewName, int Size, int n)
 
 void os_graphics(int mode)
 {
-    printf("#[gfx %d]\n", mode);
+    flush_gfx_cmds();
+    draw_frame();
+    if (fastforward)
+        ff_gfx = mode;
+    else
+        printf("#[gfx %d]\n", mode);
     int width;
     int height;
     GetPictureSize(&width, &height);
     if (width != 0) {
-        printf("#[imgsize %d %d]\n", width, height);
+        if (!fastforward) printf("#[imgsize %d %d]\n", width, height);
+        if (raster_gfx) fb_resize(width, height);
     }
 }
 
 void os_cleargraphics(void)
 {
+    if (raster_gfx) {
+        if (fb) memset(fb, 0, fb_width * fb_height);
+        fb_dirty = 1;
+        return;
+    }
+    if (fastforward) return;
+    if (binary_gfx) {
+        add_gfx_cmd('X', 0, NULL);
+        return;
+    }
     printf("#[clear]\n");
 }
 
 void os_setcolour(int colour, int index)
 {
+    if (raster_gfx) {
+        fb_colours[colour & 3] = (L9BYTE)(index & 7);
+        fb_dirty = 1;
+        return;
+    }
+    if (fastforward) return;
+    if (binary_gfx) {
+        int args[] = {colour, index};
+        add_gfx_cmd('C', 2, args);
+        return;
+    }
     printf("#[setcolor %d %d]\n", colour, index);
 }
 
 void os_drawline(int x1, int y1, int x2, int y2, int colour1, int colour2)
 {
+    if (raster_gfx) {
+        if (fb) fb_line(x1, y1, x2, y2, colour1, colour2);
+        fb_dirty = 1;
+        return;
+    }
+    if (fastforward) return;
+    if (binary_gfx) {
+        int args[] = {x1, y1, x2, y2, colour1, colour2};
+        add_gfx_cmd('L', 6, args);
+        return;
+    }
     printf("#[line %d %d %d %d %d %d]\n", x1, y1, x2, y2, colour1, colour2);
 }
 
 void os_fill(int x, int y, int colour1, int colour2)
 {
+    if (raster_gfx) {
+        if (fb) fb_fill(x, y, colour1, colour2);
+        fb_dirty = 1;
+        return;
+    }
+    if (fastforward) return;
+    if (binary_gfx) {
+        int args[] = {x, y, colour1, colour2};
+        add_gfx_cmd('F', 4, args);
+        return;
+    }
     printf("#[fill %d %d %d %d]\n", x, y, colour1, colour2);
 }
 
-static int used[64] = {0};
+/* Pictures already sent to the host, grown as needed */
+static L9BYTE* sent = NULL;
+static int nsent = 0;
 
 void os_show_bitmap(int pic, int x, int y)
 {
-    if (used[pic] == 0) {
+    if (fastforward) {
+        ff_bitmap = pic;
+        ff_x = x;
+        ff_y = y;
+        return;
+    }
+    if (pic >= nsent) {
+        int n = pic + 64;
+        L9BYTE* p = realloc(sent, n);
+        if (p) {
+            memset(p + nsent, 0, n - nsent);
+            sent = p;
+            nsent = n;
+        }
+    }
+    if (pic < 0 || pic >= nsent || !sent[pic]) {
+        double start = stats ? stats_now() : 0;
         dump_bitmap(pic);
+        stats_pictures++;
+        if (stats) stats_picture_time += stats_now() - start;
     }
-    used[pic] = 1;
+    if (pic >= 0 && pic < nsent) sent[pic] = 1;
     printf("#[bitmap %d %d %d]\n", pic, x, y);
+    L9Yield(L9_SLICE_PICTURE);
 }
 
 FILE* os_open_script_file(void)
@@ -260,6 +1028,7 @@ FILE* os_open_script_file(void)
     char* nl;
 
     os_flush();
+    if (server) return NULL;
     printf("Script file: ");
     fgets(name, 256, stdin);
     nl = strchr(name, '\n');
@@ -277,25 +1046,475 @@ L9BOOL os_find_file(char* NewName)
     return FALSE;
 }
 
+/* --export-all: every picture is written as <n>.raw, the #[imgbin] layout
+   with packing 0, and listed in manifest.json. The decoders keep their state
+   in globals, so the pictures are split across one forked process per CPU.
+   With --scale 2, 3 or 4 the pictures are upscaled first, see scale.h; the
+   bands of a picture only get threads of their own if there are no other
+   processes. The pictures are numbered up to what CountBitmaps() finds. */
+static int export_scale = 1;
+
+static void export_slice(const char* dir, int pictures, int first, int step)
+{
+    char path[1024];
+    for (int n = first; n < pictures; n += step) {
+        Bitmap* bitmap = DecodeBitmap(bitmap_dir, bitmap_type, n, 0, 0);
+        Bitmap scaled;
+        int len;
+        if (bitmap && export_scale > 1) {
+            scaled = *bitmap;
+            scaled.bitmap = scale_alloc(bitmap->bitmap, bitmap->width,
+                                        bitmap->height, export_scale,
+                                        step > 1 ? 1 : 0);
+            scaled.width *= export_scale;
+            scaled.height *= export_scale;
+            bitmap = scaled.bitmap ? &scaled : NULL;
+        }
+        L9BYTE* buf = bitmap ? encode_bitmap(bitmap, 0, &len) : NULL;
+        if (bitmap == &scaled) free(scaled.bitmap);
+        if (!buf) continue;
+        snprintf(path, sizeof(path), "%s/%d.raw", dir, n);
+        FILE* f = fopen(path, "wb");
+        if (f) {
+            fwrite(buf, 1, len, f);
+            fclose(f);
+        }
+        free(buf);
+    }
+}
+
+/* --vocab: the dictionary words for speech recognition, one per line with a
+   tab after it, as infodump -V writes them. The word types would follow the
+   tab, but Level 9 dictionaries don't have them. */
+static void write_vocab(void)
+{
+    char word[64];
+
+    for (int i = 0; GetDictionaryWord(i, word, sizeof(word)); i++)
+        printf("%s\t\n", word);
+}
+
+/* --dump-messages: every message for speech synthesis in advance, one
+   "<number>\t<text>" line each with newlines, tabs and backslashes written
+   as \n, \t and \\ */
+static void dump_message(int msg, const char* text)
+{
+    printf("%d\t", msg);
+    for (; *text; text++) {
+        if (*text == '\r' || *text == '\n')
+            fputs("\\n", stdout);
+        else if (*text == '\t')
+            fputs("\\t", stdout);
+        else if (*text == '\\')
+            fputs("\\\\", stdout);
+        else
+            putchar(*text);
+    }
+    putchar('\n');
+}
+
+static int export_all(const char* dir)
+{
+    char path[1024];
+    L9BYTE head[5];
+    int pictures = CountBitmaps(bitmap_dir, bitmap_type), workers = 1, exported = 0;
+    FILE *f, *manifest;
+
+#ifdef __unix__
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) return -1;
+#endif
+    for (int n = 0; n < pictures; n++) {
+        snprintf(path, sizeof(path), "%s/%d.raw", dir, n);
+        remove(path);
+    }
+#ifdef __unix__
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 1 && pictures > 1) workers = cpus < pictures ? (int)cpus : pictures;
+    for (int k = 1; k < workers; k++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            export_slice(dir, pictures, k, workers);
+            _exit(0);
+        }
+        if (pid < 0) export_slice(dir, pictures, k, workers);
+    }
+#endif
+    export_slice(dir, pictures, 0, workers);
+#ifdef __unix__
+    while (wait(NULL) > 0)
+        ;
+#endif
+
+    snprintf(path, sizeof(path), "%s/manifest.json", dir);
+    if (!(manifest = fopen(path, "w"))) return -1;
+    fprintf(manifest, "{\n  \"format\": \"raw\",\n  \"pictures\": [");
+    for (int n = 0; n < pictures; n++) {
+        snprintf(path, sizeof(path), "%s/%d.raw", dir, n);
+        if (!(f = fopen(path, "rb"))) continue;
+        if (fread(head, 1, 5, f) == 5) {
+            fprintf(manifest,
+                    "%s\n    {\"index\": %d, \"file\": \"%d.raw\", "
+                    "\"width\": %d, \"height\": %d, \"colours\": %d}",
+                    exported ? "," : "", n, n, head[0] | head[1] << 8,
+                    head[2] | head[3] << 8, head[4]);
+            exported++;
+        }
+        fclose(f);
+    }
+    fprintf(manifest, "\n  ]\n}\n");
+    fclose(manifest);
+    return exported;
+}
+
+#ifdef __unix__
+/* --server: requests are lines of "<id> <input>" on stdin, as for magnetic
+   --server. A new id starts a player of its own, a game context that loads
+   the game again (see L9NewContext()), and gets the opening text first (an
+   empty input only does that). "<id> #close" ends a session. Every reply is
+   a "#[session <id> <length>]" line followed by that many bytes of output,
+   ending in "#[prompt]" while the game waits for a line, "#[ready]" while it
+   waits for a key (the next input gives the keys), "#[end]" once it stopped
+   or "#[closed]". While a session runs stdout is a scratch file, the reply
+   is what went to it. Each session keeps what the front end knows of its
+   game aside while another one plays. */
+typedef struct
+{
+    char id[64];
+    L9Context* game;
+    int key_mode, key_ready_sent, last_room, column, prompted;
+    L9UINT32 stats_count;
+    L9BYTE* sent;
+    int nsent;
+} server_session;
+
+static FILE* server_out = NULL;
+static int server_seed = -1, server_room_var = -1;
+
+static void server_store(server_session* s)
+{
+    s->key_mode = key_mode;
+    s->key_ready_sent = key_ready_sent;
+    s->last_room = last_room;
+    s->column = Column;
+    s->prompted = prompted;
+    s->stats_count = stats_count;
+    s->sent = sent;
+    s->nsent = nsent;
+}
+
+static void server_restore(server_session* s)
+{
+    L9SetContext(s->game);
+    key_mode = s->key_mode;
+    key_ready_sent = s->key_ready_sent;
+    last_room = s->last_room;
+    Column = s->column;
+    prompted = s->prompted;
+    stats_count = s->stats_count;
+    sent = s->sent;
+    nsent = s->nsent;
+}
+
+static void server_free(server_session* s, int playing)
+{
+    if (playing) {
+        server_store(s);
+        sent = NULL;
+        nsent = 0;
+    }
+    free(s->sent);
+    L9FreeContext(s->game);
+}
+
+static void server_send(const char* id)
+{
+    char buf[4096];
+    long len, off = 0;
+    ssize_t n;
+
+    fflush(stdout);
+    len = ftell(stdout);
+    if (len < 0) len = 0;
+    fprintf(server_out, "#[session %s %ld]\n", id, len);
+    while (off < len) {
+        n = pread(1, buf, len - off < (long)sizeof(buf) ? len - off : (long)sizeof(buf), off);
+        if (n <= 0) break;
+        fwrite(buf, 1, n, server_out);
+        off += n;
+    }
+    /* the length is sent, keep in step */
+    for (; off < len; off++)
+        putc(0, server_out);
+    fflush(server_out);
+    server_drop();
+}
+
+/* run the game until it wants the next line or key, FALSE if it stopped
+   instead */
+static L9BOOL server_turn(const char* line)
+{
+    L9SliceStatus status;
+
+    server_line = line;
+    server_waiting = 0;
+    /* the request is the turn, what was kept is another session's */
+    turn_start = GetInstructionCount();
+    turn_len = 0;
+    do {
+        trace_begin("vm");
+        status = L9RunSlice(turn_slice());
+        trace_end();
+        if (status == L9_SLICE_PICTURE) draw_pictures();
+        if (turn_budget && GetInstructionCount() - turn_start > turn_budget) roll_back_turn();
+    } while (status != L9_SLICE_STOPPED && !(status == L9_SLICE_INPUT && server_waiting));
+    os_flush();
+    return status != L9_SLICE_STOPPED;
+}
+
+static int server_run(char* game, char* picname)
+{
+    char line[512], *input;
+    server_session* list = NULL;
+    FILE* scratch;
+    int count = 0, cur = -1, i, fd;
+
+    fflush(stdout);
+    if ((fd = dup(1)) < 0 || (server_out = fdopen(fd, "w")) == NULL ||
+        (scratch = tmpfile()) == NULL || dup2(fileno(scratch), 1) < 0) {
+        perror("--server");
+        return 1;
+    }
+    while (fgets(line, sizeof(line), stdin)) {
+        line[strcspn(line, "\r\n")] = 0;
+        input = line + strcspn(line, " ");
+        if (*input) *input++ = 0;
+        if (!*line) continue;
+        if (strlen(line) >= sizeof(list->id)) {
+            puts("#[error]");
+            server_send("-");
+            continue;
+        }
+        for (i = 0; i < count && strcmp(list[i].id, line); i++)
+            ;
+
+        if (!strcmp(input, "#close")) {
+            if (i < count) {
+                server_free(&list[i], cur == i);
+                list[i] = list[--count];
+                if (cur == i)
+                    cur = -1;
+                else if (cur == count)
+                    cur = i;
+            }
+            puts("#[closed]");
+            server_send(line);
+            continue;
+        }
+
+        if (i == count) {
+            server_session* grown = realloc(list, (count + 1) * sizeof(*list));
+            if (!grown) return 1;
+            list = grown;
+            if (cur >= 0) server_store(&list[cur]);
+            memset(&list[count], 0, sizeof(*list));
+            strcpy(list[count].id, line);
+            list[count].last_room = -1;
+            list[count].game = L9NewContext();
+            server_restore(&list[count]);
+            cur = count++;
+            stats_start = stats_now();
+            if (server_seed >= 0) SetRandomSeed((L9UINT16)server_seed);
+            if (server_room_var >= 0) SetRoomVariable(server_room_var);
+            L9BOOL loaded = LoadGame(game, picname);
+            if (!loaded || !server_turn(NULL)) {
+                puts(loaded ? "#[end]" : "#[error]");
+                server_send(line);
+                server_free(&list[cur], 1);
+                list[cur] = list[--count];
+                cur = -1;
+                continue;
+            }
+            server_send(line);
+            if (!*input) continue;
+        } else if (i != cur) {
+            if (cur >= 0) server_store(&list[cur]);
+            server_restore(&list[i]);
+            cur = i;
+        }
+
+        if (!server_turn(input)) {
+            puts("#[end]");
+            server_send(line);
+            /* the game is over, stop the session as with #close */
+            server_free(&list[i], 1);
+            list[i] = list[--count];
+            cur = -1;
+            continue;
+        }
+        server_send(line);
+    }
+    for (i = 0; i < count; i++)
+        server_free(&list[i], cur == i);
+    free(list);
+    FreeBitmaps();
+    fclose(server_out);
+    return 0;
+}
+#endif
+
 int main(int argc, char** argv)
 {
+    char* game = NULL;
+    char* picname = NULL;
+    const char* gfx = NULL;
+    const char* export_dir = NULL;
+    int vocab = 0, dump_messages = 0, preload = 0;
+    int seed = -1, room_var = -1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0)
+            binary_gfx = 1;
+        else if (strcmp(argv[i], "-r") == 0)
+            binary_gfx = raster_gfx = 1;
+        else if (strcmp(argv[i], "--rgba") == 0)
+            binary_gfx = rgba_gfx = 1;
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            SetBitmapPrefetch(atoi(argv[++i]));
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            SetScanCache(argv[++i]);
+        else if (strcmp(argv[i], "-l") == 0)
+            SetDisplayLists(TRUE, NULL);
+        else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc)
+            SetDisplayLists(TRUE, argv[++i]);
+        else if (strcmp(argv[i], "--export-all") == 0 && i + 1 < argc)
+            export_dir = argv[++i];
+        else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc)
+            export_scale = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--vocab") == 0)
+            vocab = 1;
+        else if (strcmp(argv[i], "--dump-messages") == 0)
+            dump_messages = 1;
+        else if (strcmp(argv[i], "--fast-forward") == 0 && i + 1 < argc) {
+            if (!(fastforward = fopen(argv[++i], "r")))
+                printf("Error: Unable to open %s\n", argv[i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = atoi(argv[++i]);
+            SetRandomSeed((L9UINT16)seed);
+        } else if (strcmp(argv[i], "--room-var") == 0 && i + 1 < argc) {
+            room_var = atoi(argv[++i]);
+            SetRoomVariable(room_var);
+        } else if (strcmp(argv[i], "--server") == 0)
+            server = 1;
+        else if (strcmp(argv[i], "--msg-ids") == 0)
+            SetMessageIds(TRUE);
+        else if (strcmp(argv[i], "--stats") == 0)
+            stats = 1;
+        else if (strcmp(argv[i], "--preload") == 0)
+            preload = 1;
+        else if (strcmp(argv[i], "--paragraphs") == 0)
+            paragraphs = 1;
+        else if (strcmp(argv[i], "--rooms") == 0)
+            rooms = 1;
+        else if (strcmp(argv[i], "--turn-budget") == 0 && i + 1 < argc)
+            turn_budget = (L9UINT32)strtoul(argv[++i], NULL, 0);
+        else if (!game)
+            game = argv[i];
+        else if (!gfx)
+            gfx = argv[i];
+    }
+#ifdef HAS_BUNDLE
+    /* a bundle holds the game, its picture file and "pics/", the bitmaps */
+    if (game && bundle_open(game)) {
+        game = "story";
+        if (bundle_find("graphics", NULL)) picname = "graphics";
+        if (!gfx) gfx = "pics/";
+    }
+#endif
+    if (export_dir) {
+        /* the pictures only need the bitmap directory, not the game */
+        int exported = -1;
+        if (export_scale != 1 &&
+            (export_scale < SCALE_MIN || export_scale > SCALE_MAX)) {
+            printf("Error: --scale takes %d to %d\n", SCALE_MIN, SCALE_MAX);
+            return 1;
+        }
+        if (gfx && (bitmap_type = DetectBitmaps(gfx)) != NO_BITMAPS) {
+            bitmap_dir = gfx;
+            exported = export_all(export_dir);
+        }
+        FreeBitmaps();
+        if (exported < 0) {
+            printf("Error: Unable to export pictures to %s\n", export_dir);
+            return 1;
+        }
+        printf("Exported %d pictures to %s\n", exported, export_dir);
+        return 0;
+    }
+    if (vocab || dump_messages) {
+        if (!game || !LoadGame(game, picname)) {
+            printf("Error: Unable to open game file\n");
+            return 1;
+        }
+        if (vocab)
+            write_vocab();
+        else
+            ListMessages(dump_message);
+        FreeMemory();
+        return 0;
+    }
+    if (server) {
+#ifdef __unix__
+        /* every session loads the game, see server_run() */
+        if (raster_gfx || fastforward || preload) {
+            printf("Error: --server does not take -r, --fast-forward or --preload\n");
+            return 1;
+        }
+        if (gfx) {
+            bitmap_type = DetectBitmaps(gfx);
+            bitmap_dir = gfx;
+        }
+        server_seed = seed;
+        server_room_var = room_var;
+        if (!game) {
+            printf("Error: Unable to open game file\n");
+            return 1;
+        }
+        return server_run(game, picname);
+#else
+        printf("Error: --server needs a Unix system\n");
+        return 1;
+#endif
+    }
+#ifdef __unix__
+    /* key waits poll the descriptor, see os_readchar() */
+    setvbuf(stdin, NULL, _IONBF, 0);
+#endif
     printf("Level 9 Interpreter\n\n");
-    if (!LoadGame(argv[1], NULL)) {
+    if (binary_gfx) puts("#[bin 1]");
+    if (!game || !LoadGame(game, picname)) {
         printf("Error: Unable to open game file\n");
         return 0;
     }
-    if (argc > 2) {
-        bitmap_type = DetectBitmaps(argv[2]);
+    if (gfx) {
+        bitmap_type = DetectBitmaps(gfx);
         printf("Type %d\n", bitmap_type);
-        bitmap_dir = argv[2];
+        bitmap_dir = gfx;
     }
-    int rc = 1;
-    while (rc) {
-        rc = RunGame();
-        int rg = 1;
-        while (rg != 0) {
-            rg = RunGraphics();
-        }
+    if (preload && !wait_for_start()) {
+        FreeMemory();
+        return 0;
+    }
+    L9SliceStatus status;
+    stats_start = stats_now();
+    /* text and input are dealt with as the game runs, pictures when it
+       yields for one */
+    for (;;) {
+        trace_begin("vm");
+        status = L9RunSlice(turn_slice());
+        trace_end();
+        if (status == L9_SLICE_STOPPED) break;
+        if (status == L9_SLICE_PICTURE) draw_pictures();
+        if (turn_budget && GetInstructionCount() - turn_start > turn_budget) roll_back_turn();
     }
     StopGame();
     FreeMemory();
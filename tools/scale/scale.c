@@ -0,0 +1,204 @@
+/*
+ * scale.c
+ *
+ * Pixel-art upscalers, see scale.h. Each source pixel E becomes a block of
+ * factor * factor pixels, chosen from E and its neighbours
+ *
+ *   A B C
+ *   D E F
+ *   G H I
+ *
+ * with the pixels beyond the edges taken to be copies of the edge ones.
+ * Built with SCALE_NO_THREADS the bands run one after the other.
+ */
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+
+#include "scale.h"
+
+#ifndef SCALE_NO_THREADS
+#include <pthread.h>
+#define SCALE_MAX_THREADS 64
+#endif
+
+/* Bands are no smaller than this, a thread costs more than a few rows */
+#define SCALE_BAND_ROWS 16
+
+struct scale_band
+{
+    const unsigned char* src;
+    unsigned char* dst;
+    int width, height, factor;
+    int first, last; /* the source rows, last not included */
+};
+
+static void scale2x_rows(const struct scale_band* b)
+{
+    int w = b->width, x, y;
+
+    for (y = b->first; y < b->last; y++) {
+        const unsigned char* up = b->src + (y > 0 ? y - 1 : y) * w;
+        const unsigned char* row = b->src + y * w;
+        const unsigned char* down = b->src + (y < b->height - 1 ? y + 1 : y) * w;
+        unsigned char* out0 = b->dst + (size_t)2 * y * 2 * w;
+        unsigned char* out1 = out0 + 2 * w;
+
+        for (x = 0; x < w; x++) {
+            unsigned char B = up[x], H = down[x], E = row[x];
+            unsigned char D = row[x > 0 ? x - 1 : x];
+            unsigned char F = row[x < w - 1 ? x + 1 : x];
+
+            if (B != H && D != F) {
+                out0[2 * x] = D == B ? D : E;
+                out0[2 * x + 1] = B == F ? F : E;
+                out1[2 * x] = D == H ? D : E;
+                out1[2 * x + 1] = H == F ? F : E;
+            } else
+                out0[2 * x] = out0[2 * x + 1] = out1[2 * x] = out1[2 * x + 1] =
+                    E;
+        }
+    }
+}
+
+static void scale3x_rows(const struct scale_band* b)
+{
+    int w = b->width, x, y;
+
+    for (y = b->first; y < b->last; y++) {
+        const unsigned char* up = b->src + (y > 0 ? y - 1 : y) * w;
+        const unsigned char* row = b->src + y * w;
+        const unsigned char* down = b->src + (y < b->height - 1 ? y + 1 : y) * w;
+        unsigned char* out0 = b->dst + (size_t)3 * y * 3 * w;
+        unsigned char* out1 = out0 + 3 * w;
+        unsigned char* out2 = out1 + 3 * w;
+
+        for (x = 0; x < w; x++) {
+            int l = x > 0 ? x - 1 : x, r = x < w - 1 ? x + 1 : x;
+            unsigned char A = up[l], B = up[x], C = up[r];
+            unsigned char D = row[l], E = row[x], F = row[r];
+            unsigned char G = down[l], H = down[x], I = down[r];
+            unsigned char* p0 = out0 + 3 * x;
+            unsigned char* p1 = out1 + 3 * x;
+            unsigned char* p2 = out2 + 3 * x;
+
+            if (B != H && D != F) {
+                p0[0] = D == B ? D : E;
+                p0[1] = (D == B && E != C) || (B == F && E != A) ? B : E;
+                p0[2] = B == F ? F : E;
+                p1[0] = (D == B && E != G) || (D == H && E != A) ? D : E;
+                p1[1] = E;
+                p1[2] = (B == F && E != I) || (H == F && E != C) ? F : E;
+                p2[0] = D == H ? D : E;
+                p2[1] = (D == H && E != I) || (H == F && E != G) ? H : E;
+                p2[2] = H == F ? F : E;
+            } else
+                p0[0] = p0[1] = p0[2] = p1[0] = p1[1] = p1[2] = p2[0] = p2[1] =
+                    p2[2] = E;
+        }
+    }
+}
+
+static void* scale_band_run(void* arg)
+{
+    const struct scale_band* b = arg;
+
+    if (b->factor == 3)
+        scale3x_rows(b);
+    else
+        scale2x_rows(b);
+    return NULL;
+}
+
+static int scale_threads(int threads, int height)
+{
+#ifdef SCALE_NO_THREADS
+    (void)threads;
+    (void)height;
+    return 1;
+#else
+    int bands = (height + SCALE_BAND_ROWS - 1) / SCALE_BAND_ROWS;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (threads > SCALE_MAX_THREADS) threads = SCALE_MAX_THREADS;
+    if (threads > bands) threads = bands;
+    return threads > 1 ? threads : 1;
+#endif
+}
+
+/* One Scale2x or Scale3x pass, cut into bands of rows */
+static void scale_pass(const unsigned char* src, int width, int height,
+                       int factor, unsigned char* dst, int threads)
+{
+    int n = scale_threads(threads, height), k;
+#ifndef SCALE_NO_THREADS
+    struct scale_band bands[SCALE_MAX_THREADS];
+    pthread_t ids[SCALE_MAX_THREADS];
+    int started[SCALE_MAX_THREADS];
+#else
+    struct scale_band bands[1];
+#endif
+
+    for (k = 0; k < n; k++) {
+        bands[k].src = src;
+        bands[k].dst = dst;
+        bands[k].width = width;
+        bands[k].height = height;
+        bands[k].factor = factor;
+        bands[k].first = (int)((long)height * k / n);
+        bands[k].last = (int)((long)height * (k + 1) / n);
+    }
+#ifndef SCALE_NO_THREADS
+    /* the first band runs here, and any band a thread can't be had for */
+    for (k = 1; k < n; k++)
+        started[k] =
+            pthread_create(&ids[k], NULL, scale_band_run, &bands[k]) == 0;
+    scale_band_run(&bands[0]);
+    for (k = 1; k < n; k++) {
+        if (started[k])
+            pthread_join(ids[k], NULL);
+        else
+            scale_band_run(&bands[k]);
+    }
+#else
+    scale_band_run(&bands[0]);
+#endif
+}
+
+int scale_pixels(const unsigned char* src, int width, int height, int factor,
+                 unsigned char* dst, int threads)
+{
+    unsigned char* half;
+
+    if (factor < SCALE_MIN || factor > SCALE_MAX || width <= 0 || height <= 0)
+        return -1;
+    if (factor != 4) {
+        scale_pass(src, width, height, factor, dst, threads);
+        return 0;
+    }
+    if ((half = malloc((size_t)4 * width * height)) == NULL)
+        return -1;
+    scale_pass(src, width, height, 2, half, threads);
+    scale_pass(half, 2 * width, 2 * height, 2, dst, threads);
+    free(half);
+    return 0;
+}
+
+unsigned char* scale_alloc(const unsigned char* src, int width, int height,
+                           int factor, int threads)
+{
+    unsigned char* dst;
+
+    if (factor < SCALE_MIN || factor > SCALE_MAX || width <= 0 || height <= 0)
+        return NULL;
+    dst = malloc((size_t)width * factor * height * factor);
+    if (dst != NULL && scale_pixels(src, width, height, factor, dst, threads)) {
+        free(dst);
+        dst = NULL;
+    }
+    return dst;
+}
@@ -0,0 +1,32 @@
+/*
+ * scale.h
+ *
+ * Pixel-art upscalers for the pictures the tools export: Scale2x and
+ * Scale3x (the AdvanceMAME EPX rules), and Scale4x as Scale2x twice. They
+ * work on palette indexes, one byte per pixel, so a picture keeps its
+ * palette: a pixel only ever becomes a copy of itself or of a neighbour,
+ * which follows diagonal edges instead of doubling them into steps.
+ *
+ * The output rows only read the source, so they are cut into bands that
+ * run on threads of their own.
+ */
+
+#ifndef SCALE_H
+#define SCALE_H
+
+/* The factors scale_pixels() takes */
+#define SCALE_MIN 2
+#define SCALE_MAX 4
+
+/* Scale the width * height pixels of src by factor into dst, which has
+   room for width * factor * height * factor of them. threads is the number
+   of bands to run at once, 0 for one per CPU. Returns 0, or -1 if the
+   factor is not one of 2, 3 and 4 or there is not enough memory. */
+int scale_pixels(const unsigned char* src, int width, int height, int factor,
+                 unsigned char* dst, int threads);
+
+/* scale_pixels() into a buffer of its own, NULL on failure */
+unsigned char* scale_alloc(const unsigned char* src, int width, int height,
+                           int factor, int threads);
+
+#endif /* SCALE_H */
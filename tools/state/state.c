@@ -0,0 +1,95 @@
+/*
+ * state.c
+ *
+ * Run encoding of saved states and undo steps, see state.h for the
+ * format.
+ */
+
+#include <string.h>
+
+#include "state.h"
+
+unsigned long state_adler32(const unsigned char* p, unsigned long len)
+{
+    unsigned long a = 1, b = 0, n;
+
+    while (len > 0) {
+        /* the most bytes that cannot overflow b before the modulo */
+        n = len < 5552 ? len : 5552;
+        len -= n;
+        while (n--) {
+            a += *p++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+static unsigned char* state_put_count(unsigned char* out, unsigned long n)
+{
+    while (n >= 0x80) {
+        *out++ = (unsigned char)(n | 0x80);
+        n >>= 7;
+    }
+    *out++ = (unsigned char)n;
+    return out;
+}
+
+static const unsigned char* state_get_count(const unsigned char* in,
+                                            const unsigned char* end,
+                                            unsigned long* n)
+{
+    int shift = 0;
+
+    *n = 0;
+    do {
+        if (in >= end || shift > 28) return NULL;
+        *n |= (unsigned long)(*in & 0x7f) << shift;
+        shift += 7;
+    } while (*in++ & 0x80);
+    return in;
+}
+
+unsigned char* state_encode(unsigned char* out, const unsigned char* data,
+                            const unsigned char* base, unsigned long len)
+{
+    unsigned long i = 0, start;
+
+    while (i < len) {
+        for (start = i; i < len && data[i] == (base ? base[i] : 0); i++)
+            ;
+        out = state_put_count(out, i - start);
+        for (start = i; i < len && data[i] != (base ? base[i] : 0); i++)
+            ;
+        out = state_put_count(out, i - start);
+        memcpy(out, data + start, i - start);
+        out += i - start;
+    }
+    return out;
+}
+
+const unsigned char* state_decode(unsigned char* data,
+                                  const unsigned char* base,
+                                  unsigned long len, const unsigned char* in,
+                                  const unsigned char* end)
+{
+    unsigned long i = 0, n;
+
+    while (i < len) {
+        if (!(in = state_get_count(in, end, &n)) || n > len - i) return NULL;
+        if (base)
+            memcpy(data + i, base + i, n);
+        else
+            memset(data + i, 0, n);
+        i += n;
+        if (!(in = state_get_count(in, end, &n)) || n > len - i ||
+            n > (unsigned long)(end - in))
+            return NULL;
+        memcpy(data + i, in, n);
+        in += n;
+        i += n;
+    }
+    return in;
+}
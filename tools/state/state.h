@@ -0,0 +1,37 @@
+/*
+ * state.h
+ *
+ * The encoding the interpreters keep saved states and undo steps in. A game
+ * changes little of its memory from one move to the next, so a block is
+ * stored as runs against a base the reader has as well: a count of
+ * unchanged bytes, a count of changed ones and those bytes, repeated to the
+ * end. Counts are 7 bits a byte, low bits first, the high bit set while more
+ * follow. A null base stands for zeros.
+ *
+ * Each interpreter puts a header of its own in front, with an Adler-32 of
+ * the base and of the runs so that a state is not restored over the wrong
+ * game or from a damaged file.
+ */
+
+#ifndef STATE_H
+#define STATE_H
+
+/* The most bytes state_encode() writes for a block of len bytes */
+#define STATE_ENCODE_MAX(len) (2 * (len) + 8)
+
+unsigned long state_adler32(const unsigned char* p, unsigned long len);
+
+/* Writes the runs that turn base into data to out, returns the end of
+   them */
+unsigned char* state_encode(unsigned char* out, const unsigned char* data,
+                            const unsigned char* base, unsigned long len);
+
+/* Rebuilds len bytes of data from base and the runs at in, reading no
+   further than end. Returns the end of the runs, or NULL if they are
+   damaged. */
+const unsigned char* state_decode(unsigned char* data,
+                                  const unsigned char* base,
+                                  unsigned long len, const unsigned char* in,
+                                  const unsigned char* end);
+
+#endif /* STATE_H */
@@ -0,0 +1,151 @@
+/*
+ * trace.c
+ *
+ * Span tracing, see trace.h. A span is timed on the stack of its thread
+ * and goes into the ring when it ends, as a complete ("X") event of the
+ * Chrome trace format. The ring is written once, by an atexit() handler
+ * of the process that started tracing, so forked workers that exit()
+ * don't write over it.
+ *
+ * trace_start() is meant to run before a second thread does, which it
+ * does when the main thread begins the first span.
+ */
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "trace.h"
+
+#ifndef NO_TRACE
+
+/* Per thread state, and an atomic ring index, where the compiler has them */
+#if defined(__GNUC__)
+#define TRACE_LOCAL __thread
+#define trace_next_index(p) __atomic_fetch_add(p, 1, __ATOMIC_RELAXED)
+#else
+#define TRACE_LOCAL
+#define trace_next_index(p) ((*(p))++)
+#endif
+
+struct trace_span
+{
+    const char* name;
+    double start, dur; /* microseconds since trace_start() */
+    int tid;
+};
+
+struct trace_open
+{
+    const char* name;
+    double start;
+};
+
+int trace_on = -1;
+
+static struct trace_span* trace_ring;
+static unsigned long trace_count;
+static int trace_threads;
+static long trace_pid;
+static double trace_epoch;
+
+static TRACE_LOCAL struct trace_open trace_stack[TRACE_DEPTH];
+static TRACE_LOCAL int trace_depth, trace_tid;
+
+static double trace_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3 - trace_epoch;
+#else
+    return (double)clock() * 1e6 / CLOCKS_PER_SEC - trace_epoch;
+#endif
+}
+
+static long trace_getpid(void)
+{
+#if defined(__unix__) || defined(__APPLE__)
+    return (long)getpid();
+#else
+    return 1;
+#endif
+}
+
+static void trace_exit(void)
+{
+    if (trace_getpid() == trace_pid) trace_write();
+}
+
+int trace_start(void)
+{
+    const char* path = getenv(TRACE_ENV);
+
+    if (trace_on >= 0) return trace_on;
+    trace_on = 0;
+    if (path == NULL || *path == 0) return 0;
+    trace_ring = malloc(TRACE_SPANS * sizeof(*trace_ring));
+    if (trace_ring == NULL) return 0;
+    trace_pid = trace_getpid();
+    trace_epoch = trace_now();
+    atexit(trace_exit);
+    trace_on = 1;
+    return 1;
+}
+
+void trace_span_begin(const char* name)
+{
+    if (trace_tid == 0) trace_tid = (int)trace_next_index(&trace_threads) + 1;
+    /* spans nested too deeply are counted but not timed */
+    if (trace_depth < TRACE_DEPTH) {
+        trace_stack[trace_depth].name = name;
+        trace_stack[trace_depth].start = trace_now();
+    }
+    trace_depth++;
+}
+
+void trace_span_end(void)
+{
+    struct trace_span* span;
+    double now;
+
+    if (trace_depth == 0) return;
+    if (--trace_depth >= TRACE_DEPTH) return;
+    now = trace_now();
+    span = &trace_ring[trace_next_index(&trace_count) % TRACE_SPANS];
+    span->name = trace_stack[trace_depth].name;
+    span->start = trace_stack[trace_depth].start;
+    span->dur = now - span->start;
+    span->tid = trace_tid;
+}
+
+int trace_write(void)
+{
+    const char* path = getenv(TRACE_ENV);
+    unsigned long first, i;
+    FILE* f;
+
+    if (trace_on <= 0 || path == NULL) return -1;
+    while (trace_depth > 0)
+        trace_span_end();
+    if ((f = fopen(path, "w")) == NULL) return -1;
+    first = trace_count > TRACE_SPANS ? trace_count - TRACE_SPANS : 0;
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (i = first; i < trace_count; i++) {
+        const struct trace_span* span = &trace_ring[i % TRACE_SPANS];
+
+        fprintf(f,
+                "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":%ld,\"tid\":%d}\n",
+                i > first ? "," : "", span->name, span->start, span->dur,
+                trace_pid, span->tid);
+    }
+    fprintf(f, "],\"displayTimeUnit\":\"ms\"}\n");
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+#endif /* NO_TRACE */
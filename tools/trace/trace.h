@@ -0,0 +1,59 @@
+/*
+ * trace.h
+ *
+ * Phase spans for the interpreters and tools, written as a Chrome trace
+ * (chrome://tracing or ui.perfetto.dev) when the program exits. Tracing is
+ * on when TALKIE_TRACE names the file to write, and otherwise a span costs
+ * a test of trace_on. Spans are kept in a ring allocated when tracing
+ * starts, so a long session keeps its last TRACE_SPANS of them.
+ *
+ * Span names must be string literals, only the pointer is kept. Each
+ * thread has spans of its own, a span ends the one it began last. Built
+ * with NO_TRACE the calls compile to nothing.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/* The spans kept, and how deeply they nest on a thread */
+#define TRACE_SPANS 65536
+#define TRACE_DEPTH 32
+
+/* The variable that names the file to write */
+#define TRACE_ENV "TALKIE_TRACE"
+
+#ifdef NO_TRACE
+
+#define trace_begin(name) ((void)0)
+#define trace_end() ((void)0)
+#define trace_write() ((void)0)
+
+#else
+
+/* 1 when tracing, 0 when not, -1 until TRACE_ENV has been looked at */
+extern int trace_on;
+
+/* Looks at TRACE_ENV, returns trace_on */
+int trace_start(void);
+
+void trace_span_begin(const char* name);
+void trace_span_end(void);
+
+/* Writes the spans so far, with the open ones of this thread ended now.
+   Called at exit when tracing; returns 0, or -1 if the file can't be
+   written. */
+int trace_write(void);
+
+#define trace_begin(name)                                                     \
+    do {                                                                      \
+        if (trace_on > 0 || (trace_on < 0 && trace_start()))                  \
+            trace_span_begin(name);                                           \
+    } while (0)
+#define trace_end()                                                           \
+    do {                                                                      \
+        if (trace_on > 0) trace_span_end();                                   \
+    } while (0)
+
+#endif /* NO_TRACE */
+
+#endif /* TRACE_H */
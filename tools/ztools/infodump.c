@@ -29,6 +29,9 @@
  *     -d n show dictionary (n = columns)
  *     -a   all of the above
  *     -w n display width (0 = no wrap)
+ *     -r   one JSON record line per story, for indexing many stories
+ *     -J   one line of JSON per story with the header, dictionary and objects
+ *     -j n number of stories to process at once with -r or -J
  *
  * Mark Howell 28 August 1992 howell_ma@movies.enet.dec.com
  *
@@ -52,6 +55,14 @@
  */
 
 #include "tx.h"
+#if defined(__unix__) || defined(__APPLE__)
+#    include <sys/wait.h>
+#    include <unistd.h> /* declares getopt */
+#    define HAS_FORK
+#    ifndef HAS_GETOPT
+#        define HAS_GETOPT
+#    endif
+#endif
 
 #ifndef HAS_GETOPT
 extern int getopt(int, char*[], const char*);
@@ -62,11 +73,22 @@ extern void show_dictionary(int);
 extern void show_objects(int);
 extern void show_tree(void);
 extern void show_verbs(int);
+extern void show_header_json(void);
+extern void show_dictionary_json(void);
+extern void show_vocabulary(void);
+extern void show_objects_json(void);
+extern void configure_dictionary(unsigned int*, unsigned long*, unsigned long*);
+extern void configure_object_tables(unsigned int*, unsigned long*,
+                                    unsigned long*, unsigned long*,
+                                    unsigned long*);
 
 static void show_help(const char*);
 static void process_story(const char*, int*, int, int);
-static void fix_dictionary(void);
 static void show_map(void);
+static void process_records(char*[], int, int, void (*)(const char*));
+static void show_record(const char*);
+static void show_json(const char*);
+static void show_vocab(const char*);
 
 /* Options */
 
@@ -96,7 +118,10 @@ int main(int argc, char* argv[])
 {
     int c, f, i, errflg = 0;
     int columns, options[MAXOPT];
-    int symbolic;
+    int symbolic, jobs;
+    void (*records)(const char*);
+
+    tx_init_output();
 
     /* Clear all options */
 
@@ -104,10 +129,17 @@ int main(int argc, char* argv[])
         options[i] = 0;
     columns = 0;
     symbolic = 0;
+    records = NULL;
+    jobs = 0;
+
+    /* --vocab is the spelling the interpreters use for -V */
+
+    for (i = 1; i < argc; i++)
+        if (strcmp(argv[i], "--vocab") == 0) argv[i] = (char*)"-V";
 
     /* Parse the options */
 
-    while ((c = getopt(argc, argv, "hafiotgmdsc:w:u:")) != EOF) {
+    while ((c = getopt(argc, argv, "hafiotgmdsrJVc:w:u:j:")) != EOF) {
         switch (c) {
         case 'f':
             for (i = 0; i < MAXOPT; i++)
@@ -137,6 +169,18 @@ int main(int argc, char* argv[])
         case 's':
             symbolic = 1;
             break;
+        case 'r':
+            records = show_record;
+            break;
+        case 'J':
+            records = show_json;
+            break;
+        case 'V':
+            records = show_vocab;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
         case 'c':
             columns = atoi(optarg);
             break;
@@ -161,6 +205,11 @@ int main(int argc, char* argv[])
         exit(EXIT_FAILURE);
     }
 
+    if (records) {
+        process_records(&argv[optind], argc - optind, jobs, records);
+        exit(EXIT_SUCCESS);
+    }
+
     /* If no options then force header option information on */
 
     for (f = 0, i = 0; i < MAXOPT; i++)
@@ -206,6 +255,14 @@ static void show_help(const char* program)
         "\t-s Display Inform symbolic names in object and grammar displays\n");
     (void)fprintf(stderr, "\t-u <file> Display symbols from file in object and "
                           "grammar displays (implies -s)\n");
+    (void)fprintf(stderr, "\t-r   one JSON record per story: header, checksum, "
+                          "dictionary and object counts\n");
+    (void)fprintf(stderr, "\t-J   one line of JSON per story: header, "
+                          "dictionary, verbs and objects\n");
+    (void)fprintf(stderr, "\t-V   the dictionary words and their types, one "
+                          "per line (also --vocab)\n");
+    (void)fprintf(stderr, "\t-j n number of stories to process at once with "
+                          "-r, -J or -V (default: one per CPU)\n");
 
 } /* show_help */
 
@@ -248,50 +305,175 @@ static void process_story(const char* name, int* options, int columns,
 } /* process_story */
 
 /*
- * fix_dictionary
+ * process_records
  *
- * Fix the end of text flag for each word in the dictionary. Some older games
- * are missing the end of text flag on some words. All the words are fixed up
- * so that they can be printed.
+ * Show a record for each story with show_record or show_json. Where fork is available the stories are
+ * processed by up to jobs child processes at once; their records are still
+ * printed in command line order, and a story that cannot be read gets an
+ * error record instead of stopping the run.
  */
 
-static void fix_dictionary(void)
+static void process_records(char* names[], int count, int jobs,
+                            void (*show)(const char*))
 {
-    unsigned long address;
-    int separator_count, word_size, word_count, i;
-
-    address = header.dictionary;
-    separator_count = read_data_byte(&address);
-    address += separator_count;
-    word_size = read_data_byte(&address);
-    word_count = read_data_word(&address);
-
-    for (i = 1; i <= word_count; i++) {
-
-        /* Check that the word is in non-paged memory before writing */
-
-        if ((address + 4) < (unsigned long)header.resident_size) {
-            if ((unsigned int)header.version <= V3) {
-                set_byte(address + 2,
-                         (unsigned int)get_byte(address + 2) | 0x80);
-            } else {
-                set_byte(address + 4,
-                         (unsigned int)get_byte(address + 4) | 0x80);
+#ifdef HAS_FORK
+    pid_t* pids;
+    int *fds, fd[2], started, done, status, got;
+    char buffer[BUFSIZ];
+    ssize_t n;
+
+    if (jobs <= 0) jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs <= 0) jobs = 1;
+
+    pids = (pid_t*)malloc(count * sizeof(pid_t));
+    fds = (int*)malloc(count * sizeof(int));
+    if (pids == NULL || fds == NULL) {
+        (void)fprintf(stderr, "\nFatal: insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    (void)fflush(stdout);
+    for (started = 0, done = 0; done < count; done++) {
+        for (; started < count && started - done < jobs; started++) {
+            if (pipe(fd) != 0 || (pids[started] = fork()) < 0) {
+                perror("infodump");
+                exit(EXIT_FAILURE);
+            }
+            if (pids[started] == 0) {
+                (void)close(fd[0]);
+                (void)dup2(fd[1], STDOUT_FILENO);
+                (void)close(fd[1]);
+                show(names[started]);
+                (void)fflush(stdout);
+                _exit(EXIT_SUCCESS);
             }
+            (void)close(fd[1]);
+            fds[started] = fd[0];
         }
 
-        address += word_size;
+        got = 0;
+        while ((n = read(fds[done], buffer, sizeof(buffer))) > 0) {
+            (void)fwrite(buffer, 1, (size_t)n, stdout);
+            got = 1;
+        }
+        (void)close(fds[done]);
+        (void)waitpid(pids[done], &status, 0);
+        if (!got || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            (void)printf("{\"story\":");
+            print_json_string(names[done]);
+            (void)printf(",\"error\":\"cannot read story\"}\n");
+        }
+        (void)fflush(stdout);
     }
 
-} /* fix_dictionary */
+    free(pids);
+    free(fds);
+#else
+    int i;
+
+    for (i = 0; i < count; i++)
+        show(names[i]);
+#endif
+
+} /* process_records */
+
+/*
+ * show_record
+ *
+ * Print one line of JSON describing a story. The checksum is worked out
+ * before fix_dictionary touches the story data.
+ */
+
+static void show_record(const char* name)
+{
+    unsigned int checksum, word_count, obj_count, i;
+    unsigned long base, end, data_base, data_end;
+
+    open_story(name);
+
+    configure(V1, V8);
+
+    load_cache();
+
+    checksum = story_checksum();
+
+    configure_dictionary(&word_count, &base, &end);
+    configure_object_tables(&obj_count, &base, &end, &data_base, &data_end);
+
+    (void)printf("{\"story\":");
+    print_json_string(name);
+    (void)printf(",\"version\":%u,\"release\":%u,\"serial\":\"",
+                 (unsigned int)header.version, (unsigned int)header.release);
+    for (i = 0; i < sizeof(header.serial); i++)
+        (void)putchar(isalnum(header.serial[i]) ? header.serial[i] : '-');
+    (void)printf("\",\"file_size\":%lu,\"checksum\":%u,\"checksum_ok\":%s",
+                 file_size, (unsigned int)header.checksum,
+                 (checksum == (unsigned int)header.checksum) ? "true" : "false");
+    (void)printf(",\"dictionary_words\":%u,\"objects\":%u}\n", word_count,
+                 obj_count);
+
+    close_story();
+
+} /* show_record */
+
+/*
+ * show_json
+ *
+ * Print one line of JSON with the header, dictionary and objects of a
+ * story, for programs that would otherwise have to parse the displays.
+ * Nothing goes through tx_printf, so the width and wrapping settings do not
+ * apply.
+ */
+
+static void show_json(const char* name)
+{
+
+    open_story(name);
+
+    configure(V1, V8);
+
+    load_cache();
+
+    fix_dictionary();
+
+    (void)printf("{\"story\":");
+    print_json_string(name);
+    show_header_json();
+    show_dictionary_json();
+    show_objects_json();
+    (void)printf("}\n");
+
+    close_story();
+
+} /* show_json */
+
+/*
+ * show_vocab
+ *
+ * Print the words of the dictionary with their word types, see
+ * show_vocabulary.
+ */
+
+static void show_vocab(const char* name)
+{
+
+    open_story(name);
+
+    configure(V1, V8);
+
+    load_cache();
+
+    fix_dictionary();
+
+    show_vocabulary();
+
+    close_story();
+
+} /* show_vocab */
 
-extern void configure_dictionary(unsigned int*, unsigned long*, unsigned long*);
 extern void configure_abbreviations(unsigned int*, unsigned long*,
                                     unsigned long*, unsigned long*,
                                     unsigned long*);
-extern void configure_object_tables(unsigned int*, unsigned long*,
-                                    unsigned long*, unsigned long*,
-                                    unsigned long*);
 
 static int compare_area(const void*, const void*);
 
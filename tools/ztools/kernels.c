@@ -0,0 +1,158 @@
+/*
+ * kernels - microbenchmarks for the ztools decoders
+ *
+ * Times decode_text_span() on its own, over the abbreviations, dictionary
+ * words and object names of each story, and reports the time per string
+ * and the rate at which packed text is decoded:
+ *
+ *     kernels zork.z3 anchor.z8
+ */
+
+#include "tx.h"
+
+#include <time.h>
+
+extern void configure_dictionary(unsigned int*, unsigned long*, unsigned long*);
+extern void configure_abbreviations(unsigned int*, unsigned long*,
+                                    unsigned long*, unsigned long*,
+                                    unsigned long*);
+
+/* The passes over a story are repeated until they took this long */
+
+#define KERNEL_TIME 0.25
+
+/*
+ * now
+ *
+ * Return a monotonic time in seconds.
+ */
+
+static double now(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+
+} /* now */
+
+/*
+ * collect_strings
+ *
+ * Store the addresses of the abbreviations, dictionary words and object
+ * names of the open story in strings, which has room for max of them.
+ * Returns the number stored.
+ */
+
+static unsigned int collect_strings(unsigned long* strings, unsigned int max)
+{
+    unsigned long address, base, end, data_base, data_end;
+    unsigned int count, n = 0, i, size, defaults, offset;
+
+    configure_abbreviations(&count, &base, &end, &data_base, &data_end);
+    for (i = 0, address = base; i < count && n < max; i++)
+        strings[n++] = (unsigned long)read_data_word(&address) * 2;
+
+    configure_dictionary(&count, &base, &end);
+    address = base;
+    address += read_data_byte(&address);
+    size = read_data_byte(&address);
+    address += 2;
+    for (i = 0; i < count && n < max; i++, address += size)
+        strings[n++] = address;
+
+    /* Objects follow the property defaults, see configure_object_tables */
+
+    configure_object_tables(&count, &base, &end, &data_base, &data_end);
+    if ((unsigned int)header.version < V4) {
+        defaults = 31;
+        size = 9;
+        offset = 7;
+    } else {
+        defaults = 63;
+        size = 14;
+        offset = 12;
+    }
+    for (i = 0; i < count && n < max; i++) {
+        address = base + defaults * 2 + i * size + offset;
+        address = read_data_word(&address);
+        if (read_data_byte(&address)) strings[n++] = address;
+    }
+
+    return (n);
+
+} /* collect_strings */
+
+/*
+ * bench_story
+ *
+ * Decode the strings of one story until KERNEL_TIME has passed.
+ */
+
+static void bench_story(const char* name)
+{
+    unsigned long *strings, address, bytes = 0;
+    unsigned int count, i, passes = 0;
+    const char* text;
+    int length;
+    double start, elapsed;
+    const char* game = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+
+    open_story(name);
+    configure(V1, V8);
+    load_cache();
+
+    strings = (unsigned long*)malloc(0x10000 * sizeof(unsigned long));
+    if (strings == NULL) {
+        (void)fprintf(stderr, "\nFatal: insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+    count = collect_strings(strings, 0x10000);
+
+    start = now();
+    do {
+        for (i = 0; i < count; i++) {
+            address = strings[i];
+            (void)decode_text_span(&address, &text, &length);
+            bytes += address - strings[i];
+        }
+        passes++;
+    } while ((elapsed = now() - start) < KERNEL_TIME && count);
+
+    (void)printf("%-20s %-18s %8u %10.1f %9.2f\n", "decode_text", game, count,
+                 count ? elapsed * 1e9 / ((double)count * passes) : 0.0,
+                 elapsed > 0 ? bytes / elapsed / 1e6 : 0.0);
+
+    free(strings);
+    close_story();
+
+} /* bench_story */
+
+/*
+ * main
+ *
+ * Benchmark each story file named on the command line.
+ */
+
+int main(int argc, char* argv[])
+{
+    int i;
+
+    if (argc < 2) {
+        (void)fprintf(stderr, "usage: %s story-file [story-file...]\n",
+                      argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    (void)printf("%-20s %-18s %8s %10s %9s\n", "kernel", "game", "ops",
+                 "ns/op", "MB/s");
+    for (i = 1; i < argc; i++)
+        bench_story(argv[i]);
+
+    return EXIT_SUCCESS;
+
+} /* main */
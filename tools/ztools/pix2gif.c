@@ -4,7 +4,7 @@
  *
  * Converts Infocom MG1/EG1 picture files to separate GIF files.
  *
- * usage: pix2gif picture-file
+ * usage: pix2gif [-j n] [-f gif|png|raw] [-s n] picture-file
  *
  * Mark Howell 13 September 1992 howell_ma@movies.enet.dec.com
  *
@@ -14,9 +14,40 @@
  *    Fix 64KB MS-DOS problems
  *    Handle transparent colours properly
  *    Put transparency information into GIF (now version 89a)
+ *    Open addressed code table and byte at a time LZW output
+ *    Convert pictures in parallel with -j
+ *    Write PNG or raw indexed files with -f
+ *    Upscale with Scale2x/Scale3x with -s
  */
 
 #include "pix2gif.h"
+#include <string.h>
+
+/* the pictures may come from a game bundle, see tools/bundle/bundle.h */
+#ifdef HAS_BUNDLE
+#    include "bundle.h"
+#else
+#    define bundle_fopen(f) fopen(f, "rb")
+#endif
+#ifdef HAS_ZLIB
+#    include <zlib.h>
+#endif
+/* -s upscales the pictures, see tools/scale/scale.h */
+#ifdef HAS_SCALE
+#    include "scale.h"
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#    include <sys/wait.h>
+#    include <unistd.h>
+#    define HAS_FORK
+#endif
+
+#define SHOW_IMAGE 1
+#define CONVERT_IMAGE 2
+
+#define FORMAT_GIF 0
+#define FORMAT_PNG 1
+#define FORMAT_RAW 2
 
 #ifdef __MSDOS__
 #    include <alloc.h>
@@ -38,26 +69,41 @@ static unsigned char ega_colourmap[16][3] = {
 #if defined(AMIGA) && defined(_DCC)
 __far
 #endif
-    static nlist_t* hash_table[HASH_SIZE];
+    static long hash_key[HASH_SIZE];
+static short hash_code[HASH_SIZE];
 static unsigned char colourmap[16][3];
 static unsigned char code_buffer[CODE_TABLE_SIZE];
 static char file_name[FILENAME_MAX + 1];
+static int output_format = FORMAT_GIF;
+static int scale_factor = 1;
+static int scale_threads = 0;
+static unsigned long crc_table[256];
 static short code_table[CODE_TABLE_SIZE][2];
 static unsigned char buffer[CODE_TABLE_SIZE];
 
-static void process_image(FILE*, pdirectory_t*);
+static void process_image(FILE*, pdirectory_t*, int);
+#ifdef HAS_FORK
+static void convert_images(const char*, pdirectory_t*, int, int);
+#endif
 static void decompress_image(FILE*, image_t*);
 static short read_code(FILE*, compress_t*);
 static void write_file(int, image_t*);
+static void write_gif(FILE*, image_t*);
+static void write_png(FILE*, image_t*);
+static void write_chunk(FILE*, const char*, const unsigned char*, unsigned long);
+static unsigned long update_crc(unsigned long, const unsigned char*,
+                                unsigned long);
+static unsigned char* deflate_rows(image_t*, unsigned long*);
+static void write_raw(FILE*, image_t*);
 static void write_screen(FILE*, image_t*);
 static void write_graphic_control(FILE*, image_t*);
 static void write_image(FILE*, image_t*);
 static void compress_image(FILE*, image_t*);
 static void write_code(FILE*, short, compress_t*);
+static void flush_code(FILE*, compress_t*);
 static void insert_code(short, short, short);
 static short lookup(short, short);
 static void clear_table(void);
-static void delete_table(void);
 static unsigned char read_byte(FILE*);
 static void write_byte(FILE*, int);
 static unsigned short read_word(FILE*);
@@ -67,21 +113,61 @@ static void write_bytes(FILE*, int, const void*);
 
 int main(int argc, char* argv[])
 {
-    int i;
+    int i, arg, jobs = 1;
     FILE* fp;
+    const char* name;
     header_t header;
     pdirectory_t* directory;
 
-    if (argc != 2) {
-        (void)fprintf(stderr, "usage: %s picture-file\n\n", argv[0]);
+    for (arg = 1; arg + 2 < argc && argv[arg][0] == '-'; arg += 2) {
+        if (strcmp(argv[arg], "-j") == 0)
+            jobs = atoi(argv[arg + 1]);
+        else if (strcmp(argv[arg], "-f") == 0 &&
+                 strcmp(argv[arg + 1], "gif") == 0)
+            output_format = FORMAT_GIF;
+        else if (strcmp(argv[arg], "-f") == 0 &&
+                 strcmp(argv[arg + 1], "png") == 0)
+            output_format = FORMAT_PNG;
+        else if (strcmp(argv[arg], "-f") == 0 &&
+                 strcmp(argv[arg + 1], "raw") == 0)
+            output_format = FORMAT_RAW;
+#ifdef HAS_SCALE
+        else if (strcmp(argv[arg], "-s") == 0 &&
+                 atoi(argv[arg + 1]) >= SCALE_MIN &&
+                 atoi(argv[arg + 1]) <= SCALE_MAX)
+            scale_factor = atoi(argv[arg + 1]);
+#endif
+        else
+            jobs = 0;
+    }
+    /* the bands of a picture get threads if there are no other processes */
+    scale_threads = jobs > 1 ? 1 : 0;
+
+    if (arg != argc - 1 || jobs < 1) {
+        (void)fprintf(stderr,
+                      "usage: %s [-j n] [-f format] [-s n] picture-file\n\n",
+                      argv[0]);
         (void)fprintf(stderr,
                       "PIX2GIF version 7/2 - convert Infocom MG1/EG1 files "
                       "to GIF. By Mark Howell\n");
         (void)fprintf(stderr, "Works with V6 Infocom games.\n");
+        (void)fprintf(stderr, "\n\t-j n convert images using n processes\n");
+        (void)fprintf(stderr,
+                      "\t-f format write gif (default), png or raw files\n");
+#ifdef HAS_SCALE
+        (void)fprintf(stderr,
+                      "\t-s n upscale the images n times (2 to 4) with "
+                      "Scale2x/Scale3x\n");
+#endif
         exit(EXIT_FAILURE);
     }
 
-    if ((fp = fopen(argv[1], "rb")) == NULL) {
+    name = argv[arg];
+#ifdef HAS_BUNDLE
+    /* a game bundle holds the picture file as "graphics" */
+    if (bundle_open(name)) name = "graphics";
+#endif
+    if ((fp = bundle_fopen(name)) == NULL) {
         perror("fopen");
         exit(EXIT_FAILURE);
     }
@@ -122,8 +208,16 @@ int main(int argc, char* argv[])
             (void)read_byte(fp);
         }
     }
-    for (i = 0; (unsigned int)i < (unsigned int)header.images; i++)
-        process_image(fp, &directory[i]);
+#ifdef HAS_FORK
+    if (jobs > 1) {
+        for (i = 0; (unsigned int)i < (unsigned int)header.images; i++)
+            process_image(fp, &directory[i], SHOW_IMAGE);
+        (void)fflush(stdout);
+        convert_images(name, directory, (int)header.images, jobs);
+    } else
+#endif
+        for (i = 0; (unsigned int)i < (unsigned int)header.images; i++)
+            process_image(fp, &directory[i], SHOW_IMAGE | CONVERT_IMAGE);
     free(directory);
     (void)fclose(fp);
 
@@ -133,7 +227,7 @@ int main(int argc, char* argv[])
 
 } /* main */
 
-static void process_image(FILE* fp, pdirectory_t* directory)
+static void process_image(FILE* fp, pdirectory_t* directory, int mode)
 {
     int colours = 16, i;
     image_t image;
@@ -163,26 +257,31 @@ static void process_image(FILE* fp, pdirectory_t* directory)
         colourmap[directory->image_flags >> 12][2] = 0;
     }
 
-    (void)printf("pic %03d   size %3d x %3d   %2d colours   colour map ",
-                 (int)directory->image_number, (int)directory->image_width,
-                 (int)directory->image_height, (int)colours);
-
-    if (directory->image_cm_addr != 0)
-        (void)printf("$%05lx", (long)directory->image_cm_addr);
-    else
-        (void)printf("------");
-
     if (directory->image_flags & 1) {
         image.transflag = 1;
         image.transpixel = (unsigned short)directory->image_flags >> 12;
-        (void)printf("   transparent is %u\n", image.transpixel);
     } else {
         image.transpixel = 0;
         image.transflag = 0;
-        (void)printf("\n");
     }
 
-    if (directory->image_data_addr == 0) return;
+    if (mode & SHOW_IMAGE) {
+        (void)printf("pic %03d   size %3d x %3d   %2d colours   colour map ",
+                     (int)directory->image_number, (int)directory->image_width,
+                     (int)directory->image_height, (int)colours);
+
+        if (directory->image_cm_addr != 0)
+            (void)printf("$%05lx", (long)directory->image_cm_addr);
+        else
+            (void)printf("------");
+
+        if (image.transflag)
+            (void)printf("   transparent is %u\n", image.transpixel);
+        else
+            (void)printf("\n");
+    }
+
+    if (!(mode & CONVERT_IMAGE) || directory->image_data_addr == 0) return;
 
     image.width = directory->image_width;
     image.height = directory->image_height;
@@ -202,12 +301,66 @@ static void process_image(FILE* fp, pdirectory_t* directory)
     }
     decompress_image(fp, &image);
 
+#ifdef HAS_SCALE
+    if (scale_factor > 1) {
+        unsigned char* scaled = scale_alloc(image.image, image.width,
+                                            image.height, scale_factor,
+                                            scale_threads);
+        if (scaled == NULL) {
+            (void)fprintf(stderr, "Insufficient memory\n");
+            exit(EXIT_FAILURE);
+        }
+        free(image.image);
+        image.image = scaled;
+        image.width *= scale_factor;
+        image.height *= scale_factor;
+        image.pixels = (long)image.width * image.height;
+    }
+#endif
+
     write_file((int)directory->image_number, &image);
 
     free(image.image);
 
 } /* process image */
 
+#ifdef HAS_FORK
+
+/* Convert the images in jobs child processes, each with its own file handle
+   and tables. Child k converts images k, k + jobs, k + 2 * jobs... */
+
+static void convert_images(const char* name, pdirectory_t* directory,
+                           int images, int jobs)
+{
+    int i, k, status, failed = 0;
+    pid_t pid;
+    FILE* fp;
+
+    for (k = 0; k < jobs && k < images; k++) {
+        if ((pid = fork()) == -1) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            if ((fp = bundle_fopen(name)) == NULL) {
+                perror("fopen");
+                exit(EXIT_FAILURE);
+            }
+            for (i = k; i < images; i += jobs)
+                process_image(fp, &directory[i], CONVERT_IMAGE);
+            (void)fclose(fp);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    while (wait(&status) != -1)
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+            failed = 1;
+    if (failed) exit(EXIT_FAILURE);
+
+} /* convert_images */
+
+#endif /* HAS_FORK */
+
 static void decompress_image(FILE* fp, image_t* image)
 {
     int i;
@@ -289,15 +442,34 @@ static short read_code(FILE* fp, compress_t* comp)
 
 static void write_file(int image_number, image_t* image)
 {
+    static const char* extension[] = {"gif", "png", "raw"};
     FILE* fp;
 
-    (void)sprintf(file_name, "pix%03d.gif", (int)image_number);
+    (void)sprintf(file_name, "pix%03d.%s", (int)image_number,
+                  extension[output_format]);
 
     if ((fp = fopen(file_name, "wb")) == NULL) {
         perror("fopen");
         exit(EXIT_FAILURE);
     }
 
+    if (output_format == FORMAT_PNG)
+        write_png(fp, image);
+    else if (output_format == FORMAT_RAW)
+        write_raw(fp, image);
+    else
+        write_gif(fp, image);
+
+    if (fclose(fp) != 0) {
+        perror("fclose");
+        exit(EXIT_FAILURE);
+    }
+
+} /* write_file */
+
+static void write_gif(FILE* fp, image_t* image)
+{
+
     write_bytes(fp, sig_k_bln, (const void*)CURRENT_VERSION);
     write_screen(fp, image);
     if (image->transflag) /* save 8 bytes if possible */
@@ -306,9 +478,199 @@ static void write_file(int image_number, image_t* image)
     compress_image(fp, image);
     write_byte(fp, ';');
 
-    (void)fclose(fp);
+} /* write_gif */
 
-} /* write_file */
+/* Write an 8 bit indexed PNG with the full 16 entry palette, and a tRNS
+   chunk for the transparent colour. */
+
+static void write_png(FILE* fp, image_t* image)
+{
+    static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    unsigned char chunk[16 * 3], *data;
+    unsigned long size;
+    int i;
+
+    write_bytes(fp, 8, (const void*)signature);
+
+    chunk[0] = chunk[1] = 0;
+    chunk[2] = (unsigned char)(image->width >> 8);
+    chunk[3] = (unsigned char)image->width;
+    chunk[4] = chunk[5] = 0;
+    chunk[6] = (unsigned char)(image->height >> 8);
+    chunk[7] = (unsigned char)image->height;
+    chunk[8] = 8;   /* bit depth */
+    chunk[9] = 3;   /* indexed colour */
+    chunk[10] = 0;  /* deflate */
+    chunk[11] = 0;  /* adaptive filtering */
+    chunk[12] = 0;  /* not interlaced */
+    write_chunk(fp, "IHDR", chunk, 13);
+
+    write_chunk(fp, "PLTE", (const unsigned char*)image->colourmap, 16 * 3);
+
+    if (image->transflag) {
+        for (i = 0; i <= (int)image->transpixel; i++)
+            chunk[i] = 255;
+        chunk[image->transpixel] = 0;
+        write_chunk(fp, "tRNS", chunk, (unsigned long)image->transpixel + 1);
+    }
+
+    data = deflate_rows(image, &size);
+    write_chunk(fp, "IDAT", data, size);
+    free(data);
+
+    write_chunk(fp, "IEND", NULL, 0);
+
+} /* write_png */
+
+static void write_chunk(FILE* fp, const char* type, const unsigned char* data,
+                        unsigned long size)
+{
+    unsigned char word[4];
+    unsigned long crc;
+
+    word[0] = (unsigned char)(size >> 24);
+    word[1] = (unsigned char)(size >> 16);
+    word[2] = (unsigned char)(size >> 8);
+    word[3] = (unsigned char)size;
+    write_bytes(fp, 4, (const void*)word);
+    write_bytes(fp, 4, (const void*)type);
+    if (size) write_bytes(fp, (int)size, (const void*)data);
+
+    crc = update_crc(0xffffffffUL, (const unsigned char*)type, 4);
+    crc = update_crc(crc, data, size) ^ 0xffffffffUL;
+    word[0] = (unsigned char)(crc >> 24);
+    word[1] = (unsigned char)(crc >> 16);
+    word[2] = (unsigned char)(crc >> 8);
+    word[3] = (unsigned char)crc;
+    write_bytes(fp, 4, (const void*)word);
+
+} /* write_chunk */
+
+static unsigned long update_crc(unsigned long crc, const unsigned char* data,
+                                unsigned long size)
+{
+    unsigned long c;
+    int i, j;
+
+    if (crc_table[1] == 0) {
+        for (i = 0; i < 256; i++) {
+            c = (unsigned long)i;
+            for (j = 0; j < 8; j++)
+                c = (c & 1) ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+            crc_table[i] = c;
+        }
+    }
+    while (size--)
+        crc = crc_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+    return (crc & 0xffffffffUL);
+
+} /* update_crc */
+
+/* Return the image rows, each preceded by filter byte 0, as a zlib stream.
+   Without zlib the rows go into stored deflate blocks. */
+
+static unsigned char* deflate_rows(image_t* image, unsigned long* size)
+{
+    unsigned char *rows, *data;
+    unsigned long length, i, y;
+#ifdef HAS_ZLIB
+    uLongf zsize;
+#else
+    unsigned long a, b, block, out;
+#endif
+
+    length = ((unsigned long)image->width + 1) * (unsigned long)image->height;
+    if ((rows = (unsigned char*)malloc((size_t)length)) == NULL) {
+        (void)fprintf(stderr, "Insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0, y = 0; y < (unsigned long)image->height; y++) {
+        rows[i++] = 0;
+        memcpy(rows + i, image->image + y * (unsigned long)image->width,
+               (size_t)image->width);
+        i += (unsigned long)image->width;
+    }
+
+#ifdef HAS_ZLIB
+    zsize = compressBound((uLong)length);
+    if ((data = (unsigned char*)malloc((size_t)zsize)) == NULL) {
+        (void)fprintf(stderr, "Insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+    if (compress2(data, &zsize, rows, (uLong)length, Z_BEST_COMPRESSION) !=
+        Z_OK) {
+        (void)fprintf(stderr, "compress2 failed\n");
+        exit(EXIT_FAILURE);
+    }
+    *size = (unsigned long)zsize;
+#else
+    if ((data = (unsigned char*)malloc(
+             (size_t)(length + (length / 65535 + 1) * 5 + 6))) == NULL) {
+        (void)fprintf(stderr, "Insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+    out = 0;
+    data[out++] = 0x78;
+    data[out++] = 0x01;
+    i = 0;
+    do {
+        block = (length - i > 65535) ? 65535 : length - i;
+        data[out++] = (unsigned char)(i + block == length);
+        data[out++] = (unsigned char)block;
+        data[out++] = (unsigned char)(block >> 8);
+        data[out++] = (unsigned char)~block;
+        data[out++] = (unsigned char)(~block >> 8);
+        memcpy(data + out, rows + i, (size_t)block);
+        out += block;
+        i += block;
+    } while (i < length);
+    for (a = 1, b = 0, i = 0; i < length; i++) {
+        a = (a + rows[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    data[out++] = (unsigned char)(b >> 8);
+    data[out++] = (unsigned char)b;
+    data[out++] = (unsigned char)(a >> 8);
+    data[out++] = (unsigned char)a;
+    *size = out;
+#endif
+
+    free(rows);
+
+    return (data);
+
+} /* deflate_rows */
+
+/* Raw files are a 64 byte header followed by one palette index per pixel, so
+   the pixels can be mapped straight from the file. All fields are little
+   endian:
+
+   0   "ZPIX"
+   4   width, height, colours
+   10  transparent colour, or 0xffff if none
+   12  reserved, zero
+   16  16 palette entries of red, green, blue
+   64  width * height pixels, row by row */
+
+static void write_raw(FILE* fp, image_t* image)
+{
+    static unsigned char zero[4];
+    long y;
+
+    write_bytes(fp, 4, (const void*)"ZPIX");
+    write_word(fp, (unsigned short)image->width);
+    write_word(fp, (unsigned short)image->height);
+    write_word(fp, (unsigned short)image->colours);
+    write_word(fp, image->transflag ? image->transpixel : 0xffff);
+    write_bytes(fp, 4, (const void*)zero);
+    write_bytes(fp, 16 * 3, (const void*)image->colourmap);
+    if (image->width)
+        for (y = 0; y < image->height; y++)
+            write_bytes(fp, image->width,
+                        (const void*)(image->image + y * image->width));
+
+} /* write_raw */
 
 static void write_screen(FILE* fp, image_t* image)
 {
@@ -373,9 +735,9 @@ static void compress_image(FILE* fp, image_t* image)
 
     comp.next_code = clear_code + 2;
     comp.slen = init_comp_size;
-    comp.sptr = 0;
-    comp.tlen = 255 * 8;
-    comp.tptr = 8;
+    comp.tptr = 1; /* next byte of code_buffer, after the block size */
+    comp.bits = 0;
+    comp.nbits = 0;
 
     write_byte(fp, init_comp_size - 1);
     write_code(fp, clear_code, &comp);
@@ -388,7 +750,7 @@ static void compress_image(FILE* fp, image_t* image)
         } else {
             write_code(fp, prefix, &comp);
             if (comp.next_code == 4096) {
-                delete_table();
+                clear_table();
                 comp.next_code = clear_code + 2;
                 write_code(fp, clear_code, &comp);
                 comp.slen = init_comp_size;
@@ -399,74 +761,70 @@ static void compress_image(FILE* fp, image_t* image)
     }
     write_code(fp, prefix, &comp);
     write_code(fp, (short)(clear_code + 1), &comp);
-    if (comp.tptr) {
-        code_buffer[0] = (unsigned char)((comp.tptr + 7) >> 3);
-        write_bytes(fp, (int)code_buffer[0] + 1, (const void*)code_buffer);
-    }
+    flush_code(fp, &comp);
+    code_buffer[0] = (unsigned char)comp.tptr;
+    write_bytes(fp, (int)code_buffer[0] + 1, (const void*)code_buffer);
     write_byte(fp, 0);
-    delete_table();
 
 } /* compress_image */
 
 static void write_code(FILE* fp, short code, compress_t* comp)
 {
-    short bsize, slen, sptr;
 
-    slen = comp->slen;
-    sptr = 0;
+    /* Codes are packed low bits first into 255 byte data blocks. A full block
+       is only written once more output follows it, see compress_image */
 
-    while (slen) {
-        if (comp->tlen == 0) {
+    comp->bits |= (unsigned long)code << comp->nbits;
+    comp->nbits += comp->slen;
+    while (comp->nbits >= 8) {
+        if (comp->tptr == 256) {
             write_bytes(fp, 256, (const void*)code_buffer);
-            comp->tlen = 255 * 8;
-            comp->tptr = 8;
+            comp->tptr = 1;
         }
-        bsize = ((comp->tptr + 8) & ~7) - comp->tptr;
-        bsize = (slen > bsize) ? bsize : slen;
-
-        code_buffer[comp->tptr >> 3] =
-            (unsigned char)((unsigned int)code_buffer[comp->tptr >> 3] &
-                            mask[comp->tptr & 7]);
-        code_buffer[comp->tptr >> 3] =
-            (unsigned char)((unsigned int)code_buffer[comp->tptr >> 3] |
-                            ((code >> sptr) & mask[bsize]) << (comp->tptr & 7));
-
-        slen -= bsize;
-        sptr += bsize;
-        comp->tlen -= bsize;
-        comp->tptr += bsize;
+        code_buffer[comp->tptr++] = (unsigned char)(comp->bits & 0xff);
+        comp->bits >>= 8;
+        comp->nbits -= 8;
     }
     if ((comp->next_code == (mask[comp->slen] + 1)) && (comp->slen < 12))
         comp->slen++;
 
 } /* write_code */
 
-static void insert_code(short prefix, short pixel, short code)
+static void flush_code(FILE* fp, compress_t* comp)
 {
-    short hashval;
-    nlist_t* np;
 
-    if ((np = (nlist_t*)malloc(sizeof(*np))) == NULL) {
-        (void)fprintf(stderr, "Insufficient memory\n");
-        exit(EXIT_FAILURE);
+    if (comp->nbits) {
+        if (comp->tptr == 256) {
+            write_bytes(fp, 256, (const void*)code_buffer);
+            comp->tptr = 1;
+        }
+        code_buffer[comp->tptr++] = (unsigned char)(comp->bits & 0xff);
+        comp->bits = 0;
+        comp->nbits = 0;
     }
-    hashval = (short)hashfunc(prefix, pixel);
-    np->next = (nlist_t*)hash_table[hashval];
-    hash_table[hashval] = np;
-    np->prefix = prefix;
-    np->pixel = pixel;
-    np->code = code;
+
+} /* flush_code */
+
+static void insert_code(short prefix, short pixel, short code)
+{
+    long i;
+
+    for (i = hashfunc(prefix, pixel); hash_key[i] != -1;
+         i = (i + 1) & (HASH_SIZE - 1))
+        ;
+    hash_key[i] = hashkey(prefix, pixel);
+    hash_code[i] = code;
 
 } /* insert_code */
 
 static short lookup(short prefix, short pixel)
 {
-    short hashval;
-    nlist_t* np;
+    long i, key;
 
-    hashval = (short)hashfunc(prefix, pixel);
-    for (np = hash_table[hashval]; np != NULL; np = (nlist_t*)np->next)
-        if ((np->prefix == prefix) && (np->pixel == pixel)) return (np->code);
+    key = hashkey(prefix, pixel);
+    for (i = hashfunc(prefix, pixel); hash_key[i] != -1;
+         i = (i + 1) & (HASH_SIZE - 1))
+        if (hash_key[i] == key) return (hash_code[i]);
 
     return (0);
 
@@ -477,25 +835,10 @@ static void clear_table(void)
     int i;
 
     for (i = 0; i < HASH_SIZE; i++)
-        hash_table[i] = NULL;
+        hash_key[i] = -1;
 
 } /* clear_table */
 
-static void delete_table(void)
-{
-    int i;
-    nlist_t *np, *tp;
-
-    for (i = 0; i < HASH_SIZE; i++) {
-        for (np = hash_table[i]; np != NULL; np = tp) {
-            tp = (nlist_t*)np->next;
-            free(np);
-        }
-        hash_table[i] = NULL;
-    }
-
-} /* delete_table */
-
 static unsigned char read_byte(FILE* fp)
 {
     int c;
@@ -42,8 +42,9 @@
 #define GREEN 1
 #define BLUE 2
 #define CURRENT_VERSION "GIF89a"
-#define HASH_SIZE 8192
-#define hashfunc(a, b) ((long)((long)(a) + (long)(b)) % HASH_SIZE)
+#define HASH_SIZE 8192 /* power of two, at least twice CODE_TABLE_SIZE */
+#define hashfunc(a, b) ((((long)(b) << 5) ^ (long)(a)) & (HASH_SIZE - 1))
+#define hashkey(a, b) (((long)(a) << 8) | (long)(b))
 
 typedef struct header_s
 {
@@ -92,16 +93,10 @@ typedef struct compress_s
     short sptr;
     short tlen;
     short tptr;
+    unsigned long bits; /* encoder bits not yet in code_buffer */
+    short nbits;
 } compress_t;
 
-typedef struct nlist_s
-{
-    struct nlist_s* next;
-    short prefix;
-    short pixel;
-    short code;
-} nlist_t;
-
 #define sig_k_bln 6
 
 struct sigdef
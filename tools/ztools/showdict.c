@@ -9,6 +9,8 @@
 void configure_dictionary(unsigned int*, unsigned long*, unsigned long*);
 void configure_abbreviations(unsigned int*, unsigned long*, unsigned long*,
                              unsigned long*, unsigned long*);
+static int inform_dictionary(void);
+static int word_flags(int, int, const char*[]);
 
 /*
  * show_dictionary
@@ -21,9 +23,10 @@ void show_dictionary(int columns)
 {
     unsigned long dict_address, word_address, word_table_base, word_table_end;
     unsigned int separator_count, word_size, word_count, length;
-    int i, flag;
-    int inform_flags = 0;
+    int i, flag, count;
+    int inform_flags;
     int dictpar1;
+    const char* flags[MAX_WORD_FLAGS];
 
     /* Force default column count if none specified */
 
@@ -33,15 +36,7 @@ void show_dictionary(int columns)
 
     configure_dictionary(&word_count, &word_table_base, &word_table_end);
 
-    if (header.serial[0] >= '0' && header.serial[0] <= '9' &&
-        header.serial[1] >= '0' && header.serial[1] <= '9' &&
-        header.serial[2] >= '0' && header.serial[2] <= '1' &&
-        header.serial[3] >= '0' && header.serial[3] <= '9' &&
-        header.serial[4] >= '0' && header.serial[4] <= '3' &&
-        header.serial[5] >= '0' && header.serial[5] <= '9' &&
-        header.serial[0] != '8') {
-        inform_flags = TRUE;
-    }
+    inform_flags = inform_dictionary();
 
     tx_printf("\n    **** Dictionary ****\n\n");
 
@@ -98,45 +93,241 @@ void show_dictionary(int columns)
             }
             tx_printf("]");
 
-            if (inform_flags) {
-                if (dictpar1 & NOUN) tx_printf(" <noun>");
-                if (dictpar1 & PREP) tx_printf(" <prep>");
-                if (dictpar1 & PLURAL) tx_printf(" <plural>");
-                if (dictpar1 & META) tx_printf(" <meta>");
-                if (dictpar1 & VERB_INFORM) tx_printf(" <verb>");
-            } else if (header.version != V6) {
-                flag = dictpar1 & DATA_FIRST;
-                switch (flag) {
-                case DIR_FIRST:
-                    if (dictpar1 & DIR) tx_printf(" <dir>");
-                    break;
-                case ADJ_FIRST:
-                    if (dictpar1 & DESC) tx_printf(" <adj>");
-                    break;
-                case VERB_FIRST:
-                    if (dictpar1 & VERB) tx_printf(" <verb>");
-                    break;
-                case PREP_FIRST:
-                    if (dictpar1 & PREP) tx_printf(" <prep>");
-                    break;
-                }
-                if ((dictpar1 & DIR) && (flag != DIR_FIRST))
-                    tx_printf(" <dir>");
-                if ((dictpar1 & DESC) && (flag != ADJ_FIRST))
-                    tx_printf(" <adj>");
-                if ((dictpar1 & VERB) && (flag != VERB_FIRST))
-                    tx_printf(" <verb>");
-                if ((dictpar1 & PREP) && (flag != PREP_FIRST))
-                    tx_printf(" <prep>");
-                if (dictpar1 & NOUN) tx_printf(" <noun>");
-                if (dictpar1 & SPECIAL) tx_printf(" <special>");
-            }
+            count = word_flags(dictpar1, inform_flags, flags);
+            for (flag = 0; flag < count; flag++)
+                tx_printf(" <%s>", flags[flag]);
         }
     }
     tx_printf("\n");
 
 } /* show_dictionary */
 
+/*
+ * show_dictionary_json
+ *
+ * Write the dictionary as JSON: the separators, then each word with its
+ * address, data bytes and word types, then the list of verbs.
+ */
+
+void show_dictionary_json(void)
+{
+    unsigned long dict_address, word_address, word_table_base, word_table_end;
+    unsigned long words_address;
+    unsigned int separator_count, word_size, word_count;
+    int i, j, count, length, inform_flags, dictpar1;
+    const char *flags[MAX_WORD_FLAGS], *text;
+    char separators[256];
+
+    configure_dictionary(&word_count, &word_table_base, &word_table_end);
+    inform_flags = inform_dictionary();
+
+    dict_address = word_table_base;
+    separator_count = read_data_byte(&dict_address);
+    for (i = 0; (unsigned int)i < separator_count; i++)
+        separators[i] = (char)read_data_byte(&dict_address);
+    separators[i] = '\0';
+    word_size = read_data_byte(&dict_address);
+    word_count = read_data_word(&dict_address);
+    words_address = dict_address;
+
+    (void)printf(",\"dictionary\":{\"separators\":");
+    print_json_string(separators);
+    (void)printf(",\"word_size\":%u,\"words\":[", word_size);
+    for (i = 1; (unsigned int)i <= word_count; i++) {
+        word_address = dict_address;
+        dict_address += word_size;
+        (void)printf("%s{\"address\":%lu,\"word\":", (i > 1) ? "," : "",
+                     word_address);
+        print_json_text(&word_address);
+        dictpar1 = (word_address < dict_address) ? get_byte(word_address) : 0;
+        (void)printf(",\"data\":[");
+        for (j = 0; word_address < dict_address; j++)
+            (void)printf("%s%u", (j) ? "," : "",
+                         (unsigned int)read_data_byte(&word_address));
+        (void)printf("],\"flags\":[");
+        count = word_flags(dictpar1, inform_flags, flags);
+        for (j = 0; j < count; j++)
+            (void)printf("%s\"%s\"", (j) ? "," : "", flags[j]);
+        (void)printf("]}");
+    }
+
+    /* Verbs are the words flagged as such, the grammar itself stays in -g */
+
+    (void)printf("],\"verbs\":[");
+    dict_address = words_address;
+    for (i = 1, j = 0; (unsigned int)i <= word_count; i++) {
+        word_address = dict_address;
+        dict_address += word_size;
+        (void)decode_text_span(&word_address, &text, &length);
+        dictpar1 = (word_address < dict_address) ? get_byte(word_address) : 0;
+        count = word_flags(dictpar1, inform_flags, flags);
+        while (count-- && strcmp(flags[count], "verb") != 0)
+            ;
+        if (count >= 0) {
+            (void)printf("%s", (j++) ? "," : "");
+            word_address = dict_address - word_size;
+            print_json_text(&word_address);
+        }
+    }
+    (void)printf("]}");
+
+} /* show_dictionary_json */
+
+/*
+ * show_vocabulary
+ *
+ * List the dictionary for speech recognition: one word per line, a tab, and
+ * its word types separated by commas. The level9 and magnetic interpreters
+ * write the same format with --vocab.
+ */
+
+void show_vocabulary(void)
+{
+    unsigned long dict_address, word_address, word_table_base, word_table_end;
+    unsigned int word_size, word_count;
+    int i, j, count, length, inform_flags, dictpar1;
+    const char *flags[MAX_WORD_FLAGS], *text;
+
+    configure_dictionary(&word_count, &word_table_base, &word_table_end);
+    inform_flags = inform_dictionary();
+
+    dict_address = word_table_base;
+    dict_address += read_data_byte(&dict_address);
+    word_size = read_data_byte(&dict_address);
+    word_count = read_data_word(&dict_address);
+
+    for (i = 1; (unsigned int)i <= word_count; i++) {
+        word_address = dict_address;
+        dict_address += word_size;
+        (void)decode_text_span(&word_address, &text, &length);
+        (void)printf("%.*s\t", length, text);
+        dictpar1 = (word_address < dict_address) ? get_byte(word_address) : 0;
+        count = word_flags(dictpar1, inform_flags, flags);
+        for (j = 0; j < count; j++)
+            (void)printf("%s%s", (j) ? "," : "", flags[j]);
+        (void)printf("\n");
+    }
+
+} /* show_vocabulary */
+
+/*
+ * fix_dictionary
+ *
+ * Fix the end of text flag for each word in the dictionary. Some older games
+ * are missing the end of text flag on some words. All the words are fixed up
+ * so that they can be printed.
+ */
+
+void fix_dictionary(void)
+{
+    unsigned long address;
+    int separator_count, word_size, word_count, i;
+
+    address = header.dictionary;
+    separator_count = read_data_byte(&address);
+    address += separator_count;
+    word_size = read_data_byte(&address);
+    word_count = read_data_word(&address);
+
+    for (i = 1; i <= word_count; i++) {
+
+        /* Check that the word is in non-paged memory before writing */
+
+        if ((address + 4) < (unsigned long)header.resident_size) {
+            if ((unsigned int)header.version <= V3) {
+                set_byte(address + 2,
+                         (unsigned int)get_byte(address + 2) | 0x80);
+            } else {
+                set_byte(address + 4,
+                         (unsigned int)get_byte(address + 4) | 0x80);
+            }
+        }
+
+        address += word_size;
+    }
+
+} /* fix_dictionary */
+
+/*
+ * dictionary_word_flags
+ *
+ * Name the word types set in the first data byte of a dictionary word of
+ * the open story, as show_vocabulary lists them. Returns the number of
+ * names stored in flags, which has room for MAX_WORD_FLAGS.
+ */
+
+int dictionary_word_flags(int dictpar1, const char* flags[])
+{
+
+    return (word_flags(dictpar1, inform_dictionary(), flags));
+
+} /* dictionary_word_flags */
+
+/*
+ * inform_dictionary
+ *
+ * Inform games use different word type flags, they are recognised by the
+ * date format of their serial number.
+ */
+
+static int inform_dictionary(void)
+{
+
+    return (header.serial[0] >= '0' && header.serial[0] <= '9' &&
+            header.serial[1] >= '0' && header.serial[1] <= '9' &&
+            header.serial[2] >= '0' && header.serial[2] <= '1' &&
+            header.serial[3] >= '0' && header.serial[3] <= '9' &&
+            header.serial[4] >= '0' && header.serial[4] <= '3' &&
+            header.serial[5] >= '0' && header.serial[5] <= '9' &&
+            header.serial[0] != '8');
+
+} /* inform_dictionary */
+
+/*
+ * word_flags
+ *
+ * Name the word types set in the first data byte of a dictionary word.
+ * Returns the number of names stored in flags.
+ */
+
+static int word_flags(int dictpar1, int inform_flags, const char* flags[])
+{
+    int count = 0, flag;
+
+    if (inform_flags) {
+        if (dictpar1 & NOUN) flags[count++] = "noun";
+        if (dictpar1 & PREP) flags[count++] = "prep";
+        if (dictpar1 & PLURAL) flags[count++] = "plural";
+        if (dictpar1 & META) flags[count++] = "meta";
+        if (dictpar1 & VERB_INFORM) flags[count++] = "verb";
+    } else if (header.version != V6) {
+        flag = dictpar1 & DATA_FIRST;
+        switch (flag) {
+        case DIR_FIRST:
+            if (dictpar1 & DIR) flags[count++] = "dir";
+            break;
+        case ADJ_FIRST:
+            if (dictpar1 & DESC) flags[count++] = "adj";
+            break;
+        case VERB_FIRST:
+            if (dictpar1 & VERB) flags[count++] = "verb";
+            break;
+        case PREP_FIRST:
+            if (dictpar1 & PREP) flags[count++] = "prep";
+            break;
+        }
+        if ((dictpar1 & DIR) && (flag != DIR_FIRST)) flags[count++] = "dir";
+        if ((dictpar1 & DESC) && (flag != ADJ_FIRST)) flags[count++] = "adj";
+        if ((dictpar1 & VERB) && (flag != VERB_FIRST)) flags[count++] = "verb";
+        if ((dictpar1 & PREP) && (flag != PREP_FIRST)) flags[count++] = "prep";
+        if (dictpar1 & NOUN) flags[count++] = "noun";
+        if (dictpar1 & SPECIAL) flags[count++] = "special";
+    }
+
+    return (count);
+
+} /* word_flags */
+
 /*
  * configure_dictionary
  *
@@ -352,6 +352,46 @@ void show_header(void)
 
 } /* show_header */
 
+/*
+ * show_header_json
+ *
+ * Write the main header fields as JSON. Addresses are byte addresses, the
+ * flags are the raw header values.
+ */
+
+void show_header_json(void)
+{
+    char serial[sizeof(header.serial) + 1];
+    unsigned int i;
+
+    for (i = 0; i < sizeof(header.serial); i++)
+        serial[i] = isprint(header.serial[i]) ? (char)header.serial[i] : '?';
+    serial[i] = '\0';
+
+    (void)printf(",\"header\":{\"version\":%u,\"release\":%u,\"serial\":",
+                 (unsigned int)header.version, (unsigned int)header.release);
+    print_json_string(serial);
+    (void)printf(",\"config\":%u,\"flags\":%u,\"resident_size\":%u",
+                 (unsigned int)header.config, (unsigned int)header.flags,
+                 (unsigned int)header.resident_size);
+    if ((unsigned int)header.version != V6)
+        (void)printf(",\"start_pc\":%u", (unsigned int)header.start_pc);
+    else
+        (void)printf(",\"start_pc\":%lu",
+                     ((unsigned long)header.start_pc * code_scaler) +
+                         ((unsigned long)header.routines_offset * story_scaler));
+    (void)printf(",\"dictionary\":%u,\"objects\":%u,\"globals\":%u",
+                 (unsigned int)header.dictionary, (unsigned int)header.objects,
+                 (unsigned int)header.globals);
+    (void)printf(",\"dynamic_size\":%u,\"abbreviations\":%u",
+                 (unsigned int)header.dynamic_size,
+                 (unsigned int)header.abbreviations);
+    (void)printf(",\"file_size\":%lu,\"checksum\":%u,\"alphabet\":%u}",
+                 file_size, (unsigned int)header.checksum,
+                 (unsigned int)header.alphabet);
+
+} /* show_header_json */
+
 static void show_header_extension(void)
 {
     zword_t tlen;
@@ -10,8 +10,8 @@ void configure_object_tables(unsigned int*, unsigned long*, unsigned long*,
                              unsigned long*, unsigned long*);
 static unsigned int get_object_address(unsigned int);
 static void print_property_list(unsigned long*, unsigned long);
-static void print_object(int, int);
-static void print_object_desc(int);
+static void print_object(const object_table_t*, unsigned int);
+static void print_object_desc(const object_table_t*, unsigned int);
 
 /*
  * configure_object_tables
@@ -202,19 +202,22 @@ void configure_object_tables(unsigned int* obj_count,
 
 void show_objects(int symbolic)
 {
-    unsigned long object_address, address;
+    unsigned long address;
     unsigned long obj_table_base, obj_table_end, obj_data_base, obj_data_end;
-    unsigned int obj_count, data, pobj, nobj, cobj;
+    unsigned int obj_count, data;
     int i, j, k, list;
     unsigned short inform_version;
     unsigned long class_numbers_base, class_numbers_end;
     unsigned long property_names_base, property_names_end;
     unsigned long attr_names_base, attr_names_end;
+    object_table_t objects;
+    const zbyte_t* attributes;
 
     /* Get objects configuration */
 
     configure_object_tables(&obj_count, &obj_table_base, &obj_table_end,
                             &obj_data_base, &obj_data_end);
+    load_object_table(&objects);
 
     if (symbolic) {
         configure_inform_tables(obj_data_end, &inform_version,
@@ -233,16 +236,13 @@ void show_objects(int symbolic)
     for (i = 1; (unsigned int)i <= obj_count; i++) {
         tx_printf("\n");
 
-        /* Get address of object */
-
-        object_address = (unsigned long)get_object_address((unsigned int)i);
-
         /* Display attributes */
 
         tx_printf("%3d. Attributes: ", (int)i);
         list = 0;
-        for (j = 0; j < (((unsigned int)header.version < V4) ? 4 : 6); j++) {
-            data = (unsigned int)read_data_byte(&object_address);
+        attributes = objects.attributes + (i - 1) * objects.attribute_bytes;
+        for (j = 0; j < objects.attribute_bytes; j++) {
+            data = (unsigned int)attributes[j];
             for (k = 7; k >= 0; k--) {
                 if ((data >> k) & 1) {
                     tx_printf("%s", (list++) ? ", " : "");
@@ -257,21 +257,12 @@ void show_objects(int symbolic)
         if (list == 0) tx_printf("None");
         tx_printf("\n");
 
-        /* Get object linkage information */
+        /* Display object linkage information */
 
-        if ((unsigned int)header.version < V4) {
-            pobj = (unsigned int)read_data_byte(&object_address);
-            nobj = (unsigned int)read_data_byte(&object_address);
-            cobj = (unsigned int)read_data_byte(&object_address);
-        } else {
-            pobj = (unsigned int)read_data_word(&object_address);
-            nobj = (unsigned int)read_data_word(&object_address);
-            cobj = (unsigned int)read_data_word(&object_address);
-        }
-        address = read_data_word(&object_address);
-        tx_printf("     Parent object: %3d  ", (int)pobj);
-        tx_printf("Sibling object: %3d  ", (int)nobj);
-        tx_printf("Child object: %3d\n", (int)cobj);
+        address = objects.properties[i];
+        tx_printf("     Parent object: %3d  ", (int)objects.parent[i]);
+        tx_printf("Sibling object: %3d  ", (int)objects.sibling[i]);
+        tx_printf("Child object: %3d\n", (int)objects.child[i]);
         tx_printf("     Property address: %04lx\n", (unsigned long)address);
         tx_printf("         Description: \"");
 
@@ -286,8 +277,75 @@ void show_objects(int symbolic)
         print_property_list(&address, property_names_base);
     }
 
+    free_object_table(&objects);
+
 } /* show_objects */
 
+/*
+ * show_objects_json
+ *
+ * Write every object as JSON: number, description, attribute numbers,
+ * tree links and the raw data of each property.
+ */
+
+void show_objects_json(void)
+{
+    unsigned long address;
+    unsigned int data;
+    int i, j, k, list, count;
+    object_table_t objects;
+    const zbyte_t* attributes;
+
+    load_object_table(&objects);
+
+    (void)printf(",\"objects\":[");
+    for (i = 1; (unsigned int)i <= objects.count; i++) {
+        (void)printf("%s{\"id\":%d,\"attributes\":[", (i > 1) ? "," : "", i);
+        list = 0;
+        attributes = objects.attributes + (i - 1) * objects.attribute_bytes;
+        for (j = 0; j < objects.attribute_bytes; j++) {
+            data = (unsigned int)attributes[j];
+            for (k = 7; k >= 0; k--)
+                if ((data >> k) & 1)
+                    (void)printf("%s%d", (list++) ? "," : "",
+                                 (int)((j * 8) + (7 - k)));
+        }
+
+        address = objects.properties[i];
+        (void)printf("],\"parent\":%u,\"sibling\":%u,\"child\":%u,\"name\":",
+                     objects.parent[i], objects.sibling[i], objects.child[i]);
+        if ((unsigned int)read_data_byte(&address))
+            print_json_text(&address);
+        else
+            (void)printf("\"\"");
+
+        (void)printf(",\"properties\":[");
+        for (list = 0, data = read_data_byte(&address); data;
+             data = read_data_byte(&address)) {
+            if ((unsigned int)header.version <= V3)
+                count = ((data & property_size_mask) >> 5) + 1;
+            else if (data & 0x80)
+                count =
+                    (unsigned int)read_data_byte(&address) & property_size_mask;
+            else if (data & 0x40)
+                count = 2;
+            else
+                count = 1;
+            (void)printf("%s{\"id\":%u,\"data\":[", (list++) ? "," : "",
+                         data & property_mask);
+            for (j = 0; j < count; j++)
+                (void)printf("%s%u", (j) ? "," : "",
+                             (unsigned int)read_data_byte(&address));
+            (void)printf("]}");
+        }
+        (void)printf("]}");
+    }
+    (void)printf("]");
+
+    free_object_table(&objects);
+
+} /* show_objects_json */
+
 /*
  * get_object_address
  *
@@ -312,6 +370,68 @@ static unsigned int get_object_address(unsigned int obj)
 
 } /* get_object_address */
 
+/*
+ * load_object_table
+ *
+ * Read the parent, sibling and child links, the attribute bytes and the
+ * property address of every object in one pass down the object table. Index
+ * 0, the NULL object, has no links and no properties.
+ */
+
+void load_object_table(object_table_t* objects)
+{
+    unsigned long obj_table_base, obj_table_end, obj_data_base, obj_data_end;
+    unsigned long address;
+    unsigned int i, n;
+    int j;
+
+    configure_object_tables(&objects->count, &obj_table_base, &obj_table_end,
+                            &obj_data_base, &obj_data_end);
+    objects->attribute_bytes = ((unsigned int)header.version < V4) ? 4 : 6;
+
+    n = objects->count + 1;
+    objects->attributes = (zbyte_t*)malloc((size_t)n * objects->attribute_bytes);
+    objects->parent = (unsigned int*)calloc(n, sizeof(unsigned int));
+    objects->sibling = (unsigned int*)calloc(n, sizeof(unsigned int));
+    objects->child = (unsigned int*)calloc(n, sizeof(unsigned int));
+    objects->properties = (unsigned long*)calloc(n, sizeof(unsigned long));
+    if (objects->attributes == NULL || objects->parent == NULL ||
+        objects->sibling == NULL || objects->child == NULL ||
+        objects->properties == NULL) {
+        (void)fprintf(stderr, "\nFatal: insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    address = (unsigned long)get_object_address(1);
+    for (i = 1; i <= objects->count; i++) {
+        for (j = 0; j < objects->attribute_bytes; j++)
+            objects->attributes[(i - 1) * objects->attribute_bytes + j] =
+                (zbyte_t)read_data_byte(&address);
+        if ((unsigned int)header.version < V4) {
+            objects->parent[i] = (unsigned int)read_data_byte(&address);
+            objects->sibling[i] = (unsigned int)read_data_byte(&address);
+            objects->child[i] = (unsigned int)read_data_byte(&address);
+        } else {
+            objects->parent[i] = (unsigned int)read_data_word(&address);
+            objects->sibling[i] = (unsigned int)read_data_word(&address);
+            objects->child[i] = (unsigned int)read_data_word(&address);
+        }
+        objects->properties[i] = (unsigned long)read_data_word(&address);
+    }
+
+} /* load_object_table */
+
+void free_object_table(object_table_t* objects)
+{
+
+    free(objects->attributes);
+    free(objects->parent);
+    free(objects->sibling);
+    free(objects->child);
+    free(objects->properties);
+
+} /* free_object_table */
+
 /*
  * print_property_list
  *
@@ -357,57 +477,42 @@ static void print_property_list(unsigned long* address,
 
 void show_tree(void)
 {
-    unsigned long object_address;
-    unsigned long obj_table_base, obj_table_end, obj_data_base, obj_data_end;
-    unsigned int i, obj_count, parent;
+    unsigned int i;
+    object_table_t objects;
 
     /* Get objects configuration */
 
-    configure_object_tables(&obj_count, &obj_table_base, &obj_table_end,
-                            &obj_data_base, &obj_data_end);
+    load_object_table(&objects);
 
     tx_printf("\n    **** Object tree ****\n\n");
 
-    /* Iterate through each object */
-
-    for (i = 1; i <= obj_count; i++) {
+    /*
+     * Each object with no parent is a root object, so display the tree from
+     * the object.
+     */
 
-        /* Get object address */
+    for (i = 1; i <= objects.count; i++)
+        if (objects.parent[i] == 0) print_object(&objects, i);
 
-        object_address = (unsigned long)get_object_address((unsigned int)i);
-
-        /* Get parent for this object */
-
-        if ((unsigned int)header.version <= V3) {
-            object_address += O3_PARENT;
-            parent = read_data_byte(&object_address);
-        } else {
-            object_address += O4_PARENT;
-            parent = read_data_word(&object_address);
-        }
-
-        /*
-         * If object has no parent then it is a root object so display the tree
-         * from the object.
-         */
-
-        if (parent == 0) print_object((int)i, 0);
-    }
+    free_object_table(&objects);
 
 } /* show_tree */
 
 /*
  * print_object
  *
- * Print an object description and its children for a point in the object tree.
+ * Print an object description and its children for a point in the object
+ * tree. The tree is walked depth first with a stack of the siblings still to
+ * be printed at each level, rather than by recursion.
  */
 
-static void print_object(int obj, int depth)
+static void print_object(const object_table_t* objects, unsigned int obj)
 {
-    unsigned long object_address, address;
-    int child, i;
+    static unsigned int* pending = NULL;
+    static unsigned int pending_size = 0;
+    unsigned int depth = 0, child, next, i;
 
-    /* Continue until the next object number is NULL */
+    /* Continue until the next object number is NULL at the top level */
 
     while (obj) {
 
@@ -416,30 +521,33 @@ static void print_object(int obj, int depth)
         for (i = 0; i < depth; i++)
             tx_printf(" . ");
         tx_printf("[%3d] ", (int)obj);
-        print_object_desc(obj);
+        print_object_desc(objects, obj);
         tx_printf("\n");
 
-        /* Get object address */
+        /* Get any child object and the next object at this level */
 
-        object_address = (unsigned long)get_object_address((unsigned int)obj);
+        child = (obj <= objects->count) ? objects->child[obj] : 0;
+        next = (obj <= objects->count) ? objects->sibling[obj] : 0;
 
-        /* Get any child object and the next object at this level */
+        /* If this object has a child then print its tree first */
 
-        if ((unsigned int)header.version <= V3) {
-            address = object_address + O3_CHILD;
-            child = read_data_byte(&address);
-            address = object_address + O3_NEXT;
-            obj = read_data_byte(&address);
+        if (child) {
+            if (depth == pending_size) {
+                pending_size = (pending_size) ? pending_size * 2 : 64;
+                pending = (unsigned int*)realloc(
+                    pending, pending_size * sizeof(unsigned int));
+                if (pending == NULL) {
+                    (void)fprintf(stderr, "\nFatal: insufficient memory\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            pending[depth++] = next;
+            obj = child;
         } else {
-            address = object_address + O4_CHILD;
-            child = read_data_word(&address);
-            address = object_address + O4_NEXT;
-            obj = read_data_word(&address);
+            obj = next;
+            while (obj == 0 && depth > 0)
+                obj = pending[--depth];
         }
-
-        /* If this object has a child then print its tree */
-
-        if (child) print_object(child, depth + 1);
     }
 
 } /* print_object */
@@ -450,30 +558,19 @@ static void print_object(int obj, int depth)
  * Display the description of an object.
  */
 
-static void print_object_desc(int obj)
+static void print_object_desc(const object_table_t* objects, unsigned int obj)
 {
-    unsigned long object_address, address;
+    unsigned long address;
 
     tx_printf("\"");
 
     /* Check for a NULL object number */
 
-    if (obj) {
-
-        /* Get object address */
-
-        object_address = (unsigned long)get_object_address((unsigned int)obj);
-        if ((unsigned int)header.version <= V3)
-            address = object_address + O3_PROPERTY_OFFSET;
-        else
-            address = object_address + O4_PROPERTY_OFFSET;
-
-        /* Get the property address */
-
-        address = read_data_word(&address);
+    if (obj && obj <= objects->count) {
 
         /* Display the description if the object has one */
 
+        address = objects->properties[obj];
         if ((unsigned int)read_data_byte(&address)) (void)decode_text(&address);
     }
     tx_printf("\"");
@@ -816,6 +816,95 @@ void show_syntax_of_action(int action, unsigned long verb_table_base,
     }
 }
 
+/*
+ * show_grammar
+ *
+ * List the sentence structures of every verb for speech recognition, one
+ * per line as show_verb_grammar gives them, e.g. "take OBJ with OBJ". The
+ * entries are walked as show_syntax_of_action walks them.
+ */
+
+void show_grammar(void)
+{
+    unsigned long verb_table_base, verb_data_base;
+    unsigned long action_table_base, preact_table_base;
+    unsigned long prep_table_base, prep_table_end;
+    unsigned int verb_count, action_count, parse_count, parser_type, prep_type;
+    unsigned long address, verb_entry, parse_entry;
+    unsigned int entry_count, object_count, val;
+    int i;
+
+    configure_parse_tables(
+        &verb_count, &action_count, &parse_count, &parser_type, &prep_type,
+        &verb_table_base, &verb_data_base, &action_table_base,
+        &preact_table_base, &prep_table_base, &prep_table_end);
+
+    address = verb_table_base;
+    for (i = 0; (unsigned int)i < verb_count; i++) {
+
+        if (parser_type == infocom6_grammar) {
+            unsigned long do_address, doio_address;
+            unsigned int verb_address;
+
+            /* $ffff if the verb is not a sentence on its own */
+
+            verb_address = (unsigned int)address;
+            parse_entry = address;
+            if (read_data_word(&address) != 0xffff) {
+                show_verb_grammar(parse_entry, verb_address, (int)parser_type,
+                                  0, 0, 0L, 0L);
+                tx_printf("\n");
+            }
+            read_data_word(&address);
+            do_address = read_data_word(&address);
+            doio_address = read_data_word(&address);
+
+            if (do_address) {
+                verb_entry = do_address;
+                entry_count = (unsigned int)read_data_word(&verb_entry);
+                for (; entry_count--; verb_entry += 6) {
+                    show_verb_grammar(verb_entry, verb_address,
+                                      (int)parser_type, 1, 0, 0L, 0L);
+                    tx_printf("\n");
+                }
+            }
+
+            if (doio_address) {
+                verb_entry = doio_address;
+                entry_count = (unsigned int)read_data_word(&verb_entry);
+                for (; entry_count--; verb_entry += 10) {
+                    show_verb_grammar(verb_entry, verb_address,
+                                      (int)parser_type, 2, 0, 0L, 0L);
+                    tx_printf("\n");
+                }
+            }
+        } else {
+            verb_entry = (unsigned long)read_data_word(&address);
+            entry_count = (unsigned int)read_data_byte(&verb_entry);
+
+            while (entry_count--) {
+                parse_entry = verb_entry;
+                if (parser_type >= inform_gv2) {
+                    verb_entry += 2;
+                    for (val = read_data_byte(&verb_entry); val != ENDIT;
+                         val = read_data_byte(&verb_entry))
+                        verb_entry += 2;
+                } else if (parser_type != infocom_variable) {
+                    verb_entry += 8;
+                } else {
+                    object_count = (unsigned int)read_data_byte(&verb_entry);
+                    verb_entry += verb_sizes[(object_count >> 6) & 0x03] - 1;
+                }
+                show_verb_grammar(parse_entry, VERB_NUM(i, parser_type),
+                                  (int)parser_type, 0, (int)prep_type,
+                                  prep_table_base, 0L);
+                tx_printf("\n");
+            }
+        }
+    }
+
+} /* show_grammar */
+
 int is_gv2_parsing_routine(unsigned long parsing_routine,
                            unsigned long verb_table_base,
                            unsigned int verb_count)
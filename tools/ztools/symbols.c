@@ -11,7 +11,6 @@
  *          Finish user-defined symbol table
  */
 
-#define NAMELEN 80
 #define LINBUFSIZ 256
 
 enum symtypes
@@ -34,37 +33,121 @@ enum valtypes
     val_routine
 };
 
-struct symtab_entry_t
+/*
+ * Every symbol is kept in one open addressed table, keyed by its type, its
+ * number and, for locals, the address of the routine it belongs to. Names
+ * are copied one after the other into a single arena, and looked up by
+ * their offset there, so the table only holds small fixed size slots.
+ */
+
+struct symbol_slot_t
 {
-    enum symtypes symtype;
-    enum valtypes valtype;
+    enum symtypes symtype; /* sym_unknown for an empty slot */
+    unsigned long owner;
     long number;
-    char name[NAMELEN];
+    size_t name;
 };
 
-struct routine_entry_t
+static struct symbol_slot_t* symbol_slots;
+static unsigned long symbol_size;
+static unsigned long symbol_count;
+
+static char* symbol_names;
+static size_t symbol_names_used;
+static size_t symbol_names_room;
+
+static void* symbols_alloc(void* p)
 {
-    int symtype;
-    int valtype;
-    long number;
-    char name[NAMELEN];
-    int local_entries;
-    struct symtab_entry_t* locals;
-    int global_entries;
-    struct symtab_entry_t* globals;
-};
+    if (p == NULL) {
+        (void)fprintf(stderr, "\nFatal: insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static unsigned long hash_symbol(int symtype, unsigned long owner,
+                                 long number)
+{
+    unsigned long hash = (unsigned long)number ^ (owner * 31) ^
+                         ((unsigned long)symtype << 24);
+
+    return ((hash * 2654435761UL) >> 7);
+}
+
+static struct symbol_slot_t* find_symbol(int symtype, unsigned long owner,
+                                         long number)
+{
+    struct symbol_slot_t* slot;
+    unsigned long i;
+
+    for (i = hash_symbol(symtype, owner, number) & (symbol_size - 1);
+         (slot = &symbol_slots[i])->symtype != sym_unknown;
+         i = (i + 1) & (symbol_size - 1))
+        if ((int)slot->symtype == symtype && slot->owner == owner &&
+            slot->number == number)
+            break;
+    return slot;
+}
+
+/* The name of a symbol, or NULL if there is none */
+static const char* lookup_symbol(int symtype, unsigned long owner,
+                                 long number)
+{
+    struct symbol_slot_t* slot;
+
+    if (symbol_count == 0) return NULL;
+    slot = find_symbol(symtype, owner, number);
+    return (slot->symtype != sym_unknown) ? symbol_names + slot->name : NULL;
+}
 
-static struct symtab_entry_t* attribute_names_table;
-static int attribute_entries;
+/* A later definition of the same symbol replaces the earlier one */
+static void add_symbol(enum symtypes symtype, unsigned long owner,
+                       long number, const char* name)
+{
+    struct symbol_slot_t *old_slots, *slot;
+    unsigned long old_size, i;
+    size_t len = strlen(name) + 1;
 
-static struct symtab_entry_t* property_names_table;
-static int property_entries;
+    if ((symbol_count + 1) * 2 > symbol_size) {
+        old_slots = symbol_slots;
+        old_size = symbol_size;
+        symbol_size = (old_size) ? old_size * 2 : 256;
+        symbol_slots = (struct symbol_slot_t*)symbols_alloc(
+            calloc((size_t)symbol_size, sizeof(struct symbol_slot_t)));
+        for (i = 0; i < old_size; i++)
+            if (old_slots[i].symtype != sym_unknown)
+                *find_symbol(old_slots[i].symtype, old_slots[i].owner,
+                             old_slots[i].number) = old_slots[i];
+        free(old_slots);
+    }
 
-static struct symtab_entry_t* global_names_table;
-static int global_entries;
+    if (symbol_names_used + len > symbol_names_room) {
+        while (symbol_names_used + len > symbol_names_room)
+            symbol_names_room = (symbol_names_room) ? symbol_names_room * 2
+                                                    : 4096;
+        symbol_names =
+            (char*)symbols_alloc(realloc(symbol_names, symbol_names_room));
+    }
+    (void)memcpy(symbol_names + symbol_names_used, name, len);
 
-static struct routine_entry_t* routines_table;
-static int routine_entries;
+    slot = find_symbol(symtype, owner, number);
+    if (slot->symtype == sym_unknown) symbol_count++;
+    slot->symtype = symtype;
+    slot->owner = owner;
+    slot->number = number;
+    slot->name = symbol_names_used;
+    symbol_names_used += len;
+}
+
+static void free_symbols(void)
+{
+    free(symbol_slots);
+    free(symbol_names);
+    symbol_slots = NULL;
+    symbol_names = NULL;
+    symbol_size = symbol_count = 0;
+    symbol_names_used = symbol_names_room = 0;
+}
 
 static int get_type_from_name(char* tname)
 {
@@ -87,160 +170,59 @@ static int get_type_from_name(char* tname)
     return sym_unknown;
 }
 
+static long get_number(char* s)
+{
+#ifdef HAS_STRTOUL
+    return (long)strtoul(s, (char**)NULL, 0);
+#else
+    return atoi(s);
+#endif
+}
+
 /*
  * init_symbols
  *
- * Prints the name of the attribute, if known.
+ * Reads a user symbol table, one symbol a line:
+ *
+ *   routine <address> <name>
+ *   global <number> <name>
+ *   local <routine address> <number> <name>
+ *   attribute <number> <name>
+ *   property <number> <name>
+ *
+ * The routine address of a local is the one txd shows for the routine.
+ * Only the first letter of the type counts. A global line with anything
+ * after the name is skipped.
  */
 void init_symbols(const char* fname)
 {
-    long tmp;
     FILE* symfile;
     char linbuf[LINBUFSIZ];
-    char* s;
-    char* symname;
+    char *s, *number, *symname;
     int symtype;
-    int routine = 0;
-    int global = 0;
-    int attribute = 0;
-    int property = 0;
+    long owner;
 
     symfile = fopen(fname, "r");
     if (symfile == NULL) return;
 
-    global_entries = -1;
-    attribute_entries = -1;
-    property_entries = -1;
-    routine_entries = 0;
+    free_symbols();
 
-    fgets(linbuf, LINBUFSIZ, symfile);
-    while (!feof(symfile)) {
-        s = strtok(linbuf, "\t\n\r ");
+    while (fgets(linbuf, LINBUFSIZ, symfile) != NULL) {
+        if ((s = strtok(linbuf, "\t\n\r ")) == NULL) continue;
         symtype = get_type_from_name(s);
-        switch (symtype) {
-        case sym_routine:
-            routine_entries++;
-            break;
-
-        case sym_global:
-            s = strtok(NULL, "\t\n\r ");
-#ifdef HAS_STRTOUL
-            tmp = strtoul(s, (char**)NULL, 0);
-#else
-            tmp = atoi(s);
-#endif
-            s = strtok(NULL, "\t\n\r "); /* skip name */
-            s = strtok(NULL, "\t\n\r ");
-            if ((s == NULL) && (tmp > global_entries)) global_entries = tmp;
-            break;
-
-        case sym_local:
-            break;
-        case sym_attribute:
-            s = strtok(NULL, "\t\n\r ");
-#ifdef HAS_STRTOUL
-            tmp = strtoul(s, (char**)NULL, 0);
-#else
-            tmp = atoi(s);
-#endif
-            if (tmp > attribute_entries) attribute_entries = tmp;
-            break;
-
-        case sym_property:
-            s = strtok(NULL, "\t\n\r ");
-#ifdef HAS_STRTOUL
-            tmp = strtoul(s, (char**)NULL, 0);
-#else
-            tmp = atoi(s);
-#endif
-            if (tmp > property_entries) property_entries = tmp;
-            break;
+        if (symtype == sym_unknown) continue;
+        owner = 0;
+        if (symtype == sym_local) {
+            if ((s = strtok(NULL, "\t\n\r ")) == NULL) continue;
+            owner = get_number(s);
         }
-        fgets(linbuf, LINBUFSIZ, symfile);
-    }
-    global_entries++;
-    attribute_entries++;
-    property_entries++;
-
-    if (routine_entries > 0)
-        routines_table = (struct routine_entry_t*)calloc(
-            sizeof(struct routine_entry_t), routine_entries);
-    if (global_entries > 0)
-        global_names_table = (struct symtab_entry_t*)calloc(
-            sizeof(struct symtab_entry_t), global_entries);
-    if (attribute_entries > 0)
-        attribute_names_table = (struct symtab_entry_t*)calloc(
-            sizeof(struct symtab_entry_t), attribute_entries);
-    if (property_entries > 0)
-        property_names_table = (struct symtab_entry_t*)calloc(
-            sizeof(struct symtab_entry_t), property_entries);
-    fseek(symfile, 0, 0);
-
-    fgets(linbuf, LINBUFSIZ, symfile);
-    while (!feof(symfile)) {
-        s = strtok(linbuf, "\t\n\r ");
-        symtype = get_type_from_name(s);
-        switch (symtype) {
-        case sym_routine:
-            s = strtok(NULL, "\t\n\r ");
-#ifdef HAS_STRTOUL
-            tmp = strtoul(s, (char**)NULL, 0);
-#else
-            tmp = atoi(s);
-#endif
-            routines_table[routine].symtype = sym_routine;
-            routines_table[routine].number = tmp;
-            symname = strtok(NULL, "\t\n\r ");
-            strcpy(routines_table[routine].name, symname);
-            routine++;
-            break;
-
-        case sym_global:
-            s = strtok(NULL, "\t\n\r ");
-#ifdef HAS_STRTOUL
-            tmp = strtoul(s, (char**)NULL, 0);
-#else
-            tmp = atoi(s);
-#endif
-            symname = strtok(NULL, "\t\n\r ");
-            s = strtok(NULL, "\t\n\r ");
-            if (s == NULL) {
-                global_names_table[tmp].symtype = sym_global;
-                global_names_table[tmp].number = tmp;
-                strcpy(global_names_table[tmp].name, symname);
-            }
-            break;
-
-        case sym_local:
-            break;
-
-        case sym_attribute:
-            s = strtok(NULL, "\t\n\r ");
-#ifdef HAS_STRTOUL
-            tmp = strtoul(s, (char**)NULL, 0);
-#else
-            tmp = atoi(s);
-#endif
-            symname = strtok(NULL, "\t\n\r ");
-            attribute_names_table[tmp].symtype = sym_attribute;
-            attribute_names_table[tmp].number = tmp;
-            strcpy(attribute_names_table[tmp].name, symname);
-            break;
-
-        case sym_property:
-            s = strtok(NULL, "\t\n\r ");
-#ifdef HAS_STRTOUL
-            tmp = strtoul(s, (char**)NULL, 0);
-#else
-            tmp = atoi(s);
-#endif
-            symname = strtok(NULL, "\t\n\r ");
-            property_names_table[tmp].symtype = sym_property;
-            property_names_table[tmp].number = tmp;
-            strcpy(property_names_table[tmp].name, symname);
-            break;
-        }
-        fgets(linbuf, LINBUFSIZ, symfile);
+        number = strtok(NULL, "\t\n\r ");
+        symname = strtok(NULL, "\t\n\r ");
+        if (number == NULL || symname == NULL) continue;
+        if (symtype == sym_global && strtok(NULL, "\t\n\r ") != NULL)
+            continue;
+        add_symbol((enum symtypes)symtype, (unsigned long)owner,
+                   get_number(number), symname);
     }
     fclose(symfile);
 }
@@ -252,11 +234,12 @@ void init_symbols(const char* fname)
  */
 int print_attribute_name(unsigned long attr_names_base, int attr_no)
 {
+    const char* name;
+
     if (attr_names_base) {
         return print_inform_attribute_name(attr_names_base, attr_no);
-    } else if ((attr_no < attribute_entries) &&
-               attribute_names_table[attr_no].symtype == sym_attribute) {
-        tx_printf(attribute_names_table[attr_no].name);
+    } else if ((name = lookup_symbol(sym_attribute, 0, attr_no)) != NULL) {
+        tx_printf("%s", name);
         return 1;
     }
     return 0;
@@ -264,11 +247,12 @@ int print_attribute_name(unsigned long attr_names_base, int attr_no)
 
 int print_property_name(unsigned long property_names_base, int prop_no)
 {
+    const char* name;
+
     if (property_names_base) {
         return print_inform_attribute_name(property_names_base, prop_no);
-    } else if ((prop_no < property_entries) &&
-               property_names_table[prop_no].symtype == sym_property) {
-        tx_printf(property_names_table[prop_no].name);
+    } else if ((name = lookup_symbol(sym_property, 0, prop_no)) != NULL) {
+        tx_printf("%s", name);
         return 1;
     }
     return 0;
@@ -276,17 +260,22 @@ int print_property_name(unsigned long property_names_base, int prop_no)
 
 int print_local_name(unsigned long start_of_routine, int local_no)
 {
-    (void)start_of_routine;
-    (void)local_no;
+    const char* name = lookup_symbol(sym_local, start_of_routine, local_no);
+
+    if (name != NULL) {
+        tx_printf("%s", name);
+        return 1;
+    }
     return 0;
 }
 
 int print_global_name(unsigned long start_of_routine, int global_no)
 {
+    const char* name = lookup_symbol(sym_global, 0, global_no);
+
     (void)start_of_routine;
-    if ((global_no < global_entries) &&
-        global_names_table[global_no].symtype == sym_global) {
-        tx_printf(global_names_table[global_no].name);
+    if (name != NULL) {
+        tx_printf("%s", name);
         return 1;
     }
     return 0;
@@ -337,6 +337,23 @@ typedef struct cref_item_s
     int number;
 } cref_item_t;
 
+/* The object table decoded once, indexed by object number from 1 */
+
+typedef struct object_table_s
+{
+    unsigned int count;
+    int attribute_bytes;
+    zbyte_t* attributes; /* attribute_bytes for each object */
+    unsigned int* parent;
+    unsigned int* sibling;
+    unsigned int* child;
+    unsigned long* properties;
+} object_table_t;
+
+/* The most word types dictionary_word_flags names */
+
+#define MAX_WORD_FLAGS 6
+
 /* Data access macros */
 
 #define get_byte(offset) ((zbyte_t)datap[offset])
@@ -366,6 +383,10 @@ extern int option_inform;
 extern unsigned long file_size;
 
 int decode_text(unsigned long*);
+int decode_text_span(unsigned long*, const char**, int*);
+void print_json_string(const char*);
+void print_json_text(unsigned long*);
+unsigned int zscii_to_unicode(int);
 void close_story(void);
 void configure(int, int);
 void load_cache(void);
@@ -373,9 +394,14 @@ void open_story(const char*);
 void read_page(unsigned int, void*);
 zbyte_t read_data_byte(unsigned long*);
 zword_t read_data_word(unsigned long*);
+unsigned int story_checksum(void);
+int story_in_memory(void);
 void tx_printf(const char*, ...);
+void tx_init_output(void);
 void tx_fix_margin(int);
 void tx_set_width(int);
+void tx_set_output(FILE*);
+void tx_set_quiet(int);
 void init_symbols(const char* fname);
 void configure_inform_tables(
     unsigned long obj_data_end, unsigned short* inform_version,
@@ -387,6 +413,12 @@ int print_property_name(unsigned long property_names_base, int prop_no);
 int print_attribute_name(unsigned long attr_names_base, int attr_no);
 void configure_object_tables(unsigned int*, unsigned long*, unsigned long*,
                              unsigned long*, unsigned long*);
+void load_object_table(object_table_t*);
+void configure_dictionary(unsigned int*, unsigned long*, unsigned long*);
+void free_object_table(object_table_t*);
+void fix_dictionary(void);
+int dictionary_word_flags(int, const char*[]);
+void show_grammar(void);
 int print_inform_action_name(unsigned long action_names_base, int action_no);
 int print_inform_attribute_name(unsigned long attr_names_base, int attr_no);
 int print_local_name(unsigned long start_of_routine, int local_no);
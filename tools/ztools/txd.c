@@ -50,12 +50,42 @@
  *    Remove GV2A support
  *    Add unicode disassembly support
  *    Add Inform and user symbol table support
+ *    Decode the routines for output in parallel
  */
 
 #include "tx.h"
+#if defined(__unix__) || defined(__APPLE__)
+#    include <sys/wait.h>
+#    include <unistd.h> /* declares getopt */
+#    define HAS_FORK
+#    ifndef HAS_GETOPT
+#        define HAS_GETOPT
+#    endif
+#endif
+#ifdef HAS_TRACE
+#    include "trace.h"
+#else
+#    define trace_begin(name)
+#    define trace_end()
+#endif
 
 #define MAX_PCS 100
 
+/* Open addressed index of cref items, keyed by owning routine and address */
+
+typedef struct cref_slot_s
+{
+    const cref_item_t* owner;
+    cref_item_t* item;
+} cref_slot_t;
+
+typedef struct cref_index_s
+{
+    cref_slot_t* slots;
+    unsigned long size;
+    unsigned long count;
+} cref_index_t;
+
 #define ROUND_CODE(address) ((address + (code_scaler - 1)) & ~(code_scaler - 1))
 #define ROUND_DATA(address)                                                    \
     ((address + (story_scaler - 1)) & ~(story_scaler - 1))
@@ -66,6 +96,9 @@ extern int getopt(int, char*[], const char*);
 
 static void process_story(const char*);
 static void decode_program(void);
+#ifdef HAS_FORK
+static int decode_parallel(void);
+#endif
 static int decode_routine(void);
 static int decode_code(void);
 static int decode_opcode(void);
@@ -85,6 +118,10 @@ static int lookup_label(unsigned long, int);
 static int lookup_routine(unsigned long, int);
 static void renumber_cref(cref_item_t*);
 static void free_cref(cref_item_t*);
+static void sort_cref(cref_item_t**);
+static cref_item_t* find_cref(cref_index_t*, const cref_item_t*, unsigned long);
+static void index_cref(cref_index_t*, const cref_item_t*, cref_item_t*);
+static void clear_cref_index(cref_index_t*);
 static int print_object_desc(unsigned int);
 static void print_text(unsigned long*);
 static void print_integer(unsigned int, int);
@@ -105,6 +142,10 @@ static cref_item_t* strings_base = NULL;
 static cref_item_t* routines_base = NULL;
 static cref_item_t* current_routine = NULL;
 
+static cref_index_t strings_index;
+static cref_index_t routines_index;
+static cref_index_t labels_index;
+
 static int locals_count = 0;
 static unsigned long start_of_routine = 0;
 
@@ -149,15 +190,18 @@ static int option_grammar = 1;
 static int option_dump = 0;
 static int option_width = 79;
 static int option_symbols = 0;
+static int option_jobs = 0;
 static unsigned long string_location = 0;
 
 int main(int argc, char* argv[])
 {
     int c, errflg = 0;
 
+    tx_init_output();
+
     /* Parse the options */
 
-    while ((c = getopt(argc, argv, "abdghnsw:S:u:")) != EOF) {
+    while ((c = getopt(argc, argv, "abdghj:nsw:S:u:")) != EOF) {
         switch (c) {
         case 'a':
             option_inform = 6;
@@ -168,6 +212,9 @@ int main(int argc, char* argv[])
         case 'g':
             option_grammar = 0;
             break;
+        case 'j':
+            option_jobs = atoi(optarg);
+            break;
         case 'n':
             option_labels = 0;
             break;
@@ -207,6 +254,8 @@ int main(int argc, char* argv[])
                       "\t-a   generate alternate syntax used by Inform\n");
         (void)fprintf(stderr, "\t-d   dump hex of opcodes and data\n");
         (void)fprintf(stderr, "\t-g   turn off grammar for action routines\n");
+        (void)fprintf(stderr, "\t-j n number of processes decoding the code "
+                              "(0 = one per CPU)\n");
         (void)fprintf(stderr, "\t-n   use addresses instead of labels\n");
         (void)fprintf(stderr, "\t-w n display width (0 = no wrap)\n");
         (void)fprintf(stderr, "\t-s   Symbolic mode (Inform 6+ only)\n");
@@ -288,9 +337,11 @@ static void process_story(const char* file_name)
         decode_strings(string_location);
         exit(0);
     }
+    trace_begin("analysis");
     decode_program();
 
     scan_strings(decode.pc);
+    trace_end();
 
 #if !defined(TXD_DEBUG)
     tx_printf("\nEnd of analysis pass, low address = %lx, high address = %lx\n",
@@ -317,12 +368,17 @@ static void process_story(const char* file_name)
         }
     }
 
-    if (option_labels) renumber_cref(routines_base);
+    if (option_labels) {
+        sort_cref(&routines_base);
+        renumber_cref(routines_base);
+    }
 
+    trace_begin("output");
     decode.first_pass = 0;
     decode_program();
 
     decode_strings(decode.pc);
+    trace_end();
 #endif
 
     close_story();
@@ -381,6 +437,8 @@ static void decode_program(void)
             if (option_labels) {
                 free_cref(routines_base);
                 routines_base = NULL;
+                clear_cref_index(&routines_index);
+                clear_cref_index(&labels_index);
             }
             prev_low_pc = decode.low_address;
             prev_high_pc = decode.high_address;
@@ -433,8 +491,12 @@ static void decode_program(void)
         if (option_labels == 0)
             tx_printf(" at %lx", (unsigned long)decode.low_address);
         tx_printf("]\n");
-        for (decode.pc = decode.low_address; decode.pc <= decode.high_address;)
-            (void)decode_routine();
+#ifdef HAS_FORK
+        if (!decode_parallel())
+#endif
+            for (decode.pc = decode.low_address;
+                 decode.pc <= decode.high_address;)
+                (void)decode_routine();
         tx_printf("\n[End of code");
         if (option_labels == 0) tx_printf(" at %lx", (unsigned long)decode.pc);
         tx_printf("]\n");
@@ -442,6 +504,107 @@ static void decode_program(void)
 
 } /* decode_program */
 
+#ifdef HAS_FORK
+
+/*
+ * decode_parallel
+ *
+ * Decode the code for output in up to option_jobs child processes. A
+ * quiet run through the code, printing nothing, finds where each routine
+ * starts; the code is cut at routine starts into runs of about the same
+ * size, each child decodes one into a file of its own and the files are
+ * copied out in address order, so the output is what decoding it here
+ * would print. Returns 0, having done nothing, with one job or where the
+ * children would have to share the story file.
+ */
+
+typedef struct decode_cut_s
+{
+    unsigned long pc;
+    unsigned long start_of_routine;
+    cref_item_t* routine;
+} decode_cut_t;
+
+static int decode_parallel(void)
+{
+    decode_cut_t* cuts;
+    FILE** files;
+    pid_t* pids;
+    unsigned long span;
+    char buffer[BUFSIZ];
+    size_t n;
+    int jobs = option_jobs, count, failed, status, i;
+
+    if (jobs <= 0) jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs <= 1 || !story_in_memory()) return (0);
+
+    cuts = (decode_cut_t*)malloc(jobs * sizeof(decode_cut_t));
+    files = (FILE**)calloc(jobs, sizeof(FILE*));
+    pids = (pid_t*)calloc(jobs, sizeof(pid_t));
+    if (cuts == NULL || files == NULL || pids == NULL) {
+        (void)fprintf(stderr, "\nFatal: insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Find the cuts, with what a routine's labels and branches depend on */
+
+    trace_begin("routine starts");
+    span = (decode.high_address - decode.low_address) / jobs + 1;
+    tx_set_quiet(1);
+    for (decode.pc = decode.low_address, count = 0;
+         decode.pc <= decode.high_address;) {
+        if (count < jobs && decode.pc >= decode.low_address + count * span) {
+            cuts[count].pc = decode.pc;
+            cuts[count].start_of_routine = start_of_routine;
+            cuts[count].routine = current_routine;
+            count++;
+        }
+        (void)decode_routine();
+    }
+    tx_set_quiet(0);
+    trace_end();
+
+    (void)fflush(stdout);
+    for (i = 0; i < count; i++) {
+        if ((files[i] = tmpfile()) == NULL || (pids[i] = fork()) < 0) {
+            perror("txd");
+            exit(EXIT_FAILURE);
+        }
+        if (pids[i] == 0) {
+            (void)dup2(fileno(files[i]), STDOUT_FILENO);
+            decode.pc = cuts[i].pc;
+            start_of_routine = cuts[i].start_of_routine;
+            current_routine = cuts[i].routine;
+            while ((i + 1 < count) ? decode.pc < cuts[i + 1].pc
+                                   : decode.pc <= decode.high_address)
+                (void)decode_routine();
+            (void)fflush(stdout);
+            _exit(EXIT_SUCCESS);
+        }
+    }
+
+    /* The children print fatal errors themselves */
+
+    for (i = 0, failed = 0; i < count; i++) {
+        (void)waitpid(pids[i], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+        rewind(files[i]);
+        while (!failed && (n = fread(buffer, 1, sizeof(buffer), files[i])) > 0)
+            (void)fwrite(buffer, 1, n, stdout);
+        (void)fclose(files[i]);
+    }
+    if (failed) exit(EXIT_FAILURE);
+
+    free(cuts);
+    free(files);
+    free(pids);
+
+    return (1);
+
+} /* decode_parallel */
+
+#endif /* HAS_FORK */
+
 /* decode_routine - Decode a routine from start address to last instruction */
 
 static int decode_routine(void)
@@ -1526,6 +1689,7 @@ static void scan_strings(unsigned long pc)
         cref_item->number = count++;
         cref_item->next = strings_base;
         strings_base = cref_item;
+        index_cref(&strings_index, NULL, cref_item);
         old_pc = pc;
         do
             data = (zword_t)read_data_word(&pc);
@@ -1545,11 +1709,9 @@ static int lookup_string(unsigned long addr)
 
     if (addr <= decode.high_address || addr >= file_size) return (0);
 
-    for (cref_item = strings_base; cref_item != NULL;
-         cref_item = cref_item->next)
-        if (cref_item->address == addr) return (cref_item->number);
+    cref_item = find_cref(&strings_index, NULL, addr);
 
-    return (0);
+    return ((cref_item != NULL) ? cref_item->number : 0);
 
 } /* lookup_string */
 
@@ -1647,58 +1809,49 @@ static int in_dictionary(unsigned long word_address)
 
 } /* in_dictionary */
 
+/* Labels and routines are added unsorted, sort_cref puts them in address
+   order before they are numbered */
+
 static void add_label(unsigned long addr)
 {
-    cref_item_t *cref_item, **prev_item, *next_item;
+    cref_item_t* cref_item;
 
     if (current_routine == NULL) return;
 
-    prev_item = &current_routine->child;
-    next_item = current_routine->child;
-    while (next_item != NULL && next_item->address < addr) {
-        prev_item = &(next_item->next);
-        next_item = next_item->next;
-    }
-
-    if (next_item == NULL || next_item->address != addr) {
+    if (find_cref(&labels_index, current_routine, addr) == NULL) {
         cref_item = (cref_item_t*)malloc(sizeof(cref_item_t));
         if (cref_item == NULL) {
             (void)fprintf(stderr, "\nFatal: insufficient memory\n");
             exit(EXIT_FAILURE);
         }
-        cref_item->next = next_item;
-        *prev_item = cref_item;
+        cref_item->next = current_routine->child;
+        current_routine->child = cref_item;
         cref_item->child = NULL;
         cref_item->address = addr;
         cref_item->number = 0;
+        index_cref(&labels_index, current_routine, cref_item);
     }
 
 } /* add_label */
 
 static void add_routine(unsigned long addr)
 {
-    cref_item_t *cref_item, **prev_item, *next_item;
-
-    prev_item = &routines_base;
-    next_item = routines_base;
-    while (next_item != NULL && next_item->address < addr) {
-        prev_item = &(next_item->next);
-        next_item = next_item->next;
-    }
+    cref_item_t* cref_item;
 
-    if (next_item == NULL || next_item->address != addr) {
+    cref_item = find_cref(&routines_index, NULL, addr);
+    if (cref_item == NULL) {
         cref_item = (cref_item_t*)malloc(sizeof(cref_item_t));
         if (cref_item == NULL) {
             (void)fprintf(stderr, "\nFatal: insufficient memory\n");
             exit(EXIT_FAILURE);
         }
-        cref_item->next = next_item;
-        *prev_item = cref_item;
+        cref_item->next = routines_base;
+        routines_base = cref_item;
         cref_item->child = NULL;
         cref_item->address = addr;
         cref_item->number = 0;
-    } else
-        cref_item = next_item;
+        index_cref(&routines_index, NULL, cref_item);
+    }
 
     current_routine = cref_item;
 
@@ -1706,12 +1859,9 @@ static void add_routine(unsigned long addr)
 
 static int lookup_label(unsigned long addr, int flag)
 {
-    cref_item_t* cref_item = current_routine->child;
+    cref_item_t* cref_item = find_cref(&labels_index, current_routine, addr);
     int label;
 
-    while (cref_item != NULL && cref_item->address != addr)
-        cref_item = cref_item->next;
-
     if (cref_item == NULL) {
         label = 0;
         if (flag) {
@@ -1727,10 +1877,7 @@ static int lookup_label(unsigned long addr, int flag)
 
 static int lookup_routine(unsigned long addr, int flag)
 {
-    cref_item_t* cref_item = routines_base;
-
-    while (cref_item != NULL && cref_item->address != addr)
-        cref_item = cref_item->next;
+    cref_item_t* cref_item = find_cref(&routines_index, NULL, addr);
 
     if (cref_item == NULL) {
         if (flag) {
@@ -1773,6 +1920,114 @@ static void free_cref(cref_item_t* cref_item)
 
 } /* free_cref */
 
+static int compare_cref(const void* a, const void* b)
+{
+    unsigned long a_addr = (*(const cref_item_t* const*)a)->address;
+    unsigned long b_addr = (*(const cref_item_t* const*)b)->address;
+
+    return ((a_addr > b_addr) - (a_addr < b_addr));
+
+} /* compare_cref */
+
+/* sort_cref - sort a cref list and its children by address */
+
+static void sort_cref(cref_item_t** base)
+{
+    cref_item_t *cref_item, **items;
+    size_t count, i;
+
+    for (count = 0, cref_item = *base; cref_item != NULL;
+         cref_item = cref_item->next)
+        count++;
+    if (count == 0) return;
+
+    items = (cref_item_t**)malloc(count * sizeof(cref_item_t*));
+    if (items == NULL) {
+        (void)fprintf(stderr, "\nFatal: insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0, cref_item = *base; cref_item != NULL;
+         cref_item = cref_item->next)
+        items[i++] = cref_item;
+    qsort(items, count, sizeof(cref_item_t*), compare_cref);
+
+    *base = items[0];
+    for (i = 0; i < count; i++) {
+        items[i]->next = (i + 1 < count) ? items[i + 1] : NULL;
+        sort_cref(&items[i]->child);
+    }
+    free(items);
+
+} /* sort_cref */
+
+static unsigned long hash_cref(const cref_item_t* owner, unsigned long addr)
+{
+    unsigned long hash = addr;
+
+    if (owner != NULL) hash ^= owner->address * 31;
+
+    return ((hash * 2654435761UL) >> 7);
+
+} /* hash_cref */
+
+static cref_item_t* find_cref(cref_index_t* index, const cref_item_t* owner,
+                              unsigned long addr)
+{
+    cref_slot_t* slot;
+    unsigned long i;
+
+    if (index->size == 0) return (NULL);
+
+    for (i = hash_cref(owner, addr) & (index->size - 1);
+         (slot = &index->slots[i])->item != NULL; i = (i + 1) & (index->size - 1))
+        if (slot->owner == owner && slot->item->address == addr)
+            return (slot->item);
+
+    return (NULL);
+
+} /* find_cref */
+
+static void index_cref(cref_index_t* index, const cref_item_t* owner,
+                       cref_item_t* cref_item)
+{
+    cref_slot_t *old_slots, *slot;
+    unsigned long old_size, i;
+
+    if ((index->count + 1) * 2 > index->size) {
+        old_slots = index->slots;
+        old_size = index->size;
+        index->size = (old_size) ? old_size * 2 : 256;
+        index->slots = (cref_slot_t*)calloc((size_t)index->size,
+                                            sizeof(cref_slot_t));
+        if (index->slots == NULL) {
+            (void)fprintf(stderr, "\nFatal: insufficient memory\n");
+            exit(EXIT_FAILURE);
+        }
+        index->count = 0;
+        for (i = 0; i < old_size; i++)
+            if (old_slots[i].item != NULL)
+                index_cref(index, old_slots[i].owner, old_slots[i].item);
+        free(old_slots);
+    }
+
+    for (i = hash_cref(owner, cref_item->address) & (index->size - 1);
+         (slot = &index->slots[i])->item != NULL; i = (i + 1) & (index->size - 1))
+        ;
+    slot->owner = owner;
+    slot->item = cref_item;
+    index->count++;
+
+} /* index_cref */
+
+static void clear_cref_index(cref_index_t* index)
+{
+
+    if (index->size) (void)memset(index->slots, 0,
+                                  (size_t)index->size * sizeof(cref_slot_t));
+    index->count = 0;
+
+} /* clear_cref_index */
+
 static int print_object_desc(unsigned int obj)
 {
     unsigned long address;
@@ -7,6 +7,20 @@
  */
 
 #include "tx.h"
+
+/* the story may come from a game bundle, see tools/bundle/bundle.h */
+#ifdef HAS_BUNDLE
+#    include "bundle.h"
+#else
+#    define bundle_fopen(f) fopen(f, "rb")
+#endif
+/* phase spans when TALKIE_TRACE is set, see tools/trace/trace.h */
+#ifdef HAS_TRACE
+#    include "trace.h"
+#else
+#    define trace_begin(name)
+#    define trace_end()
+#endif
 #ifdef MAC_MPW
 #    include <CursorCtl.h>
 #    include <Signal.h>
@@ -54,14 +68,34 @@ static const char* inform_euro_substitute[69] = {
 static int lookup_table_loaded = 0;
 static char lookup_table[3][26];
 
+/* Decoded abbreviations, indexed by (table - 1) * 32 + entry */
+
+#define MAX_ABBREVIATIONS 96
+
+typedef struct abbreviation
+{
+    char* text;
+    size_t length;
+    int char_count;
+} abbreviation_t;
+
+static abbreviation_t abbreviations[MAX_ABBREVIATIONS];
+
+static char* text_buffer = NULL;
+static size_t text_length = 0;
+static size_t text_size = 0;
+
 #define TX_SCREEN_COLS 79
+#define TX_OUTPUT_BUFSIZ 65536
 
 static char* tx_line = NULL;
 static int tx_line_pos = 0;
+static int tx_line_room = 0;
 static int tx_col = 1;
 static int tx_margin = 0;
 static int tx_do_margin = 1;
 static int tx_screen_cols = TX_SCREEN_COLS;
+static int tx_quiet = 0;
 
 typedef struct cache_entry
 {
@@ -72,16 +106,23 @@ typedef struct cache_entry
 
 static cache_entry_t* update_cache(unsigned int);
 static unsigned long get_story_size(void);
+static int load_story(unsigned long);
+static void put_text_char(char);
+static void tx_write_span(const char*, int);
+static void tx_wrap_span(const char*, int);
 static void tx_write_char(int);
+static void tx_line_reserve(int);
 
 static FILE* gfp = NULL;
+static FILE* tx_out = NULL;
 
 static cache_entry_t* cache = NULL;
 
 static unsigned int current_data_page = 0;
 static cache_entry_t* current_data_cachep = NULL;
 
-static unsigned int data_size;
+static unsigned long data_size;
+static zbyte_t* data_owned = NULL;
 
 void configure(int min_version, int max_version)
 {
@@ -192,7 +233,10 @@ void configure(int min_version, int max_version)
 void open_story(const char* storyname)
 {
 
-    gfp = fopen(storyname, "rb");
+#ifdef HAS_BUNDLE
+    if (bundle_open(storyname)) storyname = "story";
+#endif
+    gfp = bundle_fopen(storyname);
     if (gfp == NULL) {
         (void)fprintf(stderr, "\nFatal: game file not found\n");
         exit(EXIT_FAILURE);
@@ -202,8 +246,37 @@ void open_story(const char* storyname)
 
 void close_story(void)
 {
+    cache_entry_t* cachep;
+    int i;
 
     if (gfp != NULL) (void)fclose(gfp);
+    gfp = NULL;
+#ifdef HAS_BUNDLE
+    bundle_close();
+#endif
+
+    /* Give back what load_cache took, so a process can open many stories */
+
+    while (cache != NULL) {
+        cachep = cache;
+        cache = cache->flink;
+        free(cachep);
+    }
+    current_data_page = 0;
+    current_data_cachep = NULL;
+    free(data_owned);
+    data_owned = NULL;
+    datap = NULL;
+    data_size = 0;
+    file_size = 0;
+
+    /* The next story has its own alphabet and abbreviations */
+
+    lookup_table_loaded = 0;
+    for (i = 0; i < MAX_ABBREVIATIONS; i++) {
+        free(abbreviations[i].text);
+        abbreviations[i].text = NULL;
+    }
 
 } /* close_story */
 
@@ -218,11 +291,13 @@ void read_page(unsigned int page, void* buffer)
     else
         bytes_to_read = (unsigned int)(file_size & PAGE_MASK);
 
+    trace_begin("read_page");
     fseek(gfp, (long)page * PAGE_SIZE, SEEK_SET);
     if (fread(buffer, bytes_to_read, 1, gfp) != 1) {
         (void)fprintf(stderr, "\nFatal: game file read error\n");
         exit(EXIT_FAILURE);
     }
+    trace_end();
 
 } /* read_page */
 
@@ -232,6 +307,8 @@ void load_cache(void)
     unsigned int i, file_pages, data_pages;
     cache_entry_t* cachep;
 
+    trace_begin("load_cache");
+
     /* Must have at least one cache page for memory calculation */
 
     cachep = (cache_entry_t*)malloc(sizeof(cache_entry_t));
@@ -246,13 +323,22 @@ void load_cache(void)
     /* Calculate dynamic cache pages required */
 
     data_pages = ((unsigned int)header.resident_size + PAGE_MASK) >> PAGE_SHIFT;
-    data_size = data_pages * PAGE_SIZE;
+    data_size = (unsigned long)data_pages * PAGE_SIZE;
     file_size = (unsigned long)header.file_size * story_scaler;
     file_pages = (unsigned int)((file_size + PAGE_MASK) >> PAGE_SHIFT);
 
+    /* Load the whole story if there is room for it, so that read_data_byte
+       only has to page in addresses past the end of the file. The page cache
+       is left for machines where it does not fit. */
+
+    if (load_story(file_size)) {
+        trace_end();
+        return;
+    }
+
     /* Allocate static data area and initialise it */
 
-    datap = (zbyte_t*)malloc((size_t)data_size);
+    datap = data_owned = (zbyte_t*)malloc((size_t)data_size);
     if (datap == NULL) {
         (void)fprintf(stderr, "\nFatal: insufficient memory\n");
         exit(EXIT_FAILURE);
@@ -272,9 +358,58 @@ void load_cache(void)
             cache = cachep;
         }
     }
+    trace_end();
 
 } /* load_cache */
 
+/*
+ * load_story
+ *
+ * Read the whole story file into datap. Returns 0, leaving datap alone, if
+ * it does not fit in memory.
+ *
+ */
+
+static int load_story(unsigned long size)
+{
+    zbyte_t* storyp;
+    size_t bytes;
+
+    if (size <= data_size || (unsigned long)(size_t)size != size) return (0);
+    storyp = (zbyte_t*)malloc((size_t)size);
+    if (storyp == NULL) return (0);
+    rewind(gfp);
+    bytes = fread(storyp, 1, (size_t)size, gfp);
+    if (bytes < data_size) {
+        (void)fprintf(stderr, "\nFatal: game file read error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* A short file keeps the old behaviour of failing on the first read
+       past its end */
+
+    datap = data_owned = storyp;
+    data_size = (unsigned long)bytes;
+
+    return (1);
+
+} /* load_story */
+
+/*
+ * story_in_memory
+ *
+ * Whether load_cache read the whole story, so that reading it never goes
+ * back to the file.
+ *
+ */
+
+int story_in_memory(void)
+{
+
+    return (data_owned != NULL && data_size >= file_size);
+
+} /* story_in_memory */
+
 zword_t read_data_word(unsigned long* addr)
 {
     unsigned int w;
@@ -308,11 +443,9 @@ zbyte_t read_data_byte(unsigned long* addr)
 
 } /* read_data_byte */
 
-int decode_text(unsigned long* address)
+static void load_lookup_table(void)
 {
-    int i, j, char_count, synonym_flag, synonym = 0, ascii_flag, ascii = 0;
-    int data, code, shift_state, shift_lock;
-    unsigned long addr;
+    int i, j;
 
     /*
      * Load correct character translation table for this game.
@@ -337,6 +470,26 @@ int decode_text(unsigned long* address)
         lookup_table_loaded = 1;
     }
 
+} /* load_lookup_table */
+
+/*
+ * decode_zstring
+ *
+ * Decode the Z-string at address onto the end of the text buffer and return
+ * its character count. Abbreviations are decoded once and copied out of the
+ * abbreviation cache after that.
+ *
+ */
+
+static int decode_zstring(unsigned long* address)
+{
+    int i, char_count, synonym_flag, synonym = 0, ascii_flag, ascii = 0;
+    int data, code, shift_state, shift_lock;
+    size_t j;
+    unsigned long addr;
+    abbreviation_t* abbrp;
+    size_t start;
+
     /* Set state variables */
 
     shift_state = 0;
@@ -364,12 +517,28 @@ int decode_text(unsigned long* address)
             if (synonym_flag) {
 
                 synonym_flag = 0;
-                synonym = (synonym - 1) * 64;
-                addr =
-                    (unsigned long)get_word((unsigned int)header.abbreviations +
-                                            synonym + (code * 2)) *
-                    2;
-                char_count += decode_text(&addr);
+                abbrp = &abbreviations[(synonym - 1) * 32 + code];
+                if (abbrp->text == NULL) {
+                    addr = (unsigned long)get_word(
+                               (unsigned int)header.abbreviations +
+                               ((synonym - 1) * 64) + (code * 2)) *
+                           2;
+                    start = text_length;
+                    abbrp->char_count = decode_zstring(&addr);
+                    abbrp->length = text_length - start;
+                    abbrp->text = (char*)malloc(abbrp->length + 1);
+                    if (abbrp->text == NULL) {
+                        (void)fprintf(stderr,
+                                      "\nFatal: insufficient memory\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    (void)memcpy(abbrp->text, &text_buffer[start],
+                                 abbrp->length);
+                } else {
+                    for (j = 0; j < abbrp->length; j++)
+                        put_text_char(abbrp->text[j]);
+                }
+                char_count += abbrp->char_count;
                 shift_state = shift_lock;
 
                 /* ASCII codes */
@@ -393,7 +562,7 @@ int decode_text(unsigned long* address)
                 else {
 
                     ascii_flag = 0;
-                    tx_printf("%c", (char)(ascii | code));
+                    put_text_char((char)(ascii | code));
                     char_count++;
                 }
 
@@ -418,7 +587,7 @@ int decode_text(unsigned long* address)
                 else if (shift_state == 2 && code == 1 &&
                          (unsigned int)header.version > V1)
 
-                    tx_printf("%c", (option_inform) ? '^' : '\n');
+                    put_text_char((option_inform) ? '^' : '\n');
 
                 /*
                  * This is a normal character so select it from the character
@@ -427,7 +596,7 @@ int decode_text(unsigned long* address)
 
                 else {
 
-                    tx_printf("%c", (char)lookup_table[shift_state][code]);
+                    put_text_char((char)lookup_table[shift_state][code]);
                     char_count++;
                 }
 
@@ -446,7 +615,7 @@ int decode_text(unsigned long* address)
 
                 if (code == 0) {
 
-                    tx_printf(" ");
+                    put_text_char(' ');
                     char_count++;
 
                 } else {
@@ -468,7 +637,7 @@ int decode_text(unsigned long* address)
                         if (code == 1) {
 
                             if ((unsigned int)header.version == V1) {
-                                tx_printf("%c", (option_inform) ? '^' : '\n');
+                                put_text_char((option_inform) ? '^' : '\n');
                                 char_count++;
                             } else {
                                 synonym_flag = 1;
@@ -548,8 +717,143 @@ int decode_text(unsigned long* address)
 
     return (char_count);
 
+} /* decode_zstring */
+
+/*
+ * decode_text_span
+ *
+ * Decode the Z-string at address without printing it. The text is left in
+ * a buffer that stays valid until the next call, high ZSCII characters are
+ * not substituted yet. Returns the character count.
+ *
+ */
+
+int decode_text_span(unsigned long* address, const char** text, int* length)
+{
+    int char_count;
+
+    load_lookup_table();
+    text_length = 0;
+    char_count = decode_zstring(address);
+    *text = text_buffer;
+    *length = (int)text_length;
+
+    return (char_count);
+
+} /* decode_text_span */
+
+int decode_text(unsigned long* address)
+{
+    const char* text;
+    int char_count, length;
+
+    char_count = decode_text_span(address, &text, &length);
+    tx_write_span(text, length);
+
+    return (char_count);
+
 } /* decode_text */
 
+static void put_text_char(char c)
+{
+
+    if (text_length == text_size) {
+        text_size = (text_size) ? text_size * 2 : 256;
+        text_buffer = (char*)realloc(text_buffer, text_size);
+        if (text_buffer == NULL) {
+            (void)fprintf(stderr, "\nFatal: insufficient memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    text_buffer[text_length++] = c;
+
+} /* put_text_char */
+
+/*
+ * print_json_string
+ *
+ * Print a C string as a JSON string.
+ *
+ */
+
+void print_json_string(const char* s)
+{
+
+    (void)putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            (void)printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            (void)printf("\\u%04x", (unsigned int)(unsigned char)*s);
+        else
+            (void)putchar(*s);
+    }
+    (void)putchar('"');
+
+} /* print_json_string */
+
+/*
+ * print_json_text
+ *
+ * Decode the Z-string at address and print it as a JSON string, straight to
+ * stdout. High ZSCII characters are written as the Unicode characters they
+ * stand for, from the game's Unicode table if it has one.
+ *
+ */
+
+void print_json_text(unsigned long* address)
+{
+    const char* text;
+    int length, i, c;
+
+    (void)decode_text_span(address, &text, &length);
+    (void)putchar('"');
+    for (i = 0; i < length; i++) {
+        c = (unsigned char)text[i];
+        if (c == '"' || c == '\\')
+            (void)printf("\\%c", c);
+        else if (c == '\n')
+            (void)printf("\\n");
+        else if (c >= 0x9b && c <= 0xfb)
+            (void)printf("\\u%04x", zscii_to_unicode(c));
+        else if (c < 0x20 || c >= 0x7f)
+            (void)printf("\\u%04x", (unsigned int)c);
+        else
+            (void)putchar(c);
+    }
+    (void)putchar('"');
+
+} /* print_json_text */
+
+/* Default Unicode translations of ZSCII 155 to 223 */
+
+static const zword_t default_unicode[69] = {
+    0xe4, 0xf6, 0xfc, 0xc4, 0xd6, 0xdc, 0xdf, 0xbb, 0xab, 0xeb, 0xef, 0xff,
+    0xcb, 0xcf, 0xe1, 0xe9, 0xed, 0xf3, 0xfa, 0xfd, 0xc1, 0xc9, 0xcd, 0xd3,
+    0xda, 0xdd, 0xe0, 0xe8, 0xec, 0xf2, 0xf9, 0xc0, 0xc8, 0xcc, 0xd2, 0xd9,
+    0xe2, 0xea, 0xee, 0xf4, 0xfb, 0xc2, 0xca, 0xce, 0xd4, 0xdb, 0xe5, 0xc5,
+    0xf8, 0xd8, 0xe3, 0xf1, 0xf5, 0xc3, 0xd1, 0xd5, 0xe6, 0xc6, 0xe7, 0xc7,
+    0xfe, 0xf0, 0xde, 0xd0, 0xa3, 0x153, 0x152, 0xa1, 0xbf};
+
+unsigned int zscii_to_unicode(int c)
+{
+    unsigned int table, length;
+
+    if (header.mouse_table && (get_word(header.mouse_table) > 2)) {
+        table = get_word(header.mouse_table + 6);
+        if (table) {
+            length = get_byte(table);
+            if ((unsigned int)(c - 155) < length)
+                return (get_word(table + 1 + (c - 155) * 2));
+            return ('?');
+        }
+    }
+    if (c - 155 < 69) return (default_unicode[c - 155]);
+
+    return ('?');
+
+} /* zscii_to_unicode */
+
 static cache_entry_t* update_cache(unsigned int page_number)
 {
     cache_entry_t *cachep, *lastp;
@@ -577,6 +881,29 @@ static cache_entry_t* update_cache(unsigned int page_number)
 
 } /* update_cache */
 
+/*
+ * story_checksum
+ *
+ * Sum the story bytes after the header, as $verify does. The loaded part of
+ * the story is summed straight from memory in a loop the compiler can
+ * vectorise.
+ *
+ */
+
+unsigned int story_checksum(void)
+{
+    unsigned long addr, end, sum = 0;
+
+    end = (data_size < file_size) ? data_size : file_size;
+    for (addr = sizeof(zheader_t); addr < end; addr++)
+        sum += datap[addr];
+    while (addr < file_size)
+        sum += read_data_byte(&addr);
+
+    return ((unsigned int)(sum & 0xffff));
+
+} /* story_checksum */
+
 /*
  * get_story_size
  *
@@ -604,13 +931,15 @@ static unsigned long get_story_size(void)
 void tx_printf(const char* format, ...)
 {
     va_list ap;
-    int count, i;
+    int count;
     char buffer[TX_SCREEN_COLS + 1];
 
 #ifdef MAC_MPW
     static short cursor_initialized = 0;
 #endif
 
+    if (tx_quiet) return;
+
     va_start(ap, format);
 
 #ifdef MAC_MPW
@@ -623,14 +952,11 @@ void tx_printf(const char* format, ...)
     if (strchr(format, '\n')) SpinCursor(1);
 #endif
 
-    if (tx_screen_cols != 0) {
-        if (tx_line == NULL) {
-            tx_line = (char*)malloc((size_t)tx_screen_cols);
-            if (tx_line == NULL) {
-                (void)fprintf(stderr, "\nFatal: insufficient memory\n");
-                exit(EXIT_FAILURE);
-            }
-        }
+    /* Most calls print a literal, which needs no formatting at all */
+
+    if (strchr(format, '%') == NULL)
+        tx_write_span(format, (int)strlen(format));
+    else if (tx_screen_cols != 0) {
         /* On some systems vsprintf does not return the text length */
         (void)vsprintf(buffer, format, ap);
         count = strlen(buffer);
@@ -638,15 +964,68 @@ void tx_printf(const char* format, ...)
             (void)fprintf(stderr, "\nFatal: buffer space overflow\n");
             exit(EXIT_FAILURE);
         }
-        for (i = 0; i < count; i++)
-            tx_write_char((unsigned char)buffer[i]);
+        tx_write_span(buffer, count);
     } else
-        (void)vprintf(format, ap);
+        (void)vfprintf(tx_out ? tx_out : stdout, format, ap);
 
     va_end(ap);
 
 } /* tx_printf */
 
+/* Print decoded text the way tx_printf("%c") would print each character */
+
+static void tx_write_span(const char* text, int length)
+{
+
+    if (tx_quiet) return;
+    if (tx_screen_cols != 0) {
+        tx_wrap_span(text, length);
+    } else
+        (void)fwrite(text, 1, (size_t)length, tx_out ? tx_out : stdout);
+
+} /* tx_write_span */
+
+/* Characters tx_write_char has to see on their own */
+
+#define TX_SPECIAL(c)                                                          \
+    ((c) == '\n' || (c) == '\t' || (c) == '\v' || (c) == '\0' ||               \
+     ((c) >= 0x9b && (c) <= 0xfb))
+
+/*
+ * tx_wrap_span
+ *
+ * Append text to the current line, as tx_write_char on each character would.
+ * Runs of ordinary characters that fit on the line are copied in one go, only
+ * line ends, margins and characters that need substituting go one at a time.
+ * Nulls are skipped.
+ *
+ */
+
+static void tx_wrap_span(const char* text, int length)
+{
+    int i = 0, n, room, c;
+
+    while (i < length) {
+        c = (unsigned char)text[i];
+        room = tx_screen_cols + 1 - tx_col;
+        if (TX_SPECIAL(c) || tx_do_margin || room <= 0) {
+            if (c != '\0') tx_write_char(c);
+            i++;
+            continue;
+        }
+        for (n = 1; n < room && i + n < length &&
+                    !TX_SPECIAL((unsigned char)text[i + n]);
+             n++)
+            ;
+        tx_line_reserve(n);
+        (void)memcpy(tx_line + tx_line_pos, text + i, (size_t)n);
+        tx_line_pos += n;
+        tx_col += n;
+        i += n;
+    }
+
+} /* tx_wrap_span */
+
 static void write_high_zscii(int c)
 {
     static zword_t unicode_table[256];
@@ -695,16 +1074,20 @@ static void tx_write_char(int c)
 
     if (tx_col == tx_screen_cols + 1 || c == '\n') {
         tx_do_margin = 1;
+        tx_line_reserve(1);
         tx_line[tx_line_pos++] = '\0';
         cp = strrchr(tx_line, ' ');
         if (c == ' ' || c == '\n' || cp == NULL) {
-            (void)printf("%s\n", tx_line);
+            tx_line[tx_line_pos - 1] = '\n';
+            (void)fwrite(tx_line, 1, (size_t)tx_line_pos,
+                         tx_out ? tx_out : stdout);
             tx_line_pos = 0;
             tx_col = 1;
             return;
         } else {
-            *cp++ = '\0';
-            (void)printf("%s\n", tx_line);
+            *cp++ = '\n';
+            (void)fwrite(tx_line, 1, (size_t)(cp - tx_line),
+                         tx_out ? tx_out : stdout);
             tx_line_pos = 0;
             tx_col = 1;
             tx_printf("%s", cp);
@@ -717,11 +1100,86 @@ static void tx_write_char(int c)
             tx_write_char(' ');
     }
 
+    tx_line_reserve(1);
     tx_line[tx_line_pos++] = (char)c;
     tx_col++;
 
 } /* tx_write_char */
 
+/*
+ * tx_line_reserve
+ *
+ * Make room for count more characters in the current line. A line is
+ * normally no longer than the screen width, but a margin fixed near the
+ * right edge can push it past, so the buffer grows rather than overflows.
+ *
+ */
+
+static void tx_line_reserve(int count)
+{
+    char* line;
+    int room = (tx_line_room) ? tx_line_room : tx_screen_cols + 1;
+
+    if (tx_line != NULL && tx_line_pos + count <= tx_line_room) return;
+
+    while (tx_line_pos + count > room)
+        room *= 2;
+    line = (char*)realloc(tx_line, (size_t)room);
+    if (line == NULL) {
+        (void)fprintf(stderr, "\nFatal: insufficient memory\n");
+        exit(EXIT_FAILURE);
+    }
+    tx_line = line;
+    tx_line_room = room;
+
+} /* tx_line_reserve */
+
+/*
+ * tx_init_output
+ *
+ * Give stdout a large buffer, so that dumps go out in big writes. Call it
+ * before anything is printed.
+ *
+ */
+
+void tx_init_output(void)
+{
+    static char buffer[TX_OUTPUT_BUFSIZ];
+
+    (void)setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+
+} /* tx_init_output */
+
+/*
+ * tx_set_output
+ *
+ * Send what tx_printf prints to fp instead of stdout, or back to stdout if
+ * fp is NULL.
+ *
+ */
+
+void tx_set_output(FILE* fp)
+{
+
+    tx_out = fp;
+
+} /* tx_set_output */
+
+/*
+ * tx_set_quiet
+ *
+ * While flag is set tx_printf and decode_text print nothing, for a pass
+ * that only has to know where the output would go.
+ *
+ */
+
+void tx_set_quiet(int flag)
+{
+
+    tx_quiet = flag;
+
+} /* tx_set_quiet */
+
 void tx_fix_margin(int flag)
 {
 
@@ -734,12 +1192,14 @@ void tx_set_width(int width)
 
     if (width > tx_screen_cols) {
         if (tx_line != NULL) {
+            tx_line_reserve(1);
             tx_line[tx_line_pos++] = '\0';
-            (void)printf("%s", tx_line);
+            (void)fprintf(tx_out ? tx_out : stdout, "%s", tx_line);
         }
         tx_line_pos = 0;
         free(tx_line);
         tx_line = NULL;
+        tx_line_room = 0;
     }
     tx_screen_cols = width;
 
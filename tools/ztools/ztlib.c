@@ -0,0 +1,542 @@
+/*
+ * ztlib.c
+ *
+ * libztools, see ztlib.h. zt_open() runs the story through the decoders
+ * the tools use, one story at a time, and copies what they find into
+ * tables of the zt_story, so the queries never go back to txio.c.
+ */
+
+#include "tx.h"
+#include "ztlib.h"
+
+#ifdef HAS_BUNDLE
+#    include "bundle.h"
+#endif
+#ifndef ZTLIB_NO_THREADS
+#    include <pthread.h>
+#endif
+
+/* The strings of a story, kept as offsets while the pool still grows */
+
+typedef struct zt_pool_s
+{
+    char* text;
+    size_t length;
+    size_t room;
+} zt_pool_t;
+
+typedef struct zt_entry_s
+{
+    const char* text;
+    int word;
+} zt_entry_t;
+
+struct zt_story_s
+{
+    int version;
+    int release;
+    char serial[7];
+
+    object_table_t objects;
+    size_t* object_names;
+
+    int word_count;
+    size_t* words;      /* word, then its types */
+    zt_entry_t* sorted; /* words in strcmp order, for zt_lookup */
+    int resolution;     /* characters a dictionary word keeps */
+
+    int grammar_count;
+    size_t* grammar;
+
+    zt_pool_t pool;
+};
+
+#ifndef ZTLIB_NO_THREADS
+static pthread_mutex_t zt_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int story_file_ok(const char*);
+static int header_ok(const zbyte_t*, unsigned long);
+static int pool_add(zt_pool_t*, const char*, size_t, size_t*);
+static int pool_add_text(zt_pool_t*, const char*, int, size_t*);
+static int load_objects(zt_story*);
+static int load_words(zt_story*);
+static int load_grammar(zt_story*);
+static int compare_entries(const void*, const void*);
+
+/*
+ * header_ok
+ *
+ * Check the first bytes of a file of length bytes the way configure and
+ * load_cache will, so that a file they would give up on is refused here
+ * rather than ending the process.
+ */
+
+static int header_ok(const zbyte_t* data, unsigned long length)
+{
+    unsigned int version, resident, scaler;
+    unsigned long declared;
+
+    if (length < sizeof(zheader_t)) return (0);
+    version = data[H_VERSION];
+    if (version < V1 || version > V8 || (data[H_CONFIG] & CONFIG_BYTE_SWAPPED))
+        return (0);
+    resident = ((unsigned int)data[H_RESIDENT_SIZE] << 8) |
+               data[H_RESIDENT_SIZE + 1];
+    scaler = (version <= V3) ? 2 : (version <= V5) ? 4 : 8;
+    declared =
+        (((unsigned long)data[H_FILE_SIZE] << 8) | data[H_FILE_SIZE + 1]) *
+        scaler;
+
+    return (length >= resident && length >= declared);
+
+} /* header_ok */
+
+/*
+ * story_file_ok
+ *
+ * Check that path, or the story of a bundle at path, can be opened and
+ * has a header the tools take.
+ */
+
+static int story_file_ok(const char* path)
+{
+    zbyte_t data[sizeof(zheader_t)];
+    FILE* fp;
+    long length;
+    int ok;
+
+#ifdef HAS_BUNDLE
+    const unsigned char* story;
+    unsigned long size;
+
+    if (bundle_open(path)) {
+        story = bundle_find("story", &size);
+        ok = story != NULL && header_ok(story, size);
+        bundle_close();
+        return (ok);
+    }
+#endif
+    if ((fp = fopen(path, "rb")) == NULL) return (0);
+    ok = fread(data, sizeof(data), 1, fp) == 1 &&
+         fseek(fp, 0L, SEEK_END) == 0 && (length = ftell(fp)) >= 0 &&
+         header_ok(data, (unsigned long)length);
+    (void)fclose(fp);
+
+    return (ok);
+
+} /* story_file_ok */
+
+/*
+ * pool_add
+ *
+ * Append length bytes and a terminating NUL to the pool. Returns 0 if
+ * there is not enough memory.
+ */
+
+static int pool_add(zt_pool_t* pool, const char* text, size_t length,
+                    size_t* offset)
+{
+    size_t room;
+    char* p;
+
+    if (pool->length + length + 1 > pool->room) {
+        for (room = (pool->room) ? pool->room : 4096;
+             pool->length + length + 1 > room;)
+            room *= 2;
+        if ((p = (char*)realloc(pool->text, room)) == NULL) return (0);
+        pool->text = p;
+        pool->room = room;
+    }
+    *offset = pool->length;
+    (void)memcpy(pool->text + pool->length, text, length);
+    pool->length += length;
+    pool->text[pool->length++] = '\0';
+
+    return (1);
+
+} /* pool_add */
+
+/*
+ * pool_add_text
+ *
+ * Append text decoded by decode_text_span, with its high ZSCII characters
+ * as the UTF-8 of the Unicode characters they stand for.
+ */
+
+static int pool_add_text(zt_pool_t* pool, const char* text, int length,
+                         size_t* offset)
+{
+    char buffer[256], *out;
+    unsigned int c;
+    int i, n;
+
+    if (length <= 0) return (pool_add(pool, "", 0, offset));
+    out = (length * 3 < (int)sizeof(buffer)) ? buffer
+                                             : (char*)malloc(length * 3 + 1);
+    if (out == NULL) return (0);
+    for (i = 0, n = 0; i < length; i++) {
+        c = (unsigned char)text[i];
+        if (c >= 0x9b && c <= 0xfb) c = zscii_to_unicode((int)c);
+        if (c < 0x80)
+            out[n++] = (char)c;
+        else if (c < 0x800) {
+            out[n++] = (char)(0xc0 | (c >> 6));
+            out[n++] = (char)(0x80 | (c & 0x3f));
+        } else {
+            out[n++] = (char)(0xe0 | (c >> 12));
+            out[n++] = (char)(0x80 | ((c >> 6) & 0x3f));
+            out[n++] = (char)(0x80 | (c & 0x3f));
+        }
+    }
+    i = pool_add(pool, out, (size_t)n, offset);
+    if (out != buffer) free(out);
+
+    return (i);
+
+} /* pool_add_text */
+
+/*
+ * load_objects
+ *
+ * Keep the object table of load_object_table, and the short name of each
+ * object.
+ */
+
+static int load_objects(zt_story* story)
+{
+    unsigned long address;
+    const char* text;
+    unsigned int i;
+    int length;
+
+    load_object_table(&story->objects);
+    story->object_names =
+        (size_t*)calloc(story->objects.count + 1, sizeof(size_t));
+    if (story->object_names == NULL) return (0);
+
+    for (i = 1; i <= story->objects.count; i++) {
+        address = story->objects.properties[i];
+        if ((unsigned int)read_data_byte(&address))
+            (void)decode_text_span(&address, &text, &length);
+        else {
+            text = "";
+            length = 0;
+        }
+        if (!pool_add_text(&story->pool, text, length,
+                           &story->object_names[i]))
+            return (0);
+    }
+
+    return (1);
+
+} /* load_objects */
+
+/*
+ * load_words
+ *
+ * Keep each dictionary word with its word types, as show_vocabulary lists
+ * them, and an index of the words in order for zt_lookup.
+ */
+
+static int load_words(zt_story* story)
+{
+    unsigned long dict_address, word_address, word_table_base, word_table_end;
+    unsigned int word_size, word_count;
+    const char *flags[MAX_WORD_FLAGS], *text;
+    char types[MAX_WORD_FLAGS * 16];
+    int i, j, count, length, dictpar1;
+
+    configure_dictionary(&word_count, &word_table_base, &word_table_end);
+
+    dict_address = word_table_base;
+    dict_address += read_data_byte(&dict_address);
+    word_size = read_data_byte(&dict_address);
+    word_count = read_data_word(&dict_address);
+
+    story->word_count = (int)word_count;
+    story->words = (size_t*)calloc((size_t)word_count * 2 + 1, sizeof(size_t));
+    story->sorted =
+        (zt_entry_t*)calloc((size_t)word_count + 1, sizeof(zt_entry_t));
+    if (story->words == NULL || story->sorted == NULL) return (0);
+
+    for (i = 0; i < story->word_count; i++) {
+        word_address = dict_address;
+        dict_address += word_size;
+        (void)decode_text_span(&word_address, &text, &length);
+        if (!pool_add_text(&story->pool, text, length, &story->words[i * 2]))
+            return (0);
+        dictpar1 = (word_address < dict_address) ? get_byte(word_address) : 0;
+        count = dictionary_word_flags(dictpar1, flags);
+        for (j = 0, types[0] = '\0'; j < count; j++) {
+            if (j) (void)strcat(types, ",");
+            (void)strcat(types, flags[j]);
+        }
+        if (!pool_add(&story->pool, types, strlen(types),
+                      &story->words[i * 2 + 1]))
+            return (0);
+    }
+
+    return (1);
+
+} /* load_words */
+
+/*
+ * load_grammar
+ *
+ * Keep the sentences show_grammar prints, without their quotes. They are
+ * caught in a temporary file, the grammar printers only write.
+ */
+
+static int load_grammar(zt_story* story)
+{
+    FILE* fp;
+    char *text, *line, *end;
+    long length;
+    int count, ok;
+
+    if ((fp = tmpfile()) == NULL) return (1);
+    tx_set_width(0);
+    tx_set_output(fp);
+    show_grammar();
+    tx_set_output(NULL);
+
+    ok = 0;
+    text = NULL;
+    if (fflush(fp) == 0 && fseek(fp, 0L, SEEK_END) == 0 &&
+        (length = ftell(fp)) >= 0 && fseek(fp, 0L, SEEK_SET) == 0 &&
+        (text = (char*)malloc((size_t)length + 1)) != NULL &&
+        fread(text, 1, (size_t)length, fp) == (size_t)length) {
+        text[length] = '\0';
+        for (count = 0, line = text; *line; line++)
+            count += (*line == '\n');
+        story->grammar = (size_t*)calloc((size_t)count + 1, sizeof(size_t));
+        ok = story->grammar != NULL;
+        for (line = text; ok && *line; line = end + 1) {
+            end = strchr(line, '\n');
+            *end = '\0';
+            if (line[0] != '"' || end - line < 2 || end[-1] != '"') continue;
+            ok = pool_add(&story->pool, line + 1, (size_t)(end - line - 2),
+                          &story->grammar[story->grammar_count++]);
+        }
+    }
+    free(text);
+    (void)fclose(fp);
+
+    return (ok);
+
+} /* load_grammar */
+
+static int compare_entries(const void* a, const void* b)
+{
+
+    return (strcmp(((const zt_entry_t*)a)->text, ((const zt_entry_t*)b)->text));
+
+} /* compare_entries */
+
+zt_story* zt_open(const char* path)
+{
+    zt_story* story;
+    int i, ok;
+
+    if ((story = (zt_story*)calloc(1, sizeof(zt_story))) == NULL) return (NULL);
+
+#ifndef ZTLIB_NO_THREADS
+    (void)pthread_mutex_lock(&zt_lock);
+#endif
+    ok = story_file_ok(path);
+    if (ok) {
+        open_story(path);
+        configure(V1, V8);
+        load_cache();
+        fix_dictionary();
+
+        story->version = (int)header.version;
+        story->release = (int)header.release;
+        (void)memcpy(story->serial, header.serial, 6);
+        story->resolution = ((unsigned int)header.version <= V3) ? 6 : 9;
+        ok = load_objects(story) && load_words(story) && load_grammar(story);
+
+        close_story();
+    }
+#ifndef ZTLIB_NO_THREADS
+    (void)pthread_mutex_unlock(&zt_lock);
+#endif
+    if (!ok) {
+        zt_close(story);
+        return (NULL);
+    }
+
+    /* The pool has stopped moving */
+
+    for (i = 0; i < story->word_count; i++) {
+        story->sorted[i].text = story->pool.text + story->words[i * 2];
+        story->sorted[i].word = i;
+    }
+    qsort(story->sorted, (size_t)story->word_count, sizeof(zt_entry_t),
+          compare_entries);
+
+    return (story);
+
+} /* zt_open */
+
+void zt_close(zt_story* story)
+{
+
+    if (story == NULL) return;
+    free_object_table(&story->objects);
+    free(story->object_names);
+    free(story->words);
+    free(story->sorted);
+    free(story->grammar);
+    free(story->pool.text);
+    free(story);
+
+} /* zt_close */
+
+int zt_version(const zt_story* story)
+{
+
+    return (story->version);
+
+} /* zt_version */
+
+int zt_release(const zt_story* story)
+{
+
+    return (story->release);
+
+} /* zt_release */
+
+const char* zt_serial(const zt_story* story)
+{
+
+    return (story->serial);
+
+} /* zt_serial */
+
+int zt_object_count(const zt_story* story)
+{
+
+    return ((int)story->objects.count);
+
+} /* zt_object_count */
+
+const char* zt_object_name(const zt_story* story, int object)
+{
+
+    if (object < 1 || (unsigned int)object > story->objects.count)
+        return (NULL);
+
+    return (story->pool.text + story->object_names[object]);
+
+} /* zt_object_name */
+
+int zt_object_parent(const zt_story* story, int object)
+{
+
+    if (object < 1 || (unsigned int)object > story->objects.count) return (0);
+
+    return ((int)story->objects.parent[object]);
+
+} /* zt_object_parent */
+
+int zt_object_sibling(const zt_story* story, int object)
+{
+
+    if (object < 1 || (unsigned int)object > story->objects.count) return (0);
+
+    return ((int)story->objects.sibling[object]);
+
+} /* zt_object_sibling */
+
+int zt_object_child(const zt_story* story, int object)
+{
+
+    if (object < 1 || (unsigned int)object > story->objects.count) return (0);
+
+    return ((int)story->objects.child[object]);
+
+} /* zt_object_child */
+
+int zt_object_attribute(const zt_story* story, int object, int attribute)
+{
+    const zbyte_t* attributes;
+
+    if (object < 1 || (unsigned int)object > story->objects.count ||
+        attribute < 0 || attribute >= story->objects.attribute_bytes * 8)
+        return (0);
+    attributes = story->objects.attributes +
+                 (object - 1) * story->objects.attribute_bytes;
+
+    return ((attributes[attribute / 8] >> (7 - attribute % 8)) & 1);
+
+} /* zt_object_attribute */
+
+int zt_word_count(const zt_story* story)
+{
+
+    return (story->word_count);
+
+} /* zt_word_count */
+
+const char* zt_word(const zt_story* story, int word)
+{
+
+    if (word < 0 || word >= story->word_count) return (NULL);
+
+    return (story->pool.text + story->words[word * 2]);
+
+} /* zt_word */
+
+const char* zt_word_types(const zt_story* story, int word)
+{
+
+    if (word < 0 || word >= story->word_count) return (NULL);
+
+    return (story->pool.text + story->words[word * 2 + 1]);
+
+} /* zt_word_types */
+
+int zt_lookup(const zt_story* story, const char* text)
+{
+    char buffer[64];
+    zt_entry_t key;
+    const zt_entry_t* found;
+    int i, n;
+
+    /* Characters, not bytes, count towards the resolution */
+
+    for (i = 0, n = 0; text[i] && i < (int)sizeof(buffer) - 1; i++) {
+        if (((unsigned char)text[i] & 0xc0) != 0x80 && n++ == story->resolution)
+            break;
+        buffer[i] = (char)(((unsigned char)text[i] < 0x80)
+                               ? tolower((unsigned char)text[i])
+                               : text[i]);
+    }
+    buffer[i] = '\0';
+
+    key.text = buffer;
+    found = (const zt_entry_t*)bsearch(&key, story->sorted,
+                                       (size_t)story->word_count,
+                                       sizeof(zt_entry_t), compare_entries);
+
+    return ((found) ? found->word : -1);
+
+} /* zt_lookup */
+
+int zt_grammar_count(const zt_story* story)
+{
+
+    return (story->grammar_count);
+
+} /* zt_grammar_count */
+
+const char* zt_grammar_line(const zt_story* story, int line)
+{
+
+    if (line < 0 || line >= story->grammar_count) return (NULL);
+
+    return (story->pool.text + story->grammar[line]);
+
+} /* zt_grammar_line */
@@ -0,0 +1,81 @@
+/*
+ * ztlib.h
+ *
+ * The C API of libztools, the story decoders of infodump and txd built as a
+ * shared library, so that a host can ask about a Z-machine story in its own
+ * process (with ctypes or cffi) instead of running infodump for each
+ * question:
+ *
+ *     zt_story* story = zt_open("zork.z3");
+ *     for (i = 1; i <= zt_object_count(story); i++)
+ *         puts(zt_object_name(story, i));
+ *     zt_close(story);
+ *
+ * zt_open() reads and decodes the story once, with the routines of txio.c,
+ * showobj.c, showdict.c and showverb.c, and the queries answer from the
+ * tables it keeps. A story is its own object: any number can be open at
+ * once and queried from any thread. Opening is serialised, the tools keep
+ * the story they are decoding in globals.
+ *
+ * Strings are UTF-8 and stay valid until the story is closed.
+ */
+
+#ifndef ZTLIB_H
+#define ZTLIB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct zt_story_s zt_story;
+
+/* Read and decode a story file, which may be a bundle (see
+   tools/bundle/bundle.h). NULL if it can't be read or is not a V1 to V8
+   story. A file that passes for one but is corrupt past its header can
+   still end the process, as it ends the tools. */
+zt_story* zt_open(const char* path);
+
+/* Free everything the story holds */
+void zt_close(zt_story* story);
+
+/* From the header: the version (1 to 8), the release number and the
+   six character serial number */
+int zt_version(const zt_story* story);
+int zt_release(const zt_story* story);
+const char* zt_serial(const zt_story* story);
+
+/* The objects are numbered from 1 to zt_object_count(). An object's
+   short name, "" if it has none or NULL if there is no such object. */
+int zt_object_count(const zt_story* story);
+const char* zt_object_name(const zt_story* story, int object);
+
+/* The object tree, 0 for none */
+int zt_object_parent(const zt_story* story, int object);
+int zt_object_sibling(const zt_story* story, int object);
+int zt_object_child(const zt_story* story, int object);
+
+/* 1 if the object has the attribute (0 to 31, or 47 from V4), else 0 */
+int zt_object_attribute(const zt_story* story, int object, int attribute);
+
+/* The dictionary words, numbered from 0 in dictionary order. A word's
+   types are the names infodump -v gives them, separated by commas, e.g.
+   "noun,adj". Both are NULL past the last word. */
+int zt_word_count(const zt_story* story);
+const char* zt_word(const zt_story* story, int word);
+const char* zt_word_types(const zt_story* story, int word);
+
+/* The number of the word the parser would take text for, or -1 if the
+   dictionary does not have it. Case is ignored, and text is cut to the
+   length the story's dictionary keeps (6 characters, 9 from V4). */
+int zt_lookup(const zt_story* story, const char* text);
+
+/* The sentences the grammar takes, one per entry as infodump -g shows
+   them, e.g. "put OBJ in OBJ". NULL past the last line. */
+int zt_grammar_count(const zt_story* story);
+const char* zt_grammar_line(const zt_story* story, int line);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZTLIB_H */